@@ -71,8 +71,47 @@ struct __QEQuery {
    /* Client-defined data passed to all callbacks.
     */
     void *                     userData;
+
+   /* The compiled form of queryRoot that evaluation actually runs; built on
+    * first evaluation and thrown away whenever the query or its callbacks
+    * change. See _QEQueryCompile().
+    */
+    struct __QEQueryPlanNode * plan;
 };
 
+/* What gets stored in evaluationCallbacks for each predicate.
+ */
+typedef struct {
+    QEQueryEvaluationCallback  callback;
+    QEQueryEvaluationFlags     flags;
+    uint32_t                   cost;
+} _QEQueryEvaluationEntry;
+
+/*******************************************************************************
+* A compiled query is a flat, preorder array of nodes: each group is followed
+* by its operands, and 'next' is the index just past a node's subtree, so the
+* evaluator can skip the rest of a group once it's decided. Callbacks are
+* looked up once, at compile time.
+*******************************************************************************/
+typedef enum {
+    kQEQueryPlanNodeCallback = 0,
+    kQEQueryPlanNodeAnd,
+    kQEQueryPlanNodeOr
+} _QEQueryPlanNodeType;
+
+typedef struct __QEQueryPlanNode {
+    _QEQueryPlanNodeType       type;
+    Boolean                    negated;
+    CFDictionaryRef            element;   // not retained; owned by queryRoot
+    QEQueryEvaluationCallback  callback;  // NULL for groups, or if none set
+    QEQueryEvaluationFlags     flags;
+    CFIndex                    next;
+} _QEQueryPlanNode;
+
+/* Cost hint for predicates that don't set one.
+ */
+#define kQEQueryDefaultCost  (100)
+
 /*******************************************************************************
 * Internal query element keys for the basic operators and such.
 ********************************************************************************
@@ -122,13 +161,16 @@ CF_RETURNS_RETAINED CFStringRef _QEPredicateForString(
 QEQueryParseCallback _QEQueryParseCallbackForPredicate(
     QEQueryRef query,
     CFStringRef predicate);
-QEQueryEvaluationCallback _QEQueryEvaluationCallbackForPredicate(
+const _QEQueryEvaluationEntry * _QEQueryEvaluationEntryForPredicate(
     QEQueryRef query,
     CFStringRef predicate);
 
 Boolean _QEQueryElementIsNegated(CFDictionaryRef element);
 void _QEQueryElementNegate(CFMutableDictionaryRef element);
 
+void _QEQueryDiscardPlan(QEQueryRef query);
+Boolean _QEQueryCompile(QEQueryRef query);
+
 #pragma mark Creation/Setup/Destruction
 
 /*******************************************************************************
@@ -219,6 +261,7 @@ QEQueryFree(QEQueryRef query)
     if (query->parseCallbacks) CFRelease(query->parseCallbacks);
     if (query->evaluationCallbacks) CFRelease(query->evaluationCallbacks);
     if (query->synonyms)       CFRelease(query->synonyms);
+    _QEQueryDiscardPlan(query);
     free(query);
     return;
 }
@@ -229,6 +272,7 @@ QEQueryFree(QEQueryRef query)
 void
 QEQueryEmptyParseDictionaries(QEQueryRef query)
 {
+    _QEQueryDiscardPlan(query);
     CFDictionaryRemoveAllValues(query->parseCallbacks);
     CFDictionaryRemoveAllValues(query->evaluationCallbacks);
     CFDictionaryRemoveAllValues(query->synonyms);
@@ -294,13 +338,21 @@ void
 QEQuerySetEvaluationCallbackForPredicate(
     QEQueryRef query,
     CFStringRef predicate,
-    QEQueryEvaluationCallback evaluationCallback)
+    QEQueryEvaluationCallback evaluationCallback,
+    QEQueryEvaluationFlags flags)
 {
     CFDataRef eCallback = NULL;
+    _QEQueryEvaluationEntry entry;
+
+    _QEQueryDiscardPlan(query);
 
     if (evaluationCallback) {
+        bzero(&entry, sizeof(entry));
+        entry.callback = evaluationCallback;
+        entry.flags = flags;
+        entry.cost = kQEQueryDefaultCost;
         eCallback = CFDataCreate(kCFAllocatorDefault,
-            (void *)&evaluationCallback, sizeof(QEQueryEvaluationCallback));
+            (void *)&entry, sizeof(entry));
         if (!eCallback) {
             goto finish;
         }
@@ -314,6 +366,39 @@ finish:
     return;
 }
 
+/*******************************************************************************
+*
+*******************************************************************************/
+void
+QEQuerySetEvaluationCostForPredicate(
+    QEQueryRef query,
+    CFStringRef predicate,
+    uint32_t cost)
+{
+    const _QEQueryEvaluationEntry * oldEntry = NULL;
+    _QEQueryEvaluationEntry entry;
+    CFDataRef eCallback = NULL;
+
+    _QEQueryDiscardPlan(query);
+
+    oldEntry = _QEQueryEvaluationEntryForPredicate(query, predicate);
+    if (!oldEntry) {
+        goto finish;
+    }
+    entry = *oldEntry;
+    entry.cost = cost;
+    eCallback = CFDataCreate(kCFAllocatorDefault,
+        (void *)&entry, sizeof(entry));
+    if (!eCallback) {
+        goto finish;
+    }
+    CFDictionarySetValue(query->evaluationCallbacks, predicate, eCallback);
+
+finish:
+    if (eCallback) CFRelease(eCallback);
+    return;
+}
+
 /*******************************************************************************
 *
 *******************************************************************************/
@@ -365,6 +450,7 @@ QEQuerySetShortCircuits(
     QEQueryRef query,
     Boolean flag)
 {
+    _QEQueryDiscardPlan(query);
     query->shortCircuitEval = flag;
 }
 
@@ -378,94 +464,270 @@ QEQueryGetShortCircuits(QEQueryRef query)
 }
 
 /*******************************************************************************
-*
+* _QEQueryElementCount() -- the number of plan nodes an element compiles to.
+*******************************************************************************/
+CFIndex
+_QEQueryElementCount(CFDictionaryRef element)
+{
+    CFIndex result = 1;
+    CFStringRef predicate = CFDictionaryGetValue(element, kQEQueryKeyPredicate);
+    CFArrayRef elements = NULL;
+    CFIndex count, i;
+
+    if (CFEqual(predicate, kQEQueryPredicateAnd) ||
+        CFEqual(predicate, kQEQueryPredicateOr)) {
+
+        elements = QEQueryElementGetArguments(element);
+        count = CFArrayGetCount(elements);
+        for (i = 0; i < count; i++) {
+            result += _QEQueryElementCount(CFArrayGetValueAtIndex(elements, i));
+        }
+    }
+    return result;
+}
+
+/*******************************************************************************
+* _QEQueryElementCost() -- the summed cost hints of an element's predicates.
+* *reorderable is cleared if any of them might have side effects, in which
+* case the element must be evaluated in the position the user gave it.
+*******************************************************************************/
+uint32_t
+_QEQueryElementCost(
+    QEQueryRef query,
+    CFDictionaryRef element,
+    Boolean * reorderable)
+{
+    uint32_t result = 0;
+    CFStringRef predicate = CFDictionaryGetValue(element, kQEQueryKeyPredicate);
+    CFArrayRef elements = NULL;
+    CFIndex count, i;
+
+    if (CFEqual(predicate, kQEQueryPredicateAnd) ||
+        CFEqual(predicate, kQEQueryPredicateOr)) {
+
+        elements = QEQueryElementGetArguments(element);
+        count = CFArrayGetCount(elements);
+        for (i = 0; i < count; i++) {
+            result += _QEQueryElementCost(query,
+                CFArrayGetValueAtIndex(elements, i), reorderable);
+        }
+    } else {
+        const _QEQueryEvaluationEntry * entry =
+            _QEQueryEvaluationEntryForPredicate(query, predicate);
+
+        if (entry) {
+            result = entry->cost;
+            if (!(entry->flags & kQEQueryEvaluationNoSideEffects)) {
+                *reorderable = false;
+            }
+        } else {
+            result = kQEQueryDefaultCost;
+            *reorderable = false;
+        }
+    }
+    return result;
+}
+
+/*******************************************************************************
+* _QEQueryEmitPlan() -- compile element into query->plan starting at *index.
+* When short-circuiting, the operands of a group are stably sorted by cost if
+* none of them has side effects; AND and OR are commutative otherwise.
 *******************************************************************************/
 Boolean
-_QEQueryElementEvaluate(
+_QEQueryEmitPlan(
     QEQueryRef query,
     CFDictionaryRef element,
-    void * object)
+    CFIndex * index)
 {
     Boolean result = false;
-    CFStringRef predicate = NULL;
+    _QEQueryPlanNode * node = &query->plan[*index];
+    CFStringRef predicate = CFDictionaryGetValue(element, kQEQueryKeyPredicate);
     CFArrayRef elements = NULL;
-    CFIndex count, i;
+    CFIndex * order = NULL;   // must free
+    uint32_t * costs = NULL;  // must free
+    Boolean reorderable = true;
+    CFIndex count, i, j;
+
+    bzero(node, sizeof(*node));
+    node->element = element;
+    node->negated = _QEQueryElementIsNegated(element);
+    (*index)++;
+
+    if (!CFEqual(predicate, kQEQueryPredicateAnd) &&
+        !CFEqual(predicate, kQEQueryPredicateOr)) {
+
+        const _QEQueryEvaluationEntry * entry =
+            _QEQueryEvaluationEntryForPredicate(query, predicate);
+
+        node->type = kQEQueryPlanNodeCallback;
+        if (entry) {
+            node->callback = entry->callback;
+            node->flags = entry->flags;
+        }
+        node->next = *index;
+        result = true;
+        goto finish;
+    }
 
-    predicate = CFDictionaryGetValue(element, kQEQueryKeyPredicate);
+    node->type = CFEqual(predicate, kQEQueryPredicateAnd) ?
+        kQEQueryPlanNodeAnd : kQEQueryPlanNodeOr;
+
+    elements = QEQueryElementGetArguments(element);
+    count = CFArrayGetCount(elements);
+    if (count) {
+        order = (CFIndex *)malloc(count * sizeof(*order));
+        costs = (uint32_t *)malloc(count * sizeof(*costs));
+        if (!order || !costs) {
+            goto finish;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        order[i] = i;
+        costs[i] = _QEQueryElementCost(query,
+            CFArrayGetValueAtIndex(elements, i), &reorderable);
+    }
 
+   /* Insertion sort; groups are small and this keeps ties in user order.
+    */
+    if (reorderable && query->shortCircuitEval) {
+        for (i = 1; i < count; i++) {
+            CFIndex thisOrder = order[i];
+            uint32_t thisCost = costs[i];
+
+            for (j = i; j > 0 && costs[j - 1] > thisCost; j--) {
+                order[j] = order[j - 1];
+                costs[j] = costs[j - 1];
+            }
+            order[j] = thisOrder;
+            costs[j] = thisCost;
+        }
+    }
 
-    if (CFEqual(predicate, kQEQueryPredicateAnd)) {
-        elements = QEQueryElementGetArguments(element);
+    for (i = 0; i < count; i++) {
+        if (!_QEQueryEmitPlan(query,
+            CFArrayGetValueAtIndex(elements, order[i]), index)) {
 
-       /* Empty groups can't normally be created, except for the
-        * root query, but empty groups are trivially true; basically,
-        * an empty group is true.
-        */
-        count = CFArrayGetCount(elements);        if (!count) {
-            result = true;
+            goto finish;
         }
+    }
+
+    node->next = *index;
+    result = true;
+
+finish:
+    if (order) free(order);
+    if (costs) free(costs);
+    return result;
+}
+
+/*******************************************************************************
+* _QEQueryCompile() -- build query->plan from queryRoot if it isn't built.
+*******************************************************************************/
+Boolean
+_QEQueryCompile(QEQueryRef query)
+{
+    Boolean result = false;
+    CFIndex count;
+    CFIndex index = 0;
+
+    if (query->plan) {
+        result = true;
+        goto finish;
+    }
+
+    count = _QEQueryElementCount(query->queryRoot);
+    query->plan = (_QEQueryPlanNode *)calloc(count, sizeof(_QEQueryPlanNode));
+    if (!query->plan) {
+        query->lastError = kQEQueryErrorNoMemory;
+        goto finish;
+    }
+    if (!_QEQueryEmitPlan(query, query->queryRoot, &index)) {
+        query->lastError = kQEQueryErrorNoMemory;
+        _QEQueryDiscardPlan(query);
+        goto finish;
+    }
+    result = true;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+*
+*******************************************************************************/
+void
+_QEQueryDiscardPlan(QEQueryRef query)
+{
+    if (query->plan) {
+        free(query->plan);
+        query->plan = NULL;
+    }
+    return;
+}
 
-       /* If any element in an AND group is false, stop evaluating the
+/*******************************************************************************
+* _QEQueryPlanEvaluate() -- evaluate the plan node at index and its subtree.
+*******************************************************************************/
+Boolean
+_QEQueryPlanEvaluate(
+    QEQueryRef query,
+    CFIndex index,
+    void * object,
+    QEQueryError * error)
+{
+    Boolean result = false;
+    const _QEQueryPlanNode * node = &query->plan[index];
+    CFIndex i;
+
+    if (node->type == kQEQueryPlanNodeAnd) {
+
+       /* Empty groups can't normally be created, except for the
+        * root query, but empty groups are trivially true.
+        *
+        * If any element in an AND group is false, stop evaluating the
         * group and return false, else return true.
         */
-        for (i = 0; i < count; i++) {
-            CFDictionaryRef thisElement = CFArrayGetValueAtIndex(elements, i);
-            if (!_QEQueryElementEvaluate(query, thisElement, object)) {
+        for (i = index + 1; i < node->next; i = query->plan[i].next) {
+            if (!_QEQueryPlanEvaluate(query, i, object, error)) {
                 if (query->shortCircuitEval) {
                     goto finish;
                 }
             }
         }
         result = true;
-    } else if (CFEqual(predicate, kQEQueryPredicateOr)) {
-        elements = QEQueryElementGetArguments(element);
+    } else if (node->type == kQEQueryPlanNodeOr) {
 
-       /* Empty groups can't normally be created, except for the
-        * root query, but empty groups are trivially true; basically,
-        * an empty group is true.
+       /* An empty group is true. If any element in an OR group is true,
+        * stop evaluating the group and return true, else return false.
         */
-        count = CFArrayGetCount(elements);
-        if (!count) {
+        if (node->next == index + 1) {
             result = true;
         }
-
-       /* If any element in an OR group is true, stop evaluating the
-        * group and return true, else return false.
-        */
-        for (i = 0; i < count; i++) {
-            CFDictionaryRef thisElement = CFArrayGetValueAtIndex(elements, i);
-            if (_QEQueryElementEvaluate(query, thisElement, object)) {
+        for (i = index + 1; i < node->next; i = query->plan[i].next) {
+            if (_QEQueryPlanEvaluate(query, i, object, error)) {
                 result = true;
                 if (query->shortCircuitEval) {
                     goto finish;
                 }
             }
         }
+    } else if (node->callback) {
+        result = node->callback(node->element, object, query->userData, error);
     } else {
-
-       /* Look for a client callback.
-        */
-        QEQueryEvaluationCallback evalCallback =
-            _QEQueryEvaluationCallbackForPredicate(query, predicate);
-        if (evalCallback) {
-            result = evalCallback(element, object, query->userData,
-                &query->lastError);
-        } else {
-            query->lastError = kQEQueryErrorNoEvaluationCallback;
-        }        
+        *error = kQEQueryErrorNoEvaluationCallback;
     }
 
 finish:
 
    /* Flip the result if the element is negated.
      */
-    if (_QEQueryElementIsNegated(element)) {
+    if (node->negated) {
         result = !result;
     }
 
    /* Set the result to false upon any error.
     */
-    if (query->lastError != kQEQueryErrorNone) {
+    if (*error != kQEQueryErrorNone) {
         result = false;
     }
     return result;
@@ -483,7 +745,10 @@ QEQueryEvaluate(
     if (!QEQueryIsComplete(query) || query->lastError != kQEQueryErrorNone) {
         goto finish;
     }
-    result = _QEQueryElementEvaluate(query, query->queryRoot, object);
+    if (!_QEQueryCompile(query)) {
+        goto finish;
+    }
+    result = _QEQueryPlanEvaluate(query, 0, object, &query->lastError);
 finish:
     return result;
 }
@@ -674,6 +939,8 @@ QEQueryAppendElement(
     Boolean result = false;
     CFMutableArrayRef elements = NULL;
 
+    _QEQueryDiscardPlan(query);
+
    /* If there is no logic operator active, and the current group has
     * at least one item, treat this as being ANDed to the current group.
     */
@@ -703,6 +970,8 @@ QEQueryAppendAndOperator(QEQueryRef query)
 {
     Boolean result = false;
 
+    _QEQueryDiscardPlan(query);
+
     if (query->logicOpActive) {
         query->lastError = kQEQueryErrorSyntax;
         goto finish;
@@ -733,6 +1002,8 @@ QEQueryAppendOrOperator(QEQueryRef query)
 {
     Boolean result = false;
 
+    _QEQueryDiscardPlan(query);
+
     if (query->logicOpActive) {
         query->lastError = kQEQueryErrorSyntax;
         goto finish;
@@ -774,6 +1045,8 @@ _QEQueryStartGroup(
 {
     Boolean result = false;
 
+    _QEQueryDiscardPlan(query);
+
     if (!query->logicOpActive && _QEQueryStackTopIsOrGroup(query)) {
         if (!_QEQueryPushGroup(query, false /* negated */,
             true /* 'and' group */)) {
@@ -801,6 +1074,8 @@ QEQueryEndGroup(QEQueryRef query)
 {
     Boolean result = false;
 
+    _QEQueryDiscardPlan(query);
+
    /* A complete query has no open groups.
     */
     if (QEQueryIsComplete(query)) {
@@ -1400,23 +1675,19 @@ finish:
 /*******************************************************************************
 *
 *******************************************************************************/
-QEQueryEvaluationCallback
-_QEQueryEvaluationCallbackForPredicate(
+const _QEQueryEvaluationEntry *
+_QEQueryEvaluationEntryForPredicate(
     QEQueryRef query,
     CFStringRef predicate)
 {
-    QEQueryEvaluationCallback result = NULL;
+    const _QEQueryEvaluationEntry * result = NULL;
     CFDataRef callbackData = NULL;
-    const void * dataPtr = NULL;
-    QEQueryEvaluationCallback * callback = NULL;
 
     callbackData = CFDictionaryGetValue(query->evaluationCallbacks, predicate);
     if (!callbackData) {
         goto finish;
     }
-    dataPtr = CFDataGetBytePtr(callbackData);
-    callback = (QEQueryEvaluationCallback *)dataPtr;
-    result = *callback;
+    result = (const _QEQueryEvaluationEntry *)CFDataGetBytePtr(callbackData);
 finish:
     return result;
 }
@@ -152,6 +152,18 @@ typedef struct __QEQuery * QEQueryRef;
 * as well as just checking them against a query predicate. For example, you
 * could define a '-print' predicate that just prints data from the object
 * and returns true.
+*
+**********
+* Evaluation Order
+*
+* The first time a complete query is evaluated, it's compiled into a flat
+* plan with the evaluation callbacks already looked up; changing the query
+* or its callbacks discards the plan. When short-circuiting is on, the
+* operands of each AND or OR group are reordered so that the cheapest run
+* first, as given by QEQuerySetEvaluationCostForPredicate() (the cost of a
+* group is the sum of its members'). That's only done when every predicate
+* in the group was registered with kQEQueryEvaluationNoSideEffects, so
+* anything that prints or runs commands happens where the user put it.
 ********************************************************************************
 * TO DO:
 * XXX: Add functions that take CF strings?
@@ -198,6 +210,13 @@ typedef Boolean (*QEQueryEvaluationCallback)(
     void * user_data,
     QEQueryError * error);
 
+/* Flags for QEQuerySetEvaluationCallbackForPredicate().
+ */
+typedef enum {
+    kQEQueryEvaluationDefault    = 0,
+    kQEQueryEvaluationNoSideEffects = (1 << 0),  // may be reordered
+} QEQueryEvaluationFlags;
+
 /*******************************************************************************
 * Create and set up a query.
 *******************************************************************************/
@@ -230,7 +249,17 @@ void QEQuerySetParseCallbackForPredicate(
 void QEQuerySetEvaluationCallbackForPredicate(
     QEQueryRef query,
     CFStringRef predicate,
-    QEQueryEvaluationCallback evaluationCallback);
+    QEQueryEvaluationCallback evaluationCallback,
+    QEQueryEvaluationFlags flags);
+
+/* A relative cost hint for evaluating 'predicate', used to order operands
+ * (see Evaluation Order above). Predicates without one cost 100. Set the
+ * evaluation callback first; this has no effect on unregistered predicates.
+ */
+void QEQuerySetEvaluationCostForPredicate(
+    QEQueryRef query,
+    CFStringRef predicate,
+    uint32_t cost);
 
 /* Causes 'synonym' to be automatically replaced with 'predicate' during
  * parsing and upon creation of an element dictionary with
@@ -33,8 +33,10 @@
 #include <bootfiles.h>
 #include <IOKit/IOKitLib.h>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <notify.h>
 #include <paths.h>
 #include <mach/mach.h>
@@ -44,8 +46,10 @@
 #include <sys/sysctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
+#include <CommonCrypto/CommonDigest.h>
 #include <EFILogin/EFILogin.h>
 #include <System/libkern/mkext.h>
 #include <System/libkern/OSKextLibPrivate.h>
@@ -886,6 +890,213 @@ finish:
     return rval;
 }
 
+/*
+ * Parsed bootcaches.plist data is kept per volume so that kextd, which
+ * reads a volume's struct bootCaches over and over, doesn't re-parse a
+ * file that hasn't changed.  Entries are keyed by the volume UUID (as used
+ * for bootstamps) and validated against the plist's device, inode, size,
+ * and mtime.  Only what extractProps() produces is cached; everything
+ * readBootCaches() learns from the live volume is still looked up.
+ */
+#define kMaxParsedBootCaches    8
+
+struct parsedBootCaches {
+    struct parsedBootCaches *next;
+    uuid_string_t fsys_uuid;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct bootCaches *props;   // extractProps() output; no cachefd
+};
+
+static struct parsedBootCaches *sParsedBootCaches = NULL;
+static pthread_mutex_t sParsedBootCachesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+dupBytes(const void *src, size_t size)
+{
+    void *rval = NULL;
+
+    if (src && size && (rval = malloc(size))) {
+        memcpy(rval, src, size);
+    }
+    return rval;
+}
+
+#define REBASE_CACHEDPATH(dst, src, field, array) do { \
+    if ((src)->field)   \
+        (dst)->field = (dst)->array + ((src)->field - (src)->array); \
+} while (0)
+
+// copy extractProps()'s results from src; dst keeps its own volume info
+static int
+copyExtractedProps(struct bootCaches *dst, const struct bootCaches *src)
+{
+    int rval = ENOMEM;
+    struct bootCaches volInfo = *dst;
+    size_t extsSize = 0;
+    const char *ext;
+    int i;
+
+    *dst = *src;
+    dst->cachefd = volInfo.cachefd;
+    memcpy(dst->bsdname, volInfo.bsdname, sizeof(dst->bsdname));
+    memcpy(dst->fsys_uuid, volInfo.fsys_uuid, sizeof(dst->fsys_uuid));
+    memcpy(dst->defLabel, volInfo.defLabel, sizeof(dst->defLabel));
+    memcpy(dst->root, volInfo.root, sizeof(dst->root));
+    dst->csfde_uuid = volInfo.csfde_uuid;
+    dst->bcTime = volInfo.bcTime;
+
+    // nothing below belongs to dst until it has been copied
+    dst->cacheinfo = NULL;
+    dst->rpspaths = dst->miscpaths = NULL;
+    dst->exts = NULL;
+#if DEV_KERNEL_SUPPORT
+    dst->extraKernelCachePaths = NULL;
+    dst->nekcp = 0;
+    dst->kernelsCount = 0;
+#endif
+
+    for (ext = src->exts, i = 0; ext && i < src->nexts; i++) {
+        extsSize += strlen(ext) + 1;
+        ext += strlen(ext) + 1;
+    }
+    if (src->nrps &&
+        !(dst->rpspaths = dupBytes(src->rpspaths,
+                                   src->nrps * sizeof(*src->rpspaths)))) {
+        goto finish;
+    }
+    if (src->nmisc &&
+        !(dst->miscpaths = dupBytes(src->miscpaths,
+                                    src->nmisc * sizeof(*src->miscpaths)))) {
+        goto finish;
+    }
+    if (extsSize && !(dst->exts = dupBytes(src->exts, extsSize))) {
+        goto finish;
+    }
+    if (src->cacheinfo) {
+        dst->cacheinfo = CFRetain(src->cacheinfo);
+    }
+
+    REBASE_CACHEDPATH(dst, src, kext_boot_cache_file, rpspaths);
+    REBASE_CACHEDPATH(dst, src, bootconfig, rpspaths);
+    REBASE_CACHEDPATH(dst, src, efidefrsrcs, rpspaths);
+    REBASE_CACHEDPATH(dst, src, efiloccache, rpspaths);
+    REBASE_CACHEDPATH(dst, src, erpropcache, rpspaths);
+    REBASE_CACHEDPATH(dst, src, label, miscpaths);
+
+#if DEV_KERNEL_SUPPORT
+    // /System/Library/Kernels can change without bootcaches.plist changing
+    if (dst->kernelpath[0] && dst->root[0]) {
+        getExtraKernelCachePaths(dst);
+    }
+#endif
+
+    rval = 0;
+
+finish:
+    if (rval) {
+        if (dst->cacheinfo)     CFRelease(dst->cacheinfo);
+        if (dst->rpspaths)      free(dst->rpspaths);
+        if (dst->miscpaths)     free(dst->miscpaths);
+        if (dst->exts)          free(dst->exts);
+        *dst = volInfo;
+    }
+    return rval;
+}
+
+// the cached props for this fsys_uuid if the plist is unchanged (lock held)
+static struct parsedBootCaches **
+findParsedBootCaches(const char *fsys_uuid, struct stat *sb, Boolean *valid)
+{
+    struct parsedBootCaches **pbc;
+
+    *valid = false;
+    for (pbc = &sParsedBootCaches; *pbc; pbc = &(*pbc)->next) {
+        if (strcmp((*pbc)->fsys_uuid, fsys_uuid) == 0 &&
+                (*pbc)->dev == sb->st_dev) {
+            *valid = ((*pbc)->ino == sb->st_ino &&
+                      (*pbc)->size == sb->st_size &&
+                      (*pbc)->mtime.tv_sec == sb->st_mtimespec.tv_sec &&
+                      (*pbc)->mtime.tv_nsec == sb->st_mtimespec.tv_nsec);
+            break;
+        }
+    }
+    return pbc;
+}
+
+static Boolean
+readParsedBootCaches(struct bootCaches *caches, struct stat *sb)
+{
+    Boolean rval = false;
+    struct parsedBootCaches **pbc;
+    Boolean valid;
+
+    pthread_mutex_lock(&sParsedBootCachesLock);
+    pbc = findParsedBootCaches(caches->fsys_uuid, sb, &valid);
+    if (*pbc && valid) {
+        if (copyExtractedProps(caches, (*pbc)->props) == 0) {
+            rval = true;
+        } else {
+            OSKextLogMemError();
+        }
+    }
+    pthread_mutex_unlock(&sParsedBootCachesLock);
+
+    return rval;
+}
+
+static void
+saveParsedBootCaches(struct bootCaches *caches, struct stat *sb)
+{
+    struct parsedBootCaches **pbc, *entry = NULL;
+    struct bootCaches *props = NULL;
+    Boolean valid;
+    int count;
+
+    props = calloc(1, sizeof(*props));
+    if (!props)     goto finish;
+    props->cachefd = -1;
+    if (copyExtractedProps(props, caches))  goto finish;
+
+    pthread_mutex_lock(&sParsedBootCachesLock);
+    pbc = findParsedBootCaches(caches->fsys_uuid, sb, &valid);
+    if (*pbc) {
+        // replace the entry for this volume
+        entry = *pbc;
+        destroyCaches(entry->props);
+    } else if ((entry = calloc(1, sizeof(*entry)))) {
+        // newest first; forget the least recently added beyond the limit
+        entry->next = sParsedBootCaches;
+        sParsedBootCaches = entry;
+        for (count = 1, pbc = &entry->next; *pbc; count++) {
+            if (count >= kMaxParsedBootCaches) {
+                struct parsedBootCaches *old = *pbc;
+                *pbc = old->next;
+                destroyCaches(old->props);
+                free(old);
+            } else {
+                pbc = &(*pbc)->next;
+            }
+        }
+    }
+    if (entry) {
+        strlcpy(entry->fsys_uuid, caches->fsys_uuid, sizeof(entry->fsys_uuid));
+        entry->dev = sb->st_dev;
+        entry->ino = sb->st_ino;
+        entry->size = sb->st_size;
+        entry->mtime = sb->st_mtimespec;
+        entry->props = props;
+        props = NULL;
+    }
+    pthread_mutex_unlock(&sParsedBootCachesLock);
+
+finish:
+    if (props)      destroyCaches(props);
+    return;
+}
+
 /*
  * readBootCaches() reads a volumes bootcaches.plist file and returns
  * the contents in a new struct bootCaches.  Because it returns a pointer,
@@ -957,6 +1168,13 @@ readBootCaches(char *volRoot, BRUpdateOpts_t opts)
     }
 
 
+    // unchanged since we last parsed it?
+    if (readParsedBootCaches(caches, &sb)) {
+        errmsg = NULL;
+        rval = caches;
+        goto finish;
+    }
+
     // plist -> dictionary
     errmsg = "error reading " kBootCachesPath;
     bcDict = copy_dict_from_fd(caches->cachefd, &sb);
@@ -971,6 +1189,7 @@ readBootCaches(char *volRoot, BRUpdateOpts_t opts)
     if ((errnum = extractProps(caches, bcDict))) {
         errno = errnum; goto finish;
     }
+    saveParsedBootCaches(caches, &sb);
 
 
     // success!
@@ -1052,26 +1271,28 @@ finish:
 }
 
 /*******************************************************************************
-* needsUpdate checks a single path and timestamp; populates path->tstamp
+* needsUpdateAt checks a single path and timestamp; populates path->tstamp
 * compares/stores *ctime* of the source file vs. the *mtime* of the bootstamp.
 * returns false on error: if we can't tell, we probably can't update
+* Paths are looked up relative to descriptors for the volume root and its
+* bootstamps directory (-1 if missing), which needUpdates() opens once.
 *******************************************************************************/
-Boolean
-needsUpdate(char *root, cachedPath* cpath)
+static Boolean
+needsUpdateAt(int rootfd, int tsdirfd, const char *root, cachedPath* cpath)
 {
     Boolean outofdate = false;
     Boolean rfpresent, tsvalid;
     struct stat rsb, tsb;
-    char fullrp[PATH_MAX], fulltsp[PATH_MAX];
+    const char *relrp, *tsname;
+    int tserr;
 
-    // create full paths
-    pathcpy(fullrp, root);
-    pathcat(fullrp, cpath->rpath);
-    pathcpy(fulltsp, root);
-    pathcat(fulltsp, cpath->tspath);
+    // source files are relative to the root; bootstamps are all in tsdirfd
+    for (relrp = cpath->rpath; *relrp == '/'; relrp++)    ;
+    tsname = strrchr(cpath->tspath, '/');
+    tsname = tsname ? tsname + 1 : cpath->tspath;
     
     // check the source file in the root volume
-    if (stat(fullrp, &rsb) == 0) {
+    if (fstatat(rootfd, relrp[0] ? relrp : ".", &rsb, 0) == 0) {
         rfpresent = true;
     } else if (errno == ENOENT) {
         rfpresent = false;
@@ -1079,7 +1300,7 @@ needsUpdate(char *root, cachedPath* cpath)
         // non-ENOENT errars => fail with log message
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
-            "Cached file %s: %s.", fullrp, strerror(errno));
+            "Cached file %s%s: %s.", root, cpath->rpath, strerror(errno));
         goto finish;
     }
 
@@ -1096,19 +1317,23 @@ needsUpdate(char *root, cachedPath* cpath)
 
     // check on the timestamp file itself
     // it's invalid if it tracks a non-existant root file
-    if (stat(fulltsp, &tsb) == 0) {
+    tserr = ENOENT;
+    if (tsdirfd != -1) {
+        tserr = fstatat(tsdirfd, tsname, &tsb, 0) == 0 ? 0 : errno;
+    }
+    if (tserr == 0) {
         if (tsb.st_mtimespec.tv_sec != 0) {
             tsvalid = true;
         } else {
             tsvalid = false;
         }
-    } else if (errno == ENOENT) {
+    } else if (tserr == ENOENT) {
         tsvalid = false;
     } else {
         // non-ENOENT errors => fail w/log message
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
-            "timestamp cache %s: %s!", fulltsp, strerror(errno));
+            "timestamp cache %s%s: %s!", root, cpath->tspath, strerror(tserr));
         goto finish;
     }
 
@@ -1133,6 +1358,32 @@ finish:
     return outofdate;
 }
 
+// opens root and, if present, the bootstamps directory for needsUpdateAt()
+static int
+openUpdateDirs(const char *root, const char *fsys_uuid, int *tsdirfd)
+{
+    char tsdir[PATH_MAX];
+    int rootfd;
+
+    *tsdirfd = -1;
+    rootfd = open(root, O_RDONLY | O_DIRECTORY);
+    if (rootfd == -1) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+            "%s: %s.", root, strerror(errno));
+        goto finish;
+    }
+
+    // kTSCacheDir is absolute; look it up relative to the root
+    if (snprintf(tsdir, sizeof(tsdir), "%s/%s", &kTSCacheDir[1], fsys_uuid)
+            < (int)sizeof(tsdir)) {
+        *tsdirfd = openat(rootfd, tsdir, O_RDONLY | O_DIRECTORY);
+    }
+
+finish:
+    return rootfd;
+}
+
 /*******************************************************************************
 * needUpdates() checks all cached paths to see what looks out of date
 *
@@ -1142,7 +1393,7 @@ finish:
 * (kernel/kext, EFI Login locs, etc) should be checked and rebuilt prior
 * to calling this function.
 *
-* needsUpdate() also populates the timestamp structs for updateStamps().
+* needsUpdateAt() also populates the timestamp structs for updateStamps().
 *******************************************************************************/
 
 #define kBRTaintFile ".notBootRootDefault"
@@ -1174,6 +1425,7 @@ needUpdates(struct bootCaches *caches, BRUpdateOpts_t opts,
 {
     Boolean rpsOOD, bootersOOD, miscOOD, anyOOD;
     cachedPath *cp;
+    int rootfd, tsdirfd;
 
     // assume nothing needs updating (can't tell -> don't update)
     rpsOOD = bootersOOD = miscOOD = anyOOD = false;
@@ -1185,9 +1437,13 @@ needUpdates(struct bootCaches *caches, BRUpdateOpts_t opts,
         // not done yet, need to populate the tstamps!
     }
 
+    // one pass of fstatat()s relative to these instead of 2 path walks each
+    rootfd = openUpdateDirs(caches->root, caches->fsys_uuid, &tsdirfd);
+    if (rootfd == -1)   goto finish;
+
     // first check RPS paths
     for (cp = caches->rpspaths; cp < &caches->rpspaths[caches->nrps]; cp++) {
-        if (needsUpdate(caches->root, cp)) {
+        if (needsUpdateAt(rootfd, tsdirfd, caches->root, cp)) {
             OSKextLog(NULL, oodLogSpec, "%s " OODMSG, cp->rpath);
             anyOOD = rpsOOD = true;
         }
@@ -1197,7 +1453,7 @@ needUpdates(struct bootCaches *caches, BRUpdateOpts_t opts,
         for (cp = caches->extraKernelCachePaths;
              cp < &caches->extraKernelCachePaths[caches->nekcp];
              cp++) {
-            if (needsUpdate(caches->root, cp)) {
+            if (needsUpdateAt(rootfd, tsdirfd, caches->root, cp)) {
                 OSKextLog(NULL, oodLogSpec, "%s " OODMSG, cp->rpath);
                 anyOOD = rpsOOD = true;
             }
@@ -1207,13 +1463,13 @@ needUpdates(struct bootCaches *caches, BRUpdateOpts_t opts,
 
     // then booters
     if ((cp = &(caches->efibooter)), cp->rpath[0]) {
-        if (needsUpdate(caches->root, cp)) {
+        if (needsUpdateAt(rootfd, tsdirfd, caches->root, cp)) {
             OSKextLog(NULL, oodLogSpec, "%s " OODMSG, cp->rpath);
             anyOOD = bootersOOD = true;
         }
     }
     if ((cp = &(caches->ofbooter)), cp->rpath[0]) {
-        if (needsUpdate(caches->root, cp)) {
+        if (needsUpdateAt(rootfd, tsdirfd, caches->root, cp)) {
             OSKextLog(NULL, oodLogSpec, "%s " OODMSG, cp->rpath);
             anyOOD = bootersOOD = true;
        }
@@ -1222,12 +1478,16 @@ needUpdates(struct bootCaches *caches, BRUpdateOpts_t opts,
     // and finally misc paths (non-booter files read by EFI)
     // kextcache -U -Boot -> misc = NULL
     for (cp=caches->miscpaths; cp<&caches->miscpaths[caches->nmisc]; cp++){
-        if (needsUpdate(caches->root, cp)) {
+        if (needsUpdateAt(rootfd, tsdirfd, caches->root, cp)) {
             OSKextLog(NULL, oodLogSpec, "%s " OODMSG, cp->rpath);
             anyOOD = miscOOD = true;
         }
     }
 
+finish:
+    if (tsdirfd != -1)  close(tsdirfd);
+    if (rootfd != -1)   close(rootfd);
+
     if (rps)        *rps = rpsOOD;
     if (booters)    *booters = bootersOOD;
     if (misc)       *misc = miscOOD;
@@ -1291,6 +1551,115 @@ finish:
     return bsderr;
 }
 
+/* New stamps are all written to a fresh <uuid>.new directory, which then
+ * replaces <uuid>, so that a crash leaves either the old set, the new set,
+ * or (between the renames) none, which just looks out of date.  The files
+ * are created relative to the staging directory so only it goes through
+ * the safecalls checks, and the one F_FULLFSYNC at the end commits them
+ * along with the renames in journal order.
+ */
+#define kTSStagingExt   ".new"
+#define kTSRetiredExt   ".old"
+static int
+stageStamp(int stagefd, cachedPath *cpath)
+{
+    int bsderr = -1;
+    int fd;
+    const char *tsname;
+
+    tsname = strrchr(cpath->tspath, '/');
+    tsname = tsname ? tsname + 1 : cpath->tspath;
+
+    fd = openat(stagefd, tsname, O_CREAT | O_EXCL | O_NOFOLLOW | O_WRONLY,
+                kCacheFileMode);
+    if (fd == -1) {
+        OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "%s: %s", tsname, strerror(errno));
+        goto finish;
+    }
+    if ((bsderr = futimes(fd, cpath->tstamps))) {
+        OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "futimes(<%s>): %s", tsname, strerror(errno));
+    }
+    close(fd);
+
+finish:
+    return bsderr;
+}
+
+static int
+beginStampBatch(struct bootCaches *caches, char stagedir[PATH_MAX])
+{
+    int stagefd = -1;
+    struct stat sb;
+
+    pathcpy(stagedir, caches->root);
+    pathcat(stagedir, kTSCacheDir);
+    pathcat(stagedir, "/");
+    pathcat(stagedir, caches->fsys_uuid);
+    pathcat(stagedir, kTSStagingExt);
+
+    // leftovers from an interrupted batch
+    if (lstat(stagedir, &sb) == 0) {
+        (void)sdeepunlink(caches->cachefd, stagedir);
+    }
+    if (smkdir(caches->cachefd, stagedir, kCacheDirMode)) {
+        OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "%s: %s", stagedir, strerror(errno));
+        goto finish;
+    }
+    stagefd = sopen(caches->cachefd, stagedir, O_RDONLY, 0);
+
+finish:
+    return stagefd;
+}
+
+static int
+commitStampBatch(struct bootCaches *caches, const char *stagedir)
+{
+    int bsderr = -1;
+    char uuiddir[PATH_MAX], retired[PATH_MAX];
+    struct stat sb;
+
+    pathcpy(uuiddir, caches->root);
+    pathcat(uuiddir, kTSCacheDir);
+    pathcat(uuiddir, "/");
+    pathcat(uuiddir, caches->fsys_uuid);
+    pathcpy(retired, uuiddir);
+    pathcat(retired, kTSRetiredExt);
+
+    if (lstat(retired, &sb) == 0) {
+        (void)sdeepunlink(caches->cachefd, retired);
+    }
+    if (lstat(uuiddir, &sb) == 0 &&
+            (bsderr = srename(caches->cachefd, uuiddir, retired))) {
+        goto finish;
+    }
+    if ((bsderr = srename(caches->cachefd, stagedir, uuiddir))) {
+        goto finish;
+    }
+    if (lstat(retired, &sb) == 0) {
+        (void)sdeepunlink(caches->cachefd, retired);
+    }
+
+finish:
+    if (bsderr) {
+        OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "Can't install new bootstamps in %s: %s",
+                  uuiddir, strerror(errno));
+    }
+    return bsderr;
+}
+
+static int
+stampOne(struct bootCaches *caches, cachedPath *cp, int command, int stagefd)
+{
+    if (command == kBCStampsApplyTimes) {
+        return stageStamp(stagefd, cp);
+    }
+    return updateStamp(caches->root, cp, caches->cachefd, command);
+}
+
 #define BRDBG_DISABLE_EXTSYNC_F "/var/db/.BRDisableExtraSync"
 int
 updateStamps(struct bootCaches *caches, int command)
@@ -1299,6 +1668,8 @@ updateStamps(struct bootCaches *caches, int command)
     struct statfs sfs;
     cachedPath *cp;
     struct stat sb;
+    int stagefd = -1;
+    char stagedir[PATH_MAX];
 
     // don't try to apply bootstamps to a read-only volume
     if (statfs(caches->root, &sfs) == 0) {
@@ -1325,31 +1696,45 @@ updateStamps(struct bootCaches *caches, int command)
             (anyErr = ensureCacheDirs(caches))) {
         return anyErr;
     }
+    if (command == kBCStampsApplyTimes &&
+            (stagefd = beginStampBatch(caches, stagedir)) == -1) {
+        return ELAST + 1;
+    }
 
     // run through all of the cached paths apply bootstamp
     for (cp = caches->rpspaths; cp < &caches->rpspaths[caches->nrps]; cp++) {
-        anyErr |= updateStamp(caches->root, cp, caches->cachefd, command);
+        anyErr |= stampOne(caches, cp, command, stagefd);
     }
 #if DEV_KERNEL_SUPPORT
     if (caches->extraKernelCachePaths) {
         for (cp = caches->extraKernelCachePaths;
              cp < &caches->extraKernelCachePaths[caches->nekcp];
              cp++) {
-            anyErr |= updateStamp(caches->root, cp, caches->cachefd, command);
+            anyErr |= stampOne(caches, cp, command, stagefd);
         }
     }
 #endif
     if ((cp = &(caches->efibooter)), cp->rpath[0]) {
-        anyErr |= updateStamp(caches->root, cp, caches->cachefd, command);
+        anyErr |= stampOne(caches, cp, command, stagefd);
     }
     if ((cp = &(caches->ofbooter)), cp->rpath[0]) {
-        anyErr |= updateStamp(caches->root, cp, caches->cachefd, command);
+        anyErr |= stampOne(caches, cp, command, stagefd);
     }
     for (cp = caches->miscpaths; cp < &caches->miscpaths[caches->nmisc]; cp++){
-        anyErr |= updateStamp(caches->root, cp, caches->cachefd, command);
+        anyErr |= stampOne(caches, cp, command, stagefd);
+    }
+
+    // swap in the new set only if all of it was written
+    if (stagefd != -1) {
+        close(stagefd);
+        if (anyErr == 0) {
+            anyErr |= commitStampBatch(caches, stagedir);
+        } else {
+            (void)sdeepunlink(caches->cachefd, stagedir);
+        }
     }
 
-    // make sure stamps updates are on disk
+    // make sure stamps updates (and the swap) are on disk
     if (stat(BRDBG_DISABLE_EXTSYNC_F, &sb) == -1) {
         anyErr |= fcntl(caches->cachefd, F_FULLFSYNC);
     }
@@ -1476,7 +1861,16 @@ finish:
 /*******************************************************************************
 * rebuild_kext_boot_cache_file fires off kextcache on the given volume
 * XX there is a bug here that can mask a stale mkext in the Apple_Boot (4764605)
+* (kextcache itself registers a builder so that wait:true doesn't exec again)
 *******************************************************************************/
+static BRKextBootCacheBuilder sKextBootCacheBuilder = NULL;
+
+void
+setKextBootCacheBuilder(BRKextBootCacheBuilder builder)
+{
+    sKextBootCacheBuilder = builder;
+}
+
 int
 rebuild_kext_boot_cache_file(
     struct bootCaches *caches,
@@ -1662,7 +2056,11 @@ rebuild_kext_boot_cache_file(
     * wait:true means the return value is <0 for fork/exec failures and
     * the exit status of the forked process (>=0) otherwise.
     */
-    pid = fork_program("/usr/sbin/kextcache", kcargs, wait);  // logs errors
+    if (wait && sKextBootCacheBuilder) {
+        pid = sKextBootCacheBuilder((int)argi, kcargs);     // exit status
+    } else {
+        pid = fork_program("/usr/sbin/kextcache", kcargs, wait);  // logs errors
+    }
 
 finish:
     if (rval) {
@@ -1739,7 +2137,7 @@ plistCachesNeedRebuild(const NXArchInfo * kernelArchInfo)
     }
 
     if (!_OSKextReadCache(systemExtensionsFolderURLs, cacheBasename,
-        kernelArchInfo, _kOSKextCacheFormatCFXML, /* parseXML? */ false,
+        kernelArchInfo, kKextPropertyValuesCacheFormat, /* parseXML? */ false,
         /* valuesOut*/ NULL)) {
         
         goto finish;
@@ -2379,12 +2777,44 @@ finish:
 
 /*****************************************************************************
 * rebuild_loccache() rebuilds the localized resources for EFI Login
+* Each resource is tagged with a digest of its data so that a rebuild only
+* rewrites the ones EFILogin actually changed; leftovers are pruned after.
 *****************************************************************************/
+#define kLocRsrcDigestXattr     "com.apple.kext_tools.rsrcdigest"
+
 struct writeRsrcCtx {
     struct bootCaches *caches;
     char *locCacheDir;
+    CFMutableSetRef written;        // file system names of current resources
+    unsigned nskipped;
     int *result;
 };
+
+// does fullp already hold data with this digest?
+static Boolean
+_resourceIsCurrent(int scopefd, const char *fullp, unsigned char *digest,
+                   ssize_t size)
+{
+    Boolean rval = false;
+    int fd = -1;
+    struct stat sb;
+    unsigned char tagged[CC_SHA256_DIGEST_LENGTH];
+
+    if (-1 == (fd = sopen(scopefd, fullp, O_RDONLY, 0)))      goto finish;
+    if (fstat(fd, &sb) || sb.st_size != size)               goto finish;
+    if (fgetxattr(fd, kLocRsrcDigestXattr, tagged, sizeof(tagged), 0, 0)
+            != sizeof(tagged)) {
+        goto finish;
+    }
+
+    rval = (memcmp(tagged, digest, sizeof(tagged)) == 0);
+
+finish:
+    if (fd != -1)   close(fd);
+
+    return rval;
+}
+
 void
 _writeResource(const void *value, void *ctxp)
 {
@@ -2397,8 +2827,10 @@ _writeResource(const void *value, void *ctxp)
     void *buf;
     ssize_t bufsz;
     CFStringRef nameStr;
+    CFStringRef fsName = NULL;      // must release
     int fflags, fd = -1;
     char fname[PATH_MAX], fullp[PATH_MAX];
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
 
 
     // extract data, filename & prepare for BSD syscalls
@@ -2419,7 +2851,22 @@ _writeResource(const void *value, void *ctxp)
     pathcat(fullp, "/");
     pathcat(fullp, fname);
 
+    // remember it so _pruneResources() leaves it alone
+    bsderr = ENOMEM;
+    if (!(fsName = CFStringCreateWithFileSystemRepresentation(nil, fname)))
+        goto finish;
+    CFSetAddValue(ctx->written, fsName);
+
+    // skip the write if the previous build produced the same bytes
+    CC_SHA256(buf, (CC_LONG)bufsz, digest);
+    if (_resourceIsCurrent(caches->cachefd, fullp, digest, bufsz)) {
+        ctx->nskipped++;
+        bsderr = 0;
+        goto finish;
+    }
+
     // open & write!
+    (void)sunlink(caches->cachefd, fullp);
     fflags = O_WRONLY | O_CREAT | O_TRUNC;   // sopen() adds EXCL/NOFOL
     if (-1 == (fd = sopen(caches->cachefd, fullp, fflags, kCacheFileMode))) {
         bsderr = -1;
@@ -2429,6 +2876,8 @@ _writeResource(const void *value, void *ctxp)
         bsderr = -1;
         goto finish;
     }
+    // an untagged resource is simply rewritten next time
+    (void)fsetxattr(fd, kLocRsrcDigestXattr, digest, sizeof(digest), 0, 0);
 
     // success
     bsderr = 0;
@@ -2438,11 +2887,43 @@ finish:
         *(ctx->result) = bsderr;
     }
 
+    SAFE_RELEASE(fsName);
     if (fd != -1)   close(fd);
 
     return;
 }
 
+// remove files EFILogin no longer generates (e.g. a dropped language)
+static void
+_pruneResources(struct bootCaches *caches, char locCacheDir[PATH_MAX],
+                CFSetRef keep)
+{
+    DIR *dir = NULL;
+    struct dirent *dp;
+    CFStringRef name;
+    char fullp[PATH_MAX];
+
+    if (!(dir = opendir(locCacheDir)))      goto finish;
+
+    while ((dp = readdir(dir))) {
+        if (dp->d_type != DT_REG)           continue;
+        if (!(name = CFStringCreateWithFileSystemRepresentation(nil,
+                                                            dp->d_name))) {
+            continue;
+        }
+        if (!CFSetContainsValue(keep, name) &&
+                strlcpy(fullp, locCacheDir, PATH_MAX) < PATH_MAX &&
+                strlcat(fullp, "/", PATH_MAX) < PATH_MAX &&
+                strlcat(fullp, dp->d_name, PATH_MAX) < PATH_MAX) {
+            (void)sunlink(caches->cachefd, fullp);
+        }
+        CFRelease(name);
+    }
+
+finish:
+    if (dir)        closedir(dir);
+}
+
 extern __attribute__ ((weak_import)) CFArrayRef
 EFILoginCopyInterfaceGraphics(CFArrayRef localizationsArray,
                               CFStringRef targetPartitionPath); // 18021143
@@ -2464,7 +2945,7 @@ _writeEFILoginResources(struct bootCaches *caches,
     CFArrayRef blobList = NULL;
 
     CFRange allEntries;
-    struct writeRsrcCtx applyCtx = { caches, locCacheDir, &result };
+    struct writeRsrcCtx applyCtx = { caches, locCacheDir, NULL, 0, &result };
     
     // can't operate without EFILogin.framework function
     // (XX as of Zin12A190, this function is not properly decorated ...)
@@ -2502,16 +2983,30 @@ _writeEFILoginResources(struct bootCaches *caches,
         goto finish;
     }
 
-    // write everything out
+    // no need to hang on to the preferences while the blobs are around
+    SAFE_RELEASE_NULL(gprefs);
+
+    // write out whatever changed
+    if (!(applyCtx.written = CFSetCreateMutable(nil, 0,
+                                                &kCFTypeSetCallBacks))) {
+        result = ENOMEM;
+        goto finish;
+    }
     result = 0;         // applier only modifies on error
     allEntries = CFRangeMake(0, CFArrayGetCount(blobList));
     CFArrayApplyFunction(blobList, allEntries, _writeResource, &applyCtx);
     if (result)     goto finish;
+    _pruneResources(caches, locCacheDir, applyCtx.written);
+
+    OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogFileAccessFlag,
+              "%s: %ld EFI Login resources, %u unchanged.", locCacheDir,
+              (long)allEntries.length, applyCtx.nskipped);
 
     // success!
     result = 0;
 
 finish:
+    SAFE_RELEASE(applyCtx.written);
     if (blobList)       CFRelease(blobList);
     if (volStr)         CFRelease(volStr);
     if (locsList)       CFRelease(locsList);
@@ -2539,14 +3034,17 @@ rebuild_loccache(struct bootCaches *caches)
         result = errnum; goto finish;   // error logged by function
     }
 
-    // empty out locCacheDir ...
+    // keep locCacheDir's contents; _writeEFILoginResources() only replaces
+    // resources that changed.  Anything but a directory gets nuked.
     /* This cache is an optional part of RPS, thus it is okay to
        destroy on failure (leaving it empty risks "right" timestamps). */
-    if (sdeepunlink(caches->cachefd, locCacheDir) == -1 && errno == EROFS) {
-        result = errno; LOGERRxlate(locCacheDir, NULL, result); goto finish;
-    }
-    if ((errnum = sdeepmkdir(caches->cachefd,locCacheDir,kCacheDirMode))) {
-        result = errnum; LOGERRxlate(locCacheDir, NULL, result); goto finish;
+    if (sdeepmkdir(caches->cachefd, locCacheDir, kCacheDirMode)) {
+        if (sdeepunlink(caches->cachefd, locCacheDir) == -1 && errno==EROFS) {
+            result = errno; LOGERRxlate(locCacheDir, NULL, result); goto finish;
+        }
+        if ((errnum = sdeepmkdir(caches->cachefd,locCacheDir,kCacheDirMode))) {
+            result = errnum; LOGERRxlate(locCacheDir, NULL, result); goto finish;
+        }
     }
 
     // actually write resources!
@@ -2829,17 +3327,22 @@ finish:
  * returns the result of fork/exec (negative on error; pid on success)
  * a (waited-for) helper exit status will also be returned (see fork_program.c)
  * - 'force' -> -f to ignore bootstamps (13784516 removed only use)
+ * - 'items' -> -rebuild-only with the kBRUItem* names (0 -> everything)
  *****************************************************************************/
 // kextcache -u helper sets up argv
-pid_t
-launch_rebuild_all(char * rootPath, Boolean force, Boolean wait)
+static pid_t
+launch_rebuild(char * rootPath, Boolean force, BRUpdateOpts_t items,
+               Boolean wait)
 {
     pid_t rval = -1;
     int argc, argi = 0; 
     char **kcargs = NULL;
+    char itemNames[64] = "";
     
-    //  argv[0] '-F'  '-u'  root          -f ?       NULL
-    argc =  1  +  1  +  1  +  1  + (force == true) +  1;
+    items &= kBRUItemsMask;
+
+    //  argv[0] '-F'  '-u'  root          -f ?       -rebuild-only ?    NULL
+    argc =  1  +  1  +  1  +  1  + (force == true) + 2*(items != 0) +  1;
     kcargs = malloc(argc * sizeof(char*));
     if (!kcargs)    goto finish;
 
@@ -2849,6 +3352,19 @@ launch_rebuild_all(char * rootPath, Boolean force, Boolean wait)
     if (force) {
         kcargs[argi++] = "-f";
     }
+    if (items) {
+        // itemNames is big enough for all of them
+        if (items & kBRUItemKernelCache)
+            strlcat(itemNames, "," kBRUItemNameKernelCache, sizeof(itemNames));
+        if (items & kBRUItemCSFDE)
+            strlcat(itemNames, "," kBRUItemNameCSFDE, sizeof(itemNames));
+        if (items & kBRUItemLocCache)
+            strlcat(itemNames, "," kBRUItemNameLocCache, sizeof(itemNames));
+        if (items & kBRUItemHelpers)
+            strlcat(itemNames, "," kBRUItemNameHelpers, sizeof(itemNames));
+        kcargs[argi++] = "-rebuild-only";
+        kcargs[argi++] = &itemNames[1];     // skip leading ','
+    }
     kcargs[argi++] = "-u";
     kcargs[argi++] = rootPath;
     // kextcache reads bc.plist so nothing more needed
@@ -2871,6 +3387,19 @@ finish:
     return rval;
 }
 
+pid_t
+launch_rebuild_all(char * rootPath, Boolean force, Boolean wait)
+{
+    return launch_rebuild(rootPath, force, 0, wait);
+}
+
+// kextd passes exactly what it found stale so nothing else gets rebuilt
+pid_t
+launch_rebuild_items(char * rootPath, BRUpdateOpts_t items, Boolean wait)
+{
+    return launch_rebuild(rootPath, false, items, wait);
+}
+
 /*******************************************************************************
 *******************************************************************************/
 struct nameAndUUID {
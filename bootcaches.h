@@ -202,6 +202,10 @@ Boolean check_kext_boot_cache_file(
     struct bootCaches * caches,
     const char * cache_path,
     const char * kernel_path);
+// kextcache can do a waited-for rebuild in its own process instead of
+// forking another kextcache; the builder gets the would-be argv.
+typedef int (*BRKextBootCacheBuilder)(int argc, char * const * argv);
+void setKextBootCacheBuilder(BRKextBootCacheBuilder builder);
 // build the mkext; waiting for the kextcache child if instructed
 int rebuild_kext_boot_cache_file(
     struct bootCaches *caches,
@@ -222,6 +226,8 @@ void _daDone(DADiskRef disk, DADissenterRef dissenter, void *ctx);
 int updateMount(mountpoint_t mount, uint32_t mntgoal);
 
 pid_t launch_rebuild_all(char * rootPath, Boolean force, Boolean wait);
+pid_t launch_rebuild_items(char * rootPath, BRUpdateOpts_t items,
+                           Boolean wait);
 
 #endif /* __BOOTCACHES_H__ */
 
@@ -319,6 +319,112 @@ OSStatus BRCopyBootFilesToDir(CFURLRef srcVol,
 OSStatus BREraseBootFiles(CFURLRef srcVolRoot, CFStringRef helperBSDName);
 
 
+/*!
+ *  @group      Asynchronous variants
+ *
+ *  @discussion
+ *      BRUpdateBootFilesAsync() and friends return at once and do the
+ *      work of their synchronous counterparts on a private serial queue
+ *      inside libBootRoot.  Because the library is not thread-safe (see
+ *      the warning above), operations on different targets are queued
+ *      behind one another rather than run side by side; callers can
+ *      nonetheless start any number of them without blocking.
+ *
+ *      Each helper partition goes through the same phases as the
+ *      synchronous calls: kBRPhaseUCopy writes new content under inactive
+ *      names, kBRPhaseActivate renames and blesses it into place, and
+ *      kBRPhaseNuke removes fallbacks (or, for erase, everything).
+ *      progress, if non-NULL, is called on queue as each phase begins;
+ *      helperBSDName is NULL for kBRPhaseCaches.  completion is always
+ *      called exactly once, on queue, with the result the synchronous
+ *      call would have returned.
+ *
+ *      BRCancelOperation() asks an operation to stop; it returns
+ *      ECANCELED to completion.  An operation that hasn't started yet
+ *      does nothing.  One that is running stops at the next phase
+ *      boundary: a helper that was mid-update is rolled back exactly as
+ *      on any other error, so nothing half-activated is left behind.
+ *      Once a helper is activating, it is finished before stopping.
+ *
+ *      The caller owns the returned reference and must call
+ *      BRReleaseOperation(), which may be done at any time (including
+ *      from completion).  NULL is returned if the operation couldn't be
+ *      queued, in which case neither block is called.
+ */
+typedef enum {
+    kBRPhaseCaches   = 0,   // checking/rebuilding caches on the source
+    kBRPhaseUCopy    = 1,   // copying to inactive names on a helper
+    kBRPhaseActivate = 2,   // activating copied files on a helper
+    kBRPhaseNuke     = 3    // removing fallbacks/erasing on a helper
+} BRPhase;
+
+typedef struct __BROperation * BROperationRef;
+
+#ifdef __BLOCKS__
+#include <dispatch/dispatch.h>
+
+typedef void (^BRProgressHandler)(BROperationRef op, BRPhase phase,
+                                  CFStringRef helperBSDName);
+typedef void (^BRCompletionHandler)(BROperationRef op, OSStatus result);
+
+BROperationRef BRUpdateBootFilesAsync(CFURLRef volRoot, Boolean force,
+                                      dispatch_queue_t queue,
+                                      BRProgressHandler progress,
+                                      BRCompletionHandler completion);
+BROperationRef BRCopyBootFilesAsync(CFURLRef srcVol,
+                                    CFURLRef initialRoot,
+                                    CFStringRef helperBSDName,
+                                    CFDictionaryRef bootPrefOverrides,
+                                    dispatch_queue_t queue,
+                                    BRProgressHandler progress,
+                                    BRCompletionHandler completion);
+BROperationRef BRCopyBootFilesToDirAsync(CFURLRef srcVol,
+                                         CFURLRef initialRoot,
+                                         CFDictionaryRef bootPrefOverrides,
+                                         CFStringRef targetBSDName,
+                                         CFURLRef targetDir,
+                                         BRBlessStyle blessSpec,
+                                         CFStringRef pickerLabel,
+                                         BRCopyFilesOpts opts,
+                                         dispatch_queue_t queue,
+                                         BRProgressHandler progress,
+                                         BRCompletionHandler completion);
+BROperationRef BREraseBootFilesAsync(CFURLRef srcVolRoot,
+                                     CFStringRef helperBSDName,
+                                     dispatch_queue_t queue,
+                                     BRProgressHandler progress,
+                                     BRCompletionHandler completion);
+#endif // __BLOCKS__
+
+void BRCancelOperation(BROperationRef op);
+void BRReleaseOperation(BROperationRef op);
+
+
+/*!
+ *  @group      Statistics
+ *
+ *  @discussion
+ *      libBootRoot counts the helper partition mounts and unmounts it
+ *      asks for, the DiskArbitration requests among them, and the time
+ *      spent mounting and unmounting, so that tools like brtest can measure
+ *      what a Boot!=Root update costs.  A mount satisfied by a helper still
+ *      held from an earlier operation is counted in heldReuses instead.
+ *      The counts are process-wide and, like the rest of the library, not
+ *      thread-safe: read and reset them while no operation is running.
+ */
+typedef struct {
+    uint64_t    mountUsecs;         // mounting helpers, reused or not
+    uint64_t    unmountUsecs;       // unmounting them
+    uint32_t    mounts;             // helper mounts requested
+    uint32_t    heldReuses;         // mounts that reused a held helper
+    uint32_t    unmounts;           // helper unmounts requested
+    uint32_t    diskArbRequests;    // DiskArb mount & unmount requests
+} BRStatistics;
+
+void BRGetStatistics(BRStatistics *stats);
+void BRResetStatistics(void);
+
+
 // ---- functions below not yet implemented ----
 
 /*!
@@ -52,10 +52,28 @@ typedef enum {
     // needUpdates() opt (default is all caches, default-bootable)
     kBRUCachesAnyRoot       = 1 << 6,   // non-default B!=R configs okay
 
+    // -rebuild-only: kextd names the items it found stale (default is all)
+    kBRUItemKernelCache     = 1 << 7,   // prelinked kernel / mkext
+    kBRUItemCSFDE           = 1 << 8,   // CSFDE property cache
+    kBRUItemLocCache        = 1 << 9,   // EFI Login localized resources
+    kBRUItemHelpers         = 1 << 10,  // helper partition files
+
     // copy files opts
     // kBRAnyBootStamps = 0x10000 (1<<16) // in bootroot.h
 } BRUpdateOpts_t;
 
+#define kBRUItemsMask   (kBRUItemKernelCache | kBRUItemCSFDE | \
+                         kBRUItemLocCache | kBRUItemHelpers)
+// no -rebuild-only means every item is fair game
+#define BRU_WANTS_ITEM(opts, item)  \
+    (((opts) & kBRUItemsMask) == 0 || ((opts) & (item)))
+
+// -rebuild-only item names (comma-separated on the command line)
+#define kBRUItemNameKernelCache "kernelcache"
+#define kBRUItemNameCSFDE       "csfde"
+#define kBRUItemNameLocCache    "loccache"
+#define kBRUItemNameHelpers     "helpers"
+
 // in update_boot.c
 
 /*
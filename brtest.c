@@ -15,9 +15,13 @@
 #include <paths.h>
 #include <stdio.h>
 #include <strings.h>
+#include <stdlib.h>
 #include <sys/param.h>      // MIN()
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 #include <CoreFoundation/CoreFoundation.h>
 
@@ -37,6 +41,12 @@ void usage(int exval)
             "               -pickerLabel <label> - specific text for opt-boot\n" 
             "       brtest copyfiles <src> <root> /<dmg> <tgt>[/<dir>] [<BS>]\n"
             "              (/<dmg> is relative to <root>)\n"
+            "       brtest stress <vol> [-n <cycles>] [-j <callers>] "
+                                                "[-ops <op>[,<op>...]]\n"
+            "           Each cycle erases, copies to, and updates (-f) every\n"
+            "           helper of <vol> (or just the -ops erase, copy, update).\n"
+            "           -j runs that many callers at once, as processes.\n"
+            "           <vol> should be on a disk image: its helpers are erased!\n"
 
         //  hopefully disable will be implicit when "stealing" an Apple_Boot
         //  "       brtest disableHelperUpdates <[src]Vol> [<tgtVol>]\n"
@@ -319,6 +329,260 @@ finish:
     return result;
 }
 
+/******************************************************************************
+ * stress: time repeated libBootRoot operations on <vol>'s helpers
+ * Prints one line of key=value pairs per operation, like BENCHME.  Phase
+ * times come from the BR*Async() progress calls (mounting falls in whatever
+ * phase precedes it); mount, unmount, and DiskArb counts from BRStatistics.
+ *****************************************************************************/
+#define kStressOpErase      (1 << 0)
+#define kStressOpCopy       (1 << 1)
+#define kStressOpUpdate     (1 << 2)
+#define kStressOpsAll       (kStressOpErase | kStressOpCopy | kStressOpUpdate)
+
+static const char *sPhaseNames[] = { "caches", "ucopy", "activate", "nuke" };
+#define kNumPhases  (sizeof(sPhaseNames) / sizeof(sPhaseNames[0]))
+
+struct stressTimes {
+    uint64_t    phaseUsecs[kNumPhases];
+    uint64_t    lastStamp;
+    int         lastPhase;          // -1 before the first progress call
+    OSStatus    result;
+};
+
+static uint64_t
+usecsNow(void)
+{
+    struct timeval tv;
+
+    (void)gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// runs one operation to completion and prints its line; returns its result
+static OSStatus
+stressOne(int caller, int cycle, int op, CFURLRef volURL, CFStringRef helper,
+          dispatch_queue_t queue)
+{
+    __block struct stressTimes times;
+    dispatch_semaphore_t done = NULL;
+    BROperationRef brop = NULL;
+    BRProgressHandler progress;
+    BRCompletionHandler completion;
+    BRStatistics stats;
+    uint64_t started, total;
+    char helperName[DEVMAXPATHSIZE] = "-";
+    const char *opName;
+    unsigned i;
+
+    bzero(&times, sizeof(times));
+    times.lastPhase = -1;
+    times.result = ELAST + 1;
+    if (helper) {
+        (void)CFStringGetFileSystemRepresentation(helper, helperName,
+                                                  sizeof(helperName));
+    }
+    if (!(done = dispatch_semaphore_create(0)))     goto finish;
+
+    progress = ^(BROperationRef o __unused, BRPhase phase,
+                                   CFStringRef h __unused) {
+        uint64_t now = usecsNow();
+
+        if (times.lastPhase >= 0) {
+            times.phaseUsecs[times.lastPhase] += now - times.lastStamp;
+        }
+        times.lastPhase = (phase < kNumPhases) ? (int)phase : -1;
+        times.lastStamp = now;
+    };
+    completion = ^(BROperationRef o __unused,
+                                       OSStatus result) {
+        if (times.lastPhase >= 0) {
+            times.phaseUsecs[times.lastPhase] += usecsNow() - times.lastStamp;
+        }
+        times.result = result;
+        dispatch_semaphore_signal(done);
+    };
+
+    BRResetStatistics();
+    started = usecsNow();
+    switch (op) {
+    case kStressOpErase:
+        opName = "erase";
+        brop = BREraseBootFilesAsync(volURL, helper, queue, progress,
+                                     completion);
+        break;
+    case kStressOpCopy:
+        opName = "copy";
+        brop = BRCopyBootFilesAsync(volURL, NULL, helper, NULL, queue,
+                                    progress, completion);
+        break;
+    default:
+        opName = "update";
+        brop = BRUpdateBootFilesAsync(volURL, true, queue, progress,
+                                      completion);
+        break;
+    }
+    if (!brop)      goto finish;
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    total = usecsNow() - started;
+    BRGetStatistics(&stats);
+
+    printf("caller=%d cycle=%d op=%s helper=%s status=%d total_us=%llu",
+           caller, cycle, opName, helperName, (int)times.result,
+           (unsigned long long)total);
+    for (i = 0; i < kNumPhases; i++) {
+        printf(" %s_us=%llu", sPhaseNames[i],
+               (unsigned long long)times.phaseUsecs[i]);
+    }
+    printf(" mount_us=%llu unmount_us=%llu mounts=%u held_reuses=%u"
+           " unmounts=%u da_requests=%u\n",
+           (unsigned long long)stats.mountUsecs,
+           (unsigned long long)stats.unmountUsecs, stats.mounts,
+           stats.heldReuses, stats.unmounts, stats.diskArbRequests);
+    fflush(stdout);
+
+finish:
+    if (brop)       BRReleaseOperation(brop);
+    if (done)       dispatch_release(done);
+
+    return times.result;
+}
+
+// one caller's cycles; runs in its own process (CF doesn't survive fork())
+static int
+stressCaller(int caller, char *volpath, int cycles, int ops)
+{
+    int result = EX_OSERR;
+    int cycle, failures = 0, nops = 0;
+    CFURLRef volURL = NULL;
+    CFArrayRef helpers = NULL;
+    dispatch_queue_t queue = NULL;
+    CFIndex i, nhelpers;
+    uint64_t started = usecsNow(), wall;
+
+    volURL = CFURLCreateFromFileSystemRepresentation(nil, (UInt8*)volpath,
+                                                     strlen(volpath), true);
+    if (!volURL)        goto finish;
+    helpers = BRCopyActiveBootPartitions(volURL);
+    if (!helpers || (nhelpers = CFArrayGetCount(helpers)) == 0) {
+        fprintf(stderr, "%s: no helper partitions\n", volpath);
+        result = EX_USAGE;
+        goto finish;
+    }
+    if (!(queue = dispatch_queue_create("brtest.stress", NULL)))  goto finish;
+
+    for (cycle = 1; cycle <= cycles; cycle++) {
+        int op;
+
+        for (op = kStressOpErase; op <= kStressOpUpdate; op <<= 1) {
+            if (!(ops & op))        continue;
+
+            if (op == kStressOpUpdate) {
+                nops++;
+                failures += !!stressOne(caller, cycle, op, volURL, NULL,
+                                        queue);
+                continue;
+            }
+            for (i = 0; i < nhelpers; i++) {
+                nops++;
+                failures += !!stressOne(caller, cycle, op, volURL,
+                                    CFArrayGetValueAtIndex(helpers, i), queue);
+            }
+        }
+    }
+
+    wall = usecsNow() - started;
+    printf("# caller=%d ops=%d failures=%d wall_us=%llu ops_per_s=%.2f\n",
+           caller, nops, failures, (unsigned long long)wall,
+           wall ? nops * 1000000.0 / wall : 0.0);
+    fflush(stdout);
+    result = failures ? EX_SOFTWARE : EX_OK;
+
+finish:
+    if (queue)      dispatch_release(queue);
+    if (helpers)    CFRelease(helpers);
+    if (volURL)     CFRelease(volURL);
+
+    return result;
+}
+
+int
+stress(char *volpath, int argc, char *argv[])
+{
+    int result = EINVAL;
+    int cycles = 1, callers = 1, ops = kStressOpsAll;
+    int i, status, failed = 0;
+    struct stat volsb, rootsb;
+    uint64_t started;
+
+    // argv[0] is <vol>
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc)      usage(EX_USAGE);
+        if (strcmp(argv[i], "-n") == 0) {
+            cycles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            callers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-ops") == 0) {
+            char *opsarg = argv[++i], *opname;
+
+            ops = 0;
+            while ((opname = strsep(&opsarg, ","))) {
+                if (strcasecmp(opname, "erase") == 0) {
+                    ops |= kStressOpErase;
+                } else if (strcasecmp(opname, "copy") == 0) {
+                    ops |= kStressOpCopy;
+                } else if (strcasecmp(opname, "update") == 0) {
+                    ops |= kStressOpUpdate;
+                } else {
+                    usage(EX_USAGE);
+                }
+            }
+        } else {
+            usage(EX_USAGE);
+        }
+    }
+    if (cycles < 1 || callers < 1 || !ops)      usage(EX_USAGE);
+
+    // it erases helpers, so never point it at the running system
+    if (stat(volpath, &volsb) || stat("/", &rootsb)) {
+        result = errno; goto finish;
+    }
+    if (volsb.st_dev == rootsb.st_dev) {
+        fprintf(stderr, "won't stress the boot volume's helpers\n");
+        result = EPERM; goto finish;
+    }
+
+    printf("# brtest stress vol=%s cycles=%d callers=%d\n",
+           volpath, cycles, callers);
+    fflush(stdout);
+    started = usecsNow();
+
+    // several processes, so they contend for kextd's volume lock
+    for (i = 0; i < callers; i++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            _exit(stressCaller(i, volpath, cycles, ops));
+        } else if (pid == -1) {
+            warn("fork");
+            failed++;
+            break;
+        }
+    }
+    while (wait(&status) != -1) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EX_OK) {
+            failed++;
+        }
+    }
+
+    printf("# callers=%d failed=%d wall_us=%llu\n", callers, failed,
+           (unsigned long long)(usecsNow() - started));
+    result = failed ? ELAST + 1 : 0;
+
+finish:
+    return result;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -354,6 +618,13 @@ main(int argc, char *argv[])
             err(EX_NOINPUT, "%s", volpath);
         }
     }
+
+    // stress forks its callers before anyone touches CoreFoundation
+    if (strcasecmp(verb, "stress") == 0) {
+        result = stress(volpath, argc - 2, argv + 2);
+        goto report;
+    }
+
     volURL = CFURLCreateFromFileSystemRepresentation(nil, (UInt8*)volpath,
                                                      strlen(volpath), true);
     if (!volURL) {
@@ -380,6 +651,7 @@ main(int argc, char *argv[])
         usage(EX_USAGE);
     }
 
+report:
     if (result < 0) {
         printf("brtest function result = %#x\n", result);
     } else {
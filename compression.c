@@ -23,32 +23,263 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "compression.h"
+
 /*******************************************************************************
+* Adler-32.
+*
+* local_adler32() picks the widest implementation the CPU supports the first
+* time it is called: AVX2 or SSSE3 on x86_64, NEON on arm64, or the scalar
+* loop otherwise.  The vector versions handle 32 bytes per step, keeping
+* per-lane sums of the bytes, of the running byte totals, and of the bytes
+* weighted by their distance from the end of the step; those are folded
+* into the two Adler halves once per ADLER_NMAX bytes, which is as much as
+* 32-bit sums can take before they must be reduced modulo ADLER_BASE.
 *******************************************************************************/
-u_int32_t local_adler32(u_int8_t * buffer, int32_t length)
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__arm64__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ADLER_BASE   (65521U)
+#define ADLER_NMAX   (5552)
+#define ADLER_STEP   (32)
+
+typedef u_int32_t (*adler32_fn)(u_int32_t adler, const u_int8_t * buffer,
+    size_t length);
+
+static u_int32_t adler32_scalar(u_int32_t adler, const u_int8_t * buffer,
+    size_t length)
 {
-    int32_t cnt;
-    u_int32_t  result, lowHalf, highHalf;
-    
-    lowHalf = 1;
-    highHalf = 0;
-    
-    for (cnt = 0; cnt < length; cnt++) {
-        if ((cnt % 5000) == 0) {
-            lowHalf  %= 65521L;
-            highHalf %= 65521L;
+    u_int32_t lowHalf  = adler & 0xffff;
+    u_int32_t highHalf = adler >> 16;
+    size_t    chunk;
+
+    while (length) {
+        chunk = (length < ADLER_NMAX) ? length : ADLER_NMAX;
+        length -= chunk;
+        while (chunk--) {
+            lowHalf += *buffer++;
+            highHalf += lowHalf;
         }
-        
-        lowHalf += buffer[cnt];
-        highHalf += lowHalf;
+        lowHalf  %= ADLER_BASE;
+        highHalf %= ADLER_BASE;
     }
-    
-    lowHalf  %= 65521L;
-    highHalf %= 65521L;
-    
-    result = (highHalf << 16) | lowHalf;
-    
-    return result;
+    return (highHalf << 16) | lowHalf;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static u_int32_t adler32_avx2(u_int32_t adler, const u_int8_t * buffer,
+    size_t length)
+{
+    u_int32_t lowHalf  = adler & 0xffff;
+    u_int32_t highHalf = adler >> 16;
+    size_t    steps    = length / ADLER_STEP;
+    const __m256i weights = _mm256_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+    const __m256i ones  = _mm256_set1_epi16(1);
+    const __m256i zero  = _mm256_setzero_si256();
+
+    while (steps) {
+        size_t  n      = (steps < ADLER_NMAX / ADLER_STEP) ? steps : ADLER_NMAX / ADLER_STEP;
+        __m256i v_s1   = zero;  // sum of bytes
+        __m256i v_ps   = zero;  // sum of v_s1 before each step
+        __m256i v_s2   = zero;  // weighted sum of bytes
+        __m128i sum128;
+
+        steps -= n;
+        highHalf += lowHalf * (u_int32_t)(n * ADLER_STEP);
+
+        while (n--) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)buffer);
+
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2,
+                _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+            buffer += ADLER_STEP;
+        }
+
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        sum128 = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+            _mm256_extracti128_si256(v_s1, 1));
+        sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+        lowHalf += (u_int32_t)_mm_cvtsi128_si32(sum128);
+
+        sum128 = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+            _mm256_extracti128_si256(v_s2, 1));
+        sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+        highHalf += (u_int32_t)_mm_cvtsi128_si32(sum128);
+
+        lowHalf  %= ADLER_BASE;
+        highHalf %= ADLER_BASE;
+    }
+
+    return adler32_scalar((highHalf << 16) | lowHalf, buffer,
+        length % ADLER_STEP);
+}
+
+__attribute__((target("ssse3")))
+static u_int32_t adler32_ssse3(u_int32_t adler, const u_int8_t * buffer,
+    size_t length)
+{
+    u_int32_t lowHalf  = adler & 0xffff;
+    u_int32_t highHalf = adler >> 16;
+    size_t    steps    = length / ADLER_STEP;
+    const __m128i weightsHi = _mm_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i weightsLo = _mm_setr_epi8(
+        16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+    const __m128i ones  = _mm_set1_epi16(1);
+    const __m128i zero  = _mm_setzero_si128();
+
+    while (steps) {
+        size_t  n      = (steps < ADLER_NMAX / ADLER_STEP) ? steps : ADLER_NMAX / ADLER_STEP;
+        __m128i v_s1   = zero;
+        __m128i v_ps   = zero;
+        __m128i v_s2   = zero;
+
+        steps -= n;
+        highHalf += lowHalf * (u_int32_t)(n * ADLER_STEP);
+
+        while (n--) {
+            __m128i bytes1 = _mm_loadu_si128((const __m128i *)buffer);
+            __m128i bytes2 = _mm_loadu_si128((const __m128i *)(buffer + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_maddubs_epi16(bytes1, weightsHi), ones));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_maddubs_epi16(bytes2, weightsLo), ones));
+            buffer += ADLER_STEP;
+        }
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        lowHalf += (u_int32_t)_mm_cvtsi128_si32(v_s1);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        highHalf += (u_int32_t)_mm_cvtsi128_si32(v_s2);
+
+        lowHalf  %= ADLER_BASE;
+        highHalf %= ADLER_BASE;
+    }
+
+    return adler32_scalar((highHalf << 16) | lowHalf, buffer,
+        length % ADLER_STEP);
+}
+
+#elif defined(__arm64__) || defined(__aarch64__)
+
+static u_int32_t adler32_neon(u_int32_t adler, const u_int8_t * buffer,
+    size_t length)
+{
+    u_int32_t lowHalf  = adler & 0xffff;
+    u_int32_t highHalf = adler >> 16;
+    size_t    steps    = length / ADLER_STEP;
+    static const u_int16_t weightData[32] = {
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1 };
+
+    while (steps) {
+        size_t     n    = (steps < ADLER_NMAX / ADLER_STEP) ? steps : ADLER_NMAX / ADLER_STEP;
+        uint32x4_t v_s1 = vdupq_n_u32(0);
+        uint32x4_t v_ps = vdupq_n_u32(0);
+        uint16x8_t col1 = vdupq_n_u16(0);  // per-column byte sums
+        uint16x8_t col2 = vdupq_n_u16(0);
+        uint16x8_t col3 = vdupq_n_u16(0);
+        uint16x8_t col4 = vdupq_n_u16(0);
+        uint32x4_t v_s2;
+
+        steps -= n;
+        highHalf += lowHalf * (u_int32_t)(n * ADLER_STEP);
+
+        while (n--) {
+            uint8x16_t bytes1 = vld1q_u8(buffer);
+            uint8x16_t bytes2 = vld1q_u8(buffer + 16);
+
+            v_ps = vaddq_u32(v_ps, v_s1);
+            v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+            col1 = vaddw_u8(col1, vget_low_u8(bytes1));
+            col2 = vaddw_u8(col2, vget_high_u8(bytes1));
+            col3 = vaddw_u8(col3, vget_low_u8(bytes2));
+            col4 = vaddw_u8(col4, vget_high_u8(bytes2));
+            buffer += ADLER_STEP;
+        }
+
+        v_s2 = vshlq_n_u32(v_ps, 5);
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col1),  vld1_u16(&weightData[0]));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col1), vld1_u16(&weightData[4]));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col2),  vld1_u16(&weightData[8]));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col2), vld1_u16(&weightData[12]));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col3),  vld1_u16(&weightData[16]));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col3), vld1_u16(&weightData[20]));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col4),  vld1_u16(&weightData[24]));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col4), vld1_u16(&weightData[28]));
+
+        lowHalf  += vaddvq_u32(v_s1);
+        highHalf += vaddvq_u32(v_s2);
+
+        lowHalf  %= ADLER_BASE;
+        highHalf %= ADLER_BASE;
+    }
+
+    return adler32_scalar((highHalf << 16) | lowHalf, buffer,
+        length % ADLER_STEP);
+}
+
+#endif
+
+static adler32_fn select_adler32(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return adler32_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return adler32_ssse3;
+    }
+#elif defined(__arm64__) || defined(__aarch64__)
+    return adler32_neon;
+#endif
+    return adler32_scalar;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+u_int32_t local_adler32(u_int8_t * buffer, int32_t length)
+{
+    if (length <= 0) {
+        return 1;
+    }
+    return local_adler32_update(1, buffer, (size_t)length);
+}
+
+/*******************************************************************************
+*******************************************************************************/
+u_int32_t local_adler32_update(u_int32_t adler, const u_int8_t * buffer,
+    size_t length)
+{
+    /* Racing first calls just pick the same function. */
+    static adler32_fn adler32_impl = NULL;
+
+    if (!adler32_impl) {
+        adler32_impl = select_adler32();
+    }
+    if (!length) {
+        return adler;
+    }
+    return adler32_impl(adler, buffer, length);
 }
 
 /**************************************************************
@@ -249,8 +480,9 @@ static void delete_node(struct encode_state *sp, int p)
 }
 
 /*******************************************************************************
+* The original encoder, selected by LZSS_LEVEL_TREE.
 *******************************************************************************/
-u_int8_t * compress_lzss(
+static u_int8_t * compress_lzss_tree(
     u_int8_t       * dst,
     u_int32_t        dstlen,
     u_int8_t       * src,
@@ -374,3 +606,260 @@ finish:
 
     return result;
 }
+
+/**************************************************************
+ Hash-chain LZSS encoder.
+
+ Emits the same stream as compress_lzss_tree() above: groups of up to
+ eight units behind a flag byte, where a unit is either a literal byte or
+ a 12-bit ring buffer position plus a 4-bit (length - THRESHOLD - 1).
+ Instead of keeping the ring buffer's strings in trees, it hashes the
+ next three input bytes and walks a chain of earlier input positions with
+ the same hash.  Input position p sits at ring position (N - F + p) mod N
+ in the decoder, so any earlier position no more than N - F bytes back can
+ be referenced; a match may overlap the bytes it produces, just as the
+ decoder copies byte by byte.
+**************************************************************/
+
+#define HASH_BITS   12
+#define HASH_SIZE   (1 << HASH_BITS)
+#define MAX_DIST    (N - F)
+
+struct hash_encode_state {
+    int32_t head[HASH_SIZE];  /* newest input position for each hash, or -1 */
+    int32_t prev[N];          /* next older position with the same hash */
+
+    /* output in progress; see code_buf in compress_lzss_tree() */
+    u_int8_t * dst;
+    u_int8_t * dstend;
+    u_int8_t   code_buf[17];
+    int        code_buf_ptr;
+    u_int8_t   mask;
+};
+
+static const struct {
+    int chain_limit;  /* max candidates examined per position */
+    int lazy;         /* defer a match if the next position has a longer one */
+} lzss_levels[LZSS_LEVEL_BEST + 1] = {
+    {    0, 0 },  /* LZSS_LEVEL_TREE; not used here */
+    {    2, 0 },
+    {    4, 0 },
+    {    8, 0 },
+    {   16, 1 },
+    {   32, 1 },
+    {   64, 1 },
+    {  128, 1 },
+    {  512, 1 },
+    { 4096, 1 },
+};
+
+static int lzss_default_level = LZSS_LEVEL_DEFAULT;
+
+/*******************************************************************************
+*******************************************************************************/
+int set_lzss_compression_level(int level)
+{
+    if (level < LZSS_LEVEL_TREE || level > LZSS_LEVEL_BEST) {
+        return 0;
+    }
+    lzss_default_level = level;
+    return 1;
+}
+
+int get_lzss_compression_level(void)
+{
+    return lzss_default_level;
+}
+
+static inline u_int32_t hash3(const u_int8_t * p)
+{
+    u_int32_t v = ((u_int32_t)p[0] << 16) | ((u_int32_t)p[1] << 8) | p[2];
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Adds input position pos (which needs 3 bytes of input) to its chain.
+ */
+static inline void hash_insert(struct hash_encode_state *hs,
+    const u_int8_t * src, u_int32_t pos)
+{
+    u_int32_t h = hash3(src + pos);
+
+    hs->prev[pos & (N - 1)] = hs->head[h];
+    hs->head[h] = (int32_t)pos;
+}
+
+/* Returns the longest match length for pos (0 if none), up to maxlen,
+ * setting *match_pos to the input position it starts at.
+ */
+static int longest_match(const struct hash_encode_state *hs,
+    const u_int8_t * src, u_int32_t pos, int maxlen, int chain_limit,
+    u_int32_t * match_pos)
+{
+    int32_t cand = hs->head[hash3(src + pos)];
+    int     best = 0;
+    int     len;
+
+    while (cand >= 0 && chain_limit-- > 0) {
+        if (pos - (u_int32_t)cand > MAX_DIST) {
+            break;
+        }
+        if (src[cand + best] == src[pos + best]) {
+            for (len = 0; len < maxlen && src[cand + len] == src[pos + len]; len++)
+                ;
+            if (len > best) {
+                best = len;
+                *match_pos = (u_int32_t)cand;
+                if (len >= maxlen) {
+                    break;
+                }
+            }
+        }
+        /* chains only run toward older positions */
+        if (hs->prev[cand & (N - 1)] >= cand) {
+            break;
+        }
+        cand = hs->prev[cand & (N - 1)];
+    }
+    return best;
+}
+
+/* Appends one unit to the current group, writing the group out when full.
+ * Returns 0 if dst ran out of space.
+ */
+static int emit_unit(struct hash_encode_state *hs, int is_literal,
+    u_int8_t b0, u_int8_t b1)
+{
+    int i;
+
+    if (is_literal) {
+        hs->code_buf[0] |= hs->mask;
+        hs->code_buf[hs->code_buf_ptr++] = b0;
+    } else {
+        hs->code_buf[hs->code_buf_ptr++] = b0;
+        hs->code_buf[hs->code_buf_ptr++] = b1;
+    }
+    if ((hs->mask <<= 1) == 0) {
+        for (i = 0; i < hs->code_buf_ptr; i++) {
+            if (hs->dst < hs->dstend)
+                *hs->dst++ = hs->code_buf[i];
+            else
+                return 0;
+        }
+        hs->code_buf[0] = 0;
+        hs->code_buf_ptr = hs->mask = 1;
+    }
+    return 1;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static u_int8_t * compress_lzss_hash(
+    u_int8_t       * dst,
+    u_int32_t        dstlen,
+    u_int8_t       * src,
+    u_int32_t        srclen,
+    int              level)
+{
+    u_int8_t * result = NULL;
+    struct hash_encode_state *hs;
+    u_int32_t  pos = 0, inserted = 0, match_pos = 0, next_pos = 0, ring_pos;
+    int        len, next_len, maxlen, i;
+    int        chain_limit = lzss_levels[level].chain_limit;
+    int        lazy = lzss_levels[level].lazy;
+
+    /* Match the tree encoder, which produces nothing for empty input. */
+    if (!srclen)
+        return NULL;
+
+    hs = (struct hash_encode_state *) malloc(sizeof(*hs));
+    if (!hs) goto finish;
+
+    memset(hs->head, 0xff, sizeof(hs->head));
+    hs->dst = dst;
+    hs->dstend = dst + dstlen;
+    hs->code_buf[0] = 0;
+    hs->code_buf_ptr = hs->mask = 1;
+
+    while (pos < srclen) {
+        /* Hash every position before this one that has 3 bytes after it. */
+        for ( ; inserted < pos && inserted + THRESHOLD < srclen; inserted++)
+            hash_insert(hs, src, inserted);
+
+        maxlen = (srclen - pos < F) ? (int)(srclen - pos) : F;
+        len = 0;
+        if (maxlen > THRESHOLD)
+            len = longest_match(hs, src, pos, maxlen, chain_limit, &match_pos);
+
+        /* Lazy evaluation: if the next byte starts a longer match, send
+         * this one as a literal and take that match instead.
+         */
+        if (lazy && len > THRESHOLD && len < maxlen && pos + 1 + THRESHOLD < srclen) {
+            if (inserted == pos) {
+                hash_insert(hs, src, pos);
+                inserted++;
+            }
+            next_len = longest_match(hs, src, pos + 1,
+                (srclen - pos - 1 < F) ? (int)(srclen - pos - 1) : F,
+                chain_limit, &next_pos);
+            if (next_len > len) {
+                len = 0;
+            }
+        }
+
+        if (len > THRESHOLD) {
+            ring_pos = (N - F + match_pos) & (N - 1);
+            if (!emit_unit(hs, 0, (u_int8_t) ring_pos,
+                    (u_int8_t) (((ring_pos >> 4) & 0xF0) | (len - (THRESHOLD + 1)))))
+                goto finish;
+            pos += len;
+        } else {
+            if (!emit_unit(hs, 1, src[pos], 0))
+                goto finish;
+            pos++;
+        }
+    }
+
+    if (hs->code_buf_ptr > 1) {    /* Send remaining code. */
+        for (i = 0; i < hs->code_buf_ptr; i++)
+            if (hs->dst < hs->dstend)
+                *hs->dst++ = hs->code_buf[i];
+            else
+                goto finish;
+    }
+
+    result = hs->dst;
+
+finish:
+    if (hs) free(hs);
+
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+u_int8_t * compress_lzss_level(
+    u_int8_t       * dst,
+    u_int32_t        dstlen,
+    u_int8_t       * src,
+    u_int32_t        srclen,
+    int              level)
+{
+    if (level < LZSS_LEVEL_TREE || level > LZSS_LEVEL_BEST) {
+        level = LZSS_LEVEL_DEFAULT;
+    }
+    if (level == LZSS_LEVEL_TREE) {
+        return compress_lzss_tree(dst, dstlen, src, srclen);
+    }
+    return compress_lzss_hash(dst, dstlen, src, srclen, level);
+}
+
+/*******************************************************************************
+*******************************************************************************/
+u_int8_t * compress_lzss(
+    u_int8_t       * dst,
+    u_int32_t        dstlen,
+    u_int8_t       * src,
+    u_int32_t        srclen)
+{
+    return compress_lzss_level(dst, dstlen, src, srclen, lzss_default_level);
+}
@@ -30,6 +30,15 @@ u_int32_t local_adler32(
     u_int8_t * buffer,
     int32_t    length);
 
+/* Continues an Adler-32 checksum over another buffer; start with 1.
+ * local_adler32_update(local_adler32(a, n), b, m) is the checksum of a
+ * followed by b.
+ */
+u_int32_t local_adler32_update(
+    u_int32_t        adler,
+    const u_int8_t * buffer,
+    size_t           length);
+
 int decompress_lzss(
     u_int8_t       * dst,
     u_int32_t        dstlen,
@@ -42,4 +51,27 @@ u_int8_t * compress_lzss(
     u_int8_t * src,
     u_int32_t        srclen);
 
+/* LZSS match-finding effort, used by compress_lzss_level().
+ * LZSS_LEVEL_TREE is the original binary-tree encoder; levels 1-9 use a
+ * hash-chain matcher that searches more candidates (and, from level 4,
+ * looks one byte ahead for a better match) as the level rises.  All levels
+ * produce streams that decompress_lzss() reads.
+ */
+#define LZSS_LEVEL_TREE     (0)
+#define LZSS_LEVEL_FASTEST  (1)
+#define LZSS_LEVEL_DEFAULT  (6)
+#define LZSS_LEVEL_BEST     (9)
+
+u_int8_t * compress_lzss_level(
+    u_int8_t       * dst,
+    u_int32_t        dstlen,
+    u_int8_t * src,
+    u_int32_t        srclen,
+    int              level);
+
+/* Sets the level compress_lzss() uses; returns false if out of range.
+ */
+int set_lzss_compression_level(int level);
+int get_lzss_compression_level(void);
+
 #endif /* __COMPRESSION_H__ */
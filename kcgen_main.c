@@ -139,9 +139,9 @@ int main(int argc, char * const * argv)
     if (toolArgs.prelinkedKernelPath && !CFArrayGetCount(toolArgs.argURLs) &&
         (toolArgs.compress || toolArgs.uncompress)) 
     {
-        result = compressPrelinkedKernel(toolArgs.prelinkedKernelPath,
-                                         toolArgs.compress,
-                                         toolArgs.compressionType);
+        result = recompressPrelinkedKernelFile(toolArgs.prelinkedKernelPath,
+                                               toolArgs.compress,
+                                               toolArgs.compressionType);
         goto finish;
     }
 
@@ -906,61 +906,6 @@ finish:
     return result;
 }
 
-/*******************************************************************************
- * Creates a list of architectures to generate prelinked kernel slices for by
- * selecting the requested architectures for which the kernel has a slice.
- * Warns when a requested architecture does not have a corresponding kernel
- * slice.
- *******************************************************************************/
-ExitStatus
-createPrelinkedKernelArchs(
-    KcgenArgs         * toolArgs,
-    CFMutableArrayRef * prelinkArchsOut)
-{
-    ExitStatus          result          = EX_OSERR;
-    CFMutableArrayRef   kernelArchs     = NULL;  // must release
-    CFMutableArrayRef   prelinkArchs    = NULL;  // must release
-    const NXArchInfo  * targetArch      = NULL;  // do not free
-    int                 i               = 0;
-    
-    result = readFatFileArchsWithPath(toolArgs->kernelPath, &kernelArchs);
-    if (result != EX_OK) {
-        goto finish;
-    }
-
-    prelinkArchs = CFArrayCreateMutableCopy(kCFAllocatorDefault,
-        /* capacity */ 0, toolArgs->targetArchs);
-    if (!prelinkArchs) {
-        OSKextLogMemError();
-        result = EX_OSERR;
-        goto finish;
-    }
-
-    for (i = 0; i < CFArrayGetCount(prelinkArchs); ++i) {
-        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
-        if (!CFArrayContainsValue(kernelArchs,
-            RANGE_ALL(kernelArchs), targetArch)) 
-        {
-            OSKextLog(/* kext */ NULL,
-                      kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
-                "Warning - kernel file %s does not contain requested arch: %s",
-                toolArgs->kernelPath, targetArch->name);
-            CFArrayRemoveValueAtIndex(prelinkArchs, i);
-            i--;
-            continue;
-        }
-    }
-
-    *prelinkArchsOut = (CFMutableArrayRef) CFRetain(prelinkArchs);
-    result = EX_OK;
-
-finish:
-    SAFE_RELEASE(kernelArchs);
-    SAFE_RELEASE(prelinkArchs);
-
-    return result;
-}
-
 /*******************************************************************************
 *******************************************************************************/
 ExitStatus
@@ -985,7 +930,8 @@ createPrelinkedKernel(
 
     bzero(prelinkFileTimes, sizeof(prelinkFileTimes));
         
-    result = createPrelinkedKernelArchs(toolArgs, &prelinkArchs);
+    result = createPrelinkArchsForKernel(toolArgs->kernelPath,
+        toolArgs->targetArchs, &prelinkArchs);
     if (result != EX_OK) {
         goto finish;
     }
@@ -1058,25 +1004,21 @@ createPrelinkedKernel(
         CFArrayAppendValue(generatedArchs, targetArch);
     }
 
-    result = writeFatFile(toolArgs->prelinkedKernelPath, prelinkSlices,
+    result = writePrelinkedKernel(toolArgs->prelinkedKernelPath,
+        /* doValidation */ FALSE, 0, 0, prelinkSlices,
         prelinkArchs, (0644),  // !!! - need macro for perms
-        (updateModTime) ? prelinkFileTimes : NULL);
+        (updateModTime) ? prelinkFileTimes : NULL,
+        toolArgs->symbolDirURL, generatedSymbols, generatedArchs,
+        &toolArgs->stageStats);
     if (result != EX_OK) {
         goto finish;
     }
-     
-    if (toolArgs->symbolDirURL) {
-        result = writePrelinkedSymbols(toolArgs->symbolDirURL, 
-            generatedSymbols, generatedArchs);
-        if (result != EX_OK) {
-            goto finish;
-        }
-    }
     
     OSKextLog(/* kext */ NULL,
         kOSKextLogBasicLevel | kOSKextLogGeneralFlag | kOSKextLogArchiveFlag,
         "Created prelinked kernel %s.", 
         toolArgs->prelinkedKernelPath);
+    logPrelinkStageStats(&toolArgs->stageStats);
 
     result = EX_OK;
 
@@ -1107,10 +1049,11 @@ ExitStatus createPrelinkedKernelForArch(
     CFDataRef prelinkedKernel = NULL;
     uint32_t flags = 0;
     Boolean fatalOut = false;
+    PrelinkStageMark stageMark;
     
     /* Retrieve the kernel image for the requested architecture.
      */
-    kernelImage = readMachOSliceForArch(toolArgs->kernelPath, archInfo, /* checkArch */ TRUE);
+    kernelImage = mapMachOSliceForArch(toolArgs->kernelPath, archInfo, /* checkArch */ TRUE);
     if (!kernelImage) {
         OSKextLog(/* kext */ NULL,
                 kOSKextLogErrorLevel | kOSKextLogArchiveFlag |  kOSKextLogFileAccessFlag,
@@ -1141,8 +1084,12 @@ ExitStatus createPrelinkedKernelForArch(
         goto finish;
     }
 
+    prelinkStageStart(&stageMark);
     result = filterKextsForCache(toolArgs, prelinkKexts,
             archInfo, &fatalOut);
+    prelinkStageEnd(&toolArgs->stageStats, kPrelinkStageFilter, &stageMark);
+    prelinkStageAddCounts(&toolArgs->stageStats, kPrelinkStageFilter,
+        /* bytesIn */ 0, /* bytesOut */ 0, CFArrayGetCount(prelinkKexts));
     if (result != EX_OK || fatalOut) {
         goto finish;
     }
@@ -1167,34 +1114,21 @@ ExitStatus createPrelinkedKernelForArch(
     flags |= (toolArgs->stripSymbols) ? kOSKextKernelcacheStripSymbolsFlag : 0;
     flags |= (toolArgs->printTestResults) ? kOSKextKernelcachePrintDiagnosticsFlag : 0;
 
-    prelinkedKernel = OSKextCreatePrelinkedKernel(kernelImage, prelinkKexts,
-        toolArgs->volumeRootURL, flags, prelinkedSymbolsOut);
-    if (!prelinkedKernel) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-            "Error - failed to generate prelinked kernel.");
-        result = EX_OSERR;
+    result = linkPrelinkedKernelSlice(kernelImage, prelinkKexts,
+        toolArgs->volumeRootURL, flags, &toolArgs->stageStats,
+        &prelinkedKernel, prelinkedSymbolsOut);
+    if (result != EX_OK) {
         goto finish;
     }
 
     /* Log used bundle identifiers for B&I */
     logUsedKexts(toolArgs, prelinkKexts);
 
-   /* Compress the prelinked kernel if needed */
+   /* Compress the prelinked kernel if needed; kcgen always links for KASLR */
 
-    if (toolArgs->compress) {
-        *prelinkedKernelOut = compressPrelinkedSlice(toolArgs->compressionType,
-                                                     prelinkedKernel,
-                                                     true);
-    } else {
-        *prelinkedKernelOut = CFRetain(prelinkedKernel);
-    }
-    
-    if (!*prelinkedKernelOut) {
-        goto finish;
-    }
-
-    result = EX_OK;
+    result = compressPrelinkedKernelSlice(prelinkedKernel, toolArgs->compress,
+        toolArgs->compressionType, /* chunked */ false, /* hasRelocs */ true,
+        &toolArgs->stageStats, prelinkedKernelOut);
 
 finish:
     SAFE_RELEASE(kernelImage);
@@ -1205,108 +1139,6 @@ finish:
 }
 
 
-/*********************************************************************
- *********************************************************************/
-ExitStatus compressPrelinkedKernel(
-                                   const char        * prelinkPath,
-                                   Boolean             compress,
-                                   uint32_t            compressionType)
-{
-    ExitStatus          result          = EX_SOFTWARE;
-    struct timeval      prelinkedKernelTimes[2];
-    CFMutableArrayRef   prelinkedSlices = NULL; // must release
-    CFMutableArrayRef   prelinkedArchs  = NULL; // must release
-    CFDataRef           prelinkedSlice  = NULL; // must release
-    const NXArchInfo  * archInfo        = NULL; // do not free
-    const u_char      * sliceBytes      = NULL; // do not free
-    mode_t              fileMode        = 0;
-    int                 i               = 0;
-    
-    result = readMachOSlices(prelinkPath, &prelinkedSlices, 
-        &prelinkedArchs, &fileMode, prelinkedKernelTimes);
-    if (result != EX_OK) {
-        goto finish;
-    }
-    
-    /* Compress/uncompress each slice of the prelinked kernel.
-     */
-
-    for (i = 0; i < CFArrayGetCount(prelinkedSlices); ++i) {
-
-        SAFE_RELEASE_NULL(prelinkedSlice);
-        prelinkedSlice = CFArrayGetValueAtIndex(prelinkedSlices, i);
-
-        if (compress) {
-            prelinkedSlice = compressPrelinkedSlice(compressionType,
-                                                    prelinkedSlice,
-                                                    true);
-            if (!prelinkedSlice) {
-                result = EX_DATAERR;
-                goto finish;
-            }
-        } else {
-            prelinkedSlice = uncompressPrelinkedSlice(prelinkedSlice);
-            if (!prelinkedSlice) {
-                result = EX_DATAERR;
-                goto finish;
-            }
-        }
-
-        CFArraySetValueAtIndex(prelinkedSlices, i, prelinkedSlice);
-    }
-    SAFE_RELEASE_NULL(prelinkedSlice);
-
-    /* Snow Leopard prelinked kernels are not wrapped in a fat header, so we
-     * have to decompress the prelinked kernel and look at the mach header
-     * to get the architecture information.
-     */
-
-    if (!prelinkedArchs && CFArrayGetCount(prelinkedSlices) == 1) {
-        if (!createCFMutableArray(&prelinkedArchs, NULL)) {
-            OSKextLogMemError();
-            result = EX_OSERR;
-            goto finish;
-        }
-
-        sliceBytes = CFDataGetBytePtr(CFArrayGetValueAtIndex(prelinkedSlices, 0));
-
-        archInfo = getThinHeaderPageArch(sliceBytes);
-        if (archInfo) {
-            CFArrayAppendValue(prelinkedArchs, archInfo);
-        } else {
-            SAFE_RELEASE_NULL(prelinkedArchs);
-        }
-    }
-
-    /* If we still don't have architecture information, then something
-     * definitely went wrong.
-     */
-
-    if (!prelinkedArchs) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-            "Couldn't determine prelinked kernel's architecture");
-        result = EX_SOFTWARE;
-        goto finish;
-    }
-
-    result = writeFatFile(prelinkPath, prelinkedSlices, 
-        prelinkedArchs, fileMode, prelinkedKernelTimes);
-    if (result != EX_OK) {
-        goto finish;
-    }
-
-    result = EX_OK;
-
-finish:
-    SAFE_RELEASE(prelinkedSlices);
-    SAFE_RELEASE(prelinkedArchs);
-    SAFE_RELEASE(prelinkedSlice);
-
-    return result;
-}
-
-
 /*******************************************************************************
 * usage()
 *******************************************************************************/
@@ -165,6 +165,8 @@ typedef struct {
     Boolean     compress;
     uint32_t    compressionType;
     Boolean     uncompress;
+
+    PrelinkStageStats  stageStats;      // time, bytes, and kexts per prelink stage
 } KcgenArgs;
 
 #pragma mark Function Prototypes
@@ -204,9 +206,6 @@ ExitStatus filterKextsForCache(
     CFMutableArrayRef   kextArray,
     const NXArchInfo  * arch,
     Boolean           * fatalOut);
-ExitStatus createPrelinkedKernelArchs(
-    KcgenArgs     * toolArgs,
-    CFMutableArrayRef * prelinkArchsOut);
 ExitStatus createExistingPrelinkedSlices(
     KcgenArgs     * toolArgs,
     CFMutableArrayRef * prelinkedSlicesOut,
@@ -221,10 +220,6 @@ ExitStatus createPrelinkedKernelForArch(
     CFDataRef           * prelinkedKernelOut,
     CFDictionaryRef     * prelinkedSymbolsOut,
     const NXArchInfo    * archInfo);
-ExitStatus compressPrelinkedKernel(
-    const char        * prelinkedKernelPath,
-    Boolean             compress,
-    uint32_t            compressionType);
 void logUsedKexts(
     KcgenArgs       * toolArgs,
     CFArrayRef        prelinkKexts);
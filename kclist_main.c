@@ -50,6 +50,7 @@ int main(int argc, char * const argv[])
 
     void               * prelinkInfoSect = NULL;
     const char         * prelinkInfoBytes = NULL;
+    uint64_t             prelinkInfoSize  = 0;
     CFPropertyListRef    prelinkInfoPlist = NULL;  // must release
 
     void               * prelinkTextSect = NULL;
@@ -132,7 +133,7 @@ int main(int argc, char * const argv[])
         SAFE_RELEASE_NULL(kernelcacheImage);
         SAFE_RELEASE_NULL(rawKernelcache);
         
-        rawKernelcache = readMachOSliceForArch(toolArgs.kernelcachePath,
+        rawKernelcache = mapMachOSliceForArch(toolArgs.kernelcachePath,
                                                nextArchInfo,
                                                /* checkArch */ FALSE);
         if (!rawKernelcache) {
@@ -195,6 +196,7 @@ int main(int argc, char * const argv[])
         if (ISMACHO64(MAGIC32(kernelcacheStart))) {
             prelinkInfoBytes = ((char *)kernelcacheStart) +
             ((struct section_64 *)prelinkInfoSect)->offset;
+            prelinkInfoSize = ((struct section_64 *)prelinkInfoSect)->size;
             prelinkTextBytes = ((char *)kernelcacheStart) +
             ((struct section_64 *)prelinkTextSect)->offset;
             prelinkTextSourceAddress = ((struct section_64 *)prelinkTextSect)->addr;
@@ -202,26 +204,47 @@ int main(int argc, char * const argv[])
         } else {
             prelinkInfoBytes = ((char *)kernelcacheStart) +
             ((struct section *)prelinkInfoSect)->offset;
+            prelinkInfoSize = ((struct section *)prelinkInfoSect)->size;
             prelinkTextBytes = ((char *)kernelcacheStart) +
             ((struct section *)prelinkTextSect)->offset;
             prelinkTextSourceAddress = ((struct section *)prelinkTextSect)->addr;
             prelinkTextSourceSize = ((struct section *)prelinkTextSect)->size;
         }
         
-        prelinkInfoPlist = (CFPropertyListRef)
-        IOCFUnserialize(prelinkInfoBytes,
-                        kCFAllocatorDefault, /* options */ 0,
-                        /* errorString */ NULL);
-        if (!prelinkInfoPlist) {
+        if ((uint64_t)(prelinkInfoBytes - (const char *)kernelcacheStart) +
+            prelinkInfoSize > (uint64_t)CFDataGetLength(kernelcacheImage)) {
+
             OSKextLog(/* kext */ NULL,
                       kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
-                      "Can't unserialize prelink info.");
+                      "Prelink info section is out of bounds.");
             goto finish;
         }
-        
-        listPrelinkedKexts(&toolArgs, prelinkInfoPlist, prelinkTextBytes,
-                           prelinkTextSourceAddress, prelinkTextSourceSize,
-                           nextArchInfo);
+
+       /* With bundle IDs given, try to decode just those kexts' entries;
+        * fall back to unserializing the whole prelink info if that fails.
+        */
+        if (!CFSetGetCount(toolArgs.kextIDs) ||
+            !listPrelinkedKextsLazily(&toolArgs,
+                                      prelinkInfoBytes, (size_t)prelinkInfoSize,
+                                      prelinkTextBytes,
+                                      prelinkTextSourceAddress, prelinkTextSourceSize,
+                                      nextArchInfo)) {
+
+            prelinkInfoPlist = (CFPropertyListRef)
+            IOCFUnserialize(prelinkInfoBytes,
+                            kCFAllocatorDefault, /* options */ 0,
+                            /* errorString */ NULL);
+            if (!prelinkInfoPlist) {
+                OSKextLog(/* kext */ NULL,
+                          kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                          "Can't unserialize prelink info.");
+                goto finish;
+            }
+
+            listPrelinkedKexts(&toolArgs, prelinkInfoPlist, prelinkTextBytes,
+                               prelinkTextSourceAddress, prelinkTextSourceSize,
+                               nextArchInfo);
+        }
         
         // process next arch or done if user specified an architecture,
         // fat_arch will be NULL if user passed in an arch via "-arch XXX"
@@ -394,6 +417,7 @@ void listPrelinkedKexts(KclistArgs * toolArgs,
     CFIndex i, count;
     Boolean haveIDs = CFSetGetCount(toolArgs->kextIDs) > 0 ? TRUE : FALSE;
     CFArrayRef kextPlistArray = NULL;
+    CFDictionaryRef kextPlist = NULL;
     
     if (CFArrayGetTypeID() == CFGetTypeID(kcInfoPlist)) {
         kextPlistArray = (CFArrayRef)kcInfoPlist;
@@ -413,34 +437,294 @@ void listPrelinkedKexts(KclistArgs * toolArgs,
 
     count = CFArrayGetCount(kextPlistArray);
     for (i = 0; i < count; i++) {
-        CFDictionaryRef kextPlist = (CFDictionaryRef)CFArrayGetValueAtIndex(kextPlistArray, i);
+        kextPlist = (CFDictionaryRef)CFArrayGetValueAtIndex(kextPlistArray, i);
         CFStringRef kextIdentifier = (CFStringRef)CFDictionaryGetValue(kextPlist, kCFBundleIdentifierKey);
-        CFNumberRef kextSourceAddress = (CFNumberRef)CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkExecutableSourceKey));
-        CFNumberRef kextSourceSize = (CFNumberRef)CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkExecutableSizeKey));
-        const char *kextTextBytes = NULL;
         
         if (haveIDs && !CFSetContainsValue(toolArgs->kextIDs, kextIdentifier)) {
             continue;
         }
 
-        if (kextSourceAddress && CFNumberGetTypeID() == CFGetTypeID(kextSourceAddress) &&
-            kextSourceSize && CFNumberGetTypeID() == CFGetTypeID(kextSourceSize)) {
-            uint64_t sourceAddress;
-            uint64_t sourceSize;
-  
-            CFNumberGetValue(kextSourceAddress, kCFNumberSInt64Type, &sourceAddress);
-            CFNumberGetValue(kextSourceSize, kCFNumberSInt64Type, &sourceSize);
-            if ((sourceAddress >= prelinkTextSourceAddress) &&
-                ((sourceAddress+sourceSize) <= (prelinkTextSourceAddress + prelinkTextSourceSize))) {
-                kextTextBytes = prelinkTextBytes + (ptrdiff_t)(sourceAddress - prelinkTextSourceAddress);
+        printKextInfo(kextPlist, toolArgs->verbose, toolArgs->printUUIDs,
+            getKextTextBytes(kextPlist, prelinkTextBytes,
+                prelinkTextSourceAddress, prelinkTextSourceSize));
+    }
+
+finish:
+    return;
+}
+
+/*******************************************************************************
+* Returns the start of a kext's executable within the prelink text section,
+* or NULL if its plist doesn't place it there.
+*******************************************************************************/
+const char * getKextTextBytes(CFDictionaryRef kextPlist,
+                              const char *prelinkTextBytes,
+                              uint64_t prelinkTextSourceAddress,
+                              uint64_t prelinkTextSourceSize)
+{
+    CFNumberRef kextSourceAddress = (CFNumberRef)CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkExecutableSourceKey));
+    CFNumberRef kextSourceSize = (CFNumberRef)CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkExecutableSizeKey));
+    const char *kextTextBytes = NULL;
+
+    if (kextSourceAddress && CFNumberGetTypeID() == CFGetTypeID(kextSourceAddress) &&
+        kextSourceSize && CFNumberGetTypeID() == CFGetTypeID(kextSourceSize)) {
+        uint64_t sourceAddress;
+        uint64_t sourceSize;
+
+        CFNumberGetValue(kextSourceAddress, kCFNumberSInt64Type, &sourceAddress);
+        CFNumberGetValue(kextSourceSize, kCFNumberSInt64Type, &sourceSize);
+        if ((sourceAddress >= prelinkTextSourceAddress) &&
+            ((sourceAddress+sourceSize) <= (prelinkTextSourceAddress + prelinkTextSourceSize))) {
+            kextTextBytes = prelinkTextBytes + (ptrdiff_t)(sourceAddress - prelinkTextSourceAddress);
+        }
+    }
+    return kextTextBytes;
+}
+
+#pragma mark Lazy Prelink Info Decoding
+/*******************************************************************************
+* The prelink info is IOCFSerialize() XML: a dict whose _PrelinkInfoDictionary
+* key holds an array with one dict per kext. When only a few kexts are wanted,
+* listPrelinkedKextsLazily() walks the tags of that array without building
+* anything, reads each entry's top-level CFBundleIdentifier straight from the
+* XML, and unserializes only the entries that match.
+*
+* An entry can use IDREF to point at an object serialized elsewhere in the
+* document, in which case it can't be unserialized on its own; so can any
+* layout this scanner doesn't expect. In those cases the lazy path returns
+* false without printing anything and the caller decodes the whole plist.
+*******************************************************************************/
+#define kPrelinkInfoDictionaryKeyXML  "<key>_PrelinkInfoDictionary</key>"
+#define kBundleIdentifierKeyXML       "CFBundleIdentifier"
+
+/*******************************************************************************
+* Does the tag starting at tag ('<' or "</") name element `name`?
+*******************************************************************************/
+static Boolean xmlTagIs(const char * tag, const char * tagEnd, const char * name)
+{
+    size_t nameLength = strlen(name);
+
+    tag += (tag[1] == '/') ? 2 : 1;
+    if ((size_t)(tagEnd - tag) < nameLength || strncmp(tag, name, nameLength)) {
+        return false;
+    }
+    tag += nameLength;
+    return (*tag == '>' || *tag == '/' || *tag == ' ' || *tag == '\t');
+}
+
+/*******************************************************************************
+* Scans one kext's <dict> element, starting at its open tag. Returns a pointer
+* just past its closing tag, or NULL if the XML isn't what we expect. If the
+* dict's own CFBundleIdentifier is a plain string, *idStartOut and
+* *idLengthOut give its raw characters; otherwise *idStartOut is NULL.
+*******************************************************************************/
+static const char * scanPrelinkInfoKextDict(
+    const char   * dictStart,
+    const char   * end,
+    const char  ** idStartOut,
+    size_t       * idLengthOut)
+{
+    const char * cursor     = dictStart;
+    const char * tag        = NULL;
+    const char * tagEnd     = NULL;
+    const char * content    = NULL;
+    const char * contentEnd = NULL;
+    Boolean      selfClosing;
+    Boolean      wantID     = false;
+    int          depth      = 0;
+
+    *idStartOut = NULL;
+    *idLengthOut = 0;
+
+    while (cursor < end &&
+        (tag = memchr(cursor, '<', end - cursor))) {
+
+        tagEnd = memchr(tag, '>', end - tag);
+        if (!tagEnd) {
+            break;
+        }
+        selfClosing = (tagEnd[-1] == '/');
+        cursor = tagEnd + 1;
+
+        if (tag[1] == '/') {
+            if (xmlTagIs(tag, tagEnd, "dict") || xmlTagIs(tag, tagEnd, "array")) {
+                if (--depth == 0) {
+                    return cursor;
+                }
+            }
+            continue;
+        }
+
+        if (wantID) {
+            wantID = false;
+            if (xmlTagIs(tag, tagEnd, "string") && !selfClosing) {
+                content = cursor;
+                contentEnd = memchr(content, '<', end - content);
+                if (contentEnd && !memchr(content, '&', contentEnd - content)) {
+                    *idStartOut = content;
+                    *idLengthOut = contentEnd - content;
+                }
             }
         }
-        
-        printKextInfo(kextPlist, toolArgs->verbose, toolArgs->printUUIDs, kextTextBytes);
+
+        if (xmlTagIs(tag, tagEnd, "dict") || xmlTagIs(tag, tagEnd, "array")) {
+            if (!selfClosing) {
+                depth++;
+            }
+        } else if (depth == 1 && xmlTagIs(tag, tagEnd, "key") && !selfClosing) {
+            content = cursor;
+            contentEnd = memchr(content, '<', end - content);
+            wantID = (contentEnd &&
+                (size_t)(contentEnd - content) == strlen(kBundleIdentifierKeyXML) &&
+                !strncmp(content, kBundleIdentifierKeyXML,
+                    contentEnd - content));
+        }
+
+        if (depth == 0) {
+            break;  // not a dict
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Unserializes the matching entries of the prelink info and lists them.
+* Returns false, having printed nothing, if the caller has to fall back to
+* decoding the whole plist.
+*******************************************************************************/
+Boolean listPrelinkedKextsLazily(KclistArgs * toolArgs,
+                                 const char *prelinkInfoBytes,
+                                 size_t prelinkInfoSize,
+                                 const char *prelinkTextBytes,
+                                 uint64_t prelinkTextSourceAddress,
+                                 uint64_t prelinkTextSourceSize,
+                                 const NXArchInfo * archInfo)
+{
+    Boolean            result      = false;
+    CFMutableArrayRef  kextPlists  = NULL;  // must release
+    CFDictionaryRef    kextPlist   = NULL;  // must release
+    CFStringRef        kextID      = NULL;  // must release
+    char             * xmlBuffer   = NULL;  // must free
+    size_t             xmlBufferSize = 0;
+    const char       * end         = prelinkInfoBytes + prelinkInfoSize;
+    const char       * cursor      = NULL;
+    const char       * tag         = NULL;
+    const char       * tagEnd      = NULL;
+    const char       * dictEnd     = NULL;
+    const char       * idStart     = NULL;
+    size_t             idLength    = 0;
+    size_t             dictLength  = 0;
+    CFIndex            count, i;
+
+    if (!createCFMutableArray(&kextPlists, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+   /* The XML may be NUL-terminated short of the section's end.
+    */
+    end = memchr(prelinkInfoBytes, '\0', prelinkInfoSize);
+    if (!end) {
+        end = prelinkInfoBytes + prelinkInfoSize;
+    }
+
+    cursor = memmem(prelinkInfoBytes, end - prelinkInfoBytes,
+        kPrelinkInfoDictionaryKeyXML, strlen(kPrelinkInfoDictionaryKeyXML));
+    if (!cursor) {
+        goto finish;
+    }
+    cursor += strlen(kPrelinkInfoDictionaryKeyXML);
+    tag = memchr(cursor, '<', end - cursor);
+    tagEnd = tag ? memchr(tag, '>', end - tag) : NULL;
+    if (!tagEnd || !xmlTagIs(tag, tagEnd, "array") || tagEnd[-1] == '/') {
+        goto finish;
+    }
+    cursor = tagEnd + 1;
+
+    while (true) {
+        tag = memchr(cursor, '<', end - cursor);
+        tagEnd = tag ? memchr(tag, '>', end - tag) : NULL;
+        if (!tagEnd) {
+            goto finish;
+        }
+        if (tag[1] == '/' && xmlTagIs(tag, tagEnd, "array")) {
+            break;
+        }
+        if (!xmlTagIs(tag, tagEnd, "dict") || tagEnd[-1] == '/') {
+            goto finish;
+        }
+
+        dictEnd = scanPrelinkInfoKextDict(tag, end, &idStart, &idLength);
+        if (!dictEnd) {
+            goto finish;
+        }
+        cursor = dictEnd;
+
+        if (idStart) {
+            SAFE_RELEASE_NULL(kextID);
+            kextID = CFStringCreateWithBytesNoCopy(kCFAllocatorDefault,
+                (const UInt8 *)idStart, idLength, kCFStringEncodingUTF8,
+                /* isExternal */ false, kCFAllocatorNull);
+            if (!kextID) {
+                goto finish;
+            }
+            if (!CFSetContainsValue(toolArgs->kextIDs, kextID)) {
+                continue;
+            }
+        }
+
+       /* Unserialize just this entry; IOCFUnserialize() wants a C string.
+        */
+        dictLength = dictEnd - tag;
+        if (dictLength + 1 > xmlBufferSize) {
+            SAFE_FREE_NULL(xmlBuffer);
+            xmlBufferSize = dictLength + 1;
+            xmlBuffer = malloc(xmlBufferSize);
+            if (!xmlBuffer) {
+                OSKextLogMemError();
+                goto finish;
+            }
+        }
+        memcpy(xmlBuffer, tag, dictLength);
+        xmlBuffer[dictLength] = '\0';
+
+        SAFE_RELEASE_NULL(kextPlist);
+        kextPlist = (CFDictionaryRef)IOCFUnserialize(xmlBuffer,
+            kCFAllocatorDefault, /* options */ 0, /* errorString */ NULL);
+        if (!kextPlist || CFDictionaryGetTypeID() != CFGetTypeID(kextPlist)) {
+            goto finish;
+        }
+
+        if (!idStart && !CFSetContainsValue(toolArgs->kextIDs,
+            CFDictionaryGetValue(kextPlist, kCFBundleIdentifierKey))) {
+
+            continue;
+        }
+        CFArrayAppendValue(kextPlists, kextPlist);
+    }
+
+    result = true;
+
+    if (archInfo) {
+        printf("Listing info for architecture %s\n", archInfo->name);
+    }
+
+    count = CFArrayGetCount(kextPlists);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef aKextPlist = (CFDictionaryRef)CFArrayGetValueAtIndex(kextPlists, i);
+
+        printKextInfo(aKextPlist, toolArgs->verbose, toolArgs->printUUIDs,
+            getKextTextBytes(aKextPlist, prelinkTextBytes,
+                prelinkTextSourceAddress, prelinkTextSourceSize));
     }
 
 finish:
-    return;
+    SAFE_RELEASE(kextPlists);
+    SAFE_RELEASE(kextPlist);
+    SAFE_RELEASE(kextID);
+    SAFE_FREE(xmlBuffer);
+    return result;
 }
 
 /*******************************************************************************
@@ -460,8 +744,9 @@ void printKextInfo(CFDictionaryRef kextPlist, Boolean beVerbose, Boolean printUU
     uint64_t  kextExecutableSize = 0;
     uint64_t  kextKmodInfoAddress = 0x0;
 
+    CFDataRef uuidData;
+    const uint8_t *uuid = NULL;
     struct load_command *lcp;
-    struct uuid_command *uuid_cmd = NULL;
     uint32_t ncmds, cmd_i;
     
     if (!kextIdentifier || !kextVersion || !kextPath) {
@@ -483,7 +768,16 @@ void printKextInfo(CFDictionaryRef kextPlist, Boolean beVerbose, Boolean printUU
     if (NULL != (cfNum = CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkKmodInfoKey))))
         CFNumberGetValue(cfNum, kCFNumberSInt64Type, &kextKmodInfoAddress);
 
-    if (kextTextBytes) {
+   /* kextcache records each kext's UUID in the prelink info; only caches
+    * built without it need the kext's load commands read.
+    */
+    uuidData = (CFDataRef)CFDictionaryGetValue(kextPlist, CFSTR(kPrelinkExecutableUUIDKey));
+    if (uuidData && CFDataGetTypeID() == CFGetTypeID(uuidData) &&
+        CFDataGetLength(uuidData) == sizeof(uuid_t)) {
+        uuid = CFDataGetBytePtr(uuidData);
+    }
+
+    if (printUUIDs && !uuid && kextTextBytes) {
         if (ISMACHO64(MAGIC32(kextTextBytes))) {
             struct mach_header_64 *mhp64 = (struct mach_header_64 *)kextTextBytes;
             ncmds = mhp64->ncmds;
@@ -496,7 +790,7 @@ void printKextInfo(CFDictionaryRef kextPlist, Boolean beVerbose, Boolean printUU
 
         for (cmd_i = 0; cmd_i < ncmds; cmd_i++) {
             if (lcp->cmd == LC_UUID) {
-                uuid_cmd = (struct uuid_command *)lcp;
+                uuid = ((struct uuid_command *)lcp)->uuid;
                 break;
             }
             lcp = (struct load_command *)((uintptr_t)lcp + lcp->cmdsize);
@@ -505,10 +799,10 @@ void printKextInfo(CFDictionaryRef kextPlist, Boolean beVerbose, Boolean printUU
     
     if (printUUIDs) {
 
-        if (uuid_cmd) {
+        if (uuid) {
             uuid_string_t uuid_string;
 
-            uuid_unparse(*(uuid_t *)uuid_cmd->uuid, uuid_string);
+            uuid_unparse(uuid, uuid_string);
             printf("%s\t%s\t%s\t0x%llx\t0x%llx\t%s\n", idBuffer, versionBuffer, uuid_string, kextLoadAddress, kextExecutableSize, pathBuffer);
         } else {
             printf("%s\t%s\t\t\t\t%s\n", idBuffer, versionBuffer, pathBuffer);
@@ -75,6 +75,17 @@ void listPrelinkedKexts(KclistArgs * toolArgs,
                         uint64_t prelinkTextSourceAddress,
                         uint64_t prelinkTextSourceSize,
                         const NXArchInfo * archInfo);
+Boolean listPrelinkedKextsLazily(KclistArgs * toolArgs,
+                                 const char *prelinkInfoBytes,
+                                 size_t prelinkInfoSize,
+                                 const char *prelinkTextBytes,
+                                 uint64_t prelinkTextSourceAddress,
+                                 uint64_t prelinkTextSourceSize,
+                                 const NXArchInfo * archInfo);
+const char * getKextTextBytes(CFDictionaryRef kextPlist,
+                              const char *prelinkTextBytes,
+                              uint64_t prelinkTextSourceAddress,
+                              uint64_t prelinkTextSourceSize);
 void printKextInfo(CFDictionaryRef kextPlist,
                    Boolean beVerbose,
                    Boolean printUUIDs,
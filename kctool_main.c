@@ -86,7 +86,7 @@ int main(int argc, char * const argv[])
         toolArgs.archInfo = NXGetArchInfoFromCpuType(fat_arch->cputype, fat_arch->cpusubtype);
     }
     
-    rawKernelcache = readMachOSliceForArch(toolArgs.kernelcachePath, toolArgs.archInfo,
+    rawKernelcache = mapMachOSliceForArch(toolArgs.kernelcachePath, toolArgs.archInfo,
         /* checkArch */ FALSE);
     if (!rawKernelcache) {
         OSKextLog(/* kext */ NULL,
@@ -108,6 +108,7 @@ int main(int argc, char * const argv[])
     }
 
     toolArgs.kernelcacheImageBytes = CFDataGetBytePtr(kernelcacheImage);
+    toolArgs.kernelcacheImageLength = CFDataGetLength(kernelcacheImage);
     
     if (ISMACHO64(MAGIC32(toolArgs.kernelcacheImageBytes))) {
         prelinkInfoSect = (void *)macho_get_section_by_name_64(
@@ -144,7 +145,11 @@ int main(int argc, char * const argv[])
         goto finish;
     }
 
-    result = printKextInfo(&toolArgs);
+    if (toolArgs.queryMode) {
+        result = runQueries(&toolArgs);
+    } else {
+        result = printKextInfo(&toolArgs);
+    }
     if (result != EX_OK) {
         goto finish;
     }
@@ -203,6 +208,14 @@ ExitStatus readArgs(
                 usage(kUsageLevelFull);
                 result = kKctoolExitHelp;
                 goto finish;
+
+            case 0:
+                switch (longopt) {
+                    case kLongOptQuery:
+                        toolArgs->queryMode = true;
+                        break;
+                }
+                break;
     
             default:
                 OSKextLog(/* kext */ NULL,
@@ -224,7 +237,7 @@ ExitStatus readArgs(
     *argc -= optind;
     *argv += optind;
 
-    if (*argc != 4) {
+    if (*argc != (toolArgs->queryMode ? 1 : 4)) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "incorrect number of arguments");
@@ -235,6 +248,10 @@ ExitStatus readArgs(
     * Record remaining args from the command line.
     */
     toolArgs->kernelcachePath = (*argv)[0];
+    if (toolArgs->queryMode) {
+        result = EX_OK;
+        goto finish;
+    }
     toolArgs->kextID = CFStringCreateWithCString(kCFAllocatorDefault, (*argv)[1], kCFStringEncodingUTF8);
     if (!toolArgs->kextID) {
         OSKextLogMemError();
@@ -290,21 +307,37 @@ getSectionByName(const UInt8 *file, const char *segname, const char *sectname)
 
 /*******************************************************************************
 *******************************************************************************/
-ExitStatus printKextInfo(KctoolArgs * toolArgs)
+static CFArrayRef
+getKextPlistArray(CFPropertyListRef kernelcacheInfoPlist)
 {
-    ExitStatus result         = EX_SOFTWARE;
     CFArrayRef kextPlistArray = NULL;
-    CFIndex    i, count;
-    
-    if (CFArrayGetTypeID() == CFGetTypeID(toolArgs->kernelcacheInfoPlist)) {
-        kextPlistArray = (CFArrayRef)toolArgs->kernelcacheInfoPlist;
-    } else if (CFDictionaryGetTypeID() == CFGetTypeID(toolArgs->kernelcacheInfoPlist)){
-        kextPlistArray = (CFArrayRef)CFDictionaryGetValue(toolArgs->kernelcacheInfoPlist,
+
+    if (CFArrayGetTypeID() == CFGetTypeID(kernelcacheInfoPlist)) {
+        kextPlistArray = (CFArrayRef)kernelcacheInfoPlist;
+    } else if (CFDictionaryGetTypeID() == CFGetTypeID(kernelcacheInfoPlist)){
+        kextPlistArray = (CFArrayRef)CFDictionaryGetValue(kernelcacheInfoPlist,
             CFSTR("_PrelinkInfoDictionary"));
-    } else {
+    }
+
+    if (!kextPlistArray || CFArrayGetTypeID() != CFGetTypeID(kextPlistArray)) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "Unrecognized kernelcache plist data.");
+        kextPlistArray = NULL;
+    }
+    return kextPlistArray;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+ExitStatus printKextInfo(KctoolArgs * toolArgs)
+{
+    ExitStatus result         = EX_SOFTWARE;
+    CFArrayRef kextPlistArray = NULL;
+    CFIndex    i, count;
+    
+    kextPlistArray = getKextPlistArray(toolArgs->kernelcacheInfoPlist);
+    if (!kextPlistArray) {
         goto finish;
     }
     
@@ -438,6 +471,561 @@ finish:
     return result;
 }
 
+#pragma mark Query Mode
+/*******************************************************************************
+* With -query, kctool loads the kernelcache once and then answers queries read
+* from stdin, one per line, with one line each on stdout:
+*
+*   addr <address>
+*       -> <address> <bundle-id> <segment> <section> <offset>
+*   section <bundle-id> <segment> <section>
+*       -> <address> <file offset> <size>
+*
+* For addr, <offset> is from the start of the kext. Addresses outside every
+* kext are looked up in the kernel's own sections and reported with bundle-id
+* __kernel__ and an offset from the start of the section. A query that can't
+* be answered gets a single "-" so output stays in step with input.
+*******************************************************************************/
+#define kQueryCommandAddress   "addr"
+#define kQueryCommandSection   "section"
+#define kQuerySeparators       " \t\n"
+#define kQueryNoAnswer         "-"
+#define kQueryKernelID         "__kernel__"
+
+/*******************************************************************************
+*******************************************************************************/
+static int compareSectionEntries(const void * v1, const void * v2)
+{
+    const KctoolSectionEntry * entry1 = (const KctoolSectionEntry *)v1;
+    const KctoolSectionEntry * entry2 = (const KctoolSectionEntry *)v2;
+
+    if (entry1->addr != entry2->addr) {
+        return (entry1->addr < entry2->addr) ? -1 : 1;
+    }
+   /* Of sections starting together, put the biggest last so that
+    * findSectionForAddress() settles on it.
+    */
+    if (entry1->size != entry2->size) {
+        return (entry1->size < entry2->size) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static int compareKextEntries(const void * v1, const void * v2)
+{
+    const KctoolKextEntry * entry1 = (const KctoolKextEntry *)v1;
+    const KctoolKextEntry * entry2 = (const KctoolKextEntry *)v2;
+
+    if (entry1->addr != entry2->addr) {
+        return (entry1->addr < entry2->addr) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Collects the section headers of the mach-o at machO, which has at most
+* maxLength bytes of the image behind it, and sorts them by address.
+* baseOffset is added to each section's file offset.
+*******************************************************************************/
+static Boolean
+indexMachOSections(
+    const UInt8         * machO,
+    size_t                maxLength,
+    u_long                baseOffset,
+    KctoolSectionEntry ** sectionsOut,
+    CFIndex             * numSectionsOut)
+{
+    Boolean                result      = false;
+    Boolean                is64        = false;
+    KctoolSectionEntry   * sections    = NULL;  // must free
+    CFIndex                numSections = 0;
+    const struct load_command * cmdHeader = NULL;
+    size_t                 offset      = 0;
+    uint32_t               ncmds       = 0;
+    uint32_t               nsects      = 0;
+    uint32_t               i, j;
+    int                    pass;
+
+    *sectionsOut = NULL;
+    *numSectionsOut = 0;
+
+    if (maxLength < sizeof(struct mach_header_64)) {
+        goto finish;
+    }
+    is64 = ISMACHO64(MAGIC32(machO));
+    if (is64) {
+        ncmds = ((const struct mach_header_64 *)machO)->ncmds;
+    } else if (((const struct mach_header *)machO)->magic == MH_MAGIC) {
+        ncmds = ((const struct mach_header *)machO)->ncmds;
+    } else {
+        goto finish;
+    }
+
+   /* Count the sections, then fill them in.
+    */
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            sections = (KctoolSectionEntry *)calloc(numSections ? numSections : 1,
+                sizeof(*sections));
+            if (!sections) {
+                OSKextLogMemError();
+                goto finish;
+            }
+            numSections = 0;
+        }
+
+        offset = is64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+        for (i = 0; i < ncmds; i++, offset += cmdHeader->cmdsize) {
+            cmdHeader = (const struct load_command *)(machO + offset);
+            if (offset + sizeof(*cmdHeader) > maxLength ||
+                cmdHeader->cmdsize < sizeof(*cmdHeader) ||
+                offset + cmdHeader->cmdsize > maxLength) {
+
+                goto finish;
+            }
+
+            if (cmdHeader->cmd == LC_SEGMENT_64) {
+                const struct segment_command_64 * seg =
+                    (const struct segment_command_64 *)cmdHeader;
+                const struct section_64 * sect = (const struct section_64 *)(seg + 1);
+
+                nsects = seg->nsects;
+                if (sizeof(*seg) + nsects * sizeof(*sect) > cmdHeader->cmdsize) {
+                    goto finish;
+                }
+                for (j = 0; j < nsects; j++, sect++, numSections++) {
+                    if (pass == 0) {
+                        continue;
+                    }
+                    memcpy(sections[numSections].segname, sect->segname,
+                        sizeof(sections[numSections].segname));
+                    memcpy(sections[numSections].sectname, sect->sectname,
+                        sizeof(sections[numSections].sectname));
+                    sections[numSections].addr = sect->addr;
+                    sections[numSections].size = sect->size;
+                    sections[numSections].offset = baseOffset + sect->offset;
+                }
+            } else if (cmdHeader->cmd == LC_SEGMENT) {
+                const struct segment_command * seg =
+                    (const struct segment_command *)cmdHeader;
+                const struct section * sect = (const struct section *)(seg + 1);
+
+                nsects = seg->nsects;
+                if (sizeof(*seg) + nsects * sizeof(*sect) > cmdHeader->cmdsize) {
+                    goto finish;
+                }
+                for (j = 0; j < nsects; j++, sect++, numSections++) {
+                    if (pass == 0) {
+                        continue;
+                    }
+                    memcpy(sections[numSections].segname, sect->segname,
+                        sizeof(sections[numSections].segname));
+                    memcpy(sections[numSections].sectname, sect->sectname,
+                        sizeof(sections[numSections].sectname));
+                    sections[numSections].addr = sect->addr;
+                    sections[numSections].size = sect->size;
+                    sections[numSections].offset = baseOffset + sect->offset;
+                }
+            }
+        }
+    }
+
+    qsort(sections, numSections, sizeof(*sections), &compareSectionEntries);
+
+    *sectionsOut = sections;
+    *numSectionsOut = numSections;
+    sections = NULL;
+    result = true;
+
+finish:
+    SAFE_FREE(sections);
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static KctoolSectionEntry *
+findSectionForAddress(
+    KctoolSectionEntry * sections,
+    CFIndex              numSections,
+    uint64_t             address)
+{
+    CFIndex low  = 0;
+    CFIndex high = numSections;
+    CFIndex mid;
+
+   /* Find the last section starting at or below address.
+    */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (sections[mid].addr <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    if (address - sections[low - 1].addr >= sections[low - 1].size) {
+        return NULL;
+    }
+    return &sections[low - 1];
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static KctoolSectionEntry *
+findSectionByName(
+    KctoolSectionEntry * sections,
+    CFIndex              numSections,
+    const char         * segname,
+    const char         * sectname)
+{
+    CFIndex i;
+
+    for (i = 0; i < numSections; i++) {
+        if (!strncmp(sections[i].segname, segname, sizeof(sections[i].segname)) &&
+            !strncmp(sections[i].sectname, sectname, sizeof(sections[i].sectname))) {
+
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static KctoolKextEntry *
+findKextForAddress(KctoolIndex * index, uint64_t address)
+{
+    CFIndex low  = 0;
+    CFIndex high = index->numKexts;
+    CFIndex mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (index->kexts[mid].addr <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    if (address - index->kexts[low - 1].addr >= index->kexts[low - 1].size) {
+        return NULL;
+    }
+    return &index->kexts[low - 1];
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static Boolean
+indexKextSections(KctoolArgs * toolArgs, KctoolKextEntry * kext)
+{
+    if (!kext->sectionsIndexed) {
+        kext->sectionsIndexed = true;
+        if (!indexMachOSections(toolArgs->kernelcacheImageBytes + kext->machOOffset,
+            toolArgs->kernelcacheImageLength - kext->machOOffset,
+            kext->machOOffset, &kext->sections, &kext->numSections)) {
+
+            OSKextLogCFString(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                CFSTR("Can't read the mach-o header of kext %@."),
+                kext->kextID);
+        }
+    }
+    return kext->sections != NULL;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+ExitStatus createIndex(KctoolArgs * toolArgs, KctoolIndex * index)
+{
+    ExitStatus           result         = EX_SOFTWARE;
+    CFArrayRef           kextPlistArray = NULL;  // do not release
+    KctoolSectionEntry * prelinkText    = NULL;  // do not free
+    CFIndex              i, count;
+
+    bzero(index, sizeof(*index));
+
+    kextPlistArray = getKextPlistArray(toolArgs->kernelcacheInfoPlist);
+    if (!kextPlistArray) {
+        goto finish;
+    }
+
+    if (!indexMachOSections(toolArgs->kernelcacheImageBytes,
+        toolArgs->kernelcacheImageLength, /* baseOffset */ 0,
+        &index->kernelSections, &index->numKernelSections)) {
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Can't read the kernelcache's mach-o header.");
+        goto finish;
+    }
+
+    prelinkText = findSectionByName(index->kernelSections,
+        index->numKernelSections, kPrelinkTextSegment, kPrelinkTextSection);
+    if (!prelinkText) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Cannot find %s,%s in kernelcache.",
+            kPrelinkTextSegment, kPrelinkTextSection);
+        goto finish;
+    }
+
+    index->kextIndexByID = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, /* value callbacks */ NULL);
+    count = CFArrayGetCount(kextPlistArray);
+    index->kexts = (KctoolKextEntry *)calloc(count ? count : 1,
+        sizeof(*index->kexts));
+    if (!index->kextIndexByID || !index->kexts) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+   /* Codeless kexts and any whose executable lies outside the prelink text
+    * have nothing to look up, so they're left out.
+    */
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef   kextInfoDict = (CFDictionaryRef)CFArrayGetValueAtIndex(kextPlistArray, i);
+        CFStringRef       thisKextID   = NULL;  // do not release
+        KctoolKextEntry * kext         = &index->kexts[index->numKexts];
+
+        if (CFDictionaryGetTypeID() != CFGetTypeID(kextInfoDict)) {
+            continue;
+        }
+        thisKextID = CFDictionaryGetValue(kextInfoDict, kCFBundleIdentifierKey);
+        if (!thisKextID || CFStringGetTypeID() != CFGetTypeID(thisKextID) ||
+            !CFDictionaryGetValue(kextInfoDict, CFSTR(kPrelinkExecutableSourceKey))) {
+
+            continue;
+        }
+        if (!getKextAddressAndSize(kextInfoDict, &kext->addr, &kext->size)) {
+            continue;
+        }
+        if (kext->addr < prelinkText->addr ||
+            kext->addr - prelinkText->addr >= prelinkText->size) {
+
+            continue;
+        }
+
+        kext->kextID = thisKextID;
+        kext->machOOffset = (u_long)(prelinkText->offset +
+            (kext->addr - prelinkText->addr));
+        if (kext->machOOffset >= (u_long)toolArgs->kernelcacheImageLength) {
+            continue;
+        }
+        index->numKexts++;
+    }
+
+    qsort(index->kexts, index->numKexts, sizeof(*index->kexts),
+        &compareKextEntries);
+    for (i = 0; i < index->numKexts; i++) {
+        if (!CFDictionaryContainsKey(index->kextIndexByID, index->kexts[i].kextID)) {
+            CFDictionarySetValue(index->kextIndexByID, index->kexts[i].kextID,
+                (const void *)(uintptr_t)i);
+        }
+    }
+
+    result = EX_OK;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void freeIndex(KctoolIndex * index)
+{
+    CFIndex i;
+
+    if (index->kexts) {
+        for (i = 0; i < index->numKexts; i++) {
+            SAFE_FREE(index->kexts[i].sections);
+        }
+    }
+    SAFE_FREE_NULL(index->kexts);
+    SAFE_FREE_NULL(index->kernelSections);
+    SAFE_RELEASE_NULL(index->kextIndexByID);
+    index->numKexts = 0;
+    index->numKernelSections = 0;
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void
+answerAddressQuery(
+    KctoolArgs  * toolArgs,
+    KctoolIndex * index,
+    const char  * addressString)
+{
+    KctoolKextEntry    * kext     = NULL;  // do not free
+    KctoolSectionEntry * section  = NULL;  // do not free
+    char               * endptr   = NULL;
+    uint64_t             address  = 0;
+    char                 idBuffer[KMOD_MAX_NAME];
+
+    if (!addressString) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Missing address for %s query.", kQueryCommandAddress);
+        goto no_answer;
+    }
+
+    errno = 0;
+    address = strtoull(addressString, &endptr, 0);
+    if (errno || !*addressString || *endptr) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Invalid address %s.", addressString);
+        goto no_answer;
+    }
+
+    kext = findKextForAddress(index, address);
+    if (kext) {
+        if (indexKextSections(toolArgs, kext)) {
+            section = findSectionForAddress(kext->sections, kext->numSections,
+                address);
+        }
+        if (!CFStringGetCString(kext->kextID, idBuffer, sizeof(idBuffer),
+            kCFStringEncodingUTF8)) {
+
+            goto no_answer;
+        }
+        printf("%#llx %s %.16s %.16s %#llx\n", address, idBuffer,
+            section ? section->segname : kQueryNoAnswer,
+            section ? section->sectname : kQueryNoAnswer,
+            address - kext->addr);
+        return;
+    }
+
+    section = findSectionForAddress(index->kernelSections,
+        index->numKernelSections, address);
+    if (section) {
+        printf("%#llx %s %.16s %.16s %#llx\n", address, kQueryKernelID,
+            section->segname, section->sectname, address - section->addr);
+        return;
+    }
+
+no_answer:
+    printf("%s\n", kQueryNoAnswer);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void
+answerSectionQuery(
+    KctoolArgs  * toolArgs,
+    KctoolIndex * index,
+    const char  * kextIDString,
+    const char  * segmentName,
+    const char  * sectionName)
+{
+    CFStringRef          kextID   = NULL;  // must release
+    const void         * value    = NULL;
+    KctoolKextEntry    * kext     = NULL;  // do not free
+    KctoolSectionEntry * section  = NULL;  // do not free
+
+    if (!kextIDString || !segmentName || !sectionName) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Usage: %s bundle-id segment section", kQueryCommandSection);
+        goto finish;
+    }
+
+    kextID = CFStringCreateWithCString(kCFAllocatorDefault, kextIDString,
+        kCFStringEncodingUTF8);
+    if (!kextID) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (!CFDictionaryGetValueIfPresent(index->kextIndexByID, kextID, &value)) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Cannot find kext %s in kernelcache.", kextIDString);
+        goto finish;
+    }
+    kext = &index->kexts[(uintptr_t)value];
+
+    if (indexKextSections(toolArgs, kext)) {
+        section = findSectionByName(kext->sections, kext->numSections,
+            segmentName, sectionName);
+    }
+    if (!section) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Cannot find %s,%s in kext %s",
+            segmentName, sectionName, kextIDString);
+        goto finish;
+    }
+
+    printf("%#llx %#llx %#llx\n", section->addr, section->offset, section->size);
+
+finish:
+    if (!section) {
+        printf("%s\n", kQueryNoAnswer);
+    }
+    SAFE_RELEASE(kextID);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+ExitStatus runQueries(KctoolArgs * toolArgs)
+{
+    ExitStatus    result    = EX_SOFTWARE;
+    KctoolIndex   index;
+    char        * line      = NULL;  // must free
+    size_t        lineCap   = 0;
+    char        * lastToken = NULL;
+    char        * command   = NULL;
+    char        * arg1      = NULL;
+    char        * arg2      = NULL;
+    char        * arg3      = NULL;
+
+    result = createIndex(toolArgs, &index);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    while (getline(&line, &lineCap, stdin) != -1) {
+        command = strtok_r(line, kQuerySeparators, &lastToken);
+        if (!command) {
+            continue;  // blank lines get no answer
+        }
+        arg1 = strtok_r(NULL, kQuerySeparators, &lastToken);
+        arg2 = arg1 ? strtok_r(NULL, kQuerySeparators, &lastToken) : NULL;
+        arg3 = arg2 ? strtok_r(NULL, kQuerySeparators, &lastToken) : NULL;
+
+        if (!strcmp(command, kQueryCommandAddress)) {
+            answerAddressQuery(toolArgs, &index, arg1);
+        } else if (!strcmp(command, kQueryCommandSection)) {
+            answerSectionQuery(toolArgs, &index, arg1, arg2, arg3);
+        } else {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                "Unknown query %s.", command);
+            printf("%s\n", kQueryNoAnswer);
+        }
+        fflush(stdout);
+    }
+
+    result = EX_OK;
+
+finish:
+    freeIndex(&index);
+    SAFE_FREE(line);
+    return result;
+}
+
 /*******************************************************************************
 * usage()
 *******************************************************************************/
@@ -445,6 +1033,7 @@ void usage(UsageLevel usageLevel)
 {
     fprintf(stderr,
       "usage: %1$s [-arch archname] [--] kernelcache bundle-id segment section\n"
+      "usage: %1$s -query [-arch archname] [--] kernelcache\n"
       "usage: %1$s -help\n"
       "\n",
       progname);
@@ -461,6 +1050,12 @@ void usage(UsageLevel usageLevel)
     fprintf(stderr, "-%s <archname>:\n"
         "        list info for architecture <archname>\n",
         kOptNameArch);
+    fprintf(stderr, "-%s:\n"
+        "        read queries from stdin, one per line, and answer each on stdout:\n"
+        "        '%s <address>' prints the kext, segment, section, and offset\n"
+        "        of an address; '%s <bundle-id> <segment> <section>' prints\n"
+        "        the section's address, file offset, and size\n",
+        kOptNameQuery, kQueryCommandAddress, kQueryCommandSection);
     fprintf(stderr, "\n");
    
     fprintf(stderr, "-%s (-%c): print this message and exit\n",
@@ -36,19 +36,28 @@ enum {
 
 #define kOptArch   'a'
 
+#define kOptNameQuery   "query"
+
 #define kOptChars  "a:h"
 
+/* Options with no single-letter variant.  */
+// Do not use -1, that's getopt() end-of-args return value
+// and can cause confusion
+#define kLongOptQuery   (-2)
+
 int longopt = 0;
 
 struct option sOptInfo[] = {
     { kOptNameHelp,                  no_argument,        NULL,     kOptHelp },
     { kOptNameArch,                  required_argument,  NULL,     kOptArch },
+    { kOptNameQuery,                 no_argument,        &longopt, kLongOptQuery },
 
     { NULL, 0, NULL, 0 }  // sentinel to terminate list
 };
 
 typedef struct {
     const NXArchInfo * archInfo;
+    Boolean            queryMode;
 
     char             * kernelcachePath;
     CFStringRef        kextID;
@@ -56,10 +65,42 @@ typedef struct {
     const char       * sectionName;
     
     const UInt8      * kernelcacheImageBytes;
+    CFIndex            kernelcacheImageLength;
     CFPropertyListRef  kernelcacheInfoPlist;
 
 } KctoolArgs;
 
+/* The -query index, built once per kernelcache. Sections carry their file
+ * offset within the kernelcache image, and both the kernel's sections and
+ * the kexts are sorted by address for lookups. A kext's own sections are
+ * indexed the first time a query needs them.
+ */
+typedef struct {
+    char       segname[16];
+    char       sectname[16];
+    uint64_t   addr;
+    uint64_t   size;
+    uint64_t   offset;
+} KctoolSectionEntry;
+
+typedef struct {
+    CFStringRef          kextID;       // do not release, owned by the info plist
+    uint64_t             addr;
+    uint64_t             size;
+    u_long               machOOffset;  // of the kext's mach header in the image
+    Boolean              sectionsIndexed;
+    KctoolSectionEntry * sections;     // must free
+    CFIndex              numSections;
+} KctoolKextEntry;
+
+typedef struct {
+    KctoolSectionEntry     * kernelSections;     // must free
+    CFIndex                  numKernelSections;
+    KctoolKextEntry        * kexts;              // must free
+    CFIndex                  numKexts;
+    CFMutableDictionaryRef   kextIndexByID;      // must release
+} KctoolIndex;
+
 #pragma mark Function Prototypes
 /*******************************************************************************
 * Function Prototypes
@@ -71,6 +112,10 @@ ExitStatus readArgs(
 ExitStatus printKextInfo(KctoolArgs * toolArgs);
 Boolean getKextAddressAndSize(CFDictionaryRef infoDict, uint64_t *addr, uint64_t *size);
 
+ExitStatus runQueries(KctoolArgs * toolArgs);
+ExitStatus createIndex(KctoolArgs * toolArgs, KctoolIndex * index);
+void freeIndex(KctoolIndex * index);
+
 void usage(UsageLevel usageLevel);
 
 #endif /* _KCTOOL_MAIN_H */
@@ -27,13 +27,39 @@ size_t lzvn_encode_work_size(void);
 
 #include <mach-o/arch.h>
 #include <mach-o/fat.h>
+#include <mach-o/loader.h>
 #include <mach-o/swap.h>
 #include <sys/mman.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <pthread.h>
 
+#include <System/libkern/prelink.h>
+#include <IOKit/IOCFSerialize.h>
+#include <IOKit/IOCFUnserialize.h>
 #include <IOKit/kext/OSKext.h>
 #include <IOKit/kext/OSKextPrivate.h>
+#include <IOKit/kext/macho_util.h>
 #include <libgen.h> // dirname()
 
+static size_t compressBlock(
+    uint32_t        compressionType,
+    u_int8_t      * dst,
+    size_t          dstlen,
+    const u_int8_t * src,
+    size_t          srclen);
+static size_t uncompressBlock(
+    uint32_t        compressionType,
+    u_int8_t      * dst,
+    size_t          dstlen,
+    const u_int8_t * src,
+    size_t          srclen);
+static Boolean uncompressChunkedBlocks(
+    const PrelinkedKernelHeader * prelinkHeader,
+    CFIndex                       prelinkLength,
+    u_int8_t                    * buf,
+    size_t                        bufsize);
+
 /*******************************************************************************
 *******************************************************************************/
 ExitStatus
@@ -72,42 +98,85 @@ writeFatFileWithValidation(
                            const struct timeval        fileTimes[2])
 {
     ExitStatus        result               = EX_SOFTWARE;
-    char              tmpPath[PATH_MAX];
-    struct fat_header fatHeader;
-    struct fat_arch   fatArch;
-    CFDataRef         sliceData            = NULL;    // do not release
-    const uint8_t   * sliceDataPtr         = NULL;    // do not free
-    const char *      tmpPathPtr           = tmpPath; // must unlink
-    const NXArchInfo * targetArch          = NULL;    // do not free
-    mode_t             procMode            = 0;
-    uint32_t          fatOffset            = 0;
-    uint32_t          sliceLength          = 0;
-    int               fileDescriptor       = -1;      // must close
-    int               numArchs             = 0;
-    int               i                    = 0;
-    int               from_dir_fd          = -1;
-    int               to_dir_fd            = -1;
-    char              from_base_name[64];
-    char *            from_base_name_ptr    = &from_base_name[0];
-    size_t            from_base_name_size   = 0;
-    char              to_base_name[64];
-    char *            to_base_name_ptr      = &to_base_name[0];
-    size_t            to_base_name_size     = 0;
-    
-    /* Make the temporary file */
-    
-    strlcpy(tmpPath, filePath, sizeof(tmpPath));
-    if (strlcat(tmpPath, ".XXXX", sizeof(tmpPath)) >= sizeof(tmpPath)) {
+    FatFileWriter     writer;
+    CFIndex           i                    = 0;
+
+    result = openFatFileWriter(&writer, filePath, fileArchs, fileMode);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    for (i = 0; i < CFArrayGetCount(fileSlices); i++) {
+        result = appendFatFileSlice(&writer,
+                                    CFArrayGetValueAtIndex(fileSlices, i));
+        if (result != EX_OK) {
+            abortFatFileWriter(&writer);
+            goto finish;
+        }
+    }
+
+    result = finishFatFileWriter(&writer, doValidation,
+                                 file_dev_t, file_ino_t, fileTimes);
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+ * Starts a fat file at a temporary path next to filePath, one slice per arch
+ * in fileArchs.  The fat headers are reserved but not written until
+ * finishFatFileWriter(), since a slice's offset and size aren't known until
+ * the slices before it have been appended.  Every writer that opens must be
+ * finished or aborted.
+ *******************************************************************************/
+ExitStatus
+openFatFileWriter(
+                  FatFileWriter             * writer,
+                  const char                * filePath,
+                  CFArrayRef                  fileArchs,
+                  mode_t                      fileMode)
+{
+    ExitStatus        result               = EX_SOFTWARE;
+    mode_t            procMode             = 0;
+    uint32_t          i                    = 0;
+
+    bzero(writer, sizeof(*writer));
+    writer->fileDescriptor = -1;
+
+    if (strlcpy(writer->filePath, filePath, sizeof(writer->filePath)) >=
+            sizeof(writer->filePath) ||
+        strlcpy(writer->tmpPath, filePath, sizeof(writer->tmpPath)) >=
+            sizeof(writer->tmpPath) ||
+        strlcat(writer->tmpPath, ".XXXX", sizeof(writer->tmpPath)) >=
+            sizeof(writer->tmpPath)) {
+
         OSKextLogStringError(/* kext */ NULL);
         goto finish;
     }
+
+    writer->numArchs = (uint32_t)CFArrayGetCount(fileArchs);
+    writer->fatArchs = calloc(writer->numArchs, sizeof(*writer->fatArchs));
+    if (writer->numArchs && !writer->fatArchs) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+    for (i = 0; i < writer->numArchs; i++) {
+        const NXArchInfo * targetArch = CFArrayGetValueAtIndex(fileArchs, i);
+
+        writer->fatArchs[i].cputype = targetArch->cputype;
+        writer->fatArchs[i].cpusubtype = targetArch->cpusubtype;
+    }
+    
+    /* Make the temporary file */
     
-    fileDescriptor = mkstemp(tmpPath);
-    if (-1 == fileDescriptor) {
+    writer->fileDescriptor = mkstemp(writer->tmpPath);
+    if (-1 == writer->fileDescriptor) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
                   "Can't create %s - %s.",
-                  tmpPath, strerror(errno));
+                  writer->tmpPath, strerror(errno));
+        writer->tmpPath[0] = '\0';
         goto finish;
     }
     
@@ -119,61 +188,135 @@ writeFatFileWithValidation(
     procMode = umask(0);
     umask(procMode);
     
-    if (-1 == fchmod(fileDescriptor, fileMode & ~procMode)) {
+    if (-1 == fchmod(writer->fileDescriptor, fileMode & ~procMode)) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
                   "Can't set permissions on %s - %s.",
-                  tmpPathPtr, strerror(errno));
+                  writer->tmpPath, strerror(errno));
     }
-    
+
     /* Write out the fat headers even if there's only one arch so we know what
-     * arch a compressed prelinked kernel belongs to.
+     * arch a compressed prelinked kernel belongs to.  The slices start right
+     * after them.
      */
-    
-    numArchs = (int)CFArrayGetCount(fileArchs);
+    writer->nextOffset = sizeof(struct fat_header) +
+        (sizeof(struct fat_arch) * writer->numArchs);
+    if (lseek(writer->fileDescriptor, writer->nextOffset, SEEK_SET) == -1) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "Can't seek in %s - %s.",
+                  writer->tmpPath, strerror(errno));
+        goto finish;
+    }
+
+    result = EX_OK;
+
+finish:
+    if (result != EX_OK) {
+        abortFatFileWriter(writer);
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * Writes the next slice, in the arch order given to openFatFileWriter().
+ * The caller may release the slice as soon as this returns.
+ *******************************************************************************/
+ExitStatus
+appendFatFileSlice(
+                   FatFileWriter             * writer,
+                   CFDataRef                   sliceData)
+{
+    ExitStatus        result               = EX_SOFTWARE;
+    uint32_t          sliceLength          = 0;
+
+    if (writer->fileDescriptor < 0 || writer->nextSlice >= writer->numArchs) {
+        goto finish;
+    }
+
+    sliceLength = (uint32_t)CFDataGetLength(sliceData);
+    result = writeToFile(writer->fileDescriptor,
+                         CFDataGetBytePtr(sliceData), sliceLength);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    writer->fatArchs[writer->nextSlice].offset = writer->nextOffset;
+    writer->fatArchs[writer->nextSlice].size = sliceLength;
+    writer->nextSlice++;
+    writer->nextOffset += sliceLength;
+    writer->bytesWritten += sliceLength;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+ * Fills in the fat headers and moves the file to its final path.  With
+ * doValidation, the file being replaced must still be the one at
+ * file_dev_t/file_ino_t.  The writer is closed whether or not this succeeds.
+ *******************************************************************************/
+ExitStatus
+finishFatFileWriter(
+                    FatFileWriter             * writer,
+                    boolean_t                   doValidation,
+                    dev_t                       file_dev_t,
+                    ino_t                       file_ino_t,
+                    const struct timeval        fileTimes[2])
+{
+    ExitStatus        result               = EX_SOFTWARE;
+    struct fat_header fatHeader;
+    struct fat_arch   fatArch;
+    const char *      filePath             = writer->filePath;
+    const char *      tmpPathPtr           = writer->tmpPath;
+    uint32_t          i                    = 0;
+    int               from_dir_fd          = -1;
+    int               to_dir_fd            = -1;
+    char              from_base_name[64];
+    char *            from_base_name_ptr    = &from_base_name[0];
+    size_t            from_base_name_size   = 0;
+    char              to_base_name[64];
+    char *            to_base_name_ptr      = &to_base_name[0];
+    size_t            to_base_name_size     = 0;
+
+    if (writer->fileDescriptor < 0 || writer->nextSlice != writer->numArchs) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "Fat file %s is missing slices.", filePath);
+        goto finish;
+    }
+
+    if (lseek(writer->fileDescriptor, 0, SEEK_SET) == -1) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "Can't seek in %s - %s.",
+                  tmpPathPtr, strerror(errno));
+        goto finish;
+    }
+
     fatHeader.magic = OSSwapHostToBigInt32(FAT_MAGIC);
-    fatHeader.nfat_arch = OSSwapHostToBigInt32(numArchs);
+    fatHeader.nfat_arch = OSSwapHostToBigInt32(writer->numArchs);
     
-    result = writeToFile(fileDescriptor, (const UInt8 *)&fatHeader,
+    result = writeToFile(writer->fileDescriptor, (const UInt8 *)&fatHeader,
                          sizeof(fatHeader));
     if (result != EX_OK) {
         goto finish;
     }
     
-    fatOffset = sizeof(struct fat_header) +
-    (sizeof(struct fat_arch) * numArchs);
-    
-    for (i = 0; i < numArchs; i++) {
-        targetArch = CFArrayGetValueAtIndex(fileArchs, i);
-        sliceData = CFArrayGetValueAtIndex(fileSlices, i);
-        sliceLength = (uint32_t)CFDataGetLength(sliceData);
-        
-        fatArch.cputype = OSSwapHostToBigInt32(targetArch->cputype);
-        fatArch.cpusubtype = OSSwapHostToBigInt32(targetArch->cpusubtype);
-        fatArch.offset = OSSwapHostToBigInt32(fatOffset);
-        fatArch.size = OSSwapHostToBigInt32(sliceLength);
+    for (i = 0; i < writer->numArchs; i++) {
+        fatArch.cputype = OSSwapHostToBigInt32(writer->fatArchs[i].cputype);
+        fatArch.cpusubtype = OSSwapHostToBigInt32(writer->fatArchs[i].cpusubtype);
+        fatArch.offset = OSSwapHostToBigInt32(writer->fatArchs[i].offset);
+        fatArch.size = OSSwapHostToBigInt32(writer->fatArchs[i].size);
         fatArch.align = OSSwapHostToBigInt32(0);
         
-        result = writeToFile(fileDescriptor,
+        result = writeToFile(writer->fileDescriptor,
                              (UInt8 *)&fatArch, sizeof(fatArch));
         if (result != EX_OK) {
             goto finish;
         }
-        
-        fatOffset += sliceLength;
-    }
-    
-    /* Write out the file slices */
-    for (i = 0; i < numArchs; i++) {
-        sliceData = CFArrayGetValueAtIndex(fileSlices, i);
-        sliceDataPtr = CFDataGetBytePtr(sliceData);
-        sliceLength = (uint32_t)CFDataGetLength(sliceData);
-        
-        result = writeToFile(fileDescriptor, sliceDataPtr, sliceLength);
-        if (result != EX_OK) {
-            goto finish;
-        }
     }
+    result = EX_SOFTWARE;
     
     from_base_name_size = strlen(basename((char *)tmpPathPtr)) + 1;
     if (from_base_name_size > sizeof(from_base_name)) {
@@ -245,7 +388,7 @@ writeFatFileWithValidation(
         result = EX_OSERR;
         goto finish;
     }
-    tmpPathPtr = NULL;
+    writer->tmpPath[0] = '\0';  // nothing left to unlink
     
     /* Update the file's mod time if necessary */
     if (utimes(filePath, fileTimes)) {
@@ -253,11 +396,10 @@ writeFatFileWithValidation(
                   kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
                   "Can't update mod time of %s - %s.", filePath, strerror(errno));
     }
+    result = EX_OK;
     
 finish:
     
-    if (fileDescriptor >= 0) (void)close(fileDescriptor);
-    if (tmpPathPtr) unlink(tmpPathPtr);
     if (from_dir_fd != -1) {
         close(from_dir_fd);
     }
@@ -270,10 +412,30 @@ finish:
     if (to_base_name_ptr != NULL && to_base_name_ptr != &to_base_name[0]) {
         free(to_base_name_ptr);
     }
+    abortFatFileWriter(writer);
     
     return result;
 }
 
+/*******************************************************************************
+ * Closes the writer and removes its temporary file if it wasn't finished.
+ * Safe to call more than once.
+ *******************************************************************************/
+void
+abortFatFileWriter(
+                   FatFileWriter             * writer)
+{
+    if (writer->fileDescriptor >= 0) {
+        (void)close(writer->fileDescriptor);
+        writer->fileDescriptor = -1;
+    }
+    if (writer->tmpPath[0]) {
+        unlink(writer->tmpPath);
+        writer->tmpPath[0] = '\0';
+    }
+    SAFE_FREE_NULL(writer->fatArchs);
+}
+
 /*******************************************************************************
 *******************************************************************************/
 void *
@@ -542,13 +704,14 @@ finish:
 
 /*******************************************************************************
 *******************************************************************************/
-ExitStatus
-readMachOSlices(
+static ExitStatus
+copyMachOSlices(
     const char        * filePath,
     CFMutableArrayRef * slicesOut,
     CFMutableArrayRef * archsOut,
     mode_t            * modeOut,
-    struct timeval      machOTimesOut[2])
+    struct timeval      machOTimesOut[2],
+    Boolean             mapSlices)
 {
     struct stat         statBuf;
     ExitStatus          result          = EX_SOFTWARE;
@@ -594,8 +757,9 @@ readMachOSlices(
     fatArch = getFirstFatArch(headerPage);
     if (fatArch) {
         while (fatArch) {
-            sliceData = readMachOSlice(fileDescriptor,
-                fatArch->offset, fatArch->size);
+            sliceData = mapSlices ?
+                mapMachOSlice(fileDescriptor, fatArch->offset, fatArch->size) :
+                readMachOSlice(fileDescriptor, fatArch->offset, fatArch->size);
             if (!sliceData) goto finish;
 
             CFArrayAppendValue(fileSlices, sliceData);
@@ -604,7 +768,9 @@ readMachOSlices(
             sliceData = NULL;
         }
     } else {
-        sliceData = readMachOSlice(fileDescriptor, 0, (size_t)statBuf.st_size);
+        sliceData = mapSlices ?
+            mapMachOSlice(fileDescriptor, 0, (size_t)statBuf.st_size) :
+            readMachOSlice(fileDescriptor, 0, (size_t)statBuf.st_size);
         if (!sliceData) goto finish;
 
         CFArrayAppendValue(fileSlices, sliceData);
@@ -641,11 +807,41 @@ finish:
 
 /*******************************************************************************
 *******************************************************************************/
-CFDataRef 
-readMachOSliceForArch(
+ExitStatus
+readMachOSlices(
+    const char        * filePath,
+    CFMutableArrayRef * slicesOut,
+    CFMutableArrayRef * archsOut,
+    mode_t            * modeOut,
+    struct timeval      machOTimesOut[2])
+{
+    return copyMachOSlices(filePath, slicesOut, archsOut, modeOut,
+        machOTimesOut, /* mapSlices */ FALSE);
+}
+
+/*******************************************************************************
+* Like readMachOSlices(), but the slices are mapped with mapMachOSlice().
+*******************************************************************************/
+ExitStatus
+mapMachOSlices(
+    const char        * filePath,
+    CFMutableArrayRef * slicesOut,
+    CFMutableArrayRef * archsOut,
+    mode_t            * modeOut,
+    struct timeval      machOTimesOut[2])
+{
+    return copyMachOSlices(filePath, slicesOut, archsOut, modeOut,
+        machOTimesOut, /* mapSlices */ TRUE);
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static CFDataRef 
+copyMachOSliceForArch(
     const char        * filePath,
     const NXArchInfo  * archInfo,
-    Boolean             checkArch)
+    Boolean             checkArch,
+    Boolean             mapSlice)
 {   
     CFDataRef           result          = NULL; // must release
     CFDataRef           fileData        = NULL; // must release
@@ -699,8 +895,9 @@ readMachOSliceForArch(
 
     /* Read the file */    
 
-    fileData = readMachOSlice(fileDescriptor, fileSliceOffset, 
-        fileSliceSize);
+    fileData = mapSlice ?
+        mapMachOSlice(fileDescriptor, fileSliceOffset, fileSliceSize) :
+        readMachOSlice(fileDescriptor, fileSliceOffset, fileSliceSize);
     if (!fileData) {
         goto finish;
     }
@@ -725,6 +922,31 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+*******************************************************************************/
+CFDataRef 
+readMachOSliceForArch(
+    const char        * filePath,
+    const NXArchInfo  * archInfo,
+    Boolean             checkArch)
+{
+    return copyMachOSliceForArch(filePath, archInfo, checkArch,
+        /* mapSlice */ FALSE);
+}
+
+/*******************************************************************************
+* Like readMachOSliceForArch(), but the slice is mapped with mapMachOSlice().
+*******************************************************************************/
+CFDataRef 
+mapMachOSliceForArch(
+    const char        * filePath,
+    const NXArchInfo  * archInfo,
+    Boolean             checkArch)
+{
+    return copyMachOSliceForArch(filePath, archInfo, checkArch,
+        /* mapSlice */ TRUE);
+}
+
 /*******************************************************************************
 *******************************************************************************/
 CFDataRef 
@@ -787,6 +1009,84 @@ finish:
     return fileData;
 }
 
+/*******************************************************************************
+* Returns a no-copy CFData over the slice at fileOffset, backed by a private
+* mapping of the file (see createCFDataFromMappedRange()), so callers that
+* only look at part of a large kernel or kernelcache don't have to read all
+* of it.  Pages are copy-on-write, so the data may be treated like one from
+* readMachOSlice().  Falls back to readMachOSlice() if the file can't be
+* mapped.
+*******************************************************************************/
+CFDataRef
+mapMachOSlice(
+    int         fileDescriptor,
+    off_t       fileOffset,
+    size_t      fileSliceSize)
+{
+    CFDataRef               fileData    = NULL;  // do not release
+
+    fileData = createCFDataFromMappedRange(fileDescriptor, fileOffset,
+        fileSliceSize);
+    if (!fileData) {
+        fileData = readMachOSlice(fileDescriptor, fileOffset, fileSliceSize);
+    }
+
+    return fileData;
+}
+
+/*******************************************************************************
+* Copies the LC_UUID of a thin, host-endian Mach-O image into uuidOut.
+* Returns false if the image has no UUID or its load commands are truncated.
+*******************************************************************************/
+Boolean
+getMachOUUID(
+    const UInt8      * fileBuf,
+    size_t             size,
+    uuid_t             uuidOut)
+{
+    Boolean               result   = false;
+    struct mach_header  * machHdr  = (struct mach_header *)fileBuf;
+    struct load_command * lcp      = NULL;  // do not free
+    const UInt8         * cmdsEnd  = NULL;  // do not free
+    uint32_t              ncmds    = 0;
+    uint32_t              i        = 0;
+
+    if (size < sizeof(struct mach_header_64)) {
+        goto finish;
+    }
+
+    if (machHdr->magic == MH_MAGIC_64) {
+        struct mach_header_64 * machHdr64 = (struct mach_header_64 *)fileBuf;
+        lcp = (struct load_command *)(void *)(machHdr64 + 1);
+    } else if (machHdr->magic == MH_MAGIC) {
+        lcp = (struct load_command *)(void *)(machHdr + 1);
+    } else {
+        goto finish;
+    }
+    ncmds = machHdr->ncmds;
+    cmdsEnd = (const UInt8 *)lcp + machHdr->sizeofcmds;
+    if (cmdsEnd > fileBuf + size) {
+        goto finish;
+    }
+
+    for (i = 0; i < ncmds; i++) {
+        if ((const UInt8 *)lcp + sizeof(*lcp) > cmdsEnd ||
+            lcp->cmdsize < sizeof(*lcp) ||
+            (const UInt8 *)lcp + lcp->cmdsize > cmdsEnd) {
+            goto finish;
+        }
+        if (lcp->cmd == LC_UUID && lcp->cmdsize >= sizeof(struct uuid_command)) {
+            uuid_copy(uuidOut, ((struct uuid_command *)lcp)->uuid);
+            result = true;
+            goto finish;
+        }
+        lcp = (struct load_command *)((uintptr_t)lcp + lcp->cmdsize);
+    }
+
+finish:
+    return result;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 int 
@@ -872,7 +1172,8 @@ uncompressPrelinkedSlice(
     }
 
     if ( !(prelinkHeader->compressType == OSSwapHostToBigInt32(COMP_TYPE_LZSS) ||
-           prelinkHeader->compressType == OSSwapHostToBigInt32(COMP_TYPE_FASTLIB)) ) {
+           prelinkHeader->compressType == OSSwapHostToBigInt32(COMP_TYPE_FASTLIB) ||
+           prelinkHeader->compressType == OSSwapHostToBigInt32(COMP_TYPE_CHUNKED)) ) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
                   "Compressed prelinked kernel has invalid compressType: 0x%x.",
@@ -911,6 +1212,13 @@ uncompressPrelinkedSlice(
                                  ((u_int8_t *)(CFDataGetBytePtr(prelinkImage))) + sizeof(*prelinkHeader),
                                  (CFDataGetLength(prelinkImage) - sizeof(*prelinkHeader)));
     }
+    else if (prelinkHeader->compressType == OSSwapHostToBigInt32(COMP_TYPE_CHUNKED)) {
+        if (!uncompressChunkedBlocks(prelinkHeader,
+                CFDataGetLength(prelinkImage), buf, bufsize)) {
+            goto finish;
+        }
+        uncompsize = bufsize;
+    }
     else {
         goto finish;
     }
@@ -1050,62 +1358,610 @@ finish:
     return result;
 }
 
-/*******************************************************************************
-*******************************************************************************/
-ExitStatus
-writePrelinkedSymbols(
-    CFURLRef    symbolDirURL,
-    CFArrayRef  prelinkSymbols,
-    CFArrayRef  prelinkArchs)
+/*********************************************************************
+ * Compresses one buffer with the given codec, returning the compressed
+ * size or 0 on failure.  Safe to call from several threads at once.
+ *********************************************************************/
+static size_t
+compressBlock(
+    uint32_t          compressionType,
+    u_int8_t        * dst,
+    size_t            dstlen,
+    const u_int8_t  * src,
+    size_t            srclen)
 {
-    SaveFileContext saveFileContext;
-    ExitStatus          result          = EX_SOFTWARE;
-    CFDictionaryRef     sliceSymbols    = NULL; // do not release
-    CFURLRef            saveDirURL      = NULL; // must release
-    const NXArchInfo  * archInfo        = NULL; // do not free
-    CFIndex             numArchs        = 0;
-    CFIndex             i               = 0;
-
-    saveFileContext.overwrite = true;
-    saveFileContext.fatal = false;
-    numArchs = CFArrayGetCount(prelinkArchs);
-
-    for (i = 0; i < numArchs; ++i) {
-        archInfo = CFArrayGetValueAtIndex(prelinkArchs, i);
-        sliceSymbols = CFArrayGetValueAtIndex(prelinkSymbols, i);
-
-        SAFE_RELEASE_NULL(saveDirURL);
+    size_t      result      = 0;
+    u_int8_t  * dstend      = NULL;  // do not free
+    void      * work_space  = NULL;  // must free
 
-        /* We don't need arch-specific directories if there's only one arch */
-        if (numArchs == 1) {
-            saveDirURL = CFRetain(symbolDirURL);
-        } else {
-            saveDirURL = CFURLCreateFromFileSystemRepresentationRelativeToBase(
-                kCFAllocatorDefault, (const UInt8 *) archInfo->name, 
-                strlen(archInfo->name), /* isDirectory */ true, symbolDirURL);
-            if (!saveDirURL) {
-                goto finish;
-            }
+    if (compressionType == COMP_TYPE_FASTLIB) {
+        work_space = malloc(lzvn_encode_work_size());
+        if (work_space) {
+            result = lzvn_encode(dst, dstlen, src, srclen, work_space);
         }
-
-        result = makeDirectoryWithURL(saveDirURL);
-        if (result != EX_OK) {
-            goto finish;
+    } else if (compressionType == COMP_TYPE_LZSS) {
+        dstend = compress_lzss(dst, (u_int32_t)dstlen,
+                               (u_int8_t *)src, (u_int32_t)srclen);
+        if (dstend) {
+            result = dstend - dst;
         }
+    }
 
-        saveFileContext.saveDirURL = saveDirURL;
+    SAFE_FREE(work_space);
+    return result;
+}
 
-        CFDictionaryApplyFunction(sliceSymbols, &saveFile, 
-            &saveFileContext);
-        if (saveFileContext.fatal) {
-            goto finish;
+/*********************************************************************
+ *********************************************************************/
+static size_t
+uncompressBlock(
+    uint32_t          compressionType,
+    u_int8_t        * dst,
+    size_t            dstlen,
+    const u_int8_t  * src,
+    size_t            srclen)
+{
+    size_t result = 0;
+
+    if (compressionType == COMP_TYPE_FASTLIB) {
+        result = lzvn_decode(dst, dstlen, src, srclen);
+    } else if (compressionType == COMP_TYPE_LZSS) {
+        result = decompress_lzss(dst, (u_int32_t)dstlen,
+                                 (u_int8_t *)src, (u_int32_t)srclen);
+    }
+    return result;
+}
+
+/*********************************************************************
+ * Decodes the blocks of a COMP_TYPE_CHUNKED slice into buf, in parallel.
+ * Every index entry is bounds-checked before any block is touched.
+ *********************************************************************/
+static Boolean
+uncompressChunkedBlocks(
+    const PrelinkedKernelHeader * prelinkHeader,
+    CFIndex                       prelinkLength,
+    u_int8_t                    * buf,
+    size_t                        bufsize)
+{
+    Boolean                     result     = false;
+    const ChunkedBlockEntry   * blockIndex = NULL;  // do not free
+    const u_int8_t            * blockData  = NULL;  // do not free
+    __block Boolean             blockError = false;
+    uint32_t                    codec      = 0;
+    size_t                      blockSize  = 0;
+    size_t                      numBlocks  = 0;
+    size_t                      payloadLen = 0;
+    size_t                      i          = 0;
+
+    codec = OSSwapBigToHostInt32(prelinkHeader->reserved[kChunkedCodecIndex]);
+    blockSize = OSSwapBigToHostInt32(prelinkHeader->reserved[kChunkedBlockSizeIndex]);
+    numBlocks = OSSwapBigToHostInt32(prelinkHeader->reserved[kChunkedNumBlocksIndex]);
+
+    if (codec != COMP_TYPE_LZSS && codec != COMP_TYPE_FASTLIB) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                  "Chunked prelinked kernel has invalid block compressType: 0x%x.",
+                  codec);
+        goto finish;
+    }
+    if (!blockSize || numBlocks != (bufsize + blockSize - 1) / blockSize ||
+        prelinkLength < (CFIndex)sizeof(*prelinkHeader) ||
+        (size_t)(prelinkLength - sizeof(*prelinkHeader)) / sizeof(*blockIndex) < numBlocks) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                  "Chunked prelinked kernel has an invalid block index.");
+        goto finish;
+    }
+
+    blockIndex = (const ChunkedBlockEntry *)prelinkHeader->data;
+    blockData = (const u_int8_t *)&blockIndex[numBlocks];
+    payloadLen = prelinkLength - sizeof(*prelinkHeader) -
+        (numBlocks * sizeof(*blockIndex));
+
+    for (i = 0; i < numBlocks; i++) {
+        size_t offset = OSSwapBigToHostInt32(blockIndex[i].offset);
+        size_t length = OSSwapBigToHostInt32(blockIndex[i].compressedSize);
+
+        if (offset > payloadLen || length > payloadLen - offset) {
+            OSKextLog(/* kext */ NULL,
+                      kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                      "Chunked prelinked kernel block %zu is out of bounds.", i);
+            goto finish;
+        }
+    }
+
+    dispatch_apply(numBlocks,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+        ^(size_t block) {
+            size_t    start    = block * blockSize;
+            size_t    expected = MIN(blockSize, bufsize - start);
+            size_t    offset   = OSSwapBigToHostInt32(blockIndex[block].offset);
+            size_t    length   = OSSwapBigToHostInt32(blockIndex[block].compressedSize);
+
+            if (uncompressBlock(codec, buf + start, expected,
+                    blockData + offset, length) != expected) {
+                blockError = true;
+            }
+        });
+
+    if (blockError) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                  "Chunked prelinked kernel block uncompressed to an unexpected size.");
+        goto finish;
+    }
+
+    result = true;
+
+finish:
+    return result;
+}
+
+/*********************************************************************
+ * Compresses a prelinked kernel slice as independent blocks of blockSize
+ * bytes (see ChunkedBlockEntry in kernelcache.h).  The blocks are encoded
+ * in parallel while this thread computes the checksum of the whole slice.
+ *********************************************************************/
+CFDataRef
+compressPrelinkedSliceChunked(
+                       uint32_t            compressionType,
+                       CFDataRef           prelinkImage,
+                       Boolean             hasRelocs,
+                       uint32_t            blockSize)
+{
+    CFDataRef               result          = NULL;
+    CFMutableDataRef        compressedImage = NULL;  // must release
+    PrelinkedKernelHeader * kernelHeader    = NULL;  // do not free
+    const PrelinkedKernelHeader * kernelHeaderIn = NULL; // do not free
+    ChunkedBlockEntry     * blockIndex      = NULL;  // do not free
+    u_int8_t             ** blockBufs       = NULL;  // must free each
+    size_t                * blockSizes      = NULL;  // must free
+    const u_int8_t        * src             = NULL;  // do not free
+    dispatch_group_t        encodeGroup     = NULL;  // must release
+    unsigned char         * buf             = NULL;  // do not free
+    size_t                  srclen          = 0;
+    size_t                  numBlocks       = 0;
+    size_t                  blockBufSize    = 0;
+    size_t                  indexSize       = 0;
+    size_t                  payloadSize     = 0;
+    size_t                  i               = 0;
+    uint32_t                adler32         = 0;
+
+    /* Check that the kernel is not already compressed */
+
+    kernelHeaderIn = (const PrelinkedKernelHeader *) 
+        CFDataGetBytePtr(prelinkImage);
+    if (kernelHeaderIn->signature == OSSwapHostToBigInt('comp')) {
+        OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                "Prelinked kernel is already compressed.");
+        goto finish;
+    }
+
+    if (compressionType != COMP_TYPE_FASTLIB &&
+        compressionType != COMP_TYPE_LZSS) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                  "Unrecognized compression algorithm.");
+        goto finish;
+    }
+
+    if (!blockSize) {
+        blockSize = kChunkedCompressionBlockSize;
+    }
+
+    src = CFDataGetBytePtr(prelinkImage);
+    srclen = (size_t)CFDataGetLength(prelinkImage);
+    numBlocks = (srclen + blockSize - 1) / blockSize;
+
+    /* LZSS can grow incompressible input by 1/8; allow for that.
+     */
+    blockBufSize = blockSize + (blockSize / 8) + 64;
+
+    blockBufs = calloc(numBlocks, sizeof(*blockBufs));
+    blockSizes = calloc(numBlocks, sizeof(*blockSizes));
+    encodeGroup = dispatch_group_create();
+    if (!blockBufs || !blockSizes || !encodeGroup) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    for (i = 0; i < numBlocks; i++) {
+        blockBufs[i] = malloc(blockBufSize);
+        if (!blockBufs[i]) {
+            OSKextLogMemError();
+            goto finish;
+        }
+    }
+
+    /* Encode all blocks in the background and checksum meanwhile.
+     */
+    dispatch_group_async(encodeGroup,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            dispatch_apply(numBlocks,
+                dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                ^(size_t block) {
+                    size_t start = block * blockSize;
+
+                    blockSizes[block] = compressBlock(compressionType,
+                        blockBufs[block], blockBufSize,
+                        src + start, MIN(blockSize, srclen - start));
+                });
+        });
+
+    adler32 = local_adler32((u_int8_t *)src, (int)srclen);
+    dispatch_group_wait(encodeGroup, DISPATCH_TIME_FOREVER);
+
+    indexSize = numBlocks * sizeof(*blockIndex);
+    payloadSize = indexSize;
+    for (i = 0; i < numBlocks; i++) {
+        if (!blockSizes[i]) {
+            OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                    "Failed to compress prelinked kernel.");
+            goto finish;
+        }
+        payloadSize += blockSizes[i];
+    }
+    if (payloadSize > UINT32_MAX) {
+        OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                "Compressed prelinked kernel is too large.");
+        goto finish;
+    }
+
+    /* Lay out the header, block index, and blocks.
+     */
+    compressedImage = CFDataCreateMutable(kCFAllocatorDefault,
+        sizeof(*kernelHeader) + payloadSize);
+    if (!compressedImage) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDataSetLength(compressedImage, sizeof(*kernelHeader) + payloadSize);
+    buf = CFDataGetMutableBytePtr(compressedImage);
+    if (!buf) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    kernelHeader = (PrelinkedKernelHeader *) buf;
+    bzero(kernelHeader, sizeof(*kernelHeader));
+    kernelHeader->signature = OSSwapHostToBigInt32('comp');
+    kernelHeader->compressType = OSSwapHostToBigInt32(COMP_TYPE_CHUNKED);
+    kernelHeader->adler32 = OSSwapHostToBigInt32(adler32);
+    kernelHeader->uncompressedSize = OSSwapHostToBigInt32(srclen);
+    kernelHeader->compressedSize = OSSwapHostToBigInt32(payloadSize);
+    kernelHeader->prelinkVersion = OSSwapHostToBigInt32(hasRelocs ? 1 : 0);
+    kernelHeader->reserved[kChunkedCodecIndex] = OSSwapHostToBigInt32(compressionType);
+    kernelHeader->reserved[kChunkedBlockSizeIndex] = OSSwapHostToBigInt32(blockSize);
+    kernelHeader->reserved[kChunkedNumBlocksIndex] = OSSwapHostToBigInt32(numBlocks);
+
+    blockIndex = (ChunkedBlockEntry *)kernelHeader->data;
+    payloadSize = 0;
+    for (i = 0; i < numBlocks; i++) {
+        blockIndex[i].offset = OSSwapHostToBigInt32(payloadSize);
+        blockIndex[i].compressedSize = OSSwapHostToBigInt32(blockSizes[i]);
+        memcpy(buf + sizeof(*kernelHeader) + indexSize + payloadSize,
+            blockBufs[i], blockSizes[i]);
+        payloadSize += blockSizes[i];
+    }
+
+    result = CFRetain(compressedImage);
+
+finish:
+    if (blockBufs) {
+        for (i = 0; i < numBlocks; i++) {
+            SAFE_FREE(blockBufs[i]);
+        }
+    }
+    SAFE_FREE(blockBufs);
+    SAFE_FREE(blockSizes);
+    if (encodeGroup) dispatch_release(encodeGroup);
+    SAFE_RELEASE(compressedImage);
+    return result;
+}
+
+/*******************************************************************************
+* Symbol files are written by a few workers after the prelinked kernel is in
+* place, rather than one by one on the way to it.  Each worker takes every
+* kPrelinkSymbolWriteJobs'th file, and nothing is fsync()ed until all of them
+* have been written; finishPrelinkedSymbolWrites() is the barrier.
+*******************************************************************************/
+typedef struct {
+    char       * path;      // must free
+    CFDataRef    data;      // must release
+    Boolean      written;
+} SymbolFileWrite;
+
+struct prelink_symbol_writes {
+    SymbolFileWrite    * files;      // must free
+    CFIndex              numFiles;
+    char              ** dirPaths;   // must free each
+    CFIndex              numDirs;
+    dispatch_group_t     group;      // must release
+    PrelinkStageStats  * stats;      // do not free
+    PrelinkStageMark     mark;
+    uint64_t             bytesOut;
+};
+
+static void
+writeSymbolFile(SymbolFileWrite * file)
+{
+    int             fd      = -1;
+    mode_t          mode    = 0666;
+    struct stat     statBuf;
+    CFIndex         length  = CFDataGetLength(file->data);
+
+    if (0 == stat(file->path, &statBuf)) {
+        mode = statBuf.st_mode;
+    }
+    fd = open(file->path, O_WRONLY|O_CREAT|O_TRUNC, mode);
+    if (fd == -1) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                  "%s Failed to save '%s'", __func__, file->path);
+        return;
+    }
+    if (length &&
+        writeToFile(fd, CFDataGetBytePtr(file->data), length) != EX_OK) {
+
+        OSKextLog(/* kext */ NULL, kOSKextLogErrorLevel,
+                  "%s write failed for '%s'", __func__, file->path);
+    } else {
+        file->written = true;
+    }
+    close(fd);
+}
+
+static void
+syncPath(const char * path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+typedef struct {
+    PrelinkSymbolWrites * writes;
+    CFURLRef              saveDirURL;
+    Boolean               fatal;
+} SymbolWritesContext;
+
+static void
+addSymbolFileWrite(const void * vKey, const void * vValue, void * vContext)
+{
+    SymbolWritesContext * context  = (SymbolWritesContext *)vContext;
+    SymbolFileWrite     * file     = NULL;  // do not free
+    CFURLRef              saveURL  = NULL;  // must release
+    char                  savePath[PATH_MAX];
+
+    if (context->fatal) {
+        goto finish;
+    }
+
+    saveURL = CFURLCreateCopyAppendingPathComponent(kCFAllocatorDefault,
+        context->saveDirURL, (CFStringRef)vKey, /* isDirectory */ false);
+    if (!saveURL ||
+        !CFURLGetFileSystemRepresentation(saveURL, /* resolveToBase */ true,
+            (u_char *)savePath, sizeof(savePath))) {
+
+        context->fatal = true;
+        goto finish;
+    }
+
+    file = &context->writes->files[context->writes->numFiles];
+    file->path = strdup(savePath);
+    if (!file->path) {
+        OSKextLogMemError();
+        context->fatal = true;
+        goto finish;
+    }
+    file->data = CFRetain((CFDataRef)vValue);
+    context->writes->numFiles++;
+    context->writes->bytesOut += CFDataGetLength(file->data);
+
+finish:
+    SAFE_RELEASE(saveURL);
+}
+
+/*******************************************************************************
+* Makes the symbol directories and starts writing the files on a worker pool.
+* The caller goes on with other work and must pass *writesOut to
+* finishPrelinkedSymbolWrites().  On failure nothing is left running.
+*******************************************************************************/
+ExitStatus
+startPrelinkedSymbolWrites(
+    CFURLRef              symbolDirURL,
+    CFArrayRef            prelinkSymbols,
+    CFArrayRef            prelinkArchs,
+    PrelinkStageStats   * stats,
+    PrelinkSymbolWrites ** writesOut)
+{
+    ExitStatus            result          = EX_SOFTWARE;
+    PrelinkSymbolWrites * writes          = NULL;  // finish on error
+    SymbolWritesContext   context;
+    CFDictionaryRef       sliceSymbols    = NULL;  // do not release
+    CFURLRef              saveDirURL      = NULL;  // must release
+    const NXArchInfo    * archInfo        = NULL;  // do not free
+    CFIndex               numArchs        = 0;
+    CFIndex               numFiles        = 0;
+    CFIndex               i               = 0;
+    char                  dirPath[PATH_MAX];
+
+    *writesOut = NULL;
+    numArchs = CFArrayGetCount(prelinkArchs);
+    for (i = 0; i < numArchs; ++i) {
+        numFiles += CFDictionaryGetCount(
+            CFArrayGetValueAtIndex(prelinkSymbols, i));
+    }
+
+    writes = calloc(1, sizeof(*writes));
+    if (writes) {
+        writes->files = calloc(numFiles ? numFiles : 1,
+            sizeof(*writes->files));
+        writes->dirPaths = calloc(numArchs ? numArchs : 1,
+            sizeof(*writes->dirPaths));
+        writes->group = dispatch_group_create();
+    }
+    if (!writes || !writes->files || !writes->dirPaths || !writes->group) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+    writes->stats = stats;
+    prelinkStageStart(&writes->mark);
+
+    bzero(&context, sizeof(context));
+    context.writes = writes;
+
+    for (i = 0; i < numArchs; ++i) {
+        archInfo = CFArrayGetValueAtIndex(prelinkArchs, i);
+        sliceSymbols = CFArrayGetValueAtIndex(prelinkSymbols, i);
+
+        SAFE_RELEASE_NULL(saveDirURL);
+
+        /* We don't need arch-specific directories if there's only one arch */
+        if (numArchs == 1) {
+            saveDirURL = CFRetain(symbolDirURL);
+        } else {
+            saveDirURL = CFURLCreateFromFileSystemRepresentationRelativeToBase(
+                kCFAllocatorDefault, (const UInt8 *) archInfo->name, 
+                strlen(archInfo->name), /* isDirectory */ true, symbolDirURL);
+            if (!saveDirURL) {
+                goto finish;
+            }
+        }
+
+        result = makeDirectoryWithURL(saveDirURL);
+        if (result != EX_OK) {
+            goto finish;
         }
+        result = EX_SOFTWARE;
+
+        if (!CFURLGetFileSystemRepresentation(saveDirURL,
+                /* resolveToBase */ true, (UInt8 *)dirPath, sizeof(dirPath))) {
+            goto finish;
+        }
+        writes->dirPaths[writes->numDirs] = strdup(dirPath);
+        if (!writes->dirPaths[writes->numDirs]) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+        writes->numDirs++;
+
+        context.saveDirURL = saveDirURL;
+        CFDictionaryApplyFunction(sliceSymbols, &addSymbolFileWrite,
+            &context);
+        if (context.fatal) {
+            goto finish;
+        }
+    }
+
+    for (i = 0; i < kPrelinkSymbolWriteJobs && i < writes->numFiles; i++) {
+        CFIndex stripe = i;
+
+        dispatch_group_async(writes->group,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                CFIndex k;
+
+                for (k = stripe; k < writes->numFiles;
+                     k += kPrelinkSymbolWriteJobs) {
+
+                    writeSymbolFile(&writes->files[k]);
+                }
+            });
     }
+
+    *writesOut = writes;
+    writes = NULL;
     result = EX_OK;
 
 finish:
     SAFE_RELEASE(saveDirURL);
-        
+    if (writes) {
+        writes->stats = NULL;  // nothing was written
+        (void)finishPrelinkedSymbolWrites(writes);
+    }
+
+    return result;
+}
+
+/*******************************************************************************
+* Waits for the symbol writers, then fsync()s every file written and the
+* directories they're in.  Counts toward kPrelinkStageSymbols from the time
+* the writes were started.  Failing to save a file isn't fatal, as before.
+*******************************************************************************/
+ExitStatus
+finishPrelinkedSymbolWrites(
+    PrelinkSymbolWrites * writes)
+{
+    CFIndex     i;
+
+    if (writes->group) {
+        dispatch_group_wait(writes->group, DISPATCH_TIME_FOREVER);
+
+        dispatch_apply(kPrelinkSymbolWriteJobs,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+            ^(size_t stripe) {
+                CFIndex k;
+
+                for (k = (CFIndex)stripe; k < writes->numFiles;
+                     k += kPrelinkSymbolWriteJobs) {
+
+                    if (writes->files[k].written) {
+                        syncPath(writes->files[k].path);
+                    }
+                }
+            });
+        dispatch_release(writes->group);
+    }
+
+    for (i = 0; i < writes->numDirs; i++) {
+        syncPath(writes->dirPaths[i]);
+        SAFE_FREE(writes->dirPaths[i]);
+    }
+    if (writes->files) {
+        for (i = 0; i < writes->numFiles; i++) {
+            SAFE_FREE(writes->files[i].path);
+            SAFE_RELEASE(writes->files[i].data);
+        }
+    }
+
+    prelinkStageAddCounts(writes->stats, kPrelinkStageSymbols,
+        /* bytesIn */ 0, writes->bytesOut, writes->numFiles);
+    prelinkStageAddWallTime(writes->stats, kPrelinkStageSymbols,
+        &writes->mark);
+
+    SAFE_FREE(writes->files);
+    SAFE_FREE(writes->dirPaths);
+    free(writes);
+
+    return EX_OK;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+ExitStatus
+writePrelinkedSymbols(
+    CFURLRef    symbolDirURL,
+    CFArrayRef  prelinkSymbols,
+    CFArrayRef  prelinkArchs)
+{
+    ExitStatus            result  = EX_SOFTWARE;
+    PrelinkSymbolWrites * writes  = NULL;  // must finish
+
+    result = startPrelinkedSymbolWrites(symbolDirURL, prelinkSymbols,
+        prelinkArchs, /* stats */ NULL, &writes);
+    if (result != EX_OK) {
+        goto finish;
+    }
+    result = finishPrelinkedSymbolWrites(writes);
+
+finish:
     return result;
 }
 
@@ -1153,6 +2009,1098 @@ finish:
     return result;
 }
 
+#pragma mark Prelinked Kernel Engine
+/*******************************************************************************
+* The prelinked kernel pipeline shared by kextcache and kcgen: pick the archs,
+* link each slice, compress it, and write the fat file.  Which kexts go in,
+* and whether their signatures pass, depend on each tool's options, so the
+* tools read, filter, and sign-check themselves, but every stage is measured
+* in the same PrelinkStageStats.  Stats are summed over threads, since slices
+* may be compressed concurrently; CPU time is per thread, so a stage's work
+* on another thread isn't charged to it.
+*******************************************************************************/
+static const char * sPrelinkStageNames[kPrelinkNumStages] = {
+    "read", "filter", "sign-check", "link", "compress", "write",
+    "symbols", "stamps"
+};
+
+static uint64_t
+prelinkThreadCPUUsecs(void)
+{
+    thread_basic_info_data_t    info;
+    mach_msg_type_number_t      count = THREAD_BASIC_INFO_COUNT;
+
+    if (thread_info(pthread_mach_thread_np(pthread_self()),
+            THREAD_BASIC_INFO, (thread_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return ((uint64_t)info.user_time.seconds +
+            (uint64_t)info.system_time.seconds) * 1000000ULL +
+        (uint64_t)info.user_time.microseconds +
+        (uint64_t)info.system_time.microseconds;
+}
+
+void
+prelinkStageStart(PrelinkStageMark * mark)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    mark->wallUsecs = (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_usec;
+    mark->cpuUsecs = prelinkThreadCPUUsecs();
+}
+
+void
+prelinkStageAddWallTime(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark)
+{
+    PrelinkStageMark now;
+
+    if (stats && stage < kPrelinkNumStages) {
+        prelinkStageStart(&now);
+        __sync_fetch_and_add(&stats->stage[stage].wallUsecs,
+            now.wallUsecs - mark->wallUsecs);
+    }
+}
+
+/* For work fanned out to other threads, each worker adds its own CPU time
+ * and the caller adds the wall time once.
+ */
+void
+prelinkStageAddCPUTime(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark)
+{
+    if (stats && stage < kPrelinkNumStages) {
+        __sync_fetch_and_add(&stats->stage[stage].cpuUsecs,
+            prelinkThreadCPUUsecs() - mark->cpuUsecs);
+    }
+}
+
+void
+prelinkStageEnd(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark)
+{
+    prelinkStageAddWallTime(stats, stage, mark);
+    prelinkStageAddCPUTime(stats, stage, mark);
+}
+
+void
+prelinkStageAddCounts(
+    PrelinkStageStats * stats,
+    PrelinkStage        stage,
+    uint64_t            bytesIn,
+    uint64_t            bytesOut,
+    uint64_t            kextCount)
+{
+    if (stats && stage < kPrelinkNumStages) {
+        __sync_fetch_and_add(&stats->stage[stage].bytesIn, bytesIn);
+        __sync_fetch_and_add(&stats->stage[stage].bytesOut, bytesOut);
+        __sync_fetch_and_add(&stats->stage[stage].kextCount, kextCount);
+    }
+}
+
+void
+logPrelinkStageStats(const PrelinkStageStats * stats)
+{
+    const PrelinkStageStat * stat = NULL;  // do not free
+    int                      i;
+
+    for (i = 0; i < kPrelinkNumStages; i++) {
+        stat = &stats->stage[i];
+        if (!stat->wallUsecs && !stat->kextCount) {
+            continue;
+        }
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogArchiveFlag,
+            "Prelinked kernel stage %s: %llu.%03llu s wall, "
+            "%llu.%03llu s cpu, %llu bytes in, %llu bytes out, %llu kexts.",
+            sPrelinkStageNames[i],
+            stat->wallUsecs / 1000000ULL, (stat->wallUsecs / 1000ULL) % 1000ULL,
+            stat->cpuUsecs / 1000000ULL, (stat->cpuUsecs / 1000ULL) % 1000ULL,
+            stat->bytesIn, stat->bytesOut, stat->kextCount);
+    }
+}
+
+static Boolean
+setStatNumber(
+    CFMutableDictionaryRef  dict,
+    CFStringRef             key,
+    uint64_t                value)
+{
+    SInt64      value64 = (SInt64)value;
+    CFNumberRef number  = NULL;  // must release
+
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value64);
+    if (!number) {
+        return false;
+    }
+    CFDictionarySetValue(dict, key, number);
+    CFRelease(number);
+    return true;
+}
+
+/*******************************************************************************
+ * Writes the stage stats as an XML plist: an array with one dictionary per
+ * stage, in pipeline order.  Times are in microseconds.
+ *******************************************************************************/
+ExitStatus
+writePrelinkStageStats(
+    const PrelinkStageStats * stats,
+    const char              * statsPath)
+{
+    ExitStatus              result      = EX_OSERR;
+    CFMutableArrayRef       stageArray  = NULL;  // must release
+    CFMutableDictionaryRef  stageDict   = NULL;  // must release
+    CFStringRef             stageName   = NULL;  // must release
+    CFDataRef               statsData   = NULL;  // must release
+    const PrelinkStageStat * stat       = NULL;  // do not free
+    int                     fd          = -1;
+    int                     i;
+
+    if (!createCFMutableArray(&stageArray, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    for (i = 0; i < kPrelinkNumStages; i++) {
+        stat = &stats->stage[i];
+
+        SAFE_RELEASE_NULL(stageDict);
+        SAFE_RELEASE_NULL(stageName);
+        stageName = CFStringCreateWithCString(kCFAllocatorDefault,
+            sPrelinkStageNames[i], kCFStringEncodingUTF8);
+        if (!stageName || !createCFMutableDictionary(&stageDict)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionarySetValue(stageDict, CFSTR("Stage"), stageName);
+        if (!setStatNumber(stageDict, CFSTR("WallTime"), stat->wallUsecs) ||
+            !setStatNumber(stageDict, CFSTR("CPUTime"), stat->cpuUsecs) ||
+            !setStatNumber(stageDict, CFSTR("BytesIn"), stat->bytesIn) ||
+            !setStatNumber(stageDict, CFSTR("BytesOut"), stat->bytesOut) ||
+            !setStatNumber(stageDict, CFSTR("KextCount"), stat->kextCount)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFArrayAppendValue(stageArray, stageDict);
+    }
+
+    statsData = CFPropertyListCreateData(kCFAllocatorDefault, stageArray,
+        kCFPropertyListXMLFormat_v1_0, /* options */ 0, /* error */ NULL);
+    if (!statsData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    fd = open(statsPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag |
+            kOSKextLogFileAccessFlag,
+            "Can't create %s - %s.", statsPath, strerror(errno));
+        goto finish;
+    }
+
+    result = writeToFile(fd, CFDataGetBytePtr(statsData),
+        CFDataGetLength(statsData));
+
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    SAFE_RELEASE(stageArray);
+    SAFE_RELEASE(stageDict);
+    SAFE_RELEASE(stageName);
+    SAFE_RELEASE(statsData);
+
+    return result;
+}
+
+/*******************************************************************************
+ * Creates a list of architectures to generate prelinked kernel slices for by
+ * selecting the requested architectures for which the kernel has a slice.
+ * Warns when a requested architecture does not have a corresponding kernel
+ * slice.
+ *******************************************************************************/
+ExitStatus
+createPrelinkArchsForKernel(
+    const char        * kernelPath,
+    CFArrayRef          targetArchs,
+    CFMutableArrayRef * prelinkArchsOut)
+{
+    ExitStatus          result          = EX_OSERR;
+    CFMutableArrayRef   kernelArchs     = NULL;  // must release
+    CFMutableArrayRef   prelinkArchs    = NULL;  // must release
+    const NXArchInfo  * targetArch      = NULL;  // do not free
+    CFIndex             i               = 0;
+
+    result = readFatFileArchsWithPath(kernelPath, &kernelArchs);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    prelinkArchs = CFArrayCreateMutableCopy(kCFAllocatorDefault,
+        /* capacity */ 0, targetArchs);
+    if (!prelinkArchs) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+
+    for (i = 0; i < CFArrayGetCount(prelinkArchs); ++i) {
+        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
+        if (!CFArrayContainsValue(kernelArchs,
+            RANGE_ALL(kernelArchs), targetArch))
+        {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
+                "Kernel file %s does not contain requested arch: %s",
+                kernelPath, targetArch->name);
+            CFArrayRemoveValueAtIndex(prelinkArchs, i);
+            i--;
+            continue;
+        }
+    }
+
+    *prelinkArchsOut = (CFMutableArrayRef) CFRetain(prelinkArchs);
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(kernelArchs);
+    SAFE_RELEASE(prelinkArchs);
+
+    return result;
+}
+
+/*******************************************************************************
+ * A kernel supports KASLR if it has an LC_DYSYMTAB load command.  This also
+ * tells whether an uncompressed prelinked kernel slice carries relocations.
+ *******************************************************************************/
+Boolean
+kernelImageSupportsKASLR(CFDataRef kernelImage)
+{
+    const UInt8 * kernelStart = CFDataGetBytePtr(kernelImage);
+    const UInt8 * kernelEnd   = kernelStart + CFDataGetLength(kernelImage) - 1;
+
+    return (macho_find_dysymtab(kernelStart, kernelEnd, NULL) ==
+        macho_seek_result_found);
+}
+
+/*******************************************************************************
+ * Returns a copy of a linked slice whose prelink info gives each kext's
+ * kPrelinkExecutableUUIDKey, so that kclist -u can list UUIDs without
+ * reading every kext's Mach-O header out of the prelink text.
+ *
+ * OSKextCreatePrelinkedKernel() puts the prelink info segment last in both
+ * the file and the address space, which lets it grow without moving anything
+ * else. Returns NULL, leaving the caller to use the slice as is, if the slice
+ * isn't laid out that way or anything else goes wrong; older slices and those
+ * without the key are read the old way.
+ *******************************************************************************/
+#define kPrelinkInfoGrowthAlignment  (0x4000)   // a page on every target
+#define kMachONameSize  sizeof(((struct section *)0)->sectname)
+
+static CFDataRef
+createPrelinkedKernelWithUUIDs(CFDataRef prelinkedKernel)
+{
+    CFDataRef               result          = NULL;
+    const UInt8           * kernelStart     = CFDataGetBytePtr(prelinkedKernel);
+    CFIndex                 kernelLength    = CFDataGetLength(prelinkedKernel);
+    const UInt8           * kernelEnd       = kernelStart + kernelLength;
+    const struct mach_header * mhp = (const struct mach_header *)kernelStart;
+    Boolean                 is64;
+    const UInt8           * lcp             = NULL;
+    uint32_t                ncmds, i, j;
+    ptrdiff_t               infoSegOffset   = -1;  // of the load commands
+    ptrdiff_t               infoSectOffset  = -1;
+    uint64_t                infoSegVMEnd    = 0;
+    uint64_t                infoSegFileEnd  = 0;
+    uint64_t                infoSectOffsetInFile = 0;
+    uint64_t                infoSectSize    = 0;
+    uint64_t                otherVMEnd      = 0;
+    uint64_t                otherFileEnd    = 0;
+    uint64_t                textAddr        = 0;
+    uint64_t                textOffset      = 0;
+    uint64_t                textSize        = 0;
+    Boolean                 foundText       = false;
+    char                  * infoXML         = NULL;  // must free
+    CFPropertyListRef       prelinkInfo     = NULL;  // must release
+    CFMutableDictionaryRef  newPrelinkInfo  = NULL;  // must release
+    CFMutableArrayRef       newKextInfos    = NULL;  // must release
+    CFMutableDictionaryRef  newKextInfo     = NULL;  // must release
+    CFDataRef               uuidData        = NULL;  // must release
+    CFDataRef               newInfoData     = NULL;  // must release
+    CFMutableDataRef        newKernel       = NULL;  // must release
+    CFArrayRef              kextInfos       = NULL;  // do not release
+    CFIndex                 count, k;
+    uint64_t                newInfoSize;
+    uint64_t                growth          = 0;
+    UInt8                 * newStart        = NULL;  // do not free
+    Boolean                 addedUUIDs      = false;
+
+    if (kernelLength < (CFIndex)sizeof(struct mach_header_64)) {
+        goto finish;
+    }
+    if (mhp->magic == MH_MAGIC_64) {
+        is64 = true;
+        lcp = kernelStart + sizeof(struct mach_header_64);
+    } else if (mhp->magic == MH_MAGIC) {
+        is64 = false;
+        lcp = kernelStart + sizeof(struct mach_header);
+    } else {
+        goto finish;
+    }
+
+   /* Find the prelink info and text sections, and the extent of everything
+    * else in the file and address space.
+    */
+    ncmds = mhp->ncmds;
+    for (i = 0; i < ncmds; i++) {
+        const struct load_command * cmd = (const struct load_command *)lcp;
+        const char * segname;
+        Boolean      isInfoSeg, isTextSeg;
+        uint64_t     vmEnd, fileEnd;
+        uint32_t     nsects;
+        const UInt8 * sectp;
+
+        if (lcp + sizeof(*cmd) > kernelEnd ||
+            cmd->cmdsize < sizeof(*cmd) ||
+            lcp + cmd->cmdsize > kernelEnd) {
+            goto finish;
+        }
+
+        if (is64 && cmd->cmd == LC_SEGMENT_64) {
+            const struct segment_command_64 * seg = (const void *)lcp;
+            segname = seg->segname;
+            vmEnd = seg->vmaddr + seg->vmsize;
+            fileEnd = seg->fileoff + seg->filesize;
+            nsects = seg->nsects;
+            sectp = lcp + sizeof(*seg);
+        } else if (!is64 && cmd->cmd == LC_SEGMENT) {
+            const struct segment_command * seg = (const void *)lcp;
+            segname = seg->segname;
+            vmEnd = seg->vmaddr + seg->vmsize;
+            fileEnd = seg->fileoff + seg->filesize;
+            nsects = seg->nsects;
+            sectp = lcp + sizeof(*seg);
+        } else {
+            lcp += cmd->cmdsize;
+            continue;
+        }
+        isInfoSeg = !strncmp(segname, kPrelinkInfoSegment, kMachONameSize);
+        isTextSeg = !strncmp(segname, kPrelinkTextSegment, kMachONameSize);
+
+        for (j = 0; j < nsects; j++) {
+            const char * sectname;
+            uint64_t     addr, size, offset;
+
+            if (is64) {
+                const struct section_64 * sect = (const void *)sectp;
+                if (sectp + sizeof(*sect) > lcp + cmd->cmdsize) goto finish;
+                sectname = sect->sectname;
+                addr = sect->addr;
+                size = sect->size;
+                offset = sect->offset;
+                sectp += sizeof(*sect);
+            } else {
+                const struct section * sect = (const void *)sectp;
+                if (sectp + sizeof(*sect) > lcp + cmd->cmdsize) goto finish;
+                sectname = sect->sectname;
+                addr = sect->addr;
+                size = sect->size;
+                offset = sect->offset;
+                sectp += sizeof(*sect);
+            }
+
+            if (isInfoSeg &&
+                !strncmp(sectname, kPrelinkInfoSection, kMachONameSize)) {
+
+                infoSectOffset = (sectp - kernelStart) -
+                    (is64 ? sizeof(struct section_64) : sizeof(struct section));
+                infoSectOffsetInFile = offset;
+                infoSectSize = size;
+            } else if (isTextSeg &&
+                !strncmp(sectname, kPrelinkTextSection, kMachONameSize)) {
+
+                textAddr = addr;
+                textOffset = offset;
+                textSize = size;
+                foundText = true;
+            }
+        }
+
+        if (isInfoSeg) {
+            infoSegOffset = lcp - kernelStart;
+            infoSegVMEnd = vmEnd;
+            infoSegFileEnd = fileEnd;
+        } else {
+            if (vmEnd > otherVMEnd)      otherVMEnd = vmEnd;
+            if (fileEnd > otherFileEnd)  otherFileEnd = fileEnd;
+        }
+        lcp += cmd->cmdsize;
+    }
+
+    if (infoSegOffset < 0 || infoSectOffset < 0 || !foundText ||
+        infoSegVMEnd < otherVMEnd || infoSegFileEnd < otherFileEnd ||
+        infoSegFileEnd != (uint64_t)kernelLength ||
+        infoSectOffsetInFile + infoSectSize > infoSegFileEnd ||
+        textOffset + textSize > (uint64_t)kernelLength) {
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
+            "Prelink info isn't last in the prelinked kernel; "
+            "not adding kext UUIDs to it.");
+        goto finish;
+    }
+
+   /* IOCFUnserialize() wants a C string.
+    */
+    infoXML = malloc(infoSectSize + 1);
+    if (!infoXML) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    memcpy(infoXML, kernelStart + infoSectOffsetInFile, infoSectSize);
+    infoXML[infoSectSize] = '\0';
+
+    prelinkInfo = IOCFUnserialize(infoXML, kCFAllocatorDefault,
+        /* options */ 0, /* errorString */ NULL);
+    if (!prelinkInfo || CFDictionaryGetTypeID() != CFGetTypeID(prelinkInfo)) {
+        goto finish;
+    }
+    kextInfos = CFDictionaryGetValue(prelinkInfo,
+        CFSTR(kPrelinkInfoDictionaryKey));
+    if (!kextInfos || CFArrayGetTypeID() != CFGetTypeID(kextInfos)) {
+        goto finish;
+    }
+
+    newPrelinkInfo = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0,
+        prelinkInfo);
+    newKextInfos = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeArrayCallBacks);
+    if (!newPrelinkInfo || !newKextInfos) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kextInfos);
+    for (k = 0; k < count; k++) {
+        CFDictionaryRef kextInfo = CFArrayGetValueAtIndex(kextInfos, k);
+        CFNumberRef     sourceNum;
+        CFNumberRef     sizeNum;
+        uint64_t        sourceAddr, sourceSize;
+        uuid_t          uuid;
+
+        if (CFDictionaryGetTypeID() != CFGetTypeID(kextInfo)) {
+            goto finish;
+        }
+        sourceNum = CFDictionaryGetValue(kextInfo,
+            CFSTR(kPrelinkExecutableSourceKey));
+        sizeNum = CFDictionaryGetValue(kextInfo,
+            CFSTR(kPrelinkExecutableSizeKey));
+
+        // codeless kexts have no executable and so no UUID
+        if (!sourceNum || CFNumberGetTypeID() != CFGetTypeID(sourceNum) ||
+            !sizeNum || CFNumberGetTypeID() != CFGetTypeID(sizeNum)) {
+
+            CFArrayAppendValue(newKextInfos, kextInfo);
+            continue;
+        }
+        CFNumberGetValue(sourceNum, kCFNumberSInt64Type, &sourceAddr);
+        CFNumberGetValue(sizeNum, kCFNumberSInt64Type, &sourceSize);
+        if (sourceAddr < textAddr ||
+            sourceAddr + sourceSize > textAddr + textSize) {
+
+            CFArrayAppendValue(newKextInfos, kextInfo);
+            continue;
+        }
+
+        if (!getMachOUUID(kernelStart + textOffset + (sourceAddr - textAddr),
+                (size_t)sourceSize, uuid)) {
+            CFArrayAppendValue(newKextInfos, kextInfo);
+            continue;
+        }
+
+        SAFE_RELEASE_NULL(newKextInfo);
+        SAFE_RELEASE_NULL(uuidData);
+        newKextInfo = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0,
+            kextInfo);
+        uuidData = CFDataCreate(kCFAllocatorDefault, uuid, sizeof(uuid_t));
+        if (!newKextInfo || !uuidData) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionarySetValue(newKextInfo, CFSTR(kPrelinkExecutableUUIDKey),
+            uuidData);
+        CFArrayAppendValue(newKextInfos, newKextInfo);
+        addedUUIDs = true;
+    }
+    if (!addedUUIDs) {
+        goto finish;
+    }
+    CFDictionarySetValue(newPrelinkInfo, CFSTR(kPrelinkInfoDictionaryKey),
+        newKextInfos);
+
+    newInfoData = IOCFSerialize(newPrelinkInfo, kNilOptions);
+    if (!newInfoData) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "Can't serialize prelink info with kext UUIDs.");
+        goto finish;
+    }
+
+   /* Keep the section a C string, as the kernel and kclist read it.
+    */
+    newInfoSize = CFDataGetLength(newInfoData);
+    if (!newInfoSize ||
+        CFDataGetBytePtr(newInfoData)[newInfoSize - 1] != '\0') {
+        newInfoSize++;
+    }
+    if (infoSectOffsetInFile + newInfoSize > infoSegFileEnd) {
+        growth = infoSectOffsetInFile + newInfoSize - infoSegFileEnd;
+        growth = (growth + kPrelinkInfoGrowthAlignment - 1) &
+            ~(uint64_t)(kPrelinkInfoGrowthAlignment - 1);
+    }
+
+    newKernel = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    if (!newKernel) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDataSetLength(newKernel, kernelLength + growth);  // zero-fills
+    newStart = CFDataGetMutableBytePtr(newKernel);
+    memcpy(newStart, kernelStart, infoSectOffsetInFile);
+    memcpy(newStart + infoSectOffsetInFile, CFDataGetBytePtr(newInfoData),
+        CFDataGetLength(newInfoData));
+
+    if (is64) {
+        struct segment_command_64 * seg = (void *)(newStart + infoSegOffset);
+        struct section_64 * sect = (void *)(newStart + infoSectOffset);
+
+        seg->vmsize += growth;
+        seg->filesize += growth;
+        sect->size = newInfoSize;
+    } else {
+        struct segment_command * seg = (void *)(newStart + infoSegOffset);
+        struct section * sect = (void *)(newStart + infoSectOffset);
+
+        seg->vmsize += (uint32_t)growth;
+        seg->filesize += (uint32_t)growth;
+        sect->size = (uint32_t)newInfoSize;
+    }
+
+    result = CFRetain(newKernel);
+
+finish:
+    SAFE_FREE(infoXML);
+    SAFE_RELEASE(prelinkInfo);
+    SAFE_RELEASE(newPrelinkInfo);
+    SAFE_RELEASE(newKextInfos);
+    SAFE_RELEASE(newKextInfo);
+    SAFE_RELEASE(uuidData);
+    SAFE_RELEASE(newInfoData);
+    SAFE_RELEASE(newKernel);
+    return result;
+}
+
+/*******************************************************************************
+ * Links one uncompressed prelinked kernel slice.  The OSKext library keeps
+ * the current architecture as process-wide state, so the caller must have
+ * set it to the slice's arch, and this must not run concurrently with itself.
+ *******************************************************************************/
+ExitStatus
+linkPrelinkedKernelSlice(
+    CFDataRef           kernelImage,
+    CFArrayRef          prelinkKexts,
+    CFURLRef            volumeRootURL,
+    uint32_t            flags,
+    PrelinkStageStats * stats,
+    CFDataRef         * prelinkedKernelOut,
+    CFDictionaryRef   * prelinkedSymbolsOut)
+{
+    ExitStatus          result      = EX_OSERR;
+    PrelinkStageMark    stageMark;
+    CFDataRef           withUUIDs   = NULL;  // do not release
+
+    prelinkStageStart(&stageMark);
+
+    *prelinkedKernelOut = OSKextCreatePrelinkedKernel(kernelImage,
+        prelinkKexts, volumeRootURL, flags, prelinkedSymbolsOut);
+    if (!*prelinkedKernelOut) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "Failed to generate prelinked kernel.");
+        goto finish;
+    }
+
+    withUUIDs = createPrelinkedKernelWithUUIDs(*prelinkedKernelOut);
+    if (withUUIDs) {
+        CFRelease(*prelinkedKernelOut);
+        *prelinkedKernelOut = withUUIDs;
+    }
+
+    prelinkStageAddCounts(stats, kPrelinkStageLink,
+        CFDataGetLength(kernelImage), CFDataGetLength(*prelinkedKernelOut),
+        CFArrayGetCount(prelinkKexts));
+    result = EX_OK;
+
+finish:
+    prelinkStageEnd(stats, kPrelinkStageLink, &stageMark);
+    return result;
+}
+
+/*******************************************************************************
+ * Compresses one linked slice if asked to, or just retains it.
+ *******************************************************************************/
+ExitStatus
+compressPrelinkedKernelSlice(
+    CFDataRef           prelinkedKernel,
+    Boolean             compress,
+    uint32_t            compressionType,
+    Boolean             chunked,
+    Boolean             hasRelocs,
+    PrelinkStageStats * stats,
+    CFDataRef         * prelinkedKernelOut)
+{
+    ExitStatus          result      = EX_OSERR;
+    PrelinkStageMark    stageMark;
+
+    prelinkStageStart(&stageMark);
+
+    if (!compress) {
+        *prelinkedKernelOut = CFRetain(prelinkedKernel);
+    } else if (chunked) {
+        *prelinkedKernelOut = compressPrelinkedSliceChunked(compressionType,
+            prelinkedKernel, hasRelocs, kChunkedCompressionBlockSize);
+    } else {
+        *prelinkedKernelOut = compressPrelinkedSlice(compressionType,
+            prelinkedKernel, hasRelocs);
+    }
+    if (!*prelinkedKernelOut) {
+        goto finish;
+    }
+
+    prelinkStageAddCounts(stats, kPrelinkStageCompress,
+        CFDataGetLength(prelinkedKernel), CFDataGetLength(*prelinkedKernelOut),
+        /* kextCount */ 0);
+    result = EX_OK;
+
+finish:
+    prelinkStageEnd(stats, kPrelinkStageCompress, &stageMark);
+    return result;
+}
+
+/*******************************************************************************
+ * Writes the prelinked kernel's fat file and, given a symbol directory, the
+ * symbols generated for the new slices.  With doValidation, the file being
+ * replaced must still be the one at file_dev_t/file_ino_t.
+ *******************************************************************************/
+ExitStatus
+writePrelinkedKernel(
+    const char            * prelinkPath,
+    boolean_t               doValidation,
+    dev_t                   file_dev_t,
+    ino_t                   file_ino_t,
+    CFArrayRef              prelinkSlices,
+    CFArrayRef              prelinkArchs,
+    mode_t                  fileMode,
+    const struct timeval    fileTimes[2],
+    CFURLRef                symbolDirURL,
+    CFArrayRef              generatedSymbols,
+    CFArrayRef              generatedArchs,
+    PrelinkStageStats     * stats)
+{
+    ExitStatus          result          = EX_OSERR;
+    FatFileWriter       writer;
+    CFIndex             i;
+
+    result = openPrelinkedKernelWriter(&writer, prelinkPath,
+        prelinkArchs, fileMode, stats);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    for (i = 0; i < CFArrayGetCount(prelinkSlices); i++) {
+        result = appendPrelinkedKernelSlice(&writer,
+            CFArrayGetValueAtIndex(prelinkSlices, i), stats);
+        if (result != EX_OK) {
+            abortFatFileWriter(&writer);
+            goto finish;
+        }
+    }
+
+    result = finishPrelinkedKernel(&writer, doValidation,
+        file_dev_t, file_ino_t, fileTimes,
+        symbolDirURL, generatedSymbols, generatedArchs, stats);
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+ * The streaming form of writePrelinkedKernel(): open the writer, append each
+ * slice in arch order as soon as it's built, then finish.  Only the slice
+ * being written has to be in memory.  Time spent writing is charged to
+ * kPrelinkStageWrite.
+ *******************************************************************************/
+ExitStatus
+openPrelinkedKernelWriter(
+    FatFileWriter         * writer,
+    const char            * prelinkPath,
+    CFArrayRef              prelinkArchs,
+    mode_t                  fileMode,
+    PrelinkStageStats     * stats)
+{
+    ExitStatus          result          = EX_OSERR;
+    PrelinkStageMark    stageMark;
+
+    prelinkStageStart(&stageMark);
+    result = openFatFileWriter(writer, prelinkPath, prelinkArchs, fileMode);
+    prelinkStageEnd(stats, kPrelinkStageWrite, &stageMark);
+
+    return result;
+}
+
+ExitStatus
+appendPrelinkedKernelSlice(
+    FatFileWriter         * writer,
+    CFDataRef               prelinkSlice,
+    PrelinkStageStats     * stats)
+{
+    ExitStatus          result          = EX_OSERR;
+    PrelinkStageMark    stageMark;
+
+    prelinkStageStart(&stageMark);
+    result = appendFatFileSlice(writer, prelinkSlice);
+    prelinkStageEnd(stats, kPrelinkStageWrite, &stageMark);
+
+    return result;
+}
+
+ExitStatus
+finishPrelinkedKernel(
+    FatFileWriter         * writer,
+    boolean_t               doValidation,
+    dev_t                   file_dev_t,
+    ino_t                   file_ino_t,
+    const struct timeval    fileTimes[2],
+    CFURLRef                symbolDirURL,
+    CFArrayRef              generatedSymbols,
+    CFArrayRef              generatedArchs,
+    PrelinkStageStats     * stats)
+{
+    ExitStatus          result          = EX_OSERR;
+    PrelinkStageMark    stageMark;
+    uint64_t            bytesOut        = writer->bytesWritten;
+    PrelinkSymbolWrites * symbolWrites  = NULL;  // finished here
+
+    prelinkStageStart(&stageMark);
+    result = finishFatFileWriter(writer, doValidation,
+        file_dev_t, file_ino_t, fileTimes);
+    prelinkStageAddCounts(stats, kPrelinkStageWrite, /* bytesIn */ 0,
+        bytesOut, /* kextCount */ 0);
+    prelinkStageEnd(stats, kPrelinkStageWrite, &stageMark);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    if (symbolDirURL) {
+        result = startPrelinkedSymbolWrites(symbolDirURL,
+            generatedSymbols, generatedArchs, stats, &symbolWrites);
+        if (result != EX_OK) {
+            goto finish;
+        }
+        result = finishPrelinkedSymbolWrites(symbolWrites);
+        if (result != EX_OK) {
+            goto finish;
+        }
+    }
+
+    result = EX_OK;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+ * Compresses or uncompresses every slice of an existing prelinked kernel in
+ * place.  Whether a slice being compressed has relocations is read from its
+ * own mach-o header.
+ *******************************************************************************/
+ExitStatus
+recompressPrelinkedKernelFile(
+    const char        * prelinkPath,
+    Boolean             compress,
+    uint32_t            compressionType)
+{
+    ExitStatus          result          = EX_SOFTWARE;
+    struct timeval      prelinkedKernelTimes[2];
+    CFMutableArrayRef   prelinkedSlices = NULL; // must release
+    CFMutableArrayRef   prelinkedArchs  = NULL; // must release
+    CFDataRef           prelinkedSlice  = NULL; // must release
+    const NXArchInfo  * archInfo        = NULL; // do not free
+    const u_char      * sliceBytes      = NULL; // do not free
+    mode_t              fileMode        = 0;
+    CFIndex             i               = 0;
+
+    result = readMachOSlices(prelinkPath, &prelinkedSlices,
+        &prelinkedArchs, &fileMode, prelinkedKernelTimes);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    /* Compress/uncompress each slice of the prelinked kernel.
+     */
+    for (i = 0; i < CFArrayGetCount(prelinkedSlices); ++i) {
+
+        SAFE_RELEASE_NULL(prelinkedSlice);
+        prelinkedSlice = CFArrayGetValueAtIndex(prelinkedSlices, i);
+
+        if (compress) {
+            prelinkedSlice = compressPrelinkedSlice(compressionType,
+                prelinkedSlice, kernelImageSupportsKASLR(prelinkedSlice));
+        } else {
+            prelinkedSlice = uncompressPrelinkedSlice(prelinkedSlice);
+        }
+        if (!prelinkedSlice) {
+            result = EX_DATAERR;
+            goto finish;
+        }
+
+        CFArraySetValueAtIndex(prelinkedSlices, i, prelinkedSlice);
+    }
+    SAFE_RELEASE_NULL(prelinkedSlice);
+
+    /* Snow Leopard prelinked kernels are not wrapped in a fat header, so we
+     * have to decompress the prelinked kernel and look at the mach header
+     * to get the architecture information.
+     */
+    if (!prelinkedArchs && CFArrayGetCount(prelinkedSlices) == 1) {
+        if (!createCFMutableArray(&prelinkedArchs, NULL)) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+
+        sliceBytes = CFDataGetBytePtr(
+            CFArrayGetValueAtIndex(prelinkedSlices, 0));
+
+        archInfo = getThinHeaderPageArch(sliceBytes);
+        if (archInfo) {
+            CFArrayAppendValue(prelinkedArchs, archInfo);
+        } else {
+            SAFE_RELEASE_NULL(prelinkedArchs);
+        }
+    }
+
+    /* If we still don't have architecture information, then something
+     * definitely went wrong.
+     */
+    if (!prelinkedArchs) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "Couldn't determine prelinked kernel's architecture");
+        result = EX_SOFTWARE;
+        goto finish;
+    }
+
+    result = writeFatFile(prelinkPath, prelinkedSlices,
+        prelinkedArchs, fileMode, prelinkedKernelTimes);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(prelinkedSlices);
+    SAFE_RELEASE(prelinkedArchs);
+    SAFE_RELEASE(prelinkedSlice);
+
+    return result;
+}
+
+const char *
+prelinkCodecName(uint32_t compressionType)
+{
+    switch (compressionType) {
+    case COMP_TYPE_LZSS:    return "lzss";
+    case COMP_TYPE_FASTLIB: return "lzvn";
+    case COMP_TYPE_CHUNKED: return "chunked";
+    default:                return "unknown";
+    }
+}
+
+/*******************************************************************************
+ * Compresses an uncompressed slice with one codec and decompresses the result
+ * again, keeping the fastest of several runs of each.  The round trip must
+ * give back the original bytes.
+ *******************************************************************************/
+ExitStatus
+measurePrelinkCodec(
+    CFDataRef           prelinkedKernel,
+    uint32_t            compressionType,
+    Boolean             hasRelocs,
+    u_int               runs,
+    PrelinkCodecCost  * costOut)
+{
+    ExitStatus          result          = EX_SOFTWARE;
+    CFDataRef           compressed      = NULL;  // must release
+    CFDataRef           uncompressed    = NULL;  // must release
+    uint64_t            startUsecs      = 0;
+    uint64_t            encodeUsecs     = 0;
+    uint64_t            decodeUsecs     = 0;
+    u_int               run;
+
+    bzero(costOut, sizeof(*costOut));
+    costOut->compressionType = compressionType;
+    costOut->uncompressedBytes = CFDataGetLength(prelinkedKernel);
+
+    for (run = 0; run < (runs ? runs : 1); run++) {
+        SAFE_RELEASE_NULL(compressed);
+        SAFE_RELEASE_NULL(uncompressed);
+
+        startUsecs = prelinkThreadCPUUsecs();
+        compressed = compressPrelinkedSlice(compressionType,
+            prelinkedKernel, hasRelocs);
+        encodeUsecs = prelinkThreadCPUUsecs() - startUsecs;
+        if (!compressed) {
+            goto finish;
+        }
+
+        startUsecs = prelinkThreadCPUUsecs();
+        uncompressed = uncompressPrelinkedSlice(compressed);
+        decodeUsecs = prelinkThreadCPUUsecs() - startUsecs;
+        if (!uncompressed || !CFEqual(uncompressed, prelinkedKernel)) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+                "Prelinked kernel didn't survive a round trip through %s.",
+                prelinkCodecName(compressionType));
+            goto finish;
+        }
+
+        if (!run || encodeUsecs < costOut->encodeUsecs) {
+            costOut->encodeUsecs = encodeUsecs;
+        }
+        if (!run || decodeUsecs < costOut->decodeUsecs) {
+            costOut->decodeUsecs = decodeUsecs;
+        }
+    }
+    costOut->compressedBytes = CFDataGetLength(compressed);
+
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(compressed);
+    SAFE_RELEASE(uncompressed);
+
+    return result;
+}
+
+/*******************************************************************************
+ * What a codec costs at boot: reading the compressed slice plus decoding it.
+ *******************************************************************************/
+uint64_t
+prelinkCodecBootUsecs(const PrelinkCodecCost * cost)
+{
+    return cost->compressedBytes * 1000000ULL / kPrelinkBootReadBytesPerSec +
+        cost->decodeUsecs;
+}
+
+/*******************************************************************************
+ * Measures every codec this build can write over each slice of an existing
+ * prelinked kernel, compressed or not, and prints one line per slice and codec.
+ *******************************************************************************/
+ExitStatus
+benchmarkPrelinkCodecs(
+    const char        * prelinkPath,
+    u_int               runs)
+{
+    ExitStatus          result          = EX_SOFTWARE;
+    struct timeval      prelinkedKernelTimes[2];
+    CFMutableArrayRef   prelinkedSlices = NULL; // must release
+    CFMutableArrayRef   prelinkedArchs  = NULL; // must release
+    CFDataRef           prelinkedSlice  = NULL; // must release
+    const NXArchInfo  * archInfo        = NULL; // do not free
+    const PrelinkedKernelHeader * header = NULL; // do not free
+    PrelinkCodecCost    cost;
+    uint32_t            codecs[2];
+    u_int               numCodecs       = 0;
+    mode_t              fileMode        = 0;
+    CFIndex             i;
+    u_int               j;
+
+    codecs[numCodecs++] = COMP_TYPE_LZSS;
+    if (supportsFastLibCompression()) {
+        codecs[numCodecs++] = COMP_TYPE_FASTLIB;
+    }
+
+    result = readMachOSlices(prelinkPath, &prelinkedSlices,
+        &prelinkedArchs, &fileMode, prelinkedKernelTimes);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    for (i = 0; i < CFArrayGetCount(prelinkedSlices); ++i) {
+
+        SAFE_RELEASE_NULL(prelinkedSlice);
+        prelinkedSlice = CFRetain(CFArrayGetValueAtIndex(prelinkedSlices, i));
+
+        header = (const PrelinkedKernelHeader *)CFDataGetBytePtr(prelinkedSlice);
+        if (header->signature == OSSwapHostToBigInt32('comp')) {
+            CFDataRef uncompressed = uncompressPrelinkedSlice(prelinkedSlice);
+
+            CFRelease(prelinkedSlice);
+            prelinkedSlice = uncompressed;
+            if (!prelinkedSlice) {
+                result = EX_DATAERR;
+                goto finish;
+            }
+        }
+
+        archInfo = prelinkedArchs ?
+            CFArrayGetValueAtIndex(prelinkedArchs, i) :
+            getThinHeaderPageArch(CFDataGetBytePtr(prelinkedSlice));
+
+        for (j = 0; j < numCodecs; j++) {
+            result = measurePrelinkCodec(prelinkedSlice, codecs[j],
+                kernelImageSupportsKASLR(prelinkedSlice), runs, &cost);
+            if (result != EX_OK) {
+                goto finish;
+            }
+            printf("%s %s: %llu -> %llu bytes (ratio %.2f), "
+                "encode %.1f MB/s, decode %.1f MB/s (%llu.%03llu ms), "
+                "boot %llu.%03llu ms\n",
+                archInfo ? archInfo->name : "unknown",
+                prelinkCodecName(codecs[j]),
+                cost.uncompressedBytes, cost.compressedBytes,
+                (double)cost.uncompressedBytes / cost.compressedBytes,
+                cost.encodeUsecs ?
+                    (double)cost.uncompressedBytes / cost.encodeUsecs : 0.0,
+                cost.decodeUsecs ?
+                    (double)cost.uncompressedBytes / cost.decodeUsecs : 0.0,
+                cost.decodeUsecs / 1000ULL, cost.decodeUsecs % 1000ULL,
+                prelinkCodecBootUsecs(&cost) / 1000ULL,
+                prelinkCodecBootUsecs(&cost) % 1000ULL);
+        }
+    }
+
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(prelinkedSlices);
+    SAFE_RELEASE(prelinkedArchs);
+    SAFE_RELEASE(prelinkedSlice);
+
+    return result;
+}
+
 #if __i386__ || EMBEDDED_HOST // no lzvn for embedded host tools yet
 
 Boolean supportsFastLibCompression(void)
@@ -10,6 +10,7 @@
 #define _KERNELCACHE_H_
 
 #include <libc.h>
+#include <uuid/uuid.h>
 #include "kext_tools_util.h"
 
 #define PLATFORM_NAME_LEN  (64)
@@ -17,6 +18,17 @@
 
 #define COMP_TYPE_LZSS      'lzss'
 #define COMP_TYPE_FASTLIB   'lzvn'
+#define COMP_TYPE_CHUNKED   'chnk'
+
+/* Default uncompressed size of each block in a chunked prelinked kernel.
+ */
+#define kChunkedCompressionBlockSize  (1024 * 1024)
+
+/* Added by kextcache to each kext's prelink info dictionary: the 16-byte
+ * LC_UUID of its linked executable, as CFData. Its load address range is
+ * already there as kPrelinkExecutableLoadKey and kPrelinkExecutableSizeKey.
+ */
+#define kPrelinkExecutableUUIDKey  "_PrelinkExecutableUUID"
 
 
 // prelinkVersion value >= 1 means KASLR supported
@@ -33,6 +45,95 @@ typedef struct prelinked_kernel_header {
     char      data[0];
 } PrelinkedKernelHeader;
 
+/* A chunked compressed prelinked kernel holds the slice as independently
+ * compressed blocks, so that they can be encoded and decoded in parallel.
+ * Its header has compressType COMP_TYPE_CHUNKED, and three of the reserved
+ * words (big-endian, like the rest of the header) describe the blocks.
+ * The data is an array of numBlocks ChunkedBlockEntry records followed by
+ * the compressed blocks; adler32 still covers the whole uncompressed slice.
+ * Booters don't know this format; it is for caches read back by the tools.
+ */
+#define kChunkedCodecIndex      (0)  // reserved[0]: compressType of each block
+#define kChunkedBlockSizeIndex  (1)  // reserved[1]: uncompressed bytes per block
+#define kChunkedNumBlocksIndex  (2)  // reserved[2]: number of blocks
+
+typedef struct chunked_block_entry {
+    uint32_t  offset;          // from the end of the block index
+    uint32_t  compressedSize;
+} ChunkedBlockEntry;
+
+/* Stages of building a prelinked kernel, measured separately.
+ */
+typedef enum {
+    kPrelinkStageRead = 0,
+    kPrelinkStageFilter,
+    kPrelinkStageSignCheck,
+    kPrelinkStageLink,
+    kPrelinkStageCompress,
+    kPrelinkStageWrite,
+    kPrelinkStageSymbols,
+    kPrelinkStageStamps,
+    kPrelinkNumStages
+} PrelinkStage;
+
+typedef struct prelink_stage_stat {
+    uint64_t  wallUsecs;
+    uint64_t  cpuUsecs;        // summed over the threads doing the work
+    uint64_t  bytesIn;
+    uint64_t  bytesOut;
+    uint64_t  kextCount;
+} PrelinkStageStat;
+
+typedef struct prelink_stage_stats {
+    PrelinkStageStat  stage[kPrelinkNumStages];
+} PrelinkStageStats;
+
+/* Symbol files being written in the background; see
+ * startPrelinkedSymbolWrites().
+ */
+typedef struct prelink_symbol_writes PrelinkSymbolWrites;
+
+/* At most this many symbol files are written at once.  The work is mostly
+ * file system calls, so it doesn't follow -j.
+ */
+#define kPrelinkSymbolWriteJobs  (8)
+
+/* Taken by prelinkStageStart() on the thread that will do the work.
+ */
+typedef struct prelink_stage_mark {
+    uint64_t  wallUsecs;
+    uint64_t  cpuUsecs;
+} PrelinkStageMark;
+
+/* What one codec costs on one slice; see measurePrelinkCodec().  Times are
+ * CPU microseconds on the measuring thread.
+ */
+typedef struct prelink_codec_cost {
+    uint32_t  compressionType;
+    uint64_t  uncompressedBytes;
+    uint64_t  compressedBytes;
+    uint64_t  encodeUsecs;
+    uint64_t  decodeUsecs;
+} PrelinkCodecCost;
+
+/* Booter read rate assumed when turning compressed size into boot time,
+ * a conservative rotating-disk figure.
+ */
+#define kPrelinkBootReadBytesPerSec  (50ULL * 1024 * 1024)
+
+/* A fat file being written one slice at a time; see openFatFileWriter().
+ */
+typedef struct fat_file_writer {
+    char              filePath[PATH_MAX];
+    char              tmpPath[PATH_MAX];    // unlinked unless finished
+    int               fileDescriptor;
+    uint32_t          numArchs;
+    uint32_t          nextSlice;
+    uint32_t          nextOffset;
+    uint64_t          bytesWritten;
+    struct fat_arch * fatArchs;             // host byte order; must free
+} FatFileWriter;
+
 typedef struct platform_info {
     char platformName[PLATFORM_NAME_LEN];
     char rootPath[ROOT_PATH_LEN];
@@ -59,6 +160,22 @@ writeFatFile(
     CFArrayRef                  fileArchs,
     mode_t                      fileMode,
     const struct timeval        fileTimes[2]);
+ExitStatus openFatFileWriter(
+    FatFileWriter             * writer,
+    const char                * filePath,
+    CFArrayRef                  fileArchs,
+    mode_t                      fileMode);
+ExitStatus appendFatFileSlice(
+    FatFileWriter             * writer,
+    CFDataRef                   sliceData);
+ExitStatus finishFatFileWriter(
+    FatFileWriter             * writer,
+    boolean_t                   doValidation,
+    dev_t                       file_dev_t,
+    ino_t                       file_ino_t,
+    const struct timeval        fileTimes[2]);
+void abortFatFileWriter(
+    FatFileWriter             * writer);
 void * mapAndSwapFatHeaderPage(
     int fileDescriptor);
 void unmapFatHeaderPage(
@@ -98,11 +215,31 @@ CFDataRef readMachOSlice(
     int         fileDescriptor,
     off_t       fileOffset,
     size_t      fileSliceSize);
+ExitStatus mapMachOSlices(
+    const char        * filePath,
+    CFMutableArrayRef * slicesOut,
+    CFMutableArrayRef * archsOut,
+    mode_t            * modeOut,
+    struct timeval      machOTimesOut[2]);
+CF_RETURNS_RETAINED
+CFDataRef  mapMachOSliceForArch(
+    const char        * filePath,
+    const NXArchInfo  * archInfo,
+    Boolean             checkArch);
+CF_RETURNS_RETAINED
+CFDataRef mapMachOSlice(
+    int         fileDescriptor,
+    off_t       fileOffset,
+    size_t      fileSliceSize);
 int readFileAtOffset(
     int             fileDescriptor,
     off_t           fileOffset,
     size_t          fileSize,
     u_char        * buf);
+Boolean getMachOUUID(
+    const UInt8      * fileBuf,
+    size_t             size,
+    uuid_t             uuidOut);
 int verifyMachOIsArch(
     const UInt8      * fileBuf,
     size_t              size,
@@ -117,11 +254,125 @@ CFDataRef compressPrelinkedSlice(
     uint32_t            compressionType,
     CFDataRef           prelinkImage,
     Boolean             hasRelocs);
+CF_RETURNS_RETAINED
+CFDataRef compressPrelinkedSliceChunked(
+    uint32_t            compressionType,
+    CFDataRef           prelinkImage,
+    Boolean             hasRelocs,
+    uint32_t            blockSize);
 ExitStatus writePrelinkedSymbols(
     CFURLRef    symbolDirURL,
     CFArrayRef  prelinkSymbols,
     CFArrayRef  prelinkArchs);
+ExitStatus startPrelinkedSymbolWrites(
+    CFURLRef              symbolDirURL,
+    CFArrayRef            prelinkSymbols,
+    CFArrayRef            prelinkArchs,
+    PrelinkStageStats   * stats,
+    PrelinkSymbolWrites ** writesOut);
+ExitStatus finishPrelinkedSymbolWrites(
+    PrelinkSymbolWrites * writes);
 ExitStatus makeDirectoryWithURL(
     CFURLRef dirURL);
 
+/* Prelinked kernel engine shared by kextcache and kcgen.
+ */
+void prelinkStageStart(
+    PrelinkStageMark  * mark);
+void prelinkStageEnd(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark);
+void prelinkStageAddWallTime(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark);
+void prelinkStageAddCPUTime(
+    PrelinkStageStats      * stats,
+    PrelinkStage             stage,
+    const PrelinkStageMark * mark);
+void prelinkStageAddCounts(
+    PrelinkStageStats * stats,
+    PrelinkStage        stage,
+    uint64_t            bytesIn,
+    uint64_t            bytesOut,
+    uint64_t            kextCount);
+void logPrelinkStageStats(
+    const PrelinkStageStats * stats);
+ExitStatus writePrelinkStageStats(
+    const PrelinkStageStats * stats,
+    const char              * statsPath);
+ExitStatus createPrelinkArchsForKernel(
+    const char        * kernelPath,
+    CFArrayRef          targetArchs,
+    CFMutableArrayRef * prelinkArchsOut);
+Boolean kernelImageSupportsKASLR(
+    CFDataRef           kernelImage);
+ExitStatus linkPrelinkedKernelSlice(
+    CFDataRef           kernelImage,
+    CFArrayRef          prelinkKexts,
+    CFURLRef            volumeRootURL,
+    uint32_t            flags,
+    PrelinkStageStats * stats,
+    CFDataRef         * prelinkedKernelOut,
+    CFDictionaryRef   * prelinkedSymbolsOut);
+ExitStatus compressPrelinkedKernelSlice(
+    CFDataRef           prelinkedKernel,
+    Boolean             compress,
+    uint32_t            compressionType,
+    Boolean             chunked,
+    Boolean             hasRelocs,
+    PrelinkStageStats * stats,
+    CFDataRef         * prelinkedKernelOut);
+ExitStatus writePrelinkedKernel(
+    const char            * prelinkPath,
+    boolean_t               doValidation,
+    dev_t                   file_dev_t,
+    ino_t                   file_ino_t,
+    CFArrayRef              prelinkSlices,
+    CFArrayRef              prelinkArchs,
+    mode_t                  fileMode,
+    const struct timeval    fileTimes[2],
+    CFURLRef                symbolDirURL,
+    CFArrayRef              generatedSymbols,
+    CFArrayRef              generatedArchs,
+    PrelinkStageStats     * stats);
+ExitStatus openPrelinkedKernelWriter(
+    FatFileWriter         * writer,
+    const char            * prelinkPath,
+    CFArrayRef              prelinkArchs,
+    mode_t                  fileMode,
+    PrelinkStageStats     * stats);
+ExitStatus appendPrelinkedKernelSlice(
+    FatFileWriter         * writer,
+    CFDataRef               prelinkSlice,
+    PrelinkStageStats     * stats);
+ExitStatus finishPrelinkedKernel(
+    FatFileWriter         * writer,
+    boolean_t               doValidation,
+    dev_t                   file_dev_t,
+    ino_t                   file_ino_t,
+    const struct timeval    fileTimes[2],
+    CFURLRef                symbolDirURL,
+    CFArrayRef              generatedSymbols,
+    CFArrayRef              generatedArchs,
+    PrelinkStageStats     * stats);
+ExitStatus recompressPrelinkedKernelFile(
+    const char        * prelinkPath,
+    Boolean             compress,
+    uint32_t            compressionType);
+const char * prelinkCodecName(
+    uint32_t            compressionType);
+ExitStatus measurePrelinkCodec(
+    CFDataRef           prelinkedKernel,
+    uint32_t            compressionType,
+    Boolean             hasRelocs,
+    u_int               runs,
+    PrelinkCodecCost  * costOut);
+uint64_t prelinkCodecBootUsecs(
+    const PrelinkCodecCost * cost);
+ExitStatus benchmarkPrelinkCodecs(
+    const char        * prelinkPath,
+    u_int               runs);
+
 #endif /* _KERNELCACHE_H_ */
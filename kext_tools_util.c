@@ -32,8 +32,15 @@
 #include <asl.h>
 #include <syslog.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <CoreFoundation/CFBundlePriv.h>
 #include <IOKit/kext/OSKext.h>
 #include <IOKit/kext/OSKextPrivate.h>
+#include <IOKit/kext/fat_util.h>
+#include <IOKit/IOCFSerialize.h>
 
 #include "kext_tools_util.h"
 
@@ -160,7 +167,8 @@ Boolean createCFDataFromFile(CFDataRef  *dataRefOut,
     // fill buffer used for CFData passed to caller
     length = (CFIndex) statBuf.st_size;
     buffer = CFAllocatorAllocate(kCFAllocatorDefault, length, 0);
-    if (read(fd, buffer, length) < 0) {
+    if (read(fd, buffer, length) != length) {
+        CFAllocatorDeallocate(kCFAllocatorDefault, buffer);
         goto finish;
     }
     
@@ -186,6 +194,158 @@ finish:
 }
 
 
+/*******************************************************************************
+ * createCFDataFromMappedRange()
+ *
+ * Returns a no-copy CFData over size bytes at offset in the file open on fd,
+ * backed by a private mapping, or NULL if the range can't be mapped.  The
+ * mapping stays valid after fd is closed and after the file is replaced by
+ * rename(), and is unmapped when the CFData is freed.  Pages are
+ * copy-on-write so nothing reaches the file.  Each mapping gets its own
+ * deallocator whose context remembers the page-aligned range to munmap().
+ *******************************************************************************/
+typedef struct {
+    void      * base;
+    size_t      size;
+} MappedRange;
+
+static void
+mappedRangeDeallocate(void * ptr __unused, void * info)
+{
+    MappedRange * mapping = (MappedRange *)info;
+
+    if (mapping->base) {
+        munmap(mapping->base, mapping->size);
+        mapping->base = NULL;
+    }
+}
+
+static void
+mappedRangeRelease(const void * info)
+{
+    free((void *)info);
+}
+
+static void *
+mappedRangeAllocate(CFIndex allocSize __unused, CFOptionFlags hint __unused,
+    void * info __unused)
+{
+    return NULL;
+}
+
+CFDataRef createCFDataFromMappedRange(int     fd,
+                                      off_t   offset,
+                                      size_t  size)
+{
+    CFDataRef           result      = NULL;  // returned
+    CFAllocatorRef      deallocator = NULL;  // must release
+    MappedRange       * mapping     = NULL;  // freed by deallocator
+    CFAllocatorContext  context;
+    off_t               pageOffset  = 0;
+    size_t              slop        = 0;
+    void              * base        = MAP_FAILED;
+
+    if (size == 0) {
+        goto finish;
+    }
+
+    pageOffset = offset & ~((off_t)getpagesize() - 1);
+    slop = (size_t)(offset - pageOffset);
+
+    base = mmap(NULL, size + slop, PROT_READ | PROT_WRITE,
+                MAP_FILE | MAP_PRIVATE, fd, pageOffset);
+    if (base == MAP_FAILED) {
+        goto finish;
+    }
+
+    mapping = malloc(sizeof(*mapping));
+    if (!mapping) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    mapping->base = base;
+    mapping->size = size + slop;
+
+    bzero(&context, sizeof(context));
+    context.info = mapping;
+    context.release = mappedRangeRelease;
+    context.allocate = mappedRangeAllocate;
+    context.deallocate = mappedRangeDeallocate;
+
+    deallocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+    if (!deallocator) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    mapping = NULL;  // owned by deallocator now
+    base = MAP_FAILED;
+
+    result = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
+                                (const UInt8 *)((MappedRange *)context.info)->base + slop,
+                                (CFIndex) size,
+                                deallocator);
+    if (result == NULL) {
+        OSKextLogMemError();
+        mappedRangeDeallocate(NULL, context.info);
+    }
+finish:
+    if (base != MAP_FAILED) {
+        munmap(base, size + slop);
+    }
+    SAFE_FREE(mapping);
+    SAFE_RELEASE(deallocator);
+    return result;
+}
+
+/*******************************************************************************
+ * createCFDataFromMappedFile()
+ *
+ * Like createCFDataFromFile(), but the CFData maps the file with
+ * createCFDataFromMappedRange().  Use it for large files that are read in
+ * place, like kernels.  Falls back to createCFDataFromFile() if the file
+ * can't be mapped.
+ *******************************************************************************/
+Boolean createCFDataFromMappedFile(CFDataRef  *dataRefOut,
+                                   const char *filePath)
+{
+    int                 fd          = -1;
+    Boolean             result      = false;
+    struct stat         statBuf;
+
+    *dataRefOut = NULL;
+    fd = open(filePath, O_RDONLY, 0);
+    if (fd < 0) {
+        goto finish;
+    }
+    if (fstat(fd, &statBuf) != 0) {
+        goto finish;
+    }
+    if ((statBuf.st_mode & S_IFMT) != S_IFREG) {
+        goto finish;
+    }
+    if (statBuf.st_size == 0) {
+        goto finish;
+    }
+
+    *dataRefOut = createCFDataFromMappedRange(fd, 0, (size_t) statBuf.st_size);
+    if (*dataRefOut == NULL) {
+        close(fd);
+        fd = -1;
+        return createCFDataFromFile(dataRefOut, filePath);
+    }
+    result = true;
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (result == false) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel,
+                  "%s: failed for '%s'", __func__, filePath);
+    }
+    return result;
+}
+
 /*******************************************************************************
  *******************************************************************************/
 ExitStatus writeToFile(
@@ -718,6 +878,7 @@ finish:
     return result;
 }
 
+
 /*******************************************************************************
  * Returns the access and mod times from the file in the given directory with 
  * the latest mod time.
@@ -990,6 +1151,46 @@ int getFileDevAndIno(const char * thePath, dev_t * the_dev_t, ino_t * the_ino_t)
     return(my_result);
 }
 
+/*******************************************************************************
+ * Returns TRUE if one of thePath's parent folders is the folder with the_dev_t
+ * and the_ino_t.  This goes by which folders they are rather than by how
+ * thePath spells them, so case and symlinks along thePath don't matter.
+ *******************************************************************************/
+Boolean isPathInFolderWithDevAndIno(const char * thePath,
+                                    dev_t the_dev_t,
+                                    ino_t the_ino_t)
+{
+    char            my_path[PATH_MAX];
+    char          * my_slash;
+    size_t          my_len;
+    dev_t           my_dev_t;
+    ino_t           my_ino_t;
+
+    my_len = strlcpy(my_path, thePath, sizeof(my_path));
+    if (my_len >= sizeof(my_path)) {
+        return FALSE;
+    }
+    while (my_len > 1 && my_path[my_len - 1] == '/') {
+        my_path[--my_len] = 0x00;
+    }
+
+    while ((my_slash = strrchr(my_path, '/')) != NULL) {
+        if (my_slash == my_path) {
+            my_path[1] = 0x00;      // up to "/", and stop there
+        } else {
+            *my_slash = 0x00;
+        }
+        if (getFileDevAndIno(my_path, &my_dev_t, &my_ino_t) == 0 &&
+            my_dev_t == the_dev_t && my_ino_t == the_ino_t) {
+            return TRUE;
+        }
+        if (my_slash == my_path) {
+            break;
+        }
+    }
+    return FALSE;
+}
+
 /*******************************************************************************
  * If the_dev_t and the_ino_t are 0 then we expect thePath to NOT exist.
  *******************************************************************************/
@@ -1657,48 +1858,55 @@ finish:
 #pragma mark Caches
 #endif /* PRAGMA_MARK */
 /*******************************************************************************
+* Property value arrays are also kept in memory, keyed by arch, safe boot
+* state, and property, along with the latest mod time of the system
+* extensions folders they were built from; kextd and kextcache ask for the
+* same few properties over and over.  The on-disk caches are binary plists,
+* which parse much faster than the XML they used to be written as.
 *******************************************************************************/
-Boolean readSystemKextPropertyValues(
-    CFStringRef        propertyKey,
-    const NXArchInfo * arch,
-    Boolean            forceUpdateFlag,
-    CFArrayRef       * valuesOut)
-{
-    Boolean                result                  = false;
-    CFArrayRef             sysExtensionsFolderURLs = OSKextGetSystemExtensionsFolderURLs();
-    CFMutableArrayRef      values                  = NULL;  // must release
-    CFStringRef            cacheBasename           = NULL;  // must release
-    CFArrayRef             kexts                   = NULL;  // must release
-    CFMutableDictionaryRef newDict                 = NULL;  // must release
-    CFStringRef            kextPath                = NULL;  // must release
-    CFTypeRef              value                   = NULL;  // do not release
-    CFStringRef            kextVersion             = NULL;  // do not release
-    CFIndex                count, i;
+static CFMutableDictionaryRef sPropertyValuesCache = NULL;
 
-    cacheBasename = CFStringCreateWithFormat(kCFAllocatorDefault,
-        /* formatOptions */ NULL, CFSTR("%s%@"),
-        _kKextPropertyValuesCacheBasename,
-        propertyKey);
-    if (!cacheBasename) {
-        OSKextLogMemError();
-        goto finish;
-    }
+#define kPropertyValuesVersionKey  CFSTR("Version")
+#define kPropertyValuesValuesKey   CFSTR("Values")
 
-    if (OSKextGetUsesCaches() && !forceUpdateFlag) {
+static CFStringRef
+createPropertyValuesCacheKey(CFStringRef propertyKey, const NXArchInfo * arch)
+{
+    Boolean safeBoot = OSKextGetSimulatedSafeBoot() || OSKextGetActualSafeBoot();
 
-       /* See if we have an up-to-date cache containing an array, and return
-        * that if we have one.
-        */
-        if (_OSKextReadCache(sysExtensionsFolderURLs, cacheBasename,
-            arch, _kOSKextCacheFormatCFXML, /* parseXML? */ true,
-            (CFPropertyListRef *)&values)) {
+    return CFStringCreateWithFormat(kCFAllocatorDefault,
+        /* formatOptions */ NULL, CFSTR("%s:%d:%@"),
+        arch ? arch->name : "(none)", safeBoot ? 1 : 0, propertyKey);
+}
 
-            if (values && CFGetTypeID(values) == CFArrayGetTypeID()) {
-                result = true;
-                goto finish;
-            }
-        }
+static CFStringRef
+createPropertyValuesVersion(CFArrayRef folderURLs)
+{
+    struct timeval folderTimes[2];
+
+    if (!folderURLs ||
+        getLatestTimesFromCFURLArray(folderURLs, folderTimes) != EX_OK) {
+        return NULL;
     }
+    return CFStringCreateWithFormat(kCFAllocatorDefault,
+        /* formatOptions */ NULL, CFSTR("%ld.%06d"),
+        (long)folderTimes[1].tv_sec, (int)folderTimes[1].tv_usec);
+}
+
+/*******************************************************************************
+* Builds the { Data, CFBundleIdentifier, OSBundlePath, CFBundleVersion }
+* entries for each of kexts that has propertyKey, for the current arch.
+*******************************************************************************/
+static CFMutableArrayRef
+createPropertyValuesForKexts(CFArrayRef kexts, CFStringRef propertyKey)
+{
+    CFMutableArrayRef      result          = NULL;
+    CFMutableArrayRef      values          = NULL;  // must release
+    CFMutableDictionaryRef newDict         = NULL;  // must release
+    CFStringRef            kextPath        = NULL;  // must release
+    CFTypeRef              value           = NULL;  // do not release
+    CFStringRef            kextVersion     = NULL;  // do not release
+    CFIndex                count, i;
 
     values = CFArrayCreateMutable(kCFAllocatorDefault, /* capacity */ 0,
         &kCFTypeArrayCallBacks);
@@ -1707,14 +1915,6 @@ Boolean readSystemKextPropertyValues(
         goto finish;
     }
 
-    kexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-    sysExtensionsFolderURLs);
-
-    if (!kexts) {
-        // Create function should log error
-        goto finish;
-    }
-
     count = CFArrayGetCount(kexts);
 
     for (i = 0; i < count; i++) {
@@ -1767,13 +1967,133 @@ Boolean readSystemKextPropertyValues(
         CFArrayAppendValue(values, newDict);
     }
 
+    result = values;
+    values = NULL;
+
+finish:
+    SAFE_RELEASE(values);
+    SAFE_RELEASE(newDict);
+    SAFE_RELEASE(kextPath);
+
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void
+rememberPropertyValues(
+    CFStringRef memoryCacheKey,
+    CFStringRef foldersVersion,
+    CFArrayRef  values)
+{
+    CFMutableDictionaryRef memoryEntry = NULL;  // must release
+
+    if (!memoryCacheKey || !foldersVersion) {
+        goto finish;
+    }
+    if (!sPropertyValuesCache) {
+        sPropertyValuesCache = CFDictionaryCreateMutable(kCFAllocatorDefault,
+            0, &kCFTypeDictionaryKeyCallBacks,
+            &kCFTypeDictionaryValueCallBacks);
+    }
+    memoryEntry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (sPropertyValuesCache && memoryEntry) {
+        CFDictionarySetValue(memoryEntry, kPropertyValuesVersionKey,
+            foldersVersion);
+        CFDictionarySetValue(memoryEntry, kPropertyValuesValuesKey, values);
+        CFDictionarySetValue(sPropertyValuesCache, memoryCacheKey,
+            memoryEntry);
+    }
+
+finish:
+    SAFE_RELEASE(memoryEntry);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+Boolean readSystemKextPropertyValues(
+    CFStringRef        propertyKey,
+    const NXArchInfo * arch,
+    Boolean            forceUpdateFlag,
+    CFArrayRef       * valuesOut)
+{
+    Boolean                result                  = false;
+    CFArrayRef             sysExtensionsFolderURLs = OSKextGetSystemExtensionsFolderURLs();
+    CFMutableArrayRef      values                  = NULL;  // must release
+    CFStringRef            cacheBasename           = NULL;  // must release
+    CFArrayRef             kexts                   = NULL;  // must release
+    CFStringRef            memoryCacheKey          = NULL;  // must release
+    CFStringRef            foldersVersion          = NULL;  // must release
+
+    memoryCacheKey = createPropertyValuesCacheKey(propertyKey, arch);
+    foldersVersion = createPropertyValuesVersion(sysExtensionsFolderURLs);
+    if (memoryCacheKey && foldersVersion && !forceUpdateFlag &&
+        sPropertyValuesCache) {
+
+        CFDictionaryRef cached = CFDictionaryGetValue(sPropertyValuesCache,
+            memoryCacheKey);
+        if (cached && CFEqual(foldersVersion,
+            CFDictionaryGetValue(cached, kPropertyValuesVersionKey))) {
+
+            values = (CFMutableArrayRef)CFDictionaryGetValue(cached,
+                kPropertyValuesValuesKey);
+            CFRetain(values);
+            result = true;
+            goto finish;
+        }
+    }
+
+    cacheBasename = CFStringCreateWithFormat(kCFAllocatorDefault,
+        /* formatOptions */ NULL, CFSTR("%s%@"),
+        _kKextPropertyValuesCacheBasename,
+        propertyKey);
+    if (!cacheBasename) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (OSKextGetUsesCaches() && !forceUpdateFlag) {
+
+       /* See if we have an up-to-date cache containing an array, and return
+        * that if we have one.
+        */
+        if (_OSKextReadCache(sysExtensionsFolderURLs, cacheBasename,
+            arch, kKextPropertyValuesCacheFormat, /* parseXML? */ true,
+            (CFPropertyListRef *)&values)) {
+
+            if (values && CFGetTypeID(values) == CFArrayGetTypeID()) {
+                result = true;
+                goto remember;
+            }
+        }
+        SAFE_RELEASE_NULL(values);
+    }
+
+    kexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+    sysExtensionsFolderURLs);
+
+    if (!kexts) {
+        // Create function should log error
+        goto finish;
+    }
+
+    values = createPropertyValuesForKexts(kexts, propertyKey);
+    if (!values) {
+        goto finish;
+    }
+
     if (OSKextGetUsesCaches() || forceUpdateFlag) {
         _OSKextWriteCache(sysExtensionsFolderURLs, cacheBasename,
-            arch, _kOSKextCacheFormatCFXML, values);
+            arch, kKextPropertyValuesCacheFormat, values);
     }
 
     result = true;
 
+remember:
+    rememberPropertyValues(memoryCacheKey, foldersVersion, values);
+
 finish:
     if (result && valuesOut && values) {
         *valuesOut = (CFArrayRef)CFRetain(values);
@@ -1782,9 +2102,1323 @@ finish:
     SAFE_RELEASE(values);
     SAFE_RELEASE(cacheBasename);
     SAFE_RELEASE(kexts);
-    SAFE_RELEASE(newDict);
-    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(memoryCacheKey);
+    SAFE_RELEASE(foldersVersion);
 
     return result;
 }
 
+/*******************************************************************************
+* Drops the in-memory property value arrays; the next read rebuilds them from
+* the on-disk caches.
+*******************************************************************************/
+void flushSystemKextPropertyValues(void)
+{
+    SAFE_RELEASE_NULL(sPropertyValuesCache);
+    return;
+}
+
+/*******************************************************************************
+* Like readSystemKextPropertyValues() with forceUpdateFlag, but for kexts the
+* caller has already created from the system extensions folders, so that
+* kextcache can write every cached property from one scan of them.  The arch
+* must already be set with OSKextSetArchitecture().
+*******************************************************************************/
+Boolean writeSystemKextPropertyValues(
+    CFArrayRef         kexts,
+    CFStringRef        propertyKey,
+    const NXArchInfo * arch)
+{
+    Boolean                result                  = false;
+    CFArrayRef             sysExtensionsFolderURLs = OSKextGetSystemExtensionsFolderURLs();
+    CFMutableArrayRef      values                  = NULL;  // must release
+    CFStringRef            cacheBasename           = NULL;  // must release
+    CFStringRef            memoryCacheKey          = NULL;  // must release
+    CFStringRef            foldersVersion          = NULL;  // must release
+
+    cacheBasename = CFStringCreateWithFormat(kCFAllocatorDefault,
+        /* formatOptions */ NULL, CFSTR("%s%@"),
+        _kKextPropertyValuesCacheBasename,
+        propertyKey);
+    if (!cacheBasename) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    values = createPropertyValuesForKexts(kexts, propertyKey);
+    if (!values) {
+        goto finish;
+    }
+
+    if (!_OSKextWriteCache(sysExtensionsFolderURLs, cacheBasename,
+        arch, kKextPropertyValuesCacheFormat, values)) {
+
+        goto finish;
+    }
+
+    memoryCacheKey = createPropertyValuesCacheKey(propertyKey, arch);
+    foldersVersion = createPropertyValuesVersion(sysExtensionsFolderURLs);
+    rememberPropertyValues(memoryCacheKey, foldersVersion, values);
+
+    result = true;
+
+finish:
+    SAFE_RELEASE(values);
+    SAFE_RELEASE(cacheBasename);
+    SAFE_RELEASE(memoryCacheKey);
+    SAFE_RELEASE(foldersVersion);
+
+    return result;
+}
+
+/*******************************************************************************
+* The symbol index records, for each arch, which system kexts define and
+* which reference each symbol, so kextfind -dsym/-rsym needn't scan every
+* candidate's symbol table.  It's a per-arch cache alongside the property
+* value caches, so it goes stale with the extensions folders; each kext's
+* entry also carries its UUID, so a kext swapped in without touching the
+* folders is rescanned rather than answered for.
+*
+* Kexts holds { Path, UUID } for each indexed kext; Defines and References
+* map symbol names to CFData arrays of uint32_t positions in Kexts.
+*******************************************************************************/
+#define kKextSymbolIndexVersion        1
+
+#define kKextSymbolIndexVersionKey     CFSTR("Version")
+#define kKextSymbolIndexKextsKey       CFSTR("Kexts")
+#define kKextSymbolIndexDefinesKey     CFSTR("Defines")
+#define kKextSymbolIndexReferencesKey  CFSTR("References")
+#define kKextSymbolIndexPathKey        CFSTR("Path")
+#define kKextSymbolIndexUUIDKey        CFSTR("UUID")
+
+/* In memory only: kext path -> position, built when an index is read.
+ */
+#define kKextSymbolIndexPositionsKey   CFSTR("Positions")
+
+static CFMutableDictionaryRef sKextSymbolIndexes     = NULL;  // arch name -> index
+static pthread_mutex_t        sKextSymbolIndexesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+*******************************************************************************/
+static Boolean
+addSymbolToKextSymbolIndex(
+    CFMutableDictionaryRef symbols,
+    const char           * name,
+    uint32_t               position)
+{
+    Boolean          result       = false;
+    CFStringRef      symbol       = NULL;  // must release
+    CFMutableDataRef positions    = NULL;  // do not release
+    CFMutableDataRef newPositions = NULL;  // must release
+    CFIndex          length;
+
+    symbol = CFStringCreateWithCString(kCFAllocatorDefault, name,
+        kCFStringEncodingUTF8);
+    if (!symbol) {
+        // not UTF-8; nobody can ask for it on the command line anyway
+        result = true;
+        goto finish;
+    }
+
+    positions = (CFMutableDataRef)CFDictionaryGetValue(symbols, symbol);
+    if (!positions) {
+        newPositions = CFDataCreateMutable(kCFAllocatorDefault, 0);
+        if (!newPositions) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionarySetValue(symbols, symbol, newPositions);
+        positions = newPositions;
+    }
+
+   /* Kexts are added in order, so a repeat can only be the last one.
+    */
+    length = CFDataGetLength(positions);
+    if (length >= (CFIndex)sizeof(position) &&
+        ((const uint32_t *)CFDataGetBytePtr(positions))
+            [length / sizeof(position) - 1] == position) {
+
+        result = true;
+        goto finish;
+    }
+    CFDataAppendBytes(positions, (const UInt8 *)&position, sizeof(position));
+    result = true;
+
+finish:
+    SAFE_RELEASE(symbol);
+    SAFE_RELEASE(newPositions);
+    return result;
+}
+
+/*******************************************************************************
+* Adds the symbols in one thin Mach-O file to the index under position,
+* classified the way kextfind's evalDefinesOrReferencesSymbol() does.
+* Returns false only on allocation failure; a malformed file adds nothing.
+*******************************************************************************/
+static Boolean
+addMachOToKextSymbolIndex(
+    const void             * file,
+    const void             * fileEnd,
+    Boolean                  isKernelComponent,
+    uint32_t                 position,
+    CFMutableDictionaryRef   defines,
+    CFMutableDictionaryRef   references)
+{
+    const struct mach_header    * machHeader = (const struct mach_header *)file;
+    const struct symtab_command * symtab     = NULL;
+    const uint8_t               * cmd        = NULL;
+    const uint8_t               * symbols    = NULL;
+    const char                  * strings    = NULL;
+    size_t                        fileSize   = (const uint8_t *)fileEnd -
+                                               (const uint8_t *)file;
+    size_t                        nlistSize;
+    uint32_t                      i;
+
+    if (fileSize < sizeof(struct mach_header_64)) {
+        return true;
+    }
+    if (machHeader->magic == MH_MAGIC_64) {
+        cmd = (const uint8_t *)file + sizeof(struct mach_header_64);
+        nlistSize = sizeof(struct nlist_64);
+    } else if (machHeader->magic == MH_MAGIC) {
+        cmd = (const uint8_t *)file + sizeof(struct mach_header);
+        nlistSize = sizeof(struct nlist);
+    } else {
+        return true;
+    }
+
+    for (i = 0; i < machHeader->ncmds; i++) {
+        const struct load_command * loadCmd = (const struct load_command *)cmd;
+
+        if (cmd + sizeof(*loadCmd) > (const uint8_t *)fileEnd ||
+            loadCmd->cmdsize < sizeof(*loadCmd) ||
+            cmd + loadCmd->cmdsize > (const uint8_t *)fileEnd) {
+
+            return true;
+        }
+        if (loadCmd->cmd == LC_SYMTAB &&
+            loadCmd->cmdsize >= sizeof(struct symtab_command)) {
+
+            symtab = (const struct symtab_command *)cmd;
+            break;
+        }
+        cmd += loadCmd->cmdsize;
+    }
+    if (!symtab ||
+        symtab->stroff > fileSize || symtab->strsize > fileSize - symtab->stroff ||
+        symtab->symoff > fileSize ||
+        symtab->nsyms > (fileSize - symtab->symoff) / nlistSize) {
+
+        return true;
+    }
+    symbols = (const uint8_t *)file + symtab->symoff;
+    strings = (const char *)file + symtab->stroff;
+
+    for (i = 0; i < symtab->nsyms; i++) {
+        const struct nlist * sym = (const struct nlist *)(symbols + i * nlistSize);
+        uint32_t             strx = sym->n_un.n_strx;  // same offset in nlist_64
+        uint8_t              n_type = sym->n_type & N_TYPE;
+        const char         * name;
+        Boolean              definesIt = false;
+        Boolean              referencesIt = false;
+
+        if ((sym->n_type & N_STAB) || strx == 0 || strx >= symtab->strsize) {
+            continue;
+        }
+        name = strings + strx;
+        if (!memchr(name, '\0', symtab->strsize - strx)) {
+            continue;
+        }
+
+       /* KPI kexts list what they export as undefined or indirect, and
+        * don't reference anything.
+        */
+        if (isKernelComponent) {
+            definesIt = true;
+        } else if (n_type == N_UNDF) {
+            referencesIt = true;
+        } else {
+            definesIt = true;
+            referencesIt = (n_type == N_INDR);
+        }
+
+        if (definesIt &&
+            !addSymbolToKextSymbolIndex(defines, name, position)) {
+
+            return false;
+        }
+        if (referencesIt &&
+            !addSymbolToKextSymbolIndex(references, name, position)) {
+
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+* Builds the symbol index of kexts for arch and writes it for the system
+* extensions folders; kextcache calls this when it updates the other
+* system plist caches.
+*******************************************************************************/
+Boolean writeKextSymbolIndex(
+    CFArrayRef         kexts,
+    const NXArchInfo * arch)
+{
+    Boolean                result        = false;
+    CFMutableDictionaryRef index         = NULL;  // must release
+    CFMutableArrayRef      indexKexts    = NULL;  // must release
+    CFMutableDictionaryRef defines       = NULL;  // must release
+    CFMutableDictionaryRef references    = NULL;  // must release
+    CFMutableDictionaryRef kextEntry     = NULL;  // must release
+    CFStringRef            kextPath      = NULL;  // must release
+    CFDataRef              uuid          = NULL;  // must release
+    CFURLRef               executableURL = NULL;  // must release
+    CFNumberRef            version       = NULL;  // must release
+    fat_iterator           fiter         = NULL;  // must close
+    char                   executablePath[PATH_MAX];
+    int                    versionValue  = kKextSymbolIndexVersion;
+    CFIndex                count, i;
+
+    if (!createCFMutableDictionary(&index) ||
+        !createCFMutableArray(&indexKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableDictionary(&defines) ||
+        !createCFMutableDictionary(&references)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef  aKext    = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+        void     * file     = NULL;
+        void     * fileEnd  = NULL;
+        uint32_t   position = (uint32_t)CFArrayGetCount(indexKexts);
+
+        SAFE_RELEASE_NULL(kextEntry);
+        SAFE_RELEASE_NULL(kextPath);
+        SAFE_RELEASE_NULL(uuid);
+        SAFE_RELEASE_NULL(executableURL);
+        if (fiter) {
+            fat_iterator_close(fiter);
+            fiter = NULL;
+        }
+
+        if (!OSKextDeclaresExecutable(aKext)) {
+            continue;
+        }
+        uuid = OSKextCopyUUIDForArchitecture(aKext, arch);
+        kextPath = copyKextPath(aKext);
+        executableURL = _CFBundleCopyExecutableURLInDirectory(
+            OSKextGetURL(aKext));
+        if (!uuid || !kextPath || !executableURL) {
+            continue;
+        }
+        if (!CFURLGetFileSystemRepresentation(executableURL,
+            /* resolveToBase? */ true, (UInt8 *)executablePath,
+            sizeof(executablePath))) {
+
+            continue;
+        }
+        fiter = fat_iterator_open(executablePath, /* macho_only? */ true);
+        if (!fiter) {
+            continue;
+        }
+        file = fat_iterator_find_arch(fiter, arch->cputype, arch->cpusubtype,
+            &fileEnd);
+        if (!file) {
+            continue;
+        }
+
+        if (!addMachOToKextSymbolIndex(file, fileEnd,
+            OSKextIsKernelComponent(aKext), position, defines, references)) {
+
+            OSKextLogMemError();
+            goto finish;
+        }
+
+        if (!createCFMutableDictionary(&kextEntry)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionarySetValue(kextEntry, kKextSymbolIndexPathKey, kextPath);
+        CFDictionarySetValue(kextEntry, kKextSymbolIndexUUIDKey, uuid);
+        CFArrayAppendValue(indexKexts, kextEntry);
+    }
+
+    version = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType,
+        &versionValue);
+    if (!version) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(index, kKextSymbolIndexVersionKey, version);
+    CFDictionarySetValue(index, kKextSymbolIndexKextsKey, indexKexts);
+    CFDictionarySetValue(index, kKextSymbolIndexDefinesKey, defines);
+    CFDictionarySetValue(index, kKextSymbolIndexReferencesKey, references);
+
+    result = _OSKextWriteCache(OSKextGetSystemExtensionsFolderURLs(),
+        CFSTR(_kKextSymbolIndexCacheBasename), arch,
+        kKextSymbolIndexCacheFormat, index);
+
+finish:
+    if (fiter) fat_iterator_close(fiter);
+    SAFE_RELEASE(index);
+    SAFE_RELEASE(indexKexts);
+    SAFE_RELEASE(defines);
+    SAFE_RELEASE(references);
+    SAFE_RELEASE(kextEntry);
+    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(uuid);
+    SAFE_RELEASE(executableURL);
+    SAFE_RELEASE(version);
+    return result;
+}
+
+/*******************************************************************************
+* Returns the symbol index for arch, reading it the first time it's asked
+* for; kCFNull is remembered for an arch with no usable index.
+*******************************************************************************/
+CF_RETURNS_RETAINED
+static CFDictionaryRef
+copyKextSymbolIndexForArch(const NXArchInfo * arch)
+{
+    CFDictionaryRef        result     = NULL;
+    CFStringRef            archName   = NULL;  // must release
+    CFPropertyListRef      cache      = NULL;  // must release
+    CFMutableDictionaryRef index      = NULL;  // must release
+    CFMutableDictionaryRef positions  = NULL;  // must release
+    CFTypeRef              value      = NULL;  // do not release
+    CFTypeRef              entry      = kCFNull;
+    CFArrayRef             indexKexts = NULL;  // do not release
+    int                    versionValue;
+    CFIndex                count, i;
+
+    pthread_mutex_lock(&sKextSymbolIndexesLock);
+
+    archName = CFStringCreateWithCString(kCFAllocatorDefault, arch->name,
+        kCFStringEncodingUTF8);
+    if (!archName) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    if (sKextSymbolIndexes) {
+        value = CFDictionaryGetValue(sKextSymbolIndexes, archName);
+        if (value) {
+            if (value != kCFNull) {
+                result = CFRetain(value);
+            }
+            goto finish;
+        }
+    } else if (!createCFMutableDictionary(&sKextSymbolIndexes)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (!OSKextGetUsesCaches() ||
+        !_OSKextReadCache(OSKextGetSystemExtensionsFolderURLs(),
+            CFSTR(_kKextSymbolIndexCacheBasename), arch,
+            kKextSymbolIndexCacheFormat, /* parseXML? */ true, &cache) ||
+        !cache || CFGetTypeID(cache) != CFDictionaryGetTypeID()) {
+
+        goto remember;
+    }
+
+    value = CFDictionaryGetValue(cache, kKextSymbolIndexVersionKey);
+    if (!value || CFGetTypeID(value) != CFNumberGetTypeID() ||
+        !CFNumberGetValue(value, kCFNumberIntType, &versionValue) ||
+        versionValue != kKextSymbolIndexVersion) {
+
+        goto remember;
+    }
+    indexKexts = CFDictionaryGetValue(cache, kKextSymbolIndexKextsKey);
+    value = CFDictionaryGetValue(cache, kKextSymbolIndexDefinesKey);
+    if (!indexKexts || CFGetTypeID(indexKexts) != CFArrayGetTypeID() ||
+        !value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+
+        goto remember;
+    }
+    value = CFDictionaryGetValue(cache, kKextSymbolIndexReferencesKey);
+    if (!value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+        goto remember;
+    }
+
+    index = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, cache);
+    if (!index || !createCFMutableDictionary(&positions)) {
+        OSKextLogMemError();
+        goto remember;
+    }
+    count = CFArrayGetCount(indexKexts);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef kextEntry = CFArrayGetValueAtIndex(indexKexts, i);
+        CFNumberRef     position  = NULL;  // must release
+
+        if (CFGetTypeID(kextEntry) != CFDictionaryGetTypeID()) {
+            continue;
+        }
+        value = CFDictionaryGetValue(kextEntry, kKextSymbolIndexPathKey);
+        if (!value || CFGetTypeID(value) != CFStringGetTypeID()) {
+            continue;
+        }
+        position = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &i);
+        if (!position) {
+            OSKextLogMemError();
+            goto remember;
+        }
+        CFDictionarySetValue(positions, value, position);
+        CFRelease(position);
+    }
+    CFDictionarySetValue(index, kKextSymbolIndexPositionsKey, positions);
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
+        "Using %s symbol index of %d kexts.", arch->name, (int)count);
+
+    entry = index;
+    result = CFRetain(index);
+
+remember:
+    CFDictionarySetValue(sKextSymbolIndexes, archName, entry);
+
+finish:
+    pthread_mutex_unlock(&sKextSymbolIndexesLock);
+
+    SAFE_RELEASE(archName);
+    SAFE_RELEASE(cache);
+    SAFE_RELEASE(index);
+    SAFE_RELEASE(positions);
+    return result;
+}
+
+/*******************************************************************************
+* Answers whether aKext defines (or references) symbol in any of its arches
+* from the symbol index, as kextfind would by scanning it.  Returns
+* kKextSymbolIndexUnknown if any arch of aKext isn't indexed as it is now on
+* disk, in which case the caller has to look for itself.
+*******************************************************************************/
+KextSymbolIndexResult lookUpKextSymbolIndex(
+    OSKextRef   aKext,
+    CFStringRef symbol,
+    Boolean     seekingReference)
+{
+    KextSymbolIndexResult result   = kKextSymbolIndexUnknown;
+    const NXArchInfo   ** arches   = NULL;  // must free
+    CFStringRef           kextPath = NULL;  // must release
+    CFDictionaryRef       index    = NULL;  // must release
+    CFDataRef             uuid     = NULL;  // must release
+    Boolean               found    = false;
+    int                   i;
+
+    arches = OSKextCopyArchitectures(aKext);
+    kextPath = copyKextPath(aKext);
+    if (!arches || !arches[0] || !kextPath) {
+        goto finish;
+    }
+
+    for (i = 0; arches[i]; i++) {
+        CFNumberRef     positionNum = NULL;  // do not release
+        CFDictionaryRef kextEntry   = NULL;  // do not release
+        CFDataRef       positions   = NULL;  // do not release
+        CFIndex         position;
+        CFIndex         count, j;
+
+        SAFE_RELEASE_NULL(index);
+        SAFE_RELEASE_NULL(uuid);
+
+        index = copyKextSymbolIndexForArch(arches[i]);
+        if (!index) {
+            goto finish;
+        }
+        positionNum = CFDictionaryGetValue(
+            CFDictionaryGetValue(index, kKextSymbolIndexPositionsKey), kextPath);
+        if (!positionNum ||
+            !CFNumberGetValue(positionNum, kCFNumberCFIndexType, &position)) {
+
+            goto finish;
+        }
+        kextEntry = CFArrayGetValueAtIndex(
+            CFDictionaryGetValue(index, kKextSymbolIndexKextsKey), position);
+        uuid = OSKextCopyUUIDForArchitecture(aKext, arches[i]);
+        if (!uuid ||
+            !CFEqual(uuid, CFDictionaryGetValue(kextEntry, kKextSymbolIndexUUIDKey))) {
+
+            goto finish;
+        }
+
+        if (found) {
+            continue;  // still have to vouch for the remaining arches
+        }
+        positions = CFDictionaryGetValue(CFDictionaryGetValue(index,
+            seekingReference ? kKextSymbolIndexReferencesKey :
+            kKextSymbolIndexDefinesKey), symbol);
+        if (!positions || CFGetTypeID(positions) != CFDataGetTypeID()) {
+            continue;
+        }
+        count = CFDataGetLength(positions) / sizeof(uint32_t);
+        for (j = 0; j < count; j++) {
+            if (((const uint32_t *)CFDataGetBytePtr(positions))[j] ==
+                (uint32_t)position) {
+
+                found = true;
+                break;
+            }
+        }
+    }
+
+    result = found ? kKextSymbolIndexFound : kKextSymbolIndexNotFound;
+
+finish:
+    SAFE_FREE(arches);
+    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(index);
+    SAFE_RELEASE(uuid);
+    return result;
+}
+
+/*******************************************************************************
+* The dependency index records, for each arch, the load list of each system
+* kext as paths in load order (the kext itself last), so a tool working with
+* a few kexts can open just those instead of scanning the extensions
+* folders.  Like the symbol index it goes stale with the folders; each entry
+* also carries the kext's CFBundleVersion, and any kext opened from the
+* index that doesn't match it, or doesn't resolve, sends the caller back to
+* a full scan.
+*
+* Kexts maps a bundle identifier to { Version, Paths } for the kext that
+* dependency resolution would pick for that identifier.
+*******************************************************************************/
+#define kKextDependencyIndexVersion     1
+
+#define kKextDependencyIndexVersionKey  CFSTR("Version")
+#define kKextDependencyIndexKextsKey    CFSTR("Kexts")
+#define kKextDependencyIndexPathsKey    CFSTR("Paths")
+
+/*******************************************************************************
+* Builds the dependency index of kexts for arch, which must be the current
+* OSKext architecture, and writes it for the system extensions folders.
+*******************************************************************************/
+Boolean writeKextDependencyIndex(
+    CFArrayRef         kexts,
+    const NXArchInfo * arch)
+{
+    Boolean                result       = false;
+    CFMutableDictionaryRef index        = NULL;  // must release
+    CFMutableDictionaryRef indexKexts   = NULL;  // must release
+    CFMutableDictionaryRef kextEntry    = NULL;  // must release
+    CFMutableArrayRef      paths        = NULL;  // must release
+    CFArrayRef             loadList     = NULL;  // must release
+    CFStringRef            kextPath     = NULL;  // must release
+    CFNumberRef            version      = NULL;  // must release
+    int                    versionValue = kKextDependencyIndexVersion;
+    CFIndex                count, i;
+
+    if (!createCFMutableDictionary(&index) ||
+        !createCFMutableDictionary(&indexKexts)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef   aKext         = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+        CFStringRef kextID        = OSKextGetIdentifier(aKext);
+        CFTypeRef   bundleVersion = NULL;  // do not release
+        CFIndex     numKexts, j;
+
+        SAFE_RELEASE_NULL(kextEntry);
+        SAFE_RELEASE_NULL(paths);
+        SAFE_RELEASE_NULL(loadList);
+
+        if (!kextID || OSKextGetKextWithIdentifier(kextID) != aKext) {
+            continue;
+        }
+        bundleVersion = OSKextGetValueForInfoDictionaryKey(aKext,
+            kCFBundleVersionKey);
+        if (!bundleVersion ||
+            CFGetTypeID(bundleVersion) != CFStringGetTypeID()) {
+
+            continue;
+        }
+        loadList = OSKextCopyLoadList(aKext, /* needAll? */ true);
+        if (!loadList) {
+            continue;
+        }
+
+        if (!createCFMutableArray(&paths, &kCFTypeArrayCallBacks) ||
+            !createCFMutableDictionary(&kextEntry)) {
+
+            OSKextLogMemError();
+            goto finish;
+        }
+        numKexts = CFArrayGetCount(loadList);
+        for (j = 0; j < numKexts; j++) {
+            SAFE_RELEASE_NULL(kextPath);
+            kextPath = copyKextPath(
+                (OSKextRef)CFArrayGetValueAtIndex(loadList, j));
+            if (!kextPath) {
+                break;
+            }
+            CFArrayAppendValue(paths, kextPath);
+        }
+        if (j < numKexts) {
+            continue;
+        }
+        CFDictionarySetValue(kextEntry, kKextDependencyIndexVersionKey,
+            bundleVersion);
+        CFDictionarySetValue(kextEntry, kKextDependencyIndexPathsKey, paths);
+        CFDictionarySetValue(indexKexts, kextID, kextEntry);
+    }
+
+    version = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType,
+        &versionValue);
+    if (!version) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(index, kKextDependencyIndexVersionKey, version);
+    CFDictionarySetValue(index, kKextDependencyIndexKextsKey, indexKexts);
+
+    result = _OSKextWriteCache(OSKextGetSystemExtensionsFolderURLs(),
+        CFSTR(_kKextDependencyIndexCacheBasename), arch,
+        kKextDependencyIndexCacheFormat, index);
+
+finish:
+    SAFE_RELEASE(index);
+    SAFE_RELEASE(indexKexts);
+    SAFE_RELEASE(kextEntry);
+    SAFE_RELEASE(paths);
+    SAFE_RELEASE(loadList);
+    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(version);
+    return result;
+}
+
+/*******************************************************************************
+* Adds to kexts the kexts on the indexed load list of kextID. Returns false
+* if kextID isn't indexed or its kexts don't match the index.
+*******************************************************************************/
+static Boolean
+addKextsFromDependencyIndex(
+    CFMutableArrayRef kexts,
+    CFDictionaryRef   indexKexts,
+    CFStringRef       kextID)
+{
+    Boolean           result    = false;
+    CFDictionaryRef   kextEntry = NULL;  // do not release
+    CFTypeRef         version   = NULL;  // do not release
+    CFArrayRef        paths     = NULL;  // do not release
+    CFURLRef          kextURL   = NULL;  // must release
+    OSKextRef         aKext     = NULL;  // must release
+    CFIndex           count, i;
+
+    kextEntry = CFDictionaryGetValue(indexKexts, kextID);
+    if (!kextEntry || CFGetTypeID(kextEntry) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+    version = CFDictionaryGetValue(kextEntry, kKextDependencyIndexVersionKey);
+    paths = CFDictionaryGetValue(kextEntry, kKextDependencyIndexPathsKey);
+    if (!version || !paths || CFGetTypeID(paths) != CFArrayGetTypeID()) {
+        goto finish;
+    }
+
+    count = CFArrayGetCount(paths);
+    for (i = 0; i < count; i++) {
+        CFStringRef path = CFArrayGetValueAtIndex(paths, i);
+
+        SAFE_RELEASE_NULL(kextURL);
+        SAFE_RELEASE_NULL(aKext);
+
+        if (CFGetTypeID(path) != CFStringGetTypeID()) {
+            goto finish;
+        }
+        kextURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, path,
+            kCFURLPOSIXPathStyle, /* isDirectory */ true);
+        if (!kextURL) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        aKext = OSKextCreate(kCFAllocatorDefault, kextURL);
+        if (!aKext) {
+            goto finish;
+        }
+        addToArrayIfAbsent(kexts, aKext);
+    }
+
+   /* The requested kext is last; make sure it's still the version indexed.
+    */
+    if (!aKext || !CFEqual(version,
+        OSKextGetValueForInfoDictionaryKey(aKext, kCFBundleVersionKey))) {
+
+        goto finish;
+    }
+    result = true;
+
+finish:
+    SAFE_RELEASE(kextURL);
+    SAFE_RELEASE(aKext);
+    return result;
+}
+
+/*******************************************************************************
+* Opens the kexts at kextURLs (with their plugins), the kexts with
+* identifiers kextIDs, and everything any of them depends on, from the
+* dependency index for arch rather than by scanning the system extensions
+* folders. Returns NULL if the index is missing or stale or doesn't cover
+* all of them, in which case the caller should scan as usual.
+*******************************************************************************/
+CFArrayRef createKextsFromDependencyIndex(
+    CFArrayRef         kextURLs,
+    CFArrayRef         kextIDs,
+    const NXArchInfo * arch)
+{
+    CFArrayRef             result      = NULL;
+    CFPropertyListRef      cache       = NULL;  // must release
+    CFDictionaryRef        indexKexts  = NULL;  // do not release
+    CFTypeRef              value       = NULL;  // do not release
+    CFArrayRef             namedKexts  = NULL;  // must release
+    CFMutableArrayRef      kexts       = NULL;  // must release
+    CFMutableArrayRef      neededIDs   = NULL;  // must release
+    CFStringRef          * libraryIDs  = NULL;  // must free
+    int                    versionValue;
+    CFIndex                count, i;
+
+    if (!OSKextGetUsesCaches() ||
+        !_OSKextReadCache(OSKextGetSystemExtensionsFolderURLs(),
+            CFSTR(_kKextDependencyIndexCacheBasename), arch,
+            kKextDependencyIndexCacheFormat, /* parseXML? */ true, &cache) ||
+        !cache || CFGetTypeID(cache) != CFDictionaryGetTypeID()) {
+
+        goto finish;
+    }
+    value = CFDictionaryGetValue(cache, kKextDependencyIndexVersionKey);
+    if (!value || CFGetTypeID(value) != CFNumberGetTypeID() ||
+        !CFNumberGetValue(value, kCFNumberIntType, &versionValue) ||
+        versionValue != kKextDependencyIndexVersion) {
+
+        goto finish;
+    }
+    indexKexts = CFDictionaryGetValue(cache, kKextDependencyIndexKextsKey);
+    if (!indexKexts || CFGetTypeID(indexKexts) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+
+    if (!createCFMutableArray(&kexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&neededIDs, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+   /* Kexts named by path may not be indexed, but their libraries must be.
+    */
+    if (kextURLs && CFArrayGetCount(kextURLs)) {
+        namedKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault, kextURLs);
+        if (!namedKexts) {
+            goto finish;
+        }
+        CFArrayAppendArray(kexts, namedKexts, RANGE_ALL(namedKexts));
+    }
+    count = namedKexts ? CFArrayGetCount(namedKexts) : 0;
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef libraries = OSKextGetValueForInfoDictionaryKey(
+            (OSKextRef)CFArrayGetValueAtIndex(namedKexts, i),
+            CFSTR(kOSBundleLibrariesKey));
+        CFIndex         numLibraries, j;
+
+        if (!libraries || CFGetTypeID(libraries) != CFDictionaryGetTypeID()) {
+            continue;
+        }
+        numLibraries = CFDictionaryGetCount(libraries);
+        SAFE_FREE_NULL(libraryIDs);
+        libraryIDs = (CFStringRef *)malloc(numLibraries * sizeof(*libraryIDs));
+        if (numLibraries && !libraryIDs) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionaryGetKeysAndValues(libraries, (const void **)libraryIDs,
+            /* values */ NULL);
+        for (j = 0; j < numLibraries; j++) {
+            addToArrayIfAbsent(neededIDs, libraryIDs[j]);
+        }
+    }
+    count = kextIDs ? CFArrayGetCount(kextIDs) : 0;
+    for (i = 0; i < count; i++) {
+        addToArrayIfAbsent(neededIDs, CFArrayGetValueAtIndex(kextIDs, i));
+    }
+
+    count = CFArrayGetCount(neededIDs);
+    for (i = 0; i < count; i++) {
+        CFStringRef kextID = CFArrayGetValueAtIndex(neededIDs, i);
+
+       /* A kext named by path wins over the indexed one, as in a scan.
+        */
+        if (OSKextGetKextWithIdentifier(kextID) &&
+            namedKexts && CFArrayContainsValue(namedKexts,
+                RANGE_ALL(namedKexts), OSKextGetKextWithIdentifier(kextID))) {
+
+            continue;
+        }
+        if (!addKextsFromDependencyIndex(kexts, indexKexts, kextID)) {
+            goto finish;
+        }
+    }
+
+   /* Everything asked for has to resolve against just what we opened.
+    */
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef aKext = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+
+        if (OSKextDeclaresExecutable(aKext) &&
+            !OSKextResolveDependencies(aKext)) {
+
+            goto finish;
+        }
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+        "Using dependency index; opened %d kexts.", (int)count);
+
+    result = kexts;
+    kexts = NULL;
+
+finish:
+    SAFE_RELEASE(cache);
+    SAFE_RELEASE(namedKexts);
+    SAFE_RELEASE(kexts);
+    SAFE_RELEASE(neededIDs);
+    SAFE_FREE(libraryIDs);
+    return result;
+}
+
+/*******************************************************************************
+* The personalities cache is gzipped IOXML, which kextd has to inflate before
+* it can send anything to the IOCatalogue.  Alongside it we keep the same
+* IOCFSerialize()d data uncompressed, so kextd can map it and hand it straight
+* to the kernel early in boot.  Like the other caches, it is current only if
+* its mod time is one second past that of the system extensions folders.
+*******************************************************************************/
+static Boolean
+getSerializedPersonalitiesCachePath(
+    const NXArchInfo * arch,
+    char             * path,
+    size_t             pathSize)
+{
+    if (!arch) {
+        arch = OSKextGetArchitecture();
+    }
+    if (!arch || (size_t)snprintf(path, pathSize,
+        kSerializedPersonalitiesCachePathFormat, arch->name) >= pathSize) {
+
+        return false;
+    }
+    return true;
+}
+
+static Boolean
+getSystemExtensionsCacheModTime(struct timeval cacheTimes[2])
+{
+    if (getLatestTimesFromCFURLArray(OSKextGetSystemExtensionsFolderURLs(),
+        cacheTimes) != EX_OK) {
+
+        return false;
+    }
+    cacheTimes[1].tv_sec++;
+    return true;
+}
+
+/*******************************************************************************
+* Writes data to cachePath, via a temp file, stamped current with the system
+* extensions folders. Only root writes these caches.
+*******************************************************************************/
+static Boolean
+writeSystemExtensionsCacheFile(
+    const char * cachePath,
+    CFDataRef    data)
+{
+    Boolean         result          = false;
+    int             fd              = -1;
+    char            tmpPath[PATH_MAX];
+    struct timeval  cacheTimes[2];
+
+    tmpPath[0] = 0x00;
+    if (geteuid() != 0 || !getSystemExtensionsCacheModTime(cacheTimes)) {
+        goto finish;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", cachePath);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s", tmpPath, strerror(errno));
+        tmpPath[0] = 0x00;
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(data),
+            CFDataGetLength(data)) != EX_OK) {
+        goto finish;
+    }
+    close(fd);
+    fd = -1;
+    if (utimes(tmpPath, cacheTimes) != 0 || rename(tmpPath, cachePath) != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't update %s - %s", cachePath, strerror(errno));
+        goto finish;
+    }
+    tmpPath[0] = 0x00;
+    result = true;
+
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    return result;
+}
+
+/*******************************************************************************
+* Returns cachePath mapped if it is current, root-owned, and not writable by
+* anyone else; NULL otherwise.
+*******************************************************************************/
+static CFDataRef
+createSystemExtensionsCacheData(const char * cachePath)
+{
+    CFDataRef       result      = NULL;  // returned
+    struct timeval  cacheTimes[2];
+    struct stat     statBuf;
+
+    if (!getSystemExtensionsCacheModTime(cacheTimes) ||
+        stat(cachePath, &statBuf) != 0) {
+
+        goto finish;
+    }
+    if (statBuf.st_uid != 0 || (statBuf.st_mode & (S_IWGRP | S_IWOTH)) ||
+        statBuf.st_mtimespec.tv_sec != cacheTimes[1].tv_sec) {
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDetailLevel | kOSKextLogFileAccessFlag,
+            "%s is out of date or not secure; not using it.", cachePath);
+        goto finish;
+    }
+    if (!createCFDataFromMappedFile(&result, cachePath)) {
+        result = NULL;
+    }
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+Boolean writeSerializedPersonalities(
+    CFArrayRef         personalities,
+    const NXArchInfo * arch)
+{
+    Boolean         result          = false;
+    CFDataRef       serializedData  = NULL;  // must release
+    char            cachePath[PATH_MAX];
+
+    if (geteuid() != 0 || !personalities ||
+        !getSerializedPersonalitiesCachePath(arch, cachePath,
+            sizeof(cachePath))) {
+
+        goto finish;
+    }
+
+    serializedData = IOCFSerialize(personalities, kNilOptions);
+    if (!serializedData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    result = writeSystemExtensionsCacheFile(cachePath, serializedData);
+
+finish:
+    SAFE_RELEASE(serializedData);
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+CFDataRef createSerializedPersonalitiesData(const NXArchInfo * arch)
+{
+    char cachePath[PATH_MAX];
+
+    if (!getSerializedPersonalitiesCachePath(arch, cachePath,
+            sizeof(cachePath))) {
+
+        return NULL;
+    }
+    return createSystemExtensionsCacheData(cachePath);
+}
+
+/*******************************************************************************
+* The repository snapshot lists every kext in the system extensions folders,
+* plugins included, with the few properties tools use to decide which kexts
+* they need: identifier, versions, libraries, archs, OSBundleRequired, and
+* whether it has an executable. A tool can pick kexts out of it and open just
+* those rather than scanning the folders and reading every Info.plist. It is
+* a binary plist kept current like the serialized personalities, and any
+* kext opened from it that doesn't match its entry makes the whole snapshot
+* stale.
+*******************************************************************************/
+#define kKextRepositorySnapshotVersion     1
+
+#define kKextRepositorySnapshotVersionKey  CFSTR("Version")
+#define kKextRepositorySnapshotKextsKey    CFSTR("Kexts")
+
+/*******************************************************************************
+*******************************************************************************/
+static CFDictionaryRef
+createKextRepositorySnapshotEntry(OSKextRef aKext)
+{
+    CFDictionaryRef         result      = NULL;
+    CFMutableDictionaryRef  entry       = NULL;  // must release
+    CFMutableArrayRef       archNames   = NULL;  // must release
+    CFStringRef             archName    = NULL;  // must release
+    CFStringRef             kextPath    = NULL;  // must release
+    const NXArchInfo     ** arches      = NULL;  // must free
+    CFStringRef             copyKeys[]  = {
+        kCFBundleVersionKey,
+        CFSTR(kOSBundleCompatibleVersionKey),
+        CFSTR(kOSBundleLibrariesKey),
+        CFSTR(kOSBundleRequiredKey),
+        NULL
+    };
+    CFIndex                 i;
+
+    kextPath = copyKextPath(aKext);
+    if (!kextPath || !OSKextGetIdentifier(aKext)) {
+        goto finish;
+    }
+    if (!createCFMutableDictionary(&entry) ||
+        !createCFMutableArray(&archNames, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(entry, kKextRepositorySnapshotPathKey, kextPath);
+    CFDictionarySetValue(entry, kCFBundleIdentifierKey,
+        OSKextGetIdentifier(aKext));
+
+    for (i = 0; copyKeys[i]; i++) {
+        CFTypeRef value = OSKextGetValueForInfoDictionaryKey(aKext,
+            copyKeys[i]);
+
+        if (value) {
+            CFDictionarySetValue(entry, copyKeys[i], value);
+        }
+    }
+    CFDictionarySetValue(entry, kKextRepositorySnapshotExecutableKey,
+        OSKextDeclaresExecutable(aKext) ? kCFBooleanTrue : kCFBooleanFalse);
+
+    arches = OSKextCopyArchitectures(aKext);
+    for (i = 0; arches && arches[i]; i++) {
+        SAFE_RELEASE_NULL(archName);
+        archName = CFStringCreateWithCString(kCFAllocatorDefault,
+            arches[i]->name, kCFStringEncodingUTF8);
+        if (!archName) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFArrayAppendValue(archNames, archName);
+    }
+    CFDictionarySetValue(entry, kKextRepositorySnapshotArchsKey, archNames);
+
+    result = CFRetain(entry);
+
+finish:
+    SAFE_RELEASE(entry);
+    SAFE_RELEASE(archNames);
+    SAFE_RELEASE(archName);
+    SAFE_RELEASE(kextPath);
+    SAFE_FREE(arches);
+    return result;
+}
+
+/*******************************************************************************
+* kexts should be everything read from the system extensions folders.
+*******************************************************************************/
+Boolean writeKextRepositorySnapshot(CFArrayRef kexts)
+{
+    Boolean                result       = false;
+    CFMutableDictionaryRef snapshot     = NULL;  // must release
+    CFMutableArrayRef      entries      = NULL;  // must release
+    CFDictionaryRef        entry        = NULL;  // must release
+    CFNumberRef            version      = NULL;  // must release
+    CFDataRef              snapshotData = NULL;  // must release
+    int                    versionValue = kKextRepositorySnapshotVersion;
+    CFIndex                count, i;
+
+    if (geteuid() != 0) {
+        goto finish;
+    }
+    if (!createCFMutableDictionary(&snapshot) ||
+        !createCFMutableArray(&entries, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        SAFE_RELEASE_NULL(entry);
+        entry = createKextRepositorySnapshotEntry(
+            (OSKextRef)CFArrayGetValueAtIndex(kexts, i));
+        if (entry) {
+            CFArrayAppendValue(entries, entry);
+        }
+    }
+
+    version = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType,
+        &versionValue);
+    if (!version) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(snapshot, kKextRepositorySnapshotVersionKey, version);
+    CFDictionarySetValue(snapshot, kKextRepositorySnapshotKextsKey, entries);
+
+    snapshotData = CFPropertyListCreateData(kCFAllocatorDefault, snapshot,
+        kCFPropertyListBinaryFormat_v1_0, /* options */ 0, /* error */ NULL);
+    if (!snapshotData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    result = writeSystemExtensionsCacheFile(kKextRepositorySnapshotPath,
+        snapshotData);
+
+finish:
+    SAFE_RELEASE(snapshot);
+    SAFE_RELEASE(entries);
+    SAFE_RELEASE(entry);
+    SAFE_RELEASE(version);
+    SAFE_RELEASE(snapshotData);
+    return result;
+}
+
+/*******************************************************************************
+* Returns the snapshot's array of kext entries, or NULL if there is no
+* current snapshot.
+*******************************************************************************/
+CFArrayRef copyKextRepositorySnapshot(void)
+{
+    CFArrayRef          result          = NULL;
+    CFDataRef           snapshotData    = NULL;  // must release
+    CFPropertyListRef   snapshot        = NULL;  // must release
+    CFTypeRef           value           = NULL;  // do not release
+    int                 versionValue;
+
+    if (!OSKextGetUsesCaches()) {
+        goto finish;
+    }
+    snapshotData = createSystemExtensionsCacheData(kKextRepositorySnapshotPath);
+    if (!snapshotData) {
+        goto finish;
+    }
+    snapshot = CFPropertyListCreateWithData(kCFAllocatorDefault, snapshotData,
+        kCFPropertyListImmutable, /* format */ NULL, /* error */ NULL);
+    if (!snapshot || CFGetTypeID(snapshot) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+
+    value = CFDictionaryGetValue(snapshot, kKextRepositorySnapshotVersionKey);
+    if (!value || CFGetTypeID(value) != CFNumberGetTypeID() ||
+        !CFNumberGetValue(value, kCFNumberIntType, &versionValue) ||
+        versionValue != kKextRepositorySnapshotVersion) {
+
+        goto finish;
+    }
+    value = CFDictionaryGetValue(snapshot, kKextRepositorySnapshotKextsKey);
+    if (!value || CFGetTypeID(value) != CFArrayGetTypeID()) {
+        goto finish;
+    }
+    result = CFRetain(value);
+
+finish:
+    SAFE_RELEASE(snapshotData);
+    SAFE_RELEASE(snapshot);
+    return result;
+}
+
+/*******************************************************************************
+* Opens the kexts of the snapshot entries for which wanted returns true (all
+* of them if it's NULL). Returns NULL if any of them can't be opened or
+* doesn't match its entry, in which case the caller should scan as usual.
+*******************************************************************************/
+CFArrayRef createKextsFromRepositorySnapshot(
+    CFArrayRef   snapshot,
+    Boolean   (* wanted)(CFDictionaryRef entry, void * context),
+    void       * context)
+{
+    CFArrayRef          result      = NULL;
+    CFMutableArrayRef   kexts       = NULL;  // must release
+    CFURLRef            kextURL     = NULL;  // must release
+    OSKextRef           aKext       = NULL;  // must release
+    CFIndex             count, i;
+
+    if (!createCFMutableArray(&kexts, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(snapshot);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef entry   = CFArrayGetValueAtIndex(snapshot, i);
+        CFStringRef     path    = NULL;  // do not release
+        CFTypeRef       version = NULL;  // do not release
+
+        SAFE_RELEASE_NULL(kextURL);
+        SAFE_RELEASE_NULL(aKext);
+
+        if (CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+            goto finish;
+        }
+        if (wanted && !wanted(entry, context)) {
+            continue;
+        }
+        path = CFDictionaryGetValue(entry, kKextRepositorySnapshotPathKey);
+        version = CFDictionaryGetValue(entry, kCFBundleVersionKey);
+        if (!path || CFGetTypeID(path) != CFStringGetTypeID() || !version) {
+            goto finish;
+        }
+
+        kextURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, path,
+            kCFURLPOSIXPathStyle, /* isDirectory */ true);
+        if (!kextURL) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        aKext = OSKextCreate(kCFAllocatorDefault, kextURL);
+        if (!aKext || !CFEqual(version,
+            OSKextGetValueForInfoDictionaryKey(aKext, kCFBundleVersionKey))) {
+
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+                "Kext repository snapshot is stale; not using it.");
+            goto finish;
+        }
+        addToArrayIfAbsent(kexts, aKext);
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+        "Using kext repository snapshot; opened %d of %d kexts.",
+        (int)CFArrayGetCount(kexts), (int)count);
+
+    result = kexts;
+    kexts = NULL;
+
+finish:
+    SAFE_RELEASE(kexts);
+    SAFE_RELEASE(kextURL);
+    SAFE_RELEASE(aKext);
+    return result;
+}
@@ -30,6 +30,12 @@ typedef enum {
     kUsageLevelFull  = 1
 } UsageLevel;
 
+typedef enum {
+    kKextSymbolIndexUnknown  = -1,  // not indexed or stale; look for yourself
+    kKextSymbolIndexNotFound = 0,
+    kKextSymbolIndexFound    = 1
+} KextSymbolIndexResult;
+
 typedef struct {
     CFURLRef   saveDirURL;
     Boolean    overwrite;
@@ -41,12 +47,53 @@ typedef struct {
 * Constants
 *******************************************************************************/
 #define _kKextPropertyValuesCacheBasename  "KextPropertyValues_"
+#define kKextPropertyValuesCacheFormat     _kOSKextCacheFormatCFBinary
+#define _kKextSymbolIndexCacheBasename     "KextSymbolIndex"
+#define kKextSymbolIndexCacheFormat        _kOSKextCacheFormatCFBinary
+#define _kKextDependencyIndexCacheBasename "KextDependencyIndex"
+#define kKextDependencyIndexCacheFormat    _kOSKextCacheFormatCFBinary
+#define kSerializedPersonalitiesCachePathFormat \
+    _kOSKextCachesRootFolder "/" _kOSKextStartupCachesSubfolder \
+    "/IOKitPersonalities_%s.ioserialized"
+#define kKextRepositorySnapshotPath \
+    _kOSKextCachesRootFolder "/" _kOSKextStartupCachesSubfolder \
+    "/KextRepository.plist"
 #define __kOSKextApplePrefix        CFSTR("com.apple.")
 
 #define kAppleInternalPath      "/AppleInternal"
 #define kDefaultDevKernelPath   "/System/Library/Kernels/kernel.development"
 #define kDefaultDevKernelSuffix ".development"
 
+/* A kextmanager_load_kext() request with this key loads several kexts
+ * at once: its value is an array of dictionaries, each holding a
+ * kKextLoadIdentifierKey or kKextLoadPathKey, which share the request's
+ * kKextLoadDependenciesKey paths.
+ */
+#define kKextLoadBatchKey       CFSTR("KextLoadBatch")
+
+/* Passed as the property key to kextmanager_create_property_value_array(),
+ * this returns kextd's recent load latencies rather than a kext property:
+ * one dictionary per bundle identifier with its LoadCount and, for Total
+ * and each load phase, the P50 and P99 in microseconds.
+ */
+#define kKextLoadLatencyKey     CFSTR("KextLoadLatency")
+
+/* A kextmanager_load_kext() request with this key loads nothing: its value
+ * is an array of the bundle identifiers that the holder of the kextload
+ * lock (kextutil) is about to load, including unloaded dependencies. kextd
+ * then holds back only kernel load requests that need one of them.
+ */
+#define kKextutilLockScopeKey   CFSTR("KextutilLockScope")
+
+/* Besides these, each kext repository snapshot entry holds the kext's
+ * CFBundleIdentifier, CFBundleVersion, and if it has them its
+ * OSBundleCompatibleVersion, OSBundleLibraries, and OSBundleRequired,
+ * under their Info.plist keys.
+ */
+#define kKextRepositorySnapshotPathKey        CFSTR("Path")
+#define kKextRepositorySnapshotArchsKey       CFSTR("Archs")
+#define kKextRepositorySnapshotExecutableKey  CFSTR("DeclaresExecutable")
+
 #pragma mark Macros
 /*********************************************************************
 * Macros
@@ -126,6 +173,11 @@ Boolean createCFMutableSet(CFMutableSetRef * setOut,
     const CFSetCallBacks * callbacks);
 Boolean createCFDataFromFile(CFDataRef  *dataRefOut,
                              const char *filePath);
+Boolean createCFDataFromMappedFile(CFDataRef  *dataRefOut,
+                                   const char *filePath);
+CFDataRef createCFDataFromMappedRange(int     fd,
+                                      off_t   offset,
+                                      size_t  size);
 
 void addToArrayIfAbsent(CFMutableArrayRef array, const void * value);
 
@@ -173,6 +225,35 @@ Boolean readSystemKextPropertyValues(
     const NXArchInfo * arch,
     Boolean            forceUpdateFlag,
     CFArrayRef       * valuesOut);
+void flushSystemKextPropertyValues(void);
+Boolean writeSystemKextPropertyValues(
+    CFArrayRef         kexts,
+    CFStringRef        propertyKey,
+    const NXArchInfo * arch);
+Boolean writeKextSymbolIndex(
+    CFArrayRef         kexts,
+    const NXArchInfo * arch);
+KextSymbolIndexResult lookUpKextSymbolIndex(
+    OSKextRef   aKext,
+    CFStringRef symbol,
+    Boolean     seekingReference);
+Boolean writeKextDependencyIndex(
+    CFArrayRef         kexts,
+    const NXArchInfo * arch);
+CFArrayRef createKextsFromDependencyIndex(
+    CFArrayRef         kextURLs,
+    CFArrayRef         kextIDs,
+    const NXArchInfo * arch);
+Boolean writeSerializedPersonalities(
+    CFArrayRef         personalities,
+    const NXArchInfo * arch);
+CFDataRef createSerializedPersonalitiesData(const NXArchInfo * arch);
+Boolean writeKextRepositorySnapshot(CFArrayRef kexts);
+CFArrayRef copyKextRepositorySnapshot(void);
+CFArrayRef createKextsFromRepositorySnapshot(
+    CFArrayRef   snapshot,
+    Boolean   (* wanted)(CFDictionaryRef entry, void * context),
+    void       * context);
 
 ExitStatus writeToFile(
     int           fileDescriptor,
@@ -216,6 +297,9 @@ void addKextToAlertDict(
 char * getPathExtension(const char * pathPtr);
 
 int getFileDevAndIno(const char * thePath, dev_t * the_dev_t, ino_t * the_ino_t);
+Boolean isPathInFolderWithDevAndIno(const char * thePath,
+                                    dev_t the_dev_t,
+                                    ino_t the_ino_t);
 Boolean isSameFileDevAndIno(int the_fd,
                             const char * thePath,
                             dev_t the_dev_t,
@@ -24,6 +24,7 @@
 #include <CoreFoundation/CFBundlePriv.h>
 #include <errno.h>
 #include <libc.h>
+#include <dirent.h>
 #include <libgen.h>     // dirname()
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -44,9 +45,12 @@
 #include <unistd.h>             // sleep(3)
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysctl.h>
 #include <Security/SecKeychainPriv.h>
 #include <sandbox/rootless.h>
 #include <sys/csr.h>
+#include <dispatch/dispatch.h>
+#include <CommonCrypto/CommonDigest.h>
 
 #include <DiskArbitration/DiskArbitrationPrivate.h>
 #include <IOKit/IOTypes.h>
@@ -76,13 +80,41 @@
 // constants
 #define MKEXT_PERMS             (0644)
 
-/* The timeout we use when waiting for the system to get to a low load state.
- * We're shooting for about 10 minutes, but we don't want to collide with
- * everyone else who wants to do work 10 minutes after boot, so we just pick
- * a number in that ballpark.
+/* The most time a low-priority build spends waiting for the system load to
+ * ease, over all of its phases.  We're shooting for about 10 minutes, but we
+ * don't want to collide with everyone else who wants to do work 10 minutes
+ * after boot, so we just pick a number in that ballpark.  No single phase
+ * waits longer than kOSKextSystemLoadPhaseWait, a phase starting under an
+ * OK (not great) load pauses for kOSKextSystemLoadOKPause, and a wait
+ * rechecks the load every kOSKextSystemLoadPollTime even without an advisory
+ * notification, since the CPU load average doesn't post one.
  */
 #define kOSKextSystemLoadTimeout        (8 * 60)
-#define kOSKextSystemLoadPauseTime      (30)
+#define kOSKextSystemLoadPhaseWait      (90)
+#define kOSKextSystemLoadOKPause        (2)
+#define kOSKextSystemLoadPollTime       (5)
+
+/* Linked (uncompressed) prelinked kernel slices are kept here, named
+ * "<arch>-<key>", so that a rebuild whose inputs haven't changed can skip
+ * OSKextCreatePrelinkedKernel(). Only the newest entry per arch is kept,
+ * and entries for other archs are dropped, oldest first, to keep the folder
+ * under kLinkedSliceCacheMaxSize. Temporary files start with a '.' so that
+ * no cleanup pass ever matches another kextcache's file in progress.
+ */
+#define kLinkedSliceCacheFolder \
+    _kOSKextCachesRootFolder "/" _kOSKextStartupCachesSubfolder "/LinkedSlices"
+#define kLinkedSliceCacheMaxSize        (512LL * 1024 * 1024)
+
+/* Alongside them, this records the key each slice of the system prelinked
+ * kernel was built from, so that a slice whose key hasn't changed can be
+ * copied through without relinking or recompressing it.  The record only
+ * holds while the prelinked kernel is the same file it was written for.
+ */
+#define kPrelinkedSliceManifestName     "PrelinkedSlices.plist"
+#define kSliceManifestInodeKey          CFSTR("Inode")
+#define kSliceManifestSizeKey           CFSTR("Size")
+#define kSliceManifestModTimeKey        CFSTR("ModTime")
+#define kSliceManifestKeysKey           CFSTR("SliceKeys")
 
 /*******************************************************************************
 * Program Globals
@@ -99,18 +131,28 @@ CFMutableDictionaryRef       sRevokedKextAlertDict = NULL;
 *******************************************************************************/
 // put/take helpers
 static void waitForIOKitQuiescence(void);
-static void waitForGreatSystemLoad(void);
+static int currentSystemLoadLevel(void);
+static int waitForSystemLoadLevel(
+    int        minLevel,
+    uint32_t   maxSecs,
+    uint32_t * waitedSecsOut);
+static void throttleForSystemLoad(
+    KextcacheArgs * toolArgs,
+    const char    * phase);
 
 #define kMaxArchs 64
 #define kRootPathLen 256
 
-static u_int usecs_from_timeval(struct timeval *t);
-static void timeval_from_usecs(struct timeval *t, u_int usecs);
-static void timeval_difference(struct timeval *dst, 
-                               struct timeval *a, struct timeval *b);
 static Boolean isValidKextSigningTargetVolume(CFURLRef theURL);
 static Boolean wantsFastLibCompressionForTargetVolume(CFURLRef theURL);
+static uint32_t compressionTypeForSlice(
+    KextcacheArgs       * toolArgs,
+    CFDataRef             prelinkedKernel,
+    Boolean               hasRelocs);
 static void _appendIfNewest(CFMutableArrayRef theArray, OSKextRef theKext);
+#if !NO_BOOT_ROOT
+static int buildKextBootCacheInProcess(int argc, char * const * argv);
+#endif /* !NO_BOOT_ROOT */
 
 #if 1 // 17821398
 #include "safecalls.h"
@@ -127,6 +169,56 @@ static Boolean wantsPrelinkedKernelCopy(CFURLRef theVolRootURL);
 
 static void removeStalePrelinkedKernels(KextcacheArgs * toolArgs);
 static Boolean isRootVolURL(CFURLRef theURL);
+static CFStringRef copyLinkedSliceCacheKey(
+    KextcacheArgs     * toolArgs,
+    CFDataRef           kernelImage,
+    CFArrayRef          prelinkKexts,
+    const NXArchInfo  * archInfo,
+    uint32_t            flags);
+static Boolean getLinkedSliceCachePath(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey,
+    char              * pathBuf,
+    size_t              pathBufSize);
+static CFDataRef readLinkedSliceCache(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey);
+static void writeLinkedSliceCache(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey,
+    CFDataRef           linkedSlice);
+static void readPrelinkedSliceManifest(
+    KextcacheArgs     * toolArgs,
+    CFArrayRef          existingSlices,
+    CFArrayRef          existingArchs);
+static void writePrelinkedSliceManifest(KextcacheArgs * toolArgs);
+static void recordExistingSliceKey(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo);
+static void recordPrelinkedSliceKey(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         sliceKey);
+static ExitStatus createPrelinkedKernelSlicesConcurrently(
+    KextcacheArgs     * toolArgs,
+    CFArrayRef          prelinkArchs,
+    CFArrayRef          existingSlices,
+    CFArrayRef          existingArchs,
+    FatFileWriter     * writer,
+    CFMutableArrayRef   generatedSymbols,
+    CFMutableArrayRef   generatedArchs);
+static ExitStatus appendFinishedPrelinkedSlices(
+    KextcacheArgs         * toolArgs,
+    FatFileWriter         * writer,
+    CFDataRef             * finalSlices,
+    ExitStatus            * sliceResults,
+    dispatch_semaphore_t  * sliceDone,
+    u_int                 * nextSlice,
+    u_int                   endSlice,
+    Boolean                 wait);
 
 
 /*******************************************************************************
@@ -135,7 +227,6 @@ int main(int argc, char * const * argv)
 {
     KextcacheArgs       toolArgs;
     ExitStatus          result          = EX_SOFTWARE;
-    Boolean             fatal           = false;
 
    /*****
     * Find out what the program was invoked as.
@@ -242,7 +333,7 @@ int main(int argc, char * const * argv)
          * have a way to know if we're blocking reboot.
          */
         if (toolArgs.prelinkedKernelPath) {
-            waitForGreatSystemLoad();
+            throttleForSystemLoad(&toolArgs, "building the prelinked kernel");
         }
     }
 
@@ -258,6 +349,9 @@ int main(int argc, char * const * argv)
     * combine with more manual cache-building operations.
     */
     if (toolArgs.updateVolumeURL) {
+        // rebuild the prelinked kernel / mkext without another exec
+        setKextBootCacheBuilder(&buildKextBootCacheInProcess);
+
         // go ahead and do the update
         result = doUpdateVolume(&toolArgs);
 
@@ -285,15 +379,62 @@ int main(int argc, char * const * argv)
     }
 #endif /* !NO_BOOT_ROOT */
 
-    /* If we're uncompressing the prelinked kernel, take care of that here
+    result = createCaches(&toolArgs);
+
+finish:
+
+   /* We're actually not going to free anything else because we're exiting!
+    */
+    exit(result);
+
+    SAFE_RELEASE(toolArgs.kextIDs);
+    SAFE_RELEASE(toolArgs.argURLs);
+    SAFE_RELEASE(toolArgs.repositoryURLs);
+    SAFE_RELEASE(toolArgs.namedKextURLs);
+    SAFE_RELEASE(toolArgs.allKexts);
+    SAFE_RELEASE(toolArgs.repositoryKexts);
+    SAFE_RELEASE(toolArgs.namedKexts);
+    SAFE_RELEASE(toolArgs.loadedKexts);
+    SAFE_RELEASE(toolArgs.kernelFile);
+    SAFE_RELEASE(toolArgs.symbolDirURL);
+    SAFE_FREE(toolArgs.mkextPath);
+    SAFE_FREE(toolArgs.prelinkedKernelPath);
+    SAFE_FREE(toolArgs.kernelPath);
+    SAFE_FREE(toolArgs.statsPath);
+
+    return result;
+}
+
+/*******************************************************************************
+* createCaches() does the actual work for everything except -u/-i; it runs
+* from main() and, for kextcache -u, from buildKextBootCacheInProcess().
+*******************************************************************************/
+ExitStatus createCaches(KextcacheArgs * toolArgs)
+{
+    ExitStatus          result  = EX_OK;
+    Boolean             fatal   = false;
+    PrelinkStageMark    stageMark;
+
+   /* Measuring codecs on an existing prelinked kernel doesn't read kexts.
+    */
+    if (toolArgs->compressionBenchmark) {
+        result = benchmarkPrelinkCodecs(toolArgs->prelinkedKernelPath,
+            kCompressionBenchmarkRuns);
+        goto finish;
+    }
+
+   /* If we're uncompressing the prelinked kernel, take care of that here
      * and exit.
      */
-    if (toolArgs.prelinkedKernelPath && !CFArrayGetCount(toolArgs.argURLs) &&
-        (toolArgs.compress || toolArgs.uncompress)) 
+    if (toolArgs->prelinkedKernelPath && !CFArrayGetCount(toolArgs->argURLs) &&
+        (toolArgs->compress || toolArgs->uncompress)) 
     {
-        result = compressPrelinkedKernel(toolArgs.volumeRootURL,
-                                         toolArgs.prelinkedKernelPath,
-                                         /* compress */ toolArgs.compress);
+        uint32_t compressionType = compressionTypeForSlice(toolArgs,
+            /* prelinkedKernel */ NULL, /* hasRelocs */ false);
+
+        result = recompressPrelinkedKernelFile(toolArgs->prelinkedKernelPath,
+                                               /* compress */ toolArgs->compress,
+                                               compressionType);
         goto finish;
     }
 
@@ -301,11 +442,12 @@ int main(int argc, char * const * argv)
     * Read the kexts we'll be working with; first the set of all kexts, then
     * the repository and named kexts for use with mkext-creation flags.
     */
-    if (toolArgs.printTestResults) {
+    if (toolArgs->printTestResults) {
         OSKextSetRecordsDiagnostics(kOSKextDiagnosticsFlagAll);
     }
-    toolArgs.allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault, toolArgs.argURLs);
-    if (!toolArgs.allKexts || !CFArrayGetCount(toolArgs.allKexts)) {
+    prelinkStageStart(&stageMark);
+    toolArgs->allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault, toolArgs->argURLs);
+    if (!toolArgs->allKexts || !CFArrayGetCount(toolArgs->allKexts)) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "No kernel extensions found.");
@@ -313,11 +455,14 @@ int main(int argc, char * const * argv)
         goto finish;
     }
 
-    toolArgs.repositoryKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-        toolArgs.repositoryURLs);
-    toolArgs.namedKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-        toolArgs.namedKextURLs);
-    if (!toolArgs.repositoryKexts || !toolArgs.namedKexts) {
+    toolArgs->repositoryKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+        toolArgs->repositoryURLs);
+    toolArgs->namedKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+        toolArgs->namedKextURLs);
+    prelinkStageEnd(&toolArgs->stageStats, kPrelinkStageRead, &stageMark);
+    prelinkStageAddCounts(&toolArgs->stageStats, kPrelinkStageRead,
+        /* bytesIn */ 0, /* bytesOut */ 0, CFArrayGetCount(toolArgs->allKexts));
+    if (!toolArgs->repositoryKexts || !toolArgs->namedKexts) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "Error reading extensions.");
@@ -329,32 +474,32 @@ int main(int argc, char * const * argv)
         goto finish;
     }
     
-    if (toolArgs.needLoadedKextInfo) {
-        result = getLoadedKextInfo(&toolArgs);
+    if (toolArgs->needLoadedKextInfo) {
+        result = getLoadedKextInfo(toolArgs);
         if (result != EX_OK) {
             goto finish;
         }
     }
 
     // xxx - we are potentially overwriting error results here
-    if (toolArgs.updateSystemCaches) {
-        result = updateSystemPlistCaches(&toolArgs);
+    if (toolArgs->updateSystemCaches) {
+        result = updateSystemPlistCaches(toolArgs);
         // don't goto finish on error here, we might be able to create
         // the other caches
     }
 
-    if (toolArgs.mkextPath) {
-        result = createMkext(&toolArgs, &fatal);
+    if (toolArgs->mkextPath) {
+        result = createMkext(toolArgs, &fatal);
         if (fatal) {
             goto finish;
         }
     }
 
-    if (toolArgs.prelinkedKernelPath) {
+    if (toolArgs->prelinkedKernelPath) {
        /* If we're updating the system prelinked kernel, make sure we aren't
         * Safe Boot, or dire consequences shall result.
         */
-        if (toolArgs.needDefaultPrelinkedKernelInfo &&
+        if (toolArgs->needDefaultPrelinkedKernelInfo &&
             OSKextGetActualSafeBoot()) {
 
             OSKextLog(/* kext */ NULL,
@@ -367,34 +512,71 @@ int main(int argc, char * const * argv)
        /* Create/update the prelinked kernel as explicitly requested, or
         * for the running kernel.
         */
-        result = createPrelinkedKernel(&toolArgs);
+        result = createPrelinkedKernel(toolArgs);
         if (result != EX_OK) {
             goto finish;
         }
     }
 
 finish:
-
-   /* We're actually not going to free anything else because we're exiting!
+   /* Stats are written even on failure; a failed build is worth timing too.
     */
-    exit(result);
+    if (toolArgs->statsPath) {
+        writePrelinkStageStats(&toolArgs->stageStats, toolArgs->statsPath);
+    }
+    return result;
+}
+
+#if !NO_BOOT_ROOT
+/*******************************************************************************
+* kextcache -u used to exec yet another kextcache to rebuild the prelinked
+* kernel or mkext (see rebuild_kext_boot_cache_file()).  We are that program,
+* so parse the same arguments and build it right here; kexts read for one
+* build (e.g. the primary kernelcache) are still around for the next.
+*******************************************************************************/
+static int buildKextBootCacheInProcess(int argc, char * const * argv)
+{
+    ExitStatus    result = EX_SOFTWARE;
+    KextcacheArgs toolArgs;
+
+    // argv[0] is the program name, just like for main()
+    optreset = 1;
+    optind = 1;
+    longopt = 0;
+
+    result = readArgs(&argc, &argv, &toolArgs);
+    if (result != EX_OK) {
+        goto finish;
+    }
+    result = checkArgs(&toolArgs);
+    if (result != EX_OK) {
+        goto finish;
+    }
+    result = createCaches(&toolArgs);
 
+finish:
     SAFE_RELEASE(toolArgs.kextIDs);
     SAFE_RELEASE(toolArgs.argURLs);
     SAFE_RELEASE(toolArgs.repositoryURLs);
     SAFE_RELEASE(toolArgs.namedKextURLs);
+    SAFE_RELEASE(toolArgs.targetArchs);
     SAFE_RELEASE(toolArgs.allKexts);
     SAFE_RELEASE(toolArgs.repositoryKexts);
     SAFE_RELEASE(toolArgs.namedKexts);
     SAFE_RELEASE(toolArgs.loadedKexts);
+    SAFE_RELEASE(toolArgs.volumeRootURL);
+    SAFE_RELEASE(toolArgs.compressedPrelinkedKernelURL);
+    SAFE_RELEASE(toolArgs.updateVolumeURL);
     SAFE_RELEASE(toolArgs.kernelFile);
     SAFE_RELEASE(toolArgs.symbolDirURL);
     SAFE_FREE(toolArgs.mkextPath);
     SAFE_FREE(toolArgs.prelinkedKernelPath);
     SAFE_FREE(toolArgs.kernelPath);
+    SAFE_FREE(toolArgs.statsPath);
 
     return result;
 }
+#endif /* !NO_BOOT_ROOT */
 
 /*******************************************************************************
 *******************************************************************************/
@@ -415,6 +597,8 @@ ExitStatus readArgs(
     struct stat  sb;
 
     bzero(toolArgs, sizeof(*toolArgs));
+    toolArgs->requestedJobs = 1;
+    toolArgs->maxJobs = 1;
     
    /*****
     * Allocate collection objects.
@@ -486,6 +670,28 @@ ExitStatus readArgs(
                 }
                 toolArgs->explicitArch = true;
                 break;
+
+            case kOptJobs:
+                {
+                    char          * endptr = NULL;
+                    unsigned long   jobs   = strtoul(optarg, &endptr, 10);
+
+                    if (!optarg[0] || *endptr || jobs > kMaxArchs) {
+                        OSKextLog(/* kext */ NULL,
+                            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                            "Invalid job count %s.", optarg);
+                        goto finish;
+                    }
+                   /* -j 0 means one job per online CPU.
+                    */
+                    if (jobs == 0) {
+                        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                        jobs = (ncpu > 0) ? (unsigned long)ncpu : 1;
+                    }
+                    toolArgs->requestedJobs = (u_int)jobs;
+                    toolArgs->maxJobs = (u_int)jobs;
+                }
+                break;
   
             case kOptBundleIdentifier:
                 scratchString = CFStringCreateWithCString(kCFAllocatorDefault,
@@ -741,6 +947,50 @@ ExitStatus readArgs(
                         toolArgs->uncompress = true;
                         break;
 
+                    case kLongOptChunkedCompression:
+                        toolArgs->compress = true;
+                        toolArgs->chunkedCompression = true;
+                        break;
+
+                    case kLongOptCompression:
+                        if (!strcmp(optarg, "volume")) {
+                            toolArgs->compressionPolicy = kCompressionPolicyVolume;
+                        } else if (!strcmp(optarg, "lzss")) {
+                            toolArgs->compressionPolicy = kCompressionPolicyLZSS;
+                        } else if (!strcmp(optarg, "lzvn")) {
+                            toolArgs->compressionPolicy = kCompressionPolicyFastLib;
+                        } else if (!strcmp(optarg, "auto")) {
+                            toolArgs->compressionPolicy = kCompressionPolicyAuto;
+                        } else {
+                            OSKextLog(/* kext */ NULL,
+                                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                                "Unknown -%s policy %s "
+                                "(must be volume, lzss, lzvn, or auto).",
+                                kOptNameCompression, optarg);
+                            goto finish;
+                        }
+                        break;
+
+                    case kLongOptCompressionBenchmark:
+                        toolArgs->compressionBenchmark = true;
+                        break;
+
+                    case kLongOptLZSSLevel:
+                        {
+                            char * endptr = NULL;
+                            long   level  = strtol(optarg, &endptr, 10);
+
+                            if (!optarg[0] || *endptr ||
+                                !set_lzss_compression_level((int)level)) {
+                                OSKextLog(/* kext */ NULL,
+                                    kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                                    "Invalid LZSS level %s (must be %d-%d).",
+                                    optarg, LZSS_LEVEL_TREE, LZSS_LEVEL_BEST);
+                                goto finish;
+                            }
+                        }
+                        break;
+
                     case kLongOptSymbols:
                         if (toolArgs->symbolDirURL) {
                             OSKextLog(/* kext */ NULL,
@@ -762,6 +1012,16 @@ ExitStatus readArgs(
                         toolArgs->generatePrelinkedSymbols = true;
                         break;
 
+                    case kLongOptStatsFile:
+                        SAFE_FREE_NULL(toolArgs->statsPath);
+                        toolArgs->statsPath = strdup(optarg);
+                        if (!toolArgs->statsPath) {
+                            OSKextLogMemError();
+                            result = EX_OSERR;
+                            goto finish;
+                        }
+                        break;
+
                     case kLongOptSystemPrelinkedKernel:
                         scratchResult = setPrelinkedKernelArgs(toolArgs,
                             /* filename */ NULL);
@@ -797,6 +1057,13 @@ ExitStatus readArgs(
                     case kLongOptEarlyBoot:
                         toolArgs->updateOpts |= kBRUEarlyBoot;
                         break;
+                    case kLongOptRebuildOnly:
+                        scratchResult = readRebuildOnlyArgs(toolArgs, optarg);
+                        if (scratchResult != EX_OK) {
+                            result = scratchResult;
+                            goto finish;
+                        }
+                        break;
 #endif /* !NO_BOOT_ROOT */
 
                     default:
@@ -898,6 +1165,63 @@ ExitStatus readPrelinkedKernelArgs(
     return setPrelinkedKernelArgs(toolArgs, filename);
 }
 
+#if !NO_BOOT_ROOT
+/*******************************************************************************
+* -rebuild-only takes a comma-separated list of kBRUItemName* values.
+*******************************************************************************/
+ExitStatus readRebuildOnlyArgs(
+    KextcacheArgs * toolArgs,
+    const char    * itemList)
+{
+    ExitStatus result     = EX_USAGE;
+    char     * listCopy   = NULL;  // must free
+    char     * itemName   = NULL;  // do not free
+    char     * lasts      = NULL;  // do not free
+    BRUpdateOpts_t items  = 0;
+
+    listCopy = strdup(itemList);
+    if (!listCopy) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+
+    for (itemName = strtok_r(listCopy, ",", &lasts);
+         itemName;
+         itemName = strtok_r(NULL, ",", &lasts)) {
+
+        if (0 == strcmp(itemName, kBRUItemNameKernelCache)) {
+            items |= kBRUItemKernelCache;
+        } else if (0 == strcmp(itemName, kBRUItemNameCSFDE)) {
+            items |= kBRUItemCSFDE;
+        } else if (0 == strcmp(itemName, kBRUItemNameLocCache)) {
+            items |= kBRUItemLocCache;
+        } else if (0 == strcmp(itemName, kBRUItemNameHelpers)) {
+            items |= kBRUItemHelpers;
+        } else {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                "Unknown -%s item '%s'.", kOptNameRebuildOnly, itemName);
+            goto finish;
+        }
+    }
+
+    if (!items) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "-%s requires at least one item.", kOptNameRebuildOnly);
+        goto finish;
+    }
+
+    toolArgs->updateOpts |= items;
+    result = EX_OK;
+
+finish:
+    SAFE_FREE(listCopy);
+    return result;
+}
+#endif /* !NO_BOOT_ROOT */
+
 /*******************************************************************************
 *******************************************************************************/
 ExitStatus setPrelinkedKernelArgs(
@@ -1159,201 +1483,185 @@ waitForIOKitQuiescence(void)
 }
 
 /*******************************************************************************
-* Wait for the system to report that it's a good time to do work.  We define a
-* good time to be when the IOSystemLoadAdvisory API returns a combined level of 
-* kIOSystemLoadAdvisoryLevelGreat, and we'll wait up to kOSKextSystemLoadTimeout
-* seconds for the system to enter that state before we begin our work.  If there
-* is an error in this function, we just return and get started with the work.
+* The load level to pace a low-priority build by: the IOSystemLoadAdvisory
+* combined level (which covers user activity, battery, and thermal pressure),
+* lowered to OK when the CPU load average reaches half the active CPUs and
+* to bad when it reaches all of them.
 *******************************************************************************/
-static void
-waitForGreatSystemLoad(void)
+static int
+currentSystemLoadLevel(void)
 {
-    struct timeval currenttime;
-    struct timeval endtime;
-    struct timeval timeout;
-    fd_set readfds;
-    fd_set tmpfds;
-    uint64_t systemLoadAdvisoryState            = 0;
-    uint32_t notifyStatus                       = 0;
-    uint32_t usecs                              = 0;
-    int systemLoadAdvisoryFileDescriptor        = 0;    // closed by notify_cancel()
-    int systemLoadAdvisoryToken                 = 0;    // must notify_cancel()
-    int currentToken                            = 0;    // do not notify_cancel()
-    int myResult;
+    int         level       = IOGetSystemLoadAdvisory();
+    double      loadAvg     = 0.0;
+    int         numCPUs     = 0;
+    size_t      size        = sizeof(numCPUs);
 
-    bzero(&currenttime, sizeof(currenttime));
-    bzero(&endtime, sizeof(endtime));
-    bzero(&timeout, sizeof(timeout));
+    if (level < kIOSystemLoadAdvisoryLevelBad ||
+        level > kIOSystemLoadAdvisoryLevelGreat) {
 
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
-        "Waiting for low system load.");
+        level = kIOSystemLoadAdvisoryLevelGreat;  // no advice; don't hold up
+    }
 
-    /* Register for SystemLoadAdvisory notifications */
+    if (getloadavg(&loadAvg, 1) == 1 &&
+        sysctlbyname("hw.activecpu", &numCPUs, &size, NULL, 0) == 0 &&
+        numCPUs > 0) {
 
-    notifyStatus = notify_register_file_descriptor(kIOSystemLoadAdvisoryNotifyName, 
-        &systemLoadAdvisoryFileDescriptor, 
-        /* flags */ 0, &systemLoadAdvisoryToken);
-    if (notifyStatus != NOTIFY_STATUS_OK) {
-        goto finish;
+        if (loadAvg >= numCPUs) {
+            level = kIOSystemLoadAdvisoryLevelBad;
+        } else if (loadAvg >= numCPUs / 2.0 &&
+            level > kIOSystemLoadAdvisoryLevelOK) {
+
+            level = kIOSystemLoadAdvisoryLevelOK;
+        }
     }
 
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
-        "Received initial system load status %llu", systemLoadAdvisoryState);
+    return level;
+}
 
-    /* If it's a good time, we'll just return */
+/*******************************************************************************
+* Waits up to maxSecs for currentSystemLoadLevel() to reach minLevel, waking
+* on SystemLoadAdvisory notifications and every kOSKextSystemLoadPollTime
+* seconds.  Returns the last level seen.  If there is an error in this
+* function, we just return and get on with the work.
+*******************************************************************************/
+static int
+waitForSystemLoadLevel(
+    int        minLevel,
+    uint32_t   maxSecs,
+    uint32_t * waitedSecsOut)
+{
+    struct timeval starttime;
+    struct timeval currenttime;
+    struct timeval timeout;
+    fd_set readfds;
+    uint32_t notifyStatus                       = 0;
+    uint32_t elapsedSecs                        = 0;
+    int level                                   = currentSystemLoadLevel();
+    int systemLoadAdvisoryFileDescriptor        = -1;   // closed by notify_cancel()
+    int systemLoadAdvisoryToken                 = 0;    // must notify_cancel()
+    int currentToken                            = 0;    // do not notify_cancel()
+    int myResult;
 
-    notifyStatus = notify_get_state(systemLoadAdvisoryToken, &systemLoadAdvisoryState);
-    if (notifyStatus != NOTIFY_STATUS_OK) {
+    *waitedSecsOut = 0;
+    if (level >= minLevel || !maxSecs) {
         goto finish;
     }
 
-    if (systemLoadAdvisoryState == kIOSystemLoadAdvisoryLevelGreat) {
+    if (gettimeofday(&starttime, NULL) < 0) {
         goto finish;
     }
 
-    /* Set up the select timers */
-
-    myResult = gettimeofday(&currenttime, NULL);
-    if (myResult < 0) {
-        goto finish;
+    /* Register for SystemLoadAdvisory notifications; without them we
+     * still poll.
+     */
+    notifyStatus = notify_register_file_descriptor(kIOSystemLoadAdvisoryNotifyName, 
+        &systemLoadAdvisoryFileDescriptor, 
+        /* flags */ 0, &systemLoadAdvisoryToken);
+    if (notifyStatus != NOTIFY_STATUS_OK) {
+        systemLoadAdvisoryFileDescriptor = -1;
+        systemLoadAdvisoryToken = 0;
     }
 
-    endtime = currenttime;
-    endtime.tv_sec += kOSKextSystemLoadTimeout;
+    while (elapsedSecs < maxSecs) {
+        timeout.tv_sec = MIN(kOSKextSystemLoadPollTime, maxSecs - elapsedSecs);
+        timeout.tv_usec = 0;
 
-    timeval_difference(&timeout, &endtime, &currenttime);
-    usecs = usecs_from_timeval(&timeout);
-
-    FD_ZERO(&readfds);
-    FD_SET(systemLoadAdvisoryFileDescriptor, &readfds);
-
-    /* Check SystemLoadAdvisory notifications until it's a great time to
-     * do work or we hit the timeout.
-     */  
-
-    while (usecs) {
-        /* Wait for notifications or the timeout */
-
-        FD_COPY(&readfds, &tmpfds);
-        myResult = select(systemLoadAdvisoryFileDescriptor + 1, 
-            &tmpfds, NULL, NULL, &timeout);
-        if (myResult < 0) {
-            goto finish;
-        }
-
-        /* Set up the next timeout */
-
-        myResult = gettimeofday(&currenttime, NULL);
-        if (myResult < 0) {
-            goto finish;
-        }
-
-        timeval_difference(&timeout, &endtime, &currenttime);
-        usecs = usecs_from_timeval(&timeout);
-
-        /* Check the system load state */
-
-        if (!FD_ISSET(systemLoadAdvisoryFileDescriptor, &tmpfds)) {
-            continue;
+        FD_ZERO(&readfds);
+        if (systemLoadAdvisoryFileDescriptor >= 0) {
+            FD_SET(systemLoadAdvisoryFileDescriptor, &readfds);
         }
-
-        myResult = (int)read(systemLoadAdvisoryFileDescriptor,
-            &currentToken, sizeof(currentToken));
-        if (myResult < 0) {
+        myResult = select(systemLoadAdvisoryFileDescriptor + 1, 
+            &readfds, NULL, NULL, &timeout);
+        if (myResult < 0 && errno != EINTR) {
             goto finish;
         }
 
-        /* The token is written in network byte order. */
-        currentToken = ntohl(currentToken);
+        /* Drain the notification; the token is written in network byte
+         * order, and we recheck the level either way.
+         */
+        if (myResult > 0 && systemLoadAdvisoryFileDescriptor >= 0 &&
+            FD_ISSET(systemLoadAdvisoryFileDescriptor, &readfds)) {
 
-        if (currentToken != systemLoadAdvisoryToken) {
-            continue;
+            if (read(systemLoadAdvisoryFileDescriptor,
+                    &currentToken, sizeof(currentToken)) < 0) {
+                goto finish;
+            }
+            currentToken = ntohl(currentToken);
         }
 
-        notifyStatus = notify_get_state(systemLoadAdvisoryToken, 
-            &systemLoadAdvisoryState);
-        if (notifyStatus != NOTIFY_STATUS_OK) {
+        if (gettimeofday(&currenttime, NULL) < 0) {
             goto finish;
         }
+        elapsedSecs = (uint32_t)(currenttime.tv_sec - starttime.tv_sec);
 
+        level = currentSystemLoadLevel();
         OSKextLog(/* kext */ NULL,
             kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
-            "Received updated system load status %llu", systemLoadAdvisoryState);
-
-        if (systemLoadAdvisoryState == kIOSystemLoadAdvisoryLevelGreat) {
+            "System load level is now %d.", level);
+        if (level >= minLevel) {
             break;
         }
     }
 
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
-        "Pausing for another %d seconds to avoid work contention",
-        kOSKextSystemLoadPauseTime);
-
-    /* We'll wait a random amount longer to avoid colliding with 
-     * other work that is waiting for a great time.
-     */
-    sleep(kOSKextSystemLoadPauseTime);
-
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
-        "System load is low.  Proceeding.\n");
 finish:
+    *waitedSecsOut = elapsedSecs;
     if (systemLoadAdvisoryToken) {
         notify_cancel(systemLoadAdvisoryToken);
     }
-    return;
+    return level;
 }
 
 /*******************************************************************************
+* Low-priority (-F) builds call this before each phase of work rather than
+* waiting once up front.  Under a great load the phase runs with the -j
+* asked for; under an OK load it pauses briefly and runs with half as many
+* jobs; under a bad load it waits for the load to ease, then runs with one.
+* Waits over the whole build are capped at kOSKextSystemLoadTimeout, so a
+* rebuild on a host that's always busy still finishes.
 *******************************************************************************/
-static u_int
-usecs_from_timeval(struct timeval *t)
+static void
+throttleForSystemLoad(
+    KextcacheArgs * toolArgs,
+    const char    * phase)
 {
-    u_int usecs = 0;
+    static uint32_t waitedSecs      = 0;
+    uint32_t        budgetSecs      = 0;
+    uint32_t        phaseSecs       = 0;
+    int             level           = 0;
 
-    if (t) {
-        usecs = (unsigned int)((t->tv_sec * 1000) + t->tv_usec);
+    if (!toolArgs->lowPriorityFlag) {
+        return;
     }
-
-    return usecs;
-}
-
-/*******************************************************************************
-*******************************************************************************/
-static void
-timeval_from_usecs(struct timeval *t, u_int usecs)
-{
-    if (t) {
-        if (usecs > 0) {
-            t->tv_sec = usecs / 1000;
-            t->tv_usec = usecs % 1000;
-        } else {
-            bzero(t, sizeof(*t));
-        }
+    if (waitedSecs < kOSKextSystemLoadTimeout) {
+        budgetSecs = kOSKextSystemLoadTimeout - waitedSecs;
     }
-}
-
-/*******************************************************************************
-* dst = a - b
-*******************************************************************************/
-static void
-timeval_difference(struct timeval *dst, struct timeval *a, struct timeval *b)
-{
-    u_int ausec = 0, busec = 0, dstusec = 0;
-
-    if (dst) {
-        ausec = usecs_from_timeval(a);
-        busec = usecs_from_timeval(b);
-
-        if (ausec > busec) {
-            dstusec = ausec - busec;
-        }
 
-        timeval_from_usecs(dst, dstusec);
+    level = currentSystemLoadLevel();
+    if (level < kIOSystemLoadAdvisoryLevelOK && budgetSecs) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+            "Waiting for system load to ease before %s.", phase);
+        level = waitForSystemLoadLevel(kIOSystemLoadAdvisoryLevelOK,
+            MIN(kOSKextSystemLoadPhaseWait, budgetSecs), &phaseSecs);
+        waitedSecs += phaseSecs;
+    } else if (level == kIOSystemLoadAdvisoryLevelOK && budgetSecs) {
+        sleep(kOSKextSystemLoadOKPause);
+        waitedSecs += kOSKextSystemLoadOKPause;
+    }
+
+    if (level >= kIOSystemLoadAdvisoryLevelGreat) {
+        toolArgs->maxJobs = toolArgs->requestedJobs;
+    } else if (level == kIOSystemLoadAdvisoryLevelOK) {
+        toolArgs->maxJobs = MAX(1, toolArgs->requestedJobs / 2);
+    } else {
+        toolArgs->maxJobs = 1;
     }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+        "System load level %d before %s; using %u job%s.",
+        level, phase, toolArgs->maxJobs, (toolArgs->maxJobs == 1) ? "" : "s");
+    return;
 }
 
 #if !NO_BOOT_ROOT
@@ -1484,7 +1792,8 @@ ExitStatus checkArgs(KextcacheArgs * toolArgs)
     }
 
     if (!toolArgs->updateVolumeURL && !CFArrayGetCount(toolArgs->argURLs) &&
-        !toolArgs->compress && !toolArgs->uncompress) 
+        !toolArgs->compress && !toolArgs->uncompress &&
+        !toolArgs->compressionBenchmark) 
     {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
@@ -1502,6 +1811,24 @@ ExitStatus checkArgs(KextcacheArgs * toolArgs)
         toolArgs->compress = true;
         toolArgs->uncompress = false;
     }
+
+    if (toolArgs->compressionBenchmark &&
+        (!toolArgs->prelinkedKernelPath || CFArrayGetCount(toolArgs->argURLs))) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "-%s takes an existing prelinked kernel (-%s <filename>) "
+            "and no kexts.",
+            kOptNameCompressionBenchmark, kOptNamePrelinkedKernel);
+        goto finish;
+    }
+
+    if (toolArgs->compressionPolicy == kCompressionPolicyFastLib &&
+        !supportsFastLibCompression()) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "This kextcache can't write lzvn-compressed prelinked kernels.");
+        goto finish;
+    }
     
 #if !NO_BOOT_ROOT
     if ((toolArgs->updateOpts & kBRUForceUpdateHelpers)
@@ -1538,6 +1865,19 @@ ExitStatus checkArgs(KextcacheArgs * toolArgs)
             goto finish;
         }
     }
+    if (toolArgs->updateOpts & kBRUItemsMask) {
+        if (expectUpToDate || !toolArgs->updateVolumeURL ||
+            (toolArgs->updateOpts & (kBRUForceUpdateHelpers |
+                                     kBRUInvalidateKextcache))) {
+            OSKextLog(/* kext */ NULL,
+                      kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                      "-%s is allowed only with -%s (-%c) "
+                      "and without -%s or -%s.",
+                      kOptNameRebuildOnly, kOptNameUpdate, kOptUpdate,
+                      kOptNameForce, kOptNameInvalidate);
+            goto finish;
+        }
+    }
 #endif /* !NO_BOOT_ROOT */
 
     if (toolArgs->updateVolumeURL) {
@@ -1680,7 +2020,19 @@ finish:
 
 #pragma mark System Plist Caches
 
+/* Properties whose value arrays are precomputed with the plist caches.
+ */
+static const char * sCachedPropertyKeys[] = {
+    kOSBundleHelperKey,
+    "PGO",
+    NULL
+};
+
 /*******************************************************************************
+* All of the system plist caches are built from one scan of the system
+* extensions folders: the kexts created here are used for every arch's
+* personalities, property values, and indexes, and for each folder's
+* identifier cache, rather than each cache reading the folders again.
 *******************************************************************************/
 ExitStatus updateSystemPlistCaches(KextcacheArgs * toolArgs)
 {
@@ -1693,7 +2045,7 @@ ExitStatus updateSystemPlistCaches(KextcacheArgs * toolArgs)
     const NXArchInfo * startArch            = OSKextGetArchitecture();
     CFArrayRef         directoryValues      = NULL;   // must release
     CFArrayRef         personalities        = NULL;   // must release
-    CFIndex            count, i;
+    CFIndex            count, i, j;
 
    /* We only care about updating info for the system extensions folders.
     */
@@ -1734,22 +2086,64 @@ ExitStatus updateSystemPlistCaches(KextcacheArgs * toolArgs)
             goto finish;
         }
 
-       /* Loginwindow asks us for this property so let's spare lots of I/O
-        * by caching it. This read function call updates the caches for us;
-        * we don't use the output.
+       /* kextd sends this copy to the IOCatalogue as is, early in boot.
+        * It falls back to the compressed cache, so a failure isn't fatal.
         */
-        if (!readSystemKextPropertyValues(CFSTR(kOSBundleHelperKey), targetArch,
-                /* forceUpdate? */ true, /* values */ NULL)) {
-
-            goto finish;
+        if (!writeSerializedPersonalities(personalities, targetArch)) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
+                "Can't update %s serialized personalities cache.",
+                targetArch->name);
         }
 
-        /* And kextd asks for this each time it starts */
-        if (!readSystemKextPropertyValues(CFSTR("PGO"), targetArch,
-                /* forceUpdate? */ true, /* values */ NULL)) {
-            goto finish;
-        }
-    }
+       /* Loginwindow asks us for OSBundleHelper and kextd asks for PGO
+        * each time it starts, so let's spare lots of I/O by caching them.
+        */
+        for (j = 0; sCachedPropertyKeys[j]; j++) {
+            CFStringRef propertyKey = CFStringCreateWithCString(
+                kCFAllocatorDefault, sCachedPropertyKeys[j],
+                kCFStringEncodingUTF8);
+            Boolean     writeOK;
+
+            if (!propertyKey) {
+                OSKextLogMemError();
+                goto finish;
+            }
+            writeOK = writeSystemKextPropertyValues(kexts, propertyKey,
+                targetArch);
+            CFRelease(propertyKey);
+            if (!writeOK) {
+                goto finish;
+            }
+        }
+
+       /* kextfind looks symbols up here rather than scanning every kext.
+        * It can always fall back to scanning, so a failure isn't fatal.
+        */
+        if (!writeKextSymbolIndex(kexts, targetArch)) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
+                "Can't update %s kext symbol index.", targetArch->name);
+        }
+
+       /* kextutil and kextload open just the kexts they need from here;
+        * like the symbol index, they fall back to scanning without it.
+        */
+        if (!writeKextDependencyIndex(kexts, targetArch)) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
+                "Can't update %s kext dependency index.", targetArch->name);
+        }
+    }
+
+   /* kextlibs picks the kexts it needs out of this instead of scanning;
+    * it covers every arch, so it's written once.
+    */
+    if (!writeKextRepositorySnapshot(kexts)) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
+            "Can't update kext repository snapshot.");
+    }
 
    /* Update per-directory caches. This is just KextIdentifiers any more.
     */
@@ -1764,7 +2158,7 @@ ExitStatus updateSystemPlistCaches(KextcacheArgs * toolArgs)
             OSKextLogStringError(/* kext */ NULL);
             goto finish;
         }
-        if (EX_OK != updateDirectoryCaches(toolArgs, folderURL)) {
+        if (EX_OK != updateDirectoryCaches(toolArgs, folderURL, kexts)) {
             directoryResult = EX_OSERR;
         } else {
             OSKextLog(/* kext */ NULL,
@@ -1788,18 +2182,59 @@ finish:
 }
 
 /*******************************************************************************
+* Writes folderURL's identifier cache for the kexts in it, taken from
+* allKexts if given (kexts already created from several folders, plugins
+* included) rather than scanning the folder again.
 *******************************************************************************/
 ExitStatus updateDirectoryCaches(
         KextcacheArgs * toolArgs,
-        CFURLRef        folderURL)
+        CFURLRef        folderURL,
+        CFArrayRef      allKexts)
 {
     ExitStatus         result           = EX_OK;  // optimistic!
-    CFArrayRef         kexts            = NULL;   // must release
+    CFMutableArrayRef  kexts            = NULL;   // must release
+    CFURLRef           absFolderURL     = NULL;   // must release
+    CFStringRef        folderPath       = NULL;   // must release
+    CFStringRef        kextPath         = NULL;   // must release
+    CFIndex            count, i;
 
-    kexts = OSKextCreateKextsFromURL(kCFAllocatorDefault, folderURL);
-    if (!kexts) {
-        result = EX_OSERR;
-        goto finish;
+    if (!allKexts) {
+        kexts = (CFMutableArrayRef)OSKextCreateKextsFromURL(kCFAllocatorDefault,
+            folderURL);
+        if (!kexts) {
+            result = EX_OSERR;
+            goto finish;
+        }
+    } else {
+        if (!createCFMutableArray(&kexts, &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+        absFolderURL = CFURLCopyAbsoluteURL(folderURL);
+        folderPath = absFolderURL ?
+            CFURLCopyFileSystemPath(absFolderURL, kCFURLPOSIXPathStyle) : NULL;
+        if (!folderPath) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+
+        count = CFArrayGetCount(allKexts);
+        for (i = 0; i < count; i++) {
+            OSKextRef aKext = (OSKextRef)CFArrayGetValueAtIndex(allKexts, i);
+
+            SAFE_RELEASE_NULL(kextPath);
+            kextPath = copyKextPath(aKext);
+            if (kextPath &&
+                CFStringHasPrefix(kextPath, folderPath) &&
+                CFStringGetLength(kextPath) > CFStringGetLength(folderPath) &&
+                CFStringGetCharacterAtIndex(kextPath,
+                    CFStringGetLength(folderPath)) == '/') {
+
+                CFArrayAppendValue(kexts, aKext);
+            }
+        }
     }
 
     if (!_OSKextWriteIdentifierCacheForKextsInDirectory(
@@ -1812,6 +2247,9 @@ ExitStatus updateDirectoryCaches(
 
 finish:
     SAFE_RELEASE(kexts);
+    SAFE_RELEASE(absFolderURL);
+    SAFE_RELEASE(folderPath);
+    SAFE_RELEASE(kextPath);
     return result;
 }
 
@@ -2088,12 +2526,18 @@ ExitStatus filterKextsForCache(
 {
     ExitStatus          result        = EX_SOFTWARE;
     CFMutableArrayRef   firstPassArray = NULL;
+    CFMutableArrayRef   candidateArray = NULL;  // must release
+    OSStatus          * sigResults     = NULL;  // must free
     OSKextRequiredFlags requiredFlags;
     CFIndex             count, i;
     Boolean             kextSigningOnVol = false;
     Boolean             earlyBoot = false;
+    PrelinkStageMark    stageMark;
+
+    prelinkStageStart(&stageMark);
 
-    if (!createCFMutableArray(&firstPassArray, &kCFTypeArrayCallBacks)) {
+    if (!createCFMutableArray(&firstPassArray, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&candidateArray, &kCFTypeArrayCallBacks)) {
         OSKextLogMemError();
         goto finish;
     }
@@ -2227,7 +2671,6 @@ ExitStatus filterKextsForCache(
         OSKextIsInExcludeList(NULL, false); // prime the exclude list cache
         isInExceptionList(NULL, NULL, false); // prime the exception list cache
         for (i = count - 1; i >= 0; i--) {
-            OSStatus  sigResult;
             char kextPath[PATH_MAX];
             OSKextRef theKext = (OSKextRef)CFArrayGetValueAtIndex(
                     firstPassArray, i);
@@ -2297,8 +2740,56 @@ ExitStatus filterKextsForCache(
                 }
             }
  
+            if (!CFArrayContainsValue(candidateArray,
+                    RANGE_ALL(candidateArray), theKext)) {
+                CFArrayAppendValue(candidateArray, theKext);
+            }
+        } // for loop...
+
+       /* The exception list is consulted afterward, in order, along with
+        * the logging and the decision for each kext.
+        */
+        count = CFArrayGetCount(candidateArray);
+        if (kextSigningOnVol && count) {
+            sigResults = (OSStatus *)calloc(count, sizeof(*sigResults));
+            if (!sigResults) {
+                OSKextLogMemError();
+                goto finish;
+            }
+            prelinkStageEnd(&toolArgs->stageStats, kPrelinkStageFilter,
+                &stageMark);
+            prelinkStageStart(&stageMark);
+
+           /* The checks run on other threads, each adding its own CPU time,
+            * so a compression worker for another arch running meanwhile
+            * isn't charged to them.
+            */
+            checkKextSignatures(candidateArray, sigResults,
+                /* checkExceptionList */ false, earlyBoot,
+                &toolArgs->stageStats.stage[kPrelinkStageSignCheck].cpuUsecs);
+            prelinkStageAddWallTime(&toolArgs->stageStats,
+                kPrelinkStageSignCheck, &stageMark);
+            prelinkStageAddCounts(&toolArgs->stageStats,
+                kPrelinkStageSignCheck, /* bytesIn */ 0, /* bytesOut */ 0,
+                count);
+            prelinkStageStart(&stageMark);
+        }
+
+        for (i = 0; i < count; i++) {
+            OSStatus  sigResult;
+            char kextPath[PATH_MAX];
+            OSKextRef theKext = (OSKextRef)CFArrayGetValueAtIndex(
+                    candidateArray, i);
+
+            if (!CFURLGetFileSystemRepresentation(OSKextGetURL(theKext),
+                /* resolveToBase */ false, (UInt8 *)kextPath, sizeof(kextPath))) 
+            {
+                strlcpy(kextPath, "(unknown)", sizeof(kextPath));
+            }
+
             if (kextSigningOnVol
-                && (sigResult = checkKextSignature(theKext, true, earlyBoot)) != 0 ) {
+                && (sigResult = sigResults[i]) != 0
+                && !isInExceptionList(theKext, NULL, true)) {
                 
                 if (isInvalidSignatureAllowed()) {
                     OSKextLogCFString(NULL,
@@ -2334,6 +2825,11 @@ ExitStatus filterKextsForCache(
     result = EX_OK;
 
 finish:
+    prelinkStageEnd(&toolArgs->stageStats, kPrelinkStageFilter, &stageMark);
+    prelinkStageAddCounts(&toolArgs->stageStats, kPrelinkStageFilter,
+        /* bytesIn */ 0, /* bytesOut */ 0, CFArrayGetCount(kextArray));
+    SAFE_RELEASE(candidateArray);
+    SAFE_FREE(sigResults);
    return result;
 }
 
@@ -2503,64 +2999,11 @@ kextMatchesFilter(
     return result;
 }
 
-/*******************************************************************************
- * Creates a list of architectures to generate prelinked kernel slices for by
- * selecting the requested architectures for which the kernel has a slice.
- * Warns when a requested architecture does not have a corresponding kernel
- * slice.
- *******************************************************************************/
-ExitStatus
-createPrelinkedKernelArchs(
-    KextcacheArgs     * toolArgs,
-    CFMutableArrayRef * prelinkArchsOut)
-{
-    ExitStatus          result          = EX_OSERR;
-    CFMutableArrayRef   kernelArchs     = NULL;  // must release
-    CFMutableArrayRef   prelinkArchs    = NULL;  // must release
-    const NXArchInfo  * targetArch      = NULL;  // do not free
-    u_int               i               = 0;
-    
-    result = readFatFileArchsWithPath(toolArgs->kernelPath, &kernelArchs);
-    if (result != EX_OK) {
-        goto finish;
-    }
-
-    prelinkArchs = CFArrayCreateMutableCopy(kCFAllocatorDefault,
-        /* capacity */ 0, toolArgs->targetArchs);
-    if (!prelinkArchs) {
-        OSKextLogMemError();
-        result = EX_OSERR;
-        goto finish;
-    }
-
-    for (i = 0; i < CFArrayGetCount(prelinkArchs); ++i) {
-        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
-        if (!CFArrayContainsValue(kernelArchs, 
-            RANGE_ALL(kernelArchs), targetArch)) 
-        {
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
-                "Kernel file %s does not contain requested arch: %s",
-                toolArgs->kernelPath, targetArch->name);
-            CFArrayRemoveValueAtIndex(prelinkArchs, i);
-            i--;
-            continue;
-        }
-    }
-
-    *prelinkArchsOut = (CFMutableArrayRef) CFRetain(prelinkArchs);
-    result = EX_OK;
-
-finish:
-    SAFE_RELEASE(kernelArchs);
-    SAFE_RELEASE(prelinkArchs);
-
-    return result;
-}
-
 /*******************************************************************************
  * If the existing prelinked kernel has a valid timestamp, this reads the slices
- * out of that prelinked kernel so we don't have to regenerate them.
+ * out of that prelinked kernel so we don't have to regenerate them.  Either
+ * way, slices whose build keys were recorded are kept in toolArgs so that
+ * linkPrelinkedKernelForArch() can reuse any whose inputs haven't changed.
  *******************************************************************************/
 ExitStatus
 createExistingPrelinkedSlices(
@@ -2570,7 +3013,9 @@ createExistingPrelinkedSlices(
 {
     struct timeval      existingFileTimes[2];
     struct timeval      prelinkFileTimes[2];
-    ExitStatus          result  = EX_SOFTWARE;
+    ExitStatus          result          = EX_SOFTWARE;
+    CFMutableArrayRef   existingSlices  = NULL;  // must release
+    CFMutableArrayRef   existingArchs   = NULL;  // must release
 
    /* If we aren't updating the system prelinked kernel, then we don't want
     * to reuse any existing slices.
@@ -2580,6 +3025,16 @@ createExistingPrelinkedSlices(
         goto finish;
     }
 
+   /* Map rather than read; only the slices we end up reusing get paged in.
+    */
+    result = mapMachOSlices(toolArgs->prelinkedKernelPath, 
+        &existingSlices, &existingArchs, NULL, NULL);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    readPrelinkedSliceManifest(toolArgs, existingSlices, existingArchs);
+
     bzero(&existingFileTimes, sizeof(existingFileTimes));
     bzero(&prelinkFileTimes, sizeof(prelinkFileTimes));
 
@@ -2605,20 +3060,349 @@ createExistingPrelinkedSlices(
         goto finish;
     }
 
-    result = readMachOSlices(toolArgs->prelinkedKernelPath, 
-        existingSlicesOut, existingArchsOut, NULL, NULL);
-    if (result != EX_OK) {
-        existingSlicesOut = NULL;
-        existingArchsOut = NULL;
+    *existingSlicesOut = existingSlices;
+    *existingArchsOut = existingArchs;
+    existingSlices = NULL;
+    existingArchs = NULL;
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(existingSlices);
+    SAFE_RELEASE(existingArchs);
+    return result;
+}
+
+/*******************************************************************************
+ *******************************************************************************/
+static Boolean
+getPrelinkedSliceManifestPath(
+    KextcacheArgs     * toolArgs,
+    char              * pathBuf,
+    size_t              pathBufSize)
+{
+    if (!getLinkedSliceCachePath(toolArgs, /* archInfo */ NULL,
+            /* cacheKey */ NULL, pathBuf, pathBufSize)) {
+        return false;
+    }
+    if (strlcat(pathBuf, "/" kPrelinkedSliceManifestName, pathBufSize) >=
+            pathBufSize) {
+        OSKextLogStringError(/* kext */ NULL);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *******************************************************************************/
+static Boolean
+sliceManifestNumberMatches(
+    CFDictionaryRef     manifest,
+    CFStringRef         key,
+    int64_t             expected)
+{
+    CFNumberRef         number  = CFDictionaryGetValue(manifest, key);
+    int64_t             value   = 0;
+
+    return (number && CFGetTypeID(number) == CFNumberGetTypeID() &&
+        CFNumberGetValue(number, kCFNumberSInt64Type, &value) &&
+        value == expected);
+}
+
+/*******************************************************************************
+ * Fills in toolArgs->existingSlices and existingSliceKeys from the manifest
+ * written with the current prelinked kernel.  A missing or stale manifest
+ * just means no slice can be reused this way.
+ *******************************************************************************/
+static void
+readPrelinkedSliceManifest(
+    KextcacheArgs     * toolArgs,
+    CFArrayRef          existingSlices,
+    CFArrayRef          existingArchs)
+{
+    char                    manifestPath[PATH_MAX];
+    struct stat             statBuf;
+    CFDataRef               manifestData    = NULL;  // must release
+    CFPropertyListRef       manifest        = NULL;  // must release
+    CFDictionaryRef         sliceKeys       = NULL;  // do not release
+    CFStringRef             sliceKey        = NULL;  // do not release
+    CFStringRef             archName        = NULL;  // must release
+    CFMutableDictionaryRef  slices          = NULL;  // must release
+    CFMutableDictionaryRef  keys            = NULL;  // must release
+    const NXArchInfo      * archInfo        = NULL;  // do not free
+    CFIndex                 count, i;
+
+    if (!getPrelinkedSliceManifestPath(toolArgs, manifestPath,
+            sizeof(manifestPath)) ||
+        access(manifestPath, R_OK) != 0 ||
+        stat(toolArgs->prelinkedKernelPath, &statBuf) != 0) {
+        goto finish;
+    }
+    if (!createCFDataFromFile(&manifestData, manifestPath)) {
+        goto finish;
+    }
+    manifest = CFPropertyListCreateWithData(kCFAllocatorDefault,
+        manifestData, kCFPropertyListImmutable, NULL, NULL);
+    if (!manifest || CFGetTypeID(manifest) != CFDictionaryGetTypeID()) {
         goto finish;
     }
+    if (!sliceManifestNumberMatches(manifest, kSliceManifestInodeKey,
+            (int64_t)statBuf.st_ino) ||
+        !sliceManifestNumberMatches(manifest, kSliceManifestSizeKey,
+            (int64_t)statBuf.st_size) ||
+        !sliceManifestNumberMatches(manifest, kSliceManifestModTimeKey,
+            (int64_t)statBuf.st_mtimespec.tv_sec)) {
 
-    result = EX_OK;
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
+            "%s doesn't describe the current prelinked kernel.",
+            manifestPath);
+        goto finish;
+    }
+    sliceKeys = CFDictionaryGetValue(manifest, kSliceManifestKeysKey);
+    if (!sliceKeys || CFGetTypeID(sliceKeys) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+
+    if (!createCFMutableDictionary(&slices) ||
+        !createCFMutableDictionary(&keys)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(existingArchs);
+    for (i = 0; i < count; i++) {
+        archInfo = CFArrayGetValueAtIndex(existingArchs, i);
+
+        SAFE_RELEASE_NULL(archName);
+        archName = CFStringCreateWithCString(kCFAllocatorDefault,
+            archInfo->name, kCFStringEncodingUTF8);
+        if (!archName) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        sliceKey = CFDictionaryGetValue(sliceKeys, archName);
+        if (!sliceKey || CFGetTypeID(sliceKey) != CFStringGetTypeID()) {
+            continue;
+        }
+        CFDictionarySetValue(slices, archName,
+            CFArrayGetValueAtIndex(existingSlices, i));
+        CFDictionarySetValue(keys, archName, sliceKey);
+    }
+
+    SAFE_RELEASE(toolArgs->existingSlices);
+    SAFE_RELEASE(toolArgs->existingSliceKeys);
+    toolArgs->existingSlices = slices;
+    toolArgs->existingSliceKeys = keys;
+    slices = NULL;
+    keys = NULL;
+
+finish:
+    SAFE_RELEASE(manifestData);
+    SAFE_RELEASE(manifest);
+    SAFE_RELEASE(archName);
+    SAFE_RELEASE(slices);
+    SAFE_RELEASE(keys);
+    return;
+}
+
+/*******************************************************************************
+ * Records the key for a slice going into the new prelinked kernel.
+ *******************************************************************************/
+static void
+recordPrelinkedSliceKey(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         sliceKey)
+{
+    CFStringRef archName = NULL;  // must release
+
+    if (!sliceKey) {
+        return;
+    }
+    if (!toolArgs->sliceKeys &&
+        !createCFMutableDictionary(&toolArgs->sliceKeys)) {
+        OSKextLogMemError();
+        return;
+    }
+    archName = CFStringCreateWithCString(kCFAllocatorDefault,
+        archInfo->name, kCFStringEncodingUTF8);
+    if (!archName) {
+        OSKextLogMemError();
+        return;
+    }
+    CFDictionarySetValue(toolArgs->sliceKeys, archName, sliceKey);
+    CFRelease(archName);
+}
+
+/*******************************************************************************
+ * A slice carried over whole from the current prelinked kernel keeps the key
+ * it was recorded with, if any.
+ *******************************************************************************/
+static void
+recordExistingSliceKey(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo)
+{
+    CFStringRef archName = NULL;  // must release
+
+    if (!toolArgs->existingSliceKeys) {
+        return;
+    }
+    archName = CFStringCreateWithCString(kCFAllocatorDefault,
+        archInfo->name, kCFStringEncodingUTF8);
+    if (!archName) {
+        OSKextLogMemError();
+        return;
+    }
+    recordPrelinkedSliceKey(toolArgs, archInfo,
+        CFDictionaryGetValue(toolArgs->existingSliceKeys, archName));
+    CFRelease(archName);
+}
+
+/*******************************************************************************
+ * Returns the slice of the current prelinked kernel for archInfo if it was
+ * built from sliceKey, else NULL.
+ *******************************************************************************/
+static CFDataRef
+copyExistingSliceForKey(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         sliceKey)
+{
+    CFDataRef   result      = NULL;
+    CFStringRef archName    = NULL;  // must release
+    CFStringRef existingKey = NULL;  // do not release
+
+    if (!toolArgs->existingSlices || !toolArgs->existingSliceKeys) {
+        goto finish;
+    }
+    archName = CFStringCreateWithCString(kCFAllocatorDefault,
+        archInfo->name, kCFStringEncodingUTF8);
+    if (!archName) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    existingKey = CFDictionaryGetValue(toolArgs->existingSliceKeys, archName);
+    if (existingKey && CFEqual(existingKey, sliceKey)) {
+        result = CFDictionaryGetValue(toolArgs->existingSlices, archName);
+        if (result) {
+            CFRetain(result);
+        }
+    }
 
 finish:
+    SAFE_RELEASE(archName);
     return result;
 }
 
+/*******************************************************************************
+ * Saves the keys of the slices just written, tied to the new prelinked
+ * kernel file.  With no keys (e.g. when symbols were generated) any old
+ * manifest is removed.  As with the linked slice cache, failures only cost
+ * a rebuild later.
+ *******************************************************************************/
+static void
+writePrelinkedSliceManifest(KextcacheArgs * toolArgs)
+{
+    char                    cacheDir[PATH_MAX];
+    char                    manifestPath[PATH_MAX];
+    char                    tmpPath[PATH_MAX];
+    struct stat             statBuf;
+    CFMutableDictionaryRef  manifest        = NULL;  // must release
+    CFDataRef               manifestData    = NULL;  // must release
+    CFNumberRef             number          = NULL;  // must release
+    int64_t                 value           = 0;
+    int                     fd              = -1;    // must close
+    Boolean                 wroteManifest   = false;
+
+    if (!toolArgs->needDefaultPrelinkedKernelInfo ||
+        !getLinkedSliceCachePath(toolArgs, /* archInfo */ NULL,
+            /* cacheKey */ NULL, cacheDir, sizeof(cacheDir)) ||
+        !getPrelinkedSliceManifestPath(toolArgs, manifestPath,
+            sizeof(manifestPath))) {
+        goto finish;
+    }
+
+    if (!toolArgs->sliceKeys || !CFDictionaryGetCount(toolArgs->sliceKeys) ||
+        stat(toolArgs->prelinkedKernelPath, &statBuf) != 0) {
+
+        (void)unlink(manifestPath);
+        goto finish;
+    }
+
+    if (!createCFMutableDictionary(&manifest)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    value = (int64_t)statBuf.st_ino;
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value);
+    if (!number) {
+        goto finish;
+    }
+    CFDictionarySetValue(manifest, kSliceManifestInodeKey, number);
+    SAFE_RELEASE_NULL(number);
+    value = (int64_t)statBuf.st_size;
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value);
+    if (!number) {
+        goto finish;
+    }
+    CFDictionarySetValue(manifest, kSliceManifestSizeKey, number);
+    SAFE_RELEASE_NULL(number);
+    value = (int64_t)statBuf.st_mtimespec.tv_sec;
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value);
+    if (!number) {
+        goto finish;
+    }
+    CFDictionarySetValue(manifest, kSliceManifestModTimeKey, number);
+    CFDictionarySetValue(manifest, kSliceManifestKeysKey, toolArgs->sliceKeys);
+
+    manifestData = CFPropertyListCreateData(kCFAllocatorDefault, manifest,
+        kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (!manifestData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s.", cacheDir, strerror(errno));
+        goto finish;
+    }
+    if (strlcpy(tmpPath, manifestPath, sizeof(tmpPath)) >= sizeof(tmpPath) ||
+        strlcat(tmpPath, ".XXXX", sizeof(tmpPath)) >= sizeof(tmpPath)) {
+        OSKextLogStringError(/* kext */ NULL);
+        goto finish;
+    }
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s.", tmpPath, strerror(errno));
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(manifestData),
+            CFDataGetLength(manifestData)) != EX_OK) {
+        goto finish;
+    }
+    if (rename(tmpPath, manifestPath) != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't rename %s - %s.", tmpPath, strerror(errno));
+        goto finish;
+    }
+    wroteManifest = true;
+
+finish:
+    if (fd >= 0) close(fd);
+    if (fd >= 0 && !wroteManifest) unlink(tmpPath);
+    SAFE_RELEASE(manifest);
+    SAFE_RELEASE(manifestData);
+    SAFE_RELEASE(number);
+    return;
+}
+
 
 /*******************************************************************************
 *******************************************************************************/
@@ -2633,8 +3417,9 @@ createPrelinkedKernel(
     CFMutableArrayRef   existingArchs       = NULL;  // must release
     CFMutableArrayRef   existingSlices      = NULL;  // must release
     CFMutableArrayRef   prelinkArchs        = NULL;  // must release
-    CFMutableArrayRef   prelinkSlices       = NULL;  // must release
     CFDataRef           prelinkSlice        = NULL;  // must release
+    FatFileWriter       writer;                      // must abort or finish
+    PrelinkSymbolWrites * symbolWrites      = NULL;  // must finish
     CFDictionaryRef     sliceSymbols        = NULL;  // must release
     const NXArchInfo  * targetArch          = NULL;  // do not free
     Boolean             updateModTime       = false;
@@ -2646,8 +3431,11 @@ createPrelinkedKernel(
     dev_t               plk_dev_t           = 0;
     ino_t               kern_ino_t          = 0;
     dev_t               kern_dev_t          = 0;
+    PrelinkStageMark    stageMark;
 
     bzero(&prelinkFileTimes, sizeof(prelinkFileTimes));
+    bzero(&writer, sizeof(writer));
+    writer.fileDescriptor = -1;
  
     /* Do not allow an untrusted kernel file if 
      * 1) file system is restricted, and
@@ -2692,7 +3480,8 @@ createPrelinkedKernel(
     }
 #endif /* !NO_BOOT_ROOT */
 
-    result = createPrelinkedKernelArchs(toolArgs, &prelinkArchs);
+    result = createPrelinkArchsForKernel(toolArgs->kernelPath,
+        toolArgs->targetArchs, &prelinkArchs);
     if (result != EX_OK) {
         goto finish;
     }
@@ -2709,23 +3498,47 @@ createPrelinkedKernel(
         }
     }
 
-    prelinkSlices = CFArrayCreateMutable(kCFAllocatorDefault,
-        numArchs, &kCFTypeArrayCallBacks);
     generatedSymbols = CFArrayCreateMutable(kCFAllocatorDefault, 
         numArchs, &kCFTypeArrayCallBacks);
     generatedArchs = CFArrayCreateMutable(kCFAllocatorDefault, 
         numArchs, NULL);
-    if (!prelinkSlices || !generatedSymbols || !generatedArchs) {
+    if (!generatedSymbols || !generatedArchs) {
         OSKextLogMemError();
         result = EX_OSERR;
         goto finish;
     }
 
-    for (i = 0; i < numArchs; i++) {
-        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
-
-        SAFE_RELEASE_NULL(prelinkSlice);
-        SAFE_RELEASE_NULL(sliceSymbols);
+   /* Each slice is written to a temporary file as soon as it's built and
+    * then dropped, so only about one slice is held at a time.  The file is
+    * renamed into place by finishPrelinkedKernel() below.
+    */
+    result = openPrelinkedKernelWriter(&writer,
+        toolArgs->prelinkedKernelPath, prelinkArchs, MKEXT_PERMS,
+        &toolArgs->stageStats);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+   /* With -j, build the slices on a worker pool; the output is written
+    * in arch order either way.  Go by the -j asked for rather than the
+    * current maxJobs, which an earlier -F throttle may have lowered; the
+    * pool rechecks the load before each slice.
+    */
+    if (toolArgs->requestedJobs > 1 && numArchs > 1) {
+        result = createPrelinkedKernelSlicesConcurrently(toolArgs,
+            prelinkArchs, existingSlices, existingArchs,
+            &writer, generatedSymbols, generatedArchs);
+        if (result != EX_OK) {
+            goto finish;
+        }
+        numArchs = 0;  // skip the serial loop below
+    }
+
+    for (i = 0; i < numArchs; i++) {
+        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
+
+        SAFE_RELEASE_NULL(prelinkSlice);
+        SAFE_RELEASE_NULL(sliceSymbols);
 
        /* We always create a new prelinked kernel for the current
         * running architecture if asked, but we'll reuse existing slices
@@ -2737,9 +3550,13 @@ createPrelinkedKernel(
             j = (int)CFArrayGetFirstIndexOfValue(existingArchs,
                 RANGE_ALL(existingArchs), targetArch);
             if (j != -1) {
-                prelinkSlice = CFArrayGetValueAtIndex(existingSlices, j);
-                CFArrayAppendValue(prelinkSlices, prelinkSlice);
-                prelinkSlice = NULL;
+                result = appendPrelinkedKernelSlice(&writer,
+                    CFArrayGetValueAtIndex(existingSlices, j),
+                    &toolArgs->stageStats);
+                if (result != EX_OK) {
+                    goto finish;
+                }
+                recordExistingSliceKey(toolArgs, targetArch);
                 OSKextLog(/* kext */ NULL,
                     kOSKextLogDebugLevel | kOSKextLogArchiveFlag,
                     "Using existing prelinked slice for arch %s",
@@ -2753,19 +3570,26 @@ createPrelinkedKernel(
             "Generating a new prelinked slice for arch %s",
             targetArch->name);
 
+        throttleForSystemLoad(toolArgs, "linking a prelinked slice");
         result = createPrelinkedKernelForArch(toolArgs, &prelinkSlice,
             &sliceSymbols, targetArch);
         if (result != EX_OK) {
             goto finish;
         }
 
-        CFArrayAppendValue(prelinkSlices, prelinkSlice);
+        result = appendPrelinkedKernelSlice(&writer, prelinkSlice,
+            &toolArgs->stageStats);
+        if (result != EX_OK) {
+            goto finish;
+        }
         CFArrayAppendValue(generatedSymbols, sliceSymbols);
         CFArrayAppendValue(generatedArchs, targetArch);
     }
 
+    prelinkStageStart(&stageMark);
     result = getExpectedPrelinkedKernelModTime(toolArgs,
         prelinkFileTimes, &updateModTime);
+    prelinkStageEnd(&toolArgs->stageStats, kPrelinkStageStamps, &stageMark);
     if (result != EX_OK) {
         goto finish;
     }
@@ -2796,23 +3620,41 @@ createPrelinkedKernel(
         goto finish;
     }
     
-    result = writeFatFileWithValidation(toolArgs->prelinkedKernelPath,
-                                        TRUE,
-                                        plk_dev_t,
-                                        plk_ino_t,
-                                        prelinkSlices,
-                                        prelinkArchs,
-                                        MKEXT_PERMS,
-                                        (updateModTime) ? prelinkFileTimes : NULL);
+    throttleForSystemLoad(toolArgs, "writing the prelinked kernel");
+    result = finishPrelinkedKernel(&writer,
+                                   TRUE,
+                                   plk_dev_t,
+                                   plk_ino_t,
+                                   (updateModTime) ? prelinkFileTimes : NULL,
+                                   /* symbolDirURL */ NULL,
+                                   /* generatedSymbols */ NULL,
+                                   /* generatedArchs */ NULL,
+                                   &toolArgs->stageStats);
     if (result != EX_OK) {
         goto finish;
     }
+    writePrelinkedSliceManifest(toolArgs);
+
+   /* The prelinked kernel is in place; write the symbols in the background
+    * while we finish up, and wait for them before reporting.
+    */
+    if (toolArgs->symbolDirURL) {
+        throttleForSystemLoad(toolArgs, "writing symbols");
+        result = startPrelinkedSymbolWrites(toolArgs->symbolDirURL,
+            generatedSymbols, generatedArchs, &toolArgs->stageStats,
+            &symbolWrites);
+        if (result != EX_OK) {
+            goto finish;
+        }
+    }
     
 #if 1 // 19903363 we can remove this section after clients make transition
     if (needsPrelinkedKernelCopy(toolArgs)) {
         CFMutableStringRef  myNewString = NULL;
         CFStringRef         myTempStr = NULL;
         CFIndex             myReplacedCount = 0;
+        CFMutableArrayRef   mySlices = NULL;
+        CFMutableArrayRef   myArchs = NULL;
 
         /* convert "prelinkedkernel" to "kernelcache", adjusting paths too.
          * We do best effort to make a copy, but failure is not fatal at this
@@ -2854,9 +3696,16 @@ createPrelinkedKernel(
 
                 /* now write another copy of prelinked kernel to
                  * "/System/Library/Caches/com.apple.kext.caches/Startup"
+                 * from a mapping of the one we just wrote; the slices
+                 * weren't kept.
                  */
-                myErr = writeFatFile(&tempbuf[0], prelinkSlices,
-                                     prelinkArchs, MKEXT_PERMS,
+                myErr = mapMachOSlices(toolArgs->prelinkedKernelPath,
+                                       &mySlices, &myArchs, NULL, NULL);
+                if (myErr != EX_OK) {
+                    break;
+                }
+                myErr = writeFatFile(&tempbuf[0], mySlices,
+                                     myArchs, MKEXT_PERMS,
                                      (updateModTime) ? prelinkFileTimes : NULL);
                 if (myErr == EX_OK) {
                     OSKextLog(/* kext */ NULL,
@@ -2869,12 +3718,14 @@ createPrelinkedKernel(
 
         SAFE_RELEASE(myNewString);
         SAFE_RELEASE(myTempStr);
+        SAFE_RELEASE(mySlices);
+        SAFE_RELEASE(myArchs);
     }
 #endif
- 
-    if (toolArgs->symbolDirURL) {
-        result = writePrelinkedSymbols(toolArgs->symbolDirURL,
-                                       generatedSymbols, generatedArchs);
+
+    if (symbolWrites) {
+        result = finishPrelinkedSymbolWrites(symbolWrites);
+        symbolWrites = NULL;
         if (result != EX_OK) {
             goto finish;
         }
@@ -2884,6 +3735,7 @@ createPrelinkedKernel(
               kOSKextLogGeneralFlag | kOSKextLogBasicLevel,
               "Created prelinked kernel \"%s\"",
               toolArgs->prelinkedKernelPath);
+    logPrelinkStageStats(&toolArgs->stageStats);
     if (toolArgs->kernelPath) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogGeneralFlag | kOSKextLogBasicLevel,
@@ -2935,9 +3787,12 @@ finish:
     SAFE_RELEASE(existingArchs);
     SAFE_RELEASE(existingSlices);
     SAFE_RELEASE(prelinkArchs);
-    SAFE_RELEASE(prelinkSlices);
     SAFE_RELEASE(prelinkSlice);
     SAFE_RELEASE(sliceSymbols);
+    abortFatFileWriter(&writer);
+    if (symbolWrites) {
+        (void)finishPrelinkedSymbolWrites(symbolWrites);
+    }
 
 #if !NO_BOOT_ROOT
     putVolumeForPath(toolArgs->prelinkedKernelPath, result);
@@ -2946,6 +3801,247 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+ * Generates prelinked kernel slices for several archs at once, with at most
+ * toolArgs->maxJobs slices in flight, out of a pool of -j.  The OSKext library can only target one
+ * arch at a time, so every slice is linked in arch order on this thread, just
+ * as the serial path does; compressing each linked slice is then handed off
+ * to a worker so it overlaps with linking the next arch.  Finished slices are
+ * appended to writer in arch order as soon as all the slices before them are
+ * written, so the fat file is identical to a serial build.
+ *******************************************************************************/
+static ExitStatus
+createPrelinkedKernelSlicesConcurrently(
+    KextcacheArgs     * toolArgs,
+    CFArrayRef          prelinkArchs,
+    CFArrayRef          existingSlices,
+    CFArrayRef          existingArchs,
+    FatFileWriter     * writer,
+    CFMutableArrayRef   generatedSymbols,
+    CFMutableArrayRef   generatedArchs)
+{
+    ExitStatus            result        = EX_OK;
+    ExitStatus            writeResult   = EX_OK;
+    u_int                 numArchs      = (u_int)CFArrayGetCount(prelinkArchs);
+    CFDataRef           * linkedSlices  = NULL;  // must free; block releases
+    CFDataRef           * finalSlices   = NULL;  // must free & release each
+    CFDictionaryRef     * sliceSymbols  = NULL;  // must free & release each
+    ExitStatus          * sliceResults  = NULL;  // must free
+    Boolean             * sliceIsNew    = NULL;  // must free
+    dispatch_semaphore_t * sliceDone    = NULL;  // must free & release each
+    dispatch_queue_t      workQueue     = NULL;  // do not release
+    dispatch_group_t      workGroup     = NULL;  // must release
+    dispatch_semaphore_t  jobSlots      = NULL;  // must release
+    u_int                 poolJobs      = toolArgs->requestedJobs;
+    u_int                 heldSlots     = 0;
+    const NXArchInfo    * targetArch    = NULL;  // do not free
+    Boolean               supportsKASLR = false;
+    Boolean               sliceFinished = false;
+    u_int                 nextSlice     = 0;
+    u_int                 i             = 0;
+    int                   j             = 0;
+
+    linkedSlices = calloc(numArchs, sizeof(*linkedSlices));
+    finalSlices = calloc(numArchs, sizeof(*finalSlices));
+    sliceSymbols = calloc(numArchs, sizeof(*sliceSymbols));
+    sliceResults = calloc(numArchs, sizeof(*sliceResults));
+    sliceIsNew = calloc(numArchs, sizeof(*sliceIsNew));
+    sliceDone = calloc(numArchs, sizeof(*sliceDone));
+    workQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    workGroup = dispatch_group_create();
+    jobSlots = dispatch_semaphore_create(poolJobs);
+    if (!linkedSlices || !finalSlices || !sliceSymbols || !sliceResults ||
+        !sliceIsNew || !sliceDone || !workQueue || !workGroup || !jobSlots) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+    for (i = 0; i < numArchs; i++) {
+        sliceDone[i] = dispatch_semaphore_create(0);
+        if (!sliceDone[i]) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+    }
+
+    for (i = 0; i < numArchs; i++) {
+        targetArch = CFArrayGetValueAtIndex(prelinkArchs, i);
+
+       /* Same reuse policy as the serial path in createPrelinkedKernel().
+        */
+        if (existingArchs &&
+            targetArch != OSKextGetRunningKernelArchitecture())
+        {
+            j = (int)CFArrayGetFirstIndexOfValue(existingArchs,
+                RANGE_ALL(existingArchs), targetArch);
+            if (j != -1) {
+                finalSlices[i] = CFRetain(CFArrayGetValueAtIndex(existingSlices, j));
+                dispatch_semaphore_signal(sliceDone[i]);
+                recordExistingSliceKey(toolArgs, targetArch);
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogDebugLevel | kOSKextLogArchiveFlag,
+                    "Using existing prelinked slice for arch %s",
+                    targetArch->name);
+                result = appendFinishedPrelinkedSlices(toolArgs, writer,
+                    finalSlices, sliceResults, sliceDone, &nextSlice,
+                    /* endSlice */ i + 1, /* wait */ false);
+                if (result != EX_OK) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDebugLevel | kOSKextLogArchiveFlag,
+            "Generating a new prelinked slice for arch %s",
+            targetArch->name);
+
+       /* Under -F the load throttle may lower maxJobs between slices;
+        * narrow the pool by holding job slots ourselves, and give them
+        * back as the load eases.
+        */
+        throttleForSystemLoad(toolArgs, "linking a prelinked slice");
+        while (heldSlots < poolJobs - MIN(toolArgs->maxJobs, poolJobs)) {
+            dispatch_semaphore_wait(jobSlots, DISPATCH_TIME_FOREVER);
+            heldSlots++;
+        }
+        while (heldSlots > poolJobs - MIN(toolArgs->maxJobs, poolJobs)) {
+            dispatch_semaphore_signal(jobSlots);
+            heldSlots--;
+        }
+
+        result = linkPrelinkedKernelForArch(toolArgs, &linkedSlices[i],
+            &sliceSymbols[i], &supportsKASLR, &sliceFinished, targetArch);
+        if (result != EX_OK) {
+            break;
+        }
+        sliceIsNew[i] = true;
+
+       /* An unchanged slice from the current prelinked kernel is already
+        * compressed.
+        */
+        if (sliceFinished) {
+            finalSlices[i] = linkedSlices[i];
+            linkedSlices[i] = NULL;
+            dispatch_semaphore_signal(sliceDone[i]);
+        } else {
+           /* Wait for a free job slot, then compress this slice in the
+            * background while we go on to link the next one.
+            */
+            u_int   slot      = i;
+            Boolean slotKASLR = supportsKASLR;
+
+            dispatch_semaphore_wait(jobSlots, DISPATCH_TIME_FOREVER);
+            dispatch_group_async(workGroup, workQueue, ^{
+                sliceResults[slot] = finishPrelinkedKernelForArch(toolArgs,
+                    linkedSlices[slot], slotKASLR, &finalSlices[slot]);
+                SAFE_RELEASE_NULL(linkedSlices[slot]);
+                dispatch_semaphore_signal(sliceDone[slot]);
+                dispatch_semaphore_signal(jobSlots);
+            });
+        }
+
+       /* Write out whatever has finished in order so far, without waiting.
+        */
+        result = appendFinishedPrelinkedSlices(toolArgs, writer,
+            finalSlices, sliceResults, sliceDone, &nextSlice,
+            /* endSlice */ i + 1, /* wait */ false);
+        if (result != EX_OK) {
+            break;
+        }
+    }
+
+   /* Join all workers before looking at any of their results.
+    */
+    dispatch_group_wait(workGroup, DISPATCH_TIME_FOREVER);
+    for (; heldSlots > 0; heldSlots--) {
+        dispatch_semaphore_signal(jobSlots);
+    }
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    writeResult = appendFinishedPrelinkedSlices(toolArgs, writer,
+        finalSlices, sliceResults, sliceDone, &nextSlice,
+        /* endSlice */ numArchs, /* wait */ true);
+    if (writeResult != EX_OK) {
+        result = writeResult;
+        goto finish;
+    }
+
+    for (i = 0; i < numArchs; i++) {
+        if (sliceIsNew[i]) {
+            CFArrayAppendValue(generatedSymbols, sliceSymbols[i]);
+            CFArrayAppendValue(generatedArchs,
+                CFArrayGetValueAtIndex(prelinkArchs, i));
+        }
+    }
+
+    result = EX_OK;
+
+finish:
+    for (i = 0; i < numArchs; i++) {
+        if (linkedSlices) SAFE_RELEASE(linkedSlices[i]);
+        if (finalSlices) SAFE_RELEASE(finalSlices[i]);
+        if (sliceSymbols) SAFE_RELEASE(sliceSymbols[i]);
+        if (sliceDone && sliceDone[i]) dispatch_release(sliceDone[i]);
+    }
+    SAFE_FREE(linkedSlices);
+    SAFE_FREE(finalSlices);
+    SAFE_FREE(sliceSymbols);
+    SAFE_FREE(sliceResults);
+    SAFE_FREE(sliceIsNew);
+    SAFE_FREE(sliceDone);
+    if (workGroup) dispatch_release(workGroup);
+    if (jobSlots) dispatch_release(jobSlots);
+
+    return result;
+}
+
+/*******************************************************************************
+ * Appends finished slices from *nextSlice up to endSlice, stopping at the
+ * first one that isn't done yet unless asked to wait for it.  Each slice is
+ * released once written.
+ *******************************************************************************/
+static ExitStatus
+appendFinishedPrelinkedSlices(
+    KextcacheArgs         * toolArgs,
+    FatFileWriter         * writer,
+    CFDataRef             * finalSlices,
+    ExitStatus            * sliceResults,
+    dispatch_semaphore_t  * sliceDone,
+    u_int                 * nextSlice,
+    u_int                   endSlice,
+    Boolean                 wait)
+{
+    ExitStatus  result  = EX_OK;
+    u_int       slot    = 0;
+
+    while (*nextSlice < endSlice) {
+        slot = *nextSlice;
+        if (dispatch_semaphore_wait(sliceDone[slot],
+            wait ? DISPATCH_TIME_FOREVER : DISPATCH_TIME_NOW) != 0) {
+
+            break;
+        }
+        result = sliceResults[slot];
+        if (result != EX_OK) {
+            break;
+        }
+        result = appendPrelinkedKernelSlice(writer, finalSlices[slot],
+            &toolArgs->stageStats);
+        SAFE_RELEASE_NULL(finalSlices[slot]);
+        if (result != EX_OK) {
+            break;
+        }
+        (*nextSlice)++;
+    }
+
+    return result;
+}
+
 /* NOTE -> Null URL means no /Volumes/XXX prefix was used, also a null string
  * in the URL is also treated as root volume
  */
@@ -2986,21 +4082,62 @@ ExitStatus createPrelinkedKernelForArch(
     CFDataRef           * prelinkedKernelOut,
     CFDictionaryRef     * prelinkedSymbolsOut,
     const NXArchInfo    * archInfo)
+{
+    ExitStatus result = EX_OSERR;
+    CFDataRef prelinkedKernel = NULL;
+    Boolean kernelSupportsKASLR = false;
+    Boolean sliceFinished = false;
+
+    result = linkPrelinkedKernelForArch(toolArgs, &prelinkedKernel,
+        prelinkedSymbolsOut, &kernelSupportsKASLR, &sliceFinished, archInfo);
+    if (result != EX_OK) {
+        goto finish;
+    }
+
+    if (sliceFinished) {
+        *prelinkedKernelOut = CFRetain(prelinkedKernel);
+        goto finish;
+    }
+
+    result = finishPrelinkedKernelForArch(toolArgs, prelinkedKernel,
+        kernelSupportsKASLR, prelinkedKernelOut);
+
+finish:
+    SAFE_RELEASE(prelinkedKernel);
+
+    return result;
+}
+
+/*******************************************************************************
+ * Links the uncompressed prelinked kernel for one arch.  This is the part of
+ * slice generation that uses the OSKext library, which keeps the current
+ * architecture as process-wide state, so it must not run concurrently with
+ * itself.  If the current prelinked kernel's slice for the arch was built
+ * from the same inputs, that slice is returned instead, already compressed,
+ * and *sliceFinishedOut is set.
+ *******************************************************************************/
+ExitStatus linkPrelinkedKernelForArch(
+    KextcacheArgs       * toolArgs,
+    CFDataRef           * prelinkedKernelOut,
+    CFDictionaryRef     * prelinkedSymbolsOut,
+    Boolean             * kernelSupportsKASLROut,
+    Boolean             * sliceFinishedOut,
+    const NXArchInfo    * archInfo)
 {
     ExitStatus result = EX_OSERR;
     CFMutableArrayRef prelinkKexts = NULL;
     CFDataRef kernelImage = NULL;
     CFDataRef prelinkedKernel = NULL;
+    CFStringRef cacheKey = NULL;
+    CFStringRef sliceKey = NULL;
+    Boolean sliceFinished = false;
     uint32_t flags = 0;
     Boolean fatalOut = false;
     Boolean kernelSupportsKASLR = false;
-    macho_seek_result machoResult;
-    const UInt8 * kernelStart;
-    const UInt8 * kernelEnd;
     
     /* Retrieve the kernel image for the requested architecture.
      */
-    kernelImage = readMachOSliceForArch(toolArgs->kernelPath, archInfo, /* checkArch */ TRUE);
+    kernelImage = mapMachOSliceForArch(toolArgs->kernelPath, archInfo, /* checkArch */ TRUE);
     if (!kernelImage) {
         OSKextLog(/* kext */ NULL,
                 kOSKextLogErrorLevel | kOSKextLogArchiveFlag |  kOSKextLogFileAccessFlag,
@@ -3054,52 +4191,494 @@ ExitStatus createPrelinkedKernelForArch(
     flags |= (toolArgs->includeAllPersonalities) ? kOSKextKernelcacheIncludeAllPersonalitiesFlag : 0;
     flags |= (toolArgs->stripSymbols) ? kOSKextKernelcacheStripSymbolsFlag : 0;
  
-    kernelStart = CFDataGetBytePtr(kernelImage);
-    kernelEnd = kernelStart + CFDataGetLength(kernelImage) - 1;
-    machoResult = macho_find_dysymtab(kernelStart, kernelEnd, NULL);
-    /* this kernel supports KASLR if there is a LC_DYSYMTAB load command */
-    kernelSupportsKASLR = (machoResult == macho_seek_result_found);
+    kernelSupportsKASLR = kernelImageSupportsKASLR(kernelImage);
     if (kernelSupportsKASLR) {
         flags |= kOSKextKernelcacheKASLRFlag;
     }
   
-    prelinkedKernel = OSKextCreatePrelinkedKernel(kernelImage, prelinkKexts,
-        toolArgs->volumeRootURL, flags, prelinkedSymbolsOut);
-    if (!prelinkedKernel) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-            "Failed to generate prelinked kernel.");
-        result = EX_OSERR;
-        goto finish;
+   /* When updating the system prelinked kernel without symbols, see if
+    * we've already linked exactly this kernel and kext set.  The kext set
+    * has been filtered (and its signatures checked) by now, so a hit still
+    * reflects the current exclusion decisions.
+    */
+    if (toolArgs->needDefaultPrelinkedKernelInfo && !toolArgs->symbolDirURL) {
+        cacheKey = copyLinkedSliceCacheKey(toolArgs, kernelImage,
+            prelinkKexts, archInfo, flags);
     }
 
-   /* Compress the prelinked kernel if needed */
-
-    if (toolArgs->compress) {
-        Boolean     wantsFastLib = wantsFastLibCompressionForTargetVolume(toolArgs->volumeRootURL);
-        uint32_t    compressionType = wantsFastLib ? COMP_TYPE_FASTLIB : COMP_TYPE_LZSS;
-        
-        *prelinkedKernelOut = compressPrelinkedSlice(compressionType,
-                                                     prelinkedKernel,
-                                                     kernelSupportsKASLR);
-    } else {
-        *prelinkedKernelOut = CFRetain(prelinkedKernel);
+   /* Better yet, the slice in the current prelinked kernel may already be
+    * the one we'd build: same link inputs, same compression settings, and
+    * the same codec preference on the target volume.
+    */
+    if (cacheKey) {
+        sliceKey = CFStringCreateWithFormat(kCFAllocatorDefault, NULL,
+            CFSTR("%@-%d-%d-%d-%d"), cacheKey, toolArgs->compress,
+            toolArgs->chunkedCompression, toolArgs->compressionPolicy,
+            toolArgs->compress &&
+                wantsFastLibCompressionForTargetVolume(toolArgs->volumeRootURL));
+        recordPrelinkedSliceKey(toolArgs, archInfo, sliceKey);
+    }
+    if (sliceKey) {
+        prelinkedKernel = copyExistingSliceForKey(toolArgs, archInfo,
+            sliceKey);
+        if (prelinkedKernel) {
+            sliceFinished = true;
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogProgressLevel | kOSKextLogArchiveFlag,
+                "Prelinked slice for arch %s is unchanged; reusing it.",
+                archInfo->name);
+        }
     }
-    
-    if (!*prelinkedKernelOut) {
-        goto finish;
+    if (cacheKey && !prelinkedKernel) {
+        prelinkedKernel = readLinkedSliceCache(toolArgs, archInfo, cacheKey);
+        if (prelinkedKernel) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogProgressLevel | kOSKextLogArchiveFlag,
+                "Reusing cached linked prelinked kernel for arch %s.",
+                archInfo->name);
+        }
+    }
+    if (prelinkedKernel && prelinkedSymbolsOut) {
+        *prelinkedSymbolsOut = CFDictionaryCreate(kCFAllocatorDefault,
+            NULL, NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+            &kCFTypeDictionaryValueCallBacks);
+        if (!*prelinkedSymbolsOut) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+    }
+
+    if (!prelinkedKernel) {
+        result = linkPrelinkedKernelSlice(kernelImage, prelinkKexts,
+            toolArgs->volumeRootURL, flags, &toolArgs->stageStats,
+            &prelinkedKernel, prelinkedSymbolsOut);
+        if (result != EX_OK) {
+            goto finish;
+        }
+        if (cacheKey) {
+            writeLinkedSliceCache(toolArgs, archInfo, cacheKey,
+                prelinkedKernel);
+        }
     }
 
+    *prelinkedKernelOut = CFRetain(prelinkedKernel);
+    *kernelSupportsKASLROut = kernelSupportsKASLR;
+    *sliceFinishedOut = sliceFinished;
     result = EX_OK;
 
 finish:
     SAFE_RELEASE(kernelImage);
     SAFE_RELEASE(prelinkKexts);
     SAFE_RELEASE(prelinkedKernel);
+    SAFE_RELEASE(cacheKey);
+    SAFE_RELEASE(sliceKey);
+
+    return result;
+}
+
+/*******************************************************************************
+ * Feeds a CFString's UTF-8 bytes (and a terminator, so adjacent strings can't
+ * run together) into a digest.
+ *******************************************************************************/
+static void
+updateDigestWithCFString(CC_SHA256_CTX * context, CFStringRef aString)
+{
+    char buffer[PATH_MAX];
+
+    if (!aString ||
+        !CFStringGetCString(aString, buffer, sizeof(buffer),
+            kCFStringEncodingUTF8)) {
+        buffer[0] = '\0';
+    }
+    CC_SHA256_Update(context, buffer, (CC_LONG)strlen(buffer) + 1);
+}
+
+/*******************************************************************************
+ * Computes the key under which a linked slice is cached: the arch, the
+ * kernelcache flags, the volume root, the kernel's UUID, and for each kext
+ * (in link order) its path, version, executable UUID, and Info.plist mod
+ * time.  Any change to these yields a new key and so a relink.
+ *******************************************************************************/
+static CFStringRef
+copyLinkedSliceCacheKey(
+    KextcacheArgs     * toolArgs,
+    CFDataRef           kernelImage,
+    CFArrayRef          prelinkKexts,
+    const NXArchInfo  * archInfo,
+    uint32_t            flags)
+{
+    CFStringRef     result          = NULL;
+    CC_SHA256_CTX   context;
+    unsigned char   digest[CC_SHA256_DIGEST_LENGTH];
+    char            digestString[(2 * CC_SHA256_DIGEST_LENGTH) + 1];
+    char            infoPlistPath[PATH_MAX];
+    uuid_t          kernelUUID;
+    CFStringRef     volRootPath     = NULL;  // must release
+    CFStringRef     kextPath        = NULL;  // must release
+    CFDataRef       kextUUID        = NULL;  // must release
+    OSKextRef       aKext           = NULL;  // do not release
+    struct stat     statBuf;
+    CFIndex         count, i;
+
+    CC_SHA256_Init(&context);
+    CC_SHA256_Update(&context, archInfo->name,
+        (CC_LONG)strlen(archInfo->name) + 1);
+    CC_SHA256_Update(&context, &flags, sizeof(flags));
+
+    if (toolArgs->volumeRootURL) {
+        volRootPath = CFURLCopyFileSystemPath(toolArgs->volumeRootURL,
+            kCFURLPOSIXPathStyle);
+    }
+    updateDigestWithCFString(&context, volRootPath);
+
+   /* Fall back to the whole image for a kernel without an LC_UUID.
+    */
+    if (getMachOUUID(CFDataGetBytePtr(kernelImage),
+            (size_t)CFDataGetLength(kernelImage), kernelUUID)) {
+        CC_SHA256_Update(&context, kernelUUID, sizeof(kernelUUID));
+    } else {
+        CC_SHA256_Update(&context, CFDataGetBytePtr(kernelImage),
+            (CC_LONG)CFDataGetLength(kernelImage));
+    }
+
+    count = CFArrayGetCount(prelinkKexts);
+    for (i = 0; i < count; i++) {
+        aKext = (OSKextRef)CFArrayGetValueAtIndex(prelinkKexts, i);
+
+        SAFE_RELEASE_NULL(kextPath);
+        SAFE_RELEASE_NULL(kextUUID);
+
+        kextPath = copyKextPath(aKext);
+        if (!kextPath) {
+            goto finish;
+        }
+        updateDigestWithCFString(&context, kextPath);
+        updateDigestWithCFString(&context,
+            OSKextGetValueForInfoDictionaryKey(aKext, kCFBundleVersionKey));
+
+        kextUUID = OSKextCopyUUIDForArchitecture(aKext, archInfo);
+        if (kextUUID) {
+            CC_SHA256_Update(&context, CFDataGetBytePtr(kextUUID),
+                (CC_LONG)CFDataGetLength(kextUUID));
+        }
+        CC_SHA256_Update(&context, "", 1);
+
+        if (!CFStringGetFileSystemRepresentation(kextPath, infoPlistPath,
+                sizeof(infoPlistPath)) ||
+            strlcat(infoPlistPath, "/Contents/Info.plist",
+                sizeof(infoPlistPath)) >= sizeof(infoPlistPath)) {
+            goto finish;
+        }
+        bzero(&statBuf, sizeof(statBuf));
+        (void)stat(infoPlistPath, &statBuf);
+        CC_SHA256_Update(&context, &statBuf.st_mtimespec,
+            sizeof(statBuf.st_mtimespec));
+        CC_SHA256_Update(&context, &statBuf.st_size, sizeof(statBuf.st_size));
+    }
+
+    CC_SHA256_Final(digest, &context);
+    for (i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        snprintf(&digestString[2 * i], 3, "%02x", digest[i]);
+    }
+
+    result = CFStringCreateWithCString(kCFAllocatorDefault, digestString,
+        kCFStringEncodingUTF8);
+
+finish:
+    SAFE_RELEASE(volRootPath);
+    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(kextUUID);
 
     return result;
 }
 
+/*******************************************************************************
+ * Builds the path of the cache file for an arch and key; with a NULL key,
+ * returns the cache folder itself.
+ *******************************************************************************/
+static Boolean
+getLinkedSliceCachePath(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey,
+    char              * pathBuf,
+    size_t              pathBufSize)
+{
+    Boolean     result  = false;
+    char        keyBuf[(2 * CC_SHA256_DIGEST_LENGTH) + 1];
+
+    pathBuf[0] = '\0';
+    if (toolArgs->volumeRootURL &&
+        !CFURLGetFileSystemRepresentation(toolArgs->volumeRootURL,
+            /* resolveToBase */ true, (UInt8 *)pathBuf, pathBufSize)) {
+        goto finish;
+    }
+    if (strlcat(pathBuf, kLinkedSliceCacheFolder, pathBufSize) >= pathBufSize) {
+        goto finish;
+    }
+    if (cacheKey) {
+        if (!CFStringGetCString(cacheKey, keyBuf, sizeof(keyBuf),
+                kCFStringEncodingUTF8)) {
+            goto finish;
+        }
+        if (strlcat(pathBuf, "/", pathBufSize) >= pathBufSize ||
+            strlcat(pathBuf, archInfo->name, pathBufSize) >= pathBufSize ||
+            strlcat(pathBuf, "-", pathBufSize) >= pathBufSize ||
+            strlcat(pathBuf, keyBuf, pathBufSize) >= pathBufSize) {
+            goto finish;
+        }
+    }
+    result = true;
+
+finish:
+    if (!result) {
+        OSKextLogStringError(/* kext */ NULL);
+    }
+    return result;
+}
+
+/*******************************************************************************
+ *******************************************************************************/
+static CFDataRef
+readLinkedSliceCache(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey)
+{
+    char cachePath[PATH_MAX];
+
+    if (!getLinkedSliceCachePath(toolArgs, archInfo, cacheKey,
+            cachePath, sizeof(cachePath))) {
+        return NULL;
+    }
+
+   /* A missing file is just a cache miss.  checkArch also rejects anything
+    * that isn't a thin Mach-O of the right arch.
+    */
+    if (access(cachePath, R_OK) != 0) {
+        return NULL;
+    }
+    return mapMachOSliceForArch(cachePath, archInfo, /* checkArch */ TRUE);
+}
+
+/*******************************************************************************
+ * Saves a freshly linked slice under its key, then drops any older entries
+ * for the same arch and, if the folder is over kLinkedSliceCacheMaxSize, the
+ * oldest entries for other archs.  Failures here only cost us the next
+ * rebuild, so they are logged and otherwise ignored.
+ *******************************************************************************/
+typedef struct {
+    char            name[NAME_MAX + 1];
+    off_t           size;
+    time_t          modTime;
+} LinkedSliceCacheEntry;
+
+static int
+compareLinkedSliceCacheEntries(const void * a, const void * b)
+{
+    const LinkedSliceCacheEntry * entryA = (const LinkedSliceCacheEntry *)a;
+    const LinkedSliceCacheEntry * entryB = (const LinkedSliceCacheEntry *)b;
+
+    if (entryA->modTime < entryB->modTime)  return -1;
+    if (entryA->modTime > entryB->modTime)  return 1;
+    return 0;
+}
+
+static void
+writeLinkedSliceCache(
+    KextcacheArgs     * toolArgs,
+    const NXArchInfo  * archInfo,
+    CFStringRef         cacheKey,
+    CFDataRef           linkedSlice)
+{
+    char            cacheDir[PATH_MAX];
+    char            cachePath[PATH_MAX];
+    char            tmpPath[PATH_MAX];
+    char            entryPath[PATH_MAX];
+    char            archPrefix[64];
+    const char    * cacheName   = NULL;  // points into cachePath
+    DIR           * dirp        = NULL;  // must closedir
+    struct dirent * dp          = NULL;  // do not free
+    LinkedSliceCacheEntry others[kMaxArchs];
+    int             numOthers   = 0;
+    long long       totalSize   = CFDataGetLength(linkedSlice);
+    struct stat     statBuf;
+    int             fd          = -1;    // must close
+    Boolean         wroteCache  = false;
+    int             i;
+
+    if (totalSize > kLinkedSliceCacheMaxSize) {
+        goto finish;
+    }
+    if (!getLinkedSliceCachePath(toolArgs, archInfo, NULL,
+            cacheDir, sizeof(cacheDir)) ||
+        !getLinkedSliceCachePath(toolArgs, archInfo, cacheKey,
+            cachePath, sizeof(cachePath))) {
+        goto finish;
+    }
+    cacheName = cachePath + strlen(cacheDir) + 1;
+
+    if (mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s.", cacheDir, strerror(errno));
+        goto finish;
+    }
+
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s/.%s.XXXXXX",
+            cacheDir, cacheName) >= (int)sizeof(tmpPath)) {
+        OSKextLogStringError(/* kext */ NULL);
+        goto finish;
+    }
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s.", tmpPath, strerror(errno));
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(linkedSlice),
+            CFDataGetLength(linkedSlice)) != EX_OK) {
+        goto finish;
+    }
+    if (rename(tmpPath, cachePath) != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't rename %s - %s.", tmpPath, strerror(errno));
+        goto finish;
+    }
+    wroteCache = true;
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
+        "Saved linked prelinked kernel for arch %s to %s.",
+        archInfo->name, cachePath);
+
+   /* Now that the new entry is in place, drop this arch's older ones and
+    * note the others' sizes.  Entry names never contain a '.'; anything
+    * that does is the manifest or another run's temporary file.
+    */
+    snprintf(archPrefix, sizeof(archPrefix), "%s-", archInfo->name);
+    dirp = opendir(cacheDir);
+    while (dirp && (dp = readdir(dirp)) != NULL) {
+        if (strchr(dp->d_name, '.') ||
+            0 == strcmp(dp->d_name, cacheName)) {
+            continue;
+        }
+        if (snprintf(entryPath, sizeof(entryPath), "%s/%s",
+                cacheDir, dp->d_name) >= (int)sizeof(entryPath)) {
+            continue;
+        }
+        if (strncmp(dp->d_name, archPrefix, strlen(archPrefix)) == 0) {
+            (void)unlink(entryPath);
+            continue;
+        }
+        if (numOthers < kMaxArchs && lstat(entryPath, &statBuf) == 0 &&
+            S_ISREG(statBuf.st_mode)) {
+            strlcpy(others[numOthers].name, dp->d_name,
+                sizeof(others[numOthers].name));
+            others[numOthers].size = statBuf.st_size;
+            others[numOthers].modTime = statBuf.st_mtimespec.tv_sec;
+            totalSize += statBuf.st_size;
+            numOthers++;
+        }
+    }
+
+    qsort(others, numOthers, sizeof(others[0]),
+        compareLinkedSliceCacheEntries);
+    for (i = 0; i < numOthers && totalSize > kLinkedSliceCacheMaxSize; i++) {
+        if (snprintf(entryPath, sizeof(entryPath), "%s/%s",
+                cacheDir, others[i].name) >= (int)sizeof(entryPath)) {
+            continue;
+        }
+        if (unlink(entryPath) == 0) {
+            totalSize -= others[i].size;
+        }
+    }
+
+finish:
+    if (fd >= 0) close(fd);
+    if (fd >= 0 && !wroteCache) unlink(tmpPath);
+    if (dirp) closedir(dirp);
+    return;
+}
+
+/*******************************************************************************
+ * Picks the codec for one slice under -compression.  auto only considers lzvn
+ * when the target volume's booter reads it, and then measures both codecs
+ * on the slice itself; with no slice to measure it falls back to the volume's
+ * preference.
+ *******************************************************************************/
+static uint32_t compressionTypeForSlice(
+    KextcacheArgs       * toolArgs,
+    CFDataRef             prelinkedKernel,
+    Boolean               hasRelocs)
+{
+    uint32_t            result      = COMP_TYPE_LZSS;
+    PrelinkCodecCost    lzssCost;
+    PrelinkCodecCost    lzvnCost;
+
+    switch (toolArgs->compressionPolicy) {
+    case kCompressionPolicyLZSS:
+        result = COMP_TYPE_LZSS;
+        break;
+    case kCompressionPolicyFastLib:
+        result = COMP_TYPE_FASTLIB;
+        break;
+    case kCompressionPolicyVolume:
+    case kCompressionPolicyAuto:
+        if (wantsFastLibCompressionForTargetVolume(toolArgs->volumeRootURL)) {
+            result = COMP_TYPE_FASTLIB;
+        }
+        if (toolArgs->compressionPolicy == kCompressionPolicyVolume ||
+            result != COMP_TYPE_FASTLIB || !prelinkedKernel) {
+            break;
+        }
+        if (measurePrelinkCodec(prelinkedKernel, COMP_TYPE_LZSS,
+                hasRelocs, /* runs */ 1, &lzssCost) != EX_OK ||
+            measurePrelinkCodec(prelinkedKernel, COMP_TYPE_FASTLIB,
+                hasRelocs, /* runs */ 1, &lzvnCost) != EX_OK) {
+            break;  // keep the volume's preference
+        }
+        if (prelinkCodecBootUsecs(&lzssCost) < prelinkCodecBootUsecs(&lzvnCost)) {
+            result = COMP_TYPE_LZSS;
+        }
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogArchiveFlag,
+            "Estimated boot cost lzss %llu us, lzvn %llu us; using %s.",
+            prelinkCodecBootUsecs(&lzssCost), prelinkCodecBootUsecs(&lzvnCost),
+            prelinkCodecName(result));
+        break;
+    }
+
+    return result;
+}
+
+/*******************************************************************************
+ * Turns a linked prelinked kernel into its final slice, compressing it if
+ * requested.  This doesn't touch OSKext state and is safe to run on several
+ * slices at once.
+ *******************************************************************************/
+ExitStatus finishPrelinkedKernelForArch(
+    KextcacheArgs       * toolArgs,
+    CFDataRef             prelinkedKernel,
+    Boolean               kernelSupportsKASLR,
+    CFDataRef           * prelinkedKernelOut)
+{
+    uint32_t compressionType = COMP_TYPE_LZSS;
+
+    if (toolArgs->compress) {
+        compressionType = compressionTypeForSlice(toolArgs, prelinkedKernel,
+            kernelSupportsKASLR);
+    }
+
+    return compressPrelinkedKernelSlice(prelinkedKernel, toolArgs->compress,
+        compressionType, toolArgs->chunkedCompression, kernelSupportsKASLR,
+        &toolArgs->stageStats, prelinkedKernelOut);
+}
+
 /*****************************************************************************
  *****************************************************************************/
 ExitStatus
@@ -3184,115 +4763,6 @@ finish:
     return result;
 }
 
-/*********************************************************************
- *********************************************************************/
-ExitStatus
-compressPrelinkedKernel(
-                        CFURLRef            volumeRootURL,
-                        const char        * prelinkPath,
-                        Boolean             compress)
-{
-    ExitStatus          result          = EX_SOFTWARE;
-    struct timeval      prelinkedKernelTimes[2];
-    CFMutableArrayRef   prelinkedSlices = NULL; // must release
-    CFMutableArrayRef   prelinkedArchs  = NULL; // must release
-    CFDataRef           prelinkedSlice  = NULL; // must release
-   const NXArchInfo  * archInfo         = NULL; // do not free
-    const u_char      * sliceBytes      = NULL; // do not free
-    mode_t              fileMode        = 0;
-    int                 i               = 0;
-    
-    result = readMachOSlices(prelinkPath, &prelinkedSlices, 
-        &prelinkedArchs, &fileMode, prelinkedKernelTimes);
-    if (result != EX_OK) {
-        goto finish;
-    }
-    
-    /* Compress/uncompress each slice of the prelinked kernel.
-     */
-
-    for (i = 0; i < CFArrayGetCount(prelinkedSlices); ++i) {
-
-        SAFE_RELEASE_NULL(prelinkedSlice);
-        prelinkedSlice = CFArrayGetValueAtIndex(prelinkedSlices, i);
-
-        if (compress) {
-            const PrelinkedKernelHeader *header = (const PrelinkedKernelHeader *) 
-                CFDataGetBytePtr(prelinkedSlice);
-            Boolean     wantsFastLib = wantsFastLibCompressionForTargetVolume(volumeRootURL);
-            uint32_t    compressionType = wantsFastLib ? COMP_TYPE_FASTLIB : COMP_TYPE_LZSS;
-            
-            
-            prelinkedSlice = compressPrelinkedSlice(compressionType,
-                                                    prelinkedSlice,
-                                                    (OSSwapHostToBigInt32(header->prelinkVersion) == 1));
-            if (!prelinkedSlice) {
-                result = EX_DATAERR;
-                goto finish;
-            }
-        } else {
-            prelinkedSlice = uncompressPrelinkedSlice(prelinkedSlice);
-            if (!prelinkedSlice) {
-                result = EX_DATAERR;
-                goto finish;
-            }
-        }
-
-        CFArraySetValueAtIndex(prelinkedSlices, i, prelinkedSlice);
-    }
-    SAFE_RELEASE_NULL(prelinkedSlice);
-
-    /* Snow Leopard prelinked kernels are not wrapped in a fat header, so we
-     * have to decompress the prelinked kernel and look at the mach header
-     * to get the architecture information.
-     */
-
-    if (!prelinkedArchs && CFArrayGetCount(prelinkedSlices) == 1) {
-        if (!createCFMutableArray(&prelinkedArchs, NULL)) {
-            OSKextLogMemError();
-            result = EX_OSERR;
-            goto finish;
-        }
-
-        sliceBytes = CFDataGetBytePtr(
-            CFArrayGetValueAtIndex(prelinkedSlices, 0));
-
-        archInfo = getThinHeaderPageArch(sliceBytes);
-        if (archInfo) {
-            CFArrayAppendValue(prelinkedArchs, archInfo);
-        } else {
-            SAFE_RELEASE_NULL(prelinkedArchs);
-        }
-    }
-
-    /* If we still don't have architecture information, then something
-     * definitely went wrong.
-     */
-
-    if (!prelinkedArchs) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-            "Couldn't determine prelinked kernel's architecture");
-        result = EX_SOFTWARE;
-        goto finish;
-    }
-
-    result = writeFatFile(prelinkPath, prelinkedSlices, 
-        prelinkedArchs, fileMode, prelinkedKernelTimes);
-    if (result != EX_OK) {
-        goto finish;
-    }
-
-    result = EX_OK;
-
-finish:
-    SAFE_RELEASE(prelinkedSlices);
-    SAFE_RELEASE(prelinkedArchs);
-    SAFE_RELEASE(prelinkedSlice);
-    
-    return result;
-}
-
 #pragma mark Boot!=Root
 
 
@@ -3344,6 +4814,11 @@ void usage(UsageLevel usageLevel)
             kOptNameInstaller);
     fprintf(stderr, "-%s skips updating any helper partitions even if they appear out of date\n",
             kOptNameCachesOnly);
+    fprintf(stderr, "-%s <item>[,<item>...]: with -%s, update only the named items\n"
+        "        (%s, %s, %s, %s)\n",
+        kOptNameRebuildOnly, kOptNameUpdate,
+        kBRUItemNameKernelCache, kBRUItemNameCSFDE,
+        kBRUItemNameLocCache, kBRUItemNameHelpers);
 #endif /* !NO_BOOT_ROOT */
 #if 0
 // don't print this system-use option
@@ -3393,6 +4868,18 @@ void usage(UsageLevel usageLevel)
         kOptNameArch);
     fprintf(stderr, "-%c: run at low priority\n",
         kOptLowPriorityFork);
+    fprintf(stderr, "-%s <count> (-%c):\n"
+        "        build up to <count> prelinked kernel slices at once (0 = one per CPU)\n",
+        kOptNameJobs, kOptJobs);
+    fprintf(stderr, "-%s <filename>:\n"
+        "        write per-stage time, byte, and kext counts as an XML plist\n",
+        kOptNameStatsFile);
+    fprintf(stderr, "-%s volume|lzss|lzvn|auto:\n"
+        "        choose the prelinked kernel's codec (default: volume)\n",
+        kOptNameCompression);
+    fprintf(stderr, "-%s <filename> -%s:\n"
+        "        measure each codec on an existing prelinked kernel\n",
+        kOptNamePrelinkedKernel, kOptNameCompressionBenchmark);
     fprintf(stderr, "\n");
 
     fprintf(stderr, "-%s (-%c): quiet mode: print no informational or error messages\n",
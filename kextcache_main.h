@@ -41,6 +41,17 @@ enum {
     kKextcacheExitNoStart
 };
 
+/* How the prelinked kernel's codec is chosen (-compression).
+ */
+typedef enum {
+    kCompressionPolicyVolume = 0,   // target volume's bootcaches.plist
+    kCompressionPolicyLZSS,
+    kCompressionPolicyFastLib,
+    kCompressionPolicyAuto          // least measured boot cost the booter reads
+} CompressionPolicy;
+
+#define kCompressionBenchmarkRuns  (3)
+
 #pragma mark Command-line Option Definitions
 /*******************************************************************************
 * Command-line options. This data is used by getopt_long_only().
@@ -93,6 +104,7 @@ enum {
 #define kOptNameInstaller               "Installer"
 #define kOptNameCachesOnly              "caches-only"
 #define kOptNameEarlyBoot               "Boot"
+#define kOptNameRebuildOnly             "rebuild-only"
 
 /* Misc flags.
  */
@@ -100,6 +112,12 @@ enum {
 #define kOptNameTests                   "print-diagnostics"
 #define kOptNameCompressed              "compressed"
 #define kOptNameUncompressed            "uncompressed"
+#define kOptNameJobs                    "jobs"
+#define kOptNameChunkedCompression      "chunked-compression"
+#define kOptNameLZSSLevel               "lzss-level"
+#define kOptNameStatsFile               "stats-file"
+#define kOptNameCompression             "compression"
+#define kOptNameCompressionBenchmark    "compression-benchmark"
 
 #define kOptArch                  'a'
 // 'b' in kext_tools_util.h
@@ -113,6 +131,7 @@ enum {
 #define kOptLowPriorityFork       'F'
 // 'h' in kext_tools_util.h
 #define kOptInvalidate            'i'
+#define kOptJobs                  'j'
 #define kOptRepositoryCaches      'k'
 #define kOptKernel                'K'
 #define kOptLocalRoot             'l'
@@ -153,11 +172,17 @@ enum {
 #define kLongOptInstaller                (-14)
 #define kLongOptCachesOnly               (-15)
 #define kLongOptEarlyBoot                (-16)
+#define kLongOptChunkedCompression       (-17)
+#define kLongOptLZSSLevel                (-18)
+#define kLongOptRebuildOnly              (-19)
+#define kLongOptStatsFile                (-20)
+#define kLongOptCompression              (-21)
+#define kLongOptCompressionBenchmark     (-22)
 
 #if !NO_BOOT_ROOT
-#define kOptChars                ":a:b:c:efFhi:kK:lLm:nNqrsStu:U:vz"
+#define kOptChars                ":a:b:c:efFhi:j:kK:lLm:nNqrsStu:U:vz"
 #else
-#define kOptChars                ":a:b:c:eFhkK:lLm:nNqrsStvz"
+#define kOptChars                ":a:b:c:eFhj:kK:lLm:nNqrsStvz"
 #endif /* !NO_BOOT_ROOT */
 /* Some options are now obsolete:
  *     -F (fork)
@@ -174,8 +199,13 @@ struct option sOptInfo[] = {
     { kOptNameVerbose,               optional_argument,  NULL,     kOptVerbose },
     { kOptNameCompressed,            no_argument,        &longopt, kLongOptCompressed },
     { kOptNameUncompressed,          no_argument,        &longopt, kLongOptUncompressed },
+    { kOptNameChunkedCompression,    no_argument,        &longopt, kLongOptChunkedCompression },
+    { kOptNameLZSSLevel,             required_argument,  &longopt, kLongOptLZSSLevel },
+    { kOptNameCompression,           required_argument,  &longopt, kLongOptCompression },
+    { kOptNameCompressionBenchmark,  no_argument,        &longopt, kLongOptCompressionBenchmark },
 
     { kOptNameArch,                  required_argument,  NULL,     kOptArch },
+    { kOptNameJobs,                  required_argument,  NULL,     kOptJobs },
 
     { kOptNameMkext1,                required_argument,  &longopt, kLongOptMkext1 },
     { kOptNameMkext2,                required_argument,  &longopt, kLongOptMkext2 },
@@ -199,6 +229,7 @@ struct option sOptInfo[] = {
     { kOptNameKernel,                required_argument,  NULL,     kOptKernel },
     { kOptNameAllLoaded,             no_argument,        NULL,     kOptAllLoaded },
     { kOptNameSymbols,               required_argument,  &longopt, kLongOptSymbols },
+    { kOptNameStatsFile,             required_argument,  &longopt, kLongOptStatsFile },
 
     { kOptNameAllPersonalities,      no_argument,        &longopt, kLongOptAllPersonalities },
     { kOptNameNoLinkFailures,        no_argument,        &longopt, kLongOptNoLinkFailures },
@@ -211,6 +242,7 @@ struct option sOptInfo[] = {
     { kOptNameInstaller,             no_argument,        &longopt, kLongOptInstaller },
     { kOptNameCachesOnly,            no_argument,        &longopt, kLongOptCachesOnly },
     { kOptNameEarlyBoot,             no_argument,        &longopt, kLongOptEarlyBoot },
+    { kOptNameRebuildOnly,           required_argument,  &longopt, kLongOptRebuildOnly },
 #endif /* !NO_BOOT_ROOT */
 
     { kOptNameNoAuthentication,      no_argument,        NULL,     kOptNoAuthentication },
@@ -267,6 +299,12 @@ typedef struct {
     CFMutableArrayRef  namedKextURLs;
     CFMutableArrayRef  targetArchs;
     Boolean            explicitArch;  // user-provided instead of inferred host arches
+    u_int              requestedJobs; // -j as given
+    u_int              maxJobs;       // max concurrent slice builds; -F may lower it
+
+    CFDictionaryRef         existingSlices;     // arch name -> slice of the current prelinked kernel
+    CFDictionaryRef         existingSliceKeys;  // arch name -> key that slice was built from
+    CFMutableDictionaryRef  sliceKeys;          // arch name -> key of each slice being written
 
     CFArrayRef         allKexts;         // directories + named
     CFArrayRef         repositoryKexts;  // all from directories (may include named)
@@ -277,6 +315,12 @@ typedef struct {
     struct timeval     extensionsDirTimes[2];   // access and mod times of extensions directory with most recent change
     Boolean     compress;
     Boolean     uncompress;
+    Boolean     chunkedCompression;  // -chunked-compression; implies compress
+    Boolean     compressionBenchmark;  // -compression-benchmark; with -c file
+    CompressionPolicy  compressionPolicy;  // -compression
+
+    PrelinkStageStats  stageStats;      // time, bytes, and kexts per prelink stage
+    char             * statsPath;       // -stats-file; where to write stageStats
 } KextcacheArgs;
 
 #pragma mark Function Prototypes
@@ -302,10 +346,16 @@ ExitStatus readPrelinkedKernelArgs(
 ExitStatus setPrelinkedKernelArgs(
     KextcacheArgs * toolArgs,
     char          * filename);
+#if !NO_BOOT_ROOT
+ExitStatus readRebuildOnlyArgs(
+    KextcacheArgs * toolArgs,
+    const char    * itemList);
+#endif /* !NO_BOOT_ROOT */
 Boolean setDefaultKernel(KextcacheArgs * toolArgs);
 Boolean setDefaultPrelinkedKernel(KextcacheArgs * toolArgs);
 void setSystemExtensionsFolders(KextcacheArgs * toolArgs);
 ExitStatus doUpdateVolume(KextcacheArgs *toolArgs);
+ExitStatus createCaches(KextcacheArgs * toolArgs);
 
 void checkKextdSpawnedFilter(Boolean kernelFlag);
 ExitStatus checkArgs(KextcacheArgs * toolArgs);
@@ -314,7 +364,8 @@ ExitStatus getLoadedKextInfo(KextcacheArgs *toolArgs);
 ExitStatus updateSystemPlistCaches(KextcacheArgs * toolArgs);
 ExitStatus updateDirectoryCaches(
     KextcacheArgs * toolArgs,
-    CFURLRef folderURL);
+    CFURLRef folderURL,
+    CFArrayRef allKexts);
 ExitStatus createMkext(
     KextcacheArgs * toolArgs,
     Boolean       * fatalOut);
@@ -344,9 +395,6 @@ ExitStatus getFilePathModTimePlusOne(
 Boolean kextMatchesLoadedKextInfo(
     KextcacheArgs     * toolArgs,
     OSKextRef           theKext);
-ExitStatus createPrelinkedKernelArchs(
-    KextcacheArgs     * toolArgs,
-    CFMutableArrayRef * prelinkArchsOut);
 ExitStatus createExistingPrelinkedSlices(
     KextcacheArgs     * toolArgs,
     CFMutableArrayRef * prelinkedSlicesOut,
@@ -361,14 +409,22 @@ ExitStatus createPrelinkedKernelForArch(
     CFDataRef           * prelinkedKernelOut,
     CFDictionaryRef     * prelinkedSymbolsOut,
     const NXArchInfo    * archInfo);
+ExitStatus linkPrelinkedKernelForArch(
+    KextcacheArgs       * toolArgs,
+    CFDataRef           * prelinkedKernelOut,
+    CFDictionaryRef     * prelinkedSymbolsOut,
+    Boolean             * kernelSupportsKASLROut,
+    Boolean             * sliceFinishedOut,
+    const NXArchInfo    * archInfo);
+ExitStatus finishPrelinkedKernelForArch(
+    KextcacheArgs       * toolArgs,
+    CFDataRef             prelinkedKernel,
+    Boolean               kernelSupportsKASLR,
+    CFDataRef           * prelinkedKernelOut);
 ExitStatus getExpectedPrelinkedKernelModTime(
     KextcacheArgs  * toolArgs,
     struct timeval   cacheFileTimes[2],
     Boolean        * updateModTimeOut);
-ExitStatus compressPrelinkedKernel(
-    CFURLRef            volumeRootURL,  
-    const char        * prelinkedKernelPath,
-    Boolean             compress);
 
 void usage(UsageLevel usageLevel);
 
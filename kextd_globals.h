@@ -43,6 +43,7 @@ extern uid_t                  gClientUID;  // set & cleared by kextd_demux()
 
 // serialize_kextload.c
 extern dispatch_source_t      _gKextutilLock;
+extern CFMutableSetRef        _gKextutilLockScope;  // NULL: locks all loads
 extern Boolean                gKernelRequestsPending;
 
 #endif /* _KEXTD_GLOBALS_H */
@@ -52,6 +52,9 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #include <paths.h>
+#include <dirent.h>
+#include <malloc/malloc.h>
+#include <dispatch/dispatch.h>
 
 #include <IOKit/kext/OSKext.h>
 #include <IOKit/kext/OSKextPrivate.h>
@@ -79,10 +82,13 @@ const char * progname = "(unknown)";  // don't free
 
 /*******************************************************************************
 *******************************************************************************/
+static int longopt = 0;
+
 struct option sOptInfo[] = {
     { kOptNameHelp,             no_argument,       NULL, kOptHelp },
     { kOptNameNoCaches,         no_argument,       NULL, kOptNoCaches },
     { kOptNameDebug,            no_argument,       NULL, kOptDebug },
+    { kOptNameKextRetention,    required_argument, &longopt, kLongOptKextRetention },
 
     { kOptNameQuiet,            required_argument, NULL, kOptQuiet },
     { kOptNameVerbose,          optional_argument, NULL, kOptVerbose },
@@ -97,11 +103,15 @@ KextdArgs                 sToolArgs;
 CFArrayRef                gRepositoryURLs         = NULL;
 static CFArrayRef         sAllKexts               = NULL;
 
+// bundle path -> kexts read from that bundle (itself and its plugins),
+// and bundle path -> stamp of the bundle when they were read
+static CFMutableDictionaryRef sKextsByBundlePath    = NULL;
+static CFMutableDictionaryRef sBundleStamps         = NULL;
+
 Boolean                   gKernelRequestsPending            = false;
 
 // all the following are released in setUpServer()
 static CFRunLoopTimerRef  sReleaseKextsTimer                = NULL;
-static CFRunLoopSourceRef sClientRequestRunLoopSource       = NULL;
 static CFMachPortRef      sKextdSignalMachPort              = NULL;
 static mach_port_t        sKextSignalMachPortMachPort       = MACH_PORT_NULL;
 static CFRunLoopSourceRef sSignalRunLoopSource              = NULL;
@@ -110,9 +120,23 @@ const NXArchInfo        * gKernelArchInfo                   = NULL;  // do not f
 
 ExitStatus                sKextdExitStatus                  = kKextdExitOK;
 
+// startup phases (see logStartupPhase()) and the non-critical rest of setup
+static CFAbsoluteTime       sStartupPhaseTime               = 0;
+static CFRunLoopObserverRef sDeferredSetUpObserver          = NULL;
+static unsigned int         sSourcePriority                 = 1;
+
+// memory pressure notifications; see handleMemoryPressure()
+static dispatch_source_t    sMemoryPressureSource           = NULL;
+
 /*******************************************************************************
  * Static routines.
  ******************************************************************************/
+static void logStartupPhase(const char * phase);
+static void handleMemoryPressure(unsigned long pressure);
+static void deferredSetUpCallback(
+                                  CFRunLoopObserverRef observer,
+                                  CFRunLoopActivity activity,
+                                  void *info );
 static void NoLoadSigFailureKextCallback(
                                          CFNotificationCenterRef center,
                                          void *observer,
@@ -159,6 +183,8 @@ int main(int argc, char * const * argv)
 {
     char       logSpecBuffer[16];  // enough for a 64-bit hex value
 
+    sStartupPhaseTime = CFAbsoluteTimeGetCurrent();
+
    /*****
     * Find out what my name is.
     */
@@ -224,12 +250,15 @@ int main(int argc, char * const * argv)
     OSKextSetUsesCaches(sToolArgs.useRepositoryCaches);
 
     OSKextSetRecordsDiagnostics(kOSKextDiagnosticsFlagNone);
+    logStartupPhase("initialization");
     readExtensions();
+    logStartupPhase("reading extensions");
 
     sKextdExitStatus = setUpServer(&sToolArgs);
     if (sKextdExitStatus != EX_OK) {
         goto finish;
     }
+    logStartupPhase("setting up kernel request service");
 
    /* Tell the IOCatalogue that we are ready to service load requests.
     */
@@ -252,12 +281,9 @@ int main(int argc, char * const * argv)
     CFArrayRef propertyValues;
     if (readSystemKextPropertyValues(CFSTR("PGO"), gKernelArchInfo,
                                      /* forceUpdate? */ FALSE, &propertyValues)) {
-        if (pgo_scan_kexts(propertyValues))
-        {
-            /* give the pgo threads time to get into grab_pgo_data before the kernel
-             * starts unloading things. */
-            sleep(1);
-        }
+        /* pgo_scan_kexts() returns once its threads are about to wait in
+         * grab_pgo_data, before the kernel starts unloading things. */
+        pgo_scan_kexts(propertyValues);
         CFRelease(propertyValues);
     }
     
@@ -271,11 +297,14 @@ int main(int argc, char * const * argv)
     * bumped the busy count).
     */
     sendFinishedToKernel();
+    logStartupPhase("sending personalities");
 
-    // Start run loop
+    // Start run loop (deferredSetUpCallback() finishes setup once idle)
     CFRunLoopRun();
 
-    // Runloop is done - for restart performance exit asap
+    // Runloop is done - for restart performance exit asap,
+    // but don't drop PGO data already taken from the kernel
+    pgo_wait_for_writes();
     _exit(sKextdExitStatus);
 
 finish:
@@ -325,6 +354,7 @@ readArgs(
     bzero(toolArgs, sizeof(*toolArgs));
     toolArgs->debugMode           = false;
     toolArgs->useRepositoryCaches = true;
+    toolArgs->kextRetention       = kDefaultKextRetention;
 
     if (stat(kAppleSetupDonePath, &stat_buf) == -1 && errno == ENOENT) {
         toolArgs->firstBoot = true;
@@ -375,6 +405,32 @@ readArgs(
                 toolArgs->useRepositoryCaches = false;  // -x implies -c
                 break;
 
+            case 0:
+                switch (longopt) {
+                    case kLongOptKextRetention:
+                    {
+                        char          * endptr = NULL;
+                        unsigned long   seconds;
+
+                        errno = 0;
+                        seconds = strtoul(optarg, &endptr, 10);
+                        if (errno || !*optarg || *endptr || seconds > UINT32_MAX) {
+                            OSKextLog(/* kext */ NULL,
+                                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                                "Invalid value for -%s: %s.",
+                                kOptNameKextRetention, optarg);
+                            goto finish;
+                        }
+                        toolArgs->kextRetention = (uint32_t)seconds;
+                        break;
+                    }
+
+                    default:
+                        break;
+                }
+                longopt = 0;
+                break;
+
             default:
                /* getopt_long_only() prints an error message for us. */
                 goto finish;
@@ -473,12 +529,10 @@ void sendFinishedToKernel(void)
 /*******************************************************************************
 * setUpServer()
 *******************************************************************************/
-ExitStatus setUpServer(KextdArgs * toolArgs)
+ExitStatus setUpServer(KextdArgs * toolArgs __unused)
 {
     ExitStatus             result         = EX_OSERR;
     kern_return_t          kernelResult   = KERN_SUCCESS;
-    unsigned int           sourcePriority = 1;
-    CFMachPortRef          kextdMachPort  = NULL;  // must release
     mach_port_limits_t     limits;  // queue limit for signal-handler port
     mach_port_t            servicePort;
 
@@ -511,25 +565,17 @@ ExitStatus setUpServer(KextdArgs * toolArgs)
     * Note: CFRunLoop.h, however, says 'order' should generally be 0 for all.
     */
 
-    kextdMachPort = CFMachPortCreateWithPort(kCFAllocatorDefault,
-        servicePort, kextd_mach_port_callback, /* CFMachPortContext */ NULL,
-        /* shouldFreeInfo? */ NULL);
-    sClientRequestRunLoopSource = CFMachPortCreateRunLoopSource(
-        kCFAllocatorDefault, kextdMachPort, sourcePriority++);
-    if (!sClientRequestRunLoopSource) {
+   /* Client and kernel requests are received on a queue of their own, so
+    * that path lookups are answered while the main thread is busy; the
+    * rest are handed to the main thread (see kextd_mig_server.c).
+    */
+    if (!kextd_start_mig_server(servicePort)) {
        OSKextLog(/* kext */ NULL,
            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
-           "Failed to create client request run loop source.");
+           "Failed to create client request source.");
         goto finish;
     }
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), sClientRequestRunLoopSource,
-        kCFRunLoopDefaultMode);
 
-    // 5519500: kextd_watch_volumes now holds off on updates on its own
-    if (kextd_watch_volumes(sourcePriority++)) {
-        goto finish;
-    }
-    
     sKextdSignalMachPort = CFMachPortCreate(kCFAllocatorDefault,
         handleSignalInRunloop, NULL, NULL);
     if (!sKextdSignalMachPort) {
@@ -550,7 +596,7 @@ ExitStatus setUpServer(KextdArgs * toolArgs)
             "Failed to set signal-handling port limits.");
     }
     sSignalRunLoopSource = CFMachPortCreateRunLoopSource(
-        kCFAllocatorDefault, sKextdSignalMachPort, sourcePriority++);
+        kCFAllocatorDefault, sKextdSignalMachPort, sSourcePriority++);
     if (!sSignalRunLoopSource) {
         OSKextLog(/* kext */ NULL, kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "Failed to create signal-handling run loop source.");
@@ -559,6 +605,47 @@ ExitStatus setUpServer(KextdArgs * toolArgs)
     CFRunLoopAddSource(CFRunLoopGetCurrent(), sSignalRunLoopSource,
         kCFRunLoopDefaultMode);
 
+    signal(SIGHUP,  handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGCHLD, handleSignal);
+
+   /* Nothing else is needed to answer the kernel during boot, so the volume
+    * watchers, notifications, and console-user monitoring wait until the
+    * run loop first runs out of work.
+    */
+    sDeferredSetUpObserver = CFRunLoopObserverCreate(kCFAllocatorDefault,
+        kCFRunLoopBeforeWaiting, /* repeats */ false, /* order */ 0,
+        deferredSetUpCallback, /* context */ NULL);
+    if (!sDeferredSetUpObserver) {
+        OSKextLog(/* kext */ NULL, kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Failed to create deferred setup run loop observer.");
+        goto finish;
+    }
+    CFRunLoopAddObserver(CFRunLoopGetCurrent(), sDeferredSetUpObserver,
+        kCFRunLoopDefaultMode);
+
+    result = EX_OK;
+
+finish:
+    SAFE_RELEASE(sKextdSignalMachPort);
+    SAFE_RELEASE(sSignalRunLoopSource);
+
+    return result;
+}
+
+/*******************************************************************************
+* setUpDeferredServer() starts everything setUpServer() leaves for later.
+*******************************************************************************/
+ExitStatus setUpDeferredServer(KextdArgs * toolArgs)
+{
+    ExitStatus             result         = EX_OSERR;
+    kern_return_t          kernelResult   = KERN_SUCCESS;
+
+    // 5519500: kextd_watch_volumes now holds off on updates on its own
+    if (kextd_watch_volumes(sSourcePriority++)) {
+        goto finish;
+    }
+
    /* Watch for RAID changes so we can forcibly update their boot partitions.
     */
     CFNotificationCenterAddObserver(CFNotificationCenterGetLocalCenter(),
@@ -656,27 +743,145 @@ ExitStatus setUpServer(KextdArgs * toolArgs)
                                     CFNotificationSuspensionBehaviorDeliverImmediately);
 
 #ifndef NO_CFUserNotification
-    result = startMonitoringConsoleUser(toolArgs, &sourcePriority);
+    result = startMonitoringConsoleUser(toolArgs, &sSourcePriority);
     if (result != EX_OK) {
         goto finish;
     }
 #endif /* ifndef NO_CFUserNotification */
 
-    signal(SIGHUP,  handleSignal);
-    signal(SIGTERM, handleSignal);
-    signal(SIGCHLD, handleSignal);
+   /* Give back what we can rebuild when the system runs short of memory.
+    * The handler runs on the main queue along with the run loop, so it
+    * never races a request that is using the kexts.
+    */
+    sMemoryPressureSource = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, /* handle */ 0,
+        DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+        dispatch_get_main_queue());
+    if (sMemoryPressureSource) {
+        dispatch_source_set_event_handler(sMemoryPressureSource, ^{
+            handleMemoryPressure(
+                dispatch_source_get_data(sMemoryPressureSource));
+        });
+        dispatch_resume(sMemoryPressureSource);
+    } else {
+        OSKextLog(/* kext */ NULL, kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+            "Failed to register for memory pressure notifications.");
+    }
 
     result = EX_OK;
 
 finish:
-    SAFE_RELEASE(sClientRequestRunLoopSource);
-    SAFE_RELEASE(sKextdSignalMachPort);
-    SAFE_RELEASE(sSignalRunLoopSource);
-    SAFE_RELEASE(kextdMachPort);
-
     return result;
 }
 
+/*******************************************************************************
+* deferredSetUpCallback() runs once, the first time the run loop goes idle.
+*******************************************************************************/
+static void deferredSetUpCallback(
+    CFRunLoopObserverRef observer __unused,
+    CFRunLoopActivity    activity __unused,
+    void               * info __unused)
+{
+    // non-repeating observers invalidate themselves
+    SAFE_RELEASE_NULL(sDeferredSetUpObserver);
+
+    if (setUpDeferredServer(&sToolArgs) != EX_OK) {
+        sKextdExitStatus = EX_OSERR;
+        CFRunLoopStop(CFRunLoopGetCurrent());
+        return;
+    }
+    logStartupPhase("starting volume watchers & notifications");
+}
+
+/*******************************************************************************
+* logStartupPhase() logs how long the phase that just finished took.
+*******************************************************************************/
+static void logStartupPhase(const char * phase)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+        "Startup: %s took %.3f s.", phase, now - sStartupPhaseTime);
+    sStartupPhaseTime = now;
+}
+
+#pragma mark Memory Pressure
+/*******************************************************************************
+* currentResidentSize() returns kextd's resident size in bytes, or 0.
+*******************************************************************************/
+static uint64_t currentResidentSize(void)
+{
+    struct mach_task_basic_info  info;
+    mach_msg_type_number_t       count = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+        (task_info_t)&info, &count) != KERN_SUCCESS) {
+
+        return 0;
+    }
+    return info.resident_size;
+}
+
+/*******************************************************************************
+* Returns the bytes given back since *residentSize was measured and updates it.
+*******************************************************************************/
+static uint64_t releasedSince(uint64_t * residentSize)
+{
+    uint64_t before = *residentSize;
+
+    malloc_zone_pressure_relief(/* all zones */ NULL, /* goal */ 0);
+    *residentSize = currentResidentSize();
+    return (before > *residentSize) ? before - *residentSize : 0;
+}
+
+/*******************************************************************************
+* handleMemoryPressure() drops state kextd can rebuild, cheapest to rebuild
+* first: the kexts themselves (rescanned on the next request), the property
+* value arrays (reread from their caches), and on critical pressure the kext
+* index too (reread from disk).  Volume watches and pending alerts can't be
+* rebuilt and are kept.
+*******************************************************************************/
+static void handleMemoryPressure(unsigned long pressure)
+{
+    Boolean   critical       = (pressure & DISPATCH_MEMORYPRESSURE_CRITICAL) != 0;
+    uint64_t  startSize      = currentResidentSize();
+    uint64_t  residentSize   = startSize;
+    uint64_t  kextsBytes     = 0;
+    uint64_t  propertyBytes  = 0;
+    uint64_t  indexBytes     = 0;
+
+    if (!pressure) {
+        goto finish;
+    }
+
+    if (sReleaseKextsTimer) {
+        CFRunLoopTimerInvalidate(sReleaseKextsTimer);
+        SAFE_RELEASE_NULL(sReleaseKextsTimer);
+    }
+    releaseExtensions(/* timer */ NULL, /* context */ NULL);
+    kextsBytes = releasedSince(&residentSize);
+
+    flushSystemKextPropertyValues();
+    propertyBytes = releasedSince(&residentSize);
+
+    if (critical) {
+        kextdFlushKextIndex();
+        indexBytes = releasedSince(&residentSize);
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogBasicLevel | kOSKextLogGeneralFlag,
+        "Memory pressure %s: resident size %llu KB -> %llu KB "
+        "(kexts %llu KB, property values %llu KB, kext index %llu KB).",
+        critical ? "critical" : "warning",
+        startSize / 1024, residentSize / 1024,
+        kextsBytes / 1024, propertyBytes / 1024, indexBytes / 1024);
+
+finish:
+    return;
+}
+
 #include "security.h"
 
 /******************************************************************************
@@ -690,11 +895,9 @@ void NoLoadSigFailureKextCallback(CFNotificationCenterRef center,
                                   CFDictionaryRef userInfo)
 {
    if (userInfo) {
-        /* synchronize access to our plist file */
+        /* the plist is updated on the alert queue */
         CFRetain(userInfo);
-        dispatch_async(dispatch_get_main_queue(), ^ {
-            writeKextAlertPlist(userInfo, NO_LOAD_KEXT_ALERT);
-        });
+        queueKextAlertPlist(userInfo, NO_LOAD_KEXT_ALERT);
     }
    
     return;
@@ -733,11 +936,9 @@ void UnsignedKextCallback(CFNotificationCenterRef center,
                           CFDictionaryRef userInfo)
 {
     if (userInfo) {
-        /* synchronize access to our plist file */
+        /* the plist is updated on the alert queue */
         CFRetain(userInfo);
-        dispatch_async(dispatch_get_main_queue(), ^ {
-            writeKextAlertPlist(userInfo, UNSIGNED_KEXT_ALERT);
-        });
+        queueKextAlertPlist(userInfo, UNSIGNED_KEXT_ALERT);
     }
     
     return;
@@ -755,11 +956,9 @@ void InvalidSignedKextCallback(CFNotificationCenterRef center,
                                CFDictionaryRef userInfo)
 {
     if (userInfo) {
-        /* synchronize access to our plist file */
+        /* the plist is updated on the alert queue */
         CFRetain(userInfo);
-        dispatch_async(dispatch_get_main_queue(), ^ {
-            writeKextAlertPlist(userInfo, INVALID_SIGNATURE_KEXT_ALERT);
-        });
+        queueKextAlertPlist(userInfo, INVALID_SIGNATURE_KEXT_ALERT);
     }
     
     return;
@@ -776,11 +975,9 @@ void ExcludedKextCallback(CFNotificationCenterRef center,
                           CFDictionaryRef userInfo)
 {
   if (userInfo) {
-        /* synchronize access to our plist file */
+        /* the plist is updated on the alert queue */
         CFRetain(userInfo);
-        dispatch_async(dispatch_get_main_queue(), ^ {
-            writeKextAlertPlist(userInfo, EXCLUDED_KEXT_ALERT);
-        });
+        queueKextAlertPlist(userInfo, EXCLUDED_KEXT_ALERT);
     }
     
     return;
@@ -801,11 +998,9 @@ void LoadedKextCallback(CFNotificationCenterRef center,
         myValue = CFDictionaryGetValue(userInfo, CFSTR("KextArrayKey"));
        
        if (myValue && CFGetTypeID(myValue) == CFArrayGetTypeID()) {
-           /* synchronize access to our plist file */
+           /* the plist is updated on the alert queue */
            CFRetain(myValue);
-           dispatch_async(dispatch_get_main_queue(), ^ {
-               writeKextLoadPlist(myValue);
-           });
+           queueKextLoadPlist(myValue);
        }
     }
     
@@ -921,6 +1116,7 @@ void handleSignalInRunloop(
                 OSKextLog(/* kext */ NULL, logSpec,
                     "async child pid %d exited with status %d",
                     child_pid, WEXITSTATUS(child_status));
+                kextd_rebuild_exited(child_pid);
             }
         } while (child_pid > 0);
         
@@ -929,6 +1125,473 @@ void handleSignalInRunloop(
     return;
 }
 
+/*******************************************************************************
+ * Kexts stay resident between requests.  When the extensions folders change,
+ * each top-level bundle is compared by path against a stamp taken when it was
+ * read (inode and mod time of the bundle, its Contents, Info.plist, MacOS and
+ * PlugIns folders), and only bundles that were added or whose stamp changed
+ * are read again; those that disappeared are dropped.  How long the kexts
+ * are kept after the last request is set by -kext-retention.
+ *******************************************************************************/
+
+/*******************************************************************************
+ * Appends "inode:mtime;" for path to stamp, or "-;" if it doesn't exist.
+ *******************************************************************************/
+static void
+appendPathStamp(CFMutableStringRef stamp, const char * path)
+{
+    struct stat statBuf;
+
+    if (stat(path, &statBuf) != 0) {
+        CFStringAppendCString(stamp, "-;", kCFStringEncodingUTF8);
+        return;
+    }
+    CFStringAppendFormat(stamp, /* formatOptions */ NULL,
+        CFSTR("%llu:%ld.%09ld;"),
+        (unsigned long long)statBuf.st_ino,
+        (long)statBuf.st_mtimespec.tv_sec,
+        (long)statBuf.st_mtimespec.tv_nsec);
+}
+
+/*******************************************************************************
+ *******************************************************************************/
+CFStringRef
+copyBundleStamp(const char * bundlePath)
+{
+    CFMutableStringRef  stamp       = NULL;  // returned
+    char                path[PATH_MAX];
+    const char        * subPaths[]  = {
+        "Contents",
+        "Contents/Info.plist",
+        "Contents/MacOS",
+        "Contents/PlugIns",
+        "Info.plist",
+        NULL
+    };
+
+    stamp = CFStringCreateMutable(kCFAllocatorDefault, 0);
+    if (!stamp) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    appendPathStamp(stamp, bundlePath);
+    for (int i = 0; subPaths[i]; i++) {
+        snprintf(path, sizeof(path), "%s/%s", bundlePath, subPaths[i]);
+        appendPathStamp(stamp, path);
+    }
+
+finish:
+    return stamp;
+}
+
+/*******************************************************************************
+ * Stamps the extensions folders themselves; changes when a bundle is added,
+ * removed, or replaced in any of them.
+ *******************************************************************************/
+CFStringRef
+copyRepositoryStamp(void)
+{
+    CFMutableStringRef  stamp   = NULL;  // returned
+    CFIndex             count, i;
+    char                path[PATH_MAX];
+
+    stamp = CFStringCreateMutable(kCFAllocatorDefault, 0);
+    if (!stamp) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    count = gRepositoryURLs ? CFArrayGetCount(gRepositoryURLs) : 0;
+    for (i = 0; i < count; i++) {
+        if (!CFURLGetFileSystemRepresentation(
+                CFArrayGetValueAtIndex(gRepositoryURLs, i),
+                /* resolveToBase */ true, (UInt8 *)path, sizeof(path))) {
+            CFStringAppendCString(stamp, "?;", kCFStringEncodingUTF8);
+            continue;
+        }
+        appendPathStamp(stamp, path);
+    }
+
+finish:
+    return stamp;
+}
+
+/*******************************************************************************
+ * Returns the top-level bundle path under repositoryPath that holds aKext,
+ * so plugins are grouped with the bundle that contains them.
+ *******************************************************************************/
+static CFStringRef
+copyTopLevelBundlePath(OSKextRef aKext, CFStringRef repositoryPath)
+{
+    CFStringRef     result      = NULL;  // returned
+    CFURLRef        kextURL     = NULL;  // must release
+    CFStringRef     kextPath    = NULL;  // must release
+    CFIndex         prefixLen   = CFStringGetLength(repositoryPath) + 1;
+    CFRange         slashRange;
+
+    kextURL = CFURLCopyAbsoluteURL(OSKextGetURL(aKext));
+    if (!kextURL) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    kextPath = CFURLCopyFileSystemPath(kextURL, kCFURLPOSIXPathStyle);
+    if (!kextPath || CFStringGetLength(kextPath) <= prefixLen ||
+        !CFStringHasPrefix(kextPath, repositoryPath)) {
+        goto finish;
+    }
+    if (CFStringFindWithOptions(kextPath, CFSTR("/"),
+            CFRangeMake(prefixLen, CFStringGetLength(kextPath) - prefixLen),
+            /* options */ 0, &slashRange)) {
+        result = CFStringCreateWithSubstring(kCFAllocatorDefault, kextPath,
+            CFRangeMake(0, slashRange.location));
+    } else {
+        result = CFRetain(kextPath);
+    }
+
+finish:
+    SAFE_RELEASE(kextURL);
+    SAFE_RELEASE(kextPath);
+    return result;
+}
+
+/*******************************************************************************
+ * Files the kexts in kexts under their top-level bundle path.
+ *******************************************************************************/
+static void
+addKextsByBundlePath(
+    CFArrayRef              kexts,
+    CFStringRef             repositoryPath,
+    CFMutableDictionaryRef  kextsByBundlePath,
+    CFMutableDictionaryRef  bundleStamps)
+{
+    CFIndex count = CFArrayGetCount(kexts);
+
+    for (CFIndex i = 0; i < count; i++) {
+        OSKextRef           aKext       = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+        CFStringRef         bundlePath  = NULL;  // must release
+        CFMutableArrayRef   bundleKexts = NULL;  // do not release
+        CFStringRef         stamp       = NULL;  // must release
+        char                bundlePathCString[PATH_MAX];
+
+        bundlePath = copyTopLevelBundlePath(aKext, repositoryPath);
+        if (!bundlePath) {
+            continue;
+        }
+        bundleKexts = (CFMutableArrayRef)CFDictionaryGetValue(kextsByBundlePath,
+            bundlePath);
+        if (!bundleKexts) {
+            if (!createCFMutableArray(&bundleKexts, &kCFTypeArrayCallBacks)) {
+                OSKextLogMemError();
+                SAFE_RELEASE(bundlePath);
+                continue;
+            }
+            CFDictionarySetValue(kextsByBundlePath, bundlePath, bundleKexts);
+            CFRelease(bundleKexts);  // dictionary holds it
+
+            if (CFStringGetFileSystemRepresentation(bundlePath,
+                    bundlePathCString, sizeof(bundlePathCString))) {
+                stamp = copyBundleStamp(bundlePathCString);
+            }
+            if (stamp) {
+                CFDictionarySetValue(bundleStamps, bundlePath, stamp);
+            }
+        }
+        CFArrayAppendValue(bundleKexts, aKext);
+        SAFE_RELEASE(stamp);
+        SAFE_RELEASE(bundlePath);
+    }
+}
+
+/*******************************************************************************
+ * CFDictionaryApplyFunction callback over the old bundle set; flushes the
+ * kexts of bundles that are no longer present.
+ *******************************************************************************/
+typedef struct {
+    CFDictionaryRef     newKextsByPath;
+    int                 numRemoved;
+} RemovedBundleContext;
+
+static void
+flushRemovedBundle(const void * key, const void * value, void * context)
+{
+    RemovedBundleContext  * removedContext = (RemovedBundleContext *)context;
+    CFArrayRef              bundleKexts    = (CFArrayRef)value;
+    CFIndex                 count, i;
+
+    if (CFDictionaryContainsKey(removedContext->newKextsByPath, key)) {
+        return;
+    }
+    count = CFArrayGetCount(bundleKexts);
+    for (i = 0; i < count; i++) {
+        OSKextFlushInfoDictionary(
+            (OSKextRef)CFArrayGetValueAtIndex(bundleKexts, i));
+    }
+    removedContext->numRemoved++;
+}
+
+/*******************************************************************************
+ * Drops the kexts in oldKexts from sAllKexts.
+ *******************************************************************************/
+static void
+removeFromAllKexts(CFArrayRef oldKexts)
+{
+    CFMutableArrayRef   remaining   = NULL;  // must release
+    CFIndex             count, i;
+
+    if (!sAllKexts) {
+        goto finish;
+    }
+    remaining = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, sAllKexts);
+    if (!remaining) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    count = CFArrayGetCount(oldKexts);
+    for (i = 0; i < count; i++) {
+        CFIndex index = CFArrayGetFirstIndexOfValue(remaining,
+            RANGE_ALL(remaining), CFArrayGetValueAtIndex(oldKexts, i));
+
+        if (index != kCFNotFound) {
+            CFArrayRemoveValueAtIndex(remaining, index);
+        }
+    }
+    SAFE_RELEASE(sAllKexts);
+    sAllKexts = CFRetain(remaining);
+
+finish:
+    SAFE_RELEASE(remaining);
+    return;
+}
+
+/*******************************************************************************
+ * Brings the resident kexts up to date with the extensions folders.
+ *******************************************************************************/
+static void
+updateExtensions(void)
+{
+    CFMutableDictionaryRef  newKextsByPath  = NULL;  // must release
+    CFMutableDictionaryRef  newStamps       = NULL;  // must release
+    CFMutableArrayRef       allKexts        = NULL;  // must release
+    CFMutableArrayRef       bundlePaths     = NULL;  // must release
+    CFArrayRef              kexts           = NULL;  // must release
+    CFURLRef                bundleURL       = NULL;  // must release
+    CFStringRef             repositoryPath  = NULL;  // must release
+    CFStringRef             bundlePath      = NULL;  // must release
+    CFStringRef             stamp           = NULL;  // must release
+    DIR                   * dirp            = NULL;  // must closedir()
+    CFIndex                 numRepositories, count, i;
+    int                     numChanged      = 0;
+    int                     numRemoved      = 0;
+    Boolean                 firstRead       = (sKextsByBundlePath == NULL);
+
+    if (!gRepositoryURLs) {
+        goto finish;
+    }
+
+    newKextsByPath = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    newStamps = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!newKextsByPath || !newStamps ||
+        !createCFMutableArray(&allKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&bundlePaths, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    numRepositories = CFArrayGetCount(gRepositoryURLs);
+    for (i = 0; i < numRepositories; i++) {
+        CFURLRef        repositoryURL   = CFArrayGetValueAtIndex(gRepositoryURLs, i);
+        CFURLRef        absURL          = CFURLCopyAbsoluteURL(repositoryURL);
+        char            repositoryPathCString[PATH_MAX];
+        struct dirent * dirEntry;
+
+        SAFE_RELEASE_NULL(repositoryPath);
+        if (absURL) {
+            repositoryPath = CFURLCopyFileSystemPath(absURL, kCFURLPOSIXPathStyle);
+            CFRelease(absURL);
+        }
+        if (!repositoryPath ||
+            !CFStringGetFileSystemRepresentation(repositoryPath,
+                repositoryPathCString, sizeof(repositoryPathCString))) {
+            continue;
+        }
+
+       /* The first time through, read each folder as a whole so the
+        * repository caches can be used, then just file the results.
+        */
+        if (firstRead) {
+            kexts = OSKextCreateKextsFromURL(kCFAllocatorDefault, repositoryURL);
+            if (kexts) {
+                addKextsByBundlePath(kexts, repositoryPath, newKextsByPath,
+                    newStamps);
+                SAFE_RELEASE_NULL(kexts);
+            }
+            continue;
+        }
+
+        dirp = opendir(repositoryPathCString);
+        if (!dirp) {
+            continue;
+        }
+        CFArrayRemoveAllValues(bundlePaths);
+        while ((dirEntry = readdir(dirp))) {
+            char * extension = getPathExtension(dirEntry->d_name);
+            Boolean isKext = extension && !strcmp(extension, "kext");
+
+            SAFE_FREE(extension);
+            if (!isKext) {
+                continue;
+            }
+            bundlePath = CFStringCreateWithFormat(kCFAllocatorDefault,
+                /* formatOptions */ NULL, CFSTR("%@/%s"),
+                repositoryPath, dirEntry->d_name);
+            if (!bundlePath) {
+                OSKextLogMemError();
+                goto finish;
+            }
+            CFArrayAppendValue(bundlePaths, bundlePath);
+            SAFE_RELEASE_NULL(bundlePath);
+        }
+        closedir(dirp);
+        dirp = NULL;
+
+        CFArraySortValues(bundlePaths, RANGE_ALL(bundlePaths),
+            (CFComparatorFunction)CFStringCompare, /* context */ NULL);
+
+        count = CFArrayGetCount(bundlePaths);
+        for (CFIndex j = 0; j < count; j++) {
+            CFStringRef     thePath     = CFArrayGetValueAtIndex(bundlePaths, j);
+            CFStringRef     oldStamp    = NULL;  // do not release
+            CFArrayRef      oldKexts    = NULL;  // do not release
+            char            pathCString[PATH_MAX];
+
+            if (CFDictionaryContainsKey(newKextsByPath, thePath) ||
+                !CFStringGetFileSystemRepresentation(thePath,
+                    pathCString, sizeof(pathCString))) {
+                continue;
+            }
+
+            stamp = copyBundleStamp(pathCString);
+            oldStamp = CFDictionaryGetValue(sBundleStamps, thePath);
+            oldKexts = CFDictionaryGetValue(sKextsByBundlePath, thePath);
+            if (stamp && oldStamp && oldKexts && CFEqual(stamp, oldStamp)) {
+                CFDictionarySetValue(newKextsByPath, thePath, oldKexts);
+                CFDictionarySetValue(newStamps, thePath, stamp);
+                SAFE_RELEASE_NULL(stamp);
+                continue;
+            }
+            SAFE_RELEASE_NULL(stamp);
+
+           /* New or changed.  OSKext uniques kexts by URL, so reading the
+            * bundle again while we hold the old kexts would just hand them
+            * back.  Flush them in case something else still holds them,
+            * then drop every reference we have before reading it again.
+            */
+            if (oldKexts) {
+                CFIndex numOld = CFArrayGetCount(oldKexts);
+                for (CFIndex k = 0; k < numOld; k++) {
+                    OSKextRef oldKext = (OSKextRef)CFArrayGetValueAtIndex(
+                        oldKexts, k);
+
+                    OSKextFlushInfoDictionary(oldKext);
+                    OSKextFlushLoadInfo(oldKext, /* flushDependencies */ true);
+                }
+                removeFromAllKexts(oldKexts);
+                CFDictionaryRemoveValue(sKextsByBundlePath, thePath);
+            }
+            numChanged++;
+
+            bundleURL = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault,
+                (const UInt8 *)pathCString, strlen(pathCString), /* isDir */ true);
+            if (!bundleURL) {
+                OSKextLogMemError();
+                goto finish;
+            }
+            kexts = OSKextCreateKextsFromURL(kCFAllocatorDefault, bundleURL);
+            if (kexts) {
+                addKextsByBundlePath(kexts, repositoryPath, newKextsByPath,
+                    newStamps);
+            }
+            SAFE_RELEASE_NULL(kexts);
+            SAFE_RELEASE_NULL(bundleURL);
+        }
+    }
+
+   /* Whatever is left of the old set and wasn't carried over is gone. */
+    if (sKextsByBundlePath) {
+        RemovedBundleContext removedContext = { newKextsByPath, 0 };
+
+        CFDictionaryApplyFunction(sKextsByBundlePath,
+            &flushRemovedBundle, &removedContext);
+        numRemoved = removedContext.numRemoved;
+    }
+
+   /* Dependencies may now resolve differently. */
+    if (numChanged || numRemoved) {
+        OSKextFlushLoadInfo(NULL /* all kexts */, /* flushDependencies */ true);
+    }
+
+   /* Rebuild the flat list in a stable order. */
+    SAFE_RELEASE_NULL(bundlePaths);
+    count = CFDictionaryGetCount(newKextsByPath);
+    if (count) {
+        const void ** keys = malloc(count * sizeof(*keys));
+
+        if (!keys) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFDictionaryGetKeysAndValues(newKextsByPath, keys, NULL);
+        bundlePaths = CFArrayCreateMutable(kCFAllocatorDefault, count,
+            &kCFTypeArrayCallBacks);
+        if (bundlePaths) {
+            for (i = 0; i < count; i++) {
+                CFArrayAppendValue(bundlePaths, keys[i]);
+            }
+            CFArraySortValues(bundlePaths, RANGE_ALL(bundlePaths),
+                (CFComparatorFunction)CFStringCompare, /* context */ NULL);
+            for (i = 0; i < count; i++) {
+                CFArrayRef bundleKexts = CFDictionaryGetValue(newKextsByPath,
+                    CFArrayGetValueAtIndex(bundlePaths, i));
+                CFArrayAppendArray(allKexts, bundleKexts, RANGE_ALL(bundleKexts));
+            }
+        }
+        free(keys);
+        if (!bundlePaths) {
+            OSKextLogMemError();
+            goto finish;
+        }
+    }
+
+    if (!firstRead) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+            "Updated extensions: %d bundles read, %d removed.",
+            numChanged, numRemoved);
+    }
+
+    SAFE_RELEASE(sAllKexts);
+    SAFE_RELEASE(sKextsByBundlePath);
+    SAFE_RELEASE(sBundleStamps);
+    sAllKexts = CFRetain(allKexts);
+    sKextsByBundlePath = (CFMutableDictionaryRef)CFRetain(newKextsByPath);
+    sBundleStamps = (CFMutableDictionaryRef)CFRetain(newStamps);
+    kextdUpdateKextIndex(sAllKexts);
+
+finish:
+    if (dirp) closedir(dirp);
+    SAFE_RELEASE(newKextsByPath);
+    SAFE_RELEASE(newStamps);
+    SAFE_RELEASE(allKexts);
+    SAFE_RELEASE(bundlePaths);
+    SAFE_RELEASE(kexts);
+    SAFE_RELEASE(bundleURL);
+    SAFE_RELEASE(repositoryPath);
+    SAFE_RELEASE(bundlePath);
+    SAFE_RELEASE(stamp);
+    return;
+}
+
 /*******************************************************************************
  * This function reads the extensions if necessary.  Note support for multiple
  * extensions directories.
@@ -944,23 +1607,22 @@ void readExtensions(void)
     static struct timeval   lastAccessTime = {0,0};
     struct timeval          tempTimes[2];
     ExitStatus              result = EX_SOFTWARE;
+    Boolean                 needUpdate = false;
 
    /* If getLatestTimesFromCFURLArray fails for any of the extensions
-    * directories we will force reading in all the kexts.  Otherwise we only
-    * read in all the kexts if any of the extensions directories have been
-    * modified.  The first time we're called we will save off the latest mod
-    * time and reread (which is fine since we have not read in any kexts yet).
+    * directories we will check every bundle.  Otherwise we only do so if
+    * any of the extensions directories have been modified.  The first time
+    * we're called we will save off the latest mod time and read everything
+    * (which is fine since we have not read in any kexts yet).
     */
     result = getLatestTimesFromCFURLArray(gRepositoryURLs,
                                           tempTimes);
     if (result != EX_OK) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
-                  "Failed to stat extensions folders (%s); rereading.",
+                  "Failed to stat extensions folders (%s); rechecking.",
                   strerror(errno));
-
-        /* force reading all extensions */
-        releaseExtensions(/* timer */ NULL, /* context */ NULL);
+        needUpdate = true;
     }
     
     if (result == EX_OK && timercmp(&lastModTime, &tempTimes[1], !=)) {
@@ -968,16 +1630,14 @@ void readExtensions(void)
         lastAccessTime.tv_usec = tempTimes[0].tv_usec;
         lastModTime.tv_sec = tempTimes[1].tv_sec;
         lastModTime.tv_usec = tempTimes[1].tv_usec;
-
-        releaseExtensions(/* timer */ NULL, /* context */ NULL);
+        needUpdate = true;
     }
 
-    if (!sAllKexts && gRepositoryURLs) {
+    if ((needUpdate || !sAllKexts) && gRepositoryURLs) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
-            "Reading extensions.");
-        sAllKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-            gRepositoryURLs);
+            "%s extensions.", sAllKexts ? "Updating" : "Reading");
+        updateExtensions();
     }
     scheduleReleaseExtensions();
     return;
@@ -987,16 +1647,23 @@ void readExtensions(void)
 *******************************************************************************/
 void scheduleReleaseExtensions(void)
 {
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
-        "%scheduling release of all kexts.", sReleaseKextsTimer ? "Res" : "S");
-
     if (sReleaseKextsTimer) {
         CFRunLoopTimerInvalidate(sReleaseKextsTimer);
         SAFE_RELEASE_NULL(sReleaseKextsTimer);
     }
+
+   /* With no retention limit the kexts stay until the next rescan. */
+    if (!sToolArgs.kextRetention) {
+        goto finish;
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
+        "Scheduling release of all kexts in %u seconds.",
+        sToolArgs.kextRetention);
+
     sReleaseKextsTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
-        CFAbsoluteTimeGetCurrent() + kReleaseKextsDelay, /* interval */ 0,
+        CFAbsoluteTimeGetCurrent() + sToolArgs.kextRetention, /* interval */ 0,
         /* flags */ 0, /* order */ 0, &releaseExtensions, /* context */ NULL);
     if (!sReleaseKextsTimer) {
         OSKextLogMemError();
@@ -1023,6 +1690,8 @@ void releaseExtensions(
         SAFE_RELEASE_NULL(sReleaseKextsTimer);
     }
     SAFE_RELEASE_NULL(sAllKexts);
+    SAFE_RELEASE_NULL(sKextsByBundlePath);
+    SAFE_RELEASE_NULL(sBundleStamps);
 
     return;
 }
@@ -1082,6 +1751,10 @@ void usage(UsageLevel usageLevel)
     fprintf(stderr, "-%s (-%c):\n"
         "        run in debug mode (log to stderr)\n",
         kOptNameDebug, kOptDebug);
+    fprintf(stderr, "-%s <seconds>:\n"
+        "        release kexts this long after the last request\n"
+        "        (default %d; 0 = never)\n",
+        kOptNameKextRetention, kDefaultKextRetention);
     fprintf(stderr, "-%s (-%c):\n"
         "        run as if the system is in safe boot mode\n",
         kOptNameSafeBoot, kOptSafeBoot);
@@ -60,7 +60,11 @@ typedef struct {
 #define kKextcacheDelayStandard   (60)
 #define kKextcacheDelayFirstBoot  (60 * 5)
 
-#define kReleaseKextsDelay  (30)
+/* How long kexts stay resident after the last request that needed them,
+ * in seconds; 0 keeps them until the next rescan.  Set with
+ * -kext-retention.
+ */
+#define kDefaultKextRetention  (5 * 60)
 
 #pragma mark Command-line Option Definitions
 /*******************************************************************************
@@ -72,6 +76,7 @@ typedef struct {
 #define kOptNameNoCaches      "no-caches"
 #define kOptNameDebug         "debug"
 #define kOptNameNoJettison    "no-jettison"
+#define kOptNameKextRetention "kext-retention"
 
 #define kOptNoCaches          'c'
 #define kOptDebug             'd'
@@ -83,6 +88,7 @@ typedef struct {
 // Do not use -1, that's getopt() end-of-args return value
 // and can cause confusion
 #define kLongOptLongindexHack (-2)
+#define kLongOptKextRetention (-3)
 
 #pragma mark Tool Args Structure
 /*******************************************************************************
@@ -94,6 +100,8 @@ typedef struct {
     Boolean            safeBootMode;     // actual or simulated
 
     Boolean            firstBoot;
+
+    uint32_t           kextRetention;    // seconds; 0 means indefinitely
 } KextdArgs;
 
 extern CFArrayRef gRepositoryURLs;
@@ -109,6 +117,7 @@ Boolean    isNetboot(void);
 void       sendActiveToKernel(void);
 void       sendFinishedToKernel(void);
 ExitStatus setUpServer(KextdArgs * toolArgs);
+ExitStatus setUpDeferredServer(KextdArgs * toolArgs);
 
 bool isBootRootActive(void);
 
@@ -124,6 +133,9 @@ void scheduleReleaseExtensions(void);
 void releaseExtensions(CFRunLoopTimerRef timer, void * context);
 void rescanExtensions(void);
 
+CFStringRef copyBundleStamp(const char * bundlePath);
+CFStringRef copyRepositoryStamp(void);
+
 void usage(UsageLevel usageLevel);
 
 #endif /* _KEXTD_MAIN_H */
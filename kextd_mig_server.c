@@ -31,6 +31,7 @@
 #include <mach/mach_port.h>
 #include <servers/bootstrap.h>
 #include <sysexits.h>
+#include <dispatch/dispatch.h>
 
 #include <IOKit/kext/OSKext.h>
 #include "kext_tools_util.h"
@@ -48,6 +49,13 @@ extern boolean_t kextd_kernel_request_server(
 
 uid_t gClientUID = -1;
 
+/* Routine 0 of kextmanager_mig.defs is kextmanager_path_for_bundle_id.
+ */
+#define kKextManagerPathForBundleIDMsgID  (_kextmanager_subsystem.start + 0)
+
+static dispatch_queue_t   sClientRequestQueue   = NULL;
+static dispatch_source_t  sClientRequestSource  = NULL;
+
 /*******************************************************************************
 *******************************************************************************/
 boolean_t kextd_demux(
@@ -210,3 +218,94 @@ void kextd_mach_port_callback(
 
     CFAllocatorDeallocate(NULL, bufReply);
 }
+
+/*******************************************************************************
+* Requests on the kextd port are received on sClientRequestQueue.  Path
+* lookups only read the kext snapshot kextd publishes, so they are answered
+* right there and never wait behind a load; one the snapshot can't answer
+* (kKextdForwardToMainThread) is forwarded too.  Everything else may change or
+* read OSKext state, which is only safe on the main thread; those messages
+* are copied (with their trailer, for the caller's credentials) and handed to
+* kextd_mach_port_callback() on the main queue, which replies itself, and
+* dispatch_mig_server() is told there is no reply.
+*******************************************************************************/
+static void kextd_forwarded_request(void * context)
+{
+    mach_msg_header_t * request = (mach_msg_header_t *)context;
+
+    kextd_mach_port_callback(/* port */ NULL, request,
+        request->msgh_size, /* info */ NULL);
+    free(request);
+}
+
+static boolean_t kextd_forward_request(
+    mach_msg_header_t * request,
+    mach_msg_header_t * reply)
+{
+    mig_reply_error_t   * errorReply = (mig_reply_error_t *)reply;
+    mach_msg_trailer_t  * trailer;
+    mach_msg_header_t   * copy;
+    size_t                copySize;
+
+    trailer = (mach_msg_trailer_t *)((vm_offset_t)request +
+        round_msg(request->msgh_size));
+    copySize = round_msg(request->msgh_size) + trailer->msgh_trailer_size;
+    copy = malloc(copySize);
+    if (!copy) {
+        OSKextLogMemError();
+        return FALSE;  // dispatch_mig_server() destroys the request
+    }
+    memcpy(copy, request, copySize);
+    dispatch_async_f(dispatch_get_main_queue(), copy, kextd_forwarded_request);
+
+   /* The copy now owns the request's rights and reply port.
+    */
+    reply->msgh_bits = 0;
+    reply->msgh_remote_port = MACH_PORT_NULL;
+    errorReply->RetCode = MIG_NO_REPLY;
+    return TRUE;
+}
+
+static boolean_t kextd_queue_demux(
+    mach_msg_header_t * request,
+    mach_msg_header_t * reply)
+{
+    if (request->msgh_id == kKextManagerPathForBundleIDMsgID) {
+        if (!kextmanager_server(request, reply)) {
+            return FALSE;
+        }
+        if (((mig_reply_error_t *)reply)->RetCode != kKextdForwardToMainThread) {
+            return TRUE;
+        }
+    }
+    return kextd_forward_request(request, reply);
+}
+
+/*******************************************************************************
+*******************************************************************************/
+Boolean kextd_start_mig_server(mach_port_t servicePort)
+{
+    size_t maxSize = _kextmanager_subsystem.maxsize;
+
+    if (svc_kextd_kernel_request_subsystem.maxsize > maxSize) {
+        maxSize = svc_kextd_kernel_request_subsystem.maxsize;
+    }
+
+    sClientRequestQueue = dispatch_queue_create(
+        "com.apple.kextd.requests", DISPATCH_QUEUE_SERIAL);
+    if (!sClientRequestQueue) {
+        return false;
+    }
+    sClientRequestSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MACH_RECV,
+        servicePort, /* mask */ 0, sClientRequestQueue);
+    if (!sClientRequestSource) {
+        return false;
+    }
+    dispatch_source_set_event_handler(sClientRequestSource, ^{
+        (void)dispatch_mig_server(sClientRequestSource, maxSize,
+            kextd_queue_demux);
+    });
+    dispatch_resume(sClientRequestSource);
+
+    return true;
+}
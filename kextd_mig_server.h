@@ -30,3 +30,12 @@ void kextd_mach_port_callback(
     void         * msg,
     CFIndex        size,
     void         * info);
+Boolean kextd_start_mig_server(
+    mach_port_t    servicePort);
+
+/* A request handler called off the main thread returns this when it can't
+ * answer there; kextd_queue_demux() then forwards the request to the main
+ * queue, where the handler runs again and replies.
+ */
+#define kKextdForwardToMainThread   ((kern_return_t)0x6b657874)  // 'kext'
+
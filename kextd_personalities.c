@@ -29,6 +29,7 @@
 #include <IOKit/IOKitServer.h>
 #include <IOKit/kext/OSKextPrivate.h>
 #include <IOKit/IOCFSerialize.h>
+#include <IOKit/IOCFUnserialize.h>
 
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -41,6 +42,32 @@
 #include "kextd_globals.h"
 
 static OSReturn sendCachedPersonalitiesToKernel(Boolean resetFlag);
+static OSReturn sendPersonalityChangesToKernel(CFArrayRef kexts);
+static CFMutableSetRef createPersonalitySet(CFArrayRef personalities);
+
+/* What the IOCatalogue last got from us: the personalities, or the cache
+ * file data they were sent from, parsed only if a rescan needs to compare
+ * against it.  A rescan sends only the personalities added and removes
+ * only those gone since then, rather than resetting the catalogue and
+ * rematching every driver.  Anything else that removes personalities from
+ * the catalogue must call forgetSentPersonalities(), and a rescan does a
+ * full reset anyway once kPersonalitiesFullResetInterval has passed since
+ * the last one, in case the kernel dropped some on its own.
+ */
+#define kPersonalitiesFullResetInterval  (60 * 60)  // seconds
+
+static CFMutableSetRef sSentPersonalities     = NULL;
+static CFDataRef       sSentPersonalitiesData = NULL;
+static time_t          sLastFullPersonalitiesSend = 0;
+
+/*******************************************************************************
+*******************************************************************************/
+void forgetSentPersonalities(void)
+{
+    SAFE_RELEASE_NULL(sSentPersonalities);
+    SAFE_RELEASE_NULL(sSentPersonalitiesData);
+    return;
+}
 
 /*******************************************************************************
 *******************************************************************************/
@@ -53,6 +80,19 @@ OSReturn sendSystemKextPersonalitiesToKernel(
     CFMutableArrayRef authenticKexts = NULL; // must release
     CFIndex           count, i;
     
+   /* If we know what the kernel has, just send the differences.
+    * On failure fall back to a full send.
+    */
+    if (resetFlag && (sSentPersonalities || sSentPersonalitiesData) &&
+        time(NULL) - sLastFullPersonalitiesSend <
+        kPersonalitiesFullResetInterval) {
+
+        result = sendPersonalityChangesToKernel(kexts);
+        if (result == kOSReturnSuccess) {
+            goto finish;
+        }
+    }
+
    /* Note that we are going to finish on success here!
     * If we sent personalities we are done.
     * sendCachedPersonalitiesToKernel() logs a msg on failure.
@@ -91,6 +131,10 @@ OSReturn sendSystemKextPersonalitiesToKernel(
 
     personalities = OSKextCopyPersonalitiesOfKexts(authenticKexts);
 
+    forgetSentPersonalities();
+    sSentPersonalities = createPersonalitySet(personalities);
+    sLastFullPersonalitiesSend = time(NULL);
+
    /* Now try to write the cache file. Don't save the return value
     * of that function, we're more concerned with whether personalities
     * have actually gone to the kernel.
@@ -98,6 +142,7 @@ OSReturn sendSystemKextPersonalitiesToKernel(
     _OSKextWriteCache(OSKextGetSystemExtensionsFolderURLs(),
             CFSTR(kIOKitPersonalitiesKey), gKernelArchInfo,
             _kOSKextCacheFormatIOXML, personalities);
+    writeSerializedPersonalities(personalities, gKernelArchInfo);
 
 finish:
     if (result != kOSReturnSuccess) {
@@ -123,7 +168,12 @@ static OSReturn sendCachedPersonalitiesToKernel(Boolean resetFlag)
     OSReturn  result    = kOSReturnError;
     CFDataRef cacheData = NULL;  // must release
     
-    if (!_OSKextReadCache(gRepositoryURLs, CFSTR(kIOKitPersonalitiesKey),
+   /* The serialized cache is mapped and sent as is; the compressed one
+    * has to be read and inflated first.
+    */
+    cacheData = createSerializedPersonalitiesData(gKernelArchInfo);
+    if (!cacheData &&
+        !_OSKextReadCache(gRepositoryURLs, CFSTR(kIOKitPersonalitiesKey),
         gKernelArchInfo, _kOSKextCacheFormatIOXML,
         /* parseXML? */ false, (CFPropertyListRef *)&cacheData)) {
 
@@ -150,6 +200,10 @@ static OSReturn sendCachedPersonalitiesToKernel(Boolean resetFlag)
         kOSKextLogKextBookkeepingFlag,
         CFSTR("%@"), CFSTR("Sent cached kext personalities to the IOCatalogue."));
     
+    forgetSentPersonalities();
+    sSentPersonalitiesData = CFRetain(cacheData);
+    sLastFullPersonalitiesSend = time(NULL);
+
     result = kOSReturnSuccess;
 
 finish:
@@ -157,3 +211,250 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+* Personalities are compared with CFEqual(), which doesn't care about key
+* order.  CFHash() of a dictionary only looks at its count, though, so the
+* set hashes the values that usually tell personalities apart.
+*******************************************************************************/
+static CFHashCode hashPersonality(const void * value)
+{
+    CFDictionaryRef personality = (CFDictionaryRef)value;
+    CFStringRef     keys[] = {
+        kCFBundleIdentifierKey,
+        CFSTR(kIOClassKey),
+        CFSTR(kIOProviderClassKey),
+        CFSTR(kIONameMatchKey),
+        CFSTR(kIOPropertyMatchKey),
+    };
+    CFHashCode      result = CFDictionaryGetCount(personality);
+    size_t          i;
+
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        CFTypeRef keyValue = CFDictionaryGetValue(personality, keys[i]);
+
+        if (keyValue) {
+            result = result * 31 + CFHash(keyValue);
+        }
+    }
+    return result;
+}
+
+static CFMutableSetRef createPersonalitySet(CFArrayRef personalities)
+{
+    CFMutableSetRef result    = NULL;  // returned
+    CFSetCallBacks  callbacks = kCFTypeSetCallBacks;
+    CFIndex         count, i;
+
+    if (!personalities) {
+        goto finish;
+    }
+    callbacks.hash = &hashPersonality;
+    result = CFSetCreateMutable(kCFAllocatorDefault, 0, &callbacks);
+    if (!result) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    count = CFArrayGetCount(personalities);
+    for (i = 0; i < count; i++) {
+        CFTypeRef personality = CFArrayGetValueAtIndex(personalities, i);
+
+        if (CFGetTypeID(personality) == CFDictionaryGetTypeID()) {
+            CFSetAddValue(result, personality);
+        }
+    }
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static CFMutableSetRef createPersonalitySetFromCacheData(CFDataRef cacheData)
+{
+    CFMutableSetRef result          = NULL;  // returned
+    CFTypeRef       personalities   = NULL;  // must release
+    CFStringRef     errorString     = NULL;  // must release
+    char          * xmlBuffer       = NULL;  // must free
+    CFIndex         length          = CFDataGetLength(cacheData);
+
+   /* IOCFUnserialize() wants a C string.
+    */
+    xmlBuffer = malloc(length + 1);
+    if (!xmlBuffer) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    memcpy(xmlBuffer, CFDataGetBytePtr(cacheData), length);
+    xmlBuffer[length] = '\0';
+
+    personalities = IOCFUnserialize(xmlBuffer, kCFAllocatorDefault,
+        /* options */ 0, &errorString);
+    if (!personalities || CFGetTypeID(personalities) != CFArrayGetTypeID()) {
+        goto finish;
+    }
+    result = createPersonalitySet(personalities);
+
+finish:
+    SAFE_RELEASE(personalities);
+    SAFE_RELEASE(errorString);
+    SAFE_FREE(xmlBuffer);
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+typedef struct {
+    CFSetRef            otherSet;
+    CFMutableArrayRef   missing;
+} PersonalitySetDiffContext;
+
+static void collectMissingPersonality(const void * value, void * context)
+{
+    PersonalitySetDiffContext * diff = (PersonalitySetDiffContext *)context;
+
+    if (!CFSetContainsValue(diff->otherSet, value)) {
+        CFArrayAppendValue(diff->missing, value);
+    }
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static OSReturn sendPersonalityChangesToKernel(CFArrayRef kexts)
+{
+    OSReturn                    result          = kOSReturnError;
+    CFMutableArrayRef           authenticKexts  = NULL;  // must release
+    CFArrayRef                  personalities   = NULL;  // must release
+    CFMutableSetRef             newSet          = NULL;  // must release
+    CFMutableArrayRef           removed         = NULL;  // must release
+    CFMutableArrayRef           addedPersonalities = NULL;  // must release
+    CFDataRef                   addedData       = NULL;  // must release
+    PersonalitySetDiffContext   diff;
+    CFIndex                     count, i;
+
+    if (!sSentPersonalities) {
+        sSentPersonalities = createPersonalitySetFromCacheData(
+            sSentPersonalitiesData);
+        SAFE_RELEASE_NULL(sSentPersonalitiesData);
+        if (!sSentPersonalities) {
+            goto finish;
+        }
+    }
+
+    if (!createCFMutableArray(&authenticKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&removed, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&addedPersonalities, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    recordNonsecureKexts(kexts);
+
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef aKext = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+        if (OSKextIsAuthentic(aKext)) {
+            CFArrayAppendValue(authenticKexts, aKext);
+        }
+    }
+
+    personalities = OSKextCopyPersonalitiesOfKexts(authenticKexts);
+    newSet = createPersonalitySet(personalities);
+    if (!newSet) {
+        goto finish;
+    }
+
+    diff.otherSet = newSet;
+    diff.missing = removed;
+    CFSetApplyFunction(sSentPersonalities, &collectMissingPersonality, &diff);
+
+   /* Remove first, so a changed personality rematches with its new
+    * properties.  Removing takes each personality as a matching
+    * dictionary, which matches exactly that personality.
+    */
+    count = CFArrayGetCount(removed);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef personality = CFArrayGetValueAtIndex(removed, i);
+        CFDataRef       personalityData = IOCFSerialize(personality,
+            kNilOptions);
+
+        if (!personalityData) {
+            OSKextLogMemError();
+            result = kOSReturnError;
+            goto finish;
+        }
+        result = IOCatalogueSendData(kIOMasterPortDefault,
+            kIOCatalogRemoveDrivers,
+            (char *)CFDataGetBytePtr(personalityData),
+            (unsigned int)CFDataGetLength(personalityData));
+        CFRelease(personalityData);
+        if (result != kOSReturnSuccess) {
+            goto finish;
+        }
+        CFSetRemoveValue(sSentPersonalities, personality);
+    }
+
+   /* Whatever the kernel doesn't have now is new.
+    */
+    count = CFArrayGetCount(personalities);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef personality = CFArrayGetValueAtIndex(personalities, i);
+
+        if (!CFSetContainsValue(sSentPersonalities, personality)) {
+            CFArrayAppendValue(addedPersonalities, personality);
+        }
+    }
+    if (CFArrayGetCount(addedPersonalities)) {
+        addedData = IOCFSerialize(addedPersonalities, kNilOptions);
+        if (!addedData) {
+            OSKextLogMemError();
+            result = kOSReturnError;
+            goto finish;
+        }
+        result = IOCatalogueSendData(kIOMasterPortDefault,
+            kIOCatalogAddDrivers,
+            (char *)CFDataGetBytePtr(addedData),
+            (unsigned int)CFDataGetLength(addedData));
+        if (result != kOSReturnSuccess) {
+            goto finish;
+        }
+    }
+
+    SAFE_RELEASE(sSentPersonalities);
+    sSentPersonalities = (CFMutableSetRef)CFRetain(newSet);
+    result = kOSReturnSuccess;
+
+   /* Keep the cache file current if it isn't; as with a full send,
+    * don't let a failure here affect the result.
+    */
+    if (!_OSKextReadCache(gRepositoryURLs, CFSTR(kIOKitPersonalitiesKey),
+        gKernelArchInfo, _kOSKextCacheFormatIOXML,
+        /* parseXML? */ false, /* valuesOut */ NULL)) {
+
+        _OSKextWriteCache(OSKextGetSystemExtensionsFolderURLs(),
+            CFSTR(kIOKitPersonalitiesKey), gKernelArchInfo,
+            _kOSKextCacheFormatIOXML, personalities);
+        writeSerializedPersonalities(personalities, gKernelArchInfo);
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogIPCFlag |
+        kOSKextLogKextBookkeepingFlag,
+        "Sent %ld new kext personalities to the IOCatalogue and removed %ld.",
+        CFArrayGetCount(addedPersonalities), CFArrayGetCount(removed));
+
+finish:
+    if (result != kOSReturnSuccess) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Couldn't update kext personalities in the IOCatalogue; "
+            "sending all of them.");
+        forgetSentPersonalities();
+    }
+    SAFE_RELEASE(authenticKexts);
+    SAFE_RELEASE(personalities);
+    SAFE_RELEASE(newSet);
+    SAFE_RELEASE(removed);
+    SAFE_RELEASE(addedPersonalities);
+    SAFE_RELEASE(addedData);
+    return result;
+}
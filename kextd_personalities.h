@@ -38,4 +38,9 @@
  */
 OSReturn sendSystemKextPersonalitiesToKernel(CFArrayRef kexts, Boolean resetFlag);
 
+/* Call this after removing personalities from the kernel any other way,
+ * so that the next rescan sends all of them rather than just changes.
+ */
+void forgetSentPersonalities(void);
+
 #endif /* __KEXTD_PERSONALITIES__ */
@@ -27,6 +27,7 @@
 #include <libc.h>
 #include <mach/mach.h>
 #include <mach/mach_host.h>
+#include <mach/mach_time.h>
 #include <mach/bootstrap.h>
 #include <mach/kmod.h>
 #include <notify.h>
@@ -37,6 +38,8 @@
 #include <servers/bootstrap.h>  // bootstrap mach ports
 #include <sandbox.h>
 #include <esp.h>
+#include <pthread.h>
+#include <dispatch/dispatch.h>
 
 #include <IOKit/kext/kextmanager_types.h>
 #include <IOKit/kext/OSKext.h>
@@ -51,6 +54,8 @@
 #include "paths.h"
 #include "kextd_request.h"
 #include "kextd_main.h"
+#include "kextd_personalities.h"
+#include "kextd_mig_server.h"
 #include "kextd_usernotification.h"
 
 #include "kextd_mach.h"  // mig-generated, not in project
@@ -74,20 +79,407 @@ kern_return_t sendPropertyValueResponse(
     CFArrayRef    propertyValues,
     char       ** xml_data_out,
     int         * xml_data_length);
-void kextdProcessKernelLoadRequest(
-    CFDictionaryRef   request);
+void kextdProcessKernelLoadRequests(
+    CFArrayRef        requests,
+    uint64_t          queueUsecs);
 void kextdProcessKernelResourceRequest(
     CFDictionaryRef   request);
 kern_return_t kextdProcessUserLoadRequest(
     CFDictionaryRef request,
     uid_t           remote_euid,
     pid_t           remote_pid);
+kern_return_t kextdProcessUserBatchLoadRequest(
+    CFDictionaryRef request,
+    uid_t           remote_euid,
+    pid_t           remote_pid);
+OSReturn kextdSetKextutilLockScope(
+    CFArrayRef      kextIDs,
+    uid_t           remote_euid);
 static OSReturn checkNonrootLoadAllowed(
     OSKextRef kext,
     uid_t     remote_euid,
     pid_t     remote_pid);
 
 #pragma mark KextManager RPC routines & support
+/*******************************************************************************
+* Path requests are served off the main thread (see kextd_mig_server.c), so
+* they can't touch OSKext.  Instead they use an index from bundle identifier
+* to path, version, and UUID of the kext a lookup by identifier would find.
+* kextd rebuilds it whenever it reads the extensions (reusing the UUIDs of
+* bundles that haven't changed), keeps it when the kexts are released, and
+* saves it next to the identifier caches so that the next launch can answer
+* lookups without reading any kexts, as long as the extensions folders are
+* as they were.  An identifier missing from the index, or whose kext is no
+* longer on disk, is looked up on the main thread.
+*******************************************************************************/
+#define kKextIndexPath           _kOSKextCachesRootFolder "/KextPathIndex.plist"
+#define kKextIndexVersion        1
+
+#define kKextIndexVersionKey     CFSTR("Version")
+#define kKextIndexReposKey       CFSTR("Repositories")
+#define kKextIndexEntriesKey     CFSTR("Entries")
+#define kKextIndexPathKey        CFSTR("Path")
+#define kKextIndexBundleVersKey  CFSTR("Version")
+#define kKextIndexUUIDKey        CFSTR("UUID")
+#define kKextIndexStampKey       CFSTR("Stamp")
+
+static pthread_mutex_t  sKextIndexLock    = PTHREAD_MUTEX_INITIALIZER;
+static CFDictionaryRef  sKextIndex        = NULL;
+static Boolean          sKextIndexLoaded  = false;
+
+/*******************************************************************************
+* Called with sKextIndexLock held.
+*******************************************************************************/
+static void
+loadKextIndex(void)
+{
+    CFDataRef           indexData   = NULL;  // must release
+    CFPropertyListRef   indexPlist  = NULL;  // must release
+    CFStringRef         reposStamp  = NULL;  // must release
+    CFTypeRef           value       = NULL;  // do not release
+    int                 version     = 0;
+
+    if (sKextIndexLoaded) {
+        return;
+    }
+    sKextIndexLoaded = true;
+
+    if (!createCFDataFromFile(&indexData, kKextIndexPath)) {
+        goto finish;
+    }
+    indexPlist = CFPropertyListCreateWithData(kCFAllocatorDefault, indexData,
+        kCFPropertyListImmutable, NULL, NULL);
+    if (!indexPlist || CFGetTypeID(indexPlist) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+
+    value = CFDictionaryGetValue(indexPlist, kKextIndexVersionKey);
+    if (!value || CFGetTypeID(value) != CFNumberGetTypeID() ||
+        !CFNumberGetValue(value, kCFNumberIntType, &version) ||
+        version != kKextIndexVersion) {
+        goto finish;
+    }
+    reposStamp = copyRepositoryStamp();
+    value = CFDictionaryGetValue(indexPlist, kKextIndexReposKey);
+    if (!reposStamp || !value || !CFEqual(value, reposStamp)) {
+        goto finish;
+    }
+    value = CFDictionaryGetValue(indexPlist, kKextIndexEntriesKey);
+    if (!value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+    if (!sKextIndex) {
+        sKextIndex = CFRetain(value);
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDebugLevel | kOSKextLogIPCFlag,
+            "Using kext index %s.", kKextIndexPath);
+    }
+
+finish:
+    SAFE_RELEASE(indexData);
+    SAFE_RELEASE(indexPlist);
+    SAFE_RELEASE(reposStamp);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void
+saveKextIndex(CFDictionaryRef entries)
+{
+    CFMutableDictionaryRef  indexDict   = NULL;  // must release
+    CFNumberRef             versionNum  = NULL;  // must release
+    CFStringRef             reposStamp  = NULL;  // must release
+    CFDataRef               indexData   = NULL;  // must release
+    int                     version     = kKextIndexVersion;
+    int                     fd          = -1;
+    char                    tmpPath[PATH_MAX];
+
+    tmpPath[0] = 0x00;
+    if (geteuid() != 0) {
+        goto finish;
+    }
+
+    indexDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    versionNum = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &version);
+    reposStamp = copyRepositoryStamp();
+    if (!indexDict || !versionNum || !reposStamp) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(indexDict, kKextIndexVersionKey, versionNum);
+    CFDictionarySetValue(indexDict, kKextIndexReposKey, reposStamp);
+    CFDictionarySetValue(indexDict, kKextIndexEntriesKey, entries);
+
+    indexData = CFPropertyListCreateData(kCFAllocatorDefault, indexDict,
+        kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (!indexData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", kKextIndexPath);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't create %s - %s", tmpPath, strerror(errno));
+        tmpPath[0] = 0x00;
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(indexData),
+            CFDataGetLength(indexData)) != EX_OK) {
+        goto finish;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmpPath, kKextIndexPath) != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+            "Can't rename %s - %s", tmpPath, strerror(errno));
+        goto finish;
+    }
+    tmpPath[0] = 0x00;
+
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    SAFE_RELEASE(indexDict);
+    SAFE_RELEASE(versionNum);
+    SAFE_RELEASE(reposStamp);
+    SAFE_RELEASE(indexData);
+    return;
+}
+
+/*******************************************************************************
+* Returns the index entry for aKext, reusing oldEntry's UUID if the bundle
+* is unchanged.
+*******************************************************************************/
+static CFDictionaryRef
+createKextIndexEntry(OSKextRef aKext, CFDictionaryRef oldEntry)
+{
+    CFMutableDictionaryRef  entry       = NULL;  // returned
+    CFURLRef                absURL      = NULL;  // must release
+    CFStringRef             kextPath    = NULL;  // must release
+    CFStringRef             stamp       = NULL;  // must release
+    CFDataRef               uuid        = NULL;  // must release
+    CFTypeRef               version     = NULL;  // do not release
+    char                    kextPathCString[PATH_MAX];
+
+    absURL = CFURLCopyAbsoluteURL(OSKextGetURL(aKext));
+    if (!absURL) {
+        goto finish;
+    }
+    kextPath = CFURLCopyFileSystemPath(absURL, kCFURLPOSIXPathStyle);
+    if (!kextPath ||
+        !CFStringGetFileSystemRepresentation(kextPath, kextPathCString,
+            sizeof(kextPathCString))) {
+        goto finish;
+    }
+    stamp = copyBundleStamp(kextPathCString);
+    if (!stamp) {
+        goto finish;
+    }
+
+    entry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!entry) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(entry, kKextIndexPathKey, kextPath);
+    CFDictionarySetValue(entry, kKextIndexStampKey, stamp);
+    version = OSKextGetValueForInfoDictionaryKey(aKext, kCFBundleVersionKey);
+    if (version && CFGetTypeID(version) == CFStringGetTypeID()) {
+        CFDictionarySetValue(entry, kKextIndexBundleVersKey, version);
+    }
+
+    if (oldEntry &&
+        CFEqual(kextPath, CFDictionaryGetValue(oldEntry, kKextIndexPathKey)) &&
+        CFEqual(stamp, CFDictionaryGetValue(oldEntry, kKextIndexStampKey))) {
+
+        uuid = CFDictionaryGetValue(oldEntry, kKextIndexUUIDKey);
+        if (uuid) {
+            CFRetain(uuid);
+        }
+    } else if (OSKextDeclaresExecutable(aKext)) {
+        uuid = OSKextCopyUUIDForArchitecture(aKext, /* arch */ NULL);
+    }
+    if (uuid) {
+        CFDictionarySetValue(entry, kKextIndexUUIDKey, uuid);
+    }
+
+finish:
+    SAFE_RELEASE(absURL);
+    SAFE_RELEASE(kextPath);
+    SAFE_RELEASE(stamp);
+    SAFE_RELEASE(uuid);
+    return entry;
+}
+
+/*******************************************************************************
+* Main thread only; kexts is the full set kextd has just read.
+*******************************************************************************/
+void kextdUpdateKextIndex(CFArrayRef kexts)
+{
+    CFMutableDictionaryRef  newIndex    = NULL;  // must release
+    CFDictionaryRef         oldIndex    = NULL;  // must release
+    CFIndex                 count, i;
+
+    if (!kexts) {
+        goto finish;
+    }
+
+    pthread_mutex_lock(&sKextIndexLock);
+    loadKextIndex();
+    oldIndex = sKextIndex ? CFRetain(sKextIndex) : NULL;
+    pthread_mutex_unlock(&sKextIndexLock);
+
+    newIndex = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!newIndex) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef       aKext   = (OSKextRef)CFArrayGetValueAtIndex(kexts, i);
+        CFStringRef     kextID  = OSKextGetIdentifier(aKext);
+        CFDictionaryRef entry   = NULL;  // must release
+
+       /* Record only the kext a lookup by identifier would find.
+        */
+        if (!kextID || CFDictionaryContainsKey(newIndex, kextID) ||
+            OSKextGetKextWithIdentifier(kextID) != aKext) {
+            continue;
+        }
+        entry = createKextIndexEntry(aKext,
+            oldIndex ? CFDictionaryGetValue(oldIndex, kextID) : NULL);
+        if (entry) {
+            CFDictionarySetValue(newIndex, kextID, entry);
+        }
+        SAFE_RELEASE(entry);
+    }
+
+    pthread_mutex_lock(&sKextIndexLock);
+    SAFE_RELEASE(sKextIndex);
+    sKextIndex = CFRetain(newIndex);
+    pthread_mutex_unlock(&sKextIndexLock);
+
+    if (!oldIndex || !CFEqual(oldIndex, newIndex)) {
+        saveKextIndex(newIndex);
+    }
+
+finish:
+    SAFE_RELEASE(newIndex);
+    SAFE_RELEASE(oldIndex);
+    return;
+}
+
+/*******************************************************************************
+* Drops the in-memory kext index; the next lookup reads it back from disk.
+*******************************************************************************/
+void kextdFlushKextIndex(void)
+{
+    pthread_mutex_lock(&sKextIndexLock);
+    SAFE_RELEASE_NULL(sKextIndex);
+    sKextIndexLoaded = false;
+    pthread_mutex_unlock(&sKextIndexLock);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static Boolean
+copyIndexedPathForBundleID(CFStringRef kextID, posix_path_t path)
+{
+    Boolean         result      = false;
+    CFDictionaryRef entry       = NULL;  // do not release
+    CFStringRef     kextPath    = NULL;  // must release
+    struct stat     statBuf;
+
+    pthread_mutex_lock(&sKextIndexLock);
+    loadKextIndex();
+    entry = sKextIndex ? CFDictionaryGetValue(sKextIndex, kextID) : NULL;
+    if (entry && CFGetTypeID(entry) == CFDictionaryGetTypeID()) {
+        kextPath = CFDictionaryGetValue(entry, kKextIndexPathKey);
+        if (kextPath && CFGetTypeID(kextPath) == CFStringGetTypeID()) {
+            CFRetain(kextPath);
+        } else {
+            kextPath = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sKextIndexLock);
+
+    if (kextPath &&
+        CFStringGetFileSystemRepresentation(kextPath, path, PATH_MAX) &&
+        stat(path, &statBuf) == 0) {
+
+        result = true;
+    } else {
+        path[0] = '\0';
+    }
+    SAFE_RELEASE(kextPath);
+    return result;
+}
+
+/*******************************************************************************
+* Main thread only.
+*******************************************************************************/
+static OSReturn
+copyKextPathForBundleID(
+    CFStringRef       kextID,
+    const char      * bundle_id,
+    posix_path_t      path)
+{
+    OSReturn      result    = kOSReturnError;
+    OSKextRef     theKext   = NULL;  // must release
+    CFURLRef      kextURL   = NULL;  // do not release
+    CFURLRef      absURL    = NULL;  // must release
+
+    theKext = OSKextCreateWithIdentifier(kCFAllocatorDefault, kextID);
+    if (!theKext) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Kext %s not found for client path request.", bundle_id);
+        result = kOSKextReturnNotFound;
+        goto finish;
+    }
+    kextURL = OSKextGetURL(theKext);
+    if (!kextURL) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Kext %s found for client path request, but has no URL.", bundle_id);
+        goto finish;
+    }
+    absURL = CFURLCopyAbsoluteURL(kextURL);
+    if (!absURL) {
+        OSKextLogMemError();
+        result = kOSKextReturnNoMemory;
+        goto finish;
+    }
+    if (!CFURLGetFileSystemRepresentation(absURL, /* resolveToBase */ true,
+        (UInt8 *)path, PATH_MAX)) {
+        
+        result = kOSKextReturnSerialization;
+        goto finish;
+    }
+
+    result = kOSReturnSuccess;
+
+finish:
+    SAFE_RELEASE(theKext);
+    SAFE_RELEASE(absURL);
+
+    return result;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 kern_return_t _kextmanager_path_for_bundle_id(
@@ -98,9 +490,7 @@ kern_return_t _kextmanager_path_for_bundle_id(
 {
     kern_return_t result    = kOSReturnSuccess;
     CFStringRef   kextID    = NULL;  // must release
-    OSKextRef     theKext   = NULL;  // must release
-    CFURLRef      kextURL   = NULL;  // do not release
-    CFURLRef      absURL    = NULL;  // must release
+    OSReturn      lookupResult = kOSReturnError;
     char          crashInfo[sizeof(CRASH_INFO_USER_KEXT_PATH) +
                   KMOD_MAX_NAME + PATH_MAX];
 
@@ -125,47 +515,266 @@ kern_return_t _kextmanager_path_for_bundle_id(
         goto finish;
     }
 
-    theKext = OSKextCreateWithIdentifier(kCFAllocatorDefault, kextID);
-    if (!theKext) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
-            "Kext %s not found for client path request.", bundle_id);
-        *kext_result = kOSKextReturnNotFound;
+    if (copyIndexedPathForBundleID(kextID, path)) {
+        lookupResult = kOSReturnSuccess;
+    } else if (pthread_main_np()) {
+        lookupResult = copyKextPathForBundleID(kextID, bundle_id, path);
+    } else {
+       /* Not in the index; the OSKext lookup has to run on the main
+        * thread.  Don't wait for it here, or every later lookup queues
+        * up behind whatever the main thread is doing.
+        */
+        result = kKextdForwardToMainThread;
         goto finish;
     }
-    kextURL = OSKextGetURL(theKext);
-    if (!kextURL) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
-            "Kext %s found for client path request, but has no URL.", bundle_id);
+    *kext_result = lookupResult;
+    if (lookupResult != kOSReturnSuccess) {
         goto finish;
     }
-    absURL = CFURLCopyAbsoluteURL(kextURL);
-    if (!absURL) {
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogDebugLevel | kOSKextLogIPCFlag,
+        "Returning path %s for identifier %s.", path, bundle_id);
+
+finish:
+    SAFE_RELEASE(kextID);
+
+    setCrashLogMessage(NULL);
+
+    return result;
+}
+
+#pragma mark Load Latency Tracing
+/*******************************************************************************
+* Each load that reaches the kernel records how long it spent in each phase,
+* and the last kLoadTraceSamples loads of every bundle identifier are kept so
+* that a kKextLoadLatencyKey property request can report p50/p99 per phase.
+* Phases a batch shares (reading the extensions, checking signatures) are
+* charged in full to every kext in it, and queue time includes the loads
+* ahead of a kext in its batch, so each sample is the latency that request
+* saw.  Requests are all handled on the main thread, so this needs no lock.
+*******************************************************************************/
+typedef enum {
+    kLoadPhaseQueue = 0,      // deferred behind the kextutil lock or a batch
+    kLoadPhaseRead,           // reading extensions and the requested kexts
+    kLoadPhaseResolve,        // dependency resolution
+    kLoadPhaseSignCheck,
+    kLoadPhaseKernelLoad,
+    kLoadPhasePersonalities,  // telling the IOCatalogue to match
+    kNumLoadPhases
+} LoadPhase;
+
+#define kLoadTraceSamples  100
+
+typedef struct {
+    uint64_t  usecs[kNumLoadPhases];
+} LoadTrace;
+
+typedef struct {
+    uint32_t  count;          // loads recorded, including those rolled off
+    uint32_t  next;           // next sample to overwrite
+    uint32_t  usecs[kLoadTraceSamples][kNumLoadPhases];
+} LoadTraceHistory;
+
+static const CFStringRef sLoadPhaseKeys[kNumLoadPhases] = {
+    CFSTR("Queue"), CFSTR("Read"), CFSTR("Resolve"),
+    CFSTR("SignatureCheck"), CFSTR("KernelLoad"), CFSTR("Personalities")
+};
+
+static CFMutableDictionaryRef sLoadTraces = NULL;  // id -> LoadTraceHistory data
+
+static uint64_t
+loadTraceNow(void)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (!timebase.denom) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static void
+recordLoadTrace(OSKextRef aKext, const LoadTrace * trace)
+{
+    CFStringRef         kextID      = OSKextGetIdentifier(aKext);
+    CFMutableDataRef    historyData = NULL;  // do not release
+    LoadTraceHistory  * history     = NULL;  // do not free
+    uint64_t            total       = 0;
+    int                 phase;
+
+    if (!kextID) {
+        return;
+    }
+    if (!sLoadTraces && !createCFMutableDictionary(&sLoadTraces)) {
         OSKextLogMemError();
-        *kext_result = kOSKextReturnNoMemory;
+        return;
+    }
+    historyData = (CFMutableDataRef)CFDictionaryGetValue(sLoadTraces, kextID);
+    if (!historyData) {
+        historyData = CFDataCreateMutable(kCFAllocatorDefault,
+            sizeof(LoadTraceHistory));
+        if (!historyData) {
+            OSKextLogMemError();
+            return;
+        }
+        CFDataSetLength(historyData, sizeof(LoadTraceHistory));  // zeroed
+        CFDictionarySetValue(sLoadTraces, kextID, historyData);
+        CFRelease(historyData);
+    }
+    history = (LoadTraceHistory *)CFDataGetMutableBytePtr(historyData);
+
+    for (phase = 0; phase < kNumLoadPhases; phase++) {
+        history->usecs[history->next][phase] =
+            (uint32_t)MIN(trace->usecs[phase], UINT32_MAX);
+        total += trace->usecs[phase];
+    }
+    history->next = (history->next + 1) % kLoadTraceSamples;
+    history->count++;
+
+    OSKextLogCFString(/* kext */ NULL,
+        kOSKextLogDetailLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+        CFSTR("Load of %@ took %llu us (queue %llu, read %llu, resolve %llu, "
+              "signatures %llu, kernel %llu, personalities %llu)."),
+        kextID, total,
+        trace->usecs[kLoadPhaseQueue], trace->usecs[kLoadPhaseRead],
+        trace->usecs[kLoadPhaseResolve], trace->usecs[kLoadPhaseSignCheck],
+        trace->usecs[kLoadPhaseKernelLoad],
+        trace->usecs[kLoadPhasePersonalities]);
+}
+
+static int
+compareUInt32(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Sorts values in place.
+ */
+static Boolean
+setPercentiles(
+    CFMutableDictionaryRef  dict,
+    CFStringRef             key,
+    uint32_t              * values,
+    uint32_t                numValues)
+{
+    Boolean                 result      = false;
+    CFMutableDictionaryRef  percentiles = NULL;  // must release
+    CFNumberRef             number      = NULL;  // must release
+    SInt32                  value;
+
+    if (!createCFMutableDictionary(&percentiles)) {
         goto finish;
     }
-    if (!CFURLGetFileSystemRepresentation(absURL, /* resolveToBase */ true,
-        (UInt8 *)path, PATH_MAX)) {
-        
-        *kext_result = kOSKextReturnSerialization;
+    qsort(values, numValues, sizeof(*values), &compareUInt32);
+
+    value = (SInt32)values[(numValues - 1) * 50 / 100];
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+    if (!number) {
         goto finish;
     }
+    CFDictionarySetValue(percentiles, CFSTR("P50"), number);
+    SAFE_RELEASE_NULL(number);
 
-    *kext_result = kOSReturnSuccess;
+    value = (SInt32)values[(numValues - 1) * 99 / 100];
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+    if (!number) {
+        goto finish;
+    }
+    CFDictionarySetValue(percentiles, CFSTR("P99"), number);
 
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogDebugLevel | kOSKextLogIPCFlag,
-        "Returning path %s for identifier %s.", path, bundle_id);
+    CFDictionarySetValue(dict, key, percentiles);
+    result = true;
 
 finish:
-    SAFE_RELEASE(kextID);
-    SAFE_RELEASE(theKext);
-    SAFE_RELEASE(absURL);
+    SAFE_RELEASE(percentiles);
+    SAFE_RELEASE(number);
+    return result;
+}
 
-    setCrashLogMessage(NULL);
+/*******************************************************************************
+* Builds the kKextLoadLatencyKey reply: one dictionary per bundle identifier
+* holding its load count and, for the total and each phase, the p50 and p99
+* microseconds over the retained samples.
+*******************************************************************************/
+static CFArrayRef
+copyLoadLatencyReport(void)
+{
+    CFMutableArrayRef       result      = NULL;  // returned
+    CFMutableArrayRef       report      = NULL;  // must release
+    CFMutableDictionaryRef  entry       = NULL;  // must release
+    CFNumberRef             number      = NULL;  // must release
+    CFStringRef           * kextIDs     = NULL;  // must free
+    CFDataRef             * histories   = NULL;  // must free
+    uint32_t                values[kLoadTraceSamples];
+    uint32_t                totals[kLoadTraceSamples];
+    CFIndex                 count       = 0;
+    CFIndex                 i;
+
+    if (!createCFMutableArray(&report, &kCFTypeArrayCallBacks)) {
+        goto finish;
+    }
+    count = sLoadTraces ? CFDictionaryGetCount(sLoadTraces) : 0;
+    if (count) {
+        kextIDs = (CFStringRef *)malloc(count * sizeof(*kextIDs));
+        histories = (CFDataRef *)malloc(count * sizeof(*histories));
+        if (!kextIDs || !histories) {
+            goto finish;
+        }
+        CFDictionaryGetKeysAndValues(sLoadTraces,
+            (const void **)kextIDs, (const void **)histories);
+    }
 
+    for (i = 0; i < count; i++) {
+        const LoadTraceHistory * history = (const LoadTraceHistory *)
+                                           CFDataGetBytePtr(histories[i]);
+        uint32_t    numSamples = MIN(history->count, kLoadTraceSamples);
+        SInt32      loadCount  = (SInt32)history->count;
+        uint32_t    j;
+        int         phase;
+
+        SAFE_RELEASE_NULL(entry);
+        SAFE_RELEASE_NULL(number);
+        number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type,
+            &loadCount);
+        if (!number || !createCFMutableDictionary(&entry)) {
+            goto finish;
+        }
+        CFDictionarySetValue(entry, kCFBundleIdentifierKey, kextIDs[i]);
+        CFDictionarySetValue(entry, CFSTR("LoadCount"), number);
+
+        bzero(totals, sizeof(totals));
+        for (phase = 0; phase < kNumLoadPhases; phase++) {
+            for (j = 0; j < numSamples; j++) {
+                values[j] = history->usecs[j][phase];
+                totals[j] += values[j];
+            }
+            if (!setPercentiles(entry, sLoadPhaseKeys[phase],
+                values, numSamples)) {
+                goto finish;
+            }
+        }
+        if (!setPercentiles(entry, CFSTR("Total"), totals, numSamples)) {
+            goto finish;
+        }
+        CFArrayAppendValue(report, entry);
+    }
+
+    result = report;
+    report = NULL;
+
+finish:
+    if (!result) {
+        OSKextLogMemError();
+    }
+    SAFE_RELEASE(report);
+    SAFE_RELEASE(entry);
+    SAFE_RELEASE(number);
+    SAFE_FREE(kextIDs);
+    SAFE_FREE(histories);
     return result;
 }
 
@@ -212,6 +821,15 @@ kern_return_t _kextmanager_create_property_value_array(
         goto finish;
     }
 
+    if (CFEqual(propertyKey, kKextLoadLatencyKey)) {
+        propertyValues = copyLoadLatencyReport();
+        if (propertyValues) {
+            result = sendPropertyValueResponse(propertyValues,
+                xml_data_out, xml_data_length);
+        }
+        goto finish;
+    }
+
     if (readSystemKextPropertyValues(propertyKey, gKernelArchInfo,
         /* forceUpdate? */ FALSE, &propertyValues)) {
 
@@ -282,6 +900,40 @@ finish:
 
 #define KEXTD_LOCKED() (_gKextutilLock ? true:false)
 
+/* Once kextutil narrows its lock to the kexts it's loading, kernel requests
+ * are processed as they come but loads that need one of those kexts wait
+ * here for the lock to go.
+ */
+#define KEXTD_FULLY_LOCKED() (KEXTD_LOCKED() && !_gKextutilLockScope)
+
+static uint64_t sKernelRequestsDeferredAt = 0;  // loadTraceNow(); 0 if not
+static CFMutableArrayRef sDeferredLoadRequests = NULL;
+
+static Boolean
+loadListInKextutilLockScope(OSKextRef aKext, CFArrayRef loadList)
+{
+    CFIndex count, i;
+
+    if (!KEXTD_LOCKED() || !_gKextutilLockScope) {
+        return false;
+    }
+    if (!loadList) {
+        return CFSetContainsValue(_gKextutilLockScope,
+            OSKextGetIdentifier(aKext));
+    }
+    count = CFArrayGetCount(loadList);
+    for (i = 0; i < count; i++) {
+        OSKextRef thisKext = (OSKextRef)CFArrayGetValueAtIndex(loadList, i);
+
+        if (CFSetContainsValue(_gKextutilLockScope,
+            OSKextGetIdentifier(thisKext))) {
+
+            return true;
+        }
+    }
+    return false;
+}
+
 /*******************************************************************************
 * Incoming MIG message from kernel to let us know we should fetch requests from
 * it using kextd_process_kernel_requests().
@@ -290,7 +942,10 @@ kern_return_t svc_kextd_ping(mach_port_t mp __unused)
 {
     bool shutdownRequested = false;
 
-    if (KEXTD_LOCKED()) {
+    if (KEXTD_FULLY_LOCKED()) {
+        if (!gKernelRequestsPending) {
+            sKernelRequestsDeferredAt = loadTraceNow();
+        }
         gKernelRequestsPending = true;
         return kOSReturnSuccess;
     } else {
@@ -312,8 +967,27 @@ bool kextd_process_kernel_requests(void)
     Boolean         prelinkedKernelRequested   = false;
     Boolean         shutdownRequested          = false;
     char          * scratchCString             = NULL;  // must free
+    CFMutableArrayRef loadRequests             = NULL;  // must release
+    uint64_t        queueUsecs                 = 0;
     CFIndex         count, i;
 
+    if (sKernelRequestsDeferredAt && !_gKextutilLockScope) {
+        queueUsecs = loadTraceNow() - sKernelRequestsDeferredAt;
+        sKernelRequestsDeferredAt = 0;
+    }
+
+    if (!createCFMutableArray(&loadRequests, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+    }
+
+   /* Retry loads held back for kextutil; any it still needs go back.
+    */
+    if (loadRequests && sDeferredLoadRequests) {
+        CFArrayAppendArray(loadRequests, sDeferredLoadRequests,
+            RANGE_ALL(sDeferredLoadRequests));
+        SAFE_RELEASE_NULL(sDeferredLoadRequests);
+    }
+
    /* Stay in the while loop until _OSKextCopyKernelRequests() returns
     * no more requests.
     */
@@ -365,7 +1039,9 @@ bool kextd_process_kernel_requests(void)
                 OSKextLog(/* kext */ NULL,
                     kOSKextLogProgressLevel | kOSKextLogIPCFlag,
                     "Got load request from kernel.");
-                kextdProcessKernelLoadRequest(request);
+                if (loadRequests) {
+                    CFArrayAppendValue(loadRequests, request);
+                }
             } else if (CFEqual(predicate, CFSTR(kKextRequestPredicateLoadNotification))) {
                /* We don't do anything with the kext identifier because notify(3)
                 * doesn't allow for an argument.
@@ -390,7 +1066,20 @@ bool kextd_process_kernel_requests(void)
                     scratchCString ? scratchCString : "");
             }
         } /* for (i = 0; i < count; i++) */
+
+       /* The kernel sends a burst of load requests as drivers match,
+        * so handle each drained batch together.
+        */
+        if (loadRequests && CFArrayGetCount(loadRequests)) {
+            kextdProcessKernelLoadRequests(loadRequests, queueUsecs);
+            queueUsecs = 0;
+            CFArrayRemoveAllValues(loadRequests);
+        }
     } /* while (1) */
+
+    if (loadRequests && CFArrayGetCount(loadRequests)) {
+        kextdProcessKernelLoadRequests(loadRequests, queueUsecs);
+    }
     
 // finish:
 
@@ -443,10 +1132,14 @@ bool kextd_process_kernel_requests(void)
         notify_post(kOSKextUnloadNotification);
     }
 
-    gKernelRequestsPending = false;
+   /* Loads deferred for kextutil keep the requests pending so that
+    * removing its lock retries them.
+    */
+    gKernelRequestsPending = (sDeferredLoadRequests != NULL);
 
     SAFE_FREE(scratchCString);
     SAFE_RELEASE(kernelRequests);
+    SAFE_RELEASE(loadRequests);
 
     OSKextFlushInfoDictionary(NULL /* all kexts */);
     OSKextFlushLoadInfo(NULL /* all kexts */, /* flushDependencies */ true);
@@ -455,19 +1148,18 @@ bool kextd_process_kernel_requests(void)
 }
 
 /*******************************************************************************
-* Kernel load request.
+* Kernel load requests.
+*
+* All load requests drained from the kernel in one pass are handled together:
+* the extensions are read once, the signatures of every kext needed by any of
+* the requests (each requested kext plus its load list) are checked once and
+* concurrently, and then the kexts are loaded in request order.
 *******************************************************************************/
-void
-kextdProcessKernelLoadRequest(CFDictionaryRef   request)
+static CFStringRef
+getKernelLoadRequestIdentifier(CFDictionaryRef request)
 {
     CFDictionaryRef requestArgs     = NULL; // do not release
-    OSKextRef       osKext          = NULL; // do not release
-    OSReturn        osLoadResult    = kOSKextReturnNotFound;
-
-    CFArrayRef      loadList        = NULL;  // must release
-    CFStringRef     kextIdentifier  = NULL;  // do not release
-    char          * kext_id         = NULL;  // must free
-    char            crashInfo[sizeof(CRASH_INFO_KERNEL_KEXT_LOAD) + KMOD_MAX_NAME + PATH_MAX];
+    CFStringRef     kextIdentifier  = NULL; // do not release
 
     requestArgs = request ? CFDictionaryGetValue(request,
         CFSTR(kKextRequestArgumentsKey)) : NULL;
@@ -478,14 +1170,67 @@ kextdProcessKernelLoadRequest(CFDictionaryRef   request)
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
             "No arguments in kernel kext load request.");
-        goto finish;
-    }
-    if (!kextIdentifier) {
+    } else if (!kextIdentifier) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
             "No kext ID in kernel kext load request.");
-        goto finish;
     }
+
+    return kextIdentifier;
+}
+
+/*******************************************************************************
+* Returns true if sigResult lets theKext load, logging either way.
+*******************************************************************************/
+static Boolean
+loadSignatureAllowed(OSKextRef theKext, OSStatus sigResult)
+{
+    if (sigResult == 0) {
+        return true;
+    }
+    if (isInvalidSignatureAllowed()) {
+        CFStringRef     myKextPath = NULL; // must release
+
+        myKextPath = copyKextPath(theKext);
+        OSKextLogCFString(NULL,
+                          kOSKextLogErrorLevel | kOSKextLogLoadFlag,
+                          CFSTR("kext-dev-mode allowing invalid signature %ld 0x%02lX for kext \"%@\""),
+                          (long)sigResult, (long)sigResult,
+                          myKextPath ? myKextPath : CFSTR("Unknown"));
+        SAFE_RELEASE(myKextPath);
+        return true;
+    } else {
+        CFStringRef     myBundleID = NULL;         // do not release
+
+        myBundleID = OSKextGetIdentifier(theKext);
+        OSKextLogCFString(NULL,
+                          kOSKextLogErrorLevel |
+                          kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                          CFSTR("ERROR: invalid signature for %@, will not load"),
+                          myBundleID ? myBundleID : CFSTR("Unknown"));
+        return false;
+    }
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void
+kextdLoadKernelRequestedKext(
+    OSKextRef       osKext,
+    CFArrayRef      loadList,
+    CFArrayRef      checkedKexts,
+    const OSStatus * sigResults,
+    LoadTrace      * trace)
+{
+    OSReturn        osLoadResult    = kOSKextReturnNotFound;
+    CFArrayRef      failedLoadList  = NULL;  // must release
+    CFStringRef     kextIdentifier  = OSKextGetIdentifier(osKext);
+    char          * kext_id         = NULL;  // must free
+    char            crashInfo[sizeof(CRASH_INFO_KERNEL_KEXT_LOAD) + KMOD_MAX_NAME + PATH_MAX];
+    kern_return_t   catalogueResult = kOSReturnError;
+    uint64_t        phaseStart;
+    CFIndex         count, i;
+
     kext_id = createUTF8CStringForCFString(kextIdentifier);
     if (!kext_id) {
         // xxx - not much we can do here.
@@ -497,63 +1242,38 @@ kextdProcessKernelLoadRequest(CFDictionaryRef   request)
         kext_id);
 
     setCrashLogMessage(crashInfo);
-    
-   /* Read the extensions if necessary (also resets the release timer).
-    */
-    readExtensions();
-
-    OSKextLog(/* kext */ NULL,
-        kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-        "Kernel requests kext with id %s.", kext_id);
 
-    osKext = OSKextGetKextWithIdentifier(kextIdentifier);
-    if (!osKext) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-            "Kext id %s not found; removing personalities from kernel.", kext_id);
-        OSKextRemovePersonalitiesForIdentifierFromKernel(kextIdentifier);
-        goto finish;
-    }
-    
    /* xxx - under what circumstances should we remove personalities?
     * xxx - if the request gets into the kernel and fails, OSKext.cpp
     * xxx - removes them, but there can be other failures on the way....
     */
-    OSStatus  sigResult = checkKextSignature(osKext, true, false);
-    if ( sigResult != 0 ) {
-        if ( isInvalidSignatureAllowed() ) {
-            CFStringRef     myKextPath = NULL; // must release
-            
-            myKextPath = copyKextPath(osKext);
-            OSKextLogCFString(NULL,
-                              kOSKextLogErrorLevel | kOSKextLogLoadFlag,
-                              CFSTR("kext-dev-mode allowing invalid signature %ld 0x%02lX for kext \"%@\""),
-                              (long)sigResult, (long)sigResult,
-                              myKextPath ? myKextPath : CFSTR("Unknown"));
-            SAFE_RELEASE(myKextPath);
+    i = CFArrayGetFirstIndexOfValue(checkedKexts, RANGE_ALL(checkedKexts),
+        osKext);
+    if (!loadSignatureAllowed(osKext, sigResults[i])) {
+        OSKextRemoveKextPersonalitiesFromKernel(osKext);
+        forgetSentPersonalities();
+        goto finish;
+    }
+
+    count = loadList ? CFArrayGetCount(loadList) : 0;
+    for (CFIndex j = 0; j < count; j++) {
+        OSKextRef myKext = (OSKextRef)CFArrayGetValueAtIndex(loadList, j);
+
+        if (myKext == osKext) {
+            continue;
         }
-        else {
-            CFStringRef     myBundleID = NULL;         // do not release
-            
-            myBundleID = OSKextGetIdentifier(osKext);
-            OSKextLogCFString(NULL,
-                              kOSKextLogErrorLevel |
-                              kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                              CFSTR("ERROR: invalid signature for %@, will not load"),
-                              myBundleID ? myBundleID : CFSTR("Unknown"));
+        i = CFArrayGetFirstIndexOfValue(checkedKexts,
+            RANGE_ALL(checkedKexts), myKext);
+        if (!loadSignatureAllowed(myKext, sigResults[i])) {
+            OSKextLog(/* kext */ NULL,
+                      kOSKextLogErrorLevel | kOSKextLogLoadFlag |
+                      kOSKextLogDependenciesFlag | kOSKextLogIPCFlag,
+                      "Signature failure in dependencies for kext load request.");
             OSKextRemoveKextPersonalitiesFromKernel(osKext);
+            forgetSentPersonalities();
             goto finish;
         }
     }
-    
-    if (checkSignaturesOfDependents(osKext, true, false) != 0) {
-        OSKextLog(/* kext */ NULL,
-                  kOSKextLogErrorLevel | kOSKextLogLoadFlag |
-                  kOSKextLogDependenciesFlag | kOSKextLogIPCFlag,
-                  "Signature failure in dependencies for kext load request.");
-        OSKextRemoveKextPersonalitiesFromKernel(osKext);
-        goto finish;
-    }
 
     CFBooleanRef pgoref = (CFBooleanRef)
         OSKextGetValueForInfoDictionaryKey(osKext, CFSTR("PGO"));
@@ -564,45 +1284,207 @@ kextdProcessKernelLoadRequest(CFDictionaryRef   request)
         pgo = CFBooleanGetValue(pgoref);
     }
 
-    osLoadResult = OSKextLoadWithOptions(osKext,
-        /* startExclusion */ kOSKextExcludeNone,
-        /* addPersonalitiesExclusion */ kOSKextExcludeAll,
-        /* personalityNames */ NULL,
-        /* delayAutounload */ pgo);
+    phaseStart = loadTraceNow();
+    osLoadResult = OSKextLoadWithOptions(osKext,
+        /* startExclusion */ kOSKextExcludeNone,
+        /* addPersonalitiesExclusion */ kOSKextExcludeAll,
+        /* personalityNames */ NULL,
+        /* delayAutounload */ pgo);
+    trace->usecs[kLoadPhaseKernelLoad] = loadTraceNow() - phaseStart;
+
+    if (osLoadResult != kOSReturnSuccess) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Load %s failed; removing personalities from kernel.", kext_id);
+        OSKextRemoveKextPersonalitiesFromKernel(osKext);
+        forgetSentPersonalities();
+    } else {
+        if (pgo) {
+            pgo_start_thread(osKext);
+        }
+        phaseStart = loadTraceNow();
+        catalogueResult = IOCatalogueModuleLoaded(kIOMasterPortDefault,
+            kext_id);
+        trace->usecs[kLoadPhasePersonalities] = loadTraceNow() - phaseStart;
+        if (kOSReturnSuccess != catalogueResult) {
+
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Failed to notify IOCatalogue that %s loaded.",
+                kext_id);
+        } else {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Loaded %s and notified IOCatalogue.",
+                kext_id);
+        }
+    }
+
+    if (osLoadResult == kOSKextReturnAuthentication) {
+        failedLoadList = OSKextCopyLoadList(osKext, /* needAll? */ false);
+        recordNonsecureKexts(failedLoadList);
+    }
+    recordLoadTrace(osKext, trace);
+
+finish:
+    SAFE_RELEASE(failedLoadList);
+    SAFE_FREE(kext_id);
+    setCrashLogMessage(NULL);
+
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void
+kextdProcessKernelLoadRequests(CFArrayRef requests, uint64_t queueUsecs)
+{
+    CFMutableArrayRef       requestedKexts  = NULL;  // must release
+    CFMutableArrayRef       checkedKexts    = NULL;  // must release
+    CFMutableDictionaryRef  loadLists       = NULL;  // must release
+    CFMutableDictionaryRef  resolveTimes    = NULL;  // must release
+    OSStatus              * sigResults      = NULL;  // must free
+    char                  * kext_id         = NULL;  // must free
+    LoadTrace               batchTrace;
+    uint64_t                phaseStart      = loadTraceNow();
+    uint64_t                batchLoadStart;
+    CFIndex                 count, i;
+
+    bzero(&batchTrace, sizeof(batchTrace));
+    batchTrace.usecs[kLoadPhaseQueue] = queueUsecs;
+
+    loadLists = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    resolveTimes = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, NULL);
+    if (!loadLists || !resolveTimes ||
+        !createCFMutableArray(&requestedKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&checkedKexts, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+   /* Read the extensions if necessary (also resets the release timer).
+    */
+    readExtensions();
+    batchTrace.usecs[kLoadPhaseRead] = loadTraceNow() - phaseStart;
+
+    count = CFArrayGetCount(requests);
+    for (i = 0; i < count; i++) {
+        CFStringRef     kextIdentifier  = NULL;  // do not release
+        OSKextRef       osKext          = NULL;  // do not release
+        CFArrayRef      loadList        = NULL;  // must release
+
+        kextIdentifier = getKernelLoadRequestIdentifier(
+            CFArrayGetValueAtIndex(requests, i));
+        if (!kextIdentifier) {
+            continue;
+        }
+        SAFE_FREE_NULL(kext_id);
+        kext_id = createUTF8CStringForCFString(kextIdentifier);
+        if (!kext_id) {
+            OSKextLogMemError();
+            continue;
+        }
 
-    if (osLoadResult != kOSReturnSuccess) {
         OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-            "Load %s failed; removing personalities from kernel.", kext_id);
-        OSKextRemoveKextPersonalitiesFromKernel(osKext);
-    } else {
-        if (pgo) {
-            pgo_start_thread(osKext);
-        }
-        if (kOSReturnSuccess != IOCatalogueModuleLoaded(
-            kIOMasterPortDefault, kext_id)) {
+            kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Kernel requests kext with id %s.", kext_id);
 
+        osKext = OSKextGetKextWithIdentifier(kextIdentifier);
+        if (!osKext) {
             OSKextLog(/* kext */ NULL,
                 kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                "Failed to notify IOCatalogue that %s loaded.",
-                kext_id);
-        } else {
+                "Kext id %s not found; removing personalities from kernel.", kext_id);
+            OSKextRemovePersonalitiesForIdentifierFromKernel(kextIdentifier);
+            forgetSentPersonalities();
+            continue;
+        }
+        if (CFArrayContainsValue(requestedKexts, RANGE_ALL(requestedKexts),
+            osKext)) {
+            continue;
+        }
+
+        phaseStart = loadTraceNow();
+        loadList = OSKextCopyLoadList(osKext, /* needAll? */ true);
+        CFDictionarySetValue(resolveTimes, osKext,
+            (const void *)(uintptr_t)(loadTraceNow() - phaseStart));
+
+        if (loadListInKextutilLockScope(osKext, loadList)) {
             OSKextLog(/* kext */ NULL,
                 kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                "Loaded %s and notified IOCatalogue.",
+                "Deferring load of %s until kextutil releases its lock.",
                 kext_id);
+            if (!sDeferredLoadRequests &&
+                !createCFMutableArray(&sDeferredLoadRequests,
+                    &kCFTypeArrayCallBacks)) {
+
+                OSKextLogMemError();
+            }
+            if (sDeferredLoadRequests) {
+                CFArrayAppendValue(sDeferredLoadRequests,
+                    CFArrayGetValueAtIndex(requests, i));
+                if (!sKernelRequestsDeferredAt) {
+                    sKernelRequestsDeferredAt = loadTraceNow();
+                }
+            }
+            SAFE_RELEASE(loadList);
+            continue;
+        }
+        CFArrayAppendValue(requestedKexts, osKext);
+        addToArrayIfAbsent(checkedKexts, osKext);
+
+        if (loadList) {
+            CFIndex numDependencies = CFArrayGetCount(loadList);
+
+            for (CFIndex j = 0; j < numDependencies; j++) {
+                addToArrayIfAbsent(checkedKexts,
+                    CFArrayGetValueAtIndex(loadList, j));
+            }
+            CFDictionarySetValue(loadLists, osKext, loadList);
+            SAFE_RELEASE(loadList);
         }
     }
 
-    if (osLoadResult == kOSKextReturnAuthentication) {
-        loadList = OSKextCopyLoadList(osKext, /* needAll? */ false);
-        recordNonsecureKexts(loadList);
+    count = CFArrayGetCount(checkedKexts);
+    if (!count) {
+        goto finish;
+    }
+    sigResults = (OSStatus *)calloc(count, sizeof(*sigResults));
+    if (!sigResults) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    phaseStart = loadTraceNow();
+    checkKextSignatures(checkedKexts, sigResults,
+        /* checkExceptionList */ true, /* earlyBoot */ false,
+        /* cpuUsecs */ NULL);
+    batchTrace.usecs[kLoadPhaseSignCheck] = loadTraceNow() - phaseStart;
+
+    count = CFArrayGetCount(requestedKexts);
+    batchLoadStart = loadTraceNow();
+    for (i = 0; i < count; i++) {
+        OSKextRef osKext = (OSKextRef)CFArrayGetValueAtIndex(requestedKexts, i);
+        LoadTrace trace  = batchTrace;
+
+       /* Time spent loading the kexts ahead of this one counts as queueing.
+        */
+        trace.usecs[kLoadPhaseQueue] += loadTraceNow() - batchLoadStart;
+        trace.usecs[kLoadPhaseResolve] = (uint64_t)(uintptr_t)
+            CFDictionaryGetValue(resolveTimes, osKext);
+        kextdLoadKernelRequestedKext(osKext,
+            CFDictionaryGetValue(loadLists, osKext), checkedKexts, sigResults,
+            &trace);
     }
 
 finish:
-    SAFE_RELEASE(loadList);
+    saveKextSignatureCache();
+    SAFE_RELEASE(requestedKexts);
+    SAFE_RELEASE(checkedKexts);
+    SAFE_RELEASE(loadLists);
+    SAFE_RELEASE(resolveTimes);
+    SAFE_FREE(sigResults);
     SAFE_FREE(kext_id);
-    setCrashLogMessage(NULL);
 
     return;
 }
@@ -815,7 +1697,15 @@ _kextmanager_load_kext(
             &remote_euid, /* egid */ NULL, /* ruid */ NULL, /* rgid */ NULL,
             &remote_pid, /* asid */ NULL, /* au_tid_t */ NULL);
 
-    result = kextdProcessUserLoadRequest(request, remote_euid, remote_pid);
+    if (CFDictionaryContainsKey(request, kKextutilLockScopeKey)) {
+        result = kextdSetKextutilLockScope(
+            CFDictionaryGetValue(request, kKextutilLockScopeKey), remote_euid);
+    } else if (CFDictionaryContainsKey(request, kKextLoadBatchKey)) {
+        result = kextdProcessUserBatchLoadRequest(request,
+            remote_euid, remote_pid);
+    } else {
+        result = kextdProcessUserLoadRequest(request, remote_euid, remote_pid);
+    }
 
 finish:
     SAFE_RELEASE(requestData);
@@ -863,6 +1753,160 @@ const char * nameForPID(pid_t pid)
 #define _kLibraryExtensionsDirSlash   (kLibraryExtensionsDir "/")
 #define _kSystemFilesystemsDirSlash  ("/System/Library/Filesystems/")
 
+/*******************************************************************************
+* Non-root load requests name the same few kexts over and over, and
+* realpath() lstat()s every component of each one's path.  Instead, kextd
+* stat()s the path once and keeps what realpath() returned for the folder with
+* that dev/ino.  A cached path is used only if it still leads to that folder,
+* and the volume watcher empties the cache whenever an extensions folder
+* changes.  The folders a resolved path has to be in are likewise kept as
+* dev/ino, and the path is checked against them rather than by prefix.
+*******************************************************************************/
+#define kRealPathCacheMaxEntries  (256)
+
+typedef struct {
+    const char * path;
+    dev_t        dev;
+    ino_t        ino;
+    Boolean      exists;
+} LoadableFolder;
+
+static pthread_mutex_t          sRealPathCacheLock  = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef   sRealPathCache      = NULL;
+static Boolean                  sLoadableFoldersSet = false;
+static LoadableFolder           sLoadableFolders[]  = {
+    { kSystemExtensionsDir,            0, 0, false },
+    { kLibraryExtensionsDir,           0, 0, false },
+    { "/System/Library/Filesystems",   0, 0, false },
+};
+
+/*******************************************************************************
+*******************************************************************************/
+static CFStringRef
+createRealPathCacheKey(const struct stat * statBuf)
+{
+    return CFStringCreateWithFormat(kCFAllocatorDefault, /* options */ NULL,
+        CFSTR("%llu:%llu"), (unsigned long long)statBuf->st_dev,
+        (unsigned long long)statBuf->st_ino);
+}
+
+/*******************************************************************************
+* Like realpath() for a kext folder, but from the cache when it can be.
+*******************************************************************************/
+static Boolean
+cachedRealPath(const char * path, char resolvedPath[PATH_MAX])
+{
+    Boolean     result      = false;
+    CFStringRef key         = NULL;  // must release
+    CFStringRef cachedPath  = NULL;  // must release
+    struct stat statBuf;
+    struct stat cachedStatBuf;
+
+    if (stat(path, &statBuf) != 0) {
+        goto finish;
+    }
+    key = createRealPathCacheKey(&statBuf);
+    if (!key) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    pthread_mutex_lock(&sRealPathCacheLock);
+    if (sRealPathCache) {
+        cachedPath = CFDictionaryGetValue(sRealPathCache, key);
+        if (cachedPath) {
+            CFRetain(cachedPath);
+        }
+    }
+    pthread_mutex_unlock(&sRealPathCacheLock);
+
+    if (cachedPath &&
+        CFStringGetFileSystemRepresentation(cachedPath, resolvedPath,
+            PATH_MAX) &&
+        stat(resolvedPath, &cachedStatBuf) == 0 &&
+        cachedStatBuf.st_dev == statBuf.st_dev &&
+        cachedStatBuf.st_ino == statBuf.st_ino) {
+
+        result = true;
+        goto finish;
+    }
+
+    if (!realpath(path, resolvedPath)) {
+        goto finish;
+    }
+    result = true;
+
+    SAFE_RELEASE_NULL(cachedPath);
+    cachedPath = CFStringCreateWithFileSystemRepresentation(kCFAllocatorDefault,
+        resolvedPath);
+    if (!cachedPath) {
+        goto finish;
+    }
+    pthread_mutex_lock(&sRealPathCacheLock);
+    if (!sRealPathCache) {
+        sRealPathCache = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    } else if (CFDictionaryGetCount(sRealPathCache) >=
+        kRealPathCacheMaxEntries) {
+
+        CFDictionaryRemoveAllValues(sRealPathCache);
+    }
+    if (sRealPathCache) {
+        CFDictionarySetValue(sRealPathCache, key, cachedPath);
+    }
+    pthread_mutex_unlock(&sRealPathCacheLock);
+
+finish:
+    SAFE_RELEASE(key);
+    SAFE_RELEASE(cachedPath);
+    return result;
+}
+
+/*******************************************************************************
+* Whether resolvedPath is within one of the folders non-root users may
+* load kexts from.
+*******************************************************************************/
+static Boolean
+isInLoadableFolder(const char * resolvedPath)
+{
+    Boolean  result = false;
+    size_t   i;
+
+    pthread_mutex_lock(&sRealPathCacheLock);
+    if (!sLoadableFoldersSet) {
+        for (i = 0; i < sizeof(sLoadableFolders) / sizeof(sLoadableFolders[0]);
+             i++) {
+
+            sLoadableFolders[i].exists = (0 == getFileDevAndIno(
+                sLoadableFolders[i].path, &sLoadableFolders[i].dev,
+                &sLoadableFolders[i].ino));
+        }
+        sLoadableFoldersSet = true;
+    }
+    for (i = 0; !result &&
+         i < sizeof(sLoadableFolders) / sizeof(sLoadableFolders[0]); i++) {
+
+        result = sLoadableFolders[i].exists &&
+            isPathInFolderWithDevAndIno(resolvedPath,
+                sLoadableFolders[i].dev, sLoadableFolders[i].ino);
+    }
+    pthread_mutex_unlock(&sRealPathCacheLock);
+
+    return result;
+}
+
+/*******************************************************************************
+* Called by the volume watcher when the extensions folders change.
+*******************************************************************************/
+void kextdFlushRealPathCache(void)
+{
+    pthread_mutex_lock(&sRealPathCacheLock);
+    SAFE_RELEASE_NULL(sRealPathCache);
+    sLoadableFoldersSet = false;
+    pthread_mutex_unlock(&sRealPathCacheLock);
+    return;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 static CFURLRef createAbsOrRealURLForURL(
@@ -921,7 +1965,7 @@ static CFURLRef createAbsOrRealURLForURL(
             goto finish;
         }
 
-        if (!realpath(urlPathCString, realpathCString)) {
+        if (!cachedRealPath(urlPathCString, realpathCString)) {
 
             localError = kOSReturnError; // xxx - should we have a filesystem error?
             OSKextLog(/* kext */ NULL,
@@ -933,14 +1977,7 @@ static CFURLRef createAbsOrRealURLForURL(
        /*****
         * Check the path once more now that we've resolved it with realpath().
         */
-        inSLE = (0 == strncmp(realpathCString, _kSystemExtensionsDirSlash,
-                              strlen(_kSystemExtensionsDirSlash)));
-        inLE = (0 == strncmp(realpathCString, _kLibraryExtensionsDirSlash,
-                             strlen(_kLibraryExtensionsDirSlash)));
-        inSLF = (0 == strncmp(realpathCString, _kSystemFilesystemsDirSlash,
-                              strlen(_kSystemFilesystemsDirSlash)));
-
-        if (!inSLE && !inSLF && !inLE) {
+        if (!isInLoadableFolder(realpathCString)) {
 
             localError = kOSKextReturnNotPrivileged;
             OSKextLog(/* kext */ NULL,
@@ -977,7 +2014,6 @@ checkNonrootLoadAllowed(
 {
     OSReturn    result       = kOSKextReturnNotPrivileged;
     CFArrayRef  loadList     = NULL;  // must release
-    CFStringRef kextPath     = NULL;  // must release
     Boolean     kextAllows   = TRUE;
     char        kextPathCString[PATH_MAX];
     CFIndex     count, index;
@@ -999,27 +2035,18 @@ checkNonrootLoadAllowed(
             thisKext, CFSTR(kOSBundleAllowUserLoadKey));
         CFURLRef  kextURL = OSKextGetURL(thisKext);
 
-        SAFE_RELEASE_NULL(kextPath);
-
-        kextPath = CFURLCopyFileSystemPath(kextURL, kCFURLPOSIXPathStyle);
-        if (!kextPath) {
-            OSKextLogMemError();
-            result = kOSKextReturnNoMemory;
-        }
-        if (!CFURLGetFileSystemRepresentation(kextURL, /* resolveToBase? */ TRUE,
-            (UInt8 *)kextPathCString, sizeof(kextPathCString))) {
-            strlcpy(kextPathCString, UNKNOWN_KEXT, sizeof(UNKNOWN_KEXT));
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                "Can't get path from URL for kext load request.");
-            result = kOSKextReturnSerialization;
-            goto finish;
-        }
-
+       /* The path is needed only to say which kext isn't allowed.
+        */
         if (!allowed ||
             (CFGetTypeID(allowed) != CFBooleanGetTypeID()) ||
             !CFBooleanGetValue(allowed)) {
 
+            if (!CFURLGetFileSystemRepresentation(kextURL,
+                /* resolveToBase? */ TRUE,
+                (UInt8 *)kextPathCString, sizeof(kextPathCString))) {
+
+                strlcpy(kextPathCString, UNKNOWN_KEXT, sizeof(kextPathCString));
+            }
             kextAllows = FALSE;
             goto finish;
         }
@@ -1029,7 +2056,6 @@ checkNonrootLoadAllowed(
     
 finish:
     SAFE_RELEASE(loadList);
-    SAFE_RELEASE(kextPath);
 
     if (!kextAllows) {
         result = kOSKextReturnNotPrivileged;
@@ -1042,194 +2068,242 @@ finish:
 
     return result;
 }
-
 /*******************************************************************************
+* Reads the kext a user load request names, by identifier or by absolute path.
+* Sets *kextIDOut and *kextIDStringOut for an identifier, or *kextAbsURLOut
+* and kextPathString for a path.
 *******************************************************************************/
-kern_return_t
-kextdProcessUserLoadRequest(
-    CFDictionaryRef request,
-    uid_t           remote_euid,
-    pid_t           remote_pid)
+static OSReturn
+readUserLoadRequestTarget(
+    CFDictionaryRef   request,
+    uid_t             remote_euid,
+    pid_t             remote_pid,
+    CFStringRef     * kextIDOut,
+    char           ** kextIDStringOut,
+    CFURLRef        * kextAbsURLOut,
+    char            * kextPathString,
+    size_t            kextPathStringSize)
 {
-    OSReturn          result                   = kOSReturnSuccess;
-    CFStringRef       kextID                   = NULL;  // do not release
-    char *            kextIDString             = NULL;  // must free
-    CFStringRef       kextPath                 = NULL;  // do not release
-    CFArrayRef        dependencyPaths          = NULL;  // do not release
-    CFURLRef          kextURL                  = NULL;  // must release
-    CFURLRef          kextAbsURL               = NULL;  // must release
-    OSKextRef         theKext                  = NULL;  // must release
-    CFArrayRef        kexts                    = NULL;  // must release
-    CFMutableArrayRef dependencyURLs           = NULL;  // must release
-    CFURLRef          dependencyURL            = NULL;  // must release
-    CFURLRef          dependencyAbsURL         = NULL;  // must release
-    CFArrayRef        dependencyKexts          = NULL;  // must release
-    CFArrayRef        loadList                 = NULL;  // must release
+    OSReturn     result    = kOSReturnError;
+    CFStringRef  kextID    = NULL;  // do not release
+    CFStringRef  kextPath  = NULL;  // do not release
+    CFURLRef     kextURL   = NULL;  // must release
 
-    char              kextPathString[PATH_MAX] = "unknown";
-    char              crashInfo[sizeof(CRASH_INFO_USER_KEXT_LOAD) +
-                      KMOD_MAX_NAME + PATH_MAX];
-    CFIndex           count, index;
+    *kextIDOut = NULL;
+    *kextIDStringOut = NULL;
+    *kextAbsURLOut = NULL;
 
-   /* First get the identifier or URL to load, and convert it to a C string
-    * for logging.
-    */
     kextID = (CFStringRef)CFDictionaryGetValue(request, kKextLoadIdentifierKey);
     if (kextID) {
         if (CFGetTypeID(kextID) != CFStringGetTypeID()) {
             result = kOSKextReturnInvalidArgument;
             goto finish;
         }
-        kextIDString = createUTF8CStringForCFString(kextID);
-        if (!kextIDString) {
+        *kextIDStringOut = createUTF8CStringForCFString(kextID);
+        if (!*kextIDStringOut) {
             OSKextLogMemError();
+            result = kOSKextReturnNoMemory;
             goto finish;
         }
-    } else {
-        kextPath = (CFStringRef)CFDictionaryGetValue(request, kKextLoadPathKey);
-        if (!kextPath || CFGetTypeID(kextPath) != CFStringGetTypeID()) {
-            result = kOSKextReturnInvalidArgument;
-            goto finish;
-        }
+        *kextIDOut = kextID;
+        result = kOSReturnSuccess;
+        goto finish;
+    }
 
-        if (!CFStringHasPrefix(kextPath, CFSTR("/"))) {
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                "Error: Request from '%s' (euid %d) to load kext with relative path.",
-                nameForPID(remote_pid), remote_euid);
-            result = kOSKextReturnInvalidArgument;
-            goto finish;
-        }
+    kextPath = (CFStringRef)CFDictionaryGetValue(request, kKextLoadPathKey);
+    if (!kextPath || CFGetTypeID(kextPath) != CFStringGetTypeID()) {
+        result = kOSKextReturnInvalidArgument;
+        goto finish;
+    }
 
-        kextURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
-            kextPath, kCFURLPOSIXPathStyle, /* isDir? */ true);
-        if (!kextURL) {
-            result = kOSKextReturnSerialization;  // xxx - or other?
-            goto finish;
-        }
-        result = kOSReturnError;
-        kextAbsURL = createAbsOrRealURLForURL(kextURL,
-            remote_euid, remote_pid, &result);
-        if (!kextAbsURL) {
-            goto finish;
+    if (!CFStringHasPrefix(kextPath, CFSTR("/"))) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Error: Request from '%s' (euid %d) to load kext with relative path.",
+            nameForPID(remote_pid), remote_euid);
+        result = kOSKextReturnInvalidArgument;
+        goto finish;
+    }
+
+    kextURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
+        kextPath, kCFURLPOSIXPathStyle, /* isDir? */ true);
+    if (!kextURL) {
+        result = kOSKextReturnSerialization;  // xxx - or other?
+        goto finish;
+    }
+    *kextAbsURLOut = createAbsOrRealURLForURL(kextURL,
+        remote_euid, remote_pid, &result);
+    if (!*kextAbsURLOut) {
+        if (result == kOSReturnSuccess) {
+            result = kOSReturnError;
         }
-        CFURLGetFileSystemRepresentation(kextAbsURL, /* resolveToBase */ true,
-                                         (UInt8 *)kextPathString,
-                                         sizeof(kextPathString));
+        goto finish;
     }
+    CFURLGetFileSystemRepresentation(*kextAbsURLOut, /* resolveToBase */ true,
+                                     (UInt8 *)kextPathString,
+                                     kextPathStringSize);
+    result = kOSReturnSuccess;
 
-   /* Read the extensions if necessary (also resets the release timer).
-    */
-    readExtensions();
+finish:
+    SAFE_RELEASE(kextURL);
+    return result;
+}
 
-   /* Now log before the attempt, then try to look up or create the kext.
-    */
-    if (remote_euid != 0) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                "Request from '%s' (euid %d) to load %s.",
-                  nameForPID(remote_pid), remote_euid,
-                  kextIDString ? kextIDString : kextPathString);
-    }
+/*******************************************************************************
+* Opens any dependencies provided with a user load request. This must happen
+* *before* the requested kexts are created, since a request by identifier
+* must be resolvable from the dependencies as well as system extensions
+* folders. Returns true with *dependencyKextsOut left NULL if the request
+* has no dependencies.
+*******************************************************************************/
+static Boolean
+openUserLoadRequestDependencies(
+    CFDictionaryRef   request,
+    uid_t             remote_euid,
+    pid_t             remote_pid,
+    CFArrayRef      * dependencyKextsOut,
+    OSReturn        * error)
+{
+    Boolean           result            = false;
+    OSReturn          localError        = kOSReturnError;
+    CFArrayRef        dependencyPaths   = NULL;  // do not release
+    CFMutableArrayRef dependencyURLs    = NULL;  // must release
+    CFURLRef          dependencyURL     = NULL;  // must release
+    CFURLRef          dependencyAbsURL  = NULL;  // must release
+    CFIndex           count, index;
+
+    *dependencyKextsOut = NULL;
 
-   /* Open any dependencies provided, *before* we create the kext, since
-    * a request by identifier must be resolvable from the dependencies
-    * as well as system extensions folders.
-    */
     dependencyPaths = (CFArrayRef)CFDictionaryGetValue(request,
         kKextLoadDependenciesKey);
-    if (dependencyPaths) {
-        if (CFGetTypeID(dependencyPaths) != CFArrayGetTypeID()) {
-            result = kOSKextReturnInvalidArgument;
+    if (!dependencyPaths) {
+        localError = kOSReturnSuccess;
+        result = true;
+        goto finish;
+    }
+    if (CFGetTypeID(dependencyPaths) != CFArrayGetTypeID()) {
+        localError = kOSKextReturnInvalidArgument;
+        goto finish;
+    }
+
+    count = CFArrayGetCount(dependencyPaths);
+
+    dependencyURLs = CFArrayCreateMutable(kCFAllocatorDefault,
+        /* capacity */ count,
+        &kCFTypeArrayCallBacks);
+    if (!dependencyURLs) {
+        localError = kOSKextReturnNoMemory;
+        goto finish;
+    }
+
+    for (index = 0; index < count; index++) {
+        CFStringRef thisPath = (CFStringRef)CFArrayGetValueAtIndex(
+            dependencyPaths, index);
+
+        SAFE_RELEASE_NULL(dependencyURL);
+        SAFE_RELEASE_NULL(dependencyAbsURL);
+        if (CFGetTypeID(thisPath) != CFStringGetTypeID()) {
+            localError = kOSKextReturnInvalidArgument;
             goto finish;
         }
-        
-        count = CFArrayGetCount(dependencyPaths);
-
-        dependencyURLs = CFArrayCreateMutable(kCFAllocatorDefault,
-            /* capacity */ count,
-            &kCFTypeArrayCallBacks);
-        if (!dependencyURLs) {
-            result = kOSKextReturnNoMemory;
+        if (!CFStringHasPrefix(thisPath, CFSTR("/"))) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Error: Request to load kext using dependency with relative path.");
+            localError = kOSKextReturnInvalidArgument;
             goto finish;
         }
-        
-        for (index = 0; index < count; index++) {
-            CFStringRef thisPath = (CFStringRef)CFArrayGetValueAtIndex(
-                dependencyPaths, index);
-
-            SAFE_RELEASE_NULL(dependencyURL);
-            SAFE_RELEASE_NULL(dependencyAbsURL);
-            if (CFGetTypeID(thisPath) != CFStringGetTypeID()) {
-                result = kOSKextReturnInvalidArgument;
-                goto finish;
-            }
-            if (!CFStringHasPrefix(thisPath, CFSTR("/"))) {
-                OSKextLog(/* kext */ NULL,
-                    kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-                    "Error: Request to load kext using dependency with relative path.");
-                result = kOSKextReturnInvalidArgument;
-                goto finish;
-            }
 
-            dependencyURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
-                thisPath, kCFURLPOSIXPathStyle, /* isDir? */ true);
-            if (!dependencyURL) {
-                result = kOSKextReturnSerialization;  // xxx - or other?
-                goto finish;
-            }
-            result = kOSReturnError;
-            dependencyAbsURL = createAbsOrRealURLForURL(dependencyURL,
-                remote_euid, remote_pid, &result);
-            if (!dependencyAbsURL) {
-                goto finish;
-            }
-            CFArrayAppendValue(dependencyURLs, dependencyAbsURL);
+        dependencyURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
+            thisPath, kCFURLPOSIXPathStyle, /* isDir? */ true);
+        if (!dependencyURL) {
+            localError = kOSKextReturnSerialization;  // xxx - or other?
+            goto finish;
         }
-        dependencyKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-            dependencyURLs);
-        if (!dependencyKexts) {
-            result = kOSReturnError;
+        localError = kOSReturnError;
+        dependencyAbsURL = createAbsOrRealURLForURL(dependencyURL,
+            remote_euid, remote_pid, &localError);
+        if (!dependencyAbsURL) {
             goto finish;
         }
+        CFArrayAppendValue(dependencyURLs, dependencyAbsURL);
+    }
+    *dependencyKextsOut = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+        dependencyURLs);
+    if (!*dependencyKextsOut) {
+        localError = kOSReturnError;
+        goto finish;
     }
 
-    snprintf(crashInfo, sizeof(crashInfo), CRASH_INFO_USER_KEXT_LOAD,
-            kextIDString ? kextIDString : kextPathString);
+    localError = kOSReturnSuccess;
+    result = true;
 
-    setCrashLogMessage(crashInfo);
+finish:
+    SAFE_RELEASE(dependencyURLs);
+    SAFE_RELEASE(dependencyURL);
+    SAFE_RELEASE(dependencyAbsURL);
 
+    if (error) {
+        *error = localError;
+    }
+    return result;
+}
 
-    if (kextID) {
-        theKext = OSKextGetKextWithIdentifier(kextID);
-        if (theKext) {
-            CFRetain(theKext);  // we're going to release it
-        }
-    } else {
-       /* Make sure we also read the plugins of the kext we're asked to load,
-        * but only if we manage to open the kext itself (or we'll get too many
-        * error messages).
-        */
-        theKext = OSKextCreate(kCFAllocatorDefault, kextAbsURL);
-        if (theKext) {
-            kexts = OSKextCreateKextsFromURL(kCFAllocatorDefault, kextAbsURL);
-            kextIDString = createUTF8CStringForCFString(OSKextGetIdentifier(theKext));
-            if (!kextIDString) {
-                OSKextLogMemError();
-                goto finish;
-            }
+/*******************************************************************************
+* Looks up or creates the kext named by readUserLoadRequestTarget(). For a
+* path, the kext's plugins are also read (into *pluginKextsOut), but only if
+* the kext itself opens, and *kextIDStringOut is set from its identifier.
+*******************************************************************************/
+static OSKextRef
+createUserRequestedKext(
+    CFStringRef    kextID,
+    CFURLRef       kextAbsURL,
+    char        ** kextIDStringOut,
+    CFArrayRef   * pluginKextsOut)
+{
+    OSKextRef result = NULL;
+
+    if (kextID) {
+        result = OSKextGetKextWithIdentifier(kextID);
+        if (result) {
+            CFRetain(result);  // caller releases it
         }
+        goto finish;
     }
 
-    if (!theKext) {
-        OSKextLog(/* kext */ NULL,
-            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
-            "Error: Kext %s - not found/unable to create.",
-            kextIDString ? kextIDString : kextPathString);
-        result = kOSKextReturnNotFound;
-        goto finish;
+    result = OSKextCreate(kCFAllocatorDefault, kextAbsURL);
+    if (result) {
+        *pluginKextsOut = OSKextCreateKextsFromURL(kCFAllocatorDefault,
+            kextAbsURL);
+        SAFE_FREE_NULL(*kextIDStringOut);
+        *kextIDStringOut = createUTF8CStringForCFString(
+            OSKextGetIdentifier(result));
+        if (!*kextIDStringOut) {
+            OSKextLogMemError();
+            SAFE_RELEASE_NULL(result);
+            goto finish;
+        }
     }
 
+finish:
+    return result;
+}
+
+/*******************************************************************************
+* Checks everything besides signatures that decides whether a user process
+* may load theKext: the non-root rules, the exclude list, ESP, and the
+* sandbox.
+*******************************************************************************/
+static OSReturn
+checkUserLoadAllowed(
+    OSKextRef    theKext,
+    const char * kextIDString,
+    const char * kextPathString,
+    uid_t        remote_euid,
+    pid_t        remote_pid)
+{
+    OSReturn result = kOSReturnSuccess;
+
     if (remote_euid != 0) {
         result = checkNonrootLoadAllowed(theKext, remote_euid, remote_pid);
         if (result != kOSReturnSuccess) {
@@ -1242,10 +2316,8 @@ kextdProcessUserLoadRequest(
         CFMutableDictionaryRef myAlertInfoDict = NULL; // must release
         addKextToAlertDict(&myAlertInfoDict, theKext);
         if (myAlertInfoDict) {
-            CFRetain(myAlertInfoDict); // writeKextAlertPlist will release
-            dispatch_async(dispatch_get_main_queue(), ^ {
-                writeKextAlertPlist(myAlertInfoDict, EXCLUDED_KEXT_ALERT);
-            });
+            CFRetain(myAlertInfoDict); // queueKextAlertPlist will release
+            queueKextAlertPlist(myAlertInfoDict, EXCLUDED_KEXT_ALERT);
             SAFE_RELEASE(myAlertInfoDict);
         }
 
@@ -1293,6 +2365,133 @@ kextdProcessUserLoadRequest(
         goto finish;
     }
 
+finish:
+    return result;
+}
+
+/*******************************************************************************
+* Loads a kext for a user process once it has passed all checks.
+*******************************************************************************/
+static OSReturn
+loadUserRequestedKext(OSKextRef theKext)
+{
+    OSReturn result = kOSReturnError;
+
+    CFBooleanRef pgoref = (CFBooleanRef)
+        OSKextGetValueForInfoDictionaryKey(theKext, CFSTR("PGO"));
+    bool pgo = false;
+    if (pgoref &&
+        CFGetTypeID(pgoref) == CFBooleanGetTypeID())
+    {
+        pgo = CFBooleanGetValue(pgoref);
+    }
+
+    /* The codepath from this function will do any error logging
+     * and cleanup needed.
+     */
+    result = OSKextLoadWithOptions(theKext,
+        /* statExclusion */ kOSKextExcludeNone,
+        /* addPersonalitiesExclusion */ kOSKextExcludeNone,
+        /* personalityNames */ NULL,
+        /* delayAutounloadFlag */ pgo);
+
+    if (pgo && result == kOSReturnSuccess)
+    {
+        pgo_start_thread(theKext);
+    }
+
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+kern_return_t
+kextdProcessUserLoadRequest(
+    CFDictionaryRef request,
+    uid_t           remote_euid,
+    pid_t           remote_pid)
+{
+    OSReturn          result                   = kOSReturnSuccess;
+    CFStringRef       kextID                   = NULL;  // do not release
+    char *            kextIDString             = NULL;  // must free
+    CFURLRef          kextAbsURL               = NULL;  // must release
+    OSKextRef         theKext                  = NULL;  // must release
+    CFArrayRef        kexts                    = NULL;  // must release
+    CFArrayRef        dependencyKexts          = NULL;  // must release
+    LoadTrace         trace;
+    uint64_t          phaseStart               = loadTraceNow();
+
+    char              kextPathString[PATH_MAX] = "unknown";
+    char              crashInfo[sizeof(CRASH_INFO_USER_KEXT_LOAD) +
+                      KMOD_MAX_NAME + PATH_MAX];
+
+   /* MIG gives no way to see how long the request sat in the queue, so
+    * trace.usecs[kLoadPhaseQueue] stays 0 for user requests.
+    */
+    bzero(&trace, sizeof(trace));
+
+   /* First get the identifier or URL to load, and convert it to a C string
+    * for logging.
+    */
+    result = readUserLoadRequestTarget(request, remote_euid, remote_pid,
+        &kextID, &kextIDString, &kextAbsURL,
+        kextPathString, sizeof(kextPathString));
+    if (result != kOSReturnSuccess) {
+        goto finish;
+    }
+
+   /* Read the extensions if necessary (also resets the release timer).
+    */
+    readExtensions();
+
+   /* Now log before the attempt, then try to look up or create the kext.
+    */
+    if (remote_euid != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Request from '%s' (euid %d) to load %s.",
+                  nameForPID(remote_pid), remote_euid,
+                  kextIDString ? kextIDString : kextPathString);
+    }
+
+    if (!openUserLoadRequestDependencies(request, remote_euid, remote_pid,
+        &dependencyKexts, &result)) {
+
+        goto finish;
+    }
+
+    snprintf(crashInfo, sizeof(crashInfo), CRASH_INFO_USER_KEXT_LOAD,
+            kextIDString ? kextIDString : kextPathString);
+
+    setCrashLogMessage(crashInfo);
+
+    theKext = createUserRequestedKext(kextID, kextAbsURL,
+        &kextIDString, &kexts);
+    if (!theKext) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Error: Kext %s - not found/unable to create.",
+            kextIDString ? kextIDString : kextPathString);
+        result = kOSKextReturnNotFound;
+        goto finish;
+    }
+
+    trace.usecs[kLoadPhaseRead] = loadTraceNow() - phaseStart;
+
+    result = checkUserLoadAllowed(theKext, kextIDString, kextPathString,
+        remote_euid, remote_pid);
+    if (result != kOSReturnSuccess) {
+        goto finish;
+    }
+
+   /* Resolve up front so the signature and load phases below don't
+    * include it; a failure is reported by the load itself.
+    */
+    phaseStart = loadTraceNow();
+    (void)OSKextResolveDependencies(theKext);
+    trace.usecs[kLoadPhaseResolve] = loadTraceNow() - phaseStart;
+
+    phaseStart = loadTraceNow();
     OSStatus    sigResult = checkKextSignature(theKext, true, false);
     if ( sigResult != 0 ) {
         if ( isInvalidSignatureAllowed() ) {
@@ -1327,43 +2526,352 @@ kextdProcessUserLoadRequest(
         result = kOSKextReturnNotLoadable;
         goto finish;
     }
-    
-    CFBooleanRef pgoref = (CFBooleanRef)
-        OSKextGetValueForInfoDictionaryKey(theKext, CFSTR("PGO"));
-    bool pgo = false;
-    if (pgoref &&
-        CFGetTypeID(pgoref) == CFBooleanGetTypeID())
-    {
-        pgo = CFBooleanGetValue(pgoref);
-    }
-
-    /* The codepath from this function will do any error logging
-     * and cleanup needed.
-     */
-    result = OSKextLoadWithOptions(theKext,
-        /* statExclusion */ kOSKextExcludeNone,
-        /* addPersonalitiesExclusion */ kOSKextExcludeNone,
-        /* personalityNames */ NULL,
-        /* delayAutounloadFlag */ pgo);
+    trace.usecs[kLoadPhaseSignCheck] = loadTraceNow() - phaseStart;
 
-    if (pgo && result == kOSReturnSuccess)
-    {
-        pgo_start_thread(theKext);
-    }
+   /* The kernel sends the personalities as part of the load, so for user
+    * requests kLoadPhasePersonalities is included in kLoadPhaseKernelLoad.
+    */
+    phaseStart = loadTraceNow();
+    result = loadUserRequestedKext(theKext);
+    trace.usecs[kLoadPhaseKernelLoad] = loadTraceNow() - phaseStart;
+    recordLoadTrace(theKext, &trace);
     
 finish:            
-    SAFE_RELEASE(kextURL);
+    saveKextSignatureCache();
     SAFE_RELEASE(kextAbsURL);
     SAFE_RELEASE(kexts);
     SAFE_RELEASE(theKext);
-    SAFE_RELEASE(dependencyURLs);
-    SAFE_RELEASE(dependencyURL);
-    SAFE_RELEASE(dependencyAbsURL);
     SAFE_RELEASE(dependencyKexts);
-    SAFE_RELEASE(loadList);
     SAFE_FREE(kextIDString);
 
     setCrashLogMessage(NULL);
 
     return result;
 }
+
+/*******************************************************************************
+* Batch user load requests.
+*
+* A request carrying kKextLoadBatchKey names several kexts, each as its own
+* identifier or path dictionary, sharing the request's dependency paths.
+* The extensions and dependencies are read once, the signatures of every
+* kext any of them needs are checked once and concurrently, and the
+* requested kexts are loaded in dependency order, so that one named kext
+* that depends on another loads after it. A kext whose requested dependency
+* failed to load is skipped, as is a malformed entry, so that one bad entry
+* doesn't keep the others from loading. The kernel takes load requests one at
+* a time, so the loads themselves are serial. Returns the first failure, if
+* any.
+*******************************************************************************/
+typedef struct {
+    CFStringRef   kextID;                    // do not release
+    char        * kextIDString;              // must free
+    CFURLRef      kextAbsURL;                // must release
+    char          kextPathString[PATH_MAX];
+    Boolean       valid;
+} UserLoadTarget;
+
+kern_return_t
+kextdProcessUserBatchLoadRequest(
+    CFDictionaryRef request,
+    uid_t           remote_euid,
+    pid_t           remote_pid)
+{
+    OSReturn                result          = kOSReturnSuccess;
+    OSReturn                kextResult      = kOSReturnSuccess;
+    CFArrayRef              batch           = NULL;  // do not release
+    UserLoadTarget        * targets         = NULL;  // must free
+    CFIndex                 numTargets      = 0;
+    CFArrayRef              dependencyKexts = NULL;  // must release
+    CFMutableArrayRef       openedKexts     = NULL;  // must release
+    CFMutableArrayRef       requestedKexts  = NULL;  // must release
+    CFMutableArrayRef       checkedKexts    = NULL;  // must release
+    CFMutableArrayRef       failedKexts     = NULL;  // must release
+    CFMutableDictionaryRef  loadLists       = NULL;  // must release
+    CFMutableDictionaryRef  resolveTimes    = NULL;  // must release
+    OSStatus              * sigResults      = NULL;  // must free
+    char                  * kext_id         = NULL;  // must free
+    char                    crashInfo[sizeof(CRASH_INFO_USER_KEXT_LOAD) +
+                            KMOD_MAX_NAME + PATH_MAX];
+    LoadTrace               batchTrace;
+    uint64_t                phaseStart      = loadTraceNow();
+    uint64_t                batchLoadStart;
+    CFIndex                 count, i;
+
+    bzero(&batchTrace, sizeof(batchTrace));
+
+    batch = (CFArrayRef)CFDictionaryGetValue(request, kKextLoadBatchKey);
+    if (!batch || CFGetTypeID(batch) != CFArrayGetTypeID() ||
+        !CFArrayGetCount(batch)) {
+
+        result = kOSKextReturnInvalidArgument;
+        goto finish;
+    }
+
+    loadLists = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    resolveTimes = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, NULL);
+    targets = (UserLoadTarget *)calloc(CFArrayGetCount(batch),
+        sizeof(*targets));
+    if (!loadLists || !resolveTimes || !targets ||
+        !createCFMutableArray(&openedKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&requestedKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&checkedKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&failedKexts, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        result = kOSKextReturnNoMemory;
+        goto finish;
+    }
+
+   /* Skip a malformed entry and keep going with the rest, as loading the
+    * kexts one request at a time would.
+    */
+    count = CFArrayGetCount(batch);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef   entry   = CFArrayGetValueAtIndex(batch, i);
+        UserLoadTarget  * target  = &targets[i];
+
+        numTargets++;
+        strlcpy(target->kextPathString, "unknown",
+            sizeof(target->kextPathString));
+        if (CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+            kextResult = kOSKextReturnInvalidArgument;
+        } else {
+            kextResult = readUserLoadRequestTarget(entry,
+                remote_euid, remote_pid,
+                &target->kextID, &target->kextIDString, &target->kextAbsURL,
+                target->kextPathString, sizeof(target->kextPathString));
+        }
+        if (kextResult == kOSKextReturnNoMemory) {
+            result = kextResult;
+            goto finish;
+        }
+        if (kextResult != kOSReturnSuccess) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Skipping invalid entry %d in batch load request from '%s' "
+                "(euid %d).",
+                (int)i, nameForPID(remote_pid), remote_euid);
+            if (result == kOSReturnSuccess) {
+                result = kextResult;
+            }
+            continue;
+        }
+        target->valid = true;
+    }
+
+   /* Read the extensions if necessary (also resets the release timer).
+    */
+    readExtensions();
+
+    if (remote_euid != 0) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Request from '%s' (euid %d) to load %d kexts.",
+            nameForPID(remote_pid), remote_euid, (int)numTargets);
+    }
+
+    if (!openUserLoadRequestDependencies(request, remote_euid, remote_pid,
+        &dependencyKexts, &kextResult)) {
+
+        result = kextResult;
+        goto finish;
+    }
+    batchTrace.usecs[kLoadPhaseRead] = loadTraceNow() - phaseStart;
+
+    for (i = 0; i < numTargets; i++) {
+        UserLoadTarget  * target      = &targets[i];
+        const char      * kextName    = NULL;  // do not free
+        OSKextRef         theKext     = NULL;  // must release
+        CFArrayRef        pluginKexts = NULL;  // must release
+        CFArrayRef        loadList    = NULL;  // must release
+
+        if (!target->valid) {
+            continue;
+        }
+
+        phaseStart = loadTraceNow();
+        theKext = createUserRequestedKext(target->kextID, target->kextAbsURL,
+            &target->kextIDString, &pluginKexts);
+        batchTrace.usecs[kLoadPhaseRead] += loadTraceNow() - phaseStart;
+        kextName = target->kextIDString ?
+            target->kextIDString : target->kextPathString;
+        if (pluginKexts) {
+            CFArrayAppendArray(openedKexts, pluginKexts, RANGE_ALL(pluginKexts));
+            SAFE_RELEASE_NULL(pluginKexts);
+        }
+        if (!theKext) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "Error: Kext %s - not found/unable to create.", kextName);
+            if (result == kOSReturnSuccess) {
+                result = kOSKextReturnNotFound;
+            }
+            continue;
+        }
+        CFArrayAppendValue(openedKexts, theKext);
+
+        if (CFArrayContainsValue(requestedKexts, RANGE_ALL(requestedKexts),
+            theKext)) {
+
+            SAFE_RELEASE(theKext);
+            continue;
+        }
+
+        kextResult = checkUserLoadAllowed(theKext, target->kextIDString,
+            target->kextPathString, remote_euid, remote_pid);
+        if (kextResult != kOSReturnSuccess) {
+            if (result == kOSReturnSuccess) {
+                result = kextResult;
+            }
+            SAFE_RELEASE(theKext);
+            continue;
+        }
+        CFArrayAppendValue(requestedKexts, theKext);
+
+       /* The load list holds theKext itself last, after its dependencies,
+        * so merging the lists in order keeps checkedKexts in dependency order.
+        */
+        phaseStart = loadTraceNow();
+        loadList = OSKextCopyLoadList(theKext, /* needAll? */ true);
+        CFDictionarySetValue(resolveTimes, theKext,
+            (const void *)(uintptr_t)(loadTraceNow() - phaseStart));
+        if (loadList) {
+            CFIndex numDependencies = CFArrayGetCount(loadList);
+
+            for (CFIndex j = 0; j < numDependencies; j++) {
+                addToArrayIfAbsent(checkedKexts,
+                    CFArrayGetValueAtIndex(loadList, j));
+            }
+            CFDictionarySetValue(loadLists, theKext, loadList);
+            SAFE_RELEASE(loadList);
+        }
+        addToArrayIfAbsent(checkedKexts, theKext);
+        SAFE_RELEASE(theKext);
+    }
+
+    count = CFArrayGetCount(checkedKexts);
+    if (!count) {
+        goto finish;
+    }
+    sigResults = (OSStatus *)calloc(count, sizeof(*sigResults));
+    if (!sigResults) {
+        OSKextLogMemError();
+        result = kOSKextReturnNoMemory;
+        goto finish;
+    }
+    phaseStart = loadTraceNow();
+    checkKextSignatures(checkedKexts, sigResults,
+        /* checkExceptionList */ true, /* earlyBoot */ false,
+        /* cpuUsecs */ NULL);
+    batchTrace.usecs[kLoadPhaseSignCheck] = loadTraceNow() - phaseStart;
+
+    batchLoadStart = loadTraceNow();
+    for (i = 0; i < count; i++) {
+        OSKextRef   theKext      = (OSKextRef)CFArrayGetValueAtIndex(
+                                       checkedKexts, i);
+        CFArrayRef  loadList     = NULL;  // do not release
+        LoadTrace   trace        = batchTrace;
+        CFIndex     numDependencies;
+
+        if (!CFArrayContainsValue(requestedKexts, RANGE_ALL(requestedKexts),
+            theKext)) {
+
+            continue;
+        }
+
+        SAFE_FREE_NULL(kext_id);
+        kext_id = createUTF8CStringForCFString(OSKextGetIdentifier(theKext));
+        if (!kext_id) {
+            OSKextLogMemError();
+            result = kOSKextReturnNoMemory;
+            goto finish;
+        }
+
+        snprintf(crashInfo, sizeof(crashInfo), CRASH_INFO_USER_KEXT_LOAD,
+            kext_id);
+        setCrashLogMessage(crashInfo);
+
+        kextResult = kOSReturnSuccess;
+        if (!loadSignatureAllowed(theKext, sigResults[i])) {
+            kextResult = kOSKextReturnNotLoadable;
+        }
+
+        loadList = CFDictionaryGetValue(loadLists, theKext);
+        numDependencies = loadList ? CFArrayGetCount(loadList) : 0;
+        for (CFIndex j = 0;
+            kextResult == kOSReturnSuccess && j < numDependencies;
+            j++) {
+
+            OSKextRef myKext = (OSKextRef)CFArrayGetValueAtIndex(loadList, j);
+            CFIndex   k;
+
+            if (myKext == theKext) {
+                continue;
+            }
+            if (CFArrayContainsValue(failedKexts, RANGE_ALL(failedKexts),
+                myKext)) {
+
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogLoadFlag |
+                    kOSKextLogDependenciesFlag | kOSKextLogIPCFlag,
+                    "Not loading %s; a kext it depends on failed to load.",
+                    kext_id);
+                kextResult = kOSKextReturnDependencyLoadError;
+                break;
+            }
+            k = CFArrayGetFirstIndexOfValue(checkedKexts,
+                RANGE_ALL(checkedKexts), myKext);
+            if (!loadSignatureAllowed(myKext, sigResults[k])) {
+                OSKextLog(/* kext */ NULL,
+                          kOSKextLogErrorLevel | kOSKextLogLoadFlag |
+                          kOSKextLogDependenciesFlag | kOSKextLogIPCFlag,
+                          "Signature failure in dependencies for kext load request.");
+                kextResult = kOSKextReturnNotLoadable;
+            }
+        }
+
+        if (kextResult == kOSReturnSuccess) {
+           /* Time spent loading the kexts ahead of this one counts as
+            * queueing.
+            */
+            trace.usecs[kLoadPhaseQueue] = loadTraceNow() - batchLoadStart;
+            trace.usecs[kLoadPhaseResolve] = (uint64_t)(uintptr_t)
+                CFDictionaryGetValue(resolveTimes, theKext);
+            phaseStart = loadTraceNow();
+            kextResult = loadUserRequestedKext(theKext);
+            trace.usecs[kLoadPhaseKernelLoad] = loadTraceNow() - phaseStart;
+            recordLoadTrace(theKext, &trace);
+        }
+        if (kextResult != kOSReturnSuccess) {
+            CFArrayAppendValue(failedKexts, theKext);
+            if (result == kOSReturnSuccess) {
+                result = kextResult;
+            }
+        }
+        setCrashLogMessage(NULL);
+    }
+
+finish:
+    saveKextSignatureCache();
+    for (i = 0; i < numTargets; i++) {
+        SAFE_FREE(targets[i].kextIDString);
+        SAFE_RELEASE(targets[i].kextAbsURL);
+    }
+    SAFE_FREE(targets);
+    SAFE_RELEASE(dependencyKexts);
+    SAFE_RELEASE(openedKexts);
+    SAFE_RELEASE(requestedKexts);
+    SAFE_RELEASE(checkedKexts);
+    SAFE_RELEASE(failedKexts);
+    SAFE_RELEASE(loadLists);
+    SAFE_RELEASE(resolveTimes);
+    SAFE_FREE(sigResults);
+    SAFE_FREE(kext_id);
+
+    setCrashLogMessage(NULL);
+
+    return result;
+}
@@ -36,5 +36,8 @@
 #include "kext_tools_util.h"
 
 bool kextd_process_kernel_requests(void);
+void kextdUpdateKextIndex(CFArrayRef kexts);
+void kextdFlushKextIndex(void);
+void kextdFlushRealPathCache(void);
 
 #endif /* __REQUEST_H__ */
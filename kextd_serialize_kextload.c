@@ -33,8 +33,9 @@
 #include <dispatch/dispatch.h>
 
 dispatch_source_t _gKextutilLock = NULL;
+CFMutableSetRef   _gKextutilLockScope = NULL;
 
-void kextd_process_kernel_requests(void);
+bool kextd_process_kernel_requests(void);
 
 /******************************************************************************
  * _kextmanager_lock_volume tries to lock volumes for clients (kextutil)
@@ -44,6 +45,7 @@ static void removeKextutilLock(void)
     if (_gKextutilLock) {
         dispatch_source_cancel(_gKextutilLock);
     }
+    SAFE_RELEASE_NULL(_gKextutilLockScope);
     
     if (gKernelRequestsPending) {
         kextd_process_kernel_requests();
@@ -130,6 +132,59 @@ finish:
     return mig_result;
 }
 
+/******************************************************************************
+ * kextdSetKextutilLockScope narrows the kextutil lock to the kexts it's
+ * loading (a kKextutilLockScopeKey request), so kernel requests for
+ * unrelated kexts go ahead, including any held back until now.
+ *****************************************************************************/
+OSReturn kextdSetKextutilLockScope(CFArrayRef kextIDs, uid_t remote_euid)
+{
+    OSReturn result = kOSKextReturnInvalidArgument;
+    CFIndex  count, i;
+
+    if (remote_euid != 0 || !_gKextutilLock) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Request to narrow kextutil lock without holding it.");
+        result = kOSKextReturnNotPrivileged;
+        goto finish;
+    }
+    if (CFGetTypeID(kextIDs) != CFArrayGetTypeID()) {
+        goto finish;
+    }
+
+    SAFE_RELEASE_NULL(_gKextutilLockScope);
+    if (!createCFMutableSet(&_gKextutilLockScope, &kCFTypeSetCallBacks)) {
+        OSKextLogMemError();
+        result = kOSKextReturnNoMemory;
+        goto finish;
+    }
+    count = CFArrayGetCount(kextIDs);
+    for (i = 0; i < count; i++) {
+        CFStringRef kextID = CFArrayGetValueAtIndex(kextIDs, i);
+
+        if (CFGetTypeID(kextID) != CFStringGetTypeID()) {
+            SAFE_RELEASE_NULL(_gKextutilLockScope);
+            goto finish;
+        }
+        CFSetAddValue(_gKextutilLockScope, kextID);
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogIPCFlag,
+        "Kextutil lock narrowed to %d kexts.", (int)count);
+
+    if (gKernelRequestsPending) {
+        if (kextd_process_kernel_requests()) {
+            CFRunLoopStop(CFRunLoopGetCurrent());
+        }
+    }
+    result = kOSReturnSuccess;
+
+finish:
+    return result;
+}
+
 /******************************************************************************
  * _kextmanager_unlock_kextload unlocks for clients (kextutil)
  *****************************************************************************/
@@ -28,6 +28,7 @@
 
 #include <IOKit/kext/kextmanager_types.h>
 #include <IOKit/kext/OSKextPrivate.h>
+#include <dispatch/dispatch.h>
 
 #include "kextd_usernotification.h"
 #include "security.h"
@@ -81,6 +82,21 @@ CFRunLoopSourceRef      sExcludedKextNotificationRunLoopSource = NULL;  // must
 
 CFDictionaryRef         sKextTranslationsPlist            = NULL;
 
+/* Alert and message-trace plist updates run on sAlertQueue rather than
+ * on the run loop serving load requests.  Posts queued before a drain
+ * runs are coalesced, so each drain rewrites a plist at most once per
+ * alert type, and takes no more than kAlertBatchMax posts so new posts
+ * aren't starved by a long burst.  The queued arrays are only touched
+ * on sAlertQueue.
+ */
+#define kNumAlertTypes  (EXCLUDED_KEXT_ALERT + 1)
+#define kAlertBatchMax  (32)
+
+static dispatch_queue_t  sAlertQueue                       = NULL;
+static CFMutableArrayRef sQueuedAlertDicts[kNumAlertTypes] = { NULL };  // must release
+static CFMutableArrayRef sQueuedKextLoads                  = NULL;  // must release
+static Boolean           sAlertDrainPending                = false;
+
 static void _sessionDidChange(
     SCDynamicStoreRef store,
     CFArrayRef        changedKeys,
@@ -131,6 +147,12 @@ static void kextd_raise_excludedkext_notification(
                                                   CFStringRef alertHeader,
                                                   CFArrayRef  alertMessageArray );
 static int validateKextsAlertDict( CFDictionaryRef theDict );
+static dispatch_queue_t getAlertQueue(void);
+static void scheduleAlertDrain(void);
+static void drainAlertQueue(void);
+static void writeKextAlertPlist( CFArrayRef theKextArray, int theAlertType );
+static void writeKextLoadPlist( CFArrayRef theArray );
+static void postKextAlertPaths( CFArrayRef thePaths, int theAlertType );
 
 
 /*******************************************************************************
@@ -1474,6 +1496,200 @@ static void revealInFinder(CFArrayRef theArray)
     return;
 }
 
+/*******************************************************************************
+ * queueKextAlertPlist() - queue an alert dictionary (see addKextToAlertDict())
+ * for writeKextAlertPlist() on sAlertQueue.  Callable from any thread; it
+ * never waits on the plist files.
+ * NOTE - this routine must drop reference to theDict.
+ *******************************************************************************/
+void queueKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
+{
+    if (theDict == NULL) {
+        return;
+    }
+    if (theAlertType <= 0 || theAlertType >= kNumAlertTypes) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                  "%s: unknown alert type %d.", __func__, theAlertType);
+        CFRelease(theDict);
+        return;
+    }
+
+    dispatch_async(getAlertQueue(), ^ {
+        if (sQueuedAlertDicts[theAlertType] == NULL &&
+            !createCFMutableArray(&sQueuedAlertDicts[theAlertType],
+                                  &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+        }
+        else {
+            CFArrayAppendValue(sQueuedAlertDicts[theAlertType], theDict);
+            scheduleAlertDrain();
+        }
+        CFRelease(theDict);
+    });
+    return;
+}
+
+/*******************************************************************************
+ * queueKextLoadPlist() - queue an array of loaded kext info dictionaries for
+ * writeKextLoadPlist() on sAlertQueue.
+ * NOTE - this routine must drop reference to theArray.
+ *******************************************************************************/
+void queueKextLoadPlist( CFArrayRef theArray )
+{
+    if (theArray == NULL) {
+        return;
+    }
+
+    dispatch_async(getAlertQueue(), ^ {
+        if (sQueuedKextLoads == NULL &&
+            !createCFMutableArray(&sQueuedKextLoads, &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+        }
+        else {
+            CFArrayAppendValue(sQueuedKextLoads, theArray);
+            scheduleAlertDrain();
+        }
+        CFRelease(theArray);
+    });
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static dispatch_queue_t getAlertQueue(void)
+{
+    static dispatch_once_t onceToken;
+
+    dispatch_once(&onceToken, ^ {
+        sAlertQueue = dispatch_queue_create("com.apple.kextd.alerts",
+                                            DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(sAlertQueue,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    });
+    return sAlertQueue;
+}
+
+/*******************************************************************************
+ * Must be called on sAlertQueue.  The drain goes behind any posts already
+ * queued, so a burst is picked up by a single drain.
+ *******************************************************************************/
+static void scheduleAlertDrain(void)
+{
+    if (sAlertDrainPending) {
+        return;
+    }
+    sAlertDrainPending = true;
+    dispatch_async(sAlertQueue, ^ {
+        drainAlertQueue();
+    });
+    return;
+}
+
+/*******************************************************************************
+ * Merge the entries of up to theMax arrays at the front of theQueue into
+ * theMerged, dropping duplicates, and remove them from theQueue.  Alert
+ * dictionaries are validated first and their kext info arrays merged.
+ * Returns the number of queued items consumed.
+ *******************************************************************************/
+static CFIndex mergeQueuedItems(
+    CFMutableArrayRef theQueue,
+    CFIndex           theMax,
+    Boolean           isAlertDict,
+    CFMutableArrayRef theMerged)
+{
+    CFIndex     count, i, j;
+
+    count = CFArrayGetCount(theQueue);
+    if (count > theMax) {
+        count = theMax;
+    }
+    for (i = 0; i < count; i++) {
+        CFTypeRef   myItem     = CFArrayGetValueAtIndex(theQueue, i);
+        CFArrayRef  myKextInfo = NULL;  // do NOT release
+
+        if (isAlertDict) {
+            if (validateKextsAlertDict((CFDictionaryRef)myItem) != 0) {
+                continue;
+            }
+            myKextInfo = CFDictionaryGetValue((CFDictionaryRef)myItem,
+                                              CFSTR("KextInfoArrayKey"));
+        }
+        else {
+            myKextInfo = (CFArrayRef)myItem;
+        }
+        for (j = 0; j < CFArrayGetCount(myKextInfo); j++) {
+            CFTypeRef myInfo = CFArrayGetValueAtIndex(myKextInfo, j);
+
+            if (!CFArrayContainsValue(theMerged, RANGE_ALL(theMerged), myInfo)) {
+                CFArrayAppendValue(theMerged, myInfo);
+            }
+        }
+    }
+    CFArrayReplaceValues(theQueue, CFRangeMake(0, count), NULL, 0);
+    return count;
+}
+
+/*******************************************************************************
+ * drainAlertQueue() writes each alert plist (and the loaded kext plist) at
+ * most once for up to kAlertBatchMax queued posts, then reschedules itself
+ * if more are waiting.
+ *******************************************************************************/
+static void drainAlertQueue(void)
+{
+    CFMutableArrayRef   myMerged    = NULL;  // must release
+    CFIndex             budget      = kAlertBatchMax;
+    Boolean             morePending = false;
+    int                 alertType;
+
+    sAlertDrainPending = false;
+
+    for (alertType = 1; alertType < kNumAlertTypes; alertType++) {
+        if (!sQueuedAlertDicts[alertType] ||
+            !CFArrayGetCount(sQueuedAlertDicts[alertType])) {
+            continue;
+        }
+        if (budget == 0) {
+            morePending = true;
+            break;
+        }
+        SAFE_RELEASE_NULL(myMerged);
+        if (!createCFMutableArray(&myMerged, &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        budget -= mergeQueuedItems(sQueuedAlertDicts[alertType], budget,
+                                   /* isAlertDict */ true, myMerged);
+        if (CFArrayGetCount(sQueuedAlertDicts[alertType])) {
+            morePending = true;
+        }
+        if (CFArrayGetCount(myMerged)) {
+            writeKextAlertPlist(myMerged, alertType);
+        }
+    }
+
+    if (sQueuedKextLoads && CFArrayGetCount(sQueuedKextLoads)) {
+        SAFE_RELEASE_NULL(myMerged);
+        if (!createCFMutableArray(&myMerged, &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        mergeQueuedItems(sQueuedKextLoads, kAlertBatchMax,
+                         /* isAlertDict */ false, myMerged);
+        if (CFArrayGetCount(sQueuedKextLoads)) {
+            morePending = true;
+        }
+        writeKextLoadPlist(myMerged);
+    }
+
+finish:
+    if (morePending) {
+        scheduleAlertDrain();
+    }
+    SAFE_RELEASE(myMerged);
+    return;
+}
+
 /*******************************************************************************
  * writeKextAlertPlist() - update or create one of our alert plist files:
  *     invalidsignedkextalert.plist
@@ -1485,7 +1701,7 @@ static void revealInFinder(CFArrayRef theArray)
  * We use these plist files to control which kexts we have displayed an alert
  * dialog about.
  * Marketing only wanted us to alert once.  Accees to this routine needs to be
- * synchronized (all callers use a dispatch queue).
+ * synchronized, so it only runs on sAlertQueue (see queueKextAlertPlist()).
  *
  * The plist files are located at:
  * /System/Library/Caches/com.apple.kext.caches/Startup/
@@ -1507,13 +1723,12 @@ static void revealInFinder(CFArrayRef theArray)
  </dict>
  </plist>
  *
- * see addKextToAlertDict() for layout of theDict.
- * NOTE - this routine must drop reference to theDict.
+ * theKextArray is the "KextInfoArrayKey" array of one or more validated
+ * alert dictionaries; see addKextToAlertDict() for their layout.
  *******************************************************************************/
 
-void writeKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
+static void writeKextAlertPlist( CFArrayRef theKextArray, int theAlertType )
 {
-    CFArrayRef              myKextArray;             // do NOT release
     CFURLRef                myURL           = NULL;  // must release
     CFStringRef             myPath          = NULL;  // must release
     CFReadStreamRef         readStream      = NULL;  // must release
@@ -1524,11 +1739,6 @@ void writeKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
     Boolean                 closeReadStream     = false;
     Boolean                 closeWriteStream    = false;
   
-    if (validateKextsAlertDict(theDict) != 0) {
-        goto finish;
-    }
-    
-    myKextArray = (CFArrayRef) CFDictionaryGetValue(theDict, CFSTR("KextInfoArrayKey"));
     myPath = createPathFromAlertType(NULL, theAlertType);
     if (myPath == NULL) {
         OSKextLogMemError();
@@ -1582,7 +1792,7 @@ void writeKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
         /* add any kext paths that are not already known */
         Boolean     didAppend = false;
         
-        didAppend = sendKextAlertNotifications(&sentArray, myKextArray, theAlertType);
+        didAppend = sendKextAlertNotifications(&sentArray, theKextArray, theAlertType);
         
         /* now replace previous plist with our updated one */
         if (didAppend) {
@@ -1616,7 +1826,7 @@ void writeKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
         }
         
         /* add our array to the dictionary */
-        CFDictionarySetValue(alertDict, CFSTR("Alerts sent"), myKextArray);
+        CFDictionarySetValue(alertDict, CFSTR("Alerts sent"), theKextArray);
         
         alertPlist = CFPropertyListCreateDeepCopy(
                                                   kCFAllocatorDefault,
@@ -1645,7 +1855,7 @@ void writeKextAlertPlist( CFDictionaryRef theDict, int theAlertType )
                             0,
                             NULL);
         
-        sendKextAlertNotifications(NULL, myKextArray, theAlertType);
+        sendKextAlertNotifications(NULL, theKextArray, theAlertType);
     }
     
 finish:
@@ -1665,7 +1875,6 @@ finish:
     SAFE_RELEASE(alertPlist);
     SAFE_RELEASE(alertDict);
     SAFE_RELEASE(myPath);
-    SAFE_RELEASE(theDict);
     
     return;
 }
@@ -1725,6 +1934,8 @@ finish:
  * once about the same kext or class of kexts when we have bundle ID to 
  * mappings to a vendor or product.  theSentAlertsArray is an array of the
  * kexts we have alerted.
+ * This runs on sAlertQueue; the alert messages are handed to the main
+ * thread, which owns the pended arrays.
  */
 // NOTE - we have decided to not use bundle mappings for the alert messages
 // at this point.  So for now myMappingKey will always be NULL.
@@ -1732,9 +1943,15 @@ static Boolean sendKextAlertNotifications(CFMutableArrayRef *theSentAlertsArrayP
                                           CFArrayRef theKextsArray,
                                           int theAlertType)
 {
-    Boolean     didAppend = false;
-    CFIndex     count, i;
+    Boolean             didAppend = false;
+    CFMutableArrayRef   myPaths   = NULL;   // must release
+    CFIndex             count, i;
     
+    if (!createCFMutableArray(&myPaths, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
     count = CFArrayGetCount(theKextsArray);
     for (i = 0; i < count; i++) {
         CFDictionaryRef         myDict;                 // do NOT release
@@ -1760,38 +1977,76 @@ static Boolean sendKextAlertNotifications(CFMutableArrayRef *theSentAlertsArrayP
         
         /* nag user about this kext */
         myKextMessage = getKextAlertMessage(myDict, myMappingKey);
+        if (myKextMessage) {
+            CFArrayAppendValue(myPaths, myKextMessage);
+        }
+        SAFE_RELEASE_NULL(myMappingKey);
+    } // for loop...
+    
+    postKextAlertPaths(myPaths, theAlertType);
+
+finish:
+    SAFE_RELEASE(myPaths);
+    return(didAppend);
+}
+
+/*******************************************************************************
+ * postKextAlertPaths() hands alert messages from sAlertQueue to the main
+ * thread, which records them and signals the notification queue source.
+ *******************************************************************************/
+static void postKextAlertPaths( CFArrayRef thePaths, int theAlertType )
+{
+    if (!CFArrayGetCount(thePaths)) {
+        return;
+    }
+
+    CFRetain(thePaths);
+    dispatch_async(dispatch_get_main_queue(), ^ {
+        CFIndex count, i;
+
+        /* alerts can't be raised before the pended arrays exist */
+        if (sNotificationQueueRunLoopSource == NULL) {
+            CFRelease(thePaths);
+            return;
+        }
+
+        count = CFArrayGetCount(thePaths);
+        for (i = 0; i < count; i++) {
+            CFStringRef myKextMessage = CFArrayGetValueAtIndex(thePaths, i);
+
+            if (theAlertType == INVALID_SIGNATURE_KEXT_ALERT) {
+                recordInvalidSignedKextPath(myKextMessage);
+            }
+            else if (theAlertType == NO_LOAD_KEXT_ALERT) {
+                recordNoLoadKextPath(myKextMessage);
+            }
+            else if (theAlertType == EXCLUDED_KEXT_ALERT) {
+                recordExcludedKextPath(myKextMessage);
+            }
+#if 0 // not yet
+            else if (theAlertType == UNSIGNED_KEXT_ALERT) {
+                recordUnsignedKextPath(myKextMessage);
+            }
+#endif
+        }
+
         if (theAlertType == INVALID_SIGNATURE_KEXT_ALERT) {
-            recordInvalidSignedKextPath(myKextMessage);
+            sendInvalidSignedKextNotification();
         }
         else if (theAlertType == NO_LOAD_KEXT_ALERT) {
-            recordNoLoadKextPath(myKextMessage);
+            sendNoLoadKextNotification();
         }
         else if (theAlertType == EXCLUDED_KEXT_ALERT) {
-            recordExcludedKextPath(myKextMessage);
+            sendExcludedKextNotification();
         }
 #if 0 // not yet
         else if (theAlertType == UNSIGNED_KEXT_ALERT) {
-            recordUnsignedKextPath(myKextMessage);
+            sendUnsignedKextNotification();
         }
 #endif
-        SAFE_RELEASE_NULL(myMappingKey);
-    } // for loop...
-    
-    if (theAlertType == INVALID_SIGNATURE_KEXT_ALERT) {
-        sendInvalidSignedKextNotification();
-    }
-    else if (theAlertType == NO_LOAD_KEXT_ALERT) {
-        sendNoLoadKextNotification();
-    }
-    else if (theAlertType == EXCLUDED_KEXT_ALERT) {
-        sendExcludedKextNotification();
-    }
-#if 0 // not yet
-    else if (theAlertType == UNSIGNED_KEXT_ALERT) {
-        sendUnsignedKextNotification();
-    }
-#endif
-    return(didAppend);
+        CFRelease(thePaths);
+    });
+    return;
 }
 
 
@@ -1872,7 +2127,7 @@ _kOSKextCachesRootFolder "/" \
 _kOSKextStartupCachesSubfolder "/" \
 "loadedkextmt.plist"
 
-void writeKextLoadPlist( CFArrayRef theArray )
+static void writeKextLoadPlist( CFArrayRef theArray )
 {
     CFURLRef                myURL           = NULL;  // must release
     CFReadStreamRef         readStream      = NULL;  // must release
@@ -2018,7 +2273,6 @@ finish:
     SAFE_RELEASE(writeStream);
     SAFE_RELEASE(alertPlist);
     SAFE_RELEASE(alertDict);
-    SAFE_RELEASE(theArray);
     
     return;
 }
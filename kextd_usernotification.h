@@ -49,8 +49,8 @@ Boolean recordNonSignedKextPath(CFStringRef theKextPath);
 void    resetUserNotifications(Boolean dismissAlert);
 void    sendNonsignedKextNotification(void);
 
-void writeKextAlertPlist(CFDictionaryRef theDict, int theAlertType);
-void writeKextLoadPlist(CFArrayRef theArray);
+void queueKextAlertPlist(CFDictionaryRef theDict, int theAlertType);
+void queueKextLoadPlist(CFArrayRef theArray);
 void sendRevokedCertAlert(CFDictionaryRef theDict);
 
 void kextd_raise_notification(
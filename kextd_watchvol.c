@@ -32,6 +32,8 @@
  * 2. generate a data structure for each incoming comprehensible OS volume
  * 2a. set up notifications for all relevant paths on said volume
  *     [notifications <-> structures]
+ *     one FSEvents stream per volume covers all of its paths and says which
+ *     cache input changed; notify(3) tokens per path are the fallback
  * (2) uses bootcaches.plist to describe what caches a system needs.
  *     All top-level keys are assumed required (which means the mkext could
  *     get fancier in the future if an old-fashioned mkext was still okay).
@@ -85,6 +87,7 @@
 
 #include <bless.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>     // FSEvents
 #include <DiskArbitration/DiskArbitration.h>
 #include <DiskArbitration/DiskArbitrationPrivate.h>
 #include <IOKit/kext/kextmanager_types.h>
@@ -102,6 +105,7 @@ extern uint32_t notify_get_event(int token, int *ev, char *buf, int *len);
 
 // project includes
 #include "kextd_main.h"                 // handleSignal()
+#include "kextd_request.h"              // kextdFlushRealPathCache()
 #include "kextd_watchvol.h"             // kextd_watch_volumes
 #include "kextd_globals.h"              // gClientUID
 #include "kextd_usernotification.h"     // kextd_raise_notification
@@ -115,8 +119,11 @@ extern uint32_t notify_get_event(int token, int *ev, char *buf, int *len);
 #define kAutoUpdateDelay    300
 #define kWatchKeyBase       "com.apple.system.kextd.fswatch"
 #define kWatchSettleTime    5
+#define kMaxWatchSettleTime 60  // longest a burst of changes can stretch it
+#define kMaxBackoffShift    4   // settle time doubles per error up to 16x
 #define kMaxUpdateFailures  5   // consecutive failures
 #define kMaxUpdateAttempts  25  // reset after failure->success
+#define kFSEventsLatency    1.0 // seconds FSEvents coalesces for us
 // XXX after 25 successful updates, touching /S/L/E becomes lame
 // 6227955 dictates the failure->success reset metric 
 // should instead detect 25 back-to-back attempts
@@ -131,6 +138,22 @@ extern uint32_t notify_get_event(int token, int *ev, char *buf, int *len);
 #define kMTEndShutdownDelay         "endShutdownDelay"
 
 
+// which cache input a watched path is; changes are attributed to these so
+// check_rebuild() only stats what might be stale
+enum {
+    kWatchInputBootCaches   = 1 << 0,   // bootcaches.plist
+    kWatchInputInstaller    = 1 << 1,   // installd.commit.pid
+    kWatchInputExts         = 1 << 2,   // extensions directories
+    kWatchInputKernel       = 1 << 3,   // kernel(s) & extra kernelcaches
+    kWatchInputCaches       = 1 << 4,   // rpspaths (prelinked kernel, etc)
+    kWatchInputBootFiles    = 1 << 5,   // booters, misc, EFI login resources
+};
+#define kWatchInputsAll     ((1 << 6) - 1)
+// bootcaches.plist may change anything; installer changes were put off
+#define kWatchInputsCheckAll    (kWatchInputBootCaches | kWatchInputInstaller)
+#define kWatchInputsKernelCache (kWatchInputExts | kWatchInputKernel | \
+                                 kWatchInputCaches)
+
 // the type: struct watchedVol's (struct bootCaches in bootcaches.h)
 // created/destroyed with volumes coming/going; stored in sFsysWatchDict
 // use notify_set_state on our notifications to point to these objects
@@ -144,10 +167,18 @@ struct watchedVol {
     uint32_t origMntFlags;      // mount flags to restore if owners were off
     Boolean isBootRoot;         // should we try to update helpers?
 
-    CFMutableArrayRef tokens;   // notify(3) tokens
+    CFMutableArrayRef tokens;   // notify(3) tokens if fsStream failed
+    FSEventStreamRef fsStream;  // FSEvents for all of watchPaths
+    CFMutableArrayRef watchPaths;   // absolute paths (CFStrings) watched
+    CFMutableArrayRef watchInputs;  // kWatchInput* for each of watchPaths
+    uint32_t changedInputs;     // kWatchInput*s changed since last check
+    Boolean rebuildFailed;      // last rebuild failed; next check covers all inputs
     struct bootCaches *caches;  // parsed version of bootcaches.plist
 
-    // XX should track the PID of any launched kextcache (5736801)
+    pid_t rebuildPid;           // kextcache -u we launched, until it exits
+    Boolean rebuildPending;     // changes arrived while it ran or its disk was busy
+    char wholeDisk[DEVMAXPATHSIZE]; // DA whole disk; one update per device
+    CFAbsoluteTime settleTime;  // current debounce; grows during a burst
 };
 
 // module-wide data
@@ -188,11 +219,17 @@ static Boolean check_vol_busy(struct watchedVol *watched);
 
 // notification processing delay scheme
 static void fsys_changed(CFMachPortRef p, void *msg, CFIndex size, void *info);
+static void fsevents_changed(ConstFSEventStreamRef stream, void *info,
+                             size_t numEvents, void *eventPaths,
+                             const FSEventStreamEventFlags eventFlags[],
+                             const FSEventStreamEventId eventIds[]);
 static void checkScheduleUpdate(struct watchedVol *watched);
+static void scheduleRebuildCheck(struct watchedVol *watched);
+static void schedule_capped_rebuild(const void *key, const void *val, void *ctx);
 static void check_now(CFRunLoopTimerRef timer, void *ctx);    // notify timer cb
 
 // check and act
-static Boolean check_rebuild(struct watchedVol*);   // true if launched
+static Boolean check_rebuild(struct watchedVol*, uint32_t inputs); // launched?
 
 // CFMachPort invalidation callback
 static void port_died(CFMachPortRef p, void *info);
@@ -429,6 +466,13 @@ static void destroy_watchedVol(struct watchedVol *watched)
     int errnum;
 
     // assert that ->delayer, and ->lock have already been cleaned up
+    if (watched->fsStream) {
+        FSEventStreamStop(watched->fsStream);
+        FSEventStreamInvalidate(watched->fsStream);
+        FSEventStreamRelease(watched->fsStream);
+    }
+    if (watched->watchPaths)    CFRelease(watched->watchPaths);
+    if (watched->watchInputs)   CFRelease(watched->watchInputs);
     if (watched->tokens) {
         ntokens = CFArrayGetCount(watched->tokens);
         while(ntokens--) {
@@ -453,6 +497,8 @@ static void destroy_watchedVol(struct watchedVol *watched)
 static struct watchedVol* create_watchedVol(DADiskRef disk)
 {
     struct watchedVol *watched, *rval = NULL;
+    DADiskRef wholeDisk = NULL;     // must release
+    const char *bsdName;
     char *errmsg;
 
     errmsg = "allocation error";
@@ -468,6 +514,13 @@ static struct watchedVol* create_watchedVol(DADiskRef disk)
 
     watched->isBootRoot = hasBootRootBoots(watched->caches, NULL, NULL, NULL);
 
+    // volumes sharing a whole disk (spindle) take turns updating
+    wholeDisk = DADiskCopyWholeDisk(disk);
+    bsdName = wholeDisk ? DADiskGetBSDName(wholeDisk) : DADiskGetBSDName(disk);
+    if (bsdName) {
+        strlcpy(watched->wholeDisk, bsdName, sizeof(watched->wholeDisk));
+    }
+
     // get rid of any old bootstamps
     if (!watched->isBootRoot) {
         (void)updateStamps(watched->caches, kBCStampsUnlinkOnly);
@@ -478,6 +531,10 @@ static struct watchedVol* create_watchedVol(DADiskRef disk)
     errmsg = "allocation error";
     watched->tokens = CFArrayCreateMutable(nil, 0, NULL);
     if (!watched->tokens)   goto finish;
+    watched->watchPaths = CFArrayCreateMutable(nil, 0, &kCFTypeArrayCallBacks);
+    if (!watched->watchPaths)   goto finish;
+    watched->watchInputs = CFArrayCreateMutable(nil, 0, NULL);
+    if (!watched->watchInputs)  goto finish;
 
     errmsg = NULL;
     rval = watched;     // success!
@@ -497,6 +554,7 @@ finish:
     if (!rval && watched) {
         destroy_watchedVol(watched);
     }
+    if (wholeDisk)  CFRelease(wholeDisk);
     
     return rval;
 }
@@ -653,7 +711,140 @@ finish:
     return rval;
 }
 
-#define WATCH(watched, fullp, relpath, fsPort) do { \
+/******************************************************************************
+ * add_watch_path records a path and which cache input it is; start_watching()
+ * then watches all of them at once.  FSEvents reports real paths, so we
+ * record real paths (just the parent's if the path doesn't exist yet).
+ *****************************************************************************/
+static int
+add_watch_path(struct watchedVol *watched, const char *path, uint32_t input)
+{
+    int rval = ELAST + 1;
+    char realPath[PATH_MAX];
+    char parent[PATH_MAX];
+    char *lastSlash;
+    CFStringRef pathStr = NULL;     // must release
+
+    if (!realpath(path, realPath)) {
+        if (strlcpy(parent, path, PATH_MAX) >= PATH_MAX)     goto finish;
+        lastSlash = strrchr(parent, '/');
+        if (!lastSlash || lastSlash == parent)      goto finish;
+        *lastSlash = '\0';
+        if (!realpath(parent, realPath) ||
+            strlcat(realPath, path + (lastSlash - parent), PATH_MAX) >= PATH_MAX) {
+            // not there at all; keep the path as given
+            if (strlcpy(realPath, path, PATH_MAX) >= PATH_MAX)  goto finish;
+        }
+    }
+
+    pathStr = CFStringCreateWithFileSystemRepresentation(nil, realPath);
+    if (!pathStr)   goto finish;
+    CFArrayAppendValue(watched->watchPaths, pathStr);
+    CFArrayAppendValue(watched->watchInputs, (void*)(intptr_t)input);
+
+    rval = 0;
+
+finish:
+    if (pathStr)    CFRelease(pathStr);
+    if (rval) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDetailLevel | kOSKextLogFileAccessFlag,
+            "add_watch_path: can't watch '%s'.", path);
+    }
+
+    return rval;
+}
+
+/******************************************************************************
+ * start_watching creates one FSEvents stream for a volume's watchPaths.
+ * Files are watched through their directories (FSEvents streams are rooted
+ * at directories); fsevents_changed() filters out everything else.  If the
+ * stream can't be created, fall back to a notify(3) token per path.
+ *****************************************************************************/
+static int
+start_watching(struct watchedVol *watched, mach_port_t fsPort)
+{
+    int rval = ELAST + 1;
+    FSEventStreamContext ctx = { 0, watched, NULL, NULL, NULL };
+    CFMutableArrayRef roots = NULL;     // must release
+    CFStringRef pathStr;                // do not release
+    CFStringRef rootStr = NULL;         // must release
+    CFURLRef pathURL = NULL;            // must release
+    CFURLRef parentURL = NULL;          // must release
+    char path[PATH_MAX];
+    struct stat sb;
+    CFIndex i, count;
+
+    count = CFArrayGetCount(watched->watchPaths);
+    roots = CFArrayCreateMutable(nil, count, &kCFTypeArrayCallBacks);
+    if (!roots)     goto fallback;
+
+    for (i = 0; i < count; i++) {
+        pathStr = CFArrayGetValueAtIndex(watched->watchPaths, i);
+        SAFE_RELEASE_NULL(rootStr);
+        SAFE_RELEASE_NULL(pathURL);
+        SAFE_RELEASE_NULL(parentURL);
+
+        if (!CFStringGetFileSystemRepresentation(pathStr, path, PATH_MAX))
+            goto fallback;
+        if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            rootStr = CFRetain(pathStr);
+        } else {
+            pathURL = CFURLCreateWithFileSystemPath(nil, pathStr,
+                kCFURLPOSIXPathStyle, false);
+            if (!pathURL)   goto fallback;
+            parentURL = CFURLCreateCopyDeletingLastPathComponent(nil, pathURL);
+            if (!parentURL) goto fallback;
+            rootStr = CFURLCopyFileSystemPath(parentURL, kCFURLPOSIXPathStyle);
+            if (!rootStr)   goto fallback;
+        }
+        if (!CFArrayContainsValue(roots, RANGE_ALL(roots), rootStr)) {
+            CFArrayAppendValue(roots, rootStr);
+        }
+    }
+
+    watched->fsStream = FSEventStreamCreate(nil, fsevents_changed, &ctx,
+        roots, kFSEventStreamEventIdSinceNow, kFSEventsLatency,
+        kFSEventStreamCreateFlagUseCFTypes | kFSEventStreamCreateFlagFileEvents);
+    if (!watched->fsStream)     goto fallback;
+    FSEventStreamScheduleWithRunLoop(watched->fsStream, CFRunLoopGetCurrent(),
+        kCFRunLoopDefaultMode);
+    if (!FSEventStreamStart(watched->fsStream)) {
+        FSEventStreamInvalidate(watched->fsStream);
+        FSEventStreamRelease(watched->fsStream);
+        watched->fsStream = NULL;
+        goto fallback;
+    }
+
+    OSKextLog(/* kext */ NULL, kOSKextLogDetailLevel | kOSKextLogIPCFlag,
+        "%s: watching %ld paths from %ld directories.",
+        watched->caches->root, (long)count, (long)CFArrayGetCount(roots));
+    rval = 0;
+    goto finish;
+
+fallback:
+    OSKextLog(/* kext */ NULL, kOSKextLogWarningLevel | kOSKextLogIPCFlag,
+        "%s: can't create FSEvents stream; watching paths one by one.",
+        watched->caches->root);
+    for (i = 0; i < count; i++) {
+        pathStr = CFArrayGetValueAtIndex(watched->watchPaths, i);
+        if (!CFStringGetFileSystemRepresentation(pathStr, path, PATH_MAX))
+            goto finish;
+        if (watch_path(path, fsPort, watched))
+            goto finish;
+    }
+    rval = 0;
+
+finish:
+    SAFE_RELEASE(roots);
+    SAFE_RELEASE(rootStr);
+    SAFE_RELEASE(pathURL);
+    SAFE_RELEASE(parentURL);
+
+    return rval;
+}
+
+#define WATCH(watched, fullp, relpath, input) do { \
         /* MAKEROOTPATH */ \
         COMPILE_TIME_ASSERT(sizeof(fullp) == PATH_MAX); \
         if (strlcpy(fullp, watched->caches->root, PATH_MAX) >= PATH_MAX) \
@@ -661,7 +852,7 @@ finish:
         if (strlcat(fullp, relpath, PATH_MAX) >= PATH_MAX) \
             goto finish; \
         \
-        if (watch_path(fullp, fsPort, watched)) \
+        if (add_watch_path(watched, fullp, input)) \
             goto finish; \
     } while(0)
 #define kInstallCommitPath "/private/var/run/installd.commit.pid"
@@ -669,14 +860,13 @@ finish:
 #if DEV_KERNEL_SUPPORT
 /******************************************************************************
  * watch_kernels gets the parent of the kernel file then enumerates the given
- * directory and calls watch_path for each "valid" kernel file in that
+ * directory and calls add_watch_path for each "valid" kernel file in that
  * directory.  NOTE - "valid" currently means files named "kernel.SUFFIX"
  *****************************************************************************/
 static void
 watch_kernels(
               struct watchedVol *  watched,
-              const char *         kernelPath,
-              mach_port_t          fsPort )
+              const char *         kernelPath )
 {
     CFURLRef                kernelURL       = NULL; // must release
     CFURLRef                kernelsDirURL   = NULL; // must release
@@ -719,7 +909,7 @@ watch_kernels(
                                          true /*resolve*/,
                                          (UInt8*)tempPath,
                                          sizeof(tempPath)) ) {
-        watch_path(tempPath, fsPort, watched);
+        (void)add_watch_path(watched, tempPath, kWatchInputKernel);
     }
     
     myEnumerator = CFURLEnumeratorCreateForDirectoryURL(
@@ -766,7 +956,7 @@ watch_kernels(
                                              true /*resolve*/,
                                              (UInt8*)tempPath,
                                              sizeof(tempPath)) ) {
-            watch_path(tempPath, fsPort, watched);
+            (void)add_watch_path(watched, tempPath, kWatchInputKernel);
         }
     } // while loop
     
@@ -864,57 +1054,60 @@ static void vol_appeared(DADiskRef disk, void *launchCtx)
      * locSrcs, rpspaths[], booters, miscpaths[] }
      * rpspaths contains mkext, bootconfig; miscpaths the label file
      * cache paths are relative; WATCH() makes absolute */
-    WATCH(watched, path, kBootCachesPath, fsPort);
-    WATCH(watched, path, kInstallCommitPath, fsPort);
+    WATCH(watched, path, kBootCachesPath, kWatchInputBootCaches);
+    WATCH(watched, path, kInstallCommitPath, kWatchInputInstaller);
     
     /* support multiple extensions directories - 11860417 */
     char    *bufptr;
     bufptr = caches->exts;
     for (i = 0; i < caches->nexts; i++) {
-        WATCH(watched, path, bufptr, fsPort);
+        WATCH(watched, path, bufptr, kWatchInputExts);
         bufptr += (strlen(bufptr) + 1);
     }
     
     // newer systems kernelpath is /System/Library/Kernels/kernel
     // older systems kernelpath is /mach_kernel
-    WATCH(watched, path, caches->kernelpath, fsPort);
+    WATCH(watched, path, caches->kernelpath, kWatchInputKernel);
 #if DEV_KERNEL_SUPPORT
     // look for other kernels and watch them too.
     if (caches->kernelsCount > 0) {
-        watch_kernels(watched, caches->kernelpath, fsPort);
+        watch_kernels(watched, caches->kernelpath);
      
         // watch any other kernelcache files (kernelcache.SUFFIX)
         if (watched->caches->extraKernelCachePaths) {
             for (i = 0; i < watched->caches->nekcp; i++) {
-                WATCH(watched, path, caches->extraKernelCachePaths[i].rpath, fsPort);
+                WATCH(watched, path, caches->extraKernelCachePaths[i].rpath,
+                      kWatchInputKernel);
            }
         }
     }
 #endif
     
-    WATCH(watched, path, caches->locSource, fsPort);
-    WATCH(watched, path, caches->bgImage, fsPort);
+    WATCH(watched, path, caches->locSource, kWatchInputBootFiles);
+    WATCH(watched, path, caches->bgImage, kWatchInputBootFiles);
     // XXX commenting out until 9498428 makes watching this file
     // more efficient (and probably replaces locPref with an array).
-    // WATCH(watched, path, caches->locPref, fsPort);
+    // WATCH(watched, path, caches->locPref, kWatchInputBootFiles);
 
     // loop over RPS paths
     for (i = 0; i < caches->nrps; i++) {
-        WATCH(watched, path, caches->rpspaths[i].rpath, fsPort);
+        WATCH(watched, path, caches->rpspaths[i].rpath, kWatchInputCaches);
     }
 
     if (caches->efibooter.rpath[0]) {
-        WATCH(watched, path, caches->efibooter.rpath, fsPort);
+        WATCH(watched, path, caches->efibooter.rpath, kWatchInputBootFiles);
     }
     if (caches->ofbooter.rpath[0]) {
-        WATCH(watched, path, caches->ofbooter.rpath, fsPort);
+        WATCH(watched, path, caches->ofbooter.rpath, kWatchInputBootFiles);
     }
 
     // loop over misc paths
     for (i = 0; i < caches->nmisc; i++) {
-        WATCH(watched, path, caches->miscpaths[i].rpath, fsPort);
+        WATCH(watched, path, caches->miscpaths[i].rpath, kWatchInputBootFiles);
     }
 
+    if (start_watching(watched, fsPort))        goto finish;
+
     // we handled any pre-existing entry for volUUID above
     CFDictionarySetValue(sFsysWatchDict, volUUID, watched);
 
@@ -924,7 +1117,7 @@ static void vol_appeared(DADiskRef disk, void *launchCtx)
                 "ignoring '%s' until boot is complete", 
                 watched->caches->root);
     } else {
-        launched = check_rebuild(watched);
+        launched = check_rebuild(watched, kWatchInputsAll);
     }
 
     // reconsiderVolume() uses launchCtx to get its return value
@@ -987,7 +1180,7 @@ check_boots_set_nvram(struct watchedVol *watched)
             OSKextLog(NULL, kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
                         "%s now has Apple_Boot partition%s", volbsdname, s);
             watched->isBootRoot = true;
-            check_rebuild(watched);
+            check_rebuild(watched, kWatchInputsAll);
 
             // and if it was the root volume, re-point NVRAM
             if (0 == strcmp(watched->caches->root, "/") && curSDPreferred) {
@@ -1122,6 +1315,9 @@ static void vol_disappeared(DADiskRef disk, void* ctx)
     watched = (void*)CFDictionaryGetValue(sFsysWatchDict, volUUID);
     if (!watched)   goto finish;
 
+    // its device number may be reused by the next volume to appear
+    kextdFlushRealPathCache();
+
     if (0 == strcmp(watched->caches->root, "/")) {
         OSKextLog(NULL, kOSKextLogWarningLevel | kOSKextLogIPCFlag,
                   "[8755513] vol_disappeared() refusing to stop watching '/'");
@@ -1146,6 +1342,10 @@ static void vol_disappeared(DADiskRef disk, void* ctx)
         CFRunLoopTimerInvalidate(watched->delayer);     // refcount->0
         watched->delayer = NULL;
     }
+    if (watched->rebuildPid) {
+        watched->rebuildPid = 0;        // its exit will no longer match
+        CFDictionaryApplyFunction(sFsysWatchDict, schedule_capped_rebuild, NULL);
+    }
     // see if any lockers are waiting 
     // (off the list of watched vols so no new requests can come in)
     if (watched->waiters) {
@@ -1250,7 +1450,9 @@ static Boolean check_vol_busy(struct watchedVol *watched)
     // if not locked and not over error limits, call check_rebuild
     if (watched->updterrs < kMaxUpdateFailures &&
             watched->updtattempts < kMaxUpdateAttempts) {
-        busy = check_rebuild(watched);
+        // waiting behind another update on the same disk counts as busy
+        busy = check_rebuild(watched, kWatchInputsAll) ||
+               watched->rebuildPending;
     } else {
         // over limits; log an error
         OSKextLog(/* kext */ NULL, kOSKextLogWarningLevel | kOSKextLogIPCFlag,
@@ -1306,6 +1508,74 @@ finish:
     return;
 }
 
+/******************************************************************************
+ * fsevents_changed gets FSEvents for a volume's watchPaths' directories
+ * - attribute each event to the cache inputs it touched, ignoring the rest
+ * - if FSEvents dropped or coalesced events, assume everything changed
+ *****************************************************************************/
+static void
+fsevents_changed(ConstFSEventStreamRef stream, void *info,
+                 size_t numEvents, void *eventPaths,
+                 const FSEventStreamEventFlags eventFlags[],
+                 const FSEventStreamEventId eventIds[] __unused)
+{
+    struct watchedVol *watched = (struct watchedVol*)info;
+    CFArrayRef paths = (CFArrayRef)eventPaths;
+    CFStringRef eventPath;          // do not release
+    CFStringRef watchPath;          // do not release
+    CFIndex watchLen;
+    uint32_t inputs = 0;
+    size_t ev;
+    CFIndex i, count;
+
+    count = CFArrayGetCount(watched->watchPaths);
+    for (ev = 0; ev < numEvents; ev++) {
+        // volume coming or going: vol_changed() & co. take care of that
+        if (eventFlags[ev] & (kFSEventStreamEventFlagMount |
+                              kFSEventStreamEventFlagUnmount)) {
+            continue;
+        }
+        if (eventFlags[ev] & (kFSEventStreamEventFlagMustScanSubDirs |
+                              kFSEventStreamEventFlagRootChanged)) {
+            inputs = kWatchInputsAll;
+            break;
+        }
+
+        // a watched path or anything inside a watched directory
+        eventPath = CFArrayGetValueAtIndex(paths, ev);
+        for (i = 0; i < count; i++) {
+            watchPath = CFArrayGetValueAtIndex(watched->watchPaths, i);
+            watchLen = CFStringGetLength(watchPath);
+            if (CFStringHasPrefix(eventPath, watchPath) &&
+                (CFStringGetLength(eventPath) == watchLen ||
+                 CFStringGetCharacterAtIndex(eventPath, watchLen) == '/')) {
+                inputs |= (uint32_t)(intptr_t)
+                    CFArrayGetValueAtIndex(watched->watchInputs, i);
+            }
+        }
+    }
+
+    if (!inputs) {
+        goto finish;
+    }
+    OSKextLog(/* kext */ NULL, kOSKextLogDebugLevel | kOSKextLogFileAccessFlag,
+        "%s: cache inputs 0x%x changed.", watched->caches->root, inputs);
+
+    // kext load requests may have resolved paths that just changed
+    if (inputs & kWatchInputExts) {
+        kextdFlushRealPathCache();
+    }
+
+   /* Accumulate until check_rebuild() looks at them; changes put off while
+    * the installer runs are still there when it finishes.
+    */
+    watched->changedInputs |= inputs;
+    checkScheduleUpdate(watched);
+
+finish:
+    return;
+}
+
 static void
 checkScheduleUpdate(struct watchedVol *watched)
 {
@@ -1387,27 +1657,146 @@ checkScheduleUpdate(struct watchedVol *watched)
         // check whether the startup delay has passed
         // (XX could let 'touch' work before the startup delay has passed?)
         // and prepare to call check_now in a few seconds
-        CFRunLoopTimerContext tc = { 0, watched, NULL, NULL, NULL };
-        CFAbsoluteTime firetime = CFAbsoluteTimeGetCurrent() + kWatchSettleTime;
+        scheduleRebuildCheck(watched);
+    }
 
-        // cancel any existing timer
-        if (watched->delayer) {
-            CFRunLoopTimerInvalidate(watched->delayer);
-        }
+finish:
+    return;
+}
 
-        watched->delayer=CFRunLoopTimerCreate(nil,firetime,0,0,0,check_now,&tc);
-        if (!watched->delayer) {
-            OSKextLogCFString(/* kext */ NULL,
-                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
-                 CFSTR("fsys_changed() unable to create timer for watched volume."));
-            goto finish;
+/******************************************************************************
+ * scheduleRebuildCheck debounces changes to a volume into one check_now()
+ * - while a kextcache we launched is running, just note that more changes
+ *   came in; kextd_rebuild_exited() schedules one check for all of them
+ * - each change during a pending wait pushes it out and lengthens the
+ *   settle time (up to kMaxWatchSettleTime) so a long install coalesces
+ * - recent failures (updterrs) and attempts (updtattempts) back it off
+ *****************************************************************************/
+static void
+scheduleRebuildCheck(struct watchedVol *watched)
+{
+    CFRunLoopTimerContext tc = { 0, watched, NULL, NULL, NULL };
+    CFAbsoluteTime delay;
+    int shift;
+
+    if (watched->rebuildPid) {
+        watched->rebuildPending = true;
+        goto finish;
+    }
+
+    if (watched->settleTime < kWatchSettleTime) {
+        watched->settleTime = kWatchSettleTime;
+    } else if (watched->delayer) {
+        watched->settleTime += kWatchSettleTime;
+        if (watched->settleTime > kMaxWatchSettleTime) {
+            watched->settleTime = kMaxWatchSettleTime;
         }
+    }
+    shift = watched->updterrs < kMaxBackoffShift ?
+            watched->updterrs : kMaxBackoffShift;
+    delay = watched->settleTime * (1 << shift) +
+            watched->updtattempts * kWatchSettleTime;
 
-        CFRunLoopAddTimer(CFRunLoopGetCurrent(), watched->delayer,
-            kCFRunLoopDefaultMode);
-        CFRelease(watched->delayer);  // later auto-invalidation will free
+    // cancel any existing timer
+    if (watched->delayer) {
+        CFRunLoopTimerInvalidate(watched->delayer);
     }
 
+    watched->delayer = CFRunLoopTimerCreate(nil,
+        CFAbsoluteTimeGetCurrent() + delay, 0, 0, 0, check_now, &tc);
+    if (!watched->delayer) {
+        OSKextLogCFString(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+             CFSTR("fsys_changed() unable to create timer for watched volume."));
+        goto finish;
+    }
+
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), watched->delayer,
+        kCFRunLoopDefaultMode);
+    CFRelease(watched->delayer);  // later auto-invalidation will free
+
+finish:
+    return;
+}
+
+/******************************************************************************
+ * kextd_rebuild_exited is called for each child kextd reaps
+ * - frees the rebuild slot and folds changes seen meanwhile into one check
+ * - volumes waiting on the concurrency cap get their turn
+ *****************************************************************************/
+typedef struct {
+    pid_t pid;
+    struct watchedVol *exited;
+} RebuildExitContext;
+
+static void find_rebuild_pid(const void *key, const void *val, void *ctx)
+{
+    struct watchedVol *watched = (struct watchedVol*)val;
+    RebuildExitContext *rec = (RebuildExitContext*)ctx;
+
+    if (watched->rebuildPid == rec->pid) {
+        rec->exited = watched;
+    }
+}
+
+typedef struct {
+    struct watchedVol *watched;
+    Boolean busy;
+} DeviceBusyContext;
+
+static void check_device_busy(const void *key, const void *val, void *ctx)
+{
+    struct watchedVol *other = (struct watchedVol*)val;
+    DeviceBusyContext *dbc = (DeviceBusyContext*)ctx;
+
+    if (other != dbc->watched && other->rebuildPid &&
+        dbc->watched->wholeDisk[0] &&
+        0 == strcmp(other->wholeDisk, dbc->watched->wholeDisk)) {
+        dbc->busy = true;
+    }
+}
+
+// true if another volume on the same whole disk is being updated
+static Boolean device_rebuild_running(struct watchedVol *watched)
+{
+    DeviceBusyContext dbc = { watched, false };
+
+    if (sFsysWatchDict) {
+        CFDictionaryApplyFunction(sFsysWatchDict, check_device_busy, &dbc);
+    }
+    return dbc.busy;
+}
+
+static void schedule_capped_rebuild(const void *key, const void *val, void *ctx)
+{
+    struct watchedVol *watched = (struct watchedVol*)val;
+
+    if (watched->rebuildPending && !watched->rebuildPid && !watched->delayer &&
+        !device_rebuild_running(watched)) {
+        watched->rebuildPending = false;
+        scheduleRebuildCheck(watched);
+    }
+}
+
+void kextd_rebuild_exited(pid_t pid)
+{
+    RebuildExitContext rec = { pid, NULL };
+
+    if (!sFsysWatchDict || pid <= 0)    goto finish;
+
+    CFDictionaryApplyFunction(sFsysWatchDict, find_rebuild_pid, &rec);
+    if (!rec.exited)                    goto finish;
+
+    rec.exited->rebuildPid = 0;
+    if (rec.exited->rebuildPending) {
+        OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogFileAccessFlag,
+            "%s changed during update; checking again.",
+            rec.exited->caches->root);
+        rec.exited->rebuildPending = false;
+        scheduleRebuildCheck(rec.exited);
+    }
+    CFDictionaryApplyFunction(sFsysWatchDict, schedule_capped_rebuild, NULL);
+
 finish:
     return;
 }
@@ -1425,7 +1814,10 @@ void check_now(CFRunLoopTimerRef timer, void *info)
     // is the volume still being watched?
     if (watched && CFDictionaryGetCountOfValue(sFsysWatchDict, watched)) {
         watched->delayer = NULL;        // timer is no longer pending
-        (void)check_rebuild(watched);   // don't care what it did
+        watched->settleTime = kWatchSettleTime;     // burst is over
+        // only look at what changed (all of it if we can't tell)
+        (void)check_rebuild(watched, watched->changedInputs ?
+                            watched->changedInputs : kWatchInputsAll);
     } else {
         OSKextLog(/* kext */ NULL,
             kOSKextLogWarningLevel | kOSKextLogGeneralFlag,
@@ -1437,6 +1829,11 @@ void check_now(CFRunLoopTimerRef timer, void *info)
 /******************************************************************************
  * check_rebuild uses needUpdates() to stat everything -> rebuilds as necessary
  * - kextcache -u used to do all the work (rebuild mkext, boot's etc)
+ * - -rebuild-only now limits it to the items found stale here
+ * - inputs (kWatchInput*) says what changed; the prelinked kernel is only
+ *   checked if kexts, kernels, or caches did
+ * - after a failed rebuild, everything is checked until one succeeds or
+ *   nothing is stale, so a change of any kind retries what didn't get built
  *
  * XX if kextcache is broken (e.g. a copy of 'false'), updterrs is never
  * incremented and an an infinite reboot stall could result.  updtattempts
@@ -1445,10 +1842,11 @@ void check_now(CFRunLoopTimerRef timer, void *info)
  * prevent a transient failure condition from preventing multiple meaningful
  * attempts to update the volume.
  *****************************************************************************/
-static Boolean check_rebuild(struct watchedVol *watched)
+static Boolean check_rebuild(struct watchedVol *watched, uint32_t inputs)
 {
     Boolean launched            = false;
     Boolean wantRebuild         = false;
+    BRUpdateOpts_t staleItems   = 0;    // kBRUItem*: what kextcache rebuilds
 #if DEV_KERNEL_SUPPORT
     char *  suffixPtr           = NULL; // must free
     char *  tmpKernelPath       = NULL; // must free
@@ -1460,6 +1858,12 @@ static Boolean check_rebuild(struct watchedVol *watched)
         watched->delayer = NULL;
     }
 
+    // every check covers whatever changed up to now
+    watched->changedInputs = 0;
+    if ((inputs & kWatchInputsCheckAll) || watched->rebuildFailed) {
+        inputs = kWatchInputsAll;
+    }
+
     // make sure this volume isn't out of control with updates
     if (watched->updtattempts > kMaxUpdateAttempts) {
         OSKextLog(/* kext */ NULL, kOSKextLogWarningLevel | kOSKextLogIPCFlag,
@@ -1468,9 +1872,10 @@ static Boolean check_rebuild(struct watchedVol *watched)
         goto finish;
     }
 
-    // stat stuff to see if a rebuild is needed
-    // (it was 'goto' or ever-deeper nesting)
-    if (check_kext_boot_cache_file(watched->caches,
+    // stat stuff to see what needs a rebuild; collect all of it so that
+    // kextcache only rebuilds those items (e.g. CSFDE alone never relinks)
+    if ((inputs & kWatchInputsKernelCache) &&
+        check_kext_boot_cache_file(watched->caches,
                                    watched->caches->kext_boot_cache_file->rpath,
                                    watched->caches->kernelpath)) {
         if (isPrelinkedKernelAutoRebuildDisabled()) {
@@ -1479,13 +1884,14 @@ static Boolean check_rebuild(struct watchedVol *watched)
                       "Skipping prelinked kernel auto rebuild; kext-dev-mode setting.");
         }
         else {
-            wantRebuild = true;
-            goto dorebuild;
+            staleItems |= kBRUItemKernelCache;
         }
     }
 
 #if DEV_KERNEL_SUPPORT
-    if (watched->caches->extraKernelCachePaths) {
+    if (watched->caches->extraKernelCachePaths &&
+        (inputs & kWatchInputsKernelCache) &&
+        (staleItems & kBRUItemKernelCache) == 0) {
         int             i;
         cachedPath *    cp;
         
@@ -1514,8 +1920,8 @@ static Boolean check_rebuild(struct watchedVol *watched)
                               "Skipping prelinked kernel auto rebuild; kext-dev-mode setting.");
                 }
                 else {
-                    wantRebuild = true;
-                    goto dorebuild;
+                    staleItems |= kBRUItemKernelCache;
+                    break;
                 }
             }
         }
@@ -1530,26 +1936,51 @@ static Boolean check_rebuild(struct watchedVol *watched)
     // are not critical, they will get updated on explicit kextcache calls when
     // they are out of date.
     if (watched->isBootRoot) {
-        wantRebuild =
-        check_csfde(watched->caches) ||
-        needUpdates(watched->caches, kBRUCachesAnyRoot,
-                    NULL, NULL, NULL,   // use return aggregate
-                    kOSKextLogProgressLevel | kOSKextLogFileAccessFlag);
+        if (check_csfde(watched->caches)) {
+            staleItems |= kBRUItemCSFDE;
+        }
+        // rebuilt caches have to be copied down to the helpers, too
+        if (staleItems ||
+            needUpdates(watched->caches, kBRUCachesAnyRoot,
+                        NULL, NULL, NULL,   // use return aggregate
+                        kOSKextLogProgressLevel | kOSKextLogFileAccessFlag)) {
+            staleItems |= kBRUItemHelpers;
+        }
     }
-
-dorebuild:
-    if (wantRebuild) {
-        if (launch_rebuild_all(watched->caches->root, false, false) > 0) {
+    wantRebuild = (staleItems != 0);
+
+    if (wantRebuild && watched->rebuildPid) {
+        // one at a time per volume; it will be checked again when done
+        watched->rebuildPending = true;
+        watched->changedInputs |= inputs;
+    } else if (wantRebuild && device_rebuild_running(watched)) {
+        OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogFileAccessFlag,
+            "%s: another volume on %s is updating; waiting.",
+            watched->caches->root, watched->wholeDisk);
+        watched->rebuildPending = true;
+        watched->changedInputs |= inputs;
+    } else if (wantRebuild) {
+        pid_t pid = launch_rebuild_items(watched->caches->root, staleItems,
+                                         false);
+        if (pid > 0) {
             launched = true;
             watched->updtattempts++;
+            watched->rebuildPid = pid;
+            watched->rebuildPending = false;
+            watched->rebuildFailed = false;
         } else {
             watched->updterrs++;
+            watched->rebuildFailed = true;
             OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogIPCFlag,
                 "Error launching kextcache -u.");
         }
+    } else {
+        // everything was checked and nothing is stale
+        watched->rebuildFailed = false;
     }
 
     if (0 == strcmp(watched->caches->root, "/") &&
+            (inputs & (kWatchInputExts | kWatchInputKernel)) &&
             plistCachesNeedRebuild(gKernelArchInfo)) {
 
         handleSignal(SIGHUP);
@@ -1931,8 +2362,9 @@ kern_return_t _kextmanager_unlock_volume(mach_port_t p, mach_port_t client,
             watched->updtattempts = 0;
         }
     } else {
-        // not okay
+        // not okay; check everything again on the next change
         watched->updterrs++;
+        watched->rebuildFailed = true;
         OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogCacheFlag,
             "helper error while updating %s (error count: %d)",
             watched->caches->root, watched->updterrs);
@@ -2055,6 +2487,7 @@ static void port_died(CFMachPortRef cfport, void *info)
                 "helper pid %d exited without unlocking '%s'.",
                 CFMachPortGetPort(watched->lock), watched->caches->root);
             watched->updterrs++;
+            watched->rebuildFailed = true;
             handleWatchedHandoff(watched);      // cleans up watched->lock
             if (!sRebootLock && sRebootWaiter)
                 handleRebootHandoff();
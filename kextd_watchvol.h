@@ -33,6 +33,7 @@
 int kextd_watch_volumes(int sourcePriority/*, CFRunLoopRef runloop*/);
 int kextd_giveup_volwatch();
 void kextd_stop_volwatch();
+void kextd_rebuild_exited(pid_t pid);
 
 void updateRAIDSet(
     CFNotificationCenterRef center,
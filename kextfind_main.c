@@ -125,7 +125,13 @@ int main(int argc, char * const *argv)
         if (queryCallback->evalCallback) {
             QEQuerySetEvaluationCallbackForPredicate(query,
                 queryCallback->longName,
-                queryCallback->evalCallback);
+                queryCallback->evalCallback,
+                queryCallback->evalFlags);
+            if (queryCallback->evalCost) {
+                QEQuerySetEvaluationCostForPredicate(query,
+                    queryCallback->longName,
+                    queryCallback->evalCost);
+            }
         }
         queryCallback++;
     }
@@ -207,9 +213,22 @@ int main(int argc, char * const *argv)
 
         numArgsUsed++;
 
-        if (argv[numArgsUsed] && !strcmp(argv[numArgsUsed], kNoReportHeader)) {
+        while (argv[numArgsUsed]) {
+            if (!strcmp(argv[numArgsUsed], kNoReportHeader)) {
+                queryContext.reportStarted = true; // cause header to be skipped
+            } else if (!strcmp(argv[numArgsUsed], kReportPlist)) {
+                queryContext.reportPlist = true;
+            } else {
+                break;
+            }
             numArgsUsed++;
-            queryContext.reportStarted = true; // cause header to be skipped
+        }
+
+       /* A plist report needs the headers for its keys; they're just not
+        * printed as a row.
+        */
+        if (queryContext.reportPlist) {
+            queryContext.reportStarted = false;
         }
 
         if (queryContext.commandSpecified) {
@@ -242,7 +261,8 @@ int main(int argc, char * const *argv)
             if (reportCallback->evalCallback) {
                 QEQuerySetEvaluationCallbackForPredicate(reportQuery,
                     reportCallback->longName,
-                    reportCallback->evalCallback);
+                    reportCallback->evalCallback,
+                    reportCallback->evalFlags);
             }
             reportCallback++;
         }
@@ -356,6 +376,10 @@ int main(int argc, char * const *argv)
    /*****
     * Run the query!
     */
+    if (reportQuery) {
+        reportStartOutput(&queryContext);
+    }
+
     count = CFArrayGetCount(allKexts);
     for (i = 0; i < count; i++) {
 
@@ -368,9 +392,9 @@ int main(int argc, char * const *argv)
                         queryContext.extraInfo, '\n');
                 } else {
                     if (!queryContext.reportStarted) {
-                        queryContext.reportRowStarted = false;
+                        reportStartRow(&queryContext);
                         QEQueryEvaluate(reportQuery, theKext);
-                        printf("\n");
+                        reportEndRow(&queryContext);
                         if ((QEQueryLastError(reportQuery) != kQEQueryErrorNone)) {
                             OSKextLog(/* kext */ NULL,
                                 kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
@@ -379,9 +403,9 @@ int main(int argc, char * const *argv)
                         }
                         queryContext.reportStarted = true;
                     }
-                    queryContext.reportRowStarted = false;
+                    reportStartRow(&queryContext);
                     QEQueryEvaluate(reportQuery, theKext);
-                    printf("\n");
+                    reportEndRow(&queryContext);
                     if ((QEQueryLastError(reportQuery) != kQEQueryErrorNone)) {
                         OSKextLog(/* kext */ NULL,
                             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
@@ -398,6 +422,15 @@ int main(int argc, char * const *argv)
         }
     }
 
+    if (reportQuery) {
+        reportFinishOutput(&queryContext);
+    }
+
+    if (!finishExecBatches(&queryContext)) {
+        result = kKextfindExitExecFailed;
+        goto finish;
+    }
+
     result = EX_OK;
 
 finish:
@@ -530,6 +563,25 @@ ExitStatus readArgs(
                         toolArgs->pathSpec = kPathsNone;
                         break;
 
+                    case kLongOptExecJobs:
+                       /* Last one specified wins! */
+                        {
+                            char * endptr = NULL;
+                            long   jobs   = strtol(optarg, &endptr, 10);
+
+                            if (!optarg[0] || *endptr || jobs < 1 ||
+                                jobs > 256) {
+
+                                OSKextLog(/* kext */ NULL,
+                                    kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                                    "Invalid -%s value %s (1-256).",
+                                    kOptNameExecJobs, optarg);
+                                goto finish;
+                            }
+                            toolArgs->execJobs = (u_int)jobs;
+                        }
+                        break;
+
 #ifdef MEEK_PICKY
                     case kLongOptMeek:
                         toolArgs->assertiveness = kKextfindMeek;
@@ -718,8 +770,8 @@ void usage(UsageLevel usageLevel)
 #endif
     fprintf(stream, "    -%s              -%s\n",
         kOptNameRelativePaths, kOptNameSubstring);
-    fprintf(stream, "    -%s\n",
-        kOptNameNoPaths);
+    fprintf(stream, "    -%s                    -%s jobs\n",
+        kOptNameNoPaths, kOptNameExecJobs);
 
     fprintf(stream, "\n");
 
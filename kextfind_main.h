@@ -44,6 +44,7 @@
 
 enum {
     kKextfindExitOK          = EX_OK,
+    kKextfindExitExecFailed  = 1,   // an -exec ... {} + batch failed
 
     // don't actually exit with this, it's just a sentinel value
     kKextfindExitHelp        = 33,
@@ -111,6 +112,29 @@ typedef struct {
     */
     Boolean reportRowStarted;
 
+   /* Set by -report -plist. Rows are streamed out as dictionaries keyed by
+    * the column headers, which are collected instead of printed.
+    */
+    Boolean  reportPlist;
+    char  ** reportColumns;      // must free, and contents
+    CFIndex  reportNumColumns;
+    CFIndex  reportColumn;
+
+   /* Report values converted from CF objects are built here, and the
+    * buffer is reused for every field rather than allocated per field.
+    */
+    char   * reportBuffer;       // must free
+    size_t   reportBufferSize;
+
+   /* Each -exec ... {} + collects matching kext paths into a batch that is
+    * run as one command when it fills up and when the query is done.  Up to
+    * execJobs batch commands run at once (-exec-jobs).
+    */
+    CFMutableArrayRef execBatches;   // ExecBatch *s; must free each
+    u_int    execJobs;
+    u_int    execRunning;
+    Boolean  execFailed;
+
 } QueryContext;
 
 /*******************************************************************************
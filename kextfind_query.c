@@ -1430,6 +1430,21 @@ Boolean evalDefinesOrReferencesSymbol(
         seekingReference = true;
     }
 
+   /* System kexts are usually in kextcache's symbol index, which spares
+    * us mapping and scanning the executable.
+    */
+    switch (lookUpKextSymbolIndex(theKext,
+        QEQueryElementGetArgumentAtIndex(element, 0), seekingReference)) {
+
+      case kKextSymbolIndexFound:
+        result = true;
+        goto finish;
+      case kKextSymbolIndexNotFound:
+        goto finish;
+      default:
+        break;
+    }
+
     symbol = createUTF8CStringForCFString(
         QEQueryElementGetArgumentAtIndex(element, 0));
     if (!symbol) {
@@ -1640,6 +1655,260 @@ finish:
     return true;
 }
 
+/*******************************************************************************
+* Batched -exec ... {} + runs its utility with as many kext paths as fit in
+* ARG_MAX, like find(1) and xargs(1), instead of once per kext.  Each batch
+* keeps its fixed arguments at the front of argv and appends paths after
+* them.
+*******************************************************************************/
+typedef struct {
+    char   ** argv;         // must free each, and whole
+    CFIndex   numFixedArgs;
+    CFIndex   numArgs;
+    CFIndex   maxArgs;
+    size_t    fixedBytes;
+    size_t    argBytes;     // of argv[] and its strings so far
+} ExecBatch;
+
+#define kExecArgHeadroom    (2048)  // for the child's own use, as with xargs
+
+static size_t
+execArgLimit(void)
+{
+    static size_t limit = 0;
+    extern char ** environ;
+    char ** env;
+    long argMax;
+
+    if (!limit) {
+        argMax = sysconf(_SC_ARG_MAX);
+        if (argMax <= 0) {
+            argMax = ARG_MAX;
+        }
+        limit = (size_t)argMax - kExecArgHeadroom;
+        for (env = environ; env && *env; env++) {
+            limit -= MIN(limit, strlen(*env) + 1 + sizeof(char *));
+        }
+    }
+    return limit;
+}
+
+/*******************************************************************************
+* Records a new batch for the -exec element just parsed, whose arguments end
+* with the {} we stripped off; its index in context->execBatches is stored in
+* the element for evalExec().
+*******************************************************************************/
+static Boolean
+addExecBatch(CFMutableDictionaryRef element, QueryContext * context)
+{
+    Boolean     result     = false;
+    CFArrayRef  arguments  = QEQueryElementGetArguments(element);
+    ExecBatch * batch      = NULL;  // must free on error
+    CFNumberRef indexNum   = NULL;  // must release
+    CFIndex     batchIndex = 0;
+    CFIndex     count, i;
+
+    if (!context->execBatches) {
+        context->execBatches = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+            /* callbacks */ NULL);
+        if (!context->execBatches) {
+            goto finish;
+        }
+    }
+
+    batch = (ExecBatch *)calloc(1, sizeof(*batch));
+    if (!batch) {
+        goto finish;
+    }
+
+   /* The last argument is the {} that ended the batch.
+    */
+    count = CFArrayGetCount(arguments) - 1;
+    batch->maxArgs = count + 64;
+    batch->argv = (char **)calloc(batch->maxArgs + 1, sizeof(char *));
+    if (!batch->argv) {
+        goto finish;
+    }
+    for (i = 0; i < count; i++) {
+        batch->argv[i] = createUTF8CStringForCFString(
+            CFArrayGetValueAtIndex(arguments, i));
+        if (!batch->argv[i]) {
+            goto finish;
+        }
+        batch->fixedBytes += strlen(batch->argv[i]) + 1 + sizeof(char *);
+    }
+    batch->numFixedArgs = batch->numArgs = count;
+    batch->argBytes = batch->fixedBytes;
+
+    batchIndex = CFArrayGetCount(context->execBatches);
+    indexNum = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType,
+        &batchIndex);
+    if (!indexNum) {
+        goto finish;
+    }
+    CFDictionarySetValue(element, CFSTR(kExecBatchIndex), indexNum);
+    CFArrayAppendValue(context->execBatches, batch);
+    batch = NULL;
+
+    result = true;
+
+finish:
+    if (!result) {
+        OSKextLogMemError();
+    }
+    if (batch) {
+        if (batch->argv) {
+            for (i = 0; batch->argv[i]; i++) {
+                free(batch->argv[i]);
+            }
+            free(batch->argv);
+        }
+        free(batch);
+    }
+    SAFE_RELEASE(indexNum);
+    return result;
+}
+
+/*******************************************************************************
+* Waits for one batch command to exit (any, if pid is -1), and notes whether
+* it failed.
+*******************************************************************************/
+static void
+waitExecBatch(QueryContext * context, pid_t pid)
+{
+    int status = 0;
+
+    while ((pid = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {
+        ;
+    }
+    if (pid == -1) {
+        context->execRunning = 0;  // nothing left to wait for
+        return;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        context->execFailed = true;
+    }
+    if (context->execRunning) {
+        context->execRunning--;
+    }
+    return;
+}
+
+/*******************************************************************************
+* Runs a batch's utility with the paths collected so far, then empties it.
+* With -exec-jobs it goes on while the command runs, waiting first only if
+* as many batches as allowed are already running.
+*******************************************************************************/
+static void
+runExecBatch(QueryContext * context, ExecBatch * batch)
+{
+    u_int maxJobs = context->execJobs ? context->execJobs : 1;
+    pid_t pid;
+    CFIndex i;
+
+    if (batch->numArgs == batch->numFixedArgs) {
+        return;
+    }
+
+    while (context->execRunning >= maxJobs) {
+        waitExecBatch(context, -1);
+    }
+
+    batch->argv[batch->numArgs] = NULL;
+    fflush(stdout);
+    pid = fork();
+    switch (pid) {
+      case 0:  // child
+        execvp(batch->argv[0], batch->argv);
+        _exit(127);
+        break;
+      case -1: // error
+        perror("error forking for -exec");
+        context->execFailed = true;
+        break;
+      default: // parent
+        context->execRunning++;
+        if (maxJobs == 1) {
+            waitExecBatch(context, pid);
+        }
+        break;
+    }
+
+    for (i = batch->numFixedArgs; i < batch->numArgs; i++) {
+        SAFE_FREE_NULL(batch->argv[i]);
+    }
+    batch->numArgs = batch->numFixedArgs;
+    batch->argBytes = batch->fixedBytes;
+
+    return;
+}
+
+/*******************************************************************************
+* Adds a kext path to a batch, first running the batch if the path wouldn't
+* fit in the argument limit.
+*******************************************************************************/
+static Boolean
+appendExecBatchPath(
+    QueryContext * context,
+    ExecBatch    * batch,
+    const char   * path)
+{
+    size_t    pathBytes = strlen(path) + 1 + sizeof(char *);
+    char   ** newArgv   = NULL;
+
+    if (batch->argBytes + pathBytes > execArgLimit()) {
+        runExecBatch(context, batch);
+    }
+
+    if (batch->numArgs == batch->maxArgs) {
+        newArgv = (char **)realloc(batch->argv,
+            (2 * batch->maxArgs + 1) * sizeof(char *));
+        if (!newArgv) {
+            OSKextLogMemError();
+            return false;
+        }
+        batch->argv = newArgv;
+        batch->maxArgs *= 2;
+    }
+
+    batch->argv[batch->numArgs] = strdup(path);
+    if (!batch->argv[batch->numArgs]) {
+        OSKextLogMemError();
+        return false;
+    }
+    batch->numArgs++;
+    batch->argBytes += pathBytes;
+
+    return true;
+}
+
+/*******************************************************************************
+* Called once the query has been run over every kext: runs what's left in
+* each batch and waits for all of them.  Returns false if any batch command
+* failed.
+*******************************************************************************/
+Boolean
+finishExecBatches(QueryContext * context)
+{
+    ExecBatch * batch = NULL;  // do not free
+    CFIndex     count, i;
+
+    if (!context->execBatches) {
+        return true;
+    }
+
+    count = CFArrayGetCount(context->execBatches);
+    for (i = 0; i < count; i++) {
+        batch = (ExecBatch *)CFArrayGetValueAtIndex(context->execBatches, i);
+        runExecBatch(context, batch);
+    }
+    while (context->execRunning) {
+        waitExecBatch(context, -1);
+    }
+
+    return context->execFailed ? false : true;
+}
+
 /*******************************************************************************
 *
 *******************************************************************************/
@@ -1664,6 +1933,30 @@ Boolean parseExec(
             index++;
             goto finish;
         }
+
+       /* "{} +" ends a batched -exec; the {} isn't kept as an argument,
+        * it's where the kext paths go.
+        */
+        if (!strcmp(argv[index], kExecBatchTerminator) && index > 1 &&
+            !strcmp(argv[index - 1], kExecBundlePathReplace)) {
+
+            CFArrayRef arguments = QEQueryElementGetArguments(element);
+
+            if (!arguments || CFArrayGetCount(arguments) < 2) {
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                    "No utility for %s ... {} +.", kPredNameExec);
+                *error = kQEQueryErrorInvalidOrMissingArgument;
+                goto finish;
+            }
+            if (!addExecBatch(element, context)) {
+                *error = kQEQueryErrorNoMemory;
+                goto finish;
+            }
+            result = true;
+            index++;
+            goto finish;
+        }
         SAFE_RELEASE_NULL(arg);
         arg = CFStringCreateWithCString(kCFAllocatorDefault,
             argv[index], kCFStringEncodingUTF8);
@@ -1678,7 +1971,7 @@ Boolean parseExec(
 
     OSKextLog(/* kext */ NULL, 
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
-            "No terminating ; for %s.", kPredNameExec);
+            "No terminating ; or {} + for %s.", kPredNameExec);
     *error = kQEQueryErrorInvalidOrMissingArgument;
 finish:
     SAFE_RELEASE(arg);
@@ -1692,7 +1985,7 @@ finish:
 Boolean evalExec(
     CFDictionaryRef element,
     void * object,
-    void * user_data __unused,
+    void * user_data,
     QEQueryError * error)
 {
     Boolean result = false;
@@ -1709,6 +2002,9 @@ Boolean evalExec(
     char            ** command_argv     = NULL;  // must free each, and whole
     CFArrayRef         arguments        = QEQueryElementGetArguments(element);
     CFMutableStringRef scratch          = NULL;  // must release
+    QueryContext     * context          = (QueryContext *)user_data;
+    CFNumberRef        batchIndex       = NULL;  // do not release
+    CFIndex            batchNum         = 0;
     char               kextPathBuffer[PATH_MAX];
     CFIndex            count, i;
 
@@ -1735,6 +2031,24 @@ Boolean evalExec(
         *error = kQEQueryErrorUnspecified;
         goto finish;
     }
+
+   /* A batched -exec just collects the path for now, and like find's
+    * -exec ... {} + it is always true.
+    */
+    batchIndex = CFDictionaryGetValue(element, CFSTR(kExecBatchIndex));
+    if (batchIndex) {
+        if (!CFNumberGetValue(batchIndex, kCFNumberCFIndexType, &batchNum) ||
+            !appendExecBatchPath(context, (ExecBatch *)CFArrayGetValueAtIndex(
+                context->execBatches, batchNum), kextPathBuffer)) {
+
+            *error = kQEQueryErrorNoMemory;
+            goto finish;
+        }
+        result = true;
+        *error = kQEQueryErrorNone;
+        goto finish;
+    }
+
     kextPath = CFURLCopyFileSystemPath(kextURL, kCFURLPOSIXPathStyle);
     if (!kextPath) {
         OSKextLogMemError();
@@ -1765,11 +2079,10 @@ Boolean evalExec(
         goto finish;
     }
 
-    command_argv = (char **)malloc((1 + count) * sizeof(char *));
+    command_argv = (char **)calloc(1 + count, sizeof(char *));
     if (!command_argv) {
         goto finish;
     }
-    bzero(&command_argv, sizeof((1 + count) * sizeof(char *)));
     for (i = 0; i < count; i++) {
         scratch = CFStringCreateMutableCopy(kCFAllocatorDefault,
             0, CFArrayGetValueAtIndex(arguments, i));
@@ -1800,17 +2113,20 @@ Boolean evalExec(
 
     command_argv[i] = NULL;
 
+    fflush(stdout);
     pid = fork();
     switch (pid) {
       case 0:  // child
         execvp(command_argv[0], command_argv);
+        _exit(127);
         break;
       case -1: // error
         perror("error forking for -exec");
         goto finish;
         break;
       default: // parent
-        waitpid(-1, &status, 0);
+        // not -1: batches from -exec-jobs may be running
+        waitpid(pid, &status, 0);
         if (WIFEXITED(status)) {
             // Zero exit status is true
             result = WEXITSTATUS(status) ? false : true;
@@ -150,6 +150,8 @@
 #define kExecExecutableReplace           "{executable}"
 #define kExecBundlePathReplace           "{}"
 #define kExecTerminator                  ";"
+#define kExecBatchTerminator             "+"
+#define kExecBatchIndex                  "execBatchIndex"
 
 /*****
  * Shorter options for the more common predicates.
@@ -442,4 +444,6 @@ Boolean evalExec(
     void * user_data,
     QEQueryError * error);
 
+Boolean finishExecBatches(QueryContext * context);
+
 #endif /* _KEXTFIND_QUERY_H_ */
@@ -31,6 +31,294 @@
 #include <IOKit/kext/fat_util.h>
 #include <IOKit/kext/macho_util.h>
 
+#pragma mark Report Output
+
+/*******************************************************************************
+* Returns the context's scratch buffer, grown to at least size bytes. It only
+* ever grows, so after the first few rows a report allocates nothing more.
+*******************************************************************************/
+static char * reportBufferOfSize(QueryContext * context, size_t size)
+{
+    char * newBuffer = NULL;
+
+    if (size > context->reportBufferSize) {
+        if (size < 256) {
+            size = 256;
+        }
+        newBuffer = realloc(context->reportBuffer, size);
+        if (!newBuffer) {
+            OSKextLogMemError();
+            return NULL;
+        }
+        context->reportBuffer = newBuffer;
+        context->reportBufferSize = size;
+    }
+    return context->reportBuffer;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void printXMLEscaped(const char * string)
+{
+    const char * run = string;
+    const char * scan;
+
+    for (scan = string; *scan; scan++) {
+        const char * entity = NULL;
+
+        switch (*scan) {
+          case '&': entity = "&amp;"; break;
+          case '<': entity = "&lt;";  break;
+          case '>': entity = "&gt;";  break;
+          default:  continue;
+        }
+        fwrite(run, 1, scan - run, stdout);
+        fputs(entity, stdout);
+        run = scan + 1;
+    }
+    fwrite(run, 1, scan - run, stdout);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void reportStartOutput(QueryContext * context)
+{
+    if (context->reportPlist) {
+        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+            "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+            "<plist version=\"1.0\">\n"
+            "<array>\n", stdout);
+    }
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void reportFinishOutput(QueryContext * context)
+{
+    CFIndex i;
+
+    if (context->reportPlist) {
+        fputs("</array>\n</plist>\n", stdout);
+    }
+    fflush(stdout);
+
+    for (i = 0; i < context->reportNumColumns; i++) {
+        SAFE_FREE(context->reportColumns[i]);
+    }
+    SAFE_FREE_NULL(context->reportColumns);
+    context->reportNumColumns = 0;
+    SAFE_FREE_NULL(context->reportBuffer);
+    context->reportBufferSize = 0;
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void reportStartRow(QueryContext * context)
+{
+    context->reportRowStarted = false;
+    context->reportColumn = 0;
+    if (context->reportPlist && context->reportStarted) {
+        fputs("\t<dict>\n", stdout);
+    }
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void reportEndRow(QueryContext * context)
+{
+    if (!context->reportPlist) {
+        printf("\n");
+    } else if (context->reportStarted) {
+        fputs("\t</dict>\n", stdout);
+    }
+    return;
+}
+
+/*******************************************************************************
+* In the header row, value is a column title; otherwise it's that column's
+* value for the current kext. For -plist the titles are kept as the keys.
+*******************************************************************************/
+Boolean reportField(QueryContext * context, const char * value)
+{
+    Boolean result = false;
+    char ** newColumns = NULL;
+
+    if (!value) {
+        goto finish;
+    }
+
+    if (!context->reportPlist) {
+        printf("%s%s", context->reportRowStarted ? "\t" : "", value);
+    } else if (!context->reportStarted) {
+        newColumns = realloc(context->reportColumns,
+            (context->reportNumColumns + 1) * sizeof(*newColumns));
+        if (!newColumns) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        context->reportColumns = newColumns;
+        context->reportColumns[context->reportNumColumns] = strdup(value);
+        if (!context->reportColumns[context->reportNumColumns]) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        context->reportNumColumns++;
+    } else {
+        fputs("\t\t<key>", stdout);
+        printXMLEscaped(context->reportColumn < context->reportNumColumns ?
+            context->reportColumns[context->reportColumn] : "");
+        fputs("</key>\n\t\t<string>", stdout);
+        printXMLEscaped(value);
+        fputs("</string>\n", stdout);
+    }
+    context->reportColumn++;
+    context->reportRowStarted = true;
+    result = true;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+* The result is only good until the next call for this context.
+*******************************************************************************/
+const char * reportCStringForCFString(
+    QueryContext * context,
+    CFStringRef    aString)
+{
+    const char * result = NULL;
+    char       * buffer = NULL;
+    CFIndex      size;
+
+    result = CFStringGetCStringPtr(aString, kCFStringEncodingUTF8);
+    if (result) {
+        goto finish;
+    }
+    size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(aString),
+        kCFStringEncodingUTF8) + 1;
+    buffer = reportBufferOfSize(context, size);
+    if (!buffer) {
+        goto finish;
+    }
+    if (!CFStringGetCString(aString, buffer, size, kCFStringEncodingUTF8)) {
+        OSKextLogStringError(/* kext */ NULL);
+        goto finish;
+    }
+    result = buffer;
+
+finish:
+    return result;
+}
+
+/*******************************************************************************
+* A printable form of a property value. The result is in the context's buffer
+* (or is a constant) and is only good until the next call for this context.
+*******************************************************************************/
+const char * reportCStringForCFValue(
+    QueryContext * context,
+    CFTypeRef      value)
+{
+    CFTypeID valueType;
+    char   * buffer = NULL;
+    size_t   size   = 80;  // more than big enough for a number
+
+    if (!value) {
+        return "<null>";
+    }
+
+    valueType = CFGetTypeID(value);
+
+    if (CFStringGetTypeID() == valueType) {
+        return reportCStringForCFString(context, value);
+    } else if (CFBooleanGetTypeID() == valueType) {
+        return CFBooleanGetValue(value) ? kWordTrue : kWordFalse;
+    }
+
+    buffer = reportBufferOfSize(context, size);
+    if (!buffer) {
+        return NULL;
+    }
+    if (CFNumberGetTypeID() == valueType) {
+        long long number;
+
+        if (CFNumberIsFloatType(value)) {
+            double floatNumber;
+            CFNumberGetValue(value, kCFNumberDoubleType, &floatNumber);
+            snprintf(buffer, size, "%g", floatNumber);
+        } else {
+            CFNumberGetValue(value, kCFNumberLongLongType, &number);
+            snprintf(buffer, size, "%lld", number);
+        }
+    } else if (CFArrayGetTypeID() == valueType) {
+        snprintf(buffer, size, "<array of %ld>", CFArrayGetCount(value));
+    } else if (CFDictionaryGetTypeID() == valueType) {
+        snprintf(buffer, size, "<dict of %ld>", CFDictionaryGetCount(value));
+    } else if (CFDataGetTypeID() == valueType) {
+        snprintf(buffer, size, "<data of %ld>", CFDataGetLength(value));
+    } else {
+        return "<unknown CF type>";
+    }
+    return buffer;
+}
+
+/*******************************************************************************
+* The arches in theKext's executable, comma-separated as printKextArches()
+* prints them.
+*******************************************************************************/
+static const char * reportCStringForKextArches(
+    QueryContext * context,
+    OSKextRef      theKext)
+{
+    fat_iterator         fiter    = NULL;  // must close
+    struct mach_header * farch    = NULL;
+    const NXArchInfo   * archinfo = NULL;
+    char               * buffer   = NULL;
+    size_t               length   = 0;
+
+    buffer = reportBufferOfSize(context, 1);
+    if (!buffer) {
+        goto finish;
+    }
+    buffer[0] = '\0';
+
+    fiter = createFatIteratorForKext(theKext);
+    if (!fiter) {
+        goto finish;
+    }
+
+    while ((farch = fat_iterator_next_arch(fiter, NULL))) {
+        int swap = ISSWAPPEDMACHO(farch->magic);
+        size_t nameLength;
+
+        archinfo = NXGetArchInfoFromCpuType(CondSwapInt32(swap, farch->cputype),
+            CondSwapInt32(swap, farch->cpusubtype));
+        if (!archinfo) {
+            continue;
+        }
+        nameLength = strlen(archinfo->name);
+        buffer = reportBufferOfSize(context, length + nameLength + 2);
+        if (!buffer) {
+            goto finish;
+        }
+        if (length) {
+            buffer[length++] = ',';
+        }
+        memcpy(buffer + length, archinfo->name, nameLength + 1);
+        length += nameLength;
+    }
+
+finish:
+    if (fiter)  fat_iterator_close(fiter);
+    return buffer;
+}
+
+#pragma mark Report Callbacks
+
 
 /*******************************************************************************
 *
@@ -95,44 +383,6 @@ finish:
     return result;
 }
 
-/*******************************************************************************
-*
-*******************************************************************************/
-char * cStringForCFValue(CFTypeRef value)
-{
-    CFTypeID valueType;
-    CFIndex count;
-    char buffer[80];  // more than big enough for a number
-
-    if (!value) {
-        return strdup("<null>");
-    }
-
-    valueType = CFGetTypeID(value);
-
-    if (CFStringGetTypeID() == valueType) {
-        return createUTF8CStringForCFString(value);
-    } else if (CFBooleanGetTypeID() == valueType) {
-        return CFBooleanGetValue(value) ? strdup(kWordTrue) : strdup(kWordFalse);
-    } else if (CFNumberGetTypeID() == valueType) {
-    } else if (CFArrayGetTypeID() == valueType) {
-        count = CFArrayGetCount(value);
-        snprintf(buffer, (sizeof(buffer)/sizeof(char)), "<array of %ld>", count);
-        return strdup(buffer);
-    } else if (CFDictionaryGetTypeID() == valueType) {
-        count = CFDictionaryGetCount(value);
-        snprintf(buffer, (sizeof(buffer)/sizeof(char)), "<dict of %ld>", count);
-        return strdup(buffer);
-    } else if (CFDataGetTypeID() == valueType) {
-        count = CFDataGetLength(value);
-        snprintf(buffer, (sizeof(buffer)/sizeof(char)), "<data of %ld>", count);
-        return strdup(buffer);
-    } else {
-        return strdup("<unknown CF type>");
-    }
-    return NULL;
-}
-
 /*******************************************************************************
 * Note: reportEvalCommand() calls this.
 *******************************************************************************/
@@ -145,9 +395,9 @@ Boolean reportEvalProperty(
     Boolean result = false;
     OSKextRef theKext = (OSKextRef)object;
     QueryContext * context = (QueryContext *)user_data;
-    CFStringRef propKey = NULL;   // don't release
-    CFTypeRef   propVal = NULL;   // don't release
-    char *      cString = NULL;   // must free
+    CFStringRef  propKey = NULL;   // don't release
+    CFTypeRef    propVal = NULL;   // don't release
+    const char * cString = NULL;   // don't free
 
     propKey = QEQueryElementGetArgumentAtIndex(element, 0);
     if (!propKey) {
@@ -156,30 +406,19 @@ Boolean reportEvalProperty(
     }
 
     if (!context->reportStarted) {
-        cString = createUTF8CStringForCFString(propKey);
-        if (!cString) {
-            *error = kQEQueryErrorEvaluationCallbackFailed;
-            goto finish;
-        }
-        printf("%s%s", context->reportRowStarted ? "\t" : "",
-            cString);
+        cString = reportCStringForCFString(context, propKey);
     } else {
         // This is allowed to be null
         propVal = OSKextGetValueForInfoDictionaryKey(theKext, propKey);
-        cString = cStringForCFValue(propVal);
-        if (!cString) {
-            *error = kQEQueryErrorEvaluationCallbackFailed;
-            goto finish;
-        }
-        printf("%s%s", context->reportRowStarted ? "\t" : "",
-            cString);
+        cString = reportCStringForCFValue(context, propVal);
+    }
+    if (!reportField(context, cString)) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
     }
-
-    context->reportRowStarted = true;
 
     result = true;
 finish:
-    if (cString) free(cString);
     return result;
 }
 
@@ -231,7 +470,6 @@ Boolean reportEvalFlag(
     CFStringRef flag = CFDictionaryGetValue(element, CFSTR(kKeywordFlag));
     QueryContext * context = (QueryContext *)user_data;
     char *         cString = NULL;   // don't free!
-    Boolean print = true;
 
     if (!context->reportStarted) {
         if (CFEqual(flag, CFSTR(kPredNameLoaded))) {
@@ -267,7 +505,6 @@ Boolean reportEvalFlag(
             goto finish;
         }
 
-        printf("%s%s", context->reportRowStarted ? "\t" : "", cString);
     } else {
 
         if (CFEqual(flag, CFSTR(kPredNameLoaded))) {
@@ -304,9 +541,7 @@ Boolean reportEvalFlag(
         } else if (CFEqual(flag, CFSTR(kPredNameIntegrity))) {
            /* Note: As of SnowLeopard, integrity is no longer used.
             */
-            printf("%s%s", context->reportRowStarted ? "\t" : "",
-                "n/a");
-            print = false;
+            cString = "n/a";
         } else if (CFEqual(flag, CFSTR(kPredNameExecutable))) {
             cString = OSKextDeclaresExecutable(theKext) ? kWordYes : kWordNo;
         } else if (CFEqual(flag, CFSTR(kPredNameDuplicate))) {
@@ -326,18 +561,12 @@ Boolean reportEvalFlag(
             *error = kQEQueryErrorEvaluationCallbackFailed;
             goto finish;
         }
-
-        if (print) {
-            if (!cString) {
-                *error = kQEQueryErrorEvaluationCallbackFailed;
-                goto finish;
-            }
-            printf("%s%s", context->reportRowStarted ? "\t" : "",
-                cString);
-        }
     }
 
-    context->reportRowStarted = true;
+    if (!reportField(context, cString)) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
+    }
 
     result = true;
 finish:
@@ -390,7 +619,7 @@ Boolean reportEvalArch(
     Boolean result = false;
     QueryContext * context = (QueryContext *)user_data;
     CFStringRef string = NULL;   // don't release
-    char *      cString = NULL;   // must free
+    Boolean     fieldOK;
 
 
     if (!context->reportStarted) {
@@ -399,27 +628,22 @@ Boolean reportEvalArch(
             *error = kQEQueryErrorEvaluationCallbackFailed;
             goto finish;
         }
-        cString = createUTF8CStringForCFString(string);
-        if (!cString) {
-            *error = kQEQueryErrorEvaluationCallbackFailed;
-            goto finish;
-        }
-        printf("%s%s", context->reportRowStarted ? "\t" : "",
-            cString);
+        fieldOK = reportField(context,
+            reportCStringForCFString(context, string));
     } else {
         Boolean match = evalArch(element, object, user_data, error);
         if (*error != kQEQueryErrorNone) {
             goto finish;
         }
-        printf("%s%s", context->reportRowStarted ? "\t" : "",
-            match ? kWordYes : kWordNo);
+        fieldOK = reportField(context, match ? kWordYes : kWordNo);
+    }
+    if (!fieldOK) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
     }
-
-    context->reportRowStarted = true;
 
     result = true;
 finish:
-    if (cString) free(cString);
     return result;
 }
 
@@ -436,6 +660,8 @@ Boolean reportEvalArchExact(
     QueryContext * context = (QueryContext *)user_data;
     CFStringRef string = NULL;   // don't release
     char *      cString = NULL;   // must free
+    char *      label   = NULL;   // must free
+    Boolean     fieldOK;
 
 
     if (!context->reportStarted) {
@@ -449,22 +675,26 @@ Boolean reportEvalArchExact(
             *error = kQEQueryErrorEvaluationCallbackFailed;
             goto finish;
         }
-        printf("%s%s (only)", context->reportRowStarted ? "\t" : "",
-            cString);
+        if (asprintf(&label, "%s (only)", cString) < 0) {
+            label = NULL;
+        }
+        fieldOK = reportField(context, label);
     } else {
         Boolean match = evalArchExact(element, object, user_data, error);
         if (*error != kQEQueryErrorNone) {
             goto finish;
         }
-        printf("%s%s", context->reportRowStarted ? "\t" : "",
-            match ? kWordYes : kWordNo);
+        fieldOK = reportField(context, match ? kWordYes : kWordNo);
+    }
+    if (!fieldOK) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
     }
-
-    context->reportRowStarted = true;
 
     result = true;
 finish:
     if (cString) free(cString);
+    if (label) free(label);
     return result;
 }
 
@@ -497,7 +727,8 @@ Boolean reportEvalDefinesOrReferencesSymbol(
     OSKextRef  theKext = (OSKextRef)object;
     QueryContext * context = (QueryContext *)user_data;
     CFStringRef symbol = QEQueryElementGetArgumentAtIndex(element, 0);
-    char * cSymbol = NULL;   // must free
+    const char * cSymbol = NULL;   // don't free
+    char * label = NULL;   // must free
     const char * value = "";  // don't free
     fat_iterator fiter = NULL;  // must close
     struct mach_header * farch = NULL;
@@ -508,15 +739,19 @@ Boolean reportEvalDefinesOrReferencesSymbol(
         *error = kQEQueryErrorEvaluationCallbackFailed;
         goto finish;
     }
-    cSymbol = createUTF8CStringForCFString(symbol);
+    cSymbol = reportCStringForCFString(context, symbol);
     if (!cSymbol) {
         *error = kQEQueryErrorEvaluationCallbackFailed;
         goto finish;
     }
 
     if (!context->reportStarted) {
-        printf("%ssymbol %s", context->reportRowStarted ? "\t" : "",
-            cSymbol);
+        if (asprintf(&label, "symbol %s", cSymbol) < 0) {
+            label = NULL;
+            *error = kQEQueryErrorEvaluationCallbackFailed;
+            goto finish;
+        }
+        value = label;
     } else {
 
         fiter = createFatIteratorForKext(theKext);
@@ -542,12 +777,15 @@ Boolean reportEvalDefinesOrReferencesSymbol(
         }
     }
 
-    printf("%s%s", context->reportRowStarted ? "\t" : "", value);
-    context->reportRowStarted = true;
+    if (!reportField(context, value)) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
+    }
 
     result = true;
 finish:
-    if (cSymbol) free(cSymbol);
+    if (fiter) fat_iterator_close(fiter);
+    if (label) free(label);
     return result;
 }
 
@@ -605,10 +843,7 @@ Boolean reportEvalCommand(
     OSKextRef      theKext       = (OSKextRef)object;
     QueryContext * context       = (QueryContext *)user_data;
     CFStringRef    scratchString = NULL;  // must release
-    char         * cString       = NULL;  // must free
-
-    // if we do arches, easier to print than generate a string
-    Boolean        print         = true;
+    const char   * cString       = NULL;  // don't free
 
     CFArrayRef     dependencies  = NULL;  // must release
     CFArrayRef     dependents    = NULL;  // must release
@@ -619,30 +854,28 @@ Boolean reportEvalCommand(
     if (!context->reportStarted) {
         if (CFEqual(command, CFSTR(kPredNamePrint)) ||
             CFEqual(command, CFSTR(kPredNameBundleName))) {
-            cString = strdup("Bundle");
+            cString = "Bundle";
         } else if (CFEqual(command, CFSTR(kPredNamePrintProperty))) {
             result = reportEvalProperty(element, object, user_data, error);
             goto finish;
         } else if (CFEqual(command, CFSTR(kPredNamePrintArches))) {
-            cString = strdup("Arches");
+            cString = "Arches";
         } else if (CFEqual(command, CFSTR(kPredNamePrintDependencies))) {
-            cString = strdup("# Dependencies");
+            cString = "# Dependencies";
         } else if (CFEqual(command, CFSTR(kPredNamePrintDependents))) {
-            cString = strdup("# Dependents");
+            cString = "# Dependents";
         } else if (CFEqual(command, CFSTR(kPredNamePrintPlugins))) {
-            cString = strdup("# Plugins");
+            cString = "# Plugins";
         } else if (CFEqual(command, CFSTR(kPredNamePrintIntegrity))) {
-            cString = strdup("Integrity");
+            cString = "Integrity";
         } else if (CFEqual(command, CFSTR(kPredNamePrintInfoDictionary))) {
-            cString = strdup("Info Dictionary");
+            cString = "Info Dictionary";
         } else if (CFEqual(command, CFSTR(kPredNamePrintExecutable))) {
-            cString = strdup("Executable");
+            cString = "Executable";
         } else {
             *error = kQEQueryErrorEvaluationCallbackFailed;
             goto finish;
         }
-
-        printf("%s%s", context->reportRowStarted ? "\t" : "", cString);
     } else {
         if (CFEqual(command, CFSTR(kPredNamePrint))) {
             scratchString = copyPathForKext(theKext, context->pathSpec);
@@ -650,78 +883,68 @@ Boolean reportEvalCommand(
                 OSKextLogMemError();
                 goto finish;
             }
-            cString = createUTF8CStringForCFString(scratchString);
+            cString = reportCStringForCFString(context, scratchString);
         } else if (CFEqual(command, CFSTR(kPredNameBundleName))) {
             scratchString = copyPathForKext(theKext, kPathsNone);
             if (!scratchString) {
                 OSKextLogMemError();
                 goto finish;
             }
-            cString = createUTF8CStringForCFString(scratchString);
+            cString = reportCStringForCFString(context, scratchString);
         } else if (CFEqual(command, CFSTR(kPredNamePrintProperty))) {
             result = reportEvalProperty(element, object, user_data, error);
             goto finish;
         } else if (CFEqual(command, CFSTR(kPredNamePrintArches))) {
-            printf("%s", context->reportRowStarted ? "\t" : "");
-            printKextArches(theKext, 0, false /* print line end */);
-            print = false;
+            cString = reportCStringForKextArches(context, theKext);
         } else if (CFEqual(command, CFSTR(kPredNamePrintDependencies))) {
             dependencies = OSKextCopyAllDependencies(theKext,
                 /* needAll? */ false);
             count = dependencies ? CFArrayGetCount(dependencies) : 0;
             snprintf(buffer, (sizeof(buffer)/sizeof(char)), "%ld", count);
-            cString = strdup(buffer);
+            cString = buffer;
         } else if (CFEqual(command, CFSTR(kPredNamePrintDependents))) {
             dependencies = OSKextCopyDependents(theKext, /* direct? */ false);
             count = dependencies ? CFArrayGetCount(dependencies) : 0;
             snprintf(buffer, (sizeof(buffer)/sizeof(char)), "%ld", count);
-            cString = strdup(buffer);
+            cString = buffer;
         } else if (CFEqual(command, CFSTR(kPredNamePrintPlugins))) {
             plugins = OSKextCopyPlugins(theKext);
             count = plugins ? CFArrayGetCount(plugins) : 0;
             snprintf(buffer, (sizeof(buffer)/sizeof(char)), "%ld", count);
-            cString = strdup(buffer);
+            cString = buffer;
             SAFE_RELEASE(plugins);
         } else if (CFEqual(command, CFSTR(kPredNamePrintIntegrity))) {
            /* Note: As of SnowLeopard, integrity is no longer used.
             */
-            printf("%s%s", context->reportRowStarted ? "\t" : "",
-                "n/a");
-            print = false;
+            cString = "n/a";
         } else if (CFEqual(command, CFSTR(kPredNamePrintInfoDictionary))) {
             scratchString = copyKextInfoDictionaryPath(theKext, context->pathSpec);
             if (!scratchString) {
                 OSKextLogMemError();
                 goto finish;
             }
-            cString = createUTF8CStringForCFString(scratchString);
+            cString = reportCStringForCFString(context, scratchString);
         } else if (CFEqual(command, CFSTR(kPredNamePrintExecutable))) {
             scratchString = copyKextExecutablePath(theKext, context->pathSpec);
             if (!scratchString) {
                 OSKextLogMemError();
                 goto finish;
             }
-            cString = createUTF8CStringForCFString(scratchString);
+            cString = reportCStringForCFString(context, scratchString);
         } else {
             *error = kQEQueryErrorEvaluationCallbackFailed;
             goto finish;
         }
+    }
 
-        if (print) {
-            if (!cString) {
-                *error = kQEQueryErrorEvaluationCallbackFailed;
-                goto finish;
-            }
-            printf("%s%s", context->reportRowStarted ? "\t" : "",
-                cString);
-        }
+    if (!reportField(context, cString)) {
+        *error = kQEQueryErrorEvaluationCallbackFailed;
+        goto finish;
     }
 
-    context->reportRowStarted = true;
     result = true;
 finish:
     SAFE_RELEASE(scratchString);
-    SAFE_FREE(cString);
     SAFE_RELEASE(dependencies);
     SAFE_RELEASE(dependents);
     return result;
@@ -24,6 +24,7 @@
 #define _KEXTFIND_REPORT_H_
 
 #include "QEQuery.h"
+#include "kextfind_main.h"
 #include "kextfind_tables.h"
 #include "kextfind_query.h"
 
@@ -31,10 +32,31 @@
  */
 #define kKeywordReport   "-report"
 #define kNoReportHeader  "-no-header"
+#define kReportPlist     "-plist"
 
 #define kPredNameSymbol  "-symbol"
 #define kPredCharSymbol  "-sym"
 
+/*******************************************************************************
+* Report Output
+*
+* The report callbacks hand each header or value to reportField(), which
+* prints it tab-separated or, for -plist, as a key/value pair of the current
+* row's dictionary. Rows are bracketed by reportStartRow() and reportEndRow(),
+* and the whole report by reportStartOutput() and reportFinishOutput().
+*******************************************************************************/
+void reportStartOutput(QueryContext * context);
+void reportFinishOutput(QueryContext * context);
+void reportStartRow(QueryContext * context);
+void reportEndRow(QueryContext * context);
+Boolean reportField(QueryContext * context, const char * value);
+const char * reportCStringForCFString(
+    QueryContext * context,
+    CFStringRef    aString);
+const char * reportCStringForCFValue(
+    QueryContext * context,
+    CFTypeRef      value);
+
 /*******************************************************************************
 * Query Engine Callbacks
 *
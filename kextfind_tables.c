@@ -39,6 +39,7 @@ struct option opt_info[] = {
 #endif
     { kOptNameRelativePaths,    no_argument,        &longopt, kLongOptRelativePaths },
     { kOptNameNoPaths,          no_argument,        &longopt, kLongOptNoPaths },
+    { kOptNameExecJobs,         required_argument,  &longopt, kLongOptExecJobs },
 #ifdef MEEK_PICKY
     { kOptNameMeek,             no_argument,        &longopt, kLongOptMeek },
     { kOptNamePicky,            no_argument,        &longopt, kLongOptPicky },
@@ -72,12 +73,14 @@ struct option opt_info[] = {
  */
 struct querySetup queryCallbackList[] = {
     {   CFSTR(kPredNameProperty), CFSTR(kPredCharProperty),
-        parseProperty, evalProperty },
+        parseProperty, evalProperty,
+        kQEQueryEvaluationNoSideEffects, 1 },
     {   CFSTR(kPredNamePropertyExists), CFSTR(kPredCharPropertyExists), 
         parseProperty, NULL },
 
     {   CFSTR(kPredNameMatchProperty), CFSTR(kPredCharMatchProperty),
-        parseMatchProperty, evalMatchProperty },
+        parseMatchProperty, evalMatchProperty,
+        kQEQueryEvaluationNoSideEffects, 2 },
     {   CFSTR(kPredNameMatchPropertyExists), CFSTR(kPredCharMatchPropertyExists), 
         parseMatchProperty, NULL },
 
@@ -118,29 +121,37 @@ struct querySetup queryCallbackList[] = {
         parseFlag, NULL },
 
     {   CFSTR(kPredNameVersion), CFSTR(kPredCharVersion), 
-        parseVersion, evalVersion },
+        parseVersion, evalVersion,
+        kQEQueryEvaluationNoSideEffects, 1 },
     {   CFSTR(kPredNameCompatibleWithVersion), NULL,
-        parseCompatibleWithVersion, evalCompatibleWithVersion },
+        parseCompatibleWithVersion, evalCompatibleWithVersion,
+        kQEQueryEvaluationNoSideEffects, 1 },
     {   CFSTR(kPredNameIntegrity), NULL, 
-        parseIntegrity, evalIntegrity },
+        parseIntegrity, evalIntegrity,
+        kQEQueryEvaluationNoSideEffects, 1 },
 
     {   CFSTR(kPredNameArch), NULL, 
-        parseArch, evalArch },
+        parseArch, evalArch,
+        kQEQueryEvaluationNoSideEffects, 20 },
     {   CFSTR(kPredNameArchExact), CFSTR(kPredCharArchExact), 
-        parseArch, evalArchExact },
+        parseArch, evalArchExact,
+        kQEQueryEvaluationNoSideEffects, 20 },
     {   CFSTR(kPredNameExecutable), CFSTR(kPredCharExecutable), 
         parseFlag, NULL },
     {   CFSTR(kPredNameNoExecutable), CFSTR(kPredCharNoExecutable), 
         parseFlag, NULL },
     {   CFSTR(kPredNameDefinesSymbol), CFSTR(kPredCharDefinesSymbol), 
-        parseDefinesOrReferencesSymbol, evalDefinesOrReferencesSymbol },
+        parseDefinesOrReferencesSymbol, evalDefinesOrReferencesSymbol,
+        kQEQueryEvaluationNoSideEffects, 100 },
     {   CFSTR(kPredNameReferencesSymbol), CFSTR(kPredCharReferencesSymbol), 
-        parseDefinesOrReferencesSymbol, evalDefinesOrReferencesSymbol },
+        parseDefinesOrReferencesSymbol, evalDefinesOrReferencesSymbol,
+        kQEQueryEvaluationNoSideEffects, 100 },
 
     {   CFSTR(kPredNameBundleID), CFSTR(kPredCharBundleID), 
         parseShorthand, NULL },
     {   CFSTR(kPredNameBundleName), CFSTR(kPredCharBundleName), 
-        parseBundleName, evalBundleName },
+        parseBundleName, evalBundleName,
+        kQEQueryEvaluationNoSideEffects, 1 },
 
     {   CFSTR(kPredNameRoot), CFSTR(kPredCharRoot), 
         parseShorthand, NULL },
@@ -185,7 +196,8 @@ struct querySetup queryCallbackList[] = {
     * save the original keyword.
     */
     {   CFSTR(kPredNameFlag), NULL, 
-        NULL, evalFlag },
+        NULL, evalFlag,
+        kQEQueryEvaluationNoSideEffects, 10 },
     {   CFSTR(kPredNameCommand), NULL, 
         NULL, evalCommand },
 
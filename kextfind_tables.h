@@ -33,6 +33,12 @@
 * function callbacks used by the query engine. Some callbacks handle several
 * keywords because of similar arguments or evaluation logic.
 *
+* evalFlags marks eval callbacks that don't print or run anything as free
+* of side effects; it's left out (zero) for the rest. They're also given a
+* relative evalCost so that the query engine can try cheap tests like the
+* bundle ID before expensive ones like symbol lookups; zero leaves the
+* engine's default cost.
+*
 * See kextfind_query.[hc] for the definitions of these things.
 *******************************************************************************/
 struct querySetup {
@@ -40,6 +46,8 @@ struct querySetup {
     CFStringRef shortName;
     QEQueryParseCallback parseCallback;
     QEQueryEvaluationCallback evalCallback;
+    QEQueryEvaluationFlags evalFlags;
+    uint32_t evalCost;
 };
 
 /*******************************************************************************
@@ -62,6 +70,7 @@ struct querySetup {
 
 #define kOptNameRelativePaths           "relative-paths"
 #define kOptNameNoPaths                 "no-paths"
+#define kOptNameExecJobs                "exec-jobs"
 
 // Currently unused, although code does reference them
 // Things are picky by default for now.
@@ -92,6 +101,7 @@ enum {
     kLongOptPicky = -7,
     kLongOptReport = -8,
     kLongOptDefaultArch = -9,
+    kLongOptExecJobs = -10,
 };
 
 /*******************************************************************************
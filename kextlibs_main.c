@@ -34,6 +34,8 @@
 *******************************************************************************/
 const char * progname = "(unknown)";
 
+static Boolean isLibrarySnapshotEntry(CFDictionaryRef entry, void * context);
+
 /*******************************************************************************
 *******************************************************************************/
 int main(int argc, char * const * argv)
@@ -43,6 +45,8 @@ int main(int argc, char * const * argv)
 
     KextlibsArgs        toolArgs;
     CFArrayRef          kexts               = NULL;  // must release
+    CFArrayRef          snapshot            = NULL;  // must release
+    Boolean             systemFoldersOnly   = FALSE;
     
     const NXArchInfo ** arches              = NULL;  // must free
     KextlibsInfo      * libInfo             = NULL;  // must release contents & free
@@ -80,6 +84,7 @@ int main(int argc, char * const * argv)
     * BEGINNING of the list of folders.
     */
     count = CFArrayGetCount(toolArgs.repositoryURLs);
+    systemFoldersOnly = (count == 0);
     if (!count || toolArgs.flagSysKexts) {
         CFArrayRef osExtFolders = OSKextGetSystemExtensionsFolderURLs(); // do not release
 
@@ -103,14 +108,32 @@ int main(int argc, char * const * argv)
         }
     }
 
-    kexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-        toolArgs.repositoryURLs);
+   /* Only libraries can satisfy link dependencies, so when searching just
+    * the system extensions folders, open only their libraries, as listed
+    * in the repository snapshot, rather than reading every kext.
+    */
+    if (systemFoldersOnly) {
+        snapshot = copyKextRepositorySnapshot();
+        if (snapshot) {
+            kexts = createKextsFromRepositorySnapshot(snapshot,
+                &isLibrarySnapshotEntry, /* context */ NULL);
+        }
+    }
+    if (!kexts) {
+        kexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+            toolArgs.repositoryURLs);
+    }
     if (!kexts) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
             "Can't read kexts from folders.");
         goto finish;
     }
+
+    if (toolArgs.flagPlist) {
+        result = findLibsForKexts(&toolArgs);
+        goto finish;
+    }
     
     toolArgs.kextURL = CFURLCreateFromFileSystemRepresentation(
         kCFAllocatorDefault, (u_char *)toolArgs.kextName,
@@ -281,9 +304,11 @@ finish:
     SAFE_FREE(arches);
 
     SAFE_RELEASE(toolArgs.repositoryURLs);
+    SAFE_RELEASE(toolArgs.batchURLs);
     SAFE_RELEASE(toolArgs.kextURL);
     SAFE_RELEASE(toolArgs.theKext);
     SAFE_RELEASE(kexts);        // this is the one clang unexpectedly noticed
+    SAFE_RELEASE(snapshot);
 
     if (libInfo) {
         for (i = 0; i < numArches; i++) {
@@ -298,6 +323,16 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+* A library is any kext with an OSBundleCompatibleVersion.
+*******************************************************************************/
+static Boolean
+isLibrarySnapshotEntry(CFDictionaryRef entry, void * context __unused)
+{
+    return CFDictionaryContainsKey(entry,
+        CFSTR(kOSBundleCompatibleVersionKey));
+}
+
 /*******************************************************************************
 *******************************************************************************/
 ExitStatus readArgs(
@@ -398,6 +433,10 @@ ExitStatus readArgs(
                         toolArgs->flagAllowUnsupported = true;
                         break;
 
+                    case kLongOptPlist:
+                        toolArgs->flagPlist = true;
+                        break;
+
                 }
                 break;
             
@@ -417,6 +456,39 @@ ExitStatus readArgs(
         goto finish;
     }
 
+   /* In batch mode, take any number of kexts, and directories of them.
+    */
+    if (toolArgs->flagPlist) {
+        toolArgs->batchURLs = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+            &kCFTypeArrayCallBacks);
+        if (!toolArgs->batchURLs) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+        for (; argc; argc--, argv++) {
+            CFURLRef url = NULL;  // must release
+
+            scratchResult = checkPath(argv[0], /* suffix */ NULL,
+                /* directoryRequired */ TRUE, /* writableRequired */ FALSE);
+            if (scratchResult != EX_OK) {
+                result = scratchResult;
+                goto finish;
+            }
+            url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault,
+                (const UInt8 *)argv[0], strlen(argv[0]), /* isDirectory */ true);
+            if (!url) {
+                OSKextLogMemError();
+                result = EX_OSERR;
+                goto finish;
+            }
+            addToArrayIfAbsent(toolArgs->batchURLs, url);
+            CFRelease(url);
+        }
+        result = EX_OK;
+        goto finish;
+    }
+
     scratchResult = checkPath(argv[0], kOSKextBundleExtension,
         /* directoryRequired */ TRUE, /* writableRequired */ FALSE);
     if (scratchResult != EX_OK) {
@@ -655,6 +727,459 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+* Batch mode (-plist): find libraries for every kext named on the command
+* line, or in a directory named there, and print the results to stdout as one
+* XML plist, an array with a dictionary per kext. The repositories are read
+* once for the whole batch, and each arch is resolved across all the kexts
+* before moving to the next, so OSKext switches architecture (and reloads
+* library executables) once per arch rather than once per kext.
+*******************************************************************************/
+#define kBatchPathKey            CFSTR("Path")
+#define kBatchErrorKey           CFSTR("Error")
+#define kBatchProblemsKey        CFSTR("Problems")
+#define kBatchUndefSymbolsKey    CFSTR("Undefined Symbols")
+#define kBatchMultdefSymbolsKey  CFSTR("Multiply Defined Symbols")
+
+ExitStatus findLibsForKexts(KextlibsArgs * toolArgs)
+{
+    ExitStatus              result         = EX_OK;
+    CFMutableArrayRef       batchKexts     = NULL;  // must release
+    CFMutableArrayRef       kextResults    = NULL;  // must release
+    CFMutableArrayRef       archLibs       = NULL;  // must release
+    CFMutableArrayRef       batchArches    = NULL;  // must release; no callbacks
+    const NXArchInfo     ** kextArches     = NULL;  // must free
+    const NXArchInfo    *** allKextArches  = NULL;  // must free, and contents
+    CFArrayRef              dirKexts       = NULL;  // must release
+    OSKextRef               aKext          = NULL;  // must release
+    CFMutableDictionaryRef  kextResult     = NULL;  // must release
+    CFMutableDictionaryRef  problems       = NULL;  // must release
+    CFArrayRef              libKexts       = NULL;  // must release
+    CFDictionaryRef         undefSymbols   = NULL;  // must release
+    CFDictionaryRef         onedefSymbols  = NULL;  // must release
+    CFDictionaryRef         multdefSymbols = NULL;  // must release
+    CFArrayRef              multdefLibs    = NULL;  // must release
+    CFMutableDictionaryRef  libs           = NULL;  // must release
+    CFStringRef             path           = NULL;  // must release
+    CFDataRef               plistData      = NULL;  // must release
+    char                    urlPath[PATH_MAX];
+    CFIndex                 numKexts       = 0;
+    CFIndex                 numArches;
+    CFIndex                 count, i, j, k;
+
+    if (!createCFMutableArray(&batchKexts, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&kextResults, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&archLibs, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&batchArches, /* callbacks */ NULL)) {
+
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+
+   /* Gather up the kexts; a directory that isn't a kext is taken to hold
+    * them.
+    */
+    count = CFArrayGetCount(toolArgs->batchURLs);
+    for (i = 0; i < count; i++) {
+        CFURLRef    url       = CFArrayGetValueAtIndex(toolArgs->batchURLs, i);
+        CFStringRef extension = CFURLCopyPathExtension(url);  // must release
+        Boolean     isKext    = extension &&
+            CFEqual(extension, CFSTR(kOSKextBundleExtension));
+
+        SAFE_RELEASE(extension);
+        SAFE_RELEASE_NULL(aKext);
+        SAFE_RELEASE_NULL(dirKexts);
+
+        if (isKext) {
+            aKext = OSKextCreate(kCFAllocatorDefault, url);
+            if (aKext) {
+                addToArrayIfAbsent(batchKexts, aKext);
+                continue;
+            }
+        } else {
+            dirKexts = OSKextCreateKextsFromURL(kCFAllocatorDefault, url);
+            if (dirKexts) {
+                for (j = 0; j < CFArrayGetCount(dirKexts); j++) {
+                    addToArrayIfAbsent(batchKexts,
+                        CFArrayGetValueAtIndex(dirKexts, j));
+                }
+                continue;
+            }
+        }
+        if (CFURLGetFileSystemRepresentation(url, /* resolveToBase */ true,
+            (UInt8 *)urlPath, sizeof(urlPath))) {
+
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                "Can't open %s.", urlPath);
+        }
+        result = EX_DATAERR;
+    }
+
+    numKexts = CFArrayGetCount(batchKexts);
+    allKextArches = (const NXArchInfo ***)calloc(numKexts ? numKexts : 1,
+        sizeof(*allKextArches));
+    if (!allKextArches) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+
+   /* Set up a result for each kext, noting those we can't advise on, and
+    * collect the arches to resolve for.
+    */
+    for (i = 0; i < numKexts; i++) {
+        OSKextRef batchKext = (OSKextRef)CFArrayGetValueAtIndex(batchKexts, i);
+
+        SAFE_RELEASE_NULL(kextResult);
+        SAFE_RELEASE_NULL(path);
+
+        path = copyKextPath(batchKext);
+        if (!path || !createCFMutableDictionary(&kextResult)) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+        CFDictionarySetValue(kextResult, kBatchPathKey, path);
+        if (OSKextGetIdentifier(batchKext)) {
+            CFDictionarySetValue(kextResult, kCFBundleIdentifierKey,
+                OSKextGetIdentifier(batchKext));
+        }
+        CFArrayAppendValue(kextResults, kextResult);
+
+        if (!OSKextDeclaresExecutable(batchKext)) {
+            CFDictionarySetValue(kextResult, kBatchErrorKey,
+                OSKextIsLibrary(batchKext) ?
+                CFSTR("Library without an executable.") :
+                CFSTR("No executable; does not need OSBundleLibraries."));
+            continue;
+        }
+
+        kextArches = OSKextCopyArchitectures(batchKext);
+        if (!kextArches || !kextArches[0]) {
+            CFDictionarySetValue(kextResult, kBatchErrorKey,
+                CFSTR("Can't determine architectures."));
+            SAFE_FREE_NULL(kextArches);
+            result = EX_DATAERR;
+            continue;
+        }
+        for (j = 0; kextArches[j]; j++) {
+            numArches = CFArrayGetCount(batchArches);
+            for (k = 0; k < numArches; k++) {
+                const NXArchInfo * arch = CFArrayGetValueAtIndex(batchArches, k);
+                if (arch->cputype == kextArches[j]->cputype &&
+                    arch->cpusubtype == kextArches[j]->cpusubtype) {
+                    break;
+                }
+            }
+            if (k == numArches) {
+                CFArrayAppendValue(batchArches, kextArches[j]);
+            }
+        }
+        allKextArches[i] = kextArches;
+        kextArches = NULL;
+    }
+
+   /* Resolve arch by arch. archLibs holds each kext's libraries for each
+    * arch (as a dictionary keyed by arch name) until they're all in.
+    */
+    for (i = 0; i < numKexts; i++) {
+        SAFE_RELEASE_NULL(libs);
+        if (!createCFMutableDictionary(&libs)) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+        CFArrayAppendValue(archLibs, libs);
+    }
+    SAFE_RELEASE_NULL(libs);
+
+    numArches = CFArrayGetCount(batchArches);
+    for (j = 0; j < numArches; j++) {
+        const NXArchInfo * arch = CFArrayGetValueAtIndex(batchArches, j);
+        CFStringRef        archName = NULL;  // must release
+
+        if (!OSKextSetArchitecture(arch)) {
+            result = EX_OSERR;
+            goto finish;
+        }
+        archName = CFStringCreateWithCString(kCFAllocatorDefault, arch->name,
+            kCFStringEncodingUTF8);
+        if (!archName) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            goto finish;
+        }
+
+        for (i = 0; i < numKexts; i++) {
+            OSKextRef batchKext = (OSKextRef)CFArrayGetValueAtIndex(batchKexts, i);
+            CFIndex   undefCount, multdefCount;
+
+            if (!allKextArches[i]) {
+                continue;
+            }
+            for (k = 0; allKextArches[i][k]; k++) {
+                if (allKextArches[i][k]->cputype == arch->cputype &&
+                    allKextArches[i][k]->cpusubtype == arch->cpusubtype) {
+                    break;
+                }
+            }
+            if (!allKextArches[i][k]) {
+                continue;
+            }
+
+            SAFE_RELEASE_NULL(libKexts);
+            SAFE_RELEASE_NULL(undefSymbols);
+            SAFE_RELEASE_NULL(onedefSymbols);
+            SAFE_RELEASE_NULL(multdefSymbols);
+            SAFE_RELEASE_NULL(multdefLibs);
+            SAFE_RELEASE_NULL(libs);
+
+            libKexts = OSKextFindLinkDependencies(batchKext,
+                toolArgs->flagNonKPI, toolArgs->flagAllowUnsupported,
+                &undefSymbols, &onedefSymbols,
+                &multdefSymbols, &multdefLibs);
+            libs = libKexts ? createLibsDict(toolArgs, libKexts) : NULL;
+            if (!libs) {
+                OSKextLogMemError();
+                CFRelease(archName);
+                result = EX_OSERR;
+                goto finish;
+            }
+            CFDictionarySetValue(
+                (CFMutableDictionaryRef)CFArrayGetValueAtIndex(archLibs, i),
+                archName, libs);
+
+            undefCount = undefSymbols ? CFDictionaryGetCount(undefSymbols) : 0;
+            multdefCount = multdefSymbols ? CFDictionaryGetCount(multdefSymbols) : 0;
+            if (undefCount || multdefCount) {
+                CFMutableDictionaryRef thisResult   = NULL;  // do not release
+                CFMutableDictionaryRef archProblems = NULL;  // must release
+                CFMutableDictionaryRef allProblems  = NULL;  // do not release
+                CFArrayRef             symbols      = NULL;  // must release
+
+                thisResult = (CFMutableDictionaryRef)CFArrayGetValueAtIndex(
+                    kextResults, i);
+                allProblems = (CFMutableDictionaryRef)CFDictionaryGetValue(
+                    thisResult, kBatchProblemsKey);
+                if (!allProblems) {
+                    SAFE_RELEASE_NULL(problems);
+                    if (!createCFMutableDictionary(&problems)) {
+                        OSKextLogMemError();
+                        CFRelease(archName);
+                        result = EX_OSERR;
+                        goto finish;
+                    }
+                    CFDictionarySetValue(thisResult, kBatchProblemsKey, problems);
+                    allProblems = problems;
+                }
+
+                if (!createCFMutableDictionary(&archProblems)) {
+                    OSKextLogMemError();
+                    CFRelease(archName);
+                    result = EX_OSERR;
+                    goto finish;
+                }
+                if (undefCount) {
+                    symbols = createSortedKeys(undefSymbols);
+                    if (symbols) {
+                        CFDictionarySetValue(archProblems,
+                            kBatchUndefSymbolsKey, symbols);
+                    }
+                    SAFE_RELEASE_NULL(symbols);
+                    if (result < kKextlibsExitUndefineds) {
+                        result = kKextlibsExitUndefineds;
+                    }
+                }
+                if (multdefCount) {
+                    symbols = createSortedKeys(multdefSymbols);
+                    if (symbols) {
+                        CFDictionarySetValue(archProblems,
+                            kBatchMultdefSymbolsKey, symbols);
+                    }
+                    SAFE_RELEASE_NULL(symbols);
+                    if (result < kKextlibsExitMultiples) {
+                        result = kKextlibsExitMultiples;
+                    }
+                }
+                CFDictionarySetValue(allProblems, archName, archProblems);
+                CFRelease(archProblems);
+            }
+        }
+        CFRelease(archName);
+    }
+
+   /* As with -xml, libraries that are the same for every arch are given
+    * once, as OSBundleLibraries, and otherwise as OSBundleLibraries_<arch>.
+    */
+    for (i = 0; i < numKexts; i++) {
+        CFMutableDictionaryRef thisResult   = NULL;  // do not release
+        CFDictionaryRef        perArch      = CFArrayGetValueAtIndex(archLibs, i);
+        CFArrayRef             archNames    = NULL;  // must release
+        CFDictionaryRef        firstLibs    = NULL;  // do not release
+        Boolean                archSpecific = false;
+
+        thisResult = (CFMutableDictionaryRef)CFArrayGetValueAtIndex(
+            kextResults, i);
+
+        archNames = createSortedKeys(perArch);
+        count = archNames ? CFArrayGetCount(archNames) : 0;
+        for (j = 0; j < count; j++) {
+            CFDictionaryRef thisLibs = CFDictionaryGetValue(perArch,
+                CFArrayGetValueAtIndex(archNames, j));
+            if (!firstLibs) {
+                firstLibs = thisLibs;
+            } else if (!CFEqual(firstLibs, thisLibs)) {
+                archSpecific = true;
+            }
+        }
+        if (firstLibs && !archSpecific) {
+            CFDictionarySetValue(thisResult, CFSTR(kOSBundleLibrariesKey),
+                firstLibs);
+        } else {
+            for (j = 0; j < count; j++) {
+                CFStringRef archName = CFArrayGetValueAtIndex(archNames, j);
+                const NXArchInfo * genericArch = NULL;
+                CFStringRef key = NULL;  // must release
+                char archCString[64];
+
+                if (!CFStringGetCString(archName, archCString,
+                    sizeof(archCString), kCFStringEncodingUTF8)) {
+                    continue;
+                }
+                genericArch = NXGetArchInfoFromName(archCString);
+                if (genericArch) {
+                    genericArch = NXGetArchInfoFromCpuType(genericArch->cputype,
+                        CPU_SUBTYPE_MULTIPLE);
+                }
+                key = CFStringCreateWithFormat(kCFAllocatorDefault,
+                    /* formatOptions */ NULL, CFSTR("%s_%s"),
+                    kOSBundleLibrariesKey,
+                    genericArch ? genericArch->name : archCString);
+                if (key) {
+                    CFDictionarySetValue(thisResult, key,
+                        CFDictionaryGetValue(perArch, archName));
+                    CFRelease(key);
+                }
+            }
+        }
+        SAFE_RELEASE(archNames);
+    }
+
+    plistData = CFPropertyListCreateData(kCFAllocatorDefault, kextResults,
+        kCFPropertyListXMLFormat_v1_0, /* options */ 0, /* error */ NULL);
+    if (!plistData) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        goto finish;
+    }
+    fwrite(CFDataGetBytePtr(plistData), 1, CFDataGetLength(plistData), stdout);
+
+finish:
+    if (allKextArches) {
+        for (i = 0; i < numKexts; i++) {
+            SAFE_FREE(allKextArches[i]);
+        }
+        free(allKextArches);
+    }
+    SAFE_FREE(kextArches);
+    SAFE_RELEASE(batchKexts);
+    SAFE_RELEASE(kextResults);
+    SAFE_RELEASE(archLibs);
+    SAFE_RELEASE(batchArches);
+    SAFE_RELEASE(dirKexts);
+    SAFE_RELEASE(aKext);
+    SAFE_RELEASE(kextResult);
+    SAFE_RELEASE(problems);
+    SAFE_RELEASE(libKexts);
+    SAFE_RELEASE(undefSymbols);
+    SAFE_RELEASE(onedefSymbols);
+    SAFE_RELEASE(multdefSymbols);
+    SAFE_RELEASE(multdefLibs);
+    SAFE_RELEASE(libs);
+    SAFE_RELEASE(path);
+    SAFE_RELEASE(plistData);
+    return result;
+}
+
+/*******************************************************************************
+* The OSBundleLibraries dictionary printLibs() would print for libKexts.
+*******************************************************************************/
+CFMutableDictionaryRef createLibsDict(
+    KextlibsArgs * toolArgs,
+    CFArrayRef     libKexts)
+{
+    CFMutableDictionaryRef result = NULL;
+    CFStringRef            versString = NULL;  // must release
+    CFIndex                count, i;
+
+    if (!createCFMutableDictionary(&result)) {
+        goto finish;
+    }
+
+    count = CFArrayGetCount(libKexts);
+    for (i = 0; i < count; i++) {
+        OSKextRef      libKext = (OSKextRef)CFArrayGetValueAtIndex(libKexts, i);
+        OSKextVersion  version;
+        char           versCString[kOSKextVersionMaxLength];
+
+        if (toolArgs->flagCompatible) {
+            version = OSKextGetCompatibleVersion(libKext);
+        } else {
+            version = OSKextGetVersion(libKext);
+        }
+        if (!OSKextGetIdentifier(libKext) || version <= kOSKextVersionUndefined) {
+            continue;
+        }
+        OSKextVersionGetString(version, versCString, sizeof(versCString));
+        versString = CFStringCreateWithCString(kCFAllocatorDefault,
+            versCString, kCFStringEncodingUTF8);
+        if (!versString) {
+            SAFE_RELEASE_NULL(result);
+            goto finish;
+        }
+        CFDictionarySetValue(result, OSKextGetIdentifier(libKext), versString);
+        SAFE_RELEASE_NULL(versString);
+    }
+
+finish:
+    SAFE_RELEASE(versString);
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+CFArrayRef createSortedKeys(CFDictionaryRef dict)
+{
+    CFMutableArrayRef result = NULL;
+    const void     ** keys   = NULL;  // must free
+    CFIndex           count, i;
+
+    count = CFDictionaryGetCount(dict);
+    if (!createCFMutableArray(&result, &kCFTypeArrayCallBacks)) {
+        goto finish;
+    }
+    if (!count) {
+        goto finish;
+    }
+    keys = (const void **)malloc(count * sizeof(*keys));
+    if (!keys) {
+        SAFE_RELEASE_NULL(result);
+        goto finish;
+    }
+    CFDictionaryGetKeysAndValues(dict, keys, /* values */ NULL);
+    for (i = 0; i < count; i++) {
+        CFArrayAppendValue(result, keys[i]);
+    }
+    CFArraySortValues(result, RANGE_ALL(result),
+        (CFComparatorFunction)CFStringCompare, /* context */ NULL);
+
+finish:
+    SAFE_FREE(keys);
+    return result;
+}
+
 /*******************************************************************************
 *
 *******************************************************************************/
@@ -785,6 +1310,8 @@ finish:
 static void usage(UsageLevel usageLevel)
 {
     fprintf(stderr, "usage: %s [options] kext\n", progname);
+    fprintf(stderr, "       %s -%s [options] kext_or_directory ...\n",
+        progname, kOptNamePlist);
 
     if (usageLevel == kUsageLevelBrief) {
         fprintf(stderr, "\nuse %s -%s for a list of options\n",
@@ -800,6 +1327,9 @@ static void usage(UsageLevel usageLevel)
     fprintf(stderr, "-%s <arch>:\n", kOptNameArch);
     fprintf(stderr, "        resolve for architecture <arch> instead of running kernel's\n");
     fprintf(stderr, "-%s:   print XML fragment suitable for pasting\n", kOptNameXML);
+    fprintf(stderr, "-%s: take any number of kexts or directories of kexts,\n"
+        "        and print the results for all of them as an XML plist\n",
+        kOptNamePlist);
 
      // fake out compiler for blank line
      fprintf(stderr, "\n");
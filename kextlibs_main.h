@@ -48,6 +48,7 @@ enum {
 #define kOptNameNonKPI            "non-kpi"
 #define kOptNameUnsupported       "unsupported"
 #define kOptNameLibraryRefs       "library-references"
+#define kOptNamePlist             "plist"
 
 #define kOptCompatible           'c'
 #define kOptSystemExtensions     'e'
@@ -66,6 +67,7 @@ enum {
 #define kLongOptMultdefSymbols (-7)
 #define kLongOptNonKPI         (-8)
 #define kLongOptUnsupported    (-9)
+#define kLongOptPlist          (-10)
 
 int longopt = 0;
 
@@ -81,6 +83,7 @@ struct option sOptInfo[] = {
     { kOptNameMultdefSymbols,   no_argument,        &longopt, kLongOptMultdefSymbols },
     { kOptNameNonKPI,           no_argument,        &longopt, kLongOptNonKPI },
     { kOptNameUnsupported,      no_argument,        &longopt, kLongOptUnsupported },
+    { kOptNamePlist,            no_argument,        &longopt, kLongOptPlist },
 
     { kOptNameQuiet,                 no_argument,        NULL,     kOptQuiet },
     { kOptNameVerbose,               optional_argument,  NULL,     kOptVerbose },
@@ -101,7 +104,9 @@ typedef struct {
     Boolean            flagPrintMultdefSymbols;
     Boolean            flagNonKPI;
     Boolean            flagAllowUnsupported;
+    Boolean            flagPlist;
     CFMutableArrayRef  repositoryURLs;   // must release
+    CFMutableArrayRef  batchURLs;        // must release; kexts & dirs for -plist
     char             * kextName;         // do not free; from argv
     CFURLRef           kextURL;          // must release
     OSKextRef          theKext;
@@ -149,6 +154,13 @@ ExitStatus printResults(
     CFDictionaryRef    onedefSymbols,
     CFDictionaryRef    multdefSymbols,
     CFArrayRef         multdefLibs);
+ExitStatus findLibsForKexts(
+    KextlibsArgs     * toolArgs);
+CFMutableDictionaryRef createLibsDict(
+    KextlibsArgs     * toolArgs,
+    CFArrayRef         libKexts);
+CFArrayRef createSortedKeys(
+    CFDictionaryRef    dict);
 void printUndefSymbol(const void * key, const void * value, void * context);
 void printOnedefSymbol(const void * key, const void * value, void * context);
 void printMultdefSymbol(const void * key, const void * value, void * context);
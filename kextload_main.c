@@ -18,6 +18,7 @@
 #include <IOKit/kext/KextManager.h>
 #include <IOKit/kext/KextManagerPriv.h>
 #include <IOKit/kext/kextmanager_types.h>
+#include <IOKit/kext/kextmanager_mig.h>
 #include <IOKit/kext/OSKextPrivate.h>
 
 #pragma mark Constants
@@ -376,6 +377,13 @@ ExitStatus loadKextsViaKextd(KextloadArgs * toolArgs)
     OSReturn   loadResult = kOSReturnError;
     char       scratchCString[PATH_MAX];
     CFIndex    count, index;
+
+    if (CFArrayGetCount(toolArgs->kextIDs) +
+        CFArrayGetCount(toolArgs->kextURLs) > 1) {
+
+        result = loadKextsViaKextdBatch(toolArgs);
+        goto finish;
+    }
  
     count = CFArrayGetCount(toolArgs->kextIDs);
     for (index = 0; index < count; index++) {
@@ -448,6 +456,270 @@ ExitStatus loadKextsViaKextd(KextloadArgs * toolArgs)
         }
     }
 
+finish:
+    return result;
+}
+
+/*******************************************************************************
+* Returns the absolute POSIX path of anURL, which kextd requires.
+*******************************************************************************/
+static CFStringRef
+createAbsolutePathForURL(CFURLRef anURL)
+{
+    CFStringRef result      = NULL;  // returned
+    CFURLRef    absoluteURL = NULL;  // must release
+
+    absoluteURL = CFURLCopyAbsoluteURL(anURL);
+    if (absoluteURL) {
+        result = CFURLCopyFileSystemPath(absoluteURL, kCFURLPOSIXPathStyle);
+    }
+    SAFE_RELEASE(absoluteURL);
+    return result;
+}
+
+/*******************************************************************************
+* Logs the outcome for each kext in a batch load request. kextd returns only
+* the first failure for the batch, so when something failed, a kext counts as
+* loaded if the kernel has it loaded now; the others get the batch's error.
+* kextIdentifiers holds each kext's bundle identifier, or kCFNull if unknown.
+*******************************************************************************/
+static void
+logBatchLoadResults(
+    CFArrayRef kextNames,
+    CFArrayRef kextIdentifiers,
+    OSReturn   loadResult)
+{
+    CFMutableArrayRef knownIDs     = NULL;  // must release
+    CFMutableArrayRef infoKeys     = NULL;  // must release
+    CFDictionaryRef   loadedInfo   = NULL;  // must release
+    char              scratchCString[PATH_MAX];
+    CFIndex           count, index;
+
+    count = CFArrayGetCount(kextNames);
+
+    if (loadResult != kOSReturnSuccess &&
+        createCFMutableArray(&knownIDs, &kCFTypeArrayCallBacks) &&
+        createCFMutableArray(&infoKeys, &kCFTypeArrayCallBacks)) {
+
+        for (index = 0; index < count; index++) {
+            CFTypeRef kextID = CFArrayGetValueAtIndex(kextIdentifiers, index);
+
+            if (kextID != kCFNull) {
+                addToArrayIfAbsent(knownIDs, kextID);
+            }
+        }
+        if (CFArrayGetCount(knownIDs)) {
+            CFArrayAppendValue(infoKeys, kCFBundleIdentifierKey);
+            loadedInfo = OSKextCopyLoadedKextInfo(knownIDs, infoKeys);
+            if (!loadedInfo) {
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogGeneralFlag |
+                    kOSKextLogIPCFlag,
+                    "Couldn't get list of loaded kexts from kernel.");
+            }
+        }
+    }
+
+    for (index = 0; index < count; index++) {
+        CFStringRef kextName = CFArrayGetValueAtIndex(kextNames, index);
+        CFTypeRef   kextID   = CFArrayGetValueAtIndex(kextIdentifiers, index);
+        Boolean     loaded   = (loadResult == kOSReturnSuccess);
+
+        if (!CFStringGetCString(kextName, scratchCString,
+            sizeof(scratchCString), kCFStringEncodingUTF8)) {
+
+            strlcpy(scratchCString, "unknown", sizeof(scratchCString));
+        }
+        if (!loaded && loadedInfo && kextID != kCFNull &&
+            CFDictionaryGetValue(loadedInfo, kextID)) {
+
+            loaded = true;
+        }
+
+        if (!loaded) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+                "%s failed to load - %s; "
+                "check the system/kernel logs for errors or try kextutil(8).",
+                scratchCString, safe_mach_error_string(loadResult));
+        } else {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogBasicLevel | kOSKextLogGeneralFlag | kOSKextLogLoadFlag,
+                "%s loaded successfully (or already loaded).",
+                scratchCString);
+        }
+    }
+
+    SAFE_RELEASE(knownIDs);
+    SAFE_RELEASE(infoKeys);
+    SAFE_RELEASE(loadedInfo);
+    return;
+}
+
+/*******************************************************************************
+* Sends every named kext to kextd in a single load request, so that kextd
+* reads the extensions, resolves the dependencies, and checks the signatures
+* once for all of them, then loads them in dependency order.  kextd returns
+* the first failure for the batch and keeps going past it, so the result for
+* each kext is logged afterward from what the kernel has loaded.
+*******************************************************************************/
+ExitStatus loadKextsViaKextdBatch(KextloadArgs * toolArgs)
+{
+    ExitStatus             result          = EX_OSERR;
+    OSReturn               loadResult      = kOSReturnError;
+    mach_port_t            kextd_port      = MACH_PORT_NULL;
+    CFMutableDictionaryRef request         = NULL;  // must release
+    CFMutableArrayRef      batch           = NULL;  // must release
+    CFMutableArrayRef      dependencyPaths = NULL;  // must release
+    CFMutableArrayRef      kextNames       = NULL;  // must release
+    CFMutableArrayRef      kextIdentifiers = NULL;  // must release
+    CFDictionaryRef        entry           = NULL;  // must release
+    CFDictionaryRef        infoDict        = NULL;  // must release
+    CFStringRef            path            = NULL;  // must release
+    CFDataRef              requestData     = NULL;  // must release
+    CFTypeRef              kextID          = NULL;  // do not release
+    CFIndex                count, index;
+
+    request = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!request ||
+        !createCFMutableArray(&batch, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&dependencyPaths, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&kextNames, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&kextIdentifiers, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    count = CFArrayGetCount(toolArgs->kextIDs);
+    for (index = 0; index < count; index++) {
+        const void * key   = kKextLoadIdentifierKey;
+        const void * value = CFArrayGetValueAtIndex(toolArgs->kextIDs, index);
+
+        SAFE_RELEASE_NULL(entry);
+        entry = CFDictionaryCreate(kCFAllocatorDefault, &key, &value, 1,
+            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!entry) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFArrayAppendValue(batch, entry);
+        CFArrayAppendValue(kextNames, value);
+        CFArrayAppendValue(kextIdentifiers, value);
+    }
+
+    count = CFArrayGetCount(toolArgs->kextURLs);
+    for (index = 0; index < count; index++) {
+        const void * key     = kKextLoadPathKey;
+        CFURLRef     kextURL = CFArrayGetValueAtIndex(toolArgs->kextURLs, index);
+
+        SAFE_RELEASE_NULL(entry);
+        SAFE_RELEASE_NULL(infoDict);
+        SAFE_RELEASE_NULL(path);
+        path = createAbsolutePathForURL(kextURL);
+        if (!path) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        entry = CFDictionaryCreate(kCFAllocatorDefault,
+            &key, (const void **)&path, 1,
+            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!entry) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFArrayAppendValue(batch, entry);
+        CFArrayAppendValue(kextNames, path);
+
+       /* The identifier is only needed to report the result for this kext.
+        */
+        kextID = NULL;
+        infoDict = CFBundleCopyInfoDictionaryForURL(kextURL);
+        if (infoDict) {
+            kextID = CFDictionaryGetValue(infoDict, kCFBundleIdentifierKey);
+        }
+        if (!kextID || CFGetTypeID(kextID) != CFStringGetTypeID()) {
+            kextID = kCFNull;
+        }
+        CFArrayAppendValue(kextIdentifiers, kextID);
+    }
+    CFDictionarySetValue(request, kKextLoadBatchKey, batch);
+
+    count = CFArrayGetCount(toolArgs->scanURLs);
+    for (index = 0; index < count; index++) {
+        SAFE_RELEASE_NULL(path);
+        path = createAbsolutePathForURL(
+            CFArrayGetValueAtIndex(toolArgs->scanURLs, index));
+        if (!path) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        CFArrayAppendValue(dependencyPaths, path);
+    }
+    if (CFArrayGetCount(dependencyPaths)) {
+        CFDictionarySetValue(request, kKextLoadDependenciesKey,
+            dependencyPaths);
+    }
+
+    requestData = CFPropertyListCreateData(kCFAllocatorDefault, request,
+        kCFPropertyListXMLFormat_v1_0, /* options */ 0, /* error */ NULL);
+    if (!requestData) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Can't create kext load request.");
+        goto finish;
+    }
+
+    if (bootstrap_look_up(bootstrap_port, (char *)KEXTD_SERVER_NAME,
+        &kextd_port) != KERN_SUCCESS) {
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Can't contact kextd.");
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kextNames);
+    for (index = 0; index < count; index++) {
+        char scratchCString[PATH_MAX];
+
+        if (!CFStringGetCString(CFArrayGetValueAtIndex(kextNames, index),
+            scratchCString, sizeof(scratchCString), kCFStringEncodingUTF8)) {
+
+            strlcpy(scratchCString, "unknown", sizeof(scratchCString));
+        }
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogBasicLevel | kOSKextLogGeneralFlag |
+            kOSKextLogLoadFlag | kOSKextLogIPCFlag,
+            "Requesting load of %s.",
+            scratchCString);
+    }
+
+    loadResult = kextmanager_load_kext(kextd_port,
+        (char *)CFDataGetBytePtr(requestData),
+        (mach_msg_type_number_t)CFDataGetLength(requestData));
+    logBatchLoadResults(kextNames, kextIdentifiers, loadResult);
+    if (loadResult != kOSReturnSuccess) {
+        result = exitStatusForOSReturn(loadResult);
+        goto finish;
+    }
+    result = EX_OK;
+
+finish:
+    if (kextd_port != MACH_PORT_NULL) {
+        mach_port_deallocate(mach_task_self(), kextd_port);
+    }
+    SAFE_RELEASE(request);
+    SAFE_RELEASE(batch);
+    SAFE_RELEASE(dependencyPaths);
+    SAFE_RELEASE(kextNames);
+    SAFE_RELEASE(kextIdentifiers);
+    SAFE_RELEASE(entry);
+    SAFE_RELEASE(infoDict);
+    SAFE_RELEASE(path);
+    SAFE_RELEASE(requestData);
+
     return result;
 }
 
@@ -467,8 +739,16 @@ ExitStatus loadKextsIntoKernel(KextloadArgs * toolArgs)
     OSKextLog(/* kext */ NULL,
         kOSKextLogProgressLevel | kOSKextLogGeneralFlag,
         "Reading extensions.");
-    toolArgs->allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
-        toolArgs->scanURLs);
+    if (!CFArrayGetCount(toolArgs->repositoryURLs) &&
+        !CFArrayGetCount(toolArgs->dependencyURLs)) {
+
+        toolArgs->allKexts = createKextsFromDependencyIndex(toolArgs->kextURLs,
+            toolArgs->kextIDs, OSKextGetArchitecture());
+    }
+    if (!toolArgs->allKexts) {
+        toolArgs->allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+            toolArgs->scanURLs);
+    }
     if (!toolArgs->allKexts) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
@@ -110,6 +110,7 @@ ExitStatus checkArgs(KextloadArgs * toolArgs);
 ExitStatus checkAccess(void);
 
 ExitStatus loadKextsViaKextd(KextloadArgs * toolArgs);
+ExitStatus loadKextsViaKextdBatch(KextloadArgs * toolArgs);
 ExitStatus loadKextsIntoKernel(KextloadArgs * toolArgs);
 
 ExitStatus exitStatusForOSReturn(OSReturn osReturn);
@@ -23,6 +23,7 @@
 #include <IOKit/kext/OSKext.h>
 #include <IOKit/kext/OSKextPrivate.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -72,6 +73,11 @@ ExitStatus main(int argc, char * const * argv)
         goto finish;
     }
 
+    if (toolArgs.watchInterval) {
+        result = watchLoadedKexts(&toolArgs);
+        goto finish;
+    }
+
     toolArgs.loadedKextInfo = OSKextCopyLoadedKextInfo(toolArgs.bundleIDs,
         NULL /* all info */);
 
@@ -188,6 +194,30 @@ ExitStatus readArgs(int argc, char * const * argv, KextstatArgs * toolArgs)
             case kOptSort:
                 toolArgs->flagSortByLoadAddress = true;
                 break;
+
+            case 0:
+                switch (longopt) {
+                    case kLongOptWatch:
+                    {
+                        char          * endptr = NULL;
+                        unsigned long   seconds;
+
+                        errno = 0;
+                        seconds = strtoul(optarg, &endptr, 10);
+                        if (errno || !*optarg || *endptr ||
+                            !seconds || seconds > UINT32_MAX) {
+
+                            OSKextLog(/* kext */ NULL,
+                                kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                                "Invalid value for -%s: %s.",
+                                kOptNameWatch, optarg);
+                            goto finish;
+                        }
+                        toolArgs->watchInterval = (uint32_t)seconds;
+                        break;
+                    }
+                }
+                break;
         }
     }
 
@@ -220,7 +250,6 @@ finish:
 
 void printKextInfo(CFDictionaryRef kextInfo, KextstatArgs * toolArgs)
 {
-    CFBooleanRef      isKernelComponent      = NULL;  // do not release
     CFNumberRef       loadTag                = NULL;  // do not release
     CFNumberRef       retainCount            = NULL;  // do not release
     CFNumberRef       loadAddress            = NULL;  // do not release
@@ -264,20 +293,8 @@ void printKextInfo(CFDictionaryRef kextInfo, KextstatArgs * toolArgs)
     kextUUID = (CFDataRef)CFDictionaryGetValue(kextInfo,
                                                CFSTR(kOSBundleUUIDKey));
 
-   /* If the -k flag was given, skip any kernel components unless
-    * they are explicitly requested.
-    */
-    if (toolArgs->flagNoKernelComponents) {
-        isKernelComponent = (CFBooleanRef)CFDictionaryGetValue(kextInfo,
-            CFSTR(kOSKernelResourceKey));
-        if (isKernelComponent && CFBooleanGetValue(isKernelComponent)) {
-            if (bundleID &&
-                kCFNotFound == CFArrayGetFirstIndexOfValue(toolArgs->bundleIDs,
-                    RANGE_ALL(toolArgs->bundleIDs), bundleID)) {
-
-                goto finish;
-            }
-        }
+    if (isHiddenKernelComponent(kextInfo, toolArgs)) {
+        goto finish;
     }
 
     if (!getNumValue(loadTag, kCFNumberSInt32Type, &loadTagValue)) {
@@ -425,6 +442,277 @@ finish:
     return;
 }
 
+/*******************************************************************************
+* If the -k flag was given, skip any kernel components unless
+* they are explicitly requested.
+*******************************************************************************/
+Boolean isHiddenKernelComponent(CFDictionaryRef kextInfo, KextstatArgs * toolArgs)
+{
+    CFBooleanRef isKernelComponent = NULL;  // do not release
+    CFStringRef  bundleID          = NULL;  // do not release
+
+    if (!toolArgs->flagNoKernelComponents) {
+        return false;
+    }
+
+    isKernelComponent = (CFBooleanRef)CFDictionaryGetValue(kextInfo,
+        CFSTR(kOSKernelResourceKey));
+    bundleID = (CFStringRef)CFDictionaryGetValue(kextInfo,
+        kCFBundleIdentifierKey);
+    if (isKernelComponent && CFBooleanGetValue(isKernelComponent)) {
+        if (bundleID &&
+            kCFNotFound == CFArrayGetFirstIndexOfValue(toolArgs->bundleIDs,
+                RANGE_ALL(toolArgs->bundleIDs), bundleID)) {
+
+            return true;
+        }
+    }
+    return false;
+}
+
+#pragma mark Watch Mode
+/*******************************************************************************
+* Watch mode stays resident and polls the kernel every watchInterval seconds,
+* asking only for the few keys needed to spot changes. Rather than the table,
+* it prints one tab-separated line per change since the previous poll:
+*
+*     <event> <load tag> <refs> <bundle id> <version>
+*
+* where event is "load", "unload", or "refs" (retain count changed). The first
+* poll reports every loaded kext as a load. A kext that was unloaded and
+* reloaded between polls shows as an unload followed by a load.
+*******************************************************************************/
+#define kWatchEventLoad     "load"
+#define kWatchEventUnload   "unload"
+#define kWatchEventRefs     "refs"
+
+ExitStatus watchLoadedKexts(KextstatArgs * toolArgs)
+{
+    ExitStatus         result       = EX_OSERR;
+    CFMutableArrayRef  infoKeys     = NULL;  // must release
+    CFDictionaryRef    previousInfo = NULL;  // must release
+    CFDictionaryRef    currentInfo  = NULL;  // must release
+
+    if (!createCFMutableArray(&infoKeys, &kCFTypeArrayCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFArrayAppendValue(infoKeys, kCFBundleIdentifierKey);
+    CFArrayAppendValue(infoKeys, kCFBundleVersionKey);
+    CFArrayAppendValue(infoKeys, CFSTR(kOSBundleLoadTagKey));
+    CFArrayAppendValue(infoKeys, CFSTR(kOSBundleRetainCountKey));
+    if (toolArgs->flagNoKernelComponents) {
+        CFArrayAppendValue(infoKeys, CFSTR(kOSKernelResourceKey));
+    }
+
+    while (true) {
+        currentInfo = OSKextCopyLoadedKextInfo(toolArgs->bundleIDs, infoKeys);
+        if (!currentInfo) {
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogGeneralFlag | kOSKextLogIPCFlag,
+                "Couldn't get list of loaded kexts from kernel.");
+            goto finish;
+        }
+
+        printKextInfoDelta(previousInfo, currentInfo, toolArgs);
+        fflush(stdout);
+
+        SAFE_RELEASE(previousInfo);
+        previousInfo = currentInfo;
+        currentInfo = NULL;
+
+        sleep(toolArgs->watchInterval);
+    }
+
+finish:
+    SAFE_RELEASE(infoKeys);
+    SAFE_RELEASE(previousInfo);
+    SAFE_RELEASE(currentInfo);
+    return result;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void printKextInfoDelta(
+    CFDictionaryRef  previousInfo,
+    CFDictionaryRef  currentInfo,
+    KextstatArgs   * toolArgs)
+{
+    CFDictionaryRef * kextInfoList     = NULL;  // must free
+    CFDictionaryRef   kextInfo         = NULL;  // do not release
+    CFDictionaryRef   otherInfo        = NULL;  // do not release
+    CFStringRef       bundleID         = NULL;  // do not release
+    CFNumberRef       loadTag          = NULL;  // do not release
+    CFNumberRef       otherLoadTag     = NULL;  // do not release
+    CFNumberRef       retainCount      = NULL;  // do not release
+    CFNumberRef       otherRetainCount = NULL;  // do not release
+    CFIndex           count, i;
+
+   /* Unloads first: anything in the previous snapshot that is gone or
+    * has a new load tag (so it was reloaded in between).
+    */
+    if (previousInfo) {
+        kextInfoList = createSortedKextInfoList(previousInfo, &count);
+        for (i = 0; i < count; i++) {
+            kextInfo = kextInfoList[i];
+            bundleID = (CFStringRef)CFDictionaryGetValue(kextInfo,
+                kCFBundleIdentifierKey);
+            otherInfo = bundleID ?
+                (CFDictionaryRef)CFDictionaryGetValue(currentInfo, bundleID) :
+                NULL;
+            loadTag = (CFNumberRef)CFDictionaryGetValue(kextInfo,
+                CFSTR(kOSBundleLoadTagKey));
+            otherLoadTag = otherInfo ?
+                (CFNumberRef)CFDictionaryGetValue(otherInfo,
+                    CFSTR(kOSBundleLoadTagKey)) :
+                NULL;
+
+            if (isHiddenKernelComponent(kextInfo, toolArgs)) {
+                continue;
+            }
+            if (!otherLoadTag || !loadTag ||
+                !CFEqual(loadTag, otherLoadTag)) {
+
+                printKextInfoEvent(kWatchEventUnload, kextInfo);
+            }
+        }
+        SAFE_FREE_NULL(kextInfoList);
+    }
+
+   /* Then loads and retain count changes.
+    */
+    kextInfoList = createSortedKextInfoList(currentInfo, &count);
+    for (i = 0; i < count; i++) {
+        kextInfo = kextInfoList[i];
+        bundleID = (CFStringRef)CFDictionaryGetValue(kextInfo,
+            kCFBundleIdentifierKey);
+        otherInfo = (previousInfo && bundleID) ?
+            (CFDictionaryRef)CFDictionaryGetValue(previousInfo, bundleID) :
+            NULL;
+        loadTag = (CFNumberRef)CFDictionaryGetValue(kextInfo,
+            CFSTR(kOSBundleLoadTagKey));
+        otherLoadTag = otherInfo ?
+            (CFNumberRef)CFDictionaryGetValue(otherInfo,
+                CFSTR(kOSBundleLoadTagKey)) :
+            NULL;
+
+        if (isHiddenKernelComponent(kextInfo, toolArgs)) {
+            continue;
+        }
+        if (!otherLoadTag || !loadTag || !CFEqual(loadTag, otherLoadTag)) {
+            printKextInfoEvent(kWatchEventLoad, kextInfo);
+            continue;
+        }
+
+        retainCount = (CFNumberRef)CFDictionaryGetValue(kextInfo,
+            CFSTR(kOSBundleRetainCountKey));
+        otherRetainCount = (CFNumberRef)CFDictionaryGetValue(otherInfo,
+            CFSTR(kOSBundleRetainCountKey));
+        if (retainCount && otherRetainCount &&
+            !CFEqual(retainCount, otherRetainCount)) {
+
+            printKextInfoEvent(kWatchEventRefs, kextInfo);
+        }
+    }
+
+    SAFE_FREE(kextInfoList);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+void printKextInfoEvent(const char * event, CFDictionaryRef kextInfo)
+{
+    CFNumberRef  loadTag              = NULL;  // do not release
+    CFNumberRef  retainCount          = NULL;  // do not release
+    CFStringRef  bundleID             = NULL;  // do not release
+    CFStringRef  bundleVersion        = NULL;  // do not release
+    uint32_t     loadTagValue         = kOSKextInvalidLoadTag;
+    uint32_t     retainCountValue     = (uint32_t)-1;
+    char       * bundleIDCString      = NULL;  // must free
+    char       * bundleVersionCString = NULL;  // must free
+    char         loadTagBuffer[16];
+    char         retainCountBuffer[16];
+
+    loadTag = (CFNumberRef)CFDictionaryGetValue(kextInfo,
+        CFSTR(kOSBundleLoadTagKey));
+    retainCount = (CFNumberRef)CFDictionaryGetValue(kextInfo,
+        CFSTR(kOSBundleRetainCountKey));
+    bundleID = (CFStringRef)CFDictionaryGetValue(kextInfo,
+        kCFBundleIdentifierKey);
+    bundleVersion = (CFStringRef)CFDictionaryGetValue(kextInfo,
+        kCFBundleVersionKey);
+
+   /* Never report the kernel itself (loadTag 0, id __kernel__).
+    */
+    if (!getNumValue(loadTag, kCFNumberSInt32Type, &loadTagValue)) {
+        loadTagValue = kOSKextInvalidLoadTag;
+    }
+    if (loadTagValue == 0) {
+        goto finish;
+    }
+    if (!getNumValue(retainCount, kCFNumberSInt32Type, &retainCountValue)) {
+        retainCountValue = (uint32_t)-1;
+    }
+
+    if (loadTagValue == kOSKextInvalidLoadTag) {
+        strlcpy(loadTagBuffer, kStringInvalidShort, sizeof(loadTagBuffer));
+    } else {
+        snprintf(loadTagBuffer, sizeof(loadTagBuffer), "%u", loadTagValue);
+    }
+    if (retainCountValue == (uint32_t)-1) {
+        strlcpy(retainCountBuffer, kStringInvalidShort, sizeof(retainCountBuffer));
+    } else {
+        snprintf(retainCountBuffer, sizeof(retainCountBuffer), "%u",
+            retainCountValue);
+    }
+
+    bundleIDCString = createUTF8CStringForCFString(bundleID);
+    bundleVersionCString = createUTF8CStringForCFString(bundleVersion);
+
+    fprintf(stdout, "%s\t%s\t%s\t%s\t%s\n", event,
+        loadTagBuffer, retainCountBuffer,
+        bundleIDCString ? bundleIDCString : kStringInvalidLong,
+        bundleVersionCString ? bundleVersionCString : kStringInvalidLong);
+
+finish:
+    SAFE_FREE(bundleIDCString);
+    SAFE_FREE(bundleVersionCString);
+    return;
+}
+
+/*******************************************************************************
+* Returns a malloc'd list of the info dictionaries in loadedKextInfo, sorted
+* by load tag, or NULL if there are none (or on allocation failure);
+* *countOut is set to the number of entries returned.
+*******************************************************************************/
+CFDictionaryRef * createSortedKextInfoList(
+    CFDictionaryRef   loadedKextInfo,
+    CFIndex         * countOut)
+{
+    CFDictionaryRef * result = NULL;  // returned
+    CFIndex           count  = CFDictionaryGetCount(loadedKextInfo);
+
+    *countOut = 0;
+    if (!count) {
+        goto finish;
+    }
+
+    result = (CFDictionaryRef *)malloc(count * sizeof(CFDictionaryRef));
+    if (!result) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    CFDictionaryGetKeysAndValues(loadedKextInfo, /* keys */ NULL,
+        (const void **)result);
+    qsort(result, count, sizeof(CFDictionaryRef), &compareKextInfo);
+    *countOut = count;
+
+finish:
+    return result;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 Boolean getNumValue(CFNumberRef aNumber, CFNumberType type, void * valueOut)
@@ -528,7 +816,7 @@ CFComparisonResult compareNumbers(
 *******************************************************************************/
 static void usage(UsageLevel usageLevel)
 {
-    fprintf(stderr, "usage: %s [-a] [-k] [-l] [-b bundle_id] ...\n", progname);
+    fprintf(stderr, "usage: %s [-a] [-k] [-l] [-watch seconds] [-b bundle_id] ...\n", progname);
         
     if (usageLevel == kUsageLevelBrief) {
         fprintf(stderr, "\nUse %s -%s (-%c) for a list of options.\n",
@@ -546,6 +834,9 @@ static void usage(UsageLevel usageLevel)
             kOptNameArchitecture, kOptArchitecture);
     fprintf(stderr, "-%s (-%c): Sort by load address.\n",
             kOptNameSort, kOptSort);
+    fprintf(stderr, "-%s <seconds>: stay resident and print loads, unloads, and\n"
+        "    refcount changes every <seconds> seconds.\n",
+        kOptNameWatch);
     
     return;
 }
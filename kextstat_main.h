@@ -45,6 +45,7 @@ enum {
 #define kOptNameListOnly            "list-only"
 #define kOptNameArchitecture        "arch"
 #define kOptNameSort        "sort"
+#define kOptNameWatch               "watch"
 
 #define kOptNoKernelComponents      'k'
 #define kOptListOnly                'l'
@@ -76,6 +77,7 @@ kOSBundleMetaClassesKey
 // Do not use -1, that's getopt() end-of-args return value
 // and can cause confusion
 #define kLongOptLongindexHack (-2)
+#define kLongOptWatch         (-3)
 
 int longopt = 0;
 
@@ -86,6 +88,7 @@ struct option sOptInfo[] = {
     { kOptNameListOnly,           no_argument,        NULL,     kOptListOnly },
     { kOptNameSort,               no_argument,        NULL,     kOptSort },
     { kOptNameArch,               no_argument,        NULL,     kOptArchitecture },
+    { kOptNameWatch,              required_argument,  &longopt, kLongOptWatch },
 
     { NULL, 0, NULL, 0 }  // sentinel to terminate list
 };
@@ -100,6 +103,7 @@ typedef struct {
     Boolean            flagShowArchitecture;
     Boolean            flagSortByLoadAddress;
     CFMutableArrayRef  bundleIDs;          // must release
+    uint32_t           watchInterval;      // seconds; 0 means print once
     
     CFDictionaryRef    loadedKextInfo;     // must release
     const NXArchInfo * runningKernelArch;  // do not free
@@ -111,6 +115,17 @@ typedef struct {
 *******************************************************************************/
 ExitStatus readArgs(int argc, char * const * argv, KextstatArgs * toolArgs);
 void printKextInfo(CFDictionaryRef kextInfo, KextstatArgs * toolArgs);
+Boolean isHiddenKernelComponent(CFDictionaryRef kextInfo, KextstatArgs * toolArgs);
+
+ExitStatus watchLoadedKexts(KextstatArgs * toolArgs);
+void printKextInfoDelta(
+    CFDictionaryRef  previousInfo,
+    CFDictionaryRef  currentInfo,
+    KextstatArgs   * toolArgs);
+void printKextInfoEvent(const char * event, CFDictionaryRef kextInfo);
+CFDictionaryRef * createSortedKextInfoList(
+    CFDictionaryRef   loadedKextInfo,
+    CFIndex         * countOut);
 
 Boolean getNumValue(CFNumberRef aNumber, CFNumberType type, void * valueOut);
 int compareKextInfo(const void * vKextInfo1, const void * vKextInfo2);
@@ -26,6 +26,8 @@
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOKitServer.h>
 #include <IOKit/kext/OSKextPrivate.h>
+#include <dispatch/dispatch.h>
+#include <mach/kmod.h>
 
 #include "kextunload_main.h"
 
@@ -88,6 +90,17 @@ int main(int argc, char * const * argv)
         goto finish;
     }
 
+    if (toolArgs.parallel) {
+        scratchResult = unloadKextsInParallel(&toolArgs, &fatal);
+        if (result == EX_OK && scratchResult != EX_OK) {
+            result = scratchResult;
+        }
+        if (fatal) {
+            result = scratchResult;
+        }
+        goto finish;
+    }
+
     scratchResult = unloadKextsByIdentifier(&toolArgs, &fatal);
     if (result == EX_OK && scratchResult != EX_OK) {
         result = scratchResult;
@@ -204,6 +217,17 @@ ExitStatus readArgs(int argc, char * const * argv, KextunloadArgs * toolArgs)
                 }
                 break;
 
+            case 0:
+                switch (longopt) {
+                    case kLongOptParallel:
+                        toolArgs->parallel = true;
+                        break;
+                    default:
+                        goto finish;
+                        break;
+                }
+                break;
+
             default:
                /* getopt_long_only() prints an error message for us. */
                 goto finish;
@@ -325,19 +349,47 @@ finish:
 ExitStatus
 terminateKextClasses(KextunloadArgs * toolArgs, Boolean * fatal)
 {
-    ExitStatus    result      = EX_OK;
-    kern_return_t kernResult;
-    CFIndex       count, i;
+    ExitStatus      result      = EX_OK;
+    kern_return_t * kernResults = NULL;  // must free
+    kern_return_t   kernResult;
+    CFIndex         count, i;
 
     count = CFArrayGetCount(toolArgs->kextClassNames);
+
+   /* Classes are independent of one another, so with -parallel all
+    * their instances are terminated at once and the results reported
+    * in order afterward.
+    */
+    if (toolArgs->parallel && count > 1) {
+        kernResults = (kern_return_t *)calloc(count, sizeof(*kernResults));
+        if (!kernResults) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            *fatal = true;
+            goto finish;
+        }
+        dispatch_apply(count,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+            ^(size_t index) {
+                kernResults[index] = IOCatalogueTerminate(kIOMasterPortDefault,
+                    kIOCatalogServiceTerminate,
+                    (char *)CFArrayGetValueAtIndex(toolArgs->kextClassNames,
+                        index));
+            });
+    }
+
     for (i = 0; i < count; i++) {
         char * className = NULL;  // do not free
 
         className = (char *)CFArrayGetValueAtIndex(toolArgs->kextClassNames, i);
 
-        kernResult = IOCatalogueTerminate(kIOMasterPortDefault,
-            kIOCatalogServiceTerminate,
-            className);
+        if (kernResults) {
+            kernResult = kernResults[i];
+        } else {
+            kernResult = IOCatalogueTerminate(kIOMasterPortDefault,
+                kIOCatalogServiceTerminate,
+                className);
+        }
 
         if (kernResult == kIOReturnNotPrivileged) {
              OSKextLog(/* kext */ NULL,
@@ -367,6 +419,7 @@ finish:
             kOSKextLogErrorLevel | kOSKextLogIPCFlag,
             "Check the system/kernel logs for error messages from the I/O Kit.");
     }
+    SAFE_FREE(kernResults);
 
     return result;
 }
@@ -484,6 +537,246 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+* -parallel unloads all the named kexts together, in waves: each wave holds
+* the remaining named kexts that no other remaining named kext depends on.
+* Terminating services is where an unload spends its time, so a wave's
+* services are all terminated at once; its kexts are then unloaded one by
+* one. Each kext's terminate and unload times are logged.
+*******************************************************************************/
+static Boolean
+isDependedOnByAnyOf(
+    CFStringRef     kextID,
+    CFArrayRef      kextIDs,
+    CFDictionaryRef loadedKextInfo)
+{
+    CFDictionaryRef info    = NULL;  // do not release
+    CFNumberRef     loadTag = NULL;  // do not release
+    CFIndex         count, i;
+
+    info = CFDictionaryGetValue(loadedKextInfo, kextID);
+    loadTag = info ? CFDictionaryGetValue(info, CFSTR(kOSBundleLoadTagKey)) :
+        NULL;
+    if (!loadTag) {
+        return false;
+    }
+
+    count = CFArrayGetCount(kextIDs);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef otherInfo    = NULL;  // do not release
+        CFArrayRef      dependencies = NULL;  // do not release
+
+        otherInfo = CFDictionaryGetValue(loadedKextInfo,
+            CFArrayGetValueAtIndex(kextIDs, i));
+        dependencies = otherInfo ? CFDictionaryGetValue(otherInfo,
+            CFSTR(kOSBundleDependenciesKey)) : NULL;
+        if (dependencies &&
+            CFArrayContainsValue(dependencies, RANGE_ALL(dependencies), loadTag)) {
+
+            return true;
+        }
+    }
+    return false;
+}
+
+ExitStatus unloadKextsInParallel(KextunloadArgs * toolArgs, Boolean * fatal)
+{
+    ExitStatus          result          = EX_OK;
+    CFMutableArrayRef   kextIDs         = NULL;  // must release
+    CFMutableArrayRef   infoKeys        = NULL;  // must release
+    CFDictionaryRef     loadedKextInfo  = NULL;  // must release
+    CFMutableArrayRef   wave            = NULL;  // must release
+    CFStringRef         kextID          = NULL;  // must release
+    kern_return_t     * kernResults     = NULL;  // must free
+    CFAbsoluteTime    * terminateTimes  = NULL;  // must free
+    CFIndex             numWaves        = 0;
+    CFIndex             count, i;
+
+    if (!createCFMutableArray(&kextIDs, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&infoKeys, &kCFTypeArrayCallBacks) ||
+        !createCFMutableArray(&wave, &kCFTypeArrayCallBacks)) {
+
+        OSKextLogMemError();
+        result = EX_OSERR;
+        *fatal = true;
+        goto finish;
+    }
+
+    count = CFArrayGetCount(toolArgs->kextBundleIDs);
+    for (i = 0; i < count; i++) {
+        SAFE_RELEASE_NULL(kextID);
+        kextID = CFStringCreateWithCString(kCFAllocatorDefault,
+            (char *)CFArrayGetValueAtIndex(toolArgs->kextBundleIDs, i),
+            kCFStringEncodingUTF8);
+        if (!kextID) {
+            OSKextLogMemError();
+            result = EX_OSERR;
+            *fatal = true;
+            goto finish;
+        }
+        addToArrayIfAbsent(kextIDs, kextID);
+    }
+    count = toolArgs->kexts ? CFArrayGetCount(toolArgs->kexts) : 0;
+    for (i = 0; i < count; i++) {
+        OSKextRef aKext = (OSKextRef)CFArrayGetValueAtIndex(toolArgs->kexts, i);
+
+        if (OSKextGetIdentifier(aKext)) {
+            addToArrayIfAbsent(kextIDs, OSKextGetIdentifier(aKext));
+        }
+    }
+
+    count = CFArrayGetCount(kextIDs);
+    if (!count) {
+        goto finish;
+    }
+    kernResults = (kern_return_t *)calloc(count, sizeof(*kernResults));
+    terminateTimes = (CFAbsoluteTime *)calloc(count, sizeof(*terminateTimes));
+    if (!kernResults || !terminateTimes) {
+        OSKextLogMemError();
+        result = EX_OSERR;
+        *fatal = true;
+        goto finish;
+    }
+
+    CFArrayAppendValue(infoKeys, kCFBundleIdentifierKey);
+    CFArrayAppendValue(infoKeys, CFSTR(kOSBundleLoadTagKey));
+    CFArrayAppendValue(infoKeys, CFSTR(kOSBundleDependenciesKey));
+    loadedKextInfo = OSKextCopyLoadedKextInfo(kextIDs, infoKeys);
+    if (!loadedKextInfo) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogGeneralFlag | kOSKextLogIPCFlag,
+            "Couldn't get list of loaded kexts from kernel.");
+        result = EX_OSERR;
+        *fatal = true;
+        goto finish;
+    }
+
+    while (CFArrayGetCount(kextIDs)) {
+        CFIndex waveCount;
+
+        CFArrayRemoveAllValues(wave);
+        count = CFArrayGetCount(kextIDs);
+        for (i = 0; i < count; i++) {
+            CFStringRef thisID = CFArrayGetValueAtIndex(kextIDs, i);
+
+            if (!isDependedOnByAnyOf(thisID, kextIDs, loadedKextInfo)) {
+                CFArrayAppendValue(wave, thisID);
+            }
+        }
+
+       /* Load tags can't form a cycle, but don't spin if the kernel says so.
+        */
+        if (!CFArrayGetCount(wave)) {
+            CFArrayAppendArray(wave, kextIDs, RANGE_ALL(kextIDs));
+        }
+        waveCount = CFArrayGetCount(wave);
+        for (i = 0; i < waveCount; i++) {
+            CFArrayRemoveValueAtIndex(kextIDs,
+                CFArrayGetFirstIndexOfValue(kextIDs, RANGE_ALL(kextIDs),
+                    CFArrayGetValueAtIndex(wave, i)));
+        }
+        numWaves++;
+
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogProgressLevel | kOSKextLogIPCFlag,
+            "Terminating services for %d kexts at once.", (int)waveCount);
+
+        dispatch_apply(waveCount,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+            ^(size_t index) {
+                char           kextIDCString[KMOD_MAX_NAME];
+                CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+                if (!CFStringGetCString(CFArrayGetValueAtIndex(wave, index),
+                    kextIDCString, sizeof(kextIDCString),
+                    kCFStringEncodingUTF8)) {
+
+                    kernResults[index] = kOSKextReturnInvalidArgument;
+                    return;
+                }
+                kernResults[index] = IOCatalogueTerminate(kIOMasterPortDefault,
+                    kIOCatalogModuleTerminate, kextIDCString);
+                terminateTimes[index] = CFAbsoluteTimeGetCurrent() - start;
+            });
+
+        for (i = 0; i < waveCount; i++) {
+            CFStringRef      thisID      = CFArrayGetValueAtIndex(wave, i);
+            char           * kextIDCString = NULL;  // must free
+            ExitStatus       thisResult  = EX_OK;
+            CFAbsoluteTime   unloadTime  = 0;
+
+            kextIDCString = createUTF8CStringForCFString(thisID);
+            if (!kextIDCString) {
+                OSKextLogMemError();
+                result = EX_OSERR;
+                *fatal = true;
+                goto finish;
+            }
+
+            if (kernResults[i] == kIOReturnNotPrivileged) {
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
+                    "You must be running as root to unload kexts.");
+                SAFE_FREE(kextIDCString);
+                result = kKextunloadExitNotPrivileged;
+                *fatal = true;
+                goto finish;
+            } else if (kernResults[i] != KERN_SUCCESS) {
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+                    "Terminate for %s failed - %s.",
+                    kextIDCString, safe_mach_error_string(kernResults[i]));
+                thisResult = kKextunloadExitPartialFailure;
+            } else if (toolArgs->terminateOption == kIOCatalogModuleTerminate) {
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogBasicLevel | kOSKextLogIPCFlag,
+                    "%s: services terminated and personalities removed "
+                    "(kext not unloaded) in %.3f s.",
+                    kextIDCString, terminateTimes[i]);
+            } else {
+                CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+                thisResult = unloadKextWithIdentifier(thisID, toolArgs, fatal);
+                unloadTime = CFAbsoluteTimeGetCurrent() - start;
+                OSKextLog(/* kext */ NULL,
+                    kOSKextLogBasicLevel | kOSKextLogIPCFlag,
+                    "%s: services terminated in %.3f s, kext unloaded in %.3f s.",
+                    kextIDCString, terminateTimes[i], unloadTime);
+            }
+            SAFE_FREE(kextIDCString);
+
+           /* Only nab the first nonfatal error.
+            */
+            if (result == EX_OK && thisResult != EX_OK) {
+                result = thisResult;
+            }
+            if (*fatal) {
+                result = thisResult;
+                goto finish;
+            }
+        }
+    }
+
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogProgressLevel | kOSKextLogIPCFlag,
+        "Unloaded in %d waves.", (int)numWaves);
+
+finish:
+    if (!*fatal && result != EX_OK) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogIPCFlag,
+            "Check the system/kernel logs for error messages from the I/O Kit.");
+    }
+    SAFE_RELEASE(kextIDs);
+    SAFE_RELEASE(infoKeys);
+    SAFE_RELEASE(loadedKextInfo);
+    SAFE_RELEASE(wave);
+    SAFE_RELEASE(kextID);
+    SAFE_FREE(kernResults);
+    SAFE_FREE(terminateTimes);
+    return result;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 ExitStatus unloadKextWithIdentifier(
@@ -557,7 +850,7 @@ finish:
 void usage(UsageLevel usageLevel)
 {
     fprintf(stderr, "usage: %s [-h] [-v [0-6]]\n"
-        "        [-p] [-c class_name] ... [-b bundle_id] ... [kext] ...\n",
+        "        [-p] [-parallel] [-c class_name] ... [-b bundle_id] ... [kext] ...\n",
         progname);
 
     if (usageLevel == kUsageLevelBrief) {
@@ -583,6 +876,12 @@ void usage(UsageLevel usageLevel)
 
 // :doc: meaning of -p inverted all these years
 
+    fprintf(stderr, "-%s:\n"
+        "        unload all named kexts together, dependents first, terminating\n"
+        "        the services of independent kexts at the same time; print each\n"
+        "        kext's timing\n",
+        kOptNameParallel);
+
     fprintf(stderr, "-%s (-%c):\n"
         "        quiet mode: print no informational or error messages\n",
         kOptNameQuiet, kOptQuiet);
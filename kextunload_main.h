@@ -56,6 +56,7 @@ enum {
 
 #define kOptNameClassName           "class"
 #define kOptNamePersonalitiesOnly   "personalities-only"
+#define kOptNameParallel            "parallel"
 
 // really old option letter for "module", same as bundle id
 #define kOptClassName          'c'
@@ -64,6 +65,12 @@ enum {
 
 #define kOptChars  "b:c:hm:pqr:v"
 
+/* Options with no single-letter variant.  */
+// Do not use -1, that's getopt() end-of-args return value
+// and can cause confusion
+#define kLongOptLongindexHack  (-2)
+#define kLongOptParallel       (-3)
+
 int longopt = 0;
 
 struct option sOptInfo[] = {
@@ -73,6 +80,7 @@ struct option sOptInfo[] = {
 
     { kOptNameClassName,             required_argument,  NULL, kOptClassName },
     { kOptNamePersonalitiesOnly,     no_argument,        NULL, kOptPersonalitiesOnly },
+    { kOptNameParallel,              no_argument,        &longopt, kLongOptParallel },
 
     { kOptNameQuiet,                 required_argument,  NULL, kOptQuiet },
     { kOptNameVerbose,               optional_argument,  NULL, kOptVerbose },
@@ -88,6 +96,7 @@ struct option sOptInfo[] = {
 typedef struct {
     Boolean           unloadPersonalities;  // -p
     uint32_t          terminateOption;      // -p
+    Boolean           parallel;             // -parallel
 
     CFMutableArrayRef kextURLs;             // args
     CFMutableArrayRef kextBundleIDs;        // -b/-m -- array of C strings!
@@ -116,6 +125,9 @@ ExitStatus unloadKextsByIdentifier(
 ExitStatus unloadKextsByURL(
     KextunloadArgs * toolArgs,
     Boolean * fatal);
+ExitStatus unloadKextsInParallel(
+    KextunloadArgs * toolArgs,
+    Boolean * fatal);
 ExitStatus unloadKextWithIdentifier(
     CFStringRef      kextIdentifier,
     KextunloadArgs * toolArgs,
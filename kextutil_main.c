@@ -102,8 +102,21 @@ main(int argc, char * const * argv)
 
    /*****
     * Create the set of kexts we'll be working from.
+    * When only the system extensions folders would be scanned besides the
+    * named kexts, try opening just what's needed from the dependency index.
     */
-    allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault, toolArgs.scanURLs);
+    if (toolArgs.useSystemExtensions &&
+        !CFArrayGetCount(toolArgs.repositoryURLs) &&
+        !CFArrayGetCount(toolArgs.dependencyURLs) &&
+        !CFDictionaryGetCount(toolArgs.loadAddresses)) {
+
+        allKexts = createKextsFromDependencyIndex(toolArgs.kextURLs,
+            toolArgs.kextIDs, OSKextGetArchitecture());
+    }
+    if (!allKexts) {
+        allKexts = OSKextCreateKextsFromURLs(kCFAllocatorDefault,
+            toolArgs.scanURLs);
+    }
     if (!allKexts || !CFArrayGetCount(allKexts)) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogGeneralFlag,
@@ -129,6 +142,9 @@ main(int argc, char * const * argv)
         result = EX_OSERR;
         goto finish;
     }
+    if (sLockTaken) {
+        narrowLoadLock(kextsToProcess);
+    }
 
     processResult = processKexts(kextsToProcess, &toolArgs);
     if (result == EX_OK) {
@@ -843,8 +859,8 @@ checkArgs(KextutilArgs * toolArgs)
             goto finish;
        }
         
-        if (!createCFDataFromFile(&toolArgs->kernelFile,
-                                  kernelPathCString)) {
+        if (!createCFDataFromMappedFile(&toolArgs->kernelFile,
+                                        kernelPathCString)) {
             OSKextLog(/* kext */ NULL,
                       kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
                       "Can't read kernel file '%s'",
@@ -2347,6 +2363,84 @@ finish:
     return result;
 }
 
+/*******************************************************************************
+* Tells kextd which kexts we're about to load, so that while we hold the
+* lock it only holds back kernel load requests that need one of them.
+* Kexts already loaded can't be affected by us and are left out. Failure
+* just leaves the whole lock in place.
+*******************************************************************************/
+void narrowLoadLock(CFArrayRef kextsToProcess)
+{
+    CFMutableArrayRef      kextIDs     = NULL;  // must release
+    CFMutableDictionaryRef request     = NULL;  // must release
+    CFDataRef              requestData = NULL;  // must release
+    CFArrayRef             loadList    = NULL;  // must release
+    kern_return_t          kern_result;
+    CFIndex                count, i;
+
+    if (!createCFMutableArray(&kextIDs, &kCFTypeArrayCallBacks) ||
+        !createCFMutableDictionary(&request)) {
+
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (kOSReturnSuccess != OSKextReadLoadedKextInfo(
+        /* kextIdentifiers */ NULL, /* flushDependencies */ false)) {
+
+        goto finish;
+    }
+
+    count = CFArrayGetCount(kextsToProcess);
+    for (i = 0; i < count; i++) {
+        OSKextRef aKext = (OSKextRef)CFArrayGetValueAtIndex(kextsToProcess, i);
+        CFIndex   numKexts, j;
+
+        SAFE_RELEASE_NULL(loadList);
+        loadList = OSKextCopyLoadList(aKext, /* needAll? */ false);
+        if (!loadList) {
+            addToArrayIfAbsent(kextIDs, OSKextGetIdentifier(aKext));
+            continue;
+        }
+        numKexts = CFArrayGetCount(loadList);
+        for (j = 0; j < numKexts; j++) {
+            OSKextRef thisKext = (OSKextRef)CFArrayGetValueAtIndex(loadList, j);
+
+            if (!OSKextIsLoaded(thisKext)) {
+                addToArrayIfAbsent(kextIDs, OSKextGetIdentifier(thisKext));
+            }
+        }
+    }
+
+    CFDictionarySetValue(request, kKextutilLockScopeKey, kextIDs);
+    requestData = CFPropertyListCreateData(kCFAllocatorDefault, request,
+        kCFPropertyListXMLFormat_v1_0, /* options */ 0, /* error */ NULL);
+    if (!requestData) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+   /* An older kextd doesn't know the key and fails the request, which
+    * leaves the lock as it was.
+    */
+    kern_result = kextmanager_load_kext(sKextdPort,
+        (char *)CFDataGetBytePtr(requestData),
+        (mach_msg_type_number_t)CFDataGetLength(requestData));
+    if (kern_result != KERN_SUCCESS) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogDetailLevel | kOSKextLogIPCFlag,
+            "Can't narrow kextload serialization lock (continuing) - %s.",
+            safe_mach_error_string(kern_result));
+    }
+
+finish:
+    SAFE_RELEASE(kextIDs);
+    SAFE_RELEASE(request);
+    SAFE_RELEASE(requestData);
+    SAFE_RELEASE(loadList);
+    return;
+}
+
 /*******************************************************************************
 * usage()
 *******************************************************************************/
@@ -244,6 +244,7 @@ ExitStatus sendPersonalities(
 Boolean serializeLoad(
     KextutilArgs * toolArgs,
     Boolean        loadFlag);
+void narrowLoadLock(CFArrayRef kextsToProcess);
 static void usage(UsageLevel usageLevel);
 
 extern kern_return_t kextmanager_lock_kextload(
@@ -253,5 +254,9 @@ extern kern_return_t kextmanager_lock_kextload(
 kern_return_t kextmanager_unlock_kextload(
     mach_port_t server,
     mach_port_t client);
+extern kern_return_t kextmanager_load_kext(
+    mach_port_t server,
+    char * xml_data_in,
+    mach_msg_type_number_t xml_data_length);
 
 #endif /* _KEXTUTIL_MAIN_H */
@@ -38,6 +38,8 @@
 
 #include <mach-o/arch.h>
 
+#include <dispatch/dispatch.h>
+
 #include <System/libkern/mkext.h>
 #include <CoreFoundation/CFBundlePriv.h>
 #include <IOKit/kext/OSKextPrivate.h>
@@ -47,11 +49,30 @@
 
 
 /*******************************************************************************
+* An mkext1 is built in three passes. addToMkext1() reads each kext's info
+* dictionary and executable, one kext at a time since OSKext and CFBundle
+* aren't thread-safe. compressMkext1File() then compresses every file into
+* its own buffer, all of them concurrently. Finally assembleMkext1() lays the
+* files out after the header in kext order, computing the Adler-32 as it
+* copies them in. The archive is byte-for-byte what appending each file in
+* turn produced.
 *******************************************************************************/
 typedef struct {
-    CFMutableDataRef   mkext;
+    CFDataRef          data;              // must release
+    uint8_t          * compressed;        // must free; NULL if stored as is
+    uint32_t           compressedLength;
+    Boolean            failed;
+} Mkext1File;
+
+typedef struct {
+    char               kextPath[PATH_MAX];
+    Mkext1File         plist;
+    Mkext1File         module;            // data NULL if no executable
+} Mkext1Entry;
+
+typedef struct {
+    Mkext1Entry      * entries;
     uint32_t           kextIndex;
-    uint32_t           compressOffset;
     const NXArchInfo * arch;
     Boolean            fatal;
     Boolean            compress;
@@ -62,12 +83,17 @@ void addToMkext1(
     const void * vValue,
     void       * vContext);
 
-Boolean addDataToMkext(
-    CFDataRef       data,
-    Mkext1Context * context,
-    char          * kextPath,
+void compressMkext1File(
+    Mkext1File    * file,
+    const char    * kextPath,
     Boolean         isInfoDict);
 
+Boolean assembleMkext1(
+    CFMutableDataRef   mkext,
+    Mkext1Entry      * entries,
+    uint32_t           numEntries,
+    const NXArchInfo * arch);
+
 /*******************************************************************************
 *******************************************************************************/
 CFDataRef createMkext1ForArch(const NXArchInfo * arch, CFArrayRef archiveKexts,
@@ -76,8 +102,9 @@ CFDataRef createMkext1ForArch(const NXArchInfo * arch, CFArrayRef archiveKexts,
     CFMutableDataRef       result            = NULL;
     CFMutableDictionaryRef kextsByIdentifier = NULL;
     Mkext1Context          context;
-    mkext1_header        * mkextHeader       = NULL;  // do not free
-    const uint8_t        * adler_point = 0;
+    Mkext1Entry          * entries           = NULL;  // must free & release
+    uint32_t               numEntries        = 0;
+    __block Boolean        compressFailed    = false;
     CFIndex count, i;
 
     result = CFDataCreateMutable(kCFAllocatorDefault, /* capaacity */ 0);
@@ -115,14 +142,19 @@ CFDataRef createMkext1ForArch(const NXArchInfo * arch, CFArrayRef archiveKexts,
         }
     }
 
-   /* Add room for the mkext header and kext descriptors.
-    */
-    CFDataSetLength(result, sizeof(mkext1_header) +
-        CFDictionaryGetCount(kextsByIdentifier) * sizeof(mkext_kext));
+    numEntries = (uint32_t)CFDictionaryGetCount(kextsByIdentifier);
+    entries = (Mkext1Entry *)calloc(numEntries ? numEntries : 1,
+        sizeof(*entries));
+    if (!entries) {
+        OSKextLogMemError();
+        SAFE_RELEASE_NULL(result);
+        goto finish;
+    }
 
-    context.mkext = result;
+   /* Pass 1: read in each kext's files.
+    */
+    context.entries = entries;
     context.kextIndex = 0;
-    context.compressOffset = (uint32_t)CFDataGetLength(result);
     context.arch = arch;
     context.fatal = false;
     context.compress = compress;
@@ -132,20 +164,35 @@ CFDataRef createMkext1ForArch(const NXArchInfo * arch, CFArrayRef archiveKexts,
         goto finish;
     }
 
-    mkextHeader = (mkext1_header *)CFDataGetBytePtr(result);
-    mkextHeader->magic = OSSwapHostToBigInt32(MKEXT_MAGIC);
-    mkextHeader->signature = OSSwapHostToBigInt32(MKEXT_SIGN);
-    mkextHeader->version = OSSwapHostToBigInt32(0x01008000);   // 'vers' 1.0.0
-    mkextHeader->numkexts =
-        OSSwapHostToBigInt32(CFDictionaryGetCount(kextsByIdentifier));
-    mkextHeader->cputype = OSSwapHostToBigInt32(arch->cputype);
-    mkextHeader->cpusubtype = OSSwapHostToBigInt32(arch->cpusubtype);
-    mkextHeader->length = OSSwapHostToBigInt32(CFDataGetLength(result));
+   /* Pass 2: compress them all at once, plist and executable separately.
+    */
+    if (compress) {
+        dispatch_apply(2 * numEntries,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+            ^(size_t fileIndex) {
+                Mkext1Entry * entry      = &entries[fileIndex / 2];
+                Boolean       isInfoDict = (fileIndex % 2 == 0);
+                Mkext1File  * file       = isInfoDict ? &entry->plist : &entry->module;
+
+                if (file->data) {
+                    compressMkext1File(file, entry->kextPath, isInfoDict);
+                    if (file->failed) {
+                        compressFailed = true;
+                    }
+                }
+            });
+        if (compressFailed) {
+            SAFE_RELEASE_NULL(result);
+            goto finish;
+        }
+    }
 
-    adler_point = (UInt8 *)&mkextHeader->version;
-    mkextHeader->adler32 = OSSwapHostToBigInt32(local_adler32(
-        (UInt8 *)&mkextHeader->version,
-        (int)(CFDataGetLength(result) - (adler_point - (uint8_t *)mkextHeader))));
+   /* Pass 3: lay out and checksum the archive.
+    */
+    if (!assembleMkext1(result, entries, numEntries, arch)) {
+        SAFE_RELEASE_NULL(result);
+        goto finish;
+    }
 
     OSKextLog(/* kext */ NULL, kOSKextLogProgressLevel | kOSKextLogArchiveFlag,
         "Created mkext for %s containing %lu kexts.",
@@ -153,6 +200,15 @@ CFDataRef createMkext1ForArch(const NXArchInfo * arch, CFArrayRef archiveKexts,
         CFDictionaryGetCount(kextsByIdentifier));
 
 finish:
+    if (entries) {
+        for (i = 0; i < numEntries; i++) {
+            SAFE_RELEASE(entries[i].plist.data);
+            SAFE_FREE(entries[i].plist.compressed);
+            SAFE_RELEASE(entries[i].module.data);
+            SAFE_FREE(entries[i].module.compressed);
+        }
+        free(entries);
+    }
     SAFE_RELEASE(kextsByIdentifier);
     return result;
 }
@@ -166,21 +222,25 @@ void addToMkext1(
 {
     OSKextRef       aKext            = (OSKextRef)vValue;
     Mkext1Context * context          = (Mkext1Context *)vContext;
+    Mkext1Entry   * entry            = NULL;  // do not free
     
     CFBundleRef     kextBundle       = NULL;  // must release
     CFURLRef        infoDictURL      = NULL;  // must release
     CFDataRef       rawInfoDict      = NULL;  // must release
     CFDataRef       executable       = NULL;  // must release
-    char            kextPath[PATH_MAX];
+    char          * kextPath         = NULL;  // do not free
 
     if (context->fatal) {
         goto finish;
     }
+
+    entry = &context->entries[context->kextIndex];
+    kextPath = entry->kextPath;
     
     if (!CFURLGetFileSystemRepresentation(OSKextGetURL(aKext),
-        /* resolveToBase */ false, (UInt8 *)kextPath, sizeof(kextPath))) {
+        /* resolveToBase */ false, (UInt8 *)kextPath, sizeof(entry->kextPath))) {
 
-        strlcpy(kextPath, "(unknown)", sizeof(kextPath));
+        strlcpy(kextPath, "(unknown)", sizeof(entry->kextPath));
     }
 
     OSKextLog(aKext,
@@ -231,18 +291,8 @@ void addToMkext1(
         goto finish;
     }
     
-    if (!addDataToMkext(rawInfoDict, context, kextPath, /* isInfoDict */ true)) {
-        context->fatal = true;
-        goto finish;
-    }
-    
     executable = OSKextCopyExecutableForArchitecture(aKext, context->arch);
-    if (executable) {
-        if (!addDataToMkext(executable, context, kextPath, /* isInfoDict */ false)) {
-            context->fatal = true;
-            goto finish;
-        }
-    } else if (OSKextDeclaresExecutable(aKext)) {
+    if (!executable && OSKextDeclaresExecutable(aKext)) {
         OSKextLog(aKext,
             kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
             "Can't get executable for %s (architecture %s).", kextPath,
@@ -251,6 +301,11 @@ void addToMkext1(
         goto finish;
     }
 
+    entry->plist.data = rawInfoDict;
+    rawInfoDict = NULL;
+    entry->module.data = executable;
+    executable = NULL;
+
     context->kextIndex++;
 
 finish:
@@ -267,123 +322,199 @@ finish:
 }
 
 /*******************************************************************************
+* Compresses one file into its own buffer and checks that it decompresses to
+* the original. A file that doesn't shrink is left to be stored as is; any
+* other problem sets file->failed. Called concurrently for different files.
 *******************************************************************************/
-Boolean addDataToMkext(
-    CFDataRef       data,
-    Mkext1Context * context,
-    char          * kextPath,
+void compressMkext1File(
+    Mkext1File    * file,
+    const char    * kextPath,
     Boolean         isInfoDict)
 {
-    Boolean         result             = false;
-    CFIndex         newMkextLength;
-    uint32_t        origCompressOffset;
-    const UInt8   * mkextStart         = NULL;  // must calc after changing length!
-    UInt8         * addedDataStart     = NULL;  // must calc after changing length!
-    UInt8         * addedDataEnd       = NULL;  // do not free
-    uint32_t        addedDataFullLength;
-    uint32_t        compressedLength;
-
+    uint32_t        fullLength;
+    uint8_t       * compressedEnd      = NULL;  // do not free
     uint8_t       * checkBuffer        = NULL;  // must free
-    
-    mkext1_header * mkextHeader        = NULL;  // do not free
-    mkext_kext    * mkextKextEntry     = NULL;  // do not free
-    mkext_file    * mkextFileEntry     = NULL;  // do not free
+    size_t          checkLength;
 
-   /* Add enough to the mkext buffer to append the whole uncompressed file.
-    * If the file can't be compressed, we'll just copy it in; if it can
-    * be compressed, we'll set the mkext buffer length to fit exactly.
-    */
-    addedDataFullLength = (uint32_t)CFDataGetLength(data);
-    newMkextLength = CFDataGetLength(context->mkext) + addedDataFullLength;
-    CFDataSetLength(context->mkext, newMkextLength);
-    if (CFDataGetLength(context->mkext) != newMkextLength) {
+    fullLength = (uint32_t)CFDataGetLength(file->data);
+
+    file->compressed = (uint8_t *)malloc(fullLength ? fullLength : 1);
+    if (!file->compressed) {
+        OSKextLogMemError();
+        file->failed = true;
+        goto finish;
+    }
+
+    compressedEnd = compress_lzss(file->compressed, fullLength,
+        (uint8_t *)CFDataGetBytePtr(file->data), fullLength);
+    if (!compressedEnd) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
+            "%s did not compress; copying file (%d bytes).",
+            isInfoDict ? "info dictionary" : "executable",
+            fullLength);
+        SAFE_FREE_NULL(file->compressed);
+        goto finish;
+    }
+    file->compressedLength = (uint32_t)(compressedEnd - file->compressed);
+
+    checkBuffer = (uint8_t *)malloc(fullLength);
+    if (!checkBuffer) {
+        OSKextLogMemError();
+        file->failed = true;
+        goto finish;
+    }
+
+    checkLength = decompress_lzss(checkBuffer, fullLength,
+        file->compressed, file->compressedLength);
+    if (checkLength != fullLength) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-            "Can't resize mkext buffer.");
+            "%s - %s decompressed size %d differs from original size %d",
+            kextPath,
+            isInfoDict ? "info dictionary" : "executable",
+            (int)checkLength, (int)fullLength);
+        file->failed = true;
         goto finish;
     }
-    mkextStart = CFDataGetBytePtr(context->mkext);
-    
-    origCompressOffset = context->compressOffset;
-    addedDataStart = (UInt8 *)mkextStart + origCompressOffset;
-
-    if (context->compress) {
-        addedDataEnd = compress_lzss((uint8_t *)addedDataStart, addedDataFullLength,
-            (uint8_t *)CFDataGetBytePtr(data), addedDataFullLength);
-        if (!addedDataEnd) {
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
-                "%s did not compress; copying file (%d bytes).",
-                isInfoDict ? "info dictionary" : "executable",
-                addedDataFullLength);
-        }
+    if (0 != memcmp(checkBuffer, CFDataGetBytePtr(file->data), checkLength)) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "%s - %s decompressed data differs from input",
+            kextPath,
+            isInfoDict ? "info dictionary" : "executable");
+        file->failed = true;
+        goto finish;
     }
 
-    if (!addedDataEnd) {
-        memcpy(addedDataStart, (const void *)CFDataGetBytePtr(data),
-            addedDataFullLength);
-        addedDataEnd = addedDataStart + addedDataFullLength;
-        compressedLength = 0;
-        context->compressOffset += addedDataFullLength;
-    } else {
-        size_t checkLength;
-
-        compressedLength = (uint32_t)(addedDataEnd - addedDataStart);
-        context->compressOffset += compressedLength;
-
-        checkBuffer = (uint8_t *)malloc(addedDataFullLength);
-        if (!checkBuffer) {
-            OSKextLogMemError();
-            goto finish;
-        }
-        
-        checkLength = decompress_lzss(checkBuffer, addedDataFullLength,
-            addedDataStart, compressedLength);
-        if (checkLength != addedDataFullLength) {
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-                "%s - %s decompressed size %d differs from original size %d",
-                kextPath,
-                isInfoDict ? "info dictionary" : "executable",
-                (int)checkLength, (int)addedDataFullLength);
-            goto finish;
-        }
-        if (0 != memcmp(checkBuffer, CFDataGetBytePtr(data), checkLength)) {
-            OSKextLog(/* kext */ NULL,
-                kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
-                "%s - %s decompressed data differs from input",
-                kextPath,
-                isInfoDict ? "info dictionary" : "executable");
-            goto finish;
-        }
+    OSKextLog(/* kext */ NULL,
+        kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
+        "Compressed %s from %u to %u bytes (%.2f%%).",
+        isInfoDict ? "info dict" : "executable",
+        fullLength, file->compressedLength,
+        (100.0 * (float)file->compressedLength/(float)fullLength));
+
+finish:
+    SAFE_FREE(checkBuffer);
+    return;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static uint32_t mkext1FileLength(Mkext1File * file)
+{
+    if (!file->data) {
+        return 0;
+    }
+    return file->compressed ? file->compressedLength :
+        (uint32_t)CFDataGetLength(file->data);
+}
+
+/*******************************************************************************
+*******************************************************************************/
+static void fillMkext1FileEntry(
+    Mkext1File    * file,
+    mkext_file    * fileEntry,
+    uint32_t        offset)
+{
+    fileEntry->offset = OSSwapHostToBigInt32(offset);
+    fileEntry->realsize = OSSwapHostToBigInt32((uint32_t)CFDataGetLength(file->data));
+    fileEntry->compsize = OSSwapHostToBigInt32(file->compressed ?
+        file->compressedLength : 0);
+    fileEntry->modifiedsecs = 0;  // we never use this anyway
+    return;
+}
+
+/*******************************************************************************
+* Sizes the mkext once, fills in the header and file descriptors, then copies
+* each file in after them, folding it into the Adler-32 on the way.
+*******************************************************************************/
+Boolean assembleMkext1(
+    CFMutableDataRef   mkext,
+    Mkext1Entry      * entries,
+    uint32_t           numEntries,
+    const NXArchInfo * arch)
+{
+    Boolean         result       = false;
+    mkext1_header * mkextHeader  = NULL;  // do not free
+    UInt8         * mkextStart   = NULL;  // do not free
+    uint64_t        totalLength;
+    uint32_t        headerLength;
+    uint32_t        offset;
+    uint32_t        adler;
+    uint32_t        i;
+
+    headerLength = (uint32_t)(sizeof(mkext1_header) +
+        numEntries * sizeof(mkext_kext));
+    totalLength = headerLength;
+    for (i = 0; i < numEntries; i++) {
+        totalLength += mkext1FileLength(&entries[i].plist);
+        totalLength += mkext1FileLength(&entries[i].module);
+    }
+    if (totalLength > UINT32_MAX) {
+        OSKextLog(/* kext */ NULL,
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "Mkext for %s is too large.", arch->name);
+        goto finish;
+    }
 
+    CFDataSetLength(mkext, (CFIndex)totalLength);
+    if (CFDataGetLength(mkext) != (CFIndex)totalLength) {
         OSKextLog(/* kext */ NULL,
-            kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
-            "Compressed %s from %u to %u bytes (%.2f%%).",
-            isInfoDict ? "info dict" : "executable",
-            addedDataFullLength, compressedLength,
-            (100.0 * (float)compressedLength/(float)addedDataFullLength));
+            kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
+            "Can't resize mkext buffer.");
+        goto finish;
     }
-    
-   /* Truncate the mkext to exactly fit the new total size.
+    mkextStart = CFDataGetMutableBytePtr(mkext);
+    bzero(mkextStart, headerLength);
+
+    mkextHeader = (mkext1_header *)mkextStart;
+    mkextHeader->magic = OSSwapHostToBigInt32(MKEXT_MAGIC);
+    mkextHeader->signature = OSSwapHostToBigInt32(MKEXT_SIGN);
+    mkextHeader->version = OSSwapHostToBigInt32(0x01008000);   // 'vers' 1.0.0
+    mkextHeader->numkexts = OSSwapHostToBigInt32(numEntries);
+    mkextHeader->cputype = OSSwapHostToBigInt32(arch->cputype);
+    mkextHeader->cpusubtype = OSSwapHostToBigInt32(arch->cpusubtype);
+    mkextHeader->length = OSSwapHostToBigInt32((uint32_t)totalLength);
+
+   /* The file descriptors are part of the checksummed range, so fill them
+    * in before checksumming the header; their offsets are all known now.
     */
-    CFDataSetLength(context->mkext, addedDataEnd - mkextStart);
-
-    mkextHeader = (mkext1_header *)CFDataGetBytePtr(context->mkext);
-    mkextKextEntry = &(mkextHeader->kext[context->kextIndex]);
-    if (isInfoDict) {
-        mkextFileEntry = &(mkextKextEntry->plist);
-    } else {
-        mkextFileEntry = &(mkextKextEntry->module);
+    offset = headerLength;
+    for (i = 0; i < numEntries; i++) {
+        fillMkext1FileEntry(&entries[i].plist, &mkextHeader->kext[i].plist,
+            offset);
+        offset += mkext1FileLength(&entries[i].plist);
+
+        if (entries[i].module.data) {
+            fillMkext1FileEntry(&entries[i].module, &mkextHeader->kext[i].module,
+                offset);
+            offset += mkext1FileLength(&entries[i].module);
+        }
     }
-    mkextFileEntry->offset = OSSwapHostToBigInt32(origCompressOffset);
-    mkextFileEntry->realsize = OSSwapHostToBigInt32(addedDataFullLength);
-    mkextFileEntry->compsize = OSSwapHostToBigInt32(compressedLength);
-    mkextFileEntry->modifiedsecs = 0;  // we never use this anyway
 
+    adler = local_adler32_update(1, (UInt8 *)&mkextHeader->version,
+        headerLength - ((UInt8 *)&mkextHeader->version - mkextStart));
+
+    offset = headerLength;
+    for (i = 0; i < 2 * numEntries; i++) {
+        Mkext1File    * file   = (i % 2 == 0) ?
+            &entries[i / 2].plist : &entries[i / 2].module;
+        const UInt8   * bytes  = NULL;  // do not free
+        uint32_t        length = mkext1FileLength(file);
+
+        if (!length) {
+            continue;
+        }
+        bytes = file->compressed ? file->compressed : CFDataGetBytePtr(file->data);
+        memcpy(mkextStart + offset, bytes, length);
+        adler = local_adler32_update(adler, mkextStart + offset, length);
+        offset += length;
+    }
+
+    mkextHeader->adler32 = OSSwapHostToBigInt32(adler);
     result = true;
 
 finish:
-    SAFE_FREE(checkBuffer);
     return result;
 }
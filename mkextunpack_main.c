@@ -31,6 +31,8 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <libc.h>
+#include <dispatch/dispatch.h>
+#include <limits.h>
 #include <mach-o/arch.h>
 #include <mach-o/fat.h>
 
@@ -43,7 +45,27 @@
 static const char * progname = "mkextunpack";
 static Boolean gVerbose = false;
 
+/* With -j, entries are decompressed on up to gJobs worker threads, and files
+ * are written from a concurrent queue with at most kMaxQueuedWrites of them
+ * outstanding (each holding its data) at a time.
+ */
+#define kMaxQueuedWrites  (16)
+
+static unsigned int         gJobs        = 1;
+static dispatch_queue_t     gWriteQueue  = NULL;  // do not release
+static dispatch_group_t     gWriteGroup  = NULL;  // must release
+static dispatch_semaphore_t gWriteSlots  = NULL;  // must release
+static volatile Boolean     gWriteFailed = false;
+
+/* With -b, only kexts with these bundle identifiers are listed or unpacked.
+ * A format 2 mkext then costs only the selected kexts' data: its plist index
+ * is read, but other kexts' executables are never decompressed, and the
+ * whole-archive checksum (which would touch every page) is skipped.
+ */
+static CFMutableSetRef      gBundleIDs   = NULL;  // must release
+
 u_int32_t local_adler32(u_int8_t *buffer, int32_t length);
+Boolean isSelectedBundleID(CFStringRef bundleID);
 
 Boolean getMkextDataForArch(
     u_int8_t         * fileData,
@@ -68,6 +90,19 @@ Boolean writeMkext2ToDirectory(
 CFDictionaryRef extractEntriesFromMkext1(
     void * mkextStart,
     void * mkextEnd);
+
+/* An mkext1 entry decompressed ahead of time by uncompressMkext1Entries().
+ */
+typedef struct {
+    Boolean    plistOK;
+    CFDataRef  plistData;         // must release
+    Boolean    executableOK;
+    CFDataRef  executableData;    // must release
+} Mkext1UncompressedEntry;
+
+Mkext1UncompressedEntry * uncompressMkext1Entries(
+    void          * mkextStart,
+    mkext1_header * mkextHeader);
 Boolean uncompressMkext1Entry(
     void * mkext_base_address,
     mkext_file * entry_address,
@@ -85,6 +120,13 @@ Boolean writeFileInDirectory(
     const char * fileName,
     const char * fileData,
     size_t       fileLength);
+Boolean setUpQueuedWrites(void);
+Boolean queueFileInDirectory(
+    const char * basePath,
+    const char * subPath,
+    const char * fileName,
+    CFDataRef    fileData);
+Boolean finishQueuedWrites(void);
 
 #if 0
 /*******************************************************************************
@@ -110,9 +152,11 @@ For each arch:
 /*******************************************************************************
 *******************************************************************************/
 void usage(int num) {
-    fprintf(stderr, "usage: %s [-v] [-a arch] [-d output_dir] mkextfile\n", progname);
+    fprintf(stderr, "usage: %s [-v] [-a arch] [-b bundle_id]... [-j jobs] [-d output_dir] mkextfile\n", progname);
     fprintf(stderr, "    -d output_dir: where to put kexts (must exist)\n");
     fprintf(stderr, "    -a arch: pick architecture from fat mkext file\n");
+    fprintf(stderr, "    -b bundle_id: list or unpack only this kext (repeatable)\n");
+    fprintf(stderr, "    -j jobs: decompress and write with up to jobs threads (0: one per CPU)\n");
     fprintf(stderr, "    -v: verbose output; list kexts in mkextfile\n");
     return;
 }
@@ -141,8 +185,29 @@ int main (int argc, const char * argv[]) {
     */
     OSKextSetLogOutputFunction(&tool_log);
 
-    while ((optchar = getopt(argc, (char * const *)argv, "a:d:hv")) != -1) {
+    while ((optchar = getopt(argc, (char * const *)argv, "a:b:d:hj:v")) != -1) {
         switch (optchar) {
+          case 'b':
+            {
+                CFStringRef bundleID = NULL;  // must release
+
+                if (!gBundleIDs &&
+                    !createCFMutableSet(&gBundleIDs, &kCFTypeSetCallBacks)) {
+                    OSKextLogMemError();
+                    exit_code = 1;
+                    goto finish;
+                }
+                bundleID = CFStringCreateWithCString(kCFAllocatorDefault,
+                    optarg, kCFStringEncodingUTF8);
+                if (!bundleID) {
+                    OSKextLogMemError();
+                    exit_code = 1;
+                    goto finish;
+                }
+                CFSetAddValue(gBundleIDs, bundleID);
+                CFRelease(bundleID);
+            }
+            break;
           case 'd':
             if (!optarg) {
                 fprintf(stderr, "no argument for -d\n");
@@ -160,6 +225,26 @@ int main (int argc, const char * argv[]) {
           case 'v':
             gVerbose = true;
             break;
+          case 'j':
+            {
+                char          * endptr = NULL;
+                unsigned long   jobs   = strtoul(optarg, &endptr, 10);
+
+                if (!optarg[0] || *endptr || jobs > UINT_MAX) {
+                    fprintf(stderr, "invalid job count %s\n", optarg);
+                    usage(0);
+                    exit_code = 1;
+                    goto finish;
+                }
+               /* -j 0 means one job per online CPU.
+                */
+                if (jobs == 0) {
+                    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                    jobs = (ncpu > 0) ? (unsigned long)ncpu : 1;
+                }
+                gJobs = (unsigned int)jobs;
+            }
+            break;
           case 'a':
             if (archInfo != NULL) {
                 fprintf(stderr, "architecture already specified; replacing\n");
@@ -228,6 +313,11 @@ int main (int argc, const char * argv[]) {
             exit_code = 1;
             goto finish;
         }
+
+        if (gJobs > 1 && !setUpQueuedWrites()) {
+            exit_code = 1;
+            goto finish;
+        }
     }
 
     if (stat(mkextFile, &stat_buf) < 0) {
@@ -309,6 +399,13 @@ int main (int argc, const char * argv[]) {
 
 finish:
     SAFE_RELEASE(oskexts);
+    SAFE_RELEASE(gBundleIDs);
+    if (gWriteGroup) {
+        dispatch_release(gWriteGroup);
+    }
+    if (gWriteSlots) {
+        dispatch_release(gWriteSlots);
+    }
     exit(exit_code);
     return exit_code;
 }
@@ -392,6 +489,16 @@ Boolean getMkextDataForArch(
         goto finish;
     }
 
+    *mkextVersion = MKEXT_GET_VERSION(mkextHeader);
+
+   /* Format 2 entries are zlib streams with checksums of their own,
+    * so a selective unpack needn't read the whole archive.
+    */
+    if (gBundleIDs && *mkextVersion == MKEXT_VERS_2) {
+        result = true;
+        goto finish;
+    }
+
     crc_address = (uint8_t *)&mkextHeader->version;
     checksum = local_adler32(crc_address,
         (int32_t)((uintptr_t)mkextHeader +
@@ -404,8 +511,6 @@ Boolean getMkextDataForArch(
         goto finish;
     }
 
-    *mkextVersion = MKEXT_GET_VERSION(mkextHeader);
-
     result = true;
 
 finish:
@@ -425,6 +530,7 @@ CFArrayRef copyKextsFromMkext2(
     CFArrayRef    result          = NULL;  // release on error
     Boolean       ok              = false;
     CFDataRef     mkextDataObject = NULL;  // must release
+    CFArrayRef    allKexts        = NULL;  // must release
     char          kextPath[PATH_MAX];
     char        * kextIdentifier  = NULL;  // must free
     char          kextVersion[kOSKextVersionMaxLength];
@@ -440,14 +546,39 @@ CFArrayRef copyKextsFromMkext2(
         OSKextLogMemError();
         goto finish;
     }
-    result = OSKextCreateKextsFromMkextData(kCFAllocatorDefault, mkextDataObject);
-    if (!result) {
+    allKexts = OSKextCreateKextsFromMkextData(kCFAllocatorDefault,
+        mkextDataObject);
+    if (!allKexts) {
         OSKextLog(/* kext */ NULL,
             kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
             "Can't read mkext2 archive.");
         goto finish;
     }
 
+   /* Executables stay in the mkext until copied out, so dropping the
+    * kexts we don't want here means they are never decompressed.
+    */
+    if (gBundleIDs) {
+        CFMutableArrayRef selected = NULL;  // returned as result
+        CFIndex           count, i;
+
+        if (!createCFMutableArray(&selected, &kCFTypeArrayCallBacks)) {
+            OSKextLogMemError();
+            goto finish;
+        }
+        count = CFArrayGetCount(allKexts);
+        for (i = 0; i < count; i++) {
+            OSKextRef theKext = (OSKextRef)CFArrayGetValueAtIndex(allKexts, i);
+
+            if (isSelectedBundleID(OSKextGetIdentifier(theKext))) {
+                CFArrayAppendValue(selected, theKext);
+            }
+        }
+        result = selected;
+    } else {
+        result = CFRetain(allKexts);
+    }
+
     if (gVerbose) {
         CFIndex count, i;
 
@@ -478,10 +609,21 @@ finish:
     if (!ok) {
         SAFE_RELEASE_NULL(result);
     }
+    SAFE_RELEASE(allKexts);
     SAFE_RELEASE(mkextDataObject);
     return result;
 }
 
+/*******************************************************************************
+*******************************************************************************/
+Boolean isSelectedBundleID(CFStringRef bundleID)
+{
+    if (!gBundleIDs) {
+        return true;
+    }
+    return bundleID && CFSetContainsValue(gBundleIDs, bundleID);
+}
+
 /*******************************************************************************
 *******************************************************************************/
 Boolean writeMkext2EntriesToDirectory(
@@ -505,7 +647,13 @@ Boolean writeMkext2EntriesToDirectory(
         }
     }
 
+    result = true;
+
 finish:
+    if (!finishQueuedWrites()) {
+        result = false;
+    }
+    SAFE_RELEASE(kextNames);
     return result;
 }
 
@@ -618,8 +766,8 @@ Boolean writeMkext2ToDirectory(
             "Output path is too long - %s.", subPath);
         goto finish;
     }
-    if (!writeFileInDirectory(outputDirectory, subPath, "Info.plist",
-        file_data, CFDataGetLength(infoDictData))) {
+    if (!queueFileInDirectory(outputDirectory, subPath, "Info.plist",
+        infoDictData)) {
 
         goto finish;
     }
@@ -660,9 +808,8 @@ Boolean writeMkext2ToDirectory(
         OSKextLogMemError();
         goto finish;
     }
-    if (!writeFileInDirectory(outputDirectory, subPath,
-        executableNameCStringAlloced,
-        file_data, CFDataGetLength(executable))) {
+    if (!queueFileInDirectory(outputDirectory, subPath,
+        executableNameCStringAlloced, executable)) {
 
         goto finish;
     }
@@ -721,6 +868,8 @@ CFDictionaryRef extractEntriesFromMkext1(
     CFDictionaryRef          kextPlist = 0;        // must release
     CFStringRef              errorString = NULL;   // must release
     CFDataRef                kextExecutable = 0;   // must release
+    Mkext1UncompressedEntry * uncompressed = NULL; // must free & release each
+    Boolean                  entryOK;
     CFDictionaryKeyCallBacks keyCallBacks;
 
 
@@ -740,6 +889,18 @@ CFDictionaryRef extractEntriesFromMkext1(
         fprintf(stdout, "Found %u kexts:\n", MKEXT_GET_COUNT(mkextHeader));
     }
 
+   /* With -j, do all the decompression up front on worker threads;
+    * the loop below then just picks up each entry's results in order,
+    * so naming and output are the same as unpacking serially.
+    */
+    if (gJobs > 1 && MKEXT_GET_COUNT(mkextHeader)) {
+        uncompressed = uncompressMkext1Entries(mkextStart, mkextHeader);
+        if (!uncompressed) {
+            error = true;
+            goto finish;
+        }
+    }
+
     for (i = 0; i < MKEXT_GET_COUNT(mkextHeader); i++) {
         if (entryName) {
             CFRelease(entryName);
@@ -782,8 +943,15 @@ CFDictionaryRef extractEntriesFromMkext1(
        /*****
         * Get the plist
         */
-        if (!uncompressMkext1Entry(mkextStart,
-            plist_file, &kextPlistDataObject) || !kextPlistDataObject) {
+        if (uncompressed) {
+            entryOK = uncompressed[i].plistOK;
+            kextPlistDataObject = uncompressed[i].plistData;
+            uncompressed[i].plistData = NULL;
+        } else {
+            entryOK = uncompressMkext1Entry(mkextStart,
+                plist_file, &kextPlistDataObject);
+        }
+        if (!entryOK || !kextPlistDataObject) {
 
             fprintf(stderr, "couldn't uncompress plist at index %d.\n", i);
             continue;
@@ -819,6 +987,14 @@ CFDictionaryRef extractEntriesFromMkext1(
             goto finish;
         }
 
+       /* With -b, skip the executables of kexts we don't want.
+        */
+        if (!isSelectedBundleID(CFDictionaryGetValue(kextPlist,
+            kCFBundleIdentifierKey))) {
+
+            continue;
+        }
+
         entryName = createKextNameFromPlist(entries, kextPlist);
         if (!entryName) {
             fprintf(stderr, "internal error.\n");
@@ -864,8 +1040,15 @@ CFDictionaryRef extractEntriesFromMkext1(
             OSSwapBigToHostInt32(module_file->realsize) ||
             OSSwapBigToHostInt32(module_file->modifiedsecs)) {
 
-            if (!uncompressMkext1Entry(mkextStart,
-                module_file, &kextExecutable)) {
+            if (uncompressed) {
+                entryOK = uncompressed[i].executableOK;
+                kextExecutable = uncompressed[i].executableData;
+                uncompressed[i].executableData = NULL;
+            } else {
+                entryOK = uncompressMkext1Entry(mkextStart,
+                    module_file, &kextExecutable);
+            }
+            if (!entryOK) {
 
                 fprintf(stderr, "couldn't uncompress executable at index %d.\n",
                     i);
@@ -894,10 +1077,110 @@ finish:
     if (kextPlist)       CFRelease(kextPlist);
     if (errorString)     CFRelease(errorString);
     if (kextExecutable)  CFRelease(kextExecutable);
+    if (uncompressed) {
+        for (i = 0; i < MKEXT_GET_COUNT(mkextHeader); i++) {
+            SAFE_RELEASE(uncompressed[i].plistData);
+            SAFE_RELEASE(uncompressed[i].executableData);
+        }
+        free(uncompressed);
+    }
 
     return entries;
 }
 
+/*******************************************************************************
+* Decompresses the plist of every entry in an mkext1 archive, then the
+* executables of the kexts selected with -b, up to gJobs entries at a time.
+* Returns a malloc'd array with a result per entry, or NULL on allocation
+* failure.
+*******************************************************************************/
+Mkext1UncompressedEntry * uncompressMkext1Entries(
+    void          * mkextStart,
+    mkext1_header * mkextHeader)
+{
+    Mkext1UncompressedEntry * result    = NULL;  // returned
+    unsigned int              count     = MKEXT_GET_COUNT(mkextHeader);
+    dispatch_queue_t          workQueue = NULL;  // do not release
+    dispatch_group_t          workGroup = NULL;  // must release
+    dispatch_semaphore_t      jobSlots  = NULL;  // must release
+    unsigned int              i;
+
+    result = (Mkext1UncompressedEntry *)calloc(count, sizeof(*result));
+    workQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    workGroup = dispatch_group_create();
+    jobSlots = dispatch_semaphore_create(gJobs);
+    if (!result || !workQueue || !workGroup || !jobSlots) {
+        fprintf(stderr, "malloc failure\n");
+        SAFE_FREE_NULL(result);
+        goto finish;
+    }
+
+    for (i = 0; i < count; i++) {
+        Mkext1UncompressedEntry * entry      = &result[i];
+        mkext_kext              * kextData   = &mkextHeader->kext[i];
+
+        dispatch_semaphore_wait(jobSlots, DISPATCH_TIME_FOREVER);
+        dispatch_group_async(workGroup, workQueue, ^{
+            entry->plistOK = uncompressMkext1Entry(mkextStart,
+                &kextData->plist, &entry->plistData);
+            dispatch_semaphore_signal(jobSlots);
+        });
+    }
+    dispatch_group_wait(workGroup, DISPATCH_TIME_FOREVER);
+
+   /* With -b, only queue the executables of the kexts we want; the
+    * rest are skipped by extractEntriesFromMkext1() anyway.
+    */
+    for (i = 0; i < count; i++) {
+        Mkext1UncompressedEntry * entry      = &result[i];
+        mkext_file              * module_file = &mkextHeader->kext[i].module;
+
+        entry->executableOK = true;
+        if (!OSSwapBigToHostInt32(module_file->offset) &&
+            !OSSwapBigToHostInt32(module_file->compsize) &&
+            !OSSwapBigToHostInt32(module_file->realsize) &&
+            !OSSwapBigToHostInt32(module_file->modifiedsecs)) {
+
+            continue;
+        }
+        if (gBundleIDs) {
+            CFPropertyListRef kextPlist = NULL;  // must release
+            Boolean           selected  = false;
+
+            if (entry->plistOK && entry->plistData) {
+                kextPlist = CFPropertyListCreateWithData(kCFAllocatorDefault,
+                    entry->plistData, kCFPropertyListImmutable, NULL, NULL);
+            }
+            if (kextPlist &&
+                CFGetTypeID(kextPlist) == CFDictionaryGetTypeID()) {
+
+                selected = isSelectedBundleID(CFDictionaryGetValue(
+                    (CFDictionaryRef)kextPlist, kCFBundleIdentifierKey));
+            }
+            SAFE_RELEASE(kextPlist);
+            if (!selected) {
+                continue;
+            }
+        }
+
+        dispatch_semaphore_wait(jobSlots, DISPATCH_TIME_FOREVER);
+        dispatch_group_async(workGroup, workQueue, ^{
+            entry->executableOK = uncompressMkext1Entry(mkextStart,
+                module_file, &entry->executableData);
+            dispatch_semaphore_signal(jobSlots);
+        });
+    }
+
+   /* Join all workers before anyone looks at the results.
+    */
+    dispatch_group_wait(workGroup, DISPATCH_TIME_FOREVER);
+
+finish:
+    if (workGroup) dispatch_release(workGroup);
+    if (jobSlots)  dispatch_release(jobSlots);
+    return result;
+}
+
 /*******************************************************************************
 *******************************************************************************/
 Boolean uncompressMkext1Entry(
@@ -1033,8 +1316,8 @@ Boolean writeMkext1EntriesToDirectory(CFDictionaryRef entryDict,
                 "Output path is too long - %s.", subPath);
             goto finish;
         }
-        if (!writeFileInDirectory(outputDirectory, subPath, "Info.plist",
-            file_data, CFDataGetLength(fileData))) {
+        if (!queueFileInDirectory(outputDirectory, subPath, "Info.plist",
+            fileData)) {
 
             goto finish;
         }
@@ -1076,8 +1359,8 @@ Boolean writeMkext1EntriesToDirectory(CFDictionaryRef entryDict,
             OSKextLogMemError();
             goto finish;
         }
-        if (!writeFileInDirectory(outputDirectory, subPath, executable_name,
-            file_data, CFDataGetLength(fileData))) {
+        if (!queueFileInDirectory(outputDirectory, subPath, executable_name,
+            fileData)) {
 
             goto finish;
         }
@@ -1086,8 +1369,13 @@ Boolean writeMkext1EntriesToDirectory(CFDictionaryRef entryDict,
     result = true;
 
 finish:
+    if (!finishQueuedWrites()) {
+        result = false;
+    }
     if (kextNames) free(kextNames);
     if (entries)   free(entries);
+    SAFE_FREE(kext_name);
+    SAFE_FREE(executable_name);
     return result;
 }
 
@@ -1316,3 +1604,101 @@ finish:
     return result;
 
 }
+
+/*******************************************************************************
+* Without -j, queueFileInDirectory() just calls writeFileInDirectory(). With
+* it, each write runs on a concurrent queue once one of kMaxQueuedWrites slots
+* is free, so the caller can go on decompressing the next entry; the queued
+* write retains its data. A failed write makes later calls return false, and
+* finishQueuedWrites() waits for every write and reports whether all worked.
+* Different kexts write different files, and writeFileInDirectory() tolerates
+* another write having created a directory first, so the result on disk is the
+* same as writing serially.
+*******************************************************************************/
+Boolean setUpQueuedWrites(void)
+{
+    gWriteQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    gWriteGroup = dispatch_group_create();
+    gWriteSlots = dispatch_semaphore_create(kMaxQueuedWrites);
+    if (!gWriteQueue || !gWriteGroup || !gWriteSlots) {
+        OSKextLogMemError();
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+Boolean queueFileInDirectory(
+    const char * basePath,
+    const char * subPath,
+    const char * fileName,
+    CFDataRef    fileData)
+{
+    char * basePathCopy = NULL;  // block frees
+    char * subPathCopy  = NULL;  // block frees
+    char * fileNameCopy = NULL;  // block frees
+
+    if (!gWriteGroup) {
+        char subPathBuffer[PATH_MAX];
+
+       /* writeFileInDirectory() scribbles on subPath while it works.
+        */
+        if (strlcpy(subPathBuffer, subPath, sizeof(subPathBuffer)) >=
+            sizeof(subPathBuffer)) {
+
+            OSKextLog(/* kext */ NULL,
+                kOSKextLogErrorLevel | kOSKextLogFileAccessFlag,
+                "Output path is too long - %s.", subPath);
+            return false;
+        }
+        return writeFileInDirectory(basePath, subPathBuffer, fileName,
+            (const char *)CFDataGetBytePtr(fileData),
+            CFDataGetLength(fileData));
+    }
+
+    if (gWriteFailed) {
+        return false;
+    }
+
+    basePathCopy = strdup(basePath);
+    subPathCopy = strdup(subPath);
+    fileNameCopy = strdup(fileName);
+    if (!basePathCopy || !subPathCopy || !fileNameCopy) {
+        OSKextLogMemError();
+        SAFE_FREE(basePathCopy);
+        SAFE_FREE(subPathCopy);
+        SAFE_FREE(fileNameCopy);
+        return false;
+    }
+    CFRetain(fileData);
+
+    dispatch_semaphore_wait(gWriteSlots, DISPATCH_TIME_FOREVER);
+    dispatch_group_async(gWriteGroup, gWriteQueue, ^{
+        if (!gWriteFailed &&
+            !writeFileInDirectory(basePathCopy, subPathCopy, fileNameCopy,
+                (const char *)CFDataGetBytePtr(fileData),
+                CFDataGetLength(fileData))) {
+
+            gWriteFailed = true;
+        }
+        free(basePathCopy);
+        free(subPathCopy);
+        free(fileNameCopy);
+        CFRelease(fileData);
+        dispatch_semaphore_signal(gWriteSlots);
+    });
+
+    return true;
+}
+
+/*******************************************************************************
+*******************************************************************************/
+Boolean finishQueuedWrites(void)
+{
+    if (!gWriteGroup) {
+        return true;
+    }
+    dispatch_group_wait(gWriteGroup, DISPATCH_TIME_FOREVER);
+    return !gWriteFailed;
+}
@@ -5,6 +5,8 @@
 #include <sys/syslimits.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <dispatch/dispatch.h>
 
 #include <sys/pgo.h>
 
@@ -50,27 +52,93 @@ char *pgo_read_metadata(void *buffer, size_t size, char *key)
     return NULL;
 }
 
+/*
+ * Each kext with PGO data gets a thread that blocks in grab_pgo_data() until
+ * the kext unloads; the kernel holds the unload until the data is taken, so
+ * the waits can't share threads.  Writing the data out is what competes for
+ * I/O, so at most PGO_MAX_WRITERS threads write at once, and pgo_wait_for_writes()
+ * lets kextd finish any data already taken from the kernel before it exits.
+ */
+#define PGO_MAX_WRITERS 2
+
+struct pgo_request {
+    OSKextRef        kext;
+    uuid_t           uuid;
+    ssize_t          size;     /* metadata buffer size, or -1 to ask the kernel */
+    dispatch_group_t ready;    /* left just before waiting, or NULL */
+};
+
+static dispatch_once_t      pgo_once;
+static dispatch_semaphore_t pgo_write_slots;
+static dispatch_group_t     pgo_writes;
+
 static
-void *pgo_thread_main(void *context)
+void pgo_init(void)
+{
+    dispatch_once(&pgo_once, ^{
+        pgo_write_slots = dispatch_semaphore_create(PGO_MAX_WRITERS);
+        pgo_writes = dispatch_group_create();
+    });
+}
+
+static
+void pgo_request_ready(struct pgo_request *req)
+{
+    if (req->ready) {
+        dispatch_group_leave(req->ready);
+        req->ready = NULL;
+    }
+}
+
+static
+void pgo_write_file(OSKextRef kext, const char *id_rep, const char *instance,
+                    void *buffer, ssize_t size)
 {
-    OSKextRef kext = (OSKextRef) context;
-    void *buffer = NULL;
     int fd = -1;
 
-    uuid_t uuid;
+    mkdir(PGO_FILENAME_BASE, PGO_FILE_MODE);
 
-    CFDataRef uuid_dataref = OSKextCopyUUIDForArchitecture(kext, NULL);
-    if (uuid_dataref)
-    {
-        assert(CFDataGetLength(uuid_dataref) == sizeof(uuid));
-        memcpy(&uuid, CFDataGetBytePtr(uuid_dataref), sizeof(uuid));
-        CFRelease(uuid_dataref);
-    }
-    else
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/%s", PGO_FILENAME_BASE, id_rep);
+    mkdir (filename, PGO_FILE_MODE);
+
+    snprintf(filename, sizeof(filename), "%s/%s/%s", PGO_FILENAME_BASE, id_rep, instance);
+
+    fd = open(filename, O_WRONLY|O_CREAT, 0644);
+    if (fd < 0)
     {
+        OSKextLog(kext, kOSKextLogErrorLevel, "error (%s) while opening pgo output file: %s",
+                  strerror(errno), filename);
         goto fail;
     }
 
+    unsigned char *p = buffer;
+    ssize_t r;
+    while (size > 0) {
+        errno = 0;
+        r = write(fd, p, size);
+        if (r > 0) {
+            p += r;
+            size -= r;
+        } else {
+            OSKextLog(kext, kOSKextLogErrorLevel, "error writing pgo file: %s", strerror(errno));
+            goto fail;
+        }
+    }
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static
+void *pgo_thread_main(void *context)
+{
+    struct pgo_request *req = (struct pgo_request *) context;
+    OSKextRef kext = req->kext;
+    void *buffer = NULL;
+
     CFStringRef id = OSKextGetIdentifier(kext);
     if (!id)
     {
@@ -84,7 +152,11 @@ void *pgo_thread_main(void *context)
         goto fail;
     }
 
-    ssize_t size = grab_pgo_data(&uuid, PGO_METADATA, NULL, 0);
+    ssize_t size = req->size;
+    if (size < 0)
+    {
+        size = grab_pgo_data(&req->uuid, PGO_METADATA, NULL, 0);
+    }
     if (size < 0)
     {
         OSKextLog(kext, kOSKextLogErrorLevel, "failed to get size of pgo buffer: %s", strerror(errno));
@@ -97,7 +169,8 @@ void *pgo_thread_main(void *context)
         goto fail;
     }
 
-    size= grab_pgo_data(&uuid, PGO_METADATA | PGO_WAIT_FOR_UNLOAD, buffer, size);
+    pgo_request_ready(req);
+    size= grab_pgo_data(&req->uuid, PGO_METADATA | PGO_WAIT_FOR_UNLOAD, buffer, size);
     if (size < 0)
     {
         OSKextLog(kext, kOSKextLogErrorLevel, "failed to get size of pgo buffer: %s", strerror(errno));
@@ -107,67 +180,87 @@ void *pgo_thread_main(void *context)
     char *instance = pgo_read_metadata(buffer, size, "INSTANCE");
     if (!instance) {
         OSKextLog(kext, kOSKextLogErrorLevel, "no metadata in pgo buffer");
-    }
-
-    mkdir(PGO_FILENAME_BASE, PGO_FILE_MODE);
-
-    char filename[PATH_MAX];
-    snprintf(filename, sizeof(filename), "%s/%s", PGO_FILENAME_BASE, id_rep);
-    mkdir (filename, PGO_FILE_MODE);
-
-    snprintf(filename, sizeof(filename), "%s/%s/%s", PGO_FILENAME_BASE, id_rep, instance);
-    fd = fopen(filename, "w");
-
-    fd = open(filename, O_WRONLY|O_CREAT);
-    if (fd < 0)
-    {
-        OSKextLog(kext, kOSKextLogErrorLevel, "error (%s) while opening pgo output file: %s",
-                  strerror(errno), filename);
         goto fail;
     }
 
-    unsigned char *p = buffer;
-    ssize_t r;
-    while (size > 0) {
-        errno = 0;
-        r = write(fd, p, size);
-        if (r > 0) {
-            p += r;
-            size -= r;
-        } else {
-            OSKextLog(kext, kOSKextLogErrorLevel, "error writing pgo file: %s", strerror(errno));
-            goto fail;
-        }
-    }
+    dispatch_group_enter(pgo_writes);
+    dispatch_semaphore_wait(pgo_write_slots, DISPATCH_TIME_FOREVER);
+    pgo_write_file(kext, id_rep, instance, buffer, size);
+    dispatch_semaphore_signal(pgo_write_slots);
+    dispatch_group_leave(pgo_writes);
 
 fail:
+    pgo_request_ready(req);
     CFRelease(kext);
+    free(req);
     if (buffer) {
         free(buffer);
     }
-    if (fd > 0) {
-        close(fd);
-    }
     return NULL;
 }
 
-void pgo_start_thread(OSKextRef kext)
+static
+bool pgo_start_request(OSKextRef kext, const uuid_t uuid, ssize_t size,
+                       dispatch_group_t ready)
 {
-    CFRetain(kext);
+    struct pgo_request *req = NULL;
+    pthread_attr_t attr;
     pthread_t thread;
     int r;
-    r = pthread_create(&thread, NULL, pgo_thread_main, kext);
+
+    pgo_init();
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+    {
+        OSKextLog(kext, kOSKextLogErrorLevel, "failed to allocate pgo request");
+        return false;
+    }
+    CFRetain(kext);
+    req->kext = kext;
+    memcpy(req->uuid, uuid, sizeof(req->uuid));
+    req->size = size;
+    req->ready = ready;
+    if (ready) {
+        dispatch_group_enter(ready);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    r = pthread_create(&thread, &attr, pgo_thread_main, req);
+    pthread_attr_destroy(&attr);
     if (r)
     {
         OSKextLog(kext, kOSKextLogErrorLevel, "failed to create thread");
+        pgo_request_ready(req);
         CFRelease(kext);
+        free(req);
+        return false;
+    }
+    return true;
+}
+
+void pgo_start_thread(OSKextRef kext)
+{
+    uuid_t uuid;
+
+    CFDataRef uuid_dataref = OSKextCopyUUIDForArchitecture(kext, NULL);
+    if (!uuid_dataref)
+    {
+        return;
     }
+    assert(CFDataGetLength(uuid_dataref) == sizeof(uuid));
+    memcpy(&uuid, CFDataGetBytePtr(uuid_dataref), sizeof(uuid));
+    CFRelease(uuid_dataref);
+
+    pgo_start_request(kext, uuid, -1, NULL);
 }
 
 bool pgo_scan_kexts(CFArrayRef array)
 {
     CFIndex i; 
     bool found = false; 
+    dispatch_group_t ready = dispatch_group_create();
     
     for (i = 0; i < CFArrayGetCount(array); i++) 
     {
@@ -197,12 +290,26 @@ bool pgo_scan_kexts(CFArrayRef array)
         }
         assert(CFDataGetLength(uuid) == sizeof(uuid_t));
         ssize_t size = grab_pgo_data((uuid_t*)CFDataGetBytePtr(uuid), PGO_METADATA, NULL, 0);
-        if (size < 0) {
-            continue;
+        if (size >= 0 &&
+            pgo_start_request(kext, CFDataGetBytePtr(uuid), size, ready))
+        {
+            found = true;
         }
-        pgo_start_thread(kext);
-        found = true;
+        CFRelease(uuid);
+    }
+
+    /* Return once every thread is about to wait for its kext to unload. */
+    if (ready) {
+        dispatch_group_wait(ready, DISPATCH_TIME_FOREVER);
+        dispatch_release(ready);
     }
     
     return found;
 }
+
+void pgo_wait_for_writes(void)
+{
+    if (pgo_writes) {
+        dispatch_group_wait(pgo_writes, DISPATCH_TIME_FOREVER);
+    }
+}
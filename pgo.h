@@ -5,5 +5,7 @@
 void pgo_start_thread(OSKextRef kext);
 
 bool pgo_scan_kexts(CFArrayRef kexts);
+
+void pgo_wait_for_writes(void);
     
 #endif /* PGO_H */
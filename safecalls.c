@@ -52,6 +52,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/ucred.h>
+#include <dispatch/dispatch.h>
+#if defined(__has_include)
+#if __has_include(<sys/clonefile.h>)
+#include <sys/clonefile.h>      // fclonefileat(2), CLONE_NOFOLLOW
+#endif
+#endif
 
 #include <IOKit/kext/kextmanager_types.h>
 
@@ -504,6 +510,114 @@ finish:
 }
 
 
+/*
+ * Copy engine for _copyfiledata(): files larger than one buffer are read
+ * into page-aligned buffers while the previous buffer is being written on
+ * a serial queue.  Same-volume copies are cloned where the OS can.
+ */
+#define kCopyBufferSize     (1024 * 1024)
+#define kCopyBufferCount    (2)     // one being read, one being written
+
+#ifdef CLONE_NOFOLLOW
+// clone srcfd to dstpath on the same volume; -1 w/errno if it can't
+static int
+_clonefiledata(int srcfd, struct stat *srcsb, int dstfdvol, const char *dstpath)
+{
+    int bsderr = -1;
+    int dstfd = -1;
+    int savedir = -1;
+    struct stat volsb;
+    char child[PATH_MAX];
+
+    if (fstat(dstfdvol, &volsb))            goto finish;
+    if (volsb.st_dev != srcsb->st_dev) {
+        errno = EXDEV;
+        goto finish;
+    }
+
+    // same parent/child policy checks that sopen() applies
+    if (schdirparent(dstfdvol, dstpath, &savedir, child))   goto finish;
+    if (fclonefileat(srcfd, AT_FDCWD, child, CLONE_NOFOLLOW))  goto finish;
+    if (-1 == (dstfd = open(child, O_RDONLY | O_NOFOLLOW)))   goto finish;
+    if (spolicy(dstfdvol, dstfd))           goto finish;
+    if ((bsderr = fchmod(dstfd, srcsb->st_mode)))  goto finish;
+
+finish:
+    if (bsderr && dstfd != -1) {
+        (void)unlink(child);    // don't leave a half-vetted clone behind
+    }
+    if (dstfd != -1)    close(dstfd);
+    RESTOREDIR(savedir);
+
+    return bsderr;
+}
+#endif  // CLONE_NOFOLLOW
+
+// read/write overlapped through kCopyBufferCount buffers
+static int
+_pipelinecopy(int srcfd, int dstfd, off_t size)
+{
+    __block int bsderr = 0;     // first write error
+    int readerr = 0;
+    void *bufs[kCopyBufferCount] = { NULL };
+    dispatch_queue_t writeq = NULL;
+    dispatch_semaphore_t freebufs = NULL;
+    off_t offset;
+    int i;
+
+    writeq = dispatch_queue_create("com.apple.kext_tools.copy", NULL);
+    freebufs = dispatch_semaphore_create(kCopyBufferCount);
+    if (!writeq || !freebufs) {
+        readerr = ENOMEM;
+        goto finish;
+    }
+    for (i = 0; i < kCopyBufferCount; i++) {
+        if ((readerr = posix_memalign(&bufs[i], getpagesize(),
+                                      kCopyBufferSize))) {
+            goto finish;
+        }
+    }
+
+    for (offset = 0, i = 0; offset < size && !bsderr; i ^= 1) {
+        void *buf = bufs[i];
+        off_t thisOffset = offset;
+        ssize_t thisTime = (ssize_t)MIN(size - offset, kCopyBufferSize);
+
+        // wait for this buffer's previous write to finish
+        dispatch_semaphore_wait(freebufs, DISPATCH_TIME_FOREVER);
+        if (read(srcfd, buf, thisTime) != thisTime) {
+            readerr = errno ? errno : EIO;
+            dispatch_semaphore_signal(freebufs);
+            break;
+        }
+        dispatch_async(writeq, ^{
+            if (!bsderr &&
+                    pwrite(dstfd, buf, thisTime, thisOffset) != thisTime) {
+                bsderr = errno ? errno : EIO;
+            }
+            dispatch_semaphore_signal(freebufs);
+        });
+        offset += thisTime;
+    }
+
+    // wait for outstanding writes before the buffers go away
+    dispatch_sync(writeq, ^{ });
+
+finish:
+    if (readerr && !bsderr)     bsderr = readerr;
+    for (i = 0; i < kCopyBufferCount; i++) {
+        if (bufs[i])    free(bufs[i]);
+    }
+    if (writeq)     dispatch_release(writeq);
+    if (freebufs)   dispatch_release(freebufs);
+
+    if (bsderr) {
+        errno = bsderr;
+        bsderr = -1;
+    }
+    return bsderr;
+}
+
 static int
 _copyfiledata(int srcfd, struct stat *srcsb, int dstfdvol, const char *dstpath)
 {
@@ -514,19 +628,34 @@ _copyfiledata(int srcfd, struct stat *srcsb, int dstfdvol, const char *dstpath)
     ssize_t thisTime;
     off_t bytesLeft;
 
-    // nuke/open the destination
+    // nuke the destination
     (void)sunlink(dstfdvol, dstpath);
+
+#ifdef CLONE_NOFOLLOW
+    // same volume -> share the blocks rather than copy them
+    if (_clonefiledata(srcfd, srcsb, dstfdvol, dstpath) == 0) {
+        bsderr = 0;
+        goto finish;
+    }
+#endif
+
+    // open the destination
     dstfd = sopen(dstfdvol, dstpath, O_CREAT|O_WRONLY, srcsb->st_mode|S_IWUSR);
     if (dstfd == -1)        goto finish;
 
-    // and loop with our handy buffer
-    bufsize = (size_t)MIN(srcsb->st_size, MAXBSIZE);
-    if (!(buf = malloc(bufsize)))      goto finish;;
-    for (bytesLeft = srcsb->st_size; bytesLeft > 0; bytesLeft -= thisTime) {
-        thisTime = (ssize_t)MIN(bytesLeft, (unsigned int)bufsize);
-
-        if (read(srcfd, buf, thisTime) != thisTime)     goto finish;
-        if (write(dstfd, buf, thisTime) != thisTime)    goto finish;
+    if (srcsb->st_size > kCopyBufferSize) {
+        // prelinked kernels, booters, etc
+        if (_pipelinecopy(srcfd, dstfd, srcsb->st_size))    goto finish;
+    } else {
+        // and loop with our handy buffer
+        bufsize = (size_t)MIN(srcsb->st_size, MAXBSIZE);
+        if (bufsize && !(buf = malloc(bufsize)))      goto finish;
+        for (bytesLeft = srcsb->st_size; bytesLeft > 0; bytesLeft -= thisTime) {
+            thisTime = (ssize_t)MIN(bytesLeft, (unsigned int)bufsize);
+
+            if (read(srcfd, buf, thisTime) != thisTime)     goto finish;
+            if (write(dstfd, buf, thisTime) != thisTime)    goto finish;
+        }
     }
 
     // apply final permissions
@@ -27,6 +27,14 @@
 #include <Security/Security.h>
 #include <sys/sysctl.h>
 #include <sys/csr.h>
+#include <sys/stat.h>
+#include <CommonCrypto/CommonDigest.h>
+#include <fts.h>
+#include <libgen.h>
+#include <paths.h>
+#include <pthread.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
 #include <servers/bootstrap.h>
 #include <IOKit/kext/kextmanager_types.h>
 
@@ -38,23 +46,44 @@
 /*******************************************************************************
  * Helper functions
  *******************************************************************************/
-static OSStatus     checkRootCertificateIsApple(OSKextRef aKext);
-static CFStringRef  copyCDHash(SecStaticCodeRef code);
+static OSStatus     checkRootCertificateIsApple(CFStringRef bundleID,
+                                                CFDictionaryRef signingContext);
+static CFStringRef  copyCDHash(CFDictionaryRef signingInfo);
 static CFStringRef  copyIssuerCN(SecCertificateRef certificate);
-static void         copySigningInfo(CFURLRef kextURL,
+static void         copySigningInfo(CFDictionaryRef signingContext,
                                     CFStringRef* cdhash,
                                     CFStringRef* teamId,
                                     CFStringRef* subjectCN,
                                     CFStringRef* issuerCN);
-static CFArrayRef   copySubjectCNArray(CFURLRef kextURL);
+static CFArrayRef   copySubjectCNArray(CFDictionaryRef signingContext);
 static CFStringRef  copyTeamID(SecCertificateRef certificate);
 static CFStringRef  createArchitectureList(OSKextRef aKext, CFBooleanRef *isFat);
 static void         getAdhocSignatureHash(CFURLRef kextURL, char ** signatureBuffer);
-static void         filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList);
-static Boolean hashIsInExceptionList(CFURLRef theKextURL, CFDictionaryRef theDict);
+static void         filterKextLoadForMT(CFDictionaryRef kextSnapshot,
+                                        CFMutableArrayRef *kextList);
+static Boolean hashIsInExceptionList(CFDictionaryRef signingContext,
+                                     CFDictionaryRef theDict);
+static CFSetRef     createExceptionHashBundleIDSet(CFDictionaryRef theDict);
 static uint64_t     getKextDevModeFlags(void);
+static CFStringRef  copyKextFingerprint(CFURLRef kextURL);
+static CFDictionaryRef createKextSnapshot(OSKextRef aKext, CFURLRef kextURL);
+static CFDictionaryRef copySigningContext(CFDictionaryRef kextSnapshot);
+static OSStatus     checkKextSnapshotSignature(CFDictionaryRef kextSnapshot,
+                                               Boolean earlyBoot);
+static Boolean      isKextSnapshotInExceptionList(CFDictionaryRef kextSnapshot);
+static CFDictionaryRef getSigningContextInfo(CFDictionaryRef signingContext);
+static CFStringRef  getSigningContextAdhocHash(CFDictionaryRef signingContext);
+static Boolean      signatureCacheHasEntry(CFStringRef kextPath,
+                                           CFStringRef fingerprint,
+                                           CFStringRef cdhash,
+                                           Boolean needRevocationCheck);
+static void         signatureCacheAddEntry(CFStringRef kextPath,
+                                           CFStringRef fingerprint,
+                                           CFStringRef cdhash,
+                                           Boolean revocationChecked);
 #if USE_OLD_EXCEPTION_LIST
-static Boolean bundleIdIsInExceptionList(OSKextRef theKext, CFDictionaryRef theDict);
+static Boolean bundleIdIsInExceptionList(CFDictionaryRef kextSnapshot,
+                                         CFDictionaryRef theDict);
 #endif
 
 /*******************************************************************************
@@ -129,40 +158,288 @@ finish:
 }
 
 /*******************************************************************************
- * checkRootCertificateIsApple() - check if the root certificate of the kext
- *  is issued by Apple
- *  <rdar://problem/12435992> 
+ * Kext snapshots.
+ *
+ * Security.framework may be called from any thread, but OSKext may not, so
+ * signature checks run from the kext's plain CF values, copied on the calling
+ * thread: its absolute URL and path and the Info.plist values a check needs.
  *******************************************************************************/
-static OSStatus checkRootCertificateIsApple(OSKextRef aKext)
+#define kKextSnapshotURLKey             CFSTR("URL")
+#define kKextSnapshotPathKey            CFSTR("Path")
+#define kKextSnapshotIdentifierKey      kCFBundleIdentifierKey
+#define kKextSnapshotVersionKey         kCFBundleVersionKey
+
+/*******************************************************************************
+ * createKextSnapshot() - snapshot aKext; kextURL may be NULL, in which case
+ * the kext's absolute URL is used.  Call on the thread that owns aKext.
+ *  Note: the caller must release the returned CFDictionaryRef
+ *******************************************************************************/
+static CFDictionaryRef createKextSnapshot(OSKextRef aKext, CFURLRef kextURL)
 {
-    OSStatus                result          = -1;
-    CFURLRef                kextURL         = NULL;   // must release
-    SecStaticCodeRef        staticCodeRef   = NULL;   // must release
-    SecRequirementRef       requirementRef  = NULL;   // must release
-    CFStringRef             myCFString;
-    CFStringRef             requirementsString;
-    
-    if (aKext == NULL) {
-        return result;
+    CFMutableDictionaryRef  result      = NULL;  // returned
+    CFURLRef                absURL      = NULL;  // must release
+    CFStringRef             kextPath    = NULL;  // must release
+    CFStringRef             keys[]      = {
+        kKextSnapshotVersionKey
+    };
+    CFTypeRef               value       = NULL;  // do NOT release
+
+    if (!aKext) {
+        goto finish;
     }
-    
-    kextURL = CFURLCopyAbsoluteURL(OSKextGetURL(aKext));
-    if (!kextURL) {
+    absURL = CFURLCopyAbsoluteURL(kextURL ? kextURL : OSKextGetURL(aKext));
+    if (absURL) {
+        kextPath = CFURLCopyFileSystemPath(absURL, kCFURLPOSIXPathStyle);
+    }
+    result = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                       &kCFTypeDictionaryKeyCallBacks,
+                                       &kCFTypeDictionaryValueCallBacks);
+    if (!absURL || !kextPath || !result) {
         OSKextLogMemError();
+        SAFE_RELEASE_NULL(result);
         goto finish;
     }
-    
-    if (SecStaticCodeCreateWithPath(kextURL,
+    CFDictionarySetValue(result, kKextSnapshotURLKey, absURL);
+    CFDictionarySetValue(result, kKextSnapshotPathKey, kextPath);
+
+    value = OSKextGetIdentifier(aKext);
+    if (value) {
+        CFDictionarySetValue(result, kKextSnapshotIdentifierKey, value);
+    }
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        value = OSKextGetValueForInfoDictionaryKey(aKext, keys[i]);
+        if (value && CFGetTypeID(value) == CFStringGetTypeID()) {
+            CFDictionarySetValue(result, keys[i], value);
+        }
+    }
+
+finish:
+    SAFE_RELEASE(absURL);
+    SAFE_RELEASE(kextPath);
+    return result;
+}
+
+/*******************************************************************************
+ * isAppleKextSnapshot() - true if the snapshot's bundle ID is an Apple one.
+ *******************************************************************************/
+static Boolean isAppleKextSnapshot(CFDictionaryRef kextSnapshot)
+{
+    CFStringRef bundleID = CFDictionaryGetValue(kextSnapshot,
+                                                kKextSnapshotIdentifierKey);
+
+    return bundleID && CFStringHasPrefix(bundleID, __kOSKextApplePrefix);
+}
+
+/*******************************************************************************
+ * Signing contexts.
+ *
+ * Message tracing, exception list lookups and signature checks all want the
+ * same SecStaticCodeRef and signing information for a kext, and each one
+ * used to re-open and re-parse the bundle's signature for it.  A signing
+ * context is a dictionary holding those for one kext, created on first use
+ * and looked up again by path.  The fingerprint from copyKextFingerprint() is
+ * rechecked on every lookup so a kext that changed on disk gets a fresh
+ * context.  The signing information and ad-hoc hash are filled in lazily.
+ *******************************************************************************/
+#define kSigningContextURLKey           CFSTR("URL")
+#define kSigningContextFingerprintKey   CFSTR("Fingerprint")
+#define kSigningContextCodeKey          CFSTR("StaticCode")
+#define kSigningContextInfoKey          CFSTR("SigningInformation")
+#define kSigningContextAdhocHashKey     CFSTR("AdhocHash")
+
+#define kMaxSigningContexts             64
+
+static pthread_mutex_t          sSigningContextLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef   sSigningContexts    = NULL; // do NOT release
+
+/*******************************************************************************
+ * copySigningContext() - get the signing context for a kext snapshot.  Safe
+ * to call from any thread.
+ *  Note: the caller must release the returned CFDictionaryRef
+ *******************************************************************************/
+static CFDictionaryRef copySigningContext(CFDictionaryRef kextSnapshot)
+{
+    CFMutableDictionaryRef  context         = NULL;  // returned
+    CFURLRef                absURL          = NULL;  // do NOT release
+    CFStringRef             kextPath        = NULL;  // do NOT release
+    CFStringRef             fingerprint     = NULL;  // must release
+    SecStaticCodeRef        staticCodeRef   = NULL;  // must release
+    CFDictionaryRef         cachedContext   = NULL;  // do NOT release
+
+    if (!kextSnapshot) {
+        goto finish;
+    }
+    absURL = CFDictionaryGetValue(kextSnapshot, kKextSnapshotURLKey);
+    kextPath = CFDictionaryGetValue(kextSnapshot, kKextSnapshotPathKey);
+    fingerprint = copyKextFingerprint(absURL);
+    if (!kextPath || !fingerprint) {
+        goto finish;
+    }
+
+    pthread_mutex_lock(&sSigningContextLock);
+    if (sSigningContexts) {
+        cachedContext = CFDictionaryGetValue(sSigningContexts, kextPath);
+        if (cachedContext &&
+            CFEqual(fingerprint,
+                    CFDictionaryGetValue(cachedContext,
+                                         kSigningContextFingerprintKey))) {
+            context = (CFMutableDictionaryRef)CFRetain(cachedContext);
+        }
+    }
+    pthread_mutex_unlock(&sSigningContextLock);
+    if (context) {
+        goto finish;
+    }
+
+    if (SecStaticCodeCreateWithPath(absURL,
                                     kSecCSDefaultFlags,
                                     &staticCodeRef) != errSecSuccess ||
         (staticCodeRef == NULL)) {
         OSKextLogMemError();
         goto finish;
     }
+
+    context = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                        &kCFTypeDictionaryKeyCallBacks,
+                                        &kCFTypeDictionaryValueCallBacks);
+    if (!context) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(context, kSigningContextURLKey, absURL);
+    CFDictionarySetValue(context, kSigningContextFingerprintKey, fingerprint);
+    CFDictionarySetValue(context, kSigningContextCodeKey, staticCodeRef);
+
+    pthread_mutex_lock(&sSigningContextLock);
+    if (!sSigningContexts) {
+        sSigningContexts = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                            &kCFTypeDictionaryKeyCallBacks,
+                                            &kCFTypeDictionaryValueCallBacks);
+    }
+    if (sSigningContexts) {
+        if (CFDictionaryGetCount(sSigningContexts) >= kMaxSigningContexts) {
+            CFDictionaryRemoveAllValues(sSigningContexts);
+        }
+        CFDictionarySetValue(sSigningContexts, kextPath, context);
+    }
+    pthread_mutex_unlock(&sSigningContextLock);
+
+finish:
+    SAFE_RELEASE(fingerprint);
+    SAFE_RELEASE(staticCodeRef);
+    return context;
+}
+
+/*******************************************************************************
+ * getSigningContextInfo() - the kSecCSSigningInformation dictionary for a
+ * signing context, or NULL if it can't be read.
+ *******************************************************************************/
+static CFDictionaryRef getSigningContextInfo(CFDictionaryRef signingContext)
+{
+    CFDictionaryRef     information     = NULL;  // do NOT release
+    CFDictionaryRef     newInformation  = NULL;  // must release
+    SecStaticCodeRef    code            = NULL;  // do NOT release
+
+    pthread_mutex_lock(&sSigningContextLock);
+    information = CFDictionaryGetValue(signingContext, kSigningContextInfoKey);
+    pthread_mutex_unlock(&sSigningContextLock);
+    if (information) {
+        goto finish;
+    }
+
+    code = (SecStaticCodeRef)CFDictionaryGetValue(signingContext,
+                                                  kSigningContextCodeKey);
+    if (SecCodeCopySigningInformation(code,
+                                      kSecCSSigningInformation,
+                                      &newInformation) != noErr ||
+        !newInformation) {
+        goto finish;
+    }
+
+    pthread_mutex_lock(&sSigningContextLock);
+    information = CFDictionaryGetValue(signingContext, kSigningContextInfoKey);
+    if (!information) {
+        CFDictionarySetValue((CFMutableDictionaryRef)signingContext,
+                             kSigningContextInfoKey, newInformation);
+        information = newInformation;
+    }
+    pthread_mutex_unlock(&sSigningContextLock);
+
+finish:
+    SAFE_RELEASE(newInformation);
+    return information;
+}
+
+/*******************************************************************************
+ * getSigningContextAdhocHash() - the ad-hoc signature hash for a signing
+ * context, computed on first use.  getAdhocSignatureHash() attaches a detached
+ * signature to the code object it works on, so it keeps its own rather than
+ * the shared one.
+ *******************************************************************************/
+static CFStringRef getSigningContextAdhocHash(CFDictionaryRef signingContext)
+{
+    CFTypeRef       hashValue       = NULL;  // do NOT release
+    CFStringRef     newHash         = NULL;  // must release
+    char *          hashCString     = NULL;  // must free
+
+    pthread_mutex_lock(&sSigningContextLock);
+    hashValue = CFDictionaryGetValue(signingContext, kSigningContextAdhocHashKey);
+    pthread_mutex_unlock(&sSigningContextLock);
+    if (hashValue) {
+        goto finish;
+    }
+
+    getAdhocSignatureHash(CFDictionaryGetValue(signingContext,
+                                               kSigningContextURLKey),
+                          &hashCString);
+    if (hashCString) {
+        newHash = CFStringCreateWithCString(kCFAllocatorDefault,
+                                            hashCString,
+                                            kCFStringEncodingUTF8);
+        if (!newHash) {
+            OSKextLogMemError();
+            goto finish;
+        }
+    }
+
+    pthread_mutex_lock(&sSigningContextLock);
+    hashValue = CFDictionaryGetValue(signingContext, kSigningContextAdhocHashKey);
+    if (!hashValue) {
+        /* kCFNull records that the hash couldn't be made */
+        hashValue = newHash ? (CFTypeRef)newHash : (CFTypeRef)kCFNull;
+        CFDictionarySetValue((CFMutableDictionaryRef)signingContext,
+                             kSigningContextAdhocHashKey, hashValue);
+    }
+    pthread_mutex_unlock(&sSigningContextLock);
+
+finish:
+    SAFE_RELEASE(newHash);
+    SAFE_FREE(hashCString);
+    return (hashValue && hashValue != kCFNull) ? (CFStringRef)hashValue : NULL;
+}
+
+/*******************************************************************************
+ * checkRootCertificateIsApple() - check if the root certificate of the kext
+ *  is issued by Apple
+ *  <rdar://problem/12435992> 
+ *******************************************************************************/
+static OSStatus checkRootCertificateIsApple(CFStringRef bundleID,
+                                            CFDictionaryRef signingContext)
+{
+    OSStatus                result          = -1;
+    SecStaticCodeRef        staticCodeRef   = NULL;   // do NOT release
+    SecRequirementRef       requirementRef  = NULL;   // must release
+    CFStringRef             requirementsString;
+    
+    if (signingContext == NULL) {
+        return result;
+    }
+    
+    staticCodeRef = (SecStaticCodeRef)CFDictionaryGetValue(signingContext,
+                                                           kSigningContextCodeKey);
     
     /* set up correct requirement string */
-    myCFString = OSKextGetIdentifier(aKext);
-    if (CFStringHasPrefix(myCFString, __kOSKextApplePrefix)) {
+    if (bundleID && CFStringHasPrefix(bundleID, __kOSKextApplePrefix)) {
         requirementsString = CFSTR("anchor apple");
     }
     else {
@@ -185,12 +462,12 @@ static OSStatus checkRootCertificateIsApple(OSKextRef aKext)
         OSKextLogCFString(NULL,
                           kOSKextLogErrorLevel | kOSKextLogLoadFlag,
                           CFSTR("Invalid signature %ld for kext %@"),
-                          (long)result, aKext);
+                          (long)result,
+                          CFDictionaryGetValue(signingContext,
+                                               kSigningContextURLKey));
     }
     
 finish:
-    SAFE_RELEASE(kextURL);
-    SAFE_RELEASE(staticCodeRef);
     SAFE_RELEASE(requirementRef);
     
     return result;
@@ -683,22 +960,18 @@ finish:
 }
 
 /*******************************************************************************
- * copyCDHash() - copy the SHA-1 hash of the code
+ * copyCDHash() - copy the SHA-1 hash of the code from its signing information
  *  <rdar://13646260> 
  *  Note: the caller must release the created CFStringRef
  *******************************************************************************/
-static CFStringRef copyCDHash(SecStaticCodeRef code)
+static CFStringRef copyCDHash(CFDictionaryRef signingInfo)
 {
-    CFDictionaryRef signingInfo     = NULL; // must release
     char *          tempBufPtr      = NULL; // free
     const UInt8 *   hashDataPtr     = NULL; // do not free
     CFDataRef       cdhash          = NULL; // do not release
     CFStringRef     hash            = NULL; // do not release
     CFIndex         hashDataLen     = 0;
     
-    SecCodeCopySigningInformation(code,
-                                  kSecCSDefaultFlags,
-                                  &signingInfo);
     if (!signingInfo) {
         goto finish;
     }
@@ -730,7 +1003,6 @@ static CFStringRef copyCDHash(SecStaticCodeRef code)
     
 finish:
     SAFE_FREE(tempBufPtr);
-    SAFE_RELEASE(signingInfo);
     return hash;
 }
 
@@ -743,41 +1015,29 @@ finish:
  *  <rdar://13646260> 
  *  Note: the caller must release the created CFStringRefs
  *******************************************************************************/
-static void copySigningInfo(CFURLRef kextURL,
+static void copySigningInfo(CFDictionaryRef signingContext,
                             CFStringRef* cdhash,
                             CFStringRef* teamId,
                             CFStringRef* subjectCN,
                             CFStringRef* issuerCN)
 {
-    if (!kextURL) {
+    if (!signingContext) {
         return;
     }
     
-    SecStaticCodeRef    code                = NULL; // must release
-    CFDictionaryRef     information         = NULL; // must release
+    CFDictionaryRef     information         = NULL; // do not release
     
     SecCertificateRef   issuerCertificate   = NULL; // do not release
     CFArrayRef          certificateChain    = NULL; // do not release
-    OSStatus            status;
     CFIndex             count;
     
-    if (SecStaticCodeCreateWithPath(kextURL,
-                                    kSecCSDefaultFlags,
-                                    &code) != 0
-        || (code == NULL)) {
-        OSKextLogMemError();
+    information = getSigningContextInfo(signingContext);
+    if (!information) {
         goto finish;
     }
     
     if (cdhash) {
-        *cdhash = copyCDHash(code);
-    }
-    
-    status = SecCodeCopySigningInformation(code,
-                                           kSecCSSigningInformation,
-                                           &information);
-    if (status != noErr) {
-        goto finish;
+        *cdhash = copyCDHash(information);
     }
     
     // a CFArrayRef array of SecCertificateRef objects
@@ -810,9 +1070,6 @@ static void copySigningInfo(CFURLRef kextURL,
     }
     
 finish:
-    SAFE_RELEASE(code);
-    SAFE_RELEASE(information);
-    
     return;
 }
 
@@ -822,9 +1079,9 @@ finish:
  *  <rdar://13646260> 
  *  Note: the caller must release the created CFArrayRef
  *******************************************************************************/
-static CFArrayRef copySubjectCNArray(CFURLRef kextURL)
+static CFArrayRef copySubjectCNArray(CFDictionaryRef signingContext)
 {
-    if (!kextURL) {
+    if (!signingContext) {
         return NULL;
     }
     
@@ -832,10 +1089,8 @@ static CFArrayRef copySubjectCNArray(CFURLRef kextURL)
     CFArrayRef          certificateChain    = NULL; // do not release
     SecCertificateRef   certificate         = NULL; // do not release
     
-    SecStaticCodeRef    code                = NULL; // must release
-    CFDictionaryRef     information         = NULL; // must release
+    CFDictionaryRef     information         = NULL; // do not release
     
-    OSStatus            status;
     CFIndex             count;
     
     subjectCNArray = CFArrayCreateMutable(kCFAllocatorDefault,
@@ -845,18 +1100,8 @@ static CFArrayRef copySubjectCNArray(CFURLRef kextURL)
         goto finish;
     }
     
-    if (SecStaticCodeCreateWithPath(kextURL,
-                                    kSecCSDefaultFlags,
-                                    &code) != 0
-        || (code == NULL)) {
-        OSKextLogMemError();
-        goto finish;
-    }
-    
-    status = SecCodeCopySigningInformation(code,
-                                           kSecCSSigningInformation,
-                                           &information);
-    if (status != noErr) {
+    information = getSigningContextInfo(signingContext);
+    if (!information) {
         goto finish;
     }
     
@@ -882,9 +1127,6 @@ static CFArrayRef copySubjectCNArray(CFURLRef kextURL)
     }
     
 finish:
-    SAFE_RELEASE(code);
-    SAFE_RELEASE(information);
-    
     return subjectCNArray;
 }
 
@@ -894,9 +1136,10 @@ finish:
  *  <rdar://problem/12435992> 
  *******************************************************************************/
 
-static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
+static void filterKextLoadForMT(CFDictionaryRef kextSnapshot,
+                                CFMutableArrayRef *kextList)
 {
-    if (aKext == NULL || kextList == NULL)
+    if (kextSnapshot == NULL || kextList == NULL)
         return;
     
     CFStringRef     versionString;                // do not release
@@ -904,22 +1147,20 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
     CFStringRef     kextSigningCategory = NULL;   // do not release
     CFBooleanRef    isFat               = kCFBooleanFalse; // do not release
     CFBooleanRef    isSigned            = kCFBooleanFalse; // do not release
+    CFURLRef        kextURL             = NULL;   // do not release
+    CFStringRef     kextPath            = NULL;   // do not release
+    CFStringRef     archString          = NULL;   // do not release
     
-    CFURLRef        kextURL             = NULL;   // must release
-    CFStringRef     kextPath            = NULL;   // must release
     CFStringRef     filename            = NULL;   // must release
     CFStringRef     hashString          = NULL;   // must release
-    CFStringRef     archString          = NULL;   // must release
     CFStringRef     teamId              = NULL;   // must release
     CFStringRef     subjectCN           = NULL;   // must release
     CFStringRef     issuerCN            = NULL;   // must release
     
-    SecStaticCodeRef        code        = NULL;   // must release
-    CFDictionaryRef         information = NULL;   // must release
+    CFDictionaryRef         signingContext = NULL; // must release
+    CFDictionaryRef         information = NULL;   // do not release
     CFMutableDictionaryRef  kextDict    = NULL;   // must release
     
-    char *          hashCString         = NULL;   // must free
-
     OSStatus status = noErr;
     
     /* do not message trace this if boot-args has debug set */
@@ -927,36 +1168,25 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
         return;
     }
     
-    kextURL = CFURLCopyAbsoluteURL(OSKextGetURL(aKext));
-    if (!kextURL) {
-        OSKextLogMemError();
-        goto finish;
-    }
-    kextPath = CFURLCopyFileSystemPath(kextURL, kCFURLPOSIXPathStyle);
-    if (!kextPath) {
-        OSKextLogMemError();
-        goto finish;
-    }
-    
-    versionString   = OSKextGetValueForInfoDictionaryKey(aKext,
-                                                         kCFBundleVersionKey);
-    bundleIDString  = OSKextGetValueForInfoDictionaryKey(aKext,
-                                                         kCFBundleIdentifierKey);    
+    kextURL = CFDictionaryGetValue(kextSnapshot, kKextSnapshotURLKey);
+    kextPath = CFDictionaryGetValue(kextSnapshot, kKextSnapshotPathKey);
+    versionString   = CFDictionaryGetValue(kextSnapshot,
+                                           kKextSnapshotVersionKey);
+    bundleIDString  = CFDictionaryGetValue(kextSnapshot,
+                                           kKextSnapshotIdentifierKey);
     filename = CFURLCopyLastPathComponent(kextURL);
     
-    archString = createArchitectureList(aKext, &isFat);
+    archString = CFDictionaryGetValue(kextSnapshot, kMTSnapshotArchsKey);
+    if (CFDictionaryContainsKey(kextSnapshot, kMTSnapshotFatKey)) {
+        isFat = CFDictionaryGetValue(kextSnapshot, kMTSnapshotFatKey);
+    }
     
-    if (SecStaticCodeCreateWithPath(kextURL,
-                                    kSecCSDefaultFlags,
-                                    &code) != 0
-        || (code == NULL)) {
-        OSKextLogMemError();
+    signingContext = copySigningContext(kextSnapshot);
+    if (!signingContext) {
         goto finish;
     }
-    status = SecCodeCopySigningInformation(code,
-                                           kSecCSSigningInformation,
-                                           &information);
-    if (status != noErr) {
+    information = getSigningContextInfo(signingContext);
+    if (!information) {
         goto finish;
     }
     
@@ -966,23 +1196,22 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
          * A hash of the kext is generated for data collection. */
         kextSigningCategory = CFSTR(kUnsignedKext);
         
-        getAdhocSignatureHash(kextURL, &hashCString);
-        if (hashCString) {
-            hashString = CFStringCreateWithCString(kCFAllocatorDefault,
-                                                   hashCString,
-                                                   kCFStringEncodingUTF8);
+        hashString = getSigningContextAdhocHash(signingContext);
+        if (hashString) {
+            CFRetain(hashString);
         }
     }
     else {
-        CFStringRef myCFString = NULL; // do not release
-        myCFString = OSKextGetIdentifier(aKext);
-        status = checkKextSignature(aKext, true, false);
-        if (CFStringHasPrefix(myCFString, __kOSKextApplePrefix)) {
+        status = checkKextSnapshotSignature(kextSnapshot, false);
+        if (status != noErr && isKextSnapshotInExceptionList(kextSnapshot)) {
+            status = noErr;
+        }
+        if (isAppleKextSnapshot(kextSnapshot)) {
             if (status == noErr) {
                 /* This is a signed Apple kext, with an Apple root certificate.
                  * There is no need to retrieve additional signing information */
                 kextSigningCategory = CFSTR(kAppleKextWithAppleRoot);
-                copySigningInfo(kextURL,
+                copySigningInfo(signingContext,
                                 &hashString,
                                 NULL,
                                 NULL,
@@ -993,13 +1222,13 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
                  * This should not happen, so it is better to flag it as unsigned for
                  * collection purpose. */
                 kextSigningCategory = CFSTR(kUnsignedKext);
-                copySigningInfo(kextURL,
+                copySigningInfo(signingContext,
                                 &hashString,
                                 &teamId,
                                 NULL,
                                 &issuerCN);
                 CFArrayRef subjectCNArray = NULL; // must release
-                subjectCNArray = copySubjectCNArray(kextURL);
+                subjectCNArray = copySubjectCNArray(signingContext);
                 if (subjectCNArray) {
                     subjectCN = CFStringCreateByCombiningStrings(kCFAllocatorDefault,
                                                                  subjectCNArray,
@@ -1012,7 +1241,7 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
             if (status == noErr) {
                 /* This 3rd-party kext is signed with a devid+ kext certificate */
                 kextSigningCategory = CFSTR(k3rdPartyKextWithDevIdPlus);
-                copySigningInfo(kextURL,
+                copySigningInfo(signingContext,
                                 &hashString,
                                 &teamId,
                                 &subjectCN,
@@ -1021,14 +1250,15 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
             else if (status == CSSMERR_TP_CERT_REVOKED) {
                 /* This 3rd-party kext is signed with a revoked devid+ kext certificate */
                 kextSigningCategory = CFSTR(k3rdPartyKextWithRevokedDevIdPlus);
-                copySigningInfo(kextURL,
+                copySigningInfo(signingContext,
                                 &hashString,
                                 &teamId,
                                 &subjectCN,
                                 &issuerCN);
             }
             else {
-                status = checkRootCertificateIsApple(aKext);
+                status = checkRootCertificateIsApple(bundleIDString,
+                                                     signingContext);
                 if (status == noErr) {
                     /* This 3rd-party kext is not signed with a devid+ certificate,
                      * but uses an Apple root certificate. */
@@ -1036,13 +1266,13 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
                     /* The certificates may not have the expected format.
                      * Attempt to get the information if present, and also
                      * retrieve the subject cn of every certificate in the chain. */
-                    copySigningInfo(kextURL,
+                    copySigningInfo(signingContext,
                                     &hashString,
                                     &teamId,
                                     NULL,
                                     &issuerCN);
                     CFArrayRef subjectCNArray = NULL; // must release
-                    subjectCNArray = copySubjectCNArray(kextURL);
+                    subjectCNArray = copySubjectCNArray(signingContext);
                     if (subjectCNArray) {
                         subjectCN = CFStringCreateByCombiningStrings(kCFAllocatorDefault,
                                                                      subjectCNArray,
@@ -1056,7 +1286,7 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
                     kextSigningCategory = CFSTR(k3rdPartyKextWithoutAppleRoot);
                     /* The certificates may not have the expected format.
                      * The subjectcn, issuercn and teamid must not be logged. */
-                    copySigningInfo(kextURL,
+                    copySigningInfo(signingContext,
                                     &hashString,
                                     NULL,
                                     NULL,
@@ -1139,78 +1369,398 @@ static void filterKextLoadForMT(OSKextRef aKext, CFMutableArrayRef *kextList)
     CFArrayAppendValue(*kextList, kextDict);
     
 finish:
-    SAFE_FREE(hashCString);
-    SAFE_RELEASE(kextURL);
-    SAFE_RELEASE(kextPath);
     SAFE_RELEASE(filename);
     SAFE_RELEASE(hashString);
     SAFE_RELEASE(kextDict);
-    SAFE_RELEASE(archString);
     SAFE_RELEASE(teamId);
     SAFE_RELEASE(subjectCN);
     SAFE_RELEASE(issuerCN);
-    SAFE_RELEASE(code);
-    SAFE_RELEASE(information);
+    SAFE_RELEASE(signingContext);
     return;
 }
 
 /*******************************************************************************
- * recordKextLoadListForMT() - record the list of loaded kexts
- *  <rdar://problem/12435992> 
+ * Message trace collector.
+ *
+ * Gathering the message trace information for a kext means checking its
+ * signature and digging through its certificates, so recordKextLoadListForMT()
+ * only snapshots the kexts and queues the snapshots; the work is done on
+ * sMTQueue, which never touches an OSKextRef since the caller may still be
+ * using them (and changing the OSKext architecture).  Kexts
+ * queued before a drain runs are posted together in one note.
+ *
+ * With MT_TRACE_ONCE_PER_BOOT set, each kext is traced once per boot rather
+ * than on every load, so its signing information is worked out only once:
+ * the keys (executable UUID, or bundle ID and version for codeless kexts) of
+ * kexts already posted are kept in kMTPostedKeysPath, which lives in
+ * /var/run and so doesn't survive a reboot.  Two tools racing to update it
+ * can at worst post a kext twice, which kextd's loaded kext plist already
+ * tolerates.  With it clear, every load is traced.
+ *
+ * At exit the tools wait for everything queued to be posted, so no trace is
+ * dropped; the load itself has already been reported by then.
  *******************************************************************************/
-void
-recordKextLoadListForMT(CFArrayRef kextList)
+#define MT_TRACE_ONCE_PER_BOOT  1
+
+#define kMTPostedKeysPath   _PATH_VARRUN "com.apple.kext_tools.mtkeys.plist"
+
+/* Added to a kext snapshot for message tracing.
+ */
+#define kMTSnapshotKeyKey   CFSTR("MTKey")
+#define kMTSnapshotArchsKey CFSTR("Archs")
+#define kMTSnapshotFatKey   CFSTR("IsFat")
+
+static dispatch_queue_t         sMTQueue        = NULL;  // do NOT release
+static dispatch_group_t         sMTGroup        = NULL;  // do NOT release
+static CFMutableArrayRef        sMTPendingKexts = NULL;  // snapshots; only on sMTQueue
+#if MT_TRACE_ONCE_PER_BOOT
+static CFMutableSetRef          sMTPostedKeys   = NULL;  // only on sMTQueue
+#endif
+static Boolean                  sMTDrainPending = false; // only on sMTQueue
+
+/*******************************************************************************
+ * copyKextMTKey() - the key a kext is traced under.  Call on the thread that
+ * owns aKext.
+ *  Note: the caller must release the created CFStringRef
+ *******************************************************************************/
+static CFStringRef copyKextMTKey(OSKextRef aKext)
+{
+    CFStringRef     result      = NULL;  // returned
+    CFDataRef       uuidData    = NULL;  // must release
+    CFStringRef     versionString;       // do not release
+
+    uuidData = OSKextCopyUUIDForArchitecture(aKext, NULL);
+    if (uuidData && CFDataGetLength(uuidData) == sizeof(uuid_t)) {
+        uuid_string_t   uuidString;
+
+        uuid_unparse(CFDataGetBytePtr(uuidData), uuidString);
+        result = CFStringCreateWithCString(kCFAllocatorDefault, uuidString,
+                                           kCFStringEncodingUTF8);
+    }
+    else {
+        versionString = OSKextGetValueForInfoDictionaryKey(aKext,
+                                                           kCFBundleVersionKey);
+        result = CFStringCreateWithFormat(kCFAllocatorDefault, NULL,
+                                          CFSTR("%@-%@"),
+                                          OSKextGetIdentifier(aKext),
+                                          versionString);
+    }
+    SAFE_RELEASE(uuidData);
+    return result;
+}
+
+/*******************************************************************************
+ * createKextMTSnapshot() - snapshot aKext with what sMTQueue needs to trace
+ * it.  Call on the thread that owns aKext.
+ *  Note: the caller must release the created CFDictionaryRef
+ *******************************************************************************/
+static CFDictionaryRef createKextMTSnapshot(OSKextRef aKext)
+{
+    CFMutableDictionaryRef  result      = NULL;  // returned
+    CFDictionaryRef         snapshot    = NULL;  // must release
+    CFStringRef             kextKey     = NULL;  // must release
+    CFStringRef             archString  = NULL;  // must release
+    CFBooleanRef            isFat       = kCFBooleanFalse;  // do not release
+
+    snapshot = createKextSnapshot(aKext, /* kextURL */ NULL);
+    kextKey = copyKextMTKey(aKext);
+    if (!snapshot || !kextKey) {
+        goto finish;
+    }
+    result = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, snapshot);
+    if (!result) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(result, kMTSnapshotKeyKey, kextKey);
+    archString = createArchitectureList(aKext, &isFat);
+    if (archString) {
+        CFDictionarySetValue(result, kMTSnapshotArchsKey, archString);
+    }
+    CFDictionarySetValue(result, kMTSnapshotFatKey, isFat);
+
+finish:
+    SAFE_RELEASE(snapshot);
+    SAFE_RELEASE(kextKey);
+    SAFE_RELEASE(archString);
+    return result;
+}
+
+#if MT_TRACE_ONCE_PER_BOOT
+/*******************************************************************************
+ * loadMTPostedKeys() - read the keys posted so far this boot on first use.
+ *******************************************************************************/
+static void loadMTPostedKeys(void)
 {
+    CFDataRef           keysData    = NULL;  // must release
+    CFPropertyListRef   keysPlist   = NULL;  // must release
     CFIndex             count, i;
-    CFMutableArrayRef   kextsToMessageTrace = NULL; //must release
-    OSKextRef           aKext;                      //do not release
-    
-    if (kextList && (count = CFArrayGetCount(kextList))) {
-        kextsToMessageTrace = CFArrayCreateMutable(kCFAllocatorDefault,
-                                                  CFArrayGetCount(kextList),
-                                                  &kCFTypeArrayCallBacks);
-        if (kextsToMessageTrace) {
-            for (i = 0; i < count; i ++) {                
-                aKext = (OSKextRef)CFArrayGetValueAtIndex(kextList, i);
-                filterKextLoadForMT(aKext, &kextsToMessageTrace);
-            }
-            if (CFArrayGetCount(kextsToMessageTrace)) {
-                postNoteAboutKextLoadsMT(CFSTR("Loaded Kext Notification"),
-                                         kextsToMessageTrace);
-            }
-            SAFE_RELEASE(kextsToMessageTrace);
+
+    if (sMTPostedKeys) {
+        return;
+    }
+    sMTPostedKeys = CFSetCreateMutable(kCFAllocatorDefault, 0,
+                                       &kCFTypeSetCallBacks);
+    if (!sMTPostedKeys) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    if (!createCFDataFromFile(&keysData, kMTPostedKeysPath)) {
+        goto finish;
+    }
+    keysPlist = CFPropertyListCreateWithData(kCFAllocatorDefault, keysData,
+                                             kCFPropertyListImmutable,
+                                             NULL, NULL);
+    if (!keysPlist || CFGetTypeID(keysPlist) != CFArrayGetTypeID()) {
+        goto finish;
+    }
+    count = CFArrayGetCount(keysPlist);
+    for (i = 0; i < count; i++) {
+        CFTypeRef key = CFArrayGetValueAtIndex(keysPlist, i);
+        if (CFGetTypeID(key) == CFStringGetTypeID()) {
+            CFSetAddValue(sMTPostedKeys, key);
         }
     }
+
+finish:
+    SAFE_RELEASE(keysData);
+    SAFE_RELEASE(keysPlist);
 }
 
 /*******************************************************************************
- * recordKextLoadForMT() - record the loaded kext
- *  <rdar://problem/12435992>
+ * saveMTPostedKeys() - write out the keys posted so far this boot.
  *******************************************************************************/
-void recordKextLoadForMT(OSKextRef aKext)
+static void saveMTPostedKeys(void)
 {
-    CFMutableArrayRef myArray = NULL; // must release
-    
-    if (!aKext)
-        return;
-    
-    myArray = CFArrayCreateMutable(kCFAllocatorDefault,
-                                   1,
-                                   &kCFTypeArrayCallBacks);
-    if (myArray) {
-        CFArrayAppendValue(myArray, aKext);
-        recordKextLoadListForMT(myArray);
-        SAFE_RELEASE(myArray);
+    CFIndex             count;
+    const void       ** keys        = NULL;  // must free
+    CFArrayRef          keysArray   = NULL;  // must release
+    CFDataRef           keysData    = NULL;  // must release
+    int                 fd          = -1;
+    char                tmpPath[PATH_MAX];
+
+    tmpPath[0] = 0x00;
+    if (!sMTPostedKeys || geteuid() != 0) {
+        goto finish;
+    }
+
+    count = CFSetGetCount(sMTPostedKeys);
+    keys = malloc(count * sizeof(*keys));
+    if (!keys) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFSetGetValues(sMTPostedKeys, keys);
+    keysArray = CFArrayCreate(kCFAllocatorDefault, keys, count,
+                              &kCFTypeArrayCallBacks);
+    if (!keysArray) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    keysData = CFPropertyListCreateData(kCFAllocatorDefault, keysArray,
+                                        kCFPropertyListBinaryFormat_v1_0,
+                                        0, NULL);
+    if (!keysData) {
+        OSKextLogMemError();
+        goto finish;
     }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", kMTPostedKeysPath);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        tmpPath[0] = 0x00;
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(keysData),
+                    CFDataGetLength(keysData)) != EX_OK) {
+        goto finish;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmpPath, kMTPostedKeysPath) != 0) {
+        goto finish;
+    }
+    tmpPath[0] = 0x00;
+
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    SAFE_FREE(keys);
+    SAFE_RELEASE(keysArray);
+    SAFE_RELEASE(keysData);
 }
+#endif /* MT_TRACE_ONCE_PER_BOOT */
 
 /*******************************************************************************
- * checkSignaturesOfDependents() - check the signature for dependents of kext.
- * Note - this also includes plugins.
+ * drainKextLoadsForMT() - trace the queued kexts (those not yet traced this
+ * boot, with MT_TRACE_ONCE_PER_BOOT) and post them in a single note.  Runs on
+ * sMTQueue.
  *******************************************************************************/
-OSStatus checkSignaturesOfDependents(OSKextRef theKext,
-                                     Boolean checkExceptionList,
-                                     Boolean earlyBoot)
+static void drainKextLoadsForMT(void)
+{
+    CFMutableArrayRef   kextsToMessageTrace = NULL; // must release
+    CFIndex             count, i;
+#if MT_TRACE_ONCE_PER_BOOT
+    CFStringRef         kextKey             = NULL; // do not release
+    Boolean             addedKeys           = false;
+#endif
+
+    sMTDrainPending = false;
+
+    kextsToMessageTrace = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+                                               &kCFTypeArrayCallBacks);
+    if (!kextsToMessageTrace) {
+        OSKextLogMemError();
+        goto finish;
+    }
+#if MT_TRACE_ONCE_PER_BOOT
+    loadMTPostedKeys();
+    if (!sMTPostedKeys) {
+        goto finish;
+    }
+#endif
+
+    count = CFArrayGetCount(sMTPendingKexts);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef kextSnapshot = CFArrayGetValueAtIndex(sMTPendingKexts, i);
+
+#if MT_TRACE_ONCE_PER_BOOT
+        kextKey = CFDictionaryGetValue(kextSnapshot, kMTSnapshotKeyKey);
+        if (!kextKey || CFSetContainsValue(sMTPostedKeys, kextKey)) {
+            continue;
+        }
+        CFSetAddValue(sMTPostedKeys, kextKey);
+        addedKeys = true;
+#endif
+        filterKextLoadForMT(kextSnapshot, &kextsToMessageTrace);
+    }
+
+    if (CFArrayGetCount(kextsToMessageTrace)) {
+        postNoteAboutKextLoadsMT(CFSTR("Loaded Kext Notification"),
+                                 kextsToMessageTrace);
+    }
+#if MT_TRACE_ONCE_PER_BOOT
+    if (addedKeys) {
+        saveMTPostedKeys();
+    }
+#endif
+
+finish:
+    CFArrayRemoveAllValues(sMTPendingKexts);
+    SAFE_RELEASE(kextsToMessageTrace);
+}
+
+/*******************************************************************************
+ * waitForKextLoadsForMT() - post every queued message trace before the tool
+ * exits.  The queue runs at background priority, which can be throttled
+ * hard, so it is moved to default priority first.  Registered with atexit().
+ *******************************************************************************/
+static void waitForKextLoadsForMT(void)
+{
+    dispatch_set_target_queue(sMTQueue,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+    dispatch_group_wait(sMTGroup, DISPATCH_TIME_FOREVER);
+}
+
+/*******************************************************************************
+ * recordKextLoadListForMT() - record the list of loaded kexts
+ *  <rdar://problem/12435992> 
+ *******************************************************************************/
+void
+recordKextLoadListForMT(CFArrayRef kextList)
+{
+    static dispatch_once_t  onceToken;
+    CFMutableArrayRef       snapshots   = NULL;  // released on sMTQueue
+    CFIndex                 count, i;
+
+    if (!kextList || !CFArrayGetCount(kextList)) {
+        return;
+    }
+    /* do not message trace this if boot-args has debug set */
+    if (isDebugSetInBootargs()) {
+        return;
+    }
+
+    dispatch_once(&onceToken, ^ {
+        sMTQueue = dispatch_queue_create("com.apple.kext_tools.mt",
+                                         DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(sMTQueue,
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        sMTGroup = dispatch_group_create();
+        sMTPendingKexts = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+                                               &kCFTypeArrayCallBacks);
+        atexit(waitForKextLoadsForMT);
+    });
+    if (!sMTQueue || !sMTGroup || !sMTPendingKexts) {
+        OSKextLogMemError();
+        return;
+    }
+
+    snapshots = CFArrayCreateMutable(kCFAllocatorDefault, 0,
+                                     &kCFTypeArrayCallBacks);
+    if (!snapshots) {
+        OSKextLogMemError();
+        return;
+    }
+    count = CFArrayGetCount(kextList);
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef kextSnapshot = createKextMTSnapshot(
+            (OSKextRef)CFArrayGetValueAtIndex(kextList, i));
+
+        if (kextSnapshot) {
+            CFArrayAppendValue(snapshots, kextSnapshot);
+            CFRelease(kextSnapshot);
+        }
+    }
+    /* load the exception lists here; they are read through OSKext */
+    isInExceptionList(/* kext */ NULL, /* kextURL */ NULL, true);
+
+    dispatch_group_async(sMTGroup, sMTQueue, ^ {
+        CFArrayAppendArray(sMTPendingKexts, snapshots, RANGE_ALL(snapshots));
+        CFRelease(snapshots);
+        if (!sMTDrainPending) {
+            sMTDrainPending = true;
+            dispatch_group_async(sMTGroup, sMTQueue, ^ {
+                drainKextLoadsForMT();
+            });
+        }
+    });
+}
+
+/*******************************************************************************
+ * recordKextLoadForMT() - record the loaded kext
+ *  <rdar://problem/12435992>
+ *******************************************************************************/
+void recordKextLoadForMT(OSKextRef aKext)
+{
+    CFMutableArrayRef myArray = NULL; // must release
+    
+    if (!aKext)
+        return;
+    
+    myArray = CFArrayCreateMutable(kCFAllocatorDefault,
+                                   1,
+                                   &kCFTypeArrayCallBacks);
+    if (myArray) {
+        CFArrayAppendValue(myArray, aKext);
+        recordKextLoadListForMT(myArray);
+        SAFE_RELEASE(myArray);
+    }
+}
+
+/*******************************************************************************
+ * checkSignaturesOfDependents() - check the signature for dependents of kext.
+ * Note - this also includes plugins.
+ *******************************************************************************/
+OSStatus checkSignaturesOfDependents(OSKextRef theKext,
+                                     Boolean checkExceptionList,
+                                     Boolean earlyBoot)
 {
     OSStatus        result          = errSecCSSignatureFailed;
     CFIndex         count, i;
@@ -1266,34 +1816,518 @@ finish:
 }
 
 /*******************************************************************************
- * checkKextSignature() - check the signature for given kext.
+ * Signature verification cache.
+ *
+ * SecStaticCodeCheckValidity() hashes every file of a kext, and kextcache,
+ * kextload and kextd check the same unchanged kexts over and over.  Passing
+ * checks are remembered in kSignatureCachePath by kext path, along with the
+ * kext's CDHash and a fingerprint (inode, size and change time) of every
+ * file and directory in its bundle; an entry is reused only when all of
+ * those still match.  Change times are used because utimes() can't set them
+ * back.  The cache is dropped whenever the exclude list changes, and entries
+ * verified with revocation checking stop counting as such when the
+ * revocation databases change; both are rechecked at most once a second, so
+ * kextd notices them too.  Failures are never cached.  Only root writes the
+ * file.
  *******************************************************************************/
-OSStatus checkKextSignature(OSKextRef aKext,
-                            Boolean checkExceptionList,
-                            Boolean earlyBoot)
+#define kSignatureCachePath \
+    _kOSKextCachesRootFolder "/KextSignatureCache.plist"
+#define kSignatureCacheVersion          2
+#define kSigCacheStampInterval          1   // seconds
+
+#define kSigCacheVersionKey             CFSTR("Version")
+#define kSigCacheExcludeListKey         CFSTR("ExcludeList")
+#define kSigCacheRevocationKey          CFSTR("Revocation")
+#define kSigCacheEntriesKey             CFSTR("Entries")
+#define kSigCacheFingerprintKey         CFSTR("Fingerprint")
+#define kSigCacheCDHashKey              CFSTR("CDHash")
+#define kSigCacheRevocationCheckedKey   CFSTR("RevocationChecked")
+
+static const char * sExcludeListStampPaths[] = {
+    "/System/Library/Extensions/AppleKextExcludeList.kext/Contents/Info.plist",
+    NULL
+};
+static const char * sRevocationStampPaths[] = {
+    "/private/var/db/crls/crlcache.db",
+    "/private/var/db/crls/ocspcache.db",
+    NULL
+};
+
+static pthread_mutex_t          sSigCacheLock           = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef   sSigCacheEntries        = NULL; // do NOT release
+static CFStringRef              sSigCacheExcludeStamp   = NULL; // do NOT release
+static CFStringRef              sSigCacheRevocationStamp = NULL; // do NOT release
+static time_t                   sSigCacheStampTime      = 0;
+static Boolean                  sSigCacheDirty          = false;
+
+/*******************************************************************************
+ * appendFileStamp() - append "inode:size:ctime;" for thePath, or "-;" if it
+ * does not exist.
+ *******************************************************************************/
+static void appendFileStamp(CFMutableStringRef theStamp, const char * thePath)
+{
+    struct stat     statBuf;
+
+    if (stat(thePath, &statBuf) != 0) {
+        CFStringAppendCString(theStamp, "-;", kCFStringEncodingUTF8);
+        return;
+    }
+    CFStringAppendFormat(theStamp, NULL, CFSTR("%llu:%lld:%ld.%09ld;"),
+                         (unsigned long long)statBuf.st_ino,
+                         (long long)statBuf.st_size,
+                         (long)statBuf.st_ctimespec.tv_sec,
+                         (long)statBuf.st_ctimespec.tv_nsec);
+}
+
+/*******************************************************************************
+ * copyStampForPaths() - fingerprint a NULL-terminated list of paths.
+ *  Note: the caller must release the created CFStringRef
+ *******************************************************************************/
+static CFStringRef copyStampForPaths(const char ** thePaths)
+{
+    CFMutableStringRef  theStamp    = NULL;  // returned
+
+    theStamp = CFStringCreateMutable(kCFAllocatorDefault, 0);
+    if (theStamp == NULL) {
+        OSKextLogMemError();
+        return NULL;
+    }
+    for (; *thePaths; thePaths++) {
+        appendFileStamp(theStamp, *thePaths);
+    }
+    return theStamp;
+}
+
+static int compareFTSNames(const FTSENT ** a, const FTSENT ** b)
+{
+    return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/*******************************************************************************
+ * copyKextFingerprint() - fingerprint every file in a kext bundle, so that
+ * any change to a sealed resource is noticed.  Each entry's path relative to
+ * the bundle, inode, size and change time are hashed in name order.
+ *  Note: the caller must release the created CFStringRef
+ *******************************************************************************/
+static CFStringRef copyKextFingerprint(CFURLRef kextURL)
+{
+    CFMutableStringRef  fingerprint     = NULL;  // returned
+    char                kextPath[PATH_MAX];
+    char              * paths[2]        = { kextPath, NULL };
+    FTS               * fts             = NULL;  // must close
+    FTSENT            * fent            = NULL;  // do NOT free
+    size_t              rootLength      = 0;
+    CC_SHA256_CTX       ctx;
+    unsigned char       digest[CC_SHA256_DIGEST_LENGTH];
+
+    if (!CFURLGetFileSystemRepresentation(kextURL, true,
+                                          (UInt8 *)kextPath, sizeof(kextPath))) {
+        OSKextLogStringError(/* kext */ NULL);
+        goto finish;
+    }
+    rootLength = strlen(kextPath);
+
+    fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, compareFTSNames);
+    if (fts == NULL) {
+        goto finish;
+    }
+
+    CC_SHA256_Init(&ctx);
+    errno = 0;
+    while ((fent = fts_read(fts))) {
+        switch (fent->fts_info) {
+            case FTS_D:
+            case FTS_F:
+            case FTS_SL:
+            case FTS_DEFAULT:
+                /* any rewrite changes at least one of these */
+                CC_SHA256_Update(&ctx, fent->fts_path + rootLength,
+                                 (CC_LONG)(fent->fts_pathlen - rootLength + 1));
+                CC_SHA256_Update(&ctx, &fent->fts_statp->st_ino,
+                                 sizeof(fent->fts_statp->st_ino));
+                CC_SHA256_Update(&ctx, &fent->fts_statp->st_size,
+                                 sizeof(fent->fts_statp->st_size));
+                CC_SHA256_Update(&ctx, &fent->fts_statp->st_ctimespec,
+                                 sizeof(fent->fts_statp->st_ctimespec));
+                break;
+
+            case FTS_DP:        // already seen on the way down
+                break;
+
+            default:            // FTS_NS, FTS_DNR, FTS_ERR, ...
+                errno = fent->fts_errno;
+                goto finish;
+        }
+    }
+    if (errno) {
+        goto finish;
+    }
+    CC_SHA256_Final(digest, &ctx);
+
+    fingerprint = CFStringCreateMutable(kCFAllocatorDefault, 0);
+    if (fingerprint == NULL) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        CFStringAppendFormat(fingerprint, NULL, CFSTR("%02x"), digest[i]);
+    }
+
+finish:
+    if (fts) {
+        fts_close(fts);
+    }
+    return fingerprint;
+}
+
+/*******************************************************************************
+ * saveKextSignatureCache() - write the signature cache out if it has new
+ * entries.  Registered with atexit(); long-running callers such as kextd
+ * call it after each request.
+ *******************************************************************************/
+void saveKextSignatureCache(void)
+{
+    CFMutableDictionaryRef  cacheDict   = NULL;  // must release
+    CFNumberRef             versionNum  = NULL;  // must release
+    CFDataRef               cacheData   = NULL;  // must release
+    int                     version     = kSignatureCacheVersion;
+    int                     fd          = -1;
+    char                    tmpPath[PATH_MAX];
+    char                    dirPath[PATH_MAX];
+
+    pthread_mutex_lock(&sSigCacheLock);
+
+    tmpPath[0] = 0x00;
+    if (!sSigCacheDirty || !sSigCacheEntries || geteuid() != 0) {
+        goto finish;
+    }
+
+    cacheDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+    versionNum = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &version);
+    if (!cacheDict || !versionNum) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(cacheDict, kSigCacheVersionKey, versionNum);
+    CFDictionarySetValue(cacheDict, kSigCacheExcludeListKey, sSigCacheExcludeStamp);
+    CFDictionarySetValue(cacheDict, kSigCacheRevocationKey, sSigCacheRevocationStamp);
+    CFDictionarySetValue(cacheDict, kSigCacheEntriesKey, sSigCacheEntries);
+
+    cacheData = CFPropertyListCreateData(kCFAllocatorDefault, cacheDict,
+                                         kCFPropertyListBinaryFormat_v1_0,
+                                         0, NULL);
+    if (cacheData == NULL) {
+        OSKextLogMemError();
+        goto finish;
+    }
+
+    strlcpy(dirPath, kSignatureCachePath, sizeof(dirPath));
+    if (mkdir(dirname(dirPath), 0755) != 0 && errno != EEXIST) {
+        goto finish;
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", kSignatureCachePath);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+                  "Can't create %s - %s", tmpPath, strerror(errno));
+        tmpPath[0] = 0x00;
+        goto finish;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        writeToFile(fd, CFDataGetBytePtr(cacheData),
+                    CFDataGetLength(cacheData)) != EX_OK) {
+        goto finish;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmpPath, kSignatureCachePath) != 0) {
+        OSKextLog(/* kext */ NULL,
+                  kOSKextLogWarningLevel | kOSKextLogFileAccessFlag,
+                  "Can't rename %s - %s", tmpPath, strerror(errno));
+        goto finish;
+    }
+    tmpPath[0] = 0x00;
+    sSigCacheDirty = false;
+
+finish:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    SAFE_RELEASE(cacheDict);
+    SAFE_RELEASE(versionNum);
+    SAFE_RELEASE(cacheData);
+    pthread_mutex_unlock(&sSigCacheLock);
+}
+
+/*******************************************************************************
+ * clearSignatureCacheRevocationChecks() - the revocation data changed; the
+ * entries are still good for checks that don't ask for revocation checking.
+ * Called with sSigCacheLock held.
+ *******************************************************************************/
+static void clearSignatureCacheRevocationChecks(void)
+{
+    CFIndex         count   = CFDictionaryGetCount(sSigCacheEntries);
+    const void **   entries = NULL;  // must free
+
+    entries = malloc(count * sizeof(*entries));
+    if (entries) {
+        CFDictionaryGetKeysAndValues(sSigCacheEntries, NULL, entries);
+        for (CFIndex i = 0; i < count; i++) {
+            if (CFGetTypeID(entries[i]) == CFDictionaryGetTypeID()) {
+                CFDictionarySetValue((CFMutableDictionaryRef)entries[i],
+                                     kSigCacheRevocationCheckedKey,
+                                     kCFBooleanFalse);
+            }
+        }
+        SAFE_FREE(entries);
+    }
+    sSigCacheDirty = true;
+}
+
+/*******************************************************************************
+ * loadSignatureCache() - read the signature cache on first use.  Called with
+ * sSigCacheLock held.
+ *******************************************************************************/
+static void loadSignatureCache(void)
+{
+    CFDataRef               cacheData       = NULL;  // must release
+    CFPropertyListRef       cachePlist      = NULL;  // must release
+    CFDictionaryRef         cacheDict       = NULL;  // do NOT release
+    CFTypeRef               value           = NULL;  // do NOT release
+    int                     version         = 0;
+
+    if (sSigCacheEntries) {
+        return;
+    }
+
+    if (!sSigCacheExcludeStamp) {
+        sSigCacheExcludeStamp = copyStampForPaths(sExcludeListStampPaths);
+    }
+    if (!sSigCacheRevocationStamp) {
+        sSigCacheRevocationStamp = copyStampForPaths(sRevocationStampPaths);
+    }
+    sSigCacheStampTime = time(NULL);
+    if (!sSigCacheExcludeStamp || !sSigCacheRevocationStamp) {
+        goto finish;
+    }
+
+    if (!createCFDataFromFile(&cacheData, kSignatureCachePath)) {
+        goto finish;
+    }
+    cachePlist = CFPropertyListCreateWithData(kCFAllocatorDefault, cacheData,
+                                              kCFPropertyListMutableContainers,
+                                              NULL, NULL);
+    if (!cachePlist || CFGetTypeID(cachePlist) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+    cacheDict = (CFDictionaryRef)cachePlist;
+
+    value = CFDictionaryGetValue(cacheDict, kSigCacheVersionKey);
+    if (!value || CFGetTypeID(value) != CFNumberGetTypeID() ||
+        !CFNumberGetValue(value, kCFNumberIntType, &version) ||
+        version != kSignatureCacheVersion) {
+        goto finish;
+    }
+    value = CFDictionaryGetValue(cacheDict, kSigCacheExcludeListKey);
+    if (!value || !CFEqual(value, sSigCacheExcludeStamp)) {
+        goto finish;
+    }
+    value = CFDictionaryGetValue(cacheDict, kSigCacheEntriesKey);
+    if (!value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+    sSigCacheEntries = (CFMutableDictionaryRef)CFRetain(value);
+
+    /* Revocation data changed; the entries are still good for checks that
+     * don't ask for revocation checking.
+     */
+    value = CFDictionaryGetValue(cacheDict, kSigCacheRevocationKey);
+    if (!value || !CFEqual(value, sSigCacheRevocationStamp)) {
+        clearSignatureCacheRevocationChecks();
+    }
+
+finish:
+    if (sSigCacheEntries == NULL) {
+        sSigCacheEntries = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                            &kCFTypeDictionaryKeyCallBacks,
+                                            &kCFTypeDictionaryValueCallBacks);
+        if (sSigCacheEntries == NULL) {
+            OSKextLogMemError();
+        }
+        /* replace whatever stale file is there */
+        sSigCacheDirty = true;
+    }
+    if (sSigCacheEntries && geteuid() == 0) {
+        atexit(saveKextSignatureCache);
+    }
+    SAFE_RELEASE(cacheData);
+    SAFE_RELEASE(cachePlist);
+}
+
+/*******************************************************************************
+ * refreshSignatureCacheStamps() - recheck the exclude list and revocation
+ * databases, at most once every kSigCacheStampInterval, and drop what their
+ * changes invalidate.  Long-running processes such as kextd would otherwise
+ * keep trusting entries from before an exclude list update.  Called with
+ * sSigCacheLock held, after loadSignatureCache().
+ *******************************************************************************/
+static void refreshSignatureCacheStamps(void)
+{
+    CFStringRef     excludeStamp    = NULL;  // must release
+    CFStringRef     revocationStamp = NULL;  // must release
+    time_t          now             = time(NULL);
+
+    if (!sSigCacheEntries ||
+        (now >= sSigCacheStampTime &&
+         now - sSigCacheStampTime < kSigCacheStampInterval)) {
+        goto finish;
+    }
+    sSigCacheStampTime = now;
+
+    excludeStamp = copyStampForPaths(sExcludeListStampPaths);
+    revocationStamp = copyStampForPaths(sRevocationStampPaths);
+    if (!excludeStamp || !revocationStamp) {
+        goto finish;
+    }
+
+    if (!sSigCacheExcludeStamp || !CFEqual(excludeStamp, sSigCacheExcludeStamp)) {
+        CFDictionaryRemoveAllValues(sSigCacheEntries);
+        sSigCacheDirty = true;
+    } else if (!sSigCacheRevocationStamp ||
+               !CFEqual(revocationStamp, sSigCacheRevocationStamp)) {
+        clearSignatureCacheRevocationChecks();
+    }
+    SAFE_RELEASE(sSigCacheExcludeStamp);
+    SAFE_RELEASE(sSigCacheRevocationStamp);
+    sSigCacheExcludeStamp = excludeStamp;
+    sSigCacheRevocationStamp = revocationStamp;
+    excludeStamp = NULL;
+    revocationStamp = NULL;
+
+finish:
+    SAFE_RELEASE(excludeStamp);
+    SAFE_RELEASE(revocationStamp);
+}
+
+/*******************************************************************************
+ * signatureCacheHasEntry() - true if the kext at kextPath passed a signature
+ * check with the same fingerprint and CDHash it has now.
+ *******************************************************************************/
+static Boolean signatureCacheHasEntry(CFStringRef kextPath,
+                                      CFStringRef fingerprint,
+                                      CFStringRef cdhash,
+                                      Boolean needRevocationCheck)
+{
+    Boolean             result      = false;
+    CFDictionaryRef     entry       = NULL;  // do NOT release
+    CFTypeRef           value       = NULL;  // do NOT release
+
+    pthread_mutex_lock(&sSigCacheLock);
+    loadSignatureCache();
+    refreshSignatureCacheStamps();
+    if (!sSigCacheEntries) {
+        goto finish;
+    }
+
+    entry = CFDictionaryGetValue(sSigCacheEntries, kextPath);
+    if (!entry || CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+        goto finish;
+    }
+    value = CFDictionaryGetValue(entry, kSigCacheFingerprintKey);
+    if (!value || !CFEqual(value, fingerprint)) {
+        goto finish;
+    }
+    value = CFDictionaryGetValue(entry, kSigCacheCDHashKey);
+    if (!value || !CFEqual(value, cdhash)) {
+        goto finish;
+    }
+    if (needRevocationCheck) {
+        value = CFDictionaryGetValue(entry, kSigCacheRevocationCheckedKey);
+        if (!value || !CFEqual(value, kCFBooleanTrue)) {
+            goto finish;
+        }
+    }
+    result = true;
+
+finish:
+    pthread_mutex_unlock(&sSigCacheLock);
+    return result;
+}
+
+/*******************************************************************************
+ * signatureCacheAddEntry() - remember that the kext at kextPath passed a
+ * signature check.
+ *******************************************************************************/
+static void signatureCacheAddEntry(CFStringRef kextPath,
+                                   CFStringRef fingerprint,
+                                   CFStringRef cdhash,
+                                   Boolean revocationChecked)
+{
+    CFMutableDictionaryRef  entry       = NULL;  // must release
+
+    pthread_mutex_lock(&sSigCacheLock);
+    loadSignatureCache();
+    refreshSignatureCacheStamps();
+    if (!sSigCacheEntries) {
+        goto finish;
+    }
+
+    entry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                      &kCFTypeDictionaryKeyCallBacks,
+                                      &kCFTypeDictionaryValueCallBacks);
+    if (!entry) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionarySetValue(entry, kSigCacheFingerprintKey, fingerprint);
+    CFDictionarySetValue(entry, kSigCacheCDHashKey, cdhash);
+    CFDictionarySetValue(entry, kSigCacheRevocationCheckedKey,
+                         revocationChecked ? kCFBooleanTrue : kCFBooleanFalse);
+    CFDictionarySetValue(sSigCacheEntries, kextPath, entry);
+    sSigCacheDirty = true;
+
+finish:
+    SAFE_RELEASE(entry);
+    pthread_mutex_unlock(&sSigCacheLock);
+}
+
+/*******************************************************************************
+ * checkKextSnapshotSignature() - check the signature for a kext snapshot,
+ * without the exception list.  Safe to call from any thread.
+ *******************************************************************************/
+static OSStatus checkKextSnapshotSignature(CFDictionaryRef kextSnapshot,
+                                           Boolean earlyBoot)
 {
     OSStatus                result          = errSecCSSignatureFailed;
-    CFURLRef                kextURL         = NULL;   // must release
-    SecStaticCodeRef        staticCodeRef   = NULL;   // must release
+    CFDictionaryRef         signingContext  = NULL;   // must release
+    SecStaticCodeRef        staticCodeRef   = NULL;   // do NOT release
     SecRequirementRef       requirementRef  = NULL;   // must release
-    CFStringRef             myCFString;
+    CFStringRef             kextPath        = NULL;   // do NOT release
+    CFStringRef             fingerprint     = NULL;   // do NOT release
+    CFStringRef             cdhash          = NULL;   // must release
     CFStringRef             requirementsString;
     
-    if (aKext == NULL) {
-        return result;
-    }
-    
-    kextURL = CFURLCopyAbsoluteURL(OSKextGetURL(aKext));
-    if (!kextURL) {
-        OSKextLogMemError();
+    signingContext = copySigningContext(kextSnapshot);
+    if (signingContext == NULL) {
         goto finish;
     }
-    
-    if (SecStaticCodeCreateWithPath(kextURL,
-                                    kSecCSDefaultFlags,
-                                    &staticCodeRef) != errSecSuccess ||
-        (staticCodeRef == NULL)) {
-        OSKextLogMemError();
+    staticCodeRef = (SecStaticCodeRef)CFDictionaryGetValue(signingContext,
+                                                           kSigningContextCodeKey);
+    
+    /* skip the validity check if this exact kext passed one before */
+    kextPath = CFDictionaryGetValue(kextSnapshot, kKextSnapshotPathKey);
+    fingerprint = CFDictionaryGetValue(signingContext,
+                                       kSigningContextFingerprintKey);
+    cdhash = copyCDHash(getSigningContextInfo(signingContext));
+    if (kextPath && fingerprint && cdhash &&
+        signatureCacheHasEntry(kextPath, fingerprint, cdhash, !earlyBoot)) {
+        result = 0;
         goto finish;
     }
     
@@ -1301,8 +2335,7 @@ OSStatus checkKextSignature(OSKextRef aKext,
      * 3rd party kexts are signed through a special developer kext devid
      * program
      */
-    myCFString = OSKextGetIdentifier(aKext);
-    if (CFStringHasPrefix(myCFString, __kOSKextApplePrefix)) {
+    if (isAppleKextSnapshot(kextSnapshot)) {
         requirementsString = CFSTR("anchor apple");
     }
     else {
@@ -1334,20 +2367,142 @@ OSStatus checkKextSignature(OSKextRef aKext,
                                             kSecCSEnforceRevocationChecks | kSecCSCheckAllArchitectures,
                                             requirementRef);
     }
+    if (result == 0 && kextPath && fingerprint && cdhash) {
+        signatureCacheAddEntry(kextPath, fingerprint, cdhash, !earlyBoot);
+    }
+    
+finish:
+    SAFE_RELEASE(signingContext);
+    SAFE_RELEASE(requirementRef);
+    SAFE_RELEASE(cdhash);
+    
+    return result;
+}
+
+/*******************************************************************************
+ * checkKextSignature() - check the signature for given kext.
+ *******************************************************************************/
+OSStatus checkKextSignature(OSKextRef aKext,
+                            Boolean checkExceptionList,
+                            Boolean earlyBoot)
+{
+    OSStatus                result          = errSecCSSignatureFailed;
+    CFDictionaryRef         kextSnapshot    = NULL;   // must release
+    
+    if (aKext == NULL) {
+        return result;
+    }
+    
+    kextSnapshot = createKextSnapshot(aKext, /* kextURL */ NULL);
+    if (kextSnapshot == NULL) {
+        goto finish;
+    }
+    result = checkKextSnapshotSignature(kextSnapshot, earlyBoot);
     if ( result != 0 &&
         checkExceptionList &&
-        isInExceptionList(aKext, kextURL, true) ) {
+        isInExceptionList(aKext, NULL, true) ) {
         result = 0;
     }
     
 finish:
-    SAFE_RELEASE(kextURL);
-    SAFE_RELEASE(staticCodeRef);
-    SAFE_RELEASE(requirementRef);
+    SAFE_RELEASE(kextSnapshot);
     
     return result;
 }
 
+/*******************************************************************************
+ * CPU time used so far by the calling thread, in microseconds.
+ *******************************************************************************/
+static uint64_t threadCPUUsecs(void)
+{
+    thread_basic_info_data_t    info;
+    mach_msg_type_number_t      count = THREAD_BASIC_INFO_COUNT;
+
+    if (thread_info(pthread_mach_thread_np(pthread_self()),
+            THREAD_BASIC_INFO, (thread_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return ((uint64_t)info.user_time.seconds +
+            (uint64_t)info.system_time.seconds) * 1000000ULL +
+        (uint64_t)info.user_time.microseconds +
+        (uint64_t)info.system_time.microseconds;
+}
+
+/*******************************************************************************
+ * checkKextSignatures() - checkKextSignature() for each of kexts, leaving the
+ * result for each in results, which must have room for them all.  The
+ * Security.framework checks run concurrently; the snapshots before them and
+ * the exception list lookups after them run on the calling thread, since they
+ * use the OSKexts.  If cpuUsecs isn't NULL, the CPU time of the checks,
+ * summed over the threads that ran them, is added to it; work the process
+ * does on other threads meanwhile isn't counted.  Returns false if it
+ * couldn't check them, in which case every result is a failure.
+ *******************************************************************************/
+Boolean checkKextSignatures(CFArrayRef kexts,
+                            OSStatus * results,
+                            Boolean checkExceptionList,
+                            Boolean earlyBoot,
+                            uint64_t * cpuUsecs)
+{
+    Boolean             result      = false;
+    CFDictionaryRef   * snapshots   = NULL;  // must free, release each
+    CFIndex             count, i;
+
+    count = CFArrayGetCount(kexts);
+    for (i = 0; i < count; i++) {
+        results[i] = errSecCSSignatureFailed;
+    }
+    if (!count) {
+        result = true;
+        goto finish;
+    }
+    snapshots = (CFDictionaryRef *)calloc(count, sizeof(*snapshots));
+    if (!snapshots) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    for (i = 0; i < count; i++) {
+        snapshots[i] = createKextSnapshot(
+            (OSKextRef)CFArrayGetValueAtIndex(kexts, i), /* kextURL */ NULL);
+    }
+
+    dispatch_apply(count,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+        ^(size_t index) {
+            uint64_t startUsecs;
+
+            if (snapshots[index]) {
+                startUsecs = cpuUsecs ? threadCPUUsecs() : 0;
+                results[index] = checkKextSnapshotSignature(snapshots[index],
+                                                            earlyBoot);
+                if (cpuUsecs) {
+                    __sync_fetch_and_add(cpuUsecs,
+                                         threadCPUUsecs() - startUsecs);
+                }
+            }
+        });
+
+    if (checkExceptionList) {
+        for (i = 0; i < count; i++) {
+            if (results[i] != 0 &&
+                isInExceptionList((OSKextRef)CFArrayGetValueAtIndex(kexts, i),
+                                  /* kextURL */ NULL, true)) {
+                results[i] = 0;
+            }
+        }
+    }
+    result = true;
+
+finish:
+    if (snapshots) {
+        for (i = 0; i < count; i++) {
+            SAFE_RELEASE(snapshots[i]);
+        }
+        free(snapshots);
+    }
+    return result;
+}
+
 #define GET_CSTRING_PTR(the_cfstring, the_ptr, the_buffer, the_size) \
 do { \
 the_ptr = CFStringGetCStringPtr(the_cfstring, kCFStringEncodingUTF8); \
@@ -1359,173 +2514,274 @@ CFStringGetCString(the_cfstring, the_buffer, the_size, kCFStringEncodingUTF8); \
 } while(0)
 
 /*********************************************************************
- * isInExceptionList checks to see if the given kext is in the
- * kext signing exception list (in com.apple.driver.KextExcludeList).  
- * If useCache is TRUE, we will use the cached copy of the exception list.
- * If useCache is FALSE, we will refresh the cache from disk.  
- *
- * The kext signing exception list rarely changes but to insure you have the 
- * most recent copy in the cache pass FALSE for the first call and TRUE for
- * subsequent calls (when dealing with a large list of kexts).
- * theKext can be NULL if you just want the invalidate the cache.
+ * createExceptionHashBundleIDSet() builds the set of bundle IDs named by
+ * an OSKextSigExceptionHashList, used to skip the ad-hoc hash for kexts
+ * that can't be in it.  Only string entries can match a kext (see
+ * hashIsInExceptionList()); their bundle ID is the text up to the first
+ * space.  Returns NULL, meaning "don't prefilter", if an entry doesn't
+ * look like it starts with a bundle ID.
  *********************************************************************/
-Boolean isInExceptionList(OSKextRef theKext,
-                          CFURLRef  theKextURL,
-                          Boolean   useCache)
+static CFSetRef createExceptionHashBundleIDSet(CFDictionaryRef theDict)
 {
-    Boolean             result                      = false;
-    CFURLRef            kextURL                     = NULL; // must release
-    CFStringRef         kextID                      = NULL; // must release
-    OSKextRef           excludelistKext             = NULL; // must release
-    CFDictionaryRef     tempDict                    = NULL; // do NOT release
-#if USE_OLD_EXCEPTION_LIST
-    static CFDictionaryRef sExceptionListDict       = NULL; // do NOT release
-#endif
-    static CFDictionaryRef sExceptionHashListDict   = NULL; // do NOT release
-    
-    /* invalidate the exception list "by hash" cache or create if not
-     * present
-     */
-    if (useCache == false || sExceptionHashListDict == NULL) {
-        if (sExceptionHashListDict) {
-            SAFE_RELEASE_NULL(sExceptionHashListDict);
+    CFMutableSetRef     result          = NULL;  // returned
+    CFStringRef         bundleID        = NULL;  // must release
+    const void **       values          = NULL;  // must free
+    CFIndex             count, i;
+
+    count = CFDictionaryGetCount(theDict);
+    values = malloc(count * sizeof(*values));
+    if (!values || !createCFMutableSet(&result, &kCFTypeSetCallBacks)) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    CFDictionaryGetKeysAndValues(theDict, NULL, values);
+
+    for (i = 0; i < count; i++) {
+        CFStringRef     kextInfoString  = (CFStringRef)values[i];
+        CFRange         spaceRange;
+        CFRange         idRange;
+
+        if (CFGetTypeID(kextInfoString) != CFStringGetTypeID()) {
+            continue;
         }
-        kextID = CFStringCreateWithCString(kCFAllocatorDefault,
-                                           "com.apple.driver.KextExcludeList",
-                                           kCFStringEncodingUTF8);
-        if (kextID == NULL) {
-            OSKextLogStringError(/* kext */ NULL);
-            goto finish;
+        idRange = CFRangeMake(0, CFStringGetLength(kextInfoString));
+        if (CFStringFindWithOptions(kextInfoString, CFSTR(" "), idRange,
+                                    0, &spaceRange)) {
+            idRange.length = spaceRange.location;
         }
-        
-        excludelistKext = OSKextCreateWithIdentifier(kCFAllocatorDefault,
-                                                     kextID);
-        if (excludelistKext == NULL) {
+        bundleID = CFStringCreateWithSubstring(kCFAllocatorDefault,
+                                               kextInfoString, idRange);
+        if (!bundleID) {
+            OSKextLogMemError();
+            SAFE_RELEASE_NULL(result);
             goto finish;
         }
-        
-        /* can we trust AppleKextExcludeList.kext? 
-         * If we are NOT allowing untrusted kexts then make sure
-         * AppleKextExcludeList.kext is valid!
-         */
-        if (csr_check(CSR_ALLOW_UNTRUSTED_KEXTS) != 0) {
-            if (checkKextSignature(excludelistKext, false, false) != 0) {
-                char kextPath[PATH_MAX];
-                
-                if (!CFURLGetFileSystemRepresentation(OSKextGetURL(excludelistKext),
-                                                      false,
-                                                      (UInt8 *)kextPath,
-                                                      sizeof(kextPath))) {
-                    strlcpy(kextPath, "(unknown)", sizeof(kextPath));
-                }
-                OSKextLog(/* kext */ NULL,
-                          kOSKextLogErrorLevel | kOSKextLogArchiveFlag |
-                          kOSKextLogAuthenticationFlag | kOSKextLogGeneralFlag,
-                          "%s has invalid signature; Trust cache is disabled.",
-                          kextPath);
-                goto finish;
-            }
-        }
-        
-        tempDict = OSKextGetValueForInfoDictionaryKey(
-                                        excludelistKext,
-                                        CFSTR("OSKextSigExceptionHashList") );
-        if (tempDict) {
-            if ((unsigned int)CFDictionaryGetCount(tempDict) > 0) {
-                sExceptionHashListDict = CFDictionaryCreateCopy(NULL, tempDict);
-                if (sExceptionHashListDict == NULL) {
-                    OSKextLogMemError();
-                }
-            }
+        if (!CFStringFind(bundleID, CFSTR("."), 0).length ||
+            CFStringHasSuffix(bundleID, CFSTR(".kext"))) {
+            SAFE_RELEASE_NULL(result);
+            goto finish;
         }
+        CFSetAddValue(result, bundleID);
+        SAFE_RELEASE_NULL(bundleID);
+    }
+
+finish:
+    SAFE_RELEASE(bundleID);
+    SAFE_FREE(values);
+    return result;
+}
+
+/*********************************************************************
+ * The exception lists from AppleKextExcludeList.kext.  They are loaded
+ * through OSKext on the thread calling isInExceptionList(), but may be
+ * looked up from any thread, so they are swapped and read under
+ * sExceptionListLock.
+ *********************************************************************/
+static pthread_mutex_t  sExceptionListLock          = PTHREAD_MUTEX_INITIALIZER;
+#if USE_OLD_EXCEPTION_LIST
+static CFDictionaryRef  sExceptionListDict          = NULL; // do NOT release
+#endif
+static CFDictionaryRef  sExceptionHashListDict      = NULL; // do NOT release
+static CFSetRef         sExceptionHashBundleIDs     = NULL; // do NOT release
+static CFStringRef      sExceptionListVersion       = NULL; // do NOT release
+static Boolean          sExceptionListsLoaded       = false;
+
+/*********************************************************************
+ * setExceptionLists() - replace the loaded exception lists; NULLs
+ * invalidate them.
+ *********************************************************************/
+static void setExceptionLists(CFDictionaryRef hashListDict,
+                              CFDictionaryRef listDict __unused,
+                              CFStringRef     listVersion,
+                              Boolean         loaded)
+{
+    pthread_mutex_lock(&sExceptionListLock);
+    SAFE_RELEASE_NULL(sExceptionHashListDict);
+    SAFE_RELEASE_NULL(sExceptionHashBundleIDs);
+    SAFE_RELEASE_NULL(sExceptionListVersion);
+#if USE_OLD_EXCEPTION_LIST
+    SAFE_RELEASE_NULL(sExceptionListDict);
+    if (listDict) {
+        sExceptionListDict = CFRetain(listDict);
+    }
+#endif
+    if (hashListDict) {
+        sExceptionHashListDict = CFRetain(hashListDict);
+        sExceptionHashBundleIDs = createExceptionHashBundleIDSet(hashListDict);
+    }
+    if (listVersion) {
+        sExceptionListVersion = CFRetain(listVersion);
+    }
+    sExceptionListsLoaded = loaded;
+    pthread_mutex_unlock(&sExceptionListLock);
+}
+
+/*********************************************************************
+ * loadExceptionLists() - (re)load the exception lists if asked to or
+ * not yet loaded.  An empty list counts as loaded so it is not looked
+ * for again on every call.
+ *********************************************************************/
+static void loadExceptionLists(Boolean useCache)
+{
+    CFStringRef         kextID                      = NULL; // must release
+    OSKextRef           excludelistKext             = NULL; // must release
+    CFDictionaryRef     hashListDict                = NULL; // must release
+    CFDictionaryRef     listDict                    = NULL; // must release
+    CFDictionaryRef     tempDict                    = NULL; // do NOT release
+    CFStringRef         excludelistVersion          = NULL; // do NOT release
+    Boolean             loaded;
+
+    pthread_mutex_lock(&sExceptionListLock);
+    loaded = sExceptionListsLoaded;
+    pthread_mutex_unlock(&sExceptionListLock);
+    if (useCache && loaded) {
+        goto finish;
+    }
+
+    kextID = CFStringCreateWithCString(kCFAllocatorDefault,
+                                       "com.apple.driver.KextExcludeList",
+                                       kCFStringEncodingUTF8);
+    if (kextID == NULL) {
+        OSKextLogStringError(/* kext */ NULL);
+        goto finish;
+    }
+    
+    excludelistKext = OSKextCreateWithIdentifier(kCFAllocatorDefault,
+                                                 kextID);
+    if (excludelistKext == NULL) {
+        goto invalidate;
     }
     
-    /* invalidate the exception list "by bundle ID" cache or create if not 
-     * present 
+    /* can we trust AppleKextExcludeList.kext? 
+     * If we are NOT allowing untrusted kexts then make sure
+     * AppleKextExcludeList.kext is valid!
      */
-#if USE_OLD_EXCEPTION_LIST
-    if (useCache == false || sExceptionListDict == NULL) {
-        if (sExceptionListDict) {
-            SAFE_RELEASE_NULL(sExceptionListDict);
-        }
-        
-        if (kextID == NULL) {
-            kextID = CFStringCreateWithCString(kCFAllocatorDefault,
-                                               "com.apple.driver.KextExcludeList",
-                                               kCFStringEncodingUTF8);
-            if (kextID == NULL) {
-                OSKextLogStringError(/* kext */ NULL);
-                goto finish;
-            }
-        }
-        
-        if (excludelistKext == NULL) {
-            excludelistKext = OSKextCreateWithIdentifier(kCFAllocatorDefault,
-                                                         kextID);
-            if (excludelistKext == NULL) {
-                goto finish;
+    if (csr_check(CSR_ALLOW_UNTRUSTED_KEXTS) != 0) {
+        if (checkKextSignature(excludelistKext, false, false) != 0) {
+            char kextPath[PATH_MAX];
+            
+            if (!CFURLGetFileSystemRepresentation(OSKextGetURL(excludelistKext),
+                                                  false,
+                                                  (UInt8 *)kextPath,
+                                                  sizeof(kextPath))) {
+                strlcpy(kextPath, "(unknown)", sizeof(kextPath));
             }
+            OSKextLog(/* kext */ NULL,
+                      kOSKextLogErrorLevel | kOSKextLogArchiveFlag |
+                      kOSKextLogAuthenticationFlag | kOSKextLogGeneralFlag,
+                      "%s has invalid signature; Trust cache is disabled.",
+                      kextPath);
+            goto invalidate;
         }
-        
-        /* can we trust AppleKextExcludeList.kext?
-         * If we are NOT allowing untrusted kexts then make sure
-         * AppleKextExcludeList.kext is valid!
-         */
-        if (csr_check(CSR_ALLOW_UNTRUSTED_KEXTS) != 0) {
-            if (checkKextSignature(excludelistKext, false, false) != 0) {
-                char kextPath[PATH_MAX];
-                
-               if (!CFURLGetFileSystemRepresentation(OSKextGetURL(excludelistKext),
-                                                      false,
-                                                      (UInt8 *)kextPath,
-                                                      sizeof(kextPath))) {
-                    strlcpy(kextPath, "(unknown)", sizeof(kextPath));
-                }
-                OSKextLog(/* kext */ NULL,
-                          kOSKextLogErrorLevel | kOSKextLogArchiveFlag |
-                          kOSKextLogAuthenticationFlag | kOSKextLogGeneralFlag,
-                          "%s has invalid signature; Trust cache is disabled.",
-                          kextPath);
-                goto finish;
+    }
+    
+    /* the lists and their index only change with the exclude list version
+     */
+    excludelistVersion = OSKextGetValueForInfoDictionaryKey(excludelistKext,
+                                                            kCFBundleVersionKey);
+    pthread_mutex_lock(&sExceptionListLock);
+    loaded = sExceptionListsLoaded && excludelistVersion &&
+        sExceptionListVersion &&
+        CFEqual(excludelistVersion, sExceptionListVersion);
+    pthread_mutex_unlock(&sExceptionListLock);
+    if (loaded) {
+        goto finish;
+    }
+    
+    tempDict = OSKextGetValueForInfoDictionaryKey(
+                                    excludelistKext,
+                                    CFSTR("OSKextSigExceptionHashList") );
+    if (tempDict) {
+        if ((unsigned int)CFDictionaryGetCount(tempDict) > 0) {
+            hashListDict = CFDictionaryCreateCopy(NULL, tempDict);
+            if (hashListDict == NULL) {
+                OSKextLogMemError();
             }
         }
-
-        tempDict = OSKextGetValueForInfoDictionaryKey(
-                                            excludelistKext,
-                                            CFSTR("OSKextSigExceptionList"));
-        if (tempDict) {
-            if ((unsigned int)CFDictionaryGetCount(tempDict) > 0) {
-                sExceptionListDict = CFDictionaryCreateCopy(NULL, tempDict);
-                if (sExceptionListDict == NULL) {
-                    OSKextLogMemError();
-                }
+    }
+    
+#if USE_OLD_EXCEPTION_LIST
+    tempDict = OSKextGetValueForInfoDictionaryKey(
+                                        excludelistKext,
+                                        CFSTR("OSKextSigExceptionList"));
+    if (tempDict) {
+        if ((unsigned int)CFDictionaryGetCount(tempDict) > 0) {
+            listDict = CFDictionaryCreateCopy(NULL, tempDict);
+            if (listDict == NULL) {
+                OSKextLogMemError();
             }
         }
     }
 #endif
     
-    if (theKext == NULL) {
+    setExceptionLists(hashListDict, listDict, excludelistVersion, true);
+    goto finish;
+    
+invalidate:
+    /* no usable exclude list; drop whatever was loaded before */
+    setExceptionLists(NULL, NULL, NULL, false);
+    
+finish:
+    SAFE_RELEASE(kextID);
+    SAFE_RELEASE(excludelistKext);
+    SAFE_RELEASE(hashListDict);
+    SAFE_RELEASE(listDict);
+    return;
+}
+
+/*********************************************************************
+ * isKextSnapshotInExceptionList() - look a kext snapshot up in the
+ * exception lists as last loaded.  Safe to call from any thread.
+ *********************************************************************/
+static Boolean isKextSnapshotInExceptionList(CFDictionaryRef kextSnapshot)
+{
+    Boolean             result              = false;
+    CFDictionaryRef     signingContext      = NULL; // must release
+    CFDictionaryRef     hashListDict        = NULL; // must release
+    CFSetRef            hashBundleIDs       = NULL; // must release
+#if USE_OLD_EXCEPTION_LIST
+    CFDictionaryRef     listDict            = NULL; // must release
+#endif
+    CFStringRef         bundleID            = NULL; // do NOT release
+
+    if (kextSnapshot == NULL) {
         goto finish;
     }
-   
+
+    pthread_mutex_lock(&sExceptionListLock);
     if (sExceptionHashListDict) {
-        if (theKextURL == NULL) {
-            kextURL = CFURLCopyAbsoluteURL(OSKextGetURL(theKext));
-            if (kextURL == NULL) {
-                OSKextLogMemError();
-                goto finish;
-            }
-            theKextURL = kextURL;
+        hashListDict = CFRetain(sExceptionHashListDict);
+    }
+    if (sExceptionHashBundleIDs) {
+        hashBundleIDs = CFRetain(sExceptionHashBundleIDs);
+    }
+#if USE_OLD_EXCEPTION_LIST
+    if (sExceptionListDict) {
+        listDict = CFRetain(sExceptionListDict);
+    }
+#endif
+    pthread_mutex_unlock(&sExceptionListLock);
+   
+    /* the ad-hoc hash is costly; only make it for kexts whose bundle ID
+     * appears in the hash list
+     */
+    bundleID = CFDictionaryGetValue(kextSnapshot, kKextSnapshotIdentifierKey);
+    if (hashListDict &&
+        (!hashBundleIDs ||
+         (bundleID && CFSetContainsValue(hashBundleIDs, bundleID)))) {
+        signingContext = copySigningContext(kextSnapshot);
+        if (signingContext == NULL) {
+            goto finish;
         }
-        if (hashIsInExceptionList(theKextURL, sExceptionHashListDict)) {
+        if (hashIsInExceptionList(signingContext, hashListDict)) {
             result = true;
             goto finish;
         }
     }
     
 #if USE_OLD_EXCEPTION_LIST
-    if (sExceptionListDict) {
-        if (bundleIdIsInExceptionList(theKext, sExceptionListDict)) {
+    if (listDict) {
+        if (bundleIdIsInExceptionList(kextSnapshot, listDict)) {
             result = true;
             goto finish;
         }
@@ -1533,9 +2789,42 @@ Boolean isInExceptionList(OSKextRef theKext,
 #endif
     
 finish:
-    SAFE_RELEASE(kextURL);
-    SAFE_RELEASE(kextID);
-    SAFE_RELEASE(excludelistKext);
+    SAFE_RELEASE(signingContext);
+    SAFE_RELEASE(hashListDict);
+    SAFE_RELEASE(hashBundleIDs);
+#if USE_OLD_EXCEPTION_LIST
+    SAFE_RELEASE(listDict);
+#endif
+    return result;
+}
+
+/*********************************************************************
+ * isInExceptionList checks to see if the given kext is in the
+ * kext signing exception list (in com.apple.driver.KextExcludeList).  
+ * If useCache is TRUE, we will use the cached copy of the exception list.
+ * If useCache is FALSE, we will refresh the cache from disk.  
+ *
+ * The kext signing exception list rarely changes but to insure you have the 
+ * most recent copy in the cache pass FALSE for the first call and TRUE for
+ * subsequent calls (when dealing with a large list of kexts).
+ * theKext can be NULL if you just want the invalidate the cache.
+ *********************************************************************/
+Boolean isInExceptionList(OSKextRef theKext,
+                          CFURLRef  theKextURL,
+                          Boolean   useCache)
+{
+    Boolean             result                      = false;
+    CFDictionaryRef     kextSnapshot                = NULL; // must release
+
+    loadExceptionLists(useCache);
+    if (theKext == NULL) {
+        goto finish;
+    }
+    kextSnapshot = createKextSnapshot(theKext, theKextURL);
+    result = isKextSnapshotInExceptionList(kextSnapshot);
+
+finish:
+    SAFE_RELEASE(kextSnapshot);
     return result;
 }
 
@@ -1560,18 +2849,19 @@ finish:
  * OSKextParseVersionString
  *********************************************************************/
 
-static Boolean bundleIdIsInExceptionList(OSKextRef          theKext,
+static Boolean bundleIdIsInExceptionList(CFDictionaryRef    kextSnapshot,
                                          CFDictionaryRef    theDict)
 {
     Boolean         result                  = false;
     CFStringRef     bundleID                = NULL;  // do NOT release
+    CFStringRef     kextVersString          = NULL;  // do NOT release
     CFStringRef     exceptionKextVersString = NULL;  // do NOT release
     OSKextVersion   kextVers                = -1;
     const char *    versCString             = NULL;  // do not free
     OSKextVersion   exceptionKextVers;
     char            versBuffer[256];
 
-    bundleID = OSKextGetIdentifier(theKext);
+    bundleID = CFDictionaryGetValue(kextSnapshot, kKextSnapshotIdentifierKey);
     if (!bundleID) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
@@ -1580,8 +2870,13 @@ static Boolean bundleIdIsInExceptionList(OSKextRef          theKext,
         goto finish;
     }
     
-    kextVers = OSKextGetVersion(theKext);
-    if (!kextVers) {
+    kextVersString = CFDictionaryGetValue(kextSnapshot, kKextSnapshotVersionKey);
+    if (kextVersString) {
+        GET_CSTRING_PTR(kextVersString, versCString, versBuffer,
+                        sizeof(versBuffer));
+        kextVers = OSKextParseVersionString(versCString);
+    }
+    if (kextVers <= 0) {
         OSKextLog(/* kext */ NULL,
                   kOSKextLogDebugLevel | kOSKextLogGeneralFlag,
                   "%s could not get kextVers",
@@ -1638,29 +2933,21 @@ finish:
  * </dict>
  *********************************************************************/
 
-static Boolean hashIsInExceptionList(CFURLRef           theKextURL,
+static Boolean hashIsInExceptionList(CFDictionaryRef    signingContext,
                                      CFDictionaryRef    theDict)
 {
     Boolean         result              = false;
-    char *          hashCString         = NULL;     // must free
-    CFStringRef     hashString          = NULL;     // must release
+    CFStringRef     hashString          = NULL;     // do NOT release
     CFStringRef     kextInfoString      = NULL;     // do NOT release
     
-    if (theKextURL == NULL) {
+    if (signingContext == NULL) {
         goto finish;
     }
     
     /* generate the hash for unsigned kext to look up in exception list
      */
-    getAdhocSignatureHash(theKextURL, &hashCString);
-    if (hashCString == NULL) {
-        goto finish;
-    }
-    hashString = CFStringCreateWithCString(kCFAllocatorDefault,
-                                           hashCString,
-                                           kCFStringEncodingUTF8);
+    hashString = getSigningContextAdhocHash(signingContext);
     if (hashString == NULL) {
-        OSKextLogMemError();
         goto finish;
     }
     
@@ -1673,12 +2960,10 @@ static Boolean hashIsInExceptionList(CFURLRef           theKextURL,
     OSKextLogCFString(NULL,
                       kOSKextLogGeneralFlag | kOSKextLogErrorLevel,
                       CFSTR("kext %@ is in hash exception list, allowing to load"),
-                      theKextURL);
+                      CFDictionaryGetValue(signingContext, kSigningContextURLKey));
     result = true;
     
 finish:
-    SAFE_RELEASE(hashString);
-    SAFE_FREE(hashCString);
 
     return result;
 }
@@ -1742,39 +3027,45 @@ static uint64_t getKextDevModeFlags(void)
 }
 
 /*********************************************************************
+ * Checks the folders theKext is in by dev/ino, so that a path that
+ * merely spells the folder differently isn't misclassified.
  *********************************************************************/
-Boolean isInLibraryExtensionsFolder(OSKextRef theKext)
+static Boolean isKextInFolder(OSKextRef theKext, const char * folderPath)
 {
-    CFStringRef     myKextPath = NULL; // must release
+    CFURLRef        myURL = NULL; // do not release
     Boolean         myResult = false;
+    dev_t           myFolderDev;
+    ino_t           myFolderIno;
+    char            myKextPath[PATH_MAX];
 
-    myKextPath = copyKextPath(theKext);
-    if ( myKextPath ) {
-        if ( CFStringHasPrefix(myKextPath,
-                               CFSTR(_kOSKextLibraryExtensionsFolder)) ) {
-            myResult = true;
-        }
+    myURL = OSKextGetURL(theKext);
+    if (!myURL ||
+        !CFURLGetFileSystemRepresentation(myURL, /* resolveToBase */ true,
+                                          (UInt8 *)myKextPath,
+                                          sizeof(myKextPath))) {
+        goto finish;
+    }
+    if (getFileDevAndIno(folderPath, &myFolderDev, &myFolderIno) != 0) {
+        goto finish;
     }
-    SAFE_RELEASE(myKextPath);
+    myResult = isPathInFolderWithDevAndIno(myKextPath,
+                                           myFolderDev, myFolderIno);
+finish:
     return(myResult);
 }
 
 /*********************************************************************
  *********************************************************************/
-Boolean isInSystemLibraryExtensionsFolder(OSKextRef theKext)
+Boolean isInLibraryExtensionsFolder(OSKextRef theKext)
 {
-    CFStringRef     myKextPath = NULL; // must release
-    Boolean         myResult = false;
+    return isKextInFolder(theKext, _kOSKextLibraryExtensionsFolder);
+}
 
-    myKextPath = copyKextPath(theKext);
-    if ( myKextPath ) {
-        if ( CFStringHasPrefix(myKextPath,
-                               CFSTR(_kOSKextSystemLibraryExtensionsFolder)) ) {
-            myResult = true;
-        }
-    }
-    SAFE_RELEASE(myKextPath);
-    return(myResult);
+/*********************************************************************
+ *********************************************************************/
+Boolean isInSystemLibraryExtensionsFolder(OSKextRef theKext)
+{
+    return isKextInFolder(theKext, _kOSKextSystemLibraryExtensionsFolder);
 }
 
 /*******************************************************************************
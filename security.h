@@ -61,6 +61,12 @@ void    recordKextLoadForMT(OSKextRef aKext);
 OSStatus checkKextSignature(OSKextRef aKext,
                             Boolean checkExceptionList,
                             Boolean earlyBoot);
+Boolean checkKextSignatures(CFArrayRef kexts,
+                            OSStatus * results,
+                            Boolean checkExceptionList,
+                            Boolean earlyBoot,
+                            uint64_t * cpuUsecs);
+void    saveKextSignatureCache(void);
 OSStatus checkSignaturesOfDependents(OSKextRef theKext,
                                      Boolean checkExceptionList,
                                      Boolean earlyBoot);
@@ -31,6 +31,7 @@
 #include <bless.h>
 #include <miscfs/devfs/devfs.h>     // UID_ROOT, GID_WHEEL
 #include <fcntl.h>
+#include <fts.h>
 #include <hfs/hfs_mount.h>          // hfs_mount_args
 #include <libgen.h>
 #include <mach/mach_error.h>
@@ -42,6 +43,9 @@
 #include <sys/mount.h>
 #include <sys/xattr.h>
 #include <unistd.h>
+#include <Block.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
 
 #include <IOKit/kext/kextmanager_types.h>
 #include <IOKit/kext/OSKextPrivate.h>
@@ -51,6 +55,7 @@
 #include <IOKit/IOBSD.h>
 #include <IOKit/storage/IOMedia.h>
 #include <IOKit/storage/IOPartitionScheme.h>
+#include <CommonCrypto/CommonDigest.h>
 #include <MediaKit/GPTTypes.h>
 #include <bootfiles.h>
 #include <CoreFoundation/CoreFoundation.h>
@@ -71,6 +76,42 @@ static mach_port_t sBRUptLock = MACH_PORT_NULL;
 static uuid_t      s_vol_uuid;      // XX not threadsafe (10561671)
 static mach_port_t sKextdPort = MACH_PORT_NULL;
 
+/* DiskArb-mounted helpers stay mounted after unmountBoot() so that later
+ * operations in this process (e.g. BRCopyBootFiles() after kextcache -u)
+ * can reuse them.  They share one DA session on the runloop that created
+ * it and are unmounted kHeldHelperDelay seconds after their last use, or
+ * at exit.  Only touched from sHeldRunLoop.
+ */
+#define kMaxHeldHelpers     (8)
+#define kHeldHelperDelay    (10.0)
+struct heldHelper {
+    char bsdname[DEVMAXPATHSIZE];
+    char mount[MNAMELEN];
+    DADiskRef disk;                     // NULL -> empty slot
+    int refs;                           // contexts using it now
+};
+static struct heldHelper  sHeldHelpers[kMaxHeldHelpers];
+static DASessionRef       sHeldSession = NULL;
+static CFRunLoopRef       sHeldRunLoop = NULL;
+static CFRunLoopTimerRef  sHeldTimer = NULL;
+
+/* BR*Async() operations (see bootroot.h) run one at a time on sBROpQueue.
+ * sCurrentOp is the one running on this thread, if any, so that the phases
+ * below can report progress and notice cancellation.
+ */
+struct __BROperation {
+    volatile int32_t refs;
+    volatile int32_t cancelled;
+    dispatch_queue_t queue;             // caller's, for the blocks below
+    BRProgressHandler progress;         // may be NULL
+    BRCompletionHandler completion;
+};
+static dispatch_queue_t                 sBROpQueue = NULL;
+static __thread struct __BROperation  * sCurrentOp = NULL;
+
+// for BRGetStatistics()
+static BRStatistics sBRStats;
+
 
 /******************************************************************************
 * Types
@@ -152,7 +193,7 @@ struct updatingVol {
 #define kBRRootUUIDFile ".root_uuid"
 #define kBRBootOnceDir "/com.apple.boot.once"
 
-// NOTE: These strings must be the same length, or code in ucopyRPS will break!
+// NOTE: These strings must be the same length, or useAPMBootPlistName() breaks!
 // There is a compile time assert in the function to this effect.
 #define BOOTPLIST_NAME "com.apple.Boot.plist"
 #define BOOTPLIST_APM_NAME "com.apple.boot.plist"
@@ -165,6 +206,16 @@ struct updatingVol {
 // diskarb
 static int mountBoot(struct updatingVol *up);
 static void unmountBoot(struct updatingVol *up);
+// DiskArb requests for several helpers at once (errs[i] as from mountBoot())
+static void mountBoots(struct updatingVol *helpers, CFIndex count, int errs[]);
+static void unmountBoots(struct updatingVol *helpers, CFIndex count);
+// reuse of helpers mounted by earlier operations (see sHeldHelpers)
+static DASessionRef copyHelperSession(void);
+static Boolean opCancelled(void);
+static void opProgress(BRPhase phase, const char *bsdname);
+static Boolean reuseHeldHelper(struct updatingVol *up);
+static Boolean holdHelper(struct updatingVol *up);
+static uint64_t _usecsSince(uint64_t started);
 
 // ucopy = unlink & copy
 // no race for RPS, so install it first
@@ -484,13 +535,108 @@ finish:
     return;
 }
 
+/*******************************************************************************
+* updateHelper() runs the ucopy and activate phases on one mounted helper.
+* Callers roll back with revertState() and unmount afterwards.
+*
+* "expect up to date" -> just move the labels aside
+******************************************************************************/
+static int
+updateHelper(struct updatingVol *up)
+{
+    int result = 0;
+    char path[PATH_MAX];
+    struct stat sb;
+
+    opProgress(kBRPhaseUCopy, up->bsdname);
+
+    // if directed, do our best to nuke anything that doesn't belong
+    if (up->doSanitize) {
+        (void)sanitizeBoot(up);
+    }
+    if (up->cleanOnceDir && 
+            strlcpy(path, up->curMount, PATH_MAX) < PATH_MAX &&
+            strlcat(path, kBRBootOnceDir, PATH_MAX) < PATH_MAX &&
+            0 == stat(path, &sb)) {
+        (void)sdeepunlink(up->curbootfd, path);
+    }
+
+    // If files are missing, update up.do* to ensure we copy them
+    // (implicitly forcing their update in subsequent helpers).
+    checkBootContents(up);
+
+    // If breaking default config, mark helper as tainted
+    if (up->customSource && !up->customDest) {
+        markNotBRDefault(up->curbootfd, up->curMount, NULL, true);
+    }
+
+    if (up->doRPS && (result = ucopyRPS(up))) {
+        goto finish;            // new RPS content inactive
+    }
+    if (up->doMisc) {
+        (void)ucopyMisc(up);    // -> .new files
+    }
+    
+    // get the label out of the way (should be optional?)
+    // expectUpToDate => early boot -> harder to generate label?
+    if (up->opts & kBRUExpectUpToDate) {
+        if ((result = moveLabels(up))) {
+            goto finish;
+        }
+    } else {
+        if ((result = nukeBRLabels(up))) {
+            goto finish;
+        }
+    }
+    
+    if (up->doBooters && (result = ucopyBooters(up))) {                
+        goto finish;        // .old still active
+    }
+
+    // last chance to cancel; revertState() undoes everything so far
+    if (opCancelled()) {
+        result = ECANCELED; goto finish;
+    }
+    opProgress(kBRPhaseActivate, up->bsdname);
+
+    // If Recovery OS was available, we could swap these two and leave
+    // the Recovery OS blessed until RPS and new booters were activated.
+    if (up->doBooters && (result = activateBooters(up))) { // committed
+        goto finish;
+    }
+    // 10.x.n+1 booters remain compatible 10.x.n kernels?? (power outage!)
+    if (up->doRPS && (result = activateRPS(up))) {         // complete
+        goto finish;
+    }
+    if ((result = activateMisc(up))) {
+        goto finish;        // reverts label
+    }
+
+    // if restoring the default configuration, remove any taint
+    if (!up->customSource && !up->customDest) {
+        markNotBRDefault(up->curbootfd, up->curMount, NULL, false);
+    }
+
+    up->changestate = nothingSerious;
+    // -U -> updates are a warning
+    OSKextLog(NULL,kOSKextLogFileAccessFlag|((up->opts & kBRUExpectUpToDate)
+              ? kOSKextLogWarningLevel : kOSKextLogBasicLevel),
+              "Successfully updated %s%s.", up->bsdname, up->flatTarget);
+
+finish:
+    return result;
+}
+
 /*******************************************************************************
 * updateBootHelpers() updates per the passed-in struct updatingVol.
 * Sec: must ensure each target is one of the source's Apple_Boot partitions
 * Logically, callers provide up->boots,caches but initContext() also
 * fills in up->dasession.  Callers must also releaseContext() afterwards.
 *
-* "expect up to date" -> just move the labels aside
+* Each helper gets its own copy of *up so that its mount and rollback state
+* stay separate.  With DiskArb, all helpers are mounted (and later unmounted)
+* together so RAID/Fusion setups wait out DA latency once; the copies
+* themselves stay serial because safecalls.c relies on the process CWD.
 ******************************************************************************/
 static int
 updateBootHelpers(struct updatingVol *up)
@@ -498,6 +644,9 @@ updateBootHelpers(struct updatingVol *up)
     int errnum, result = 0;
     struct stat sb;
     CFIndex bootcount, bootupdates = 0;
+    struct updatingVol *helpers = NULL;     // must free
+    int *mountErrs = NULL;                  // must free
+    Boolean mountAll;
  
     if (up->curbootfd != -1) {
         close(up->curbootfd);
@@ -511,99 +660,82 @@ updateBootHelpers(struct updatingVol *up)
     }
 
     bootcount = CFArrayGetCount(up->boots);
+    helpers = calloc(bootcount, sizeof(*helpers));
+    mountErrs = calloc(bootcount, sizeof(*mountErrs));
+    if (bootcount && (!helpers || !mountErrs)) {
+        OSKextLogMemError();
+        result = ENOMEM; goto finish;
+    }
     for (up->bootIdx = 0; up->bootIdx < bootcount; up->bootIdx++) {
-        char path[PATH_MAX];
+        struct updatingVol *helper = &helpers[up->bootIdx];
 
-        up->changestate = nothingSerious;           // init state
-        if ((errnum = mountBoot(up))) {             // sets curMount
-            result = errnum; goto bootfail;  
-        }
+        // shares caches, boots, etc with *up (which releases them)
+        *helper = *up;
+        helper->curBoot = NULL;
+        helper->curMount[0] = '\0';
+        helper->curbootfd = -1;
+    }
 
-        // if directed, do our best to nuke anything that doesn't belong
-        if (up->doSanitize) {
-            (void)sanitizeBoot(up);
-        }
-        if (up->cleanOnceDir && 
-                strlcpy(path, up->curMount, PATH_MAX) < PATH_MAX &&
-                strlcat(path, kBRBootOnceDir, PATH_MAX) < PATH_MAX &&
-                0 == stat(path, &sb)) {
-            (void)sdeepunlink(up->curbootfd, path);
-        }
+    // mount(2) reuses one mount point, so only DiskArb can mount them all
+    mountAll = (up->dasession && bootcount > 1);
+    if (mountAll) {
+        mountBoots(helpers, bootcount, mountErrs);
+    }
 
-        // If files are missing, update up.do* to ensure we copy them
-        // (implicitly forcing their update in subsequent helpers).
-        checkBootContents(up);
+    for (up->bootIdx = 0; up->bootIdx < bootcount; up->bootIdx++) {
+        struct updatingVol *helper = &helpers[up->bootIdx];
 
-        // If breaking default config, mark helper as tainted
-        if (up->customSource && !up->customDest) {
-            markNotBRDefault(up->curbootfd, up->curMount, NULL, true);
+        // leave the remaining helpers as they are
+        if (opCancelled()) {
+            result = ECANCELED;
+            break;
         }
 
-        if (up->doRPS && (result = ucopyRPS(up))) {
-            goto bootfail;          // new RPS content inactive
-        }
-        if (up->doMisc) {
-            (void)ucopyMisc(up);    // -> .new files
+        // missing files found in one helper are copied to the rest
+        helper->doRPS = up->doRPS;
+        helper->doMisc = up->doMisc;
+        helper->doBooters = up->doBooters;
+        helper->changestate = nothingSerious;           // init state
+
+        errnum = mountAll ? mountErrs[up->bootIdx] : mountBoot(helper);
+        if (errnum == 0) {
+            errnum = updateHelper(helper);
         }
-        
-        // get the label out of the way (should be optional?)
-        // expectUpToDate => early boot -> harder to generate label?
-        if (up->opts & kBRUExpectUpToDate) {
-            if ((result = moveLabels(up))) {
-                goto bootfail;
-            }
+        if (errnum) {
+            result = errnum;
         } else {
-            if ((result = nukeBRLabels(up))) {
-                goto bootfail;
-            }
-        }
-        
-        if (up->doBooters && (result = ucopyBooters(up))) {                
-            goto bootfail;      // .old still active
-        }
-        // If Recovery OS was available, we could swap these two and leave
-        // the Recovery OS blessed until RPS and new booters were activated.
-        if (up->doBooters && (result = activateBooters(up))) { // committed
-            goto bootfail;
-        }
-        // 10.x.n+1 booters remain compatible 10.x.n kernels?? (power outage!)
-        if (up->doRPS && (result = activateRPS(up))) {         // complete
-            goto bootfail;
-        }
-        if ((result = activateMisc(up))) {
-            goto bootfail;      // reverts label
+            bootupdates++;      // loop success
         }
 
-        // if restoring the default configuration, remove any taint
-        if (!up->customSource && !up->customDest) {
-            markNotBRDefault(up->curbootfd, up->curMount, NULL, false);
-        }
+        up->doRPS = helper->doRPS;
+        up->doMisc = helper->doMisc;
+        up->doBooters = helper->doBooters;
 
-        up->changestate = nothingSerious;
-        bootupdates++;      // loop success
-        // -U -> updates are a warning
-        OSKextLog(NULL,kOSKextLogFileAccessFlag|((up->opts & kBRUExpectUpToDate)
-                  ? kOSKextLogWarningLevel : kOSKextLogBasicLevel),
-                  "Successfully updated %s%s.", up->bsdname, up->flatTarget);
-        
-bootfail:
         // clean up this helper only, no hard failures in the loop
-        if (up->changestate!=nothingSerious && !(up->opts&kBRUHelpersOptional)){
-            OSKextLog(NULL, up->errLogSpec,
+        if (helper->changestate != nothingSerious &&
+                !(helper->opts & kBRUHelpersOptional)) {
+            OSKextLog(NULL, helper->errLogSpec,
                       "Error updating helper partition %s, state %d: %s.",
-                      up->bsdname, up->changestate,
-                      bootReversionsStrings[up->changestate]);
+                      helper->bsdname, helper->changestate,
+                      bootReversionsStrings[helper->changestate]);
         }
         // unroll any changes we may have made
-        (void)revertState(up);     // smart enough to do nothing
+        (void)revertState(helper);     // smart enough to do nothing
         
         // clean up and unmount (flatTarget -> might not be a helper)
         // X could check for MNT_DONTBROWSE as a hint it's okay to unmount
-        if (nukeFallbacks(up)) {
-            OSKextLog(NULL, up->errLogSpec, "Warning: %s%s may be untidy.",
-                      up->bsdname, up->flatTarget);
+        opProgress(kBRPhaseNuke, helper->bsdname);
+        if (nukeFallbacks(helper)) {
+            OSKextLog(NULL, helper->errLogSpec, "Warning: %s%s may be untidy.",
+                      helper->bsdname, helper->flatTarget);
+        }
+        if (!mountAll) {
+            unmountBoot(helper);   // smart, handles "when to unmount" policy 
         }
-        unmountBoot(up);       // smart, handles "when to unmount" policy 
+    }
+
+    if (mountAll) {
+        unmountBoots(helpers, bootcount);
     }
 
     if (bootupdates != bootcount && !(up->opts&kBRUHelpersOptional)) {
@@ -618,6 +750,9 @@ bootfail:
     }
 
 finish:
+    SAFE_FREE(helpers);
+    SAFE_FREE(mountErrs);
+
     return result;
 }
 
@@ -637,6 +772,7 @@ finish:
  
    invalidateKextCache - if TRUE then we mimic 
    "sudo touch /System/Library/Extensions"
+   items - kBRUItem* bits from -rebuild-only; 0 checks every cache
 */
 // FIXME: eliminate unnecessary 'anyUpdates' parameter.  Callers can
 // detect whether caches were rebuilt by checking filesystem timestamps
@@ -646,6 +782,7 @@ checkRebuildAllCaches(struct bootCaches *caches,
                       int oodLogSpec,
                       Boolean invalidateKextCache,
                       Boolean earlyBootCheckUpdate,
+                      BRUpdateOpts_t items,
                       Boolean *anyUpdates)
 {
     int opres, result = ELAST + 1;  // no pathc() [yet]
@@ -683,8 +820,11 @@ checkRebuildAllCaches(struct bootCaches *caches,
     // should be holding it (caller should have called initContext() XX?).
     setenv("_com_apple_kextd_skiplocks", "1", 1);
     
-    // update the various kernel caches
-    if (invalidateKextCache ||
+    // update the various kernel caches (items limits to what kextd saw stale)
+    if (!BRU_WANTS_ITEM(items, kBRUItemKernelCache)) {
+        OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogArchiveFlag,
+                  "Primary kext cache update not requested.");
+    } else if (invalidateKextCache ||
         check_kext_boot_cache_file(caches,
                                    caches->kext_boot_cache_file->rpath,
                                    caches->kernelpath)) {
@@ -709,7 +849,8 @@ checkRebuildAllCaches(struct bootCaches *caches,
                   "Primary kext cache does not need update.");
     }
 #if DEV_KERNEL_SUPPORT
-    if (caches->extraKernelCachePaths) {
+    if (caches->extraKernelCachePaths &&
+        BRU_WANTS_ITEM(items, kBRUItemKernelCache)) {
         int             i;
         cachedPath *    cp;
         
@@ -745,7 +886,7 @@ checkRebuildAllCaches(struct bootCaches *caches,
     
     // Check/rebuild the CSFDE property cache which goes into the Apple_Boot.
     // It's less critical for booting, but more critical for security.
-    if (check_csfde(caches)) {
+    if (BRU_WANTS_ITEM(items, kBRUItemCSFDE) && check_csfde(caches)) {
         OSKextLog(NULL,oodLogSpec,"rebuilding %s",caches->erpropcache->rpath);
         if ((opres = rebuild_csfde_cache(caches))) {
             OSKextLog(NULL, kOSKextLogErrorLevel | kOSKextLogArchiveFlag,
@@ -763,7 +904,8 @@ checkRebuildAllCaches(struct bootCaches *caches,
     // check on the (optional) localized resources used by EFI Login
     // Match kextd shutdown policy in 16513211 and don't bother rebuilding
     // EFILoginLocalizations during early boot (probably wouldn't work anyway?).
-    if (!earlyBootCheckUpdate && check_loccache(caches)) {
+    if (!earlyBootCheckUpdate && BRU_WANTS_ITEM(items, kBRUItemLocCache) &&
+            check_loccache(caches)) {
         OSKextLog(NULL,oodLogSpec,"rebuilding %s",caches->efiloccache->rpath);
         if ((result = rebuild_loccache(caches))) {
             OSKextLog(NULL, kOSKextLogWarningLevel | kOSKextLogArchiveFlag,
@@ -845,11 +987,8 @@ initContext(struct updatingVol *up, CFURLRef srcVol, CFStringRef helperBSDName,
     }
 
     // attempt to configure a disk arb session
-    if ((up->dasession = DASessionCreate(nil))) {
-        // mountBoot and unmountBoot will spin the runloop for this DA session
-        DASessionScheduleWithRunLoop(up->dasession, CFRunLoopGetCurrent(),
-                kCFRunLoopDefaultMode);
-    } else {
+    // (mountBoot and unmountBoot will spin the runloop for this DA session)
+    if (!(up->dasession = copyHelperSession())) {
         OSKextLog(NULL, up->warnLogSpec, "Warning: proceeding w/o DiskArb");
     }
 
@@ -875,8 +1014,11 @@ releaseContext(struct updatingVol *up, int status)
     }
 
     if (up->dasession) {
-        DASessionUnscheduleFromRunLoop(up->dasession, CFRunLoopGetCurrent(),
-                kCFRunLoopDefaultMode);
+        // the shared session stays scheduled for any held helpers
+        if (up->dasession != sHeldSession) {
+            DASessionUnscheduleFromRunLoop(up->dasession, CFRunLoopGetCurrent(),
+                    kCFRunLoopDefaultMode);
+        }
         CFRelease(up->dasession);
         up->dasession = NULL;
     }
@@ -1092,9 +1234,11 @@ checkUpdateCachesAndBoots(CFURLRef volumeURL, BRUpdateOpts_t opts)
 
     // Do some real work updating caches *in* the source volume.
     // earlyBootCheckUpdate restricts which caches are rebuilt.
+    opProgress(kBRPhaseCaches, NULL);
     if ((opres = checkRebuildAllCaches(up.caches, oodLogSpec,
                                        (opts & kBRUInvalidateKextcache),
                                        earlyBootCheckUpdate,
+                                       opts & kBRUItemsMask,
                                        &anyCacheUpdates))) {
         result = opres; goto finish;    // error logged by function
     }
@@ -1103,7 +1247,8 @@ checkUpdateCachesAndBoots(CFURLRef volumeURL, BRUpdateOpts_t opts)
     cachesUpToDate = true;
     
     // 9455881: If requested, only update the caches
-    if (opts & kBRUCachesOnly) {
+    // (kextd leaves out 'helpers' from -rebuild-only when they look current)
+    if ((opts & kBRUCachesOnly) || !BRU_WANTS_ITEM(opts, kBRUItemHelpers)) {
         goto doneUpdatingHelpers;
     }
 
@@ -1415,10 +1560,11 @@ BRCopyBootFilesToDir(CFURLRef srcVol,
 
     // Make sure all caches are up to date on the source
     // (undefined if OOD & system's kext management/EFILogin can't rebuild)
+    opProgress(kBRPhaseCaches, NULL);
     errnum = checkRebuildAllCaches(up.caches, kBRCheckLogSpec, 
                                    (opts & kBRUInvalidateKextcache),
                    (opts & kBRUExpectUpToDate) && (opts & kBRUEarlyBoot),
-                                   NULL);
+                                   opts & kBRUItemsMask, NULL);
     if (errnum) {
         result = errnum; goto finish;
     }
@@ -1675,6 +1821,7 @@ BREraseBootFiles(CFURLRef srcVolRoot, CFStringRef helperBSDName)
     if ((opres = mountBoot(&up))) {        // sets curMount
         result = opres; goto finish;
     }
+    opProgress(kBRPhaseNuke, up.bsdname);
 
     // generally best effort
 
@@ -1749,6 +1896,223 @@ finish:
 }
 
 
+/******************************************************************************
+* BR*Async() queue the synchronous entry points on sBROpQueue (see bootroot.h).
+* Each work block releases what its entry point retained; it is called with
+* cancelled set if the operation never gets to run.
+******************************************************************************/
+typedef OSStatus (^BROpWork)(Boolean cancelled);
+
+static Boolean
+opCancelled(void)
+{
+    return sCurrentOp && sCurrentOp->cancelled;
+}
+
+static void
+opProgress(BRPhase phase, const char *bsdname)
+{
+    struct __BROperation *op = sCurrentOp;
+    CFStringRef helper = NULL;
+
+    if (!op || !op->progress)   return;
+
+    if (bsdname && bsdname[0]) {
+        helper = CFStringCreateWithCString(nil, bsdname, kCFStringEncodingUTF8);
+    }
+    OSAtomicIncrement32Barrier(&op->refs);
+    dispatch_async(op->queue, ^{
+        op->progress(op, phase, helper);
+        if (helper)     CFRelease(helper);
+        BRReleaseOperation(op);
+    });
+}
+
+static BROperationRef
+startOp(dispatch_queue_t queue, BRProgressHandler progress,
+        BRCompletionHandler completion, BROpWork work)
+{
+    static dispatch_once_t once;
+    struct __BROperation *op = NULL;
+
+    if (!queue || !completion)      goto finish;
+
+    dispatch_once(&once, ^{
+        sBROpQueue = dispatch_queue_create("com.apple.libBootRoot.async", NULL);
+    });
+    if (!sBROpQueue || !(op = calloc(1, sizeof(*op)))) {
+        OSKextLogMemError();
+        goto finish;
+    }
+    op->refs = 2;                   // caller's and sBROpQueue's
+    op->queue = queue;
+    dispatch_retain(queue);
+    op->progress = progress ? Block_copy(progress) : NULL;
+    op->completion = Block_copy(completion);
+
+    dispatch_async(sBROpQueue, ^{
+        OSStatus result;
+
+        sCurrentOp = op;
+        result = work(op->cancelled != 0);
+        sCurrentOp = NULL;
+
+        dispatch_async(op->queue, ^{
+            op->completion(op, result);
+            BRReleaseOperation(op);
+        });
+    });
+
+finish:
+    if (!op) {
+        (void)work(true);           // just releases its arguments
+    }
+    return op;
+}
+
+void
+BRCancelOperation(BROperationRef op)
+{
+    if (op) {
+        OSAtomicCompareAndSwap32Barrier(0, 1, &op->cancelled);
+    }
+}
+
+void
+BRReleaseOperation(BROperationRef op)
+{
+    if (!op || OSAtomicDecrement32Barrier(&op->refs) > 0)     return;
+
+    if (op->progress)   Block_release(op->progress);
+    Block_release(op->completion);
+    dispatch_release(op->queue);
+    free(op);
+}
+
+
+/******************************************************************************
+* Statistics (see bootroot.h); the mount and unmount paths update sBRStats.
+******************************************************************************/
+static uint64_t
+_usecsSince(uint64_t started)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0) {
+        (void)mach_timebase_info(&timebase);
+    }
+    return (mach_absolute_time() - started) * timebase.numer /
+           timebase.denom / 1000;
+}
+
+void
+BRGetStatistics(BRStatistics *stats)
+{
+    if (stats)      *stats = sBRStats;
+}
+
+void
+BRResetStatistics(void)
+{
+    bzero(&sBRStats, sizeof(sBRStats));
+}
+
+BROperationRef
+BRUpdateBootFilesAsync(CFURLRef volRoot, Boolean force,
+                       dispatch_queue_t queue,
+                       BRProgressHandler progress,
+                       BRCompletionHandler completion)
+{
+    if (volRoot)    CFRetain(volRoot);
+
+    return startOp(queue, progress, completion, ^(Boolean cancelled) {
+        OSStatus result = ECANCELED;
+
+        if (!cancelled) {
+            result = BRUpdateBootFiles(volRoot, force);
+        }
+        SAFE_RELEASE(volRoot);
+        return result;
+    });
+}
+
+BROperationRef
+BRCopyBootFilesToDirAsync(CFURLRef srcVol,
+                          CFURLRef initialRoot,
+                          CFDictionaryRef bootPrefOverrides,
+                          CFStringRef targetBSDName,
+                          CFURLRef targetDir,
+                          BRBlessStyle blessSpec,
+                          CFStringRef pickerLabel,
+                          BRCopyFilesOpts opts,
+                          dispatch_queue_t queue,
+                          BRProgressHandler progress,
+                          BRCompletionHandler completion)
+{
+    if (srcVol)             CFRetain(srcVol);
+    if (initialRoot)        CFRetain(initialRoot);
+    if (bootPrefOverrides)  CFRetain(bootPrefOverrides);
+    if (targetBSDName)      CFRetain(targetBSDName);
+    if (targetDir)          CFRetain(targetDir);
+    if (pickerLabel)        CFRetain(pickerLabel);
+
+    return startOp(queue, progress, completion, ^(Boolean cancelled) {
+        OSStatus result = ECANCELED;
+
+        if (!cancelled) {
+            result = BRCopyBootFilesToDir(srcVol, initialRoot,
+                                          bootPrefOverrides, targetBSDName,
+                                          targetDir, blessSpec, pickerLabel,
+                                          opts);
+        }
+        SAFE_RELEASE(srcVol);
+        SAFE_RELEASE(initialRoot);
+        SAFE_RELEASE(bootPrefOverrides);
+        SAFE_RELEASE(targetBSDName);
+        SAFE_RELEASE(targetDir);
+        SAFE_RELEASE(pickerLabel);
+        return result;
+    });
+}
+
+BROperationRef
+BRCopyBootFilesAsync(CFURLRef srcVol,
+                     CFURLRef initialRoot,
+                     CFStringRef helperBSDName,
+                     CFDictionaryRef bootPrefOverrides,
+                     dispatch_queue_t queue,
+                     BRProgressHandler progress,
+                     BRCompletionHandler completion)
+{
+    return BRCopyBootFilesToDirAsync(srcVol, initialRoot, bootPrefOverrides,
+                                     helperBSDName, NULL /*helperDir*/,
+                                     kBRBlessFSDefault, NULL /*pickerLabel*/,
+                                     kBROptsNone, queue, progress, completion);
+}
+
+BROperationRef
+BREraseBootFilesAsync(CFURLRef srcVolRoot,
+                      CFStringRef helperBSDName,
+                      dispatch_queue_t queue,
+                      BRProgressHandler progress,
+                      BRCompletionHandler completion)
+{
+    if (srcVolRoot)     CFRetain(srcVolRoot);
+    if (helperBSDName)  CFRetain(helperBSDName);
+
+    return startOp(queue, progress, completion, ^(Boolean cancelled) {
+        OSStatus result = ECANCELED;
+
+        if (!cancelled) {
+            result = BREraseBootFiles(srcVolRoot, helperBSDName);
+        }
+        SAFE_RELEASE(srcVolRoot);
+        SAFE_RELEASE(helperBSDName);
+        return result;
+    });
+}
+
+
 /******************************************************************************
 * revertState() rolls back incomplete changes
 ******************************************************************************/
@@ -1824,36 +2188,64 @@ finish:
     return rval;
 };
 
+// up->bsdname <- up->boots[up->bootIdx]
+static Boolean
+_helperBSDName(struct updatingVol *up)
+{
+    CFStringRef str;
+
+    str = (CFStringRef)CFArrayGetValueAtIndex(up->boots, up->bootIdx);
+    if (!str || CFGetTypeID(str) != CFStringGetTypeID()) {
+        return false;
+    }
+
+    return CFStringGetFileSystemRepresentation(str, up->bsdname,
+                                               DEVMAXPATHSIZE);
+}
+
 /******************************************************************************
 * mountBoot digs in for the root, and mounts up the Apple_Boots
 * mountpoint -> up->curMount
 ******************************************************************************/
+// start a DiskArb mount of up->bsdname; _daDone() will replace *dis
 static int
-_mountBootDA(struct updatingVol *up)
+_requestMountDA(struct updatingVol *up, DADissenterRef *dis)
 {
-    int rval = ELAST + 1;
     CFStringRef mountargs[] = { CFSTR("perm"), CFSTR("nobrowse"), NULL };
-    DADissenterRef dis = (void*)kCFNull;
-    CFDictionaryRef ddesc = NULL;
-    CFURLRef volURL;
 
+    *dis = NULL;
+    if (reuseHeldHelper(up)) {
+        sBRStats.heldReuses++;
+        return 0;               // _finishMountDA() sees curMount
+    }
     if (!(up->curBoot=DADiskCreateFromBSDName(nil,up->dasession,up->bsdname))){
-        goto finish;
+        OSKextLog(NULL, up->errLogSpec,"Failed to mount helper partition.");
+        return ELAST + 1;
     }
     
     OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
               "Mounting %s...", up->bsdname);
 
     // DADiskMountWithArgument might call _daDone before it returns (e.g. if it
-    // knows your request is impossible ...)
-    // _daDone updates our 'dis[senter]'
+    // knows your request is impossible ...) so callers check for kCFNull
+    // before CFRunLoopRun().  _daDone updates our 'dis[senter]'
+    *dis = (void*)kCFNull;
+    sBRStats.mounts++;
+    sBRStats.diskArbRequests++;
     DADiskMountWithArguments(up->curBoot, NULL/*mnt*/,kDADiskMountOptionDefault,
-                             _daDone, &dis, mountargs);
+                             _daDone, dis, mountargs);
+
+    return 0;
+}
+
+// stash the mountpoint once _daDone() has answered; releases dis
+static int
+_finishMountDA(struct updatingVol *up, DADissenterRef dis)
+{
+    int rval = ELAST + 1;
+    CFDictionaryRef ddesc = NULL;
+    CFURLRef volURL;
 
-    // ... so we use kCFNull and check the value before CFRunLoopRun()
-    if (dis == (void*)kCFNull) {
-        CFRunLoopRun();         // stopped by _daDone (which updates 'dis')
-    }
     if (dis) {
         rval = DADissenterGetStatus(dis);
         // only an error if it's not already mounted
@@ -1862,6 +2254,12 @@ _mountBootDA(struct updatingVol *up)
         }
     }
 
+    // held from an earlier operation
+    if (up->curMount[0]) {
+        rval = 0;
+        goto finish;
+    }
+
     // get and stash the mountpoint of the boot partition
     if (!(ddesc = DADiskCopyDescription(up->curBoot)))  goto finish;
     volURL = CFDictionaryGetValue(ddesc, kDADiskDescriptionVolumePathKey);
@@ -1892,6 +2290,33 @@ finish:
     return rval;
 }
 
+static int
+_mountBootDA(struct updatingVol *up)
+{
+    int rval;
+    DADissenterRef dis;
+
+    if ((rval = _requestMountDA(up, &dis)))     return rval;
+    if (dis == (void*)kCFNull) {
+        CFRunLoopRun();         // stopped by _daDone (which updates 'dis')
+    }
+
+    return _finishMountDA(up, dis);
+}
+
+// any DiskArb requests still unanswered?
+static Boolean
+_daPending(DADissenterRef dis[], CFIndex count)
+{
+    CFIndex i;
+
+    for (i = 0; i < count; i++) {
+        if (dis[i] == (void*)kCFNull)   return true;
+    }
+
+    return false;
+}
+
 /* _mountBootBuiltIn() will mount with mount(2) in /var/run.  Use
  * _findMountedhelper() first to see if it's already mounted. */
 // Creating BRMNT_PARENT instead of using _PATH_VARRUN because the latter
@@ -1942,6 +2367,7 @@ _mountBootBuiltIn(struct updatingVol *up)
     // _PATH_DEV contains a trailing '/'
     (void)snprintf(devpath, sizeof(devpath), _PATH_DEV "%s", up->bsdname);
     hfsargs.fspec = devpath;
+    sBRStats.mounts++;
     if ((bsderr = mount("hfs", BRMNT, MNT_DONTBROWSE, &hfsargs))) {
         rval = bsderr; LOGERRxlate(up, "mount", BRMNT, rval); goto finish;
     }
@@ -2008,26 +2434,19 @@ finish:
     return rval;
 }
 
+static int _checkMountedBoot(struct updatingVol *up);
+
 static int
 mountBoot(struct updatingVol *up)
 {
     int errnum, rval = ELAST + 1;
-    CFStringRef str;
-    struct statfs bsfs;
-    uint32_t mntgoal;
-    struct stat sb;
+    uint64_t started = mach_absolute_time();
 
     OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
               "Mounting helper partition...");
 
     // request the Apple_Boot mount
-    str = (CFStringRef)CFArrayGetValueAtIndex(up->boots, up->bootIdx);
-    if (!str || CFGetTypeID(str) != CFStringGetTypeID()) {
-        goto finish;
-    }
-    if (!CFStringGetFileSystemRepresentation(str,up->bsdname,DEVMAXPATHSIZE)){
-        goto finish;
-    }
+    if (!_helperBSDName(up))        goto finish;
     if (up->dasession) {
         if ((errnum = _mountBootDA(up))) {
             rval = errnum; goto finish;     // error logged by function
@@ -2037,6 +2456,27 @@ mountBoot(struct updatingVol *up)
             rval = errnum; goto finish;     // error logged by function
     }
 
+    rval = _checkMountedBoot(up);
+
+finish:
+    if (rval != 0 && (up->curBoot || up->curMount[0])) {
+        (void)unmountBoot(up);      // undo anything significant
+    }
+    sBRStats.mountUsecs += _usecsSince(started);
+
+    return rval;
+}
+
+/* _checkMountedBoot() vets a freshly-mounted helper and opens curbootfd.
+ * Callers unmount on failure. */
+static int
+_checkMountedBoot(struct updatingVol *up)
+{
+    int rval = ELAST + 1;
+    struct statfs bsfs;
+    uint32_t mntgoal;
+    struct stat sb;
+
     // Sec: get a non-spoofable handle to the current helper (extend trust)
     if (-1 == (up->curbootfd = open(up->curMount, O_RDONLY, 0))) {
         rval = errno; LOGERRxlate(up, up->curMount, NULL, rval); goto finish;
@@ -2087,22 +2527,89 @@ mountBoot(struct updatingVol *up)
     rval = 0;
 
 finish:
-    if (rval != 0 && (up->curBoot || up->curMount[0])) {
-        (void)unmountBoot(up);      // undo anything significant
+    return rval;
+}
+
+/******************************************************************************
+* mountBoots() requests DiskArb mounts for all helpers before waiting on any.
+* errs[i] is what mountBoot() would return for helpers[i]; those that fail
+* are unmounted again.
+******************************************************************************/
+static void
+mountBoots(struct updatingVol *helpers, CFIndex count, int errs[])
+{
+    CFIndex i;
+    DADissenterRef *dis = NULL;         // must free (entries released)
+    uint64_t started = mach_absolute_time();
+
+    if (!(dis = calloc(count, sizeof(*dis)))) {
+        OSKextLogMemError();
+        for (i = 0; i < count; i++) {
+            errs[i] = ENOMEM;
+        }
+        goto finish;
     }
 
-    return rval;
+    OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+              "Mounting %ld helper partitions...", (long)count);
+
+    for (i = 0; i < count; i++) {
+        errs[i] = ELAST + 1;
+        if (!_helperBSDName(&helpers[i]))     continue;
+        errs[i] = _requestMountDA(&helpers[i], &dis[i]);
+    }
+
+    // each _daDone stops the runloop; spin until every request is answered
+    while (_daPending(dis, count)) {
+        CFRunLoopRun();
+    }
+
+    for (i = 0; i < count; i++) {
+        struct updatingVol *up = &helpers[i];
+
+        if (errs[i] == 0) {
+            errs[i] = _finishMountDA(up, dis[i]);
+        }
+        if (errs[i] == 0) {
+            errs[i] = _checkMountedBoot(up);
+        }
+        if (errs[i] != 0 && (up->curBoot || up->curMount[0])) {
+            (void)unmountBoot(up);  // undo anything significant
+        }
+    }
+
+finish:
+    sBRStats.mountUsecs += _usecsSince(started);
+    SAFE_FREE(dis);
 }
 
 /******************************************************************************
 * unmountBoot 
 * attempt to unmount; no worries on failure
 ******************************************************************************/
+// log and forget the answer to DADiskUnmount(); releases dis
+static void
+_finishUnmountDA(struct updatingVol *up, DADissenterRef dis)
+{
+    // if that didn't work, just log
+    if (dis) {
+        OSKextLog(NULL, up->warnLogSpec,
+                  "%s didn't unmount, leaving mounted", up->bsdname);
+        if (dis != (void*)kCFNull) {
+            CFRelease(dis);
+        }
+    }
+    up->curMount[0] = '\0';     // only try to unmount once
+    CFRelease(up->curBoot);
+    up->curBoot = NULL;
+}
+
 static void
 unmountBoot(struct updatingVol *up)
 {
     int errnum = 0;
     DADissenterRef dis = (void*)kCFNull;
+    uint64_t started;
 
     // clean up curbootfd
     if (up->curbootfd != -1) {
@@ -2113,39 +2620,38 @@ unmountBoot(struct updatingVol *up)
     // specifying a target directory => might not be a helper volume!
     if (up->flatTarget[0])      return;
     
+    // keep it around for the next operation?
+    if (holdHelper(up)) {
+        return;
+    }
+
     if (up->curMount[0]) {
         OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
                   "Unmounting helper partition %s.", up->bsdname);
     }
+    started = mach_absolute_time();
 
     // clean up any DiskArb-mounted filesystem
     if (up->curBoot) {
+        sBRStats.unmounts++;
+        sBRStats.diskArbRequests++;
         // _daDone populates 'dis'[senter]
         DADiskUnmount(up->curBoot,kDADiskMountOptionDefault,_daDone,&dis);
         if (dis == (void*)kCFNull) {    // DA.Unmount can call _daDone
             CFRunLoopRun();
         }
-
-        // if that didn't work, just log
-        if (dis) {
-            OSKextLog(NULL, up->warnLogSpec,
-                      "%s didn't unmount, leaving mounted", up->bsdname);
-            if (dis != (void*)kCFNull) {
-                CFRelease(dis);
-            }
-        }
-        up->curMount[0] = '\0';     // only try to unmount once
-        CFRelease(up->curBoot);
-        up->curBoot = NULL;
+        _finishUnmountDA(up, dis);
     }
 
     // unmount anything mounted by _mountBuiltIn()
     if (up->dasession == NULL && up->curMount[0] != '\0') {
+        sBRStats.unmounts++;
         if (unmount(up->curMount, 0)) {
             errnum = errno;
         }
         up->curMount[0] = '\0';     // only try to unmount once
     }
+    sBRStats.unmountUsecs += _usecsSince(started);
 
     if (errnum) {
         OSKextLog(NULL, up->errLogSpec,
@@ -2155,6 +2661,258 @@ unmountBoot(struct updatingVol *up)
 }
 
 
+/******************************************************************************
+* unmountBoots() is unmountBoot() for a set of DiskArb-mounted helpers,
+* waiting on all the unmounts together
+******************************************************************************/
+static void
+unmountBoots(struct updatingVol *helpers, CFIndex count)
+{
+    CFIndex i;
+    DADissenterRef *dis = NULL;         // must free (entries released)
+
+    // without the array, unmountBoot() below does them one at a time
+    if ((dis = calloc(count, sizeof(*dis)))) {
+        uint64_t started = mach_absolute_time();
+
+        for (i = 0; i < count; i++) {
+            struct updatingVol *up = &helpers[i];
+
+            // same policy as unmountBoot()
+            if (!up->curBoot || up->flatTarget[0])      continue;
+            if (up->curbootfd != -1) {
+                close(up->curbootfd);
+                up->curbootfd = -1;
+            }
+            if (holdHelper(up))                         continue;
+            if (up->curMount[0]) {
+                OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+                          "Unmounting helper partition %s.", up->bsdname);
+            }
+            // _daDone populates 'dis'[senter]
+            dis[i] = (void*)kCFNull;
+            sBRStats.unmounts++;
+            sBRStats.diskArbRequests++;
+            DADiskUnmount(up->curBoot, kDADiskMountOptionDefault,
+                          _daDone, &dis[i]);
+        }
+
+        while (_daPending(dis, count)) {
+            CFRunLoopRun();
+        }
+
+        for (i = 0; i < count; i++) {
+            if (helpers[i].curBoot && !helpers[i].flatTarget[0]) {
+                _finishUnmountDA(&helpers[i], dis[i]);
+            }
+        }
+        sBRStats.unmountUsecs += _usecsSince(started);
+    } else {
+        OSKextLogMemError();
+    }
+
+    // anything left over (curbootfd, etc)
+    for (i = 0; i < count; i++) {
+        unmountBoot(&helpers[i]);
+    }
+
+    SAFE_FREE(dis);
+}
+
+
+/******************************************************************************
+* Held helpers (see sHeldHelpers above)
+******************************************************************************/
+// unmount an unused held helper and free its slot
+static void
+_unmountHeldHelper(struct heldHelper *held)
+{
+    DADissenterRef dis = (void*)kCFNull;
+    uint64_t started;
+
+    OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+              "Unmounting helper partition %s.", held->bsdname);
+
+    // _daDone populates 'dis'[senter]
+    started = mach_absolute_time();
+    sBRStats.unmounts++;
+    sBRStats.diskArbRequests++;
+    DADiskUnmount(held->disk, kDADiskMountOptionDefault, _daDone, &dis);
+    if (dis == (void*)kCFNull) {    // DA.Unmount can call _daDone
+        CFRunLoopRun();
+    }
+    sBRStats.unmountUsecs += _usecsSince(started);
+    if (dis) {
+        OSKextLog(NULL, kOSKextLogArchiveFlag | kOSKextLogWarningLevel,
+                  "%s didn't unmount, leaving mounted", held->bsdname);
+        if (dis != (void*)kCFNull) {
+            CFRelease(dis);
+        }
+    }
+
+    CFRelease(held->disk);
+    bzero(held, sizeof(*held));
+}
+
+static void
+_unmountIdleHelpers(void)
+{
+    int i;
+
+    if (sHeldRunLoop != CFRunLoopGetCurrent())      return;
+
+    for (i = 0; i < kMaxHeldHelpers; i++) {
+        if (sHeldHelpers[i].disk && sHeldHelpers[i].refs == 0) {
+            _unmountHeldHelper(&sHeldHelpers[i]);
+        }
+    }
+}
+
+static void
+_heldHelperTimerFired(CFRunLoopTimerRef timer __unused, void *info __unused)
+{
+    int i;
+
+    _unmountIdleHelpers();
+
+    // stop waking up once nothing is held
+    for (i = 0; i < kMaxHeldHelpers; i++) {
+        if (sHeldHelpers[i].disk)   return;
+    }
+    CFRunLoopTimerInvalidate(sHeldTimer);
+    SAFE_RELEASE_NULL(sHeldTimer);
+}
+
+/* Shared DA session for helper mounts.  Contexts on other threads get a
+ * private session (and so never hold helpers). */
+static DASessionRef
+copyHelperSession(void)
+{
+    DASessionRef rval = NULL;
+
+    if (sHeldSession && sHeldRunLoop == CFRunLoopGetCurrent()) {
+        rval = (DASessionRef)CFRetain(sHeldSession);
+        goto finish;
+    }
+
+    if (!(rval = DASessionCreate(nil)))     goto finish;
+    DASessionScheduleWithRunLoop(rval, CFRunLoopGetCurrent(),
+                                 kCFRunLoopDefaultMode);
+
+    // GCD threads come and go, so BR*Async() operations never hold helpers
+    if (!sHeldSession && !sCurrentOp) {
+        sHeldSession = (DASessionRef)CFRetain(rval);
+        sHeldRunLoop = CFRunLoopGetCurrent();
+        // kextcache, bless, etc exit long before any timer fires
+        atexit(_unmountIdleHelpers);
+    }
+
+finish:
+    return rval;
+}
+
+// picks up a held mount of up->bsdname if it's still there
+static Boolean
+reuseHeldHelper(struct updatingVol *up)
+{
+    Boolean rval = false;
+    struct statfs sfs;
+    int i;
+
+    if (!up->dasession || up->dasession != sHeldSession)    goto finish;
+    if (sHeldRunLoop != CFRunLoopGetCurrent())              goto finish;
+
+    for (i = 0; i < kMaxHeldHelpers; i++) {
+        struct heldHelper *held = &sHeldHelpers[i];
+
+        if (!held->disk || strcmp(held->bsdname, up->bsdname))  continue;
+
+        // someone else may have unmounted (or remounted) it meanwhile
+        if (statfs(held->mount, &sfs) != 0 ||
+                strncmp(sfs.f_mntfromname, _PATH_DEV, strlen(_PATH_DEV)) ||
+                strcmp(sfs.f_mntfromname + strlen(_PATH_DEV), held->bsdname)) {
+            if (held->refs == 0) {
+                CFRelease(held->disk);
+                bzero(held, sizeof(*held));
+            }
+            goto finish;
+        }
+
+        OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+                  "Reusing %s mounted at %s.", held->bsdname, held->mount);
+        up->curBoot = (DADiskRef)CFRetain(held->disk);
+        strlcpy(up->curMount, held->mount, sizeof(up->curMount));
+        held->refs++;
+        rval = true;
+        break;
+    }
+
+finish:
+    return rval;
+}
+
+/* Instead of unmounting a DiskArb helper, keep it (and arm the timer).
+ * Returns false if it should be unmounted now. */
+static Boolean
+holdHelper(struct updatingVol *up)
+{
+    Boolean rval = false;
+    struct heldHelper *held = NULL, *empty = NULL;
+    CFAbsoluteTime fireTime;
+    int i;
+
+    if (!up->curBoot || !up->curMount[0] || up->flatTarget[0])  goto finish;
+    if (!up->dasession || up->dasession != sHeldSession)    goto finish;
+    if (sHeldRunLoop != CFRunLoopGetCurrent())              goto finish;
+
+    for (i = 0; i < kMaxHeldHelpers; i++) {
+        if (sHeldHelpers[i].disk &&
+                strcmp(sHeldHelpers[i].bsdname, up->bsdname) == 0) {
+            held = &sHeldHelpers[i];
+            break;
+        }
+        if (!sHeldHelpers[i].disk && !empty) {
+            empty = &sHeldHelpers[i];
+        }
+    }
+
+    if (held) {
+        if (held->refs > 0)     held->refs--;
+        if (held->refs == 0) {
+            strlcpy(held->mount, up->curMount, sizeof(held->mount));
+        }
+    } else if (empty) {
+        held = empty;
+        strlcpy(held->bsdname, up->bsdname, sizeof(held->bsdname));
+        strlcpy(held->mount, up->curMount, sizeof(held->mount));
+        held->disk = (DADiskRef)CFRetain(up->curBoot);
+        held->refs = 0;
+    } else {
+        goto finish;            // table full; unmount as usual
+    }
+
+    // (re)start the countdown
+    fireTime = CFAbsoluteTimeGetCurrent() + kHeldHelperDelay;
+    if (sHeldTimer) {
+        CFRunLoopTimerSetNextFireDate(sHeldTimer, fireTime);
+    } else if ((sHeldTimer = CFRunLoopTimerCreate(nil, fireTime,
+                                   kHeldHelperDelay, 0, 0,
+                                   _heldHelperTimerFired, NULL))) {
+        CFRunLoopAddTimer(sHeldRunLoop, sHeldTimer, kCFRunLoopDefaultMode);
+    }
+
+    OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
+              "Keeping %s mounted for reuse.", up->bsdname);
+    up->curMount[0] = '\0';
+    CFRelease(up->curBoot);
+    up->curBoot = NULL;
+    rval = true;
+
+finish:
+    return rval;
+}
+
+
 /******************************************************************************
 * ucopyRPS unlinks old/copies new RPS content w/o activating
 * RPS files are considered important -- non-zero file sizes only!
@@ -2371,6 +3129,249 @@ finish:
     return rval;
 }
 
+/******************************************************************************
+* Source digests let ucopyRPS() and ucopyMisc() skip files the helper already
+* has.  Each item copied to a helper is tagged with a digest of its source
+* (size, times, and inode of every file; or the generated data) and compared
+* on the next update.  A missing or stale tag just means another copy.
+******************************************************************************/
+#define kBRSourceDigestXattr    "com.apple.kext_tools.srcdigest"
+
+typedef unsigned char srcDigest[CC_SHA256_DIGEST_LENGTH];
+
+static int
+compareFTSNames(const FTSENT **a, const FTSENT **b)
+{
+    return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+// fold srcpath (and anything under it) into ctx; size is -1 for directories
+static int
+digestSourceItem(CC_SHA256_CTX *ctx, char *srcpath, off_t *size)
+{
+    int rval = -1;
+    char *paths[2] = { srcpath, NULL };
+    FTS *fts = NULL;
+    FTSENT *fent;
+
+    fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, compareFTSNames);
+    if (!fts)       goto finish;
+
+    errno = 0;
+    while ((fent = fts_read(fts))) {
+        switch (fent->fts_info) {
+            case FTS_D:
+            case FTS_F:
+            case FTS_SL:
+                // any rewrite changes at least one of these
+                CC_SHA256_Update(ctx, fent->fts_path, fent->fts_pathlen);
+                CC_SHA256_Update(ctx, &fent->fts_statp->st_size,
+                                 sizeof(fent->fts_statp->st_size));
+                CC_SHA256_Update(ctx, &fent->fts_statp->st_mtimespec,
+                                 sizeof(fent->fts_statp->st_mtimespec));
+                CC_SHA256_Update(ctx, &fent->fts_statp->st_ctimespec,
+                                 sizeof(fent->fts_statp->st_ctimespec));
+                CC_SHA256_Update(ctx, &fent->fts_statp->st_ino,
+                                 sizeof(fent->fts_statp->st_ino));
+                if (fent->fts_level == FTS_ROOTLEVEL) {
+                    *size = (fent->fts_info == FTS_F) ?
+                            fent->fts_statp->st_size : -1;
+                }
+                break;
+
+            case FTS_DP:        // already seen on the way down
+                break;
+
+            default:            // FTS_NS, FTS_DNR, FTS_ERR, ...
+                errno = fent->fts_errno;
+                goto finish;
+        }
+    }
+    if (errno)      goto finish;
+
+    rval = 0;
+
+finish:
+    if (fts)        fts_close(fts);
+
+    return rval;
+}
+
+static int
+digestSourceFile(char *srcpath, srcDigest digest, off_t *size)
+{
+    CC_SHA256_CTX ctx;
+
+    CC_SHA256_Init(&ctx);
+    if (digestSourceItem(&ctx, srcpath, size))      return -1;
+    CC_SHA256_Final(digest, &ctx);
+
+    return 0;
+}
+
+// what ucopyRPS() would put in the helper for item
+static int
+digestRPSItem(struct updatingVol *up, cachedPath *item, char *srcpath,
+              srcDigest digest, off_t *size)
+{
+    int rval = -1;
+    CC_SHA256_CTX ctx;
+    CFDataRef data = NULL;      // must release
+    Boolean fdeItem = (item == up->caches->erpropcache && up->csfdeprops &&
+                       up->onAPM == false);
+
+    CC_SHA256_Init(&ctx);
+    *size = -1;
+
+    if (item == up->caches->bootconfig) {
+        // Boot.plist is generated by writeBootPrefs()
+        data = createBootPrefData(up, up->host_uuid, up->bpoverrides);
+        if (!data) {
+            errno = ENOMEM; goto finish;
+        }
+        *size = CFDataGetLength(data);
+        CC_SHA256_Update(&ctx, CFDataGetBytePtr(data), (CC_LONG)*size);
+    } else {
+        if (digestSourceItem(&ctx, srcpath, size) &&
+                !(fdeItem && errno == ENOENT)) {
+            goto finish;
+        }
+        // _writeFDEPropsToHelper() encrypts these for this helper
+        if (fdeItem) {
+            *size = -1;
+            data = CFPropertyListCreateData(NULL, up->csfdeprops,
+                                  kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+            if (!data) {
+                errno = ENOMEM; goto finish;
+            }
+            CC_SHA256_Update(&ctx, CFDataGetBytePtr(data),
+                             (CC_LONG)CFDataGetLength(data));
+            CC_SHA256_Update(&ctx, up->bsdname, (CC_LONG)strlen(up->bsdname));
+        }
+    }
+
+    CC_SHA256_Final(digest, &ctx);
+    rval = 0;
+
+finish:
+    SAFE_RELEASE(data);
+
+    return rval;
+}
+
+// is dstpath tagged with digest (and, if size != -1, that big)?
+static Boolean
+helperItemMatches(struct updatingVol *up, const char *dstpath,
+                  srcDigest digest, off_t size)
+{
+    Boolean rval = false;
+    int fd = -1;
+    struct stat sb;
+    srcDigest tagged;
+
+    if (-1 == (fd = sopen(up->curbootfd, dstpath, O_RDONLY, 0)))  goto finish;
+    if (fstat(fd, &sb))                                 goto finish;
+    if (size != -1 && sb.st_size != size)               goto finish;
+    if (fgetxattr(fd, kBRSourceDigestXattr, tagged, sizeof(tagged), 0, 0)
+            != sizeof(tagged)) {
+        goto finish;
+    }
+
+    rval = (memcmp(tagged, digest, sizeof(tagged)) == 0);
+
+finish:
+    if (fd != -1)   close(fd);
+
+    return rval;
+}
+
+// best effort: an untagged item just gets copied again next time
+static void
+tagHelperItem(struct updatingVol *up, const char *dstpath, srcDigest digest)
+{
+    int fd = -1;
+
+    if (-1 == (fd = sopen(up->curbootfd, dstpath, O_RDONLY, 0)))  goto finish;
+    if (fsetxattr(fd, kBRSourceDigestXattr, digest, sizeof(srcDigest), 0, 0)) {
+        OSKextLog(NULL, up->warnLogSpec, "Warning: couldn't tag %s: %s",
+                  dstpath, strerror(errno));
+    }
+
+finish:
+    if (fd != -1)   close(fd);
+}
+
+// PR-5115900 - call it com.apple.boot.plist on APM since Tiger
+// (since Tiger bless scribbles on com.apple.Boot.plist)
+static void
+useAPMBootPlistName(char *dstpath)
+{
+    char * plistNamePtr;
+
+    COMPILE_TIME_ASSERT(sizeof(BOOTPLIST_NAME)==sizeof(BOOTPLIST_APM_NAME));
+    plistNamePtr = strstr(dstpath, BOOTPLIST_NAME);
+    if (plistNamePtr) {
+        strncpy(plistNamePtr, BOOTPLIST_APM_NAME, strlen(BOOTPLIST_NAME));
+    }
+}
+
+/*
+ * rpsIsCurrent() - does the active RPS directory already hold exactly
+ * what ucopyRPS() would copy?  Only for the default (rotating) layout.
+ */
+static Boolean
+rpsIsCurrent(struct updatingVol *up, const char *curRPS)
+{
+    Boolean rval = false;
+    unsigned i;
+    char srcpath[PATH_MAX], curpath[PATH_MAX];
+    srcDigest digest;
+    off_t size;
+    struct stat sb;
+#if DEV_KERNEL_SUPPORT
+    CFStringRef my_kcsuffix = NULL;     // must release
+
+    // the preferred-kernelcache layout is always copied
+    my_kcsuffix = copy_kcsuffix();
+    if (up->caches->extraKernelCachePaths && my_kcsuffix)   goto finish;
+#endif
+
+    if (up->opts & kBRUForceUpdateHelpers)              goto finish;
+    if (up->flatTarget[0] || up->useOnceDir)            goto finish;
+
+    for (i = 0; i < up->caches->nrps; i++) {
+        cachedPath *curItem = &up->caches->rpspaths[i];
+
+        pathcpy(srcpath, up->caches->root);
+        pathcat(srcpath, curItem->rpath);
+        pathcpy(curpath, curRPS);
+        pathcat(curpath, curItem->rpath);
+        if (curItem == up->caches->bootconfig && up->onAPM) {
+            useAPMBootPlistName(curpath);
+        }
+
+        if (digestRPSItem(up, curItem, srcpath, digest, &size)) {
+            // erpropcache, efiloccache are optional (see ucopyRPS)
+            if (errno == ENOENT &&
+                    (curItem == up->caches->erpropcache ||
+                     curItem == up->caches->efiloccache) &&
+                    stat(curpath, &sb) == -1 && errno == ENOENT) {
+                continue;
+            }
+            goto finish;
+        }
+        if (!helperItemMatches(up, curpath, digest, size))  goto finish;
+    }
+
+    rval = true;
+
+finish:
+#if DEV_KERNEL_SUPPORT
+    SAFE_RELEASE(my_kcsuffix);
+#endif
+    return rval;
+}
+
 /* 
  * ucopyRPS - copy new RPS directory to "inactive" location
  * bails on any error because only a whole RPS dir makes sense
@@ -2387,7 +3388,9 @@ ucopyRPS(struct updatingVol *up)
     CFStringRef my_kcsuffix     = NULL;     // must release
     Boolean copiedPrefKernel    = false;
 #endif
-    COMPILE_TIME_ASSERT(sizeof(BOOTPLIST_NAME)==sizeof(BOOTPLIST_APM_NAME));
+    srcDigest digest;
+    off_t size;
+    Boolean haveDigest;
     
     
     OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
@@ -2397,6 +3400,15 @@ ucopyRPS(struct updatingVol *up)
         rval = bsderr; goto finish;     // error logged by function
     }
 
+    // nothing changed -> activateRPS() will find dstdir already current
+    if (rpsIsCurrent(up, curRPS)) {
+        OSKextLog(NULL, kOSKextLogGeneralFlag|kOSKextLogDetailLevel,
+                  "%s is up to date; not copying.", curRPS);
+        pathcpy(up->dstdir, curRPS);
+        rval = 0;
+        goto finish;
+    }
+
     if (up->flatTarget[0] || up->useOnceDir) {
         // copy desired target into dstdir
         pathcpy(up->dstdir, up->curMount);
@@ -2494,17 +3506,13 @@ ucopyRPS(struct updatingVol *up)
             pathcat(dstpath, curItem->rpath);
         }
 
+        // digest the source before copying so a racing change isn't missed
+        haveDigest = (digestRPSItem(up, curItem, srcpath, digest, &size) == 0);
+
         // check for special files; first Boot.plist
         if (curItem == up->caches->bootconfig) {
-            // PR-5115900 - call it com.apple.boot.plist on APM since Tiger
-            // (since Tiger bless scribbles on com.apple.Boot.plist)
             if (up->onAPM) {
-                char * plistNamePtr;
-                // see assert above
-                plistNamePtr = strstr(dstpath, BOOTPLIST_NAME);
-                if (plistNamePtr) {
-                    strncpy(plistNamePtr, BOOTPLIST_APM_NAME, strlen(BOOTPLIST_NAME));
-                }
+                useAPMBootPlistName(dstpath);
             }
             // write customized com.apple.Boot.plist data
             if ((bsderr = writeBootPrefs(up, dstpath))) {
@@ -2539,6 +3547,10 @@ ucopyRPS(struct updatingVol *up)
                 }
             }
         }
+
+        if (haveDigest) {
+            tagHelperItem(up, dstpath, digest);
+        }
     }
 
     // XX EFI is happier if there is a SystemVersion.plist it can find
@@ -2588,20 +3600,38 @@ ucopyMisc(struct updatingVol *up)
 {
     int bsderr, rval = -1;
     unsigned i, nprocessed = 0;
-    char srcpath[PATH_MAX], dstpath[PATH_MAX];
+    char srcpath[PATH_MAX], dstpath[PATH_MAX], curpath[PATH_MAX];
     struct stat sb;
+    srcDigest digest;
+    off_t size;
+    Boolean haveDigest;
 
     OSKextLog(NULL, kOSKextLogDetailLevel | kOSKextLogGeneralFlag,
               "Copying files read before the booter runs.");
    
     for (i = 0; i < up->caches->nmisc; i++) {
+        cachedPath *curItem = &up->caches->miscpaths[i];
+
         pathcpy(srcpath, up->caches->root);
-        pathcat(srcpath, up->caches->miscpaths[i].rpath);
-        makebootpath(dstpath, up->caches->miscpaths[i].rpath);
+        pathcat(srcpath, curItem->rpath);
+        makebootpath(curpath, curItem->rpath);
+        pathcpy(dstpath, curpath);
         pathcat(dstpath, ".new");
 
         if (stat(srcpath, &sb) == 0) { 
             // file exists and is accessible
+            haveDigest = (digestSourceFile(srcpath, digest, &size) == 0);
+
+            // unchanged since the last copy? (nukeBRLabels() takes the label)
+            if (haveDigest && curItem != up->caches->label &&
+                    !(up->opts & kBRUForceUpdateHelpers) &&
+                    helperItemMatches(up, curpath, digest, size)) {
+                // activateMisc() mustn't find a leftover .new
+                (void)sunlink(up->curbootfd, dstpath);
+                nprocessed++;
+                continue;
+            }
+
             if ((bsderr = scopyitem(up->caches->cachefd, srcpath,
                                     up->curbootfd, dstpath))) {
                 if (bsderr == -1)  bsderr = errno;
@@ -2609,6 +3639,9 @@ ucopyMisc(struct updatingVol *up)
                           bsderr, srcpath, dstpath, strerror(bsderr));
                 continue;
             }
+            if (haveDigest) {
+                tagHelperItem(up, dstpath, digest);     // rename keeps it
+            }
         } else if (errno != ENOENT) {
             continue;
         }